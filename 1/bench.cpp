@@ -0,0 +1,405 @@
+#include "libcoro.h"
+#include "bench.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static void
+bench_report(const char *name, std::vector<double> &times)
+{
+	bench_report(name, "ns", times.data(), (int)times.size());
+}
+
+/**
+ * Each run gets a fresh engine so the pool is empty in the
+ * beginning. That allows to measure spawn of brand new coroutines
+ * separately from the pooled ones.
+ */
+static double
+bench_run_in_threads(coro_f func, void *arg, int thread_count)
+{
+	coro_sched_init();
+	coro_sched_set_thread_count(thread_count);
+	struct coro *main_coro = coro_new(func, arg);
+	coro_sched_run();
+	double *res = (double *)coro_join(main_coro);
+	coro_sched_destroy();
+	return *res;
+}
+
+static double
+bench_run_in_engine(coro_f func, void *arg)
+{
+	return bench_run_in_threads(func, arg, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+struct bench_spawn_ctx {
+	int count;
+	double result;
+};
+
+static void *
+bench_spawn_new_f(void *arg)
+{
+	struct bench_spawn_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct coro *> coros(ctx->count);
+	uint64_t start = bench_clock_ns();
+	for (int i = 0; i < ctx->count; ++i)
+		coros[i] = coro_new(bench_empty_f, NULL);
+	uint64_t duration = bench_clock_ns() - start;
+	for (int i = 0; i < ctx->count; ++i)
+		coro_join(coros[i]);
+	ctx->result = (double)duration / ctx->count;
+	return &ctx->result;
+}
+
+static void *
+bench_spawn_join_f(void *arg)
+{
+	struct bench_spawn_ctx *ctx = (decltype(ctx))arg;
+	/* Warm up the pool. */
+	coro_join(coro_new(bench_empty_f, NULL));
+	uint64_t start = bench_clock_ns();
+	for (int i = 0; i < ctx->count; ++i)
+		coro_join(coro_new(bench_empty_f, NULL));
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / ctx->count;
+	return &ctx->result;
+}
+
+static void
+bench_spawn(void)
+{
+	struct bench_spawn_ctx ctx;
+	std::vector<double> times;
+
+	ctx.count = 10000;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_spawn_new_f, &ctx));
+	bench_report("Spawn a new coroutine, per coro_new()", times);
+
+	times.clear();
+	ctx.count = 1000000;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_spawn_join_f, &ctx));
+	bench_report("Spawn + join a pooled coroutine, per pair", times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_fan_ctx {
+	int width;
+	int round_count;
+	double result;
+};
+
+static void *
+bench_fan_out_f(void *arg)
+{
+	struct bench_fan_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct coro *> coros(ctx->width);
+	uint64_t start = bench_clock_ns();
+	for (int r = 0; r < ctx->round_count; ++r) {
+		for (int i = 0; i < ctx->width; ++i)
+			coros[i] = coro_new(bench_empty_f, NULL);
+		for (int i = 0; i < ctx->width; ++i)
+			coro_join(coros[i]);
+	}
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / (ctx->round_count * ctx->width);
+	return &ctx->result;
+}
+
+static void *
+bench_fan_out_group_f(void *arg)
+{
+	struct bench_fan_ctx *ctx = (decltype(ctx))arg;
+	std::vector<coro_f> funcs(ctx->width, bench_empty_f);
+	std::vector<void *> args(ctx->width, NULL);
+	uint64_t start = bench_clock_ns();
+	for (int r = 0; r < ctx->round_count; ++r) {
+		coro_group_join(coro_spawn_group(funcs.data(), args.data(),
+			ctx->width), NULL);
+	}
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / (ctx->round_count * ctx->width);
+	return &ctx->result;
+}
+
+static void
+bench_fan_out(void)
+{
+	struct bench_fan_ctx ctx;
+	ctx.width = 100;
+	ctx.round_count = 10000;
+	std::vector<double> times;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_fan_out_f, &ctx));
+	bench_report("Spawn 100, join 100, per coroutine", times);
+
+	times.clear();
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_fan_out_group_f, &ctx));
+	bench_report("Spawn + join a group of 100, per coroutine", times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_switch_ctx {
+	int coro_count;
+	int yield_count;
+	double result;
+};
+
+static void *
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+bench_switch_f(void *arg)
+{
+	struct bench_switch_ctx *ctx = (decltype(ctx))arg;
+	struct coro *c1 = coro_new(bench_yield_f, &ctx->yield_count);
+	struct coro *c2 = coro_new(bench_yield_f, &ctx->yield_count);
+	/* Let them both get started before the measurement. */
+	coro_yield();
+	uint64_t start = bench_clock_ns();
+	coro_join(c1);
+	coro_join(c2);
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / (2.0 * ctx->yield_count);
+	return &ctx->result;
+}
+
+static void
+bench_switch(void)
+{
+	struct bench_switch_ctx ctx;
+	ctx.yield_count = 5000000;
+	std::vector<double> times;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_switch_f, &ctx));
+	bench_report("Yield ping-pong of 2 coroutines, per coro_yield()", times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_wakeup_ctx {
+	int waiter_count;
+	int round_count;
+	bool is_done;
+	double result;
+};
+
+static void *
+bench_waiter_f(void *arg)
+{
+	struct bench_wakeup_ctx *ctx = (decltype(ctx))arg;
+	while (!ctx->is_done)
+		coro_suspend();
+	return NULL;
+}
+
+static void *
+bench_wakeup_f(void *arg)
+{
+	struct bench_wakeup_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct coro *> coros(ctx->waiter_count);
+	ctx->is_done = false;
+	for (int i = 0; i < ctx->waiter_count; ++i)
+		coros[i] = coro_new(bench_waiter_f, ctx);
+	/* Let them all suspend. */
+	coro_yield();
+	uint64_t start = bench_clock_ns();
+	for (int r = 0; r < ctx->round_count; ++r) {
+		for (int i = 0; i < ctx->waiter_count; ++i)
+			coro_wakeup(coros[i]);
+		coro_yield();
+	}
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->is_done = true;
+	for (int i = 0; i < ctx->waiter_count; ++i) {
+		coro_wakeup(coros[i]);
+		coro_join(coros[i]);
+	}
+	ctx->result = (double)duration / (ctx->round_count * ctx->waiter_count);
+	return &ctx->result;
+}
+
+static void
+bench_wakeup(void)
+{
+	struct bench_wakeup_ctx ctx;
+	ctx.waiter_count = 100;
+	ctx.round_count = 20000;
+	std::vector<double> times;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_engine(bench_wakeup_f, &ctx));
+	bench_report("Wakeup of 100 suspended coroutines, per wakeup + resume",
+		times);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_many_yield_f(void *arg)
+{
+	struct bench_switch_ctx *ctx = (decltype(ctx))arg;
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	/* Small stacks to fit 100K coroutines into the memory. */
+	attr.stack_size = 16 * 1024;
+	std::vector<struct coro *> coros(ctx->coro_count);
+	for (int i = 0; i < ctx->coro_count; ++i) {
+		coros[i] = coro_new_ex(bench_yield_f, &ctx->yield_count,
+			&attr);
+	}
+	coro_yield();
+	uint64_t start = bench_clock_ns();
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / ((double)ctx->coro_count *
+		ctx->yield_count);
+	return &ctx->result;
+}
+
+/**
+ * Each stack takes 2 mappings because of its guard page. The
+ * kernel limits their number per process.
+ */
+static long
+bench_max_map_count(void)
+{
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f == NULL)
+		return -1;
+	long res = -1;
+	if (fscanf(f, "%ld", &res) != 1)
+		res = -1;
+	fclose(f);
+	return res;
+}
+
+static void
+bench_many_runnable(void)
+{
+	long max_map_count = bench_max_map_count();
+	struct bench_switch_ctx ctx;
+	std::vector<double> times;
+	int counts[] = {10000, 100000};
+	for (int count : counts) {
+		if (max_map_count >= 0 && max_map_count < 2L * count + 1000) {
+			printf("Yield among %d runnable coroutines - skipped, "
+				"needs vm.max_map_count >= %ld\n", count,
+				2L * count + 1000);
+			continue;
+		}
+		ctx.coro_count = count;
+		ctx.yield_count = 2000000 / count;
+		times.clear();
+		for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+			times.push_back(bench_run_in_engine(bench_many_yield_f,
+				&ctx));
+		}
+		char name[128];
+		snprintf(name, sizeof(name), "Yield among %d runnable "
+			"coroutines, per coro_yield()", count);
+		bench_report(name, times);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_mt_ctx {
+	int coro_count;
+	int chunk_count;
+	double result;
+};
+
+static void *
+bench_mt_work_f(void *arg)
+{
+	int chunk_count = *(int *)arg;
+	volatile uint64_t sum = 0;
+	for (int i = 0; i < chunk_count; ++i) {
+		for (int j = 0; j < 100000; ++j)
+			sum = sum + j * j;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_mt_f(void *arg)
+{
+	struct bench_mt_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct coro *> coros(ctx->coro_count);
+	uint64_t start = bench_clock_ns();
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coros[i] = coro_new(bench_mt_work_f, &ctx->chunk_count);
+	for (int i = 0; i < ctx->coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_clock_ns() - start;
+	ctx->result = (double)duration / (ctx->coro_count * ctx->chunk_count);
+	return &ctx->result;
+}
+
+static void
+bench_mt_in_threads(struct bench_mt_ctx *ctx, int thread_count)
+{
+	std::vector<double> times;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times.push_back(bench_run_in_threads(bench_mt_f, ctx, thread_count));
+	char name[128];
+	snprintf(name, sizeof(name), "CPU-bound coroutines in %d threads, "
+		"per 100K iterations chunk", thread_count);
+	bench_report(name, times);
+}
+
+static void
+bench_mt(void)
+{
+	struct bench_mt_ctx ctx;
+	ctx.coro_count = 64;
+	ctx.chunk_count = 50;
+	int cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count < 1)
+		cpu_count = 1;
+	/* Powers of 2 and then all the CPUs. */
+	int thread_count = 1;
+	for (; thread_count < cpu_count; thread_count *= 2)
+		bench_mt_in_threads(&ctx, thread_count);
+	bench_mt_in_threads(&ctx, cpu_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	bench_spawn();
+	bench_fan_out();
+	bench_switch();
+	bench_wakeup();
+	bench_many_runnable();
+	bench_mt();
+	return 0;
+}
@@ -0,0 +1,471 @@
+#include "corobus.h"
+#include "coro_channel.h"
+#include "libcoro.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+bench_switch_count(void)
+{
+	struct coro_sched_stats stats;
+	coro_sched_stats(&stats);
+	return stats.switch_count;
+}
+
+/** How the control messages get through the bulk ones. */
+enum bench_control_mode {
+	/* Queued after the bulk in the same channel. */
+	BENCH_CONTROL_QUEUED,
+	BENCH_CONTROL_EXPEDITED,
+	/* A channel of a higher priority, coro_bus_select_weighted(). */
+	BENCH_CONTROL_PRIORITY,
+};
+
+struct bench_bus_ctx {
+	/* Parameters. */
+	int size_limit;
+	int batch_size;
+	int channel_count;
+	int producer_count;
+	int message_count;
+	enum bench_control_mode control_mode;
+	/* State of a run. */
+	struct coro_bus *bus;
+	std::vector<int> channels;
+	/* Per message. */
+	double result_ns;
+	double result_switches;
+};
+
+static void
+bench_bus_report(const char *name, std::vector<double> &times,
+	std::vector<double> &switches)
+{
+	std::sort(times.begin(), times.end());
+	std::sort(switches.begin(), switches.end());
+	printf("%s\n", name);
+	printf("    min: %.2lf ns\n", times.front());
+	printf("    med: %.2lf ns\n", times[times.size() / 2]);
+	printf("    max: %.2lf ns\n", times.back());
+	/* Only counted with LIBCORO_STATS. */
+	if (switches.back() > 0) {
+		printf("    switches: %.2lf\n",
+			switches[switches.size() / 2]);
+	}
+}
+
+/**
+ * Each run gets a fresh engine and bus. The function measures
+ * itself, excluding the setup, and divides by the messages it
+ * passed.
+ */
+static void
+bench_bus_run(const char *name, coro_f func, struct bench_bus_ctx *ctx)
+{
+	std::vector<double> times;
+	std::vector<double> switches;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+		coro_sched_init();
+		ctx->bus = coro_bus_new();
+		ctx->channels.resize(ctx->channel_count);
+		for (int j = 0; j < ctx->channel_count; ++j) {
+			ctx->channels[j] = coro_bus_channel_open(ctx->bus,
+				ctx->size_limit);
+		}
+		struct coro *main_coro = coro_new(func, ctx);
+		coro_sched_run();
+		coro_join(main_coro);
+		coro_bus_delete(ctx->bus);
+		coro_sched_destroy();
+		times.push_back(ctx->result_ns);
+		switches.push_back(ctx->result_switches);
+	}
+	bench_bus_report(name, times, switches);
+}
+
+static void
+bench_bus_finish(struct bench_bus_ctx *ctx, uint64_t start_ns,
+	uint64_t start_switches, int message_count)
+{
+	ctx->result_ns = (double)(bench_now_ns() - start_ns) / message_count;
+	ctx->result_switches = (double)(bench_switch_count() -
+		start_switches) / message_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_send_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	int count = ctx->message_count / ctx->producer_count;
+	for (int i = 0; i < count; ++i)
+		coro_bus_send(ctx->bus, ctx->channels[0], i);
+	return NULL;
+}
+
+static void *
+bench_send_recv_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct coro *> coros(ctx->producer_count);
+	int count = ctx->message_count / ctx->producer_count *
+		ctx->producer_count;
+	uint64_t start_switches = bench_switch_count();
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < ctx->producer_count; ++i)
+		coros[i] = coro_new(bench_send_f, ctx);
+	unsigned data;
+	for (int i = 0; i < count; ++i)
+		coro_bus_recv(ctx->bus, ctx->channels[0], &data);
+	bench_bus_finish(ctx, start, start_switches, count);
+	for (int i = 0; i < ctx->producer_count; ++i)
+		coro_join(coros[i]);
+	return NULL;
+}
+
+static void
+bench_send_recv(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.channel_count = 1;
+	ctx.producer_count = 1;
+	ctx.message_count = 1000000;
+	ctx.size_limit = 64;
+	bench_bus_run("Send + recv, 1 producer, size limit 64, per message",
+		bench_send_recv_f, &ctx);
+
+	ctx.producer_count = 8;
+	int size_limits[] = {1, 16, 256, 4096};
+	for (int size_limit : size_limits) {
+		ctx.size_limit = size_limit;
+		char name[128];
+		snprintf(name, sizeof(name), "Send + recv, %d producers, size "
+			"limit %d, per message", ctx.producer_count, size_limit);
+		bench_bus_run(name, bench_send_recv_f, &ctx);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef coro_channel<unsigned, 64> bench_channel;
+
+static void *
+bench_channel_send_f(void *arg)
+{
+	bench_channel *channel = (decltype(channel))arg;
+	for (unsigned i = 0; i < 1000000; ++i)
+		channel->send(i);
+	return NULL;
+}
+
+/** The same as the 1 producer send + recv, without the bus. */
+static void *
+bench_channel_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	bench_channel channel;
+	uint64_t start_switches = bench_switch_count();
+	uint64_t start = bench_now_ns();
+	struct coro *sender = coro_new(bench_channel_send_f, &channel);
+	unsigned data;
+	for (int i = 0; i < 1000000; ++i)
+		channel.recv(data);
+	bench_bus_finish(ctx, start, start_switches, 1000000);
+	coro_join(sender);
+	return NULL;
+}
+
+static void
+bench_channel_template(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.channel_count = 0;
+	ctx.size_limit = 0;
+	bench_bus_run("coro_channel send + recv, 1 producer, capacity 64, "
+		"per message", bench_channel_f, &ctx);
+}
+
+static void *
+bench_send_v_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	std::vector<unsigned> data(ctx->batch_size, 0);
+	int count = ctx->message_count;
+	while (count > 0) {
+		int rc = coro_bus_send_v(ctx->bus, ctx->channels[0],
+			data.data(), std::min(count, ctx->batch_size));
+		if (rc < 0)
+			break;
+		count -= rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_batch_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	std::vector<unsigned> data(ctx->batch_size);
+	uint64_t start_switches = bench_switch_count();
+	uint64_t start = bench_now_ns();
+	struct coro *producer = coro_new(bench_send_v_f, ctx);
+	int count = ctx->message_count;
+	while (count > 0) {
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channels[0],
+			data.data(), ctx->batch_size);
+		if (rc < 0)
+			break;
+		count -= rc;
+	}
+	bench_bus_finish(ctx, start, start_switches, ctx->message_count);
+	coro_join(producer);
+	return NULL;
+}
+
+static void
+bench_batch(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.channel_count = 1;
+	ctx.producer_count = 1;
+	ctx.message_count = 2000000;
+	ctx.size_limit = 4096;
+	for (int batch_size = 1; batch_size <= 4096; batch_size *= 4) {
+		ctx.batch_size = batch_size;
+		char name[128];
+		snprintf(name, sizeof(name), "Send_v + recv_v, batch %d, size "
+			"limit %d, per message", batch_size, ctx.size_limit);
+		bench_bus_run(name, bench_batch_f, &ctx);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_broadcast_recv_ctx {
+	struct bench_bus_ctx *bus_ctx;
+	int channel;
+};
+
+static void *
+bench_broadcast_recv_f(void *arg)
+{
+	struct bench_broadcast_recv_ctx *ctx = (decltype(ctx))arg;
+	struct bench_bus_ctx *bus_ctx = ctx->bus_ctx;
+	unsigned data;
+	for (int i = 0; i < bus_ctx->message_count; ++i)
+		coro_bus_recv(bus_ctx->bus, ctx->channel, &data);
+	return NULL;
+}
+
+static void *
+bench_broadcast_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	std::vector<struct bench_broadcast_recv_ctx> recv_ctxs(
+		ctx->channel_count);
+	std::vector<struct coro *> coros(ctx->channel_count);
+	for (int i = 0; i < ctx->channel_count; ++i) {
+		recv_ctxs[i].bus_ctx = ctx;
+		recv_ctxs[i].channel = ctx->channels[i];
+		coros[i] = coro_new(bench_broadcast_recv_f, &recv_ctxs[i]);
+	}
+	/* Let the receivers start waiting. */
+	coro_yield();
+	uint64_t start_switches = bench_switch_count();
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < ctx->message_count; ++i)
+		coro_bus_broadcast(ctx->bus, i);
+	for (int i = 0; i < ctx->channel_count; ++i)
+		coro_join(coros[i]);
+	bench_bus_finish(ctx, start, start_switches,
+		ctx->message_count * ctx->channel_count);
+	return NULL;
+}
+
+static void
+bench_broadcast(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.producer_count = 1;
+	ctx.size_limit = 64;
+	int channel_counts[] = {1, 10, 100, 1000};
+	for (int channel_count : channel_counts) {
+		ctx.channel_count = channel_count;
+		ctx.message_count = 1000000 / channel_count;
+		char name[128];
+		snprintf(name, sizeof(name), "Broadcast to %d channels, size "
+			"limit %d, per delivered message", channel_count,
+			ctx.size_limit);
+		bench_bus_run(name, bench_broadcast_f, &ctx);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	BENCH_CONTROL_COUNT = 1000,
+	/* Yields of the control sender between its messages. */
+	BENCH_CONTROL_INTERVAL = 64,
+};
+
+/* Marks the control messages among the bulk ones. */
+static const unsigned BENCH_CONTROL_FLAG = 1u << 31;
+
+struct bench_control_ctx {
+	struct bench_bus_ctx *bus_ctx;
+	uint64_t sent_ns[BENCH_CONTROL_COUNT];
+};
+
+static void *
+bench_bulk_send_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->message_count; ++i)
+		coro_bus_send(ctx->bus, ctx->channels[0], i);
+	return NULL;
+}
+
+static void *
+bench_control_send_f(void *arg)
+{
+	struct bench_control_ctx *ctx = (decltype(ctx))arg;
+	struct bench_bus_ctx *bus_ctx = ctx->bus_ctx;
+	for (unsigned i = 0; i < BENCH_CONTROL_COUNT; ++i) {
+		for (int j = 0; j < BENCH_CONTROL_INTERVAL; ++j)
+			coro_yield();
+		ctx->sent_ns[i] = bench_now_ns();
+		unsigned data = BENCH_CONTROL_FLAG | i;
+		switch (bus_ctx->control_mode) {
+		case BENCH_CONTROL_QUEUED:
+			coro_bus_send(bus_ctx->bus, bus_ctx->channels[0], data);
+			break;
+		case BENCH_CONTROL_EXPEDITED:
+			coro_bus_send_expedited(bus_ctx->bus,
+				bus_ctx->channels[0], data);
+			break;
+		case BENCH_CONTROL_PRIORITY:
+			coro_bus_send(bus_ctx->bus, bus_ctx->channels[1], data);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/** The result is the average delay of a control message. */
+static void *
+bench_control_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	struct bench_control_ctx control_ctx;
+	control_ctx.bus_ctx = ctx;
+	coro_bus_channel_set_priority(ctx->bus, ctx->channels[1], 1, 1);
+	struct coro *bulk = coro_new(bench_bulk_send_f, ctx);
+	struct coro *control = coro_new(bench_control_send_f, &control_ctx);
+	uint64_t start_switches = bench_switch_count();
+	uint64_t delay_ns = 0;
+	int total = ctx->message_count + BENCH_CONTROL_COUNT;
+	for (int i = 0; i < total; ++i) {
+		unsigned data;
+		int which;
+		if (ctx->control_mode == BENCH_CONTROL_PRIORITY) {
+			coro_bus_select_weighted(ctx->bus, ctx->channels.data(),
+				2, &data, &which);
+		} else {
+			coro_bus_recv(ctx->bus, ctx->channels[0], &data);
+		}
+		if ((data & BENCH_CONTROL_FLAG) != 0) {
+			delay_ns += bench_now_ns() -
+				control_ctx.sent_ns[data & ~BENCH_CONTROL_FLAG];
+		}
+	}
+	ctx->result_ns = (double)delay_ns / BENCH_CONTROL_COUNT;
+	ctx->result_switches = (double)(bench_switch_count() -
+		start_switches) / total;
+	coro_join(bulk);
+	coro_join(control);
+	return NULL;
+}
+
+static void
+bench_control(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.channel_count = 2;
+	ctx.producer_count = 1;
+	ctx.message_count = 1000000;
+	ctx.size_limit = 4096;
+	struct {
+		enum bench_control_mode mode;
+		const char *name;
+	} modes[] = {
+		{BENCH_CONTROL_QUEUED, "queued"},
+		{BENCH_CONTROL_EXPEDITED, "expedited"},
+		{BENCH_CONTROL_PRIORITY, "priority channel"},
+	};
+	for (const auto &mode : modes) {
+		ctx.control_mode = mode.mode;
+		char name[128];
+		snprintf(name, sizeof(name), "Control message delay under bulk "
+			"load, size limit %d, %s", ctx.size_limit, mode.name);
+		bench_bus_run(name, bench_control_f, &ctx);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_open_close_f(void *arg)
+{
+	struct bench_bus_ctx *ctx = (decltype(ctx))arg;
+	uint64_t start_switches = bench_switch_count();
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < ctx->message_count; ++i) {
+		int channel = coro_bus_channel_open(ctx->bus, ctx->size_limit);
+		coro_bus_send(ctx->bus, channel, i);
+		coro_bus_channel_close(ctx->bus, channel);
+	}
+	bench_bus_finish(ctx, start, start_switches, ctx->message_count);
+	return NULL;
+}
+
+static void
+bench_open_close(void)
+{
+	struct bench_bus_ctx ctx;
+	ctx.channel_count = 0;
+	ctx.message_count = 1000000;
+	ctx.size_limit = 64;
+	bench_bus_run("Open + send + close a channel, size limit 64, per "
+		"channel", bench_open_close_f, &ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	bench_send_recv();
+	bench_channel_template();
+	bench_batch();
+	bench_broadcast();
+	bench_control();
+	bench_open_close();
+	return 0;
+}
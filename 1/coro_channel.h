@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "libcoro.h"
+#include "rlist.h"
+
+/** Result of the operations of coro_channel. */
+enum coro_channel_status {
+	CORO_CHANNEL_OK,
+	/** The channel is full for a send or empty for a receive. */
+	CORO_CHANNEL_WOULD_BLOCK,
+	/** Closed, and for a receive also empty. */
+	CORO_CHANNEL_CLOSED,
+	/** The waiting coroutine is cancelled. */
+	CORO_CHANNEL_CANCELLED,
+};
+
+/**
+ * Channel between the coroutines of one thread, for the C++ code which owns
+ * it directly instead of through a coro_bus descriptor:
+ *
+ *     coro_channel<request *, 64> requests;
+ *     ...
+ *     if (requests.send(req) != CORO_CHANNEL_OK)
+ *
+ * The capacity is a power of 2 known at compile time, so the positions wrap
+ * with a constant mask, and the messages are of type T, moved in and out.
+ * There is no lookup, no errno and no allocation: a send or a receive which
+ * doesn't wait is a few instructions inline. A message for a waiting receiver
+ * goes right into its variable, as in corobus.
+ *
+ * Closing fails the sends and wakes up all the waiters. The messages already
+ * in the channel can still be received, then the receives fail. The destructor
+ * closes the channel, so the waiters must not touch it after a failure.
+ */
+template<typename T, std::size_t Capacity>
+class coro_channel
+{
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+		      "The capacity must be a power of 2");
+
+public:
+	coro_channel()
+	{
+		rlist_create(&m_send_waiters);
+		rlist_create(&m_recv_waiters);
+	}
+
+	~coro_channel()
+	{
+		close();
+		while (m_head != m_tail)
+			m_slots[m_head++ & MASK].value.~T();
+	}
+
+	coro_channel(const coro_channel &) = delete;
+	coro_channel &
+	operator=(const coro_channel &) = delete;
+
+	static constexpr std::size_t
+	capacity() { return Capacity; }
+
+	std::size_t
+	size() const { return m_tail - m_head; }
+
+	bool
+	is_closed() const { return m_is_closed; }
+
+	/** The value is moved only on success. */
+	coro_channel_status
+	try_send(T &value)
+	{
+		if (m_is_closed)
+			return CORO_CHANNEL_CLOSED;
+		// Receivers wait only while the channel is empty.
+		if (!rlist_empty(&m_recv_waiters)) {
+			waiter *w = rlist_first_entry(&m_recv_waiters, waiter, link);
+			rlist_del_entry(w, link);
+			*w->slot = std::move(value);
+			w->is_done = true;
+			coro_wakeup(w->coroutine);
+			return CORO_CHANNEL_OK;
+		}
+		if (m_tail - m_head == Capacity)
+			return CORO_CHANNEL_WOULD_BLOCK;
+		new (&m_slots[m_tail++ & MASK].value) T(std::move(value));
+		return CORO_CHANNEL_OK;
+	}
+
+	coro_channel_status
+	try_send(T &&value) { return try_send(value); }
+
+	coro_channel_status
+	send(T &value)
+	{
+		while (true) {
+			coro_channel_status status = try_send(value);
+			if (status != CORO_CHANNEL_WOULD_BLOCK)
+				return status;
+			waiter w;
+			if (!wait(&m_send_waiters, &w))
+				return CORO_CHANNEL_CANCELLED;
+			if (w.is_closed)
+				return CORO_CHANNEL_CLOSED;
+		}
+	}
+
+	coro_channel_status
+	send(T &&value) { return send(value); }
+
+	coro_channel_status
+	try_recv(T &value)
+	{
+		if (m_head == m_tail)
+			return m_is_closed ? CORO_CHANNEL_CLOSED : CORO_CHANNEL_WOULD_BLOCK;
+		T &slot = m_slots[m_head++ & MASK].value;
+		value = std::move(slot);
+		slot.~T();
+		if (!rlist_empty(&m_send_waiters))
+			wakeup_first(&m_send_waiters);
+		return CORO_CHANNEL_OK;
+	}
+
+	coro_channel_status
+	recv(T &value)
+	{
+		while (true) {
+			coro_channel_status status = try_recv(value);
+			if (status != CORO_CHANNEL_WOULD_BLOCK)
+				return status;
+			waiter w;
+			w.slot = &value;
+			bool is_woken = wait(&m_recv_waiters, &w);
+			// A handed over message is received even if cancelled,
+			// or it would be lost.
+			if (w.is_done)
+				return CORO_CHANNEL_OK;
+			if (!is_woken)
+				return CORO_CHANNEL_CANCELLED;
+			if (w.is_closed)
+				return CORO_CHANNEL_CLOSED;
+		}
+	}
+
+	void
+	close()
+	{
+		m_is_closed = true;
+		mark_closed(&m_send_waiters);
+		mark_closed(&m_recv_waiters);
+		while (!rlist_empty(&m_send_waiters))
+			wakeup_first(&m_send_waiters);
+		while (!rlist_empty(&m_recv_waiters))
+			wakeup_first(&m_recv_waiters);
+	}
+
+private:
+	static constexpr std::size_t MASK = Capacity - 1;
+
+	struct waiter {
+		rlist link;
+		struct coro *coroutine = nullptr;
+		/** A receiver's variable for a handed over message. */
+		T *slot = nullptr;
+		bool is_done = false;
+		/** The channel can't be touched after the wakeup. */
+		bool is_closed = false;
+	};
+
+	/** The storage of a message, constructed only while in the channel. */
+	union slot_storage {
+		slot_storage() {}
+		~slot_storage() {}
+		T value;
+	};
+
+	static void
+	wakeup_first(rlist *waiters)
+	{
+		waiter *w = rlist_first_entry(waiters, waiter, link);
+		rlist_del_entry(w, link);
+		coro_wakeup(w->coroutine);
+	}
+
+	static void
+	mark_closed(rlist *waiters)
+	{
+		waiter *w;
+		rlist_foreach_entry(w, waiters, link)
+			w->is_closed = true;
+	}
+
+	/**
+	 * False if cancelled, before or during the wait. Then the waiter is
+	 * out of the queue, and if a waker has already popped it, the wakeup
+	 * is passed on to the next waiter.
+	 */
+	static bool
+	wait(rlist *waiters, waiter *w)
+	{
+		if (coro_is_cancelled())
+			return false;
+		w->coroutine = coro_this();
+		rlist_add_tail_entry(waiters, w, link);
+		coro_suspend();
+		if (!rlist_empty(&w->link)) {
+			rlist_del_entry(w, link);
+		} else if (coro_is_cancelled() && !w->is_done && !w->is_closed &&
+			   !rlist_empty(waiters)) {
+			wakeup_first(waiters);
+		}
+		return !coro_is_cancelled();
+	}
+
+	std::size_t m_head = 0;
+	std::size_t m_tail = 0;
+	bool m_is_closed = false;
+	rlist m_send_waiters;
+	rlist m_recv_waiters;
+	slot_storage m_slots[Capacity];
+};
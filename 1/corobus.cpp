@@ -1,76 +1,736 @@
 #include "corobus.h"
 
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <deque>
+#include <ctime>
+#include <new>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
 
 #include "libcoro.h"
 #include "rlist.h"
+#include "ring.h"
+#include "rlistpp.h"
+#include "trace.h"
+
+#ifndef CORO_BUS_BROADCAST_LOG
+#define CORO_BUS_BROADCAST_LOG 1
+#endif
+
+static std::uint64_t bus_clock_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + static_cast<std::uint64_t>(ts.tv_nsec);
+}
 
 struct wakeup_entry {
     rlist base;
     coro *coroutine;
+    // A waiting receiver can get a message right from a sender into
+    // here, bypassing the channel queue. nullptr for the others.
+    unsigned *slot;
+    // How many messages or slots the waiter can take at once. A batch
+    // waiter is woken once for the whole range. 0 is the same as 1.
+    std::size_t want;
+    bool is_done;
+    // The queue is deleted, can't be touched after the wakeup.
+    bool is_closed;
+    std::uint64_t wait_start_ns;
 };
 
+using wakeup_list = intrusive_list<wakeup_entry, &wakeup_entry::base>;
+
 struct wakeup_queue {
     rlist coroutines;
+    std::uint64_t wait_count = 0;
+    std::uint64_t wait_ns = 0;
 };
 
 static void wakeup_queue_init(wakeup_queue *queue) {
     rlist_create(&queue->coroutines);
 }
 
-static void wakeup_queue_suspend_this(wakeup_queue *queue) {
-    wakeup_entry entry {};
-    rlist_create(&entry.base);
-    entry.coroutine = coro_this();
-
-    rlist_add_tail_entry(&queue->coroutines, &entry, base);
-    coro_suspend();
-
-    // Always unlink. Safe even if already popped by waker.
-    rlist_del_entry(&entry, base);
+// Whoever unlinks the entry accounts its wait, while the queue surely
+// exists.
+static void wakeup_queue_pop(wakeup_queue *queue, wakeup_entry *entry) {
+    rlist_del_entry(entry, base);
+    queue->wait_ns += bus_clock_ns() - entry->wait_start_ns;
 }
 
-static void wakeup_queue_wakeup_first(const wakeup_queue *queue) {
+static void wakeup_queue_wakeup_first(wakeup_queue *queue) {
     if (rlist_empty(&queue->coroutines)) {
         return;
     }
 
     auto *entry = rlist_first_entry(&queue->coroutines, wakeup_entry, base);
-    rlist_del_entry(entry, base);    // pop first, then wake
+    wakeup_queue_pop(queue, entry);    // pop first, then wake
+    TRACE_INSTANT("bus wakeup", queue);
     coro_wakeup(entry->coroutine);
 }
 
-static void wakeup_queue_wakeup_all(const wakeup_queue *queue) {
+static std::size_t wakeup_entry_want(const wakeup_entry *entry) {
+    return entry->want > 0 ? entry->want : 1;
+}
+
+// Wakes up the waiters who together can take the count of messages or
+// slots, instead of one waiter per each.
+static void wakeup_queue_wakeup_n(wakeup_queue *queue, std::size_t count) {
+    while (count > 0 && !rlist_empty(&queue->coroutines)) {
+        auto *entry = rlist_first_entry(&queue->coroutines, wakeup_entry, base);
+        const std::size_t want = wakeup_entry_want(entry);
+        count = want < count ? count - want : 0;
+        wakeup_queue_pop(queue, entry);
+        TRACE_INSTANT("bus wakeup", queue);
+        coro_wakeup(entry->coroutine);
+    }
+}
+
+static void wakeup_queue_wakeup_all(wakeup_queue *queue) {
     while (!rlist_empty(&queue->coroutines)) {
         auto *e = rlist_first_entry(&queue->coroutines, wakeup_entry, base);
-        rlist_del_entry(e, base);
+        wakeup_queue_pop(queue, e);
+        TRACE_INSTANT("bus wakeup", queue);
         coro_wakeup(e->coroutine);
     }
 }
 
+static void wakeup_queue_close(wakeup_queue *queue) {
+    for (wakeup_entry *e : wakeup_list(&queue->coroutines)) {
+        e->is_closed = true;
+    }
+    wakeup_queue_wakeup_all(queue);
+}
+
+static void wakeup_queue_add(wakeup_queue *queue, wakeup_entry *entry) {
+    rlist_create(&entry->base);
+    entry->coroutine = coro_this();
+    entry->is_done = false;
+    entry->is_closed = false;
+    entry->wait_start_ns = bus_clock_ns();
+
+    ++queue->wait_count;
+    rlist_add_tail_entry(&queue->coroutines, entry, base);
+    TRACE_INSTANT("bus suspend", queue);
+}
+
+// Returns true if the entry was popped by a waker, and false if it is
+// a spurious wakeup or a cancel. Then the queue is still alive and the
+// entry is removed from it.
+static bool wakeup_queue_leave(wakeup_queue *queue, wakeup_entry *entry) {
+    if (rlist_empty(&entry->base)) {
+        return true;
+    }
+    wakeup_queue_pop(queue, entry);
+    return false;
+}
+
+static const std::uint64_t BUS_NO_DEADLINE = UINT64_MAX;
+
+// Negative timeout means no deadline.
+static std::uint64_t bus_deadline(const double timeout) {
+    if (timeout < 0) {
+        return BUS_NO_DEADLINE;
+    }
+    return bus_clock_ns() + static_cast<std::uint64_t>(timeout * 1000000000);
+}
+
+// Returns false, with the errno set, if the coroutine is cancelled or
+// the deadline has passed. If a message was handed into the entry's
+// slot, then it is received even if cancelled - or it would be lost.
+static bool wakeup_queue_suspend_entry(wakeup_queue *queue, wakeup_entry *entry,
+                                       const std::uint64_t deadline = BUS_NO_DEADLINE) {
+    if (coro_is_cancelled()) {
+        coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+        return false;
+    }
+    bool is_timed_out = false;
+    if (deadline == BUS_NO_DEADLINE) {
+        wakeup_queue_add(queue, entry);
+        coro_suspend();
+    } else {
+        const std::uint64_t now = bus_clock_ns();
+        if (now >= deadline) {
+            coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+            return false;
+        }
+        wakeup_queue_add(queue, entry);
+        is_timed_out = !coro_suspend_timeout(static_cast<double>(deadline - now) / 1000000000);
+    }
+    if (wakeup_queue_leave(queue, entry)) {
+        if (entry->is_done || !coro_is_cancelled()) {
+            return true;
+        }
+        if (!entry->is_closed) {
+            // Pass the wakeup on to whoever can use it.
+            wakeup_queue_wakeup_n(queue, wakeup_entry_want(entry));
+        }
+    }
+    if (coro_is_cancelled()) {
+        coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+        return false;
+    }
+    if (is_timed_out) {
+        coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+        return false;
+    }
+    return true;
+}
+
+static bool wakeup_queue_suspend_this(wakeup_queue *queue, const std::uint64_t deadline = BUS_NO_DEADLINE,
+                                      const std::size_t want = 1) {
+    wakeup_entry entry {};
+    entry.want = want;
+    return wakeup_queue_suspend_entry(queue, &entry, deadline);
+}
+
+// Fixed-capacity FIFO of messages. The capacity is a power of two so
+// the positions wrap with a mask. head and tail only grow, their
+// difference is the size.
+template <typename T>
+struct message_ring {
+    T *data = nullptr;
+    std::size_t mask = 0;
+    std::size_t head = 0;
+    std::size_t tail = 0;
+};
+
+template <typename T>
+static bool message_ring_create(message_ring<T> *ring, const std::size_t min_capacity) {
+    std::size_t capacity = 1;
+    while (capacity < min_capacity) {
+        if (capacity > SIZE_MAX / 2 / sizeof(T)) {
+            return false;
+        }
+        capacity *= 2;
+    }
+    ring->data = new (std::nothrow) T[capacity];
+    if (ring->data == nullptr) {
+        return false;
+    }
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+template <typename T>
+static void message_ring_destroy(message_ring<T> *ring) {
+    delete[] ring->data;
+    ring->data = nullptr;
+}
+
+template <typename T>
+static std::size_t message_ring_size(const message_ring<T> *ring) {
+    return ring->tail - ring->head;
+}
+
+template <typename T>
+static void message_ring_push(message_ring<T> *ring, const T &value) {
+    assert(message_ring_size(ring) <= ring->mask);
+    ring->data[ring->tail++ & ring->mask] = value;
+}
+
+template <typename T>
+static T message_ring_pop(message_ring<T> *ring) {
+    assert(message_ring_size(ring) > 0);
+    return ring->data[ring->head++ & ring->mask];
+}
+
+// Copy in at most two pieces: up to the end of the buffer, and from
+// its beginning.
+template <typename T>
+static void message_ring_push_n(message_ring<T> *ring, const T *values, const std::size_t count) {
+    assert(message_ring_size(ring) + count <= ring->mask + 1);
+    const std::size_t pos = ring->tail & ring->mask;
+    const std::size_t first = count < ring->mask + 1 - pos ? count : ring->mask + 1 - pos;
+    std::memcpy(ring->data + pos, values, first * sizeof(*values));
+    std::memcpy(ring->data, values + first, (count - first) * sizeof(*values));
+    ring->tail += count;
+}
+
+template <typename T>
+static void message_ring_pop_n(message_ring<T> *ring, T *values, const std::size_t count) {
+    assert(count <= message_ring_size(ring));
+    const std::size_t pos = ring->head & ring->mask;
+    const std::size_t first = count < ring->mask + 1 - pos ? count : ring->mask + 1 - pos;
+    std::memcpy(values, ring->data + pos, first * sizeof(*values));
+    std::memcpy(values + first, ring->data, (count - first) * sizeof(*values));
+    ring->head += count;
+}
+
+// Double the capacity keeping the positions, so the indices into the
+// ring stay valid.
+template <typename T>
+static bool message_ring_grow(message_ring<T> *ring) {
+    const std::size_t capacity = ring->data == nullptr ? 1 : (ring->mask + 1) * 2;
+    if (capacity > SIZE_MAX / sizeof(T)) {
+        return false;
+    }
+    T *data = new (std::nothrow) T[capacity];
+    if (data == nullptr) {
+        return false;
+    }
+    for (std::size_t pos = ring->head; pos != ring->tail; ++pos) {
+        data[pos & (capacity - 1)] = ring->data[pos & ring->mask];
+    }
+    delete[] ring->data;
+    ring->data = data;
+    ring->mask = capacity - 1;
+    return true;
+}
+
+// The same ring in a file. The file is unlinked at once, only the
+// mapping keeps it. The kernel writes its pages out and drops them
+// under memory pressure, so a big burst doesn't stay in the memory.
+static bool overflow_ring_create(message_ring<unsigned> *ring, const char *dir, const std::size_t file_limit) {
+    const std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t capacity = page_size / sizeof(unsigned);
+    while (capacity <= file_limit / sizeof(unsigned) / 2) {
+        capacity *= 2;
+    }
+    std::string path = std::string(dir) + "/corobus_overflow_XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return false;
+    }
+    unlink(path.c_str());
+    const std::size_t size = capacity * sizeof(unsigned);
+    void *data = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    ring->data = static_cast<unsigned *>(data);
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+static void overflow_ring_destroy(message_ring<unsigned> *ring) {
+    if (ring->data != nullptr) {
+        munmap(ring->data, (ring->mask + 1) * sizeof(unsigned));
+    }
+    *ring = message_ring<unsigned> {};
+}
+
+static std::size_t overflow_ring_free_count(const message_ring<unsigned> *ring) {
+    return ring->data == nullptr ? 0 : ring->mask + 1 - message_ring_size(ring);
+}
+
+#if CORO_BUS_BROADCAST_LOG
+
+// A broadcast message is stored once for all the channels. Each channel
+// has a cursor in the log and fetches the messages into its own queue
+// lazily, when it is used next time. The slot is freed when the last
+// channel has fetched it, so the log head is the slowest cursor.
+struct broadcast_slot {
+    unsigned data;
+    unsigned ref_count;
+};
+
+struct broadcast_log {
+    message_ring<broadcast_slot> slots {};
+    std::size_t channel_count = 0;
+    // A lower bound of the free space in the channels. Only senders
+    // decrease it, so it is exact until a receiver frees some space,
+    // and then is recalculated only when reaches zero.
+    std::size_t min_free = SIZE_MAX;
+    // Channels having blocked receivers, to wake up on a broadcast.
+    rlist recv_waiting;
+};
+
+#endif
+
+// The unsigned and the generic messages are kept in separate rings and
+// waited for in separate queues, so a wakeup meant for one kind is
+// never consumed by a waiter of the other kind. The count limit is
+// common.
 struct coro_bus_channel {
     std::size_t size_limit = 0;
+    std::size_t byte_limit = 0;
+    std::size_t byte_count = 0;
     wakeup_queue send_queue {};
     wakeup_queue recv_queue {};
-    std::deque<unsigned> message_queue {};
+    wakeup_queue msg_send_queue {};
+    wakeup_queue msg_recv_queue {};
+    message_ring<unsigned> message_queue {};
+    // Created on the first generic message, the channel might never
+    // see one.
+    message_ring<coro_bus_msg> msg_queue {};
+    // Received before message_queue. Not counted in the size limit,
+    // and created on the first expedited message too.
+    message_ring<unsigned> expedited_queue {};
+    wakeup_queue expedited_send_queue {};
+    // The unsigned messages over the size limit, in a file mapped into
+    // memory. Newer than all in message_queue, and moved there on pop.
+    message_ring<unsigned> overflow_queue {};
+    std::uint64_t overflow_count = 0;
+    // How coro_bus_select_weighted() serves the channel. The credit is
+    // earned by the weight while the channel has messages, and spent
+    // on being served.
+    int priority = 0;
+    unsigned weight = 1;
+    std::int64_t credit = 0;
+    int descriptor = -1;
+    rlist in_bus;
+    std::uint64_t send_count = 0;
+    std::uint64_t recv_count = 0;
+    std::size_t max_size = 0;
+#if CORO_BUS_BROADCAST_LOG
+    // Broadcast messages before the cursor are already in the queue.
+    broadcast_log *log = nullptr;
+    std::size_t log_cursor = 0;
+    rlist in_recv_waiting;
+#endif
+};
+
+using channel_list = intrusive_list<coro_bus_channel, &coro_bus_channel::in_bus>;
+
+// The closed channels are kept in the bus for reuse, together with their
+// rings. They are grouped by the ring capacity order, so any channel of
+// the group fits the new size limit without a reallocation.
+enum {
+    BUS_CHANNEL_ORDER_COUNT = sizeof(std::size_t) * 8,
 };
 
+static int channel_order(const std::size_t size_limit) {
+    int order = 0;
+    while (order < BUS_CHANNEL_ORDER_COUNT && (std::size_t(1) << order) < size_limit) {
+        ++order;
+    }
+    return order;
+}
+
+static coro_bus_channel *channel_new(rlist *free_channels, const std::size_t size_limit,
+                                     const std::size_t byte_limit) {
+    coro_bus_channel *channel;
+    const int order = channel_order(size_limit);
+    if (order < BUS_CHANNEL_ORDER_COUNT && !rlist_empty(&free_channels[order])) {
+        channel = rlist_first_entry(&free_channels[order], coro_bus_channel, in_bus);
+        rlist_del_entry(channel, in_bus);
+        const message_ring<unsigned> ring = channel->message_queue;
+        *channel = coro_bus_channel {};
+        channel->message_queue.data = ring.data;
+        channel->message_queue.mask = ring.mask;
+    } else {
+        channel = new coro_bus_channel {};
+        if (!message_ring_create(&channel->message_queue, size_limit)) {
+            delete channel;
+            return nullptr;
+        }
+    }
+    channel->size_limit = size_limit;
+    channel->byte_limit = byte_limit;
+    wakeup_queue_init(&channel->send_queue);
+    wakeup_queue_init(&channel->recv_queue);
+    wakeup_queue_init(&channel->msg_send_queue);
+    wakeup_queue_init(&channel->msg_recv_queue);
+    wakeup_queue_init(&channel->expedited_send_queue);
+    return channel;
+}
+
+static void channel_delete(coro_bus_channel *channel) {
+    while (message_ring_size(&channel->msg_queue) > 0) {
+        coro_bus_msg msg = message_ring_pop(&channel->msg_queue);
+        coro_bus_msg_destroy(&msg);
+    }
+    message_ring_destroy(&channel->msg_queue);
+    message_ring_destroy(&channel->expedited_queue);
+    overflow_ring_destroy(&channel->overflow_queue);
+    message_ring_destroy(&channel->message_queue);
+    delete channel;
+}
+
+// The generic and the expedited messages are rare, and the overflow is
+// per channel, their rings aren't kept.
+static void channel_recycle(rlist *free_channels, coro_bus_channel *channel) {
+    while (message_ring_size(&channel->msg_queue) > 0) {
+        coro_bus_msg msg = message_ring_pop(&channel->msg_queue);
+        coro_bus_msg_destroy(&msg);
+    }
+    message_ring_destroy(&channel->msg_queue);
+    message_ring_destroy(&channel->expedited_queue);
+    overflow_ring_destroy(&channel->overflow_queue);
+    const int order = channel_order(channel->message_queue.mask + 1);
+    rlist_add_entry(&free_channels[order], channel, in_bus);
+}
+
+#if CORO_BUS_BROADCAST_LOG
+
+static void broadcast_log_release(broadcast_log *log, const std::size_t pos) {
+    if (--log->slots.data[pos & log->slots.mask].ref_count != 0) {
+        return;
+    }
+    while (message_ring_size(&log->slots) > 0 && log->slots.data[log->slots.head & log->slots.mask].ref_count == 0) {
+        ++log->slots.head;
+    }
+}
+
+static void channel_log_attach(coro_bus_channel *channel, broadcast_log *log) {
+    channel->log = log;
+    channel->log_cursor = log->slots.tail;
+    rlist_create(&channel->in_recv_waiting);
+    ++log->channel_count;
+    if (log->min_free > channel->size_limit) {
+        log->min_free = channel->size_limit;
+    }
+}
+
+static void channel_log_detach(coro_bus_channel *channel) {
+    broadcast_log *log = channel->log;
+    for (; channel->log_cursor != log->slots.tail; ++channel->log_cursor) {
+        broadcast_log_release(log, channel->log_cursor);
+    }
+    rlist_del(&channel->in_recv_waiting);
+    --log->channel_count;
+}
+
+static std::size_t channel_log_pending(const coro_bus_channel *channel) {
+    return channel->log->slots.tail - channel->log_cursor;
+}
+
+// Fits, because the pending broadcasts are counted in the channel size.
+static void channel_log_fetch(coro_bus_channel *channel) {
+    broadcast_log *log = channel->log;
+    channel->send_count += channel_log_pending(channel);
+    for (; channel->log_cursor != log->slots.tail; ++channel->log_cursor) {
+        message_ring_push(&channel->message_queue, log->slots.data[channel->log_cursor & log->slots.mask].data);
+        broadcast_log_release(log, channel->log_cursor);
+    }
+}
+
+static void channel_log_wait_recv(coro_bus_channel *channel) {
+    if (rlist_empty(&channel->in_recv_waiting)) {
+        rlist_add_tail(&channel->log->recv_waiting, &channel->in_recv_waiting);
+    }
+}
+
+#else
+
+static std::size_t channel_log_pending(const coro_bus_channel *) {
+    return 0;
+}
+
+static void channel_log_fetch(coro_bus_channel *) {
+}
+
+static void channel_log_wait_recv(coro_bus_channel *) {
+}
+
+#endif
+
+static std::size_t channel_free_count(const coro_bus_channel *channel) {
+    return channel->size_limit - message_ring_size(&channel->message_queue) -
+           message_ring_size(&channel->msg_queue) - channel_log_pending(channel);
+}
+
+// Unsigned messages which can be sent without blocking.
+static std::size_t channel_send_room(const coro_bus_channel *channel) {
+    return channel_free_count(channel) + overflow_ring_free_count(&channel->overflow_queue);
+}
+
+// The overflow goes into the freed space in its order.
+static void channel_overflow_refill(coro_bus_channel *channel) {
+    std::size_t count = message_ring_size(&channel->overflow_queue);
+    if (count == 0) {
+        return;
+    }
+    const std::size_t free_count = channel_free_count(channel);
+    if (count > free_count) {
+        count = free_count;
+    }
+    for (std::size_t index = 0; index < count; ++index) {
+        message_ring_push(&channel->message_queue, message_ring_pop(&channel->overflow_queue));
+    }
+}
+
+// Called when the channel gets fuller, to keep the broadcast's lower
+// bound of the free space valid.
+static void channel_on_push(coro_bus_channel *channel) {
+    const std::size_t free_count = channel_free_count(channel);
+    if (channel->max_size < channel->size_limit - free_count) {
+        channel->max_size = channel->size_limit - free_count;
+    }
+#if CORO_BUS_BROADCAST_LOG
+    if (channel->log->min_free > free_count) {
+        channel->log->min_free = free_count;
+    }
+#endif
+}
+
+// The pending broadcasts are already sent, even if not fetched yet.
+static void channel_stats_add(const coro_bus_channel *channel, struct coro_bus_stats *stats) {
+    const std::size_t size = channel->size_limit - channel_free_count(channel);
+    stats->send_count += channel->send_count + channel_log_pending(channel);
+    stats->recv_count += channel->recv_count;
+    if (stats->max_size < size) {
+        stats->max_size = size;
+    }
+    if (stats->max_size < channel->max_size) {
+        stats->max_size = channel->max_size;
+    }
+    stats->send_wait_count += channel->send_queue.wait_count + channel->msg_send_queue.wait_count +
+                              channel->expedited_send_queue.wait_count;
+    stats->send_wait_ns += channel->send_queue.wait_ns + channel->msg_send_queue.wait_ns +
+                           channel->expedited_send_queue.wait_ns;
+    stats->recv_wait_count += channel->recv_queue.wait_count + channel->msg_recv_queue.wait_count;
+    stats->recv_wait_ns += channel->recv_queue.wait_ns + channel->msg_recv_queue.wait_ns;
+    stats->overflow_count += channel->overflow_count;
+}
+
+// Freed slots wake as many unsigned senders as can fill them. The generic ones
+// are all woken, because they also wait for bytes, and one of them
+// failing to fit mustn't block the others.
+static void channel_on_pop(coro_bus_channel *channel, const std::size_t count) {
+    channel_overflow_refill(channel);
+    channel->recv_count += count;
+    wakeup_queue_wakeup_n(&channel->send_queue, count);
+    wakeup_queue_wakeup_all(&channel->msg_send_queue);
+}
+
+// The first messages go straight to the waiting receivers, while the
+// queue is empty - otherwise the order would break. The rest is queued,
+// and enough receivers are woken up to take them. A handed over message
+// leaves its slot free, so the senders are woken up instead of the
+// receiver doing it on pop. What doesn't fit goes to the overflow, which
+// is only non-empty while the channel is full.
+static void channel_push_values(coro_bus_channel *channel, const unsigned *data, const std::size_t count) {
+    channel_log_fetch(channel);
+    channel_overflow_refill(channel);
+    assert(count <= channel_send_room(channel));
+    std::size_t index = 0;
+    while (index < count && message_ring_size(&channel->message_queue) == 0 &&
+           message_ring_size(&channel->overflow_queue) == 0 &&
+           message_ring_size(&channel->expedited_queue) == 0 && !rlist_empty(&channel->recv_queue.coroutines)) {
+        auto *entry = rlist_first_entry(&channel->recv_queue.coroutines, wakeup_entry, base);
+        if (entry->slot == nullptr) {
+            break;
+        }
+        *entry->slot = data[index++];
+        entry->is_done = true;
+        wakeup_queue_pop(&channel->recv_queue, entry);
+        TRACE_INSTANT("bus wakeup", &channel->recv_queue);
+        coro_wakeup(entry->coroutine);
+    }
+    channel->recv_count += index;
+    wakeup_queue_wakeup_n(&channel->send_queue, index);
+    std::size_t queued = count - index;
+    if (queued > channel_free_count(channel)) {
+        queued = channel_free_count(channel);
+    }
+    message_ring_push_n(&channel->message_queue, data + index, queued);
+    if (index + queued < count) {
+        message_ring_push_n(&channel->overflow_queue, data + index + queued, count - index - queued);
+        channel->overflow_count += count - index - queued;
+    }
+    wakeup_queue_wakeup_n(&channel->recv_queue, count - index);
+    channel->send_count += count;
+    channel_on_push(channel);
+}
+
+// Unsigned messages ready to be received, the expedited ones included.
+static std::size_t channel_value_count(coro_bus_channel *channel) {
+    channel_log_fetch(channel);
+    channel_overflow_refill(channel);
+    return message_ring_size(&channel->expedited_queue) + message_ring_size(&channel->message_queue);
+}
+
+// The expedited messages go first, and free the slots of their lane.
+static void channel_pop_values(coro_bus_channel *channel, unsigned *data, const std::size_t count) {
+    std::size_t expedited = message_ring_size(&channel->expedited_queue);
+    if (expedited > count) {
+        expedited = count;
+    }
+    if (expedited > 0) {
+        message_ring_pop_n(&channel->expedited_queue, data, expedited);
+        channel->recv_count += expedited;
+        wakeup_queue_wakeup_n(&channel->expedited_send_queue, expedited);
+    }
+    if (count > expedited) {
+        message_ring_pop_n(&channel->message_queue, data + expedited, count - expedited);
+        channel_on_pop(channel, count - expedited);
+    }
+}
+
+// A waiting receiver gets the message right away, same as in
+// channel_push_values(). Then the channel is empty, the order can't
+// break.
+static void channel_push_expedited(coro_bus_channel *channel, const unsigned data) {
+    ++channel->send_count;
+    if (channel_value_count(channel) == 0 && !rlist_empty(&channel->recv_queue.coroutines)) {
+        auto *entry = rlist_first_entry(&channel->recv_queue.coroutines, wakeup_entry, base);
+        if (entry->slot != nullptr) {
+            *entry->slot = data;
+            entry->is_done = true;
+            ++channel->recv_count;
+            wakeup_queue_pop(&channel->recv_queue, entry);
+            TRACE_INSTANT("bus wakeup", &channel->recv_queue);
+            coro_wakeup(entry->coroutine);
+            return;
+        }
+    }
+    message_ring_push(&channel->expedited_queue, data);
+    wakeup_queue_wakeup_n(&channel->recv_queue, 1);
+}
+
 struct coro_bus {
     coro_bus_channel **channels = nullptr;    // descriptor table with holes
     int channel_count = 0;                    // capacity of descriptor table
+    // The holes, as a stack. The lowest new descriptors are on top.
+    mutable int *free_descs = nullptr;
+    mutable int free_desc_count = 0;
+    mutable rlist live_channels;
+    // Closed channels for reuse, by the ring capacity order.
+    mutable rlist free_channels[BUS_CHANNEL_ORDER_COUNT];
+    // Totals of the already closed channels.
+    mutable struct coro_bus_stats closed_stats {};
+#if CORO_BUS_BROADCAST_LOG
+    broadcast_log *log = nullptr;
+#endif
 };
 
-static coro_bus_error_code global_errno = CORO_BUS_ERR_NONE;
+// Each coroutine has its own errno, so interleaved calls don't
+// overwrite each other's errors. The thread one works outside of
+// the coroutines and when no keys are left.
+static thread_local coro_bus_error_code global_errno = CORO_BUS_ERR_NONE;
+
+static int errno_key() {
+    static const int key = [] {
+        coro_key_t new_key;
+        return coro_key_create(&new_key, nullptr) == 0 ? new_key : -1;
+    }();
+    return key;
+}
 
 coro_bus_error_code coro_bus_errno() {
-    return global_errno;
+    const int key = errno_key();
+    if (key < 0 || coro_this() == nullptr) {
+        return global_errno;
+    }
+    return static_cast<coro_bus_error_code>(
+        reinterpret_cast<std::intptr_t>(coro_getspecific(key)));
 }
 
 void coro_bus_errno_set(const coro_bus_error_code error_code) {
-    global_errno = error_code;
+    const int key = errno_key();
+    if (key < 0 || coro_setspecific(key, reinterpret_cast<void *>(
+                       static_cast<std::intptr_t>(error_code))) != 0) {
+        global_errno = error_code;
+    }
 }
 
 static coro_bus_channel *get_bus_channel(const coro_bus *coroutines_bus, const int index) {
@@ -84,19 +744,19 @@ static coro_bus_channel *get_bus_channel(const coro_bus *coroutines_bus, const i
 }
 
 static bool is_bus_has_any_channels(const coro_bus *coroutines_bus) {
-    if (coroutines_bus == nullptr || coroutines_bus->channels == nullptr) {
-        return false;
-    }
-    for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-        if (coroutines_bus->channels[index] != nullptr) {
-            return true;
-        }
-    }
-    return false;
+    return coroutines_bus != nullptr && !rlist_empty(&coroutines_bus->live_channels);
 }
 
 coro_bus *coro_bus_new() {
     auto *coroutines_bus = new coro_bus {};
+    rlist_create(&coroutines_bus->live_channels);
+    for (rlist &free_list : coroutines_bus->free_channels) {
+        rlist_create(&free_list);
+    }
+#if CORO_BUS_BROADCAST_LOG
+    coroutines_bus->log = new broadcast_log {};
+    rlist_create(&coroutines_bus->log->recv_waiting);
+#endif
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return coroutines_bus;
 }
@@ -106,68 +766,85 @@ void coro_bus_delete(coro_bus *coroutines_bus) {
         return;
     }
 
-    if (coroutines_bus->channels != nullptr) {
-        for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-            if (coroutines_bus->channels[index] != nullptr) {
-                coro_bus_channel_close(coroutines_bus, index);
-            }
+    while (!rlist_empty(&coroutines_bus->live_channels)) {
+        auto *channel = rlist_first_entry(&coroutines_bus->live_channels, coro_bus_channel, in_bus);
+        coro_bus_channel_close(coroutines_bus, channel->descriptor);
+    }
+    for (rlist &free_list : coroutines_bus->free_channels) {
+        while (!rlist_empty(&free_list)) {
+            auto *channel = rlist_first_entry(&free_list, coro_bus_channel, in_bus);
+            rlist_del_entry(channel, in_bus);
+            channel_delete(channel);
         }
-        delete[] coroutines_bus->channels;
-        coroutines_bus->channels = nullptr;
-        coroutines_bus->channel_count = 0;
     }
+    delete[] coroutines_bus->channels;
+    delete[] coroutines_bus->free_descs;
+#if CORO_BUS_BROADCAST_LOG
+    assert(coroutines_bus->log->channel_count == 0);
+    message_ring_destroy(&coroutines_bus->log->slots);
+    delete coroutines_bus->log;
+#endif
 
     delete coroutines_bus;
 }
 
-int coro_bus_channel_open(coro_bus *coroutines_bus, std::size_t size_limit) {
-    if (coroutines_bus == nullptr) {
-        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-        return -1;
-    }
-    if (size_limit == 0) {
-        size_limit = 1;
-    }
-
-    // Reuse holes first
-    if (coroutines_bus->channels != nullptr) {
-        for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-            if (coroutines_bus->channels[index] == nullptr) {
-                auto *ch = new coro_bus_channel {};
-                ch->size_limit = size_limit;
-                wakeup_queue_init(&ch->send_queue);
-                wakeup_queue_init(&ch->recv_queue);
-                coroutines_bus->channels[index] = ch;
-                coro_bus_errno_set(CORO_BUS_ERR_NONE);
-                return index;
-            }
-        }
-    }
-
-    // Grow descriptor table
+// Double the descriptor table. The new descriptors become holes.
+static void bus_grow_descs(coro_bus *coroutines_bus) {
     const int old_capacity = coroutines_bus->channel_count;
     const int new_doubled_cap = old_capacity == 0 ? 2 : old_capacity * 2;
 
     auto **new_arr = new coro_bus_channel *[static_cast<std::size_t>(new_doubled_cap)];
     std::memset(new_arr, 0, sizeof(*new_arr) * static_cast<std::size_t>(new_doubled_cap));
+    auto *new_free = new int[static_cast<std::size_t>(new_doubled_cap)];
 
     if (coroutines_bus->channels != nullptr) {
         std::memcpy(new_arr, coroutines_bus->channels, sizeof(*new_arr) * static_cast<std::size_t>(old_capacity));
         delete[] coroutines_bus->channels;
     }
+    // Only called without holes, nothing to copy.
+    assert(coroutines_bus->free_desc_count == 0);
+    delete[] coroutines_bus->free_descs;
 
     coroutines_bus->channels = new_arr;
     coroutines_bus->channel_count = new_doubled_cap;
+    coroutines_bus->free_descs = new_free;
+    for (int index = new_doubled_cap - 1; index >= old_capacity; --index) {
+        coroutines_bus->free_descs[coroutines_bus->free_desc_count++] = index;
+    }
+}
+
+int coro_bus_channel_open(coro_bus *coroutines_bus, std::size_t size_limit) {
+    return coro_bus_channel_open_ex(coroutines_bus, size_limit, 0);
+}
+
+int coro_bus_channel_open_ex(coro_bus *coroutines_bus, std::size_t size_limit, const std::size_t byte_limit) {
+    if (coroutines_bus == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    if (size_limit == 0) {
+        size_limit = 1;
+    }
 
-    // First free slot is old_cap (no holes existed).
-    auto *new_channel = new coro_bus_channel {};
-    new_channel->size_limit = size_limit;
-    wakeup_queue_init(&new_channel->send_queue);
-    wakeup_queue_init(&new_channel->recv_queue);
-    coroutines_bus->channels[old_capacity] = new_channel;
+    auto *new_channel = channel_new(coroutines_bus->free_channels, size_limit, byte_limit);
+    if (new_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return -1;
+    }
+    if (coroutines_bus->free_desc_count == 0) {
+        bus_grow_descs(coroutines_bus);
+    }
+    const int descriptor = coroutines_bus->free_descs[--coroutines_bus->free_desc_count];
+    assert(coroutines_bus->channels[descriptor] == nullptr);
+    coroutines_bus->channels[descriptor] = new_channel;
+    new_channel->descriptor = descriptor;
+    rlist_add_tail_entry(&coroutines_bus->live_channels, new_channel, in_bus);
+#if CORO_BUS_BROADCAST_LOG
+    channel_log_attach(new_channel, coroutines_bus->log);
+#endif
 
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
-    return old_capacity;
+    return descriptor;
 }
 
 void coro_bus_channel_close(const coro_bus *coroutines_bus, const int channel) {
@@ -178,15 +855,49 @@ void coro_bus_channel_close(const coro_bus *coroutines_bus, const int channel) {
 
     // Mark closed first so woken coroutines observe NO_CHANNEL on retry
     coroutines_bus->channels[channel] = nullptr;
+    coroutines_bus->free_descs[coroutines_bus->free_desc_count++] = channel;
+    rlist_del_entry(current_channel, in_bus);
 
     // Wake all waiters, then delete channel safely
-    wakeup_queue_wakeup_all(&current_channel->send_queue);
-    wakeup_queue_wakeup_all(&current_channel->recv_queue);
+    wakeup_queue_close(&current_channel->send_queue);
+    wakeup_queue_close(&current_channel->recv_queue);
+    wakeup_queue_close(&current_channel->msg_send_queue);
+    wakeup_queue_close(&current_channel->msg_recv_queue);
+    wakeup_queue_close(&current_channel->expedited_send_queue);
+    channel_stats_add(current_channel, &coroutines_bus->closed_stats);
+
+#if CORO_BUS_BROADCAST_LOG
+    channel_log_detach(current_channel);
+#endif
+    channel_recycle(coroutines_bus->free_channels, current_channel);
+}
 
-    delete current_channel;
+int coro_bus_stats(const coro_bus *coroutines_bus, const int channel, struct coro_bus_stats *stats) {
+    *stats = {};
+    if (channel == -1 && coroutines_bus != nullptr) {
+        *stats = coroutines_bus->closed_stats;
+        for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+            channel_stats_add(current_channel, stats);
+        }
+        coro_bus_errno_set(CORO_BUS_ERR_NONE);
+        return 0;
+    }
+    const auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    channel_stats_add(current_channel, stats);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
 }
 
 int coro_bus_send(const coro_bus *coroutines_bus, const int channel, const unsigned data) {
+    return coro_bus_send_timed(coroutines_bus, channel, data, -1);
+}
+
+int coro_bus_send_timed(const coro_bus *coroutines_bus, const int channel, const unsigned data, const double timeout) {
+    const std::uint64_t deadline = bus_deadline(timeout);
     while (true) {
         if (coro_bus_try_send(coroutines_bus, channel, data) == 0) {
             return 0;
@@ -201,7 +912,9 @@ int coro_bus_send(const coro_bus *coroutines_bus, const int channel, const unsig
             coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
             return -1;
         }
-        wakeup_queue_suspend_this(&current_channel->send_queue);
+        if (!wakeup_queue_suspend_this(&current_channel->send_queue, deadline)) {
+            return -1;
+        }
     }
 }
 
@@ -212,21 +925,25 @@ int coro_bus_try_send(const coro_bus *coroutines_bus, const int channel, const u
         return -1;
     }
 
-    if (current_channel->message_queue.size() >= current_channel->size_limit) {
+    if (channel_send_room(current_channel) == 0) {
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
     }
 
-    current_channel->message_queue.push_back(data);
-    wakeup_queue_wakeup_first(&current_channel->recv_queue);
+    channel_push_values(current_channel, &data, 1);
 
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return 0;
 }
 
 int coro_bus_recv(const coro_bus *coroutines_bus, const int channel, unsigned *data) {
+    return coro_bus_recv_timed(coroutines_bus, channel, data, -1);
+}
+
+int coro_bus_recv_timed(const coro_bus *coroutines_bus, const int channel, unsigned *data, const double timeout) {
     assert(data != nullptr);
 
+    const std::uint64_t deadline = bus_deadline(timeout);
     while (true) {
         if (coro_bus_try_recv(coroutines_bus, channel, data) == 0) {
             return 0;
@@ -240,7 +957,16 @@ int coro_bus_recv(const coro_bus *coroutines_bus, const int channel, unsigned *d
             coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
             return -1;
         }
-        wakeup_queue_suspend_this(&current_channel->recv_queue);
+        wakeup_entry entry {};
+        entry.slot = data;
+        channel_log_wait_recv(current_channel);
+        if (!wakeup_queue_suspend_entry(&current_channel->recv_queue, &entry, deadline)) {
+            return -1;
+        }
+        if (entry.is_done) {
+            coro_bus_errno_set(CORO_BUS_ERR_NONE);
+            return 0;
+        }
     }
 }
 
@@ -253,54 +979,363 @@ int coro_bus_try_recv(const coro_bus *coroutines_bus, const int channel, unsigne
         return -1;
     }
 
-    if (current_channel->message_queue.empty()) {
+    if (channel_value_count(current_channel) == 0) {
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
     }
 
-    *data = current_channel->message_queue.front();
-    current_channel->message_queue.pop_front();
-    wakeup_queue_wakeup_first(&current_channel->send_queue);
+    channel_pop_values(current_channel, data, 1);
 
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return 0;
 }
 
-#if NEED_BROADCAST
-
-int coro_bus_try_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
-    if (!is_bus_has_any_channels(coroutines_bus)) {
-        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-        return -1;
+// The wakeups of the channels which were not used are passed on, the
+// messages might still be there.
+static void bus_select_forward(const coro_bus *coroutines_bus, const int *channels, const int count,
+                               const wakeup_entry *entries, const int used_channel) {
+    for (int index = 0; index < count; ++index) {
+        if (!entries[index].is_done || channels[index] == used_channel) {
+            continue;
+        }
+        auto *current_channel = get_bus_channel(coroutines_bus, channels[index]);
+        if (current_channel != nullptr) {
+            wakeup_queue_wakeup_first(&current_channel->recv_queue);
+        }
     }
+}
 
-    // if any existing channel is full -> fail, send nowhere
-    for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-        const auto *current_channel = get_bus_channel(coroutines_bus, index);
-        if (current_channel == nullptr) {
-            continue;
+// Start from the channel which woke us up, so the first ones can't
+// starve the others. CORO_BUS_ERR_WOULD_BLOCK when all are empty.
+static int bus_select_try(const coro_bus *coroutines_bus, const int *channels, const int count, const int start,
+                          unsigned *data, int *which) {
+    for (int step = 0; step < count; ++step) {
+        const int index = (start + step) % count;
+        if (coro_bus_try_recv(coroutines_bus, channels[index], data) == 0) {
+            *which = index;
+            return 0;
         }
-        if (current_channel->message_queue.size() >= current_channel->size_limit) {
-            coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+            *which = index;
             return -1;
         }
     }
+    return -1;
+}
 
-    // Commit to all.
-    for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-        auto *current_channel = get_bus_channel(coroutines_bus, index);
+// The class of a channel in the weighted select, the bigger the sooner.
+// The expedited messages go before any priority.
+static std::int64_t channel_select_class(const coro_bus_channel *channel) {
+    const std::int64_t is_expedited = message_ring_size(&channel->expedited_queue) > 0 ? 1 : 0;
+    return (is_expedited << 32) + channel->priority;
+}
+
+// Smooth weighted round robin within the best class of the ready
+// channels: each of them earns its weight, the richest is served and
+// pays the sum of the earned. So a channel of weight 3 next to one of
+// weight 1 gets 3 of each 4 receives, spread among them.
+static int bus_select_try_weighted(const coro_bus *coroutines_bus, const int *channels, const int count,
+                                   unsigned *data, int *which) {
+    bool is_ready = false;
+    std::int64_t best_class = 0;
+    for (int index = 0; index < count; ++index) {
+        coro_bus_channel *current_channel = get_bus_channel(coroutines_bus, channels[index]);
         if (current_channel == nullptr) {
+            coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+            *which = index;
+            return -1;
+        }
+        if (channel_value_count(current_channel) == 0) {
             continue;
         }
-        current_channel->message_queue.push_back(data);
+        const std::int64_t select_class = channel_select_class(current_channel);
+        if (!is_ready || select_class > best_class) {
+            best_class = select_class;
+        }
+        is_ready = true;
+    }
+    if (!is_ready) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    coro_bus_channel *best = nullptr;
+    std::int64_t total_weight = 0;
+    for (int index = 0; index < count; ++index) {
+        coro_bus_channel *current_channel = get_bus_channel(coroutines_bus, channels[index]);
+        if (channel_value_count(current_channel) == 0 || channel_select_class(current_channel) != best_class) {
+            continue;
+        }
+        current_channel->credit += current_channel->weight;
+        total_weight += current_channel->weight;
+        if (best == nullptr || current_channel->credit > best->credit) {
+            best = current_channel;
+            *which = index;
+        }
+    }
+    best->credit -= total_weight;
+    channel_pop_values(best, data, 1);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+static int bus_select(const coro_bus *coroutines_bus, const int *channels, const int count, unsigned *data,
+                      int *which, wakeup_entry *entries, const bool is_weighted) {
+    bool is_woken = false;
+    int start = 0;
+    while (true) {
+        const int rc = is_weighted ? bus_select_try_weighted(coroutines_bus, channels, count, data, which)
+                                   : bus_select_try(coroutines_bus, channels, count, start, data, which);
+        if (rc == 0 || coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+            if (is_woken) {
+                bus_select_forward(coroutines_bus, channels, count, entries, rc == 0 ? channels[*which] : -1);
+            }
+            return rc;
+        }
+        // All the channels exist and are empty.
+        if (coro_is_cancelled()) {
+            coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+            return -1;
+        }
+        for (int index = 0; index < count; ++index) {
+            auto *current_channel = get_bus_channel(coroutines_bus, channels[index]);
+            channel_log_wait_recv(current_channel);
+            wakeup_queue_add(&current_channel->recv_queue, &entries[index]);
+        }
+        coro_suspend();
+
+        // A closed channel is reported on retry. is_done marks the
+        // ones which got a wakeup.
+        start = -1;
+        for (int index = 0; index < count; ++index) {
+            wakeup_entry *entry = &entries[index];
+            if (!entry->is_closed) {
+                auto *current_channel = get_bus_channel(coroutines_bus, channels[index]);
+                entry->is_done = wakeup_queue_leave(&current_channel->recv_queue, entry);
+            }
+            if ((entry->is_done || entry->is_closed) && start < 0) {
+                start = index;
+            }
+        }
+        if (start < 0) {
+            start = 0;
+        }
+        is_woken = true;
+        if (coro_is_cancelled()) {
+            bus_select_forward(coroutines_bus, channels, count, entries, -1);
+            coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+            return -1;
+        }
+    }
+}
+
+static int bus_select_entries(const coro_bus *coroutines_bus, const int *channels, const int count, unsigned *data,
+                              int *which, const bool is_weighted) {
+    assert(data != nullptr && which != nullptr);
+    if (count <= 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    wakeup_entry small_entries[8] {};
+    wakeup_entry *entries = small_entries;
+    if (count > static_cast<int>(sizeof(small_entries) / sizeof(small_entries[0]))) {
+        entries = new wakeup_entry[static_cast<std::size_t>(count)] {};
+    }
+    const int rc = bus_select(coroutines_bus, channels, count, data, which, entries, is_weighted);
+    if (entries != small_entries) {
+        delete[] entries;
+    }
+    return rc;
+}
+
+int coro_bus_select(const coro_bus *coroutines_bus, const int *channels, const int count, unsigned *data,
+                    int *which) {
+    return bus_select_entries(coroutines_bus, channels, count, data, which, false);
+}
+
+int coro_bus_select_weighted(const coro_bus *coroutines_bus, const int *channels, const int count, unsigned *data,
+                             int *which) {
+    return bus_select_entries(coroutines_bus, channels, count, data, which, true);
+}
+
+int coro_bus_channel_set_priority(const coro_bus *coroutines_bus, const int channel, const int priority,
+                                  const unsigned weight) {
+    auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    current_channel->priority = priority;
+    current_channel->weight = weight > 0 ? weight : 1;
+    current_channel->credit = 0;
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_channel_set_overflow(const coro_bus *coroutines_bus, const int channel, const char *dir,
+                                  const std::size_t file_limit) {
+    auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    if (message_ring_size(&current_channel->overflow_queue) > 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    message_ring<unsigned> ring {};
+    if (file_limit > 0 && !overflow_ring_create(&ring, dir, file_limit)) {
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return -1;
+    }
+    overflow_ring_destroy(&current_channel->overflow_queue);
+    current_channel->overflow_queue = ring;
+    // The senders can go on into the new file
+    wakeup_queue_wakeup_all(&current_channel->send_queue);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_send_expedited(const coro_bus *coroutines_bus, const int channel, const unsigned data) {
+    while (true) {
+        if (coro_bus_try_send_expedited(coroutines_bus, channel, data) == 0) {
+            return 0;
+        }
+        if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+            return -1;
+        }
+        auto *current_channel = get_bus_channel(coroutines_bus, channel);
+        if (!wakeup_queue_suspend_this(&current_channel->expedited_send_queue)) {
+            return -1;
+        }
+    }
+}
+
+int coro_bus_try_send_expedited(const coro_bus *coroutines_bus, const int channel, const unsigned data) {
+    auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    message_ring<unsigned> *lane = &current_channel->expedited_queue;
+    if (lane->data == nullptr && !message_ring_create(lane, CORO_BUS_EXPEDITED_SIZE)) {
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return -1;
+    }
+    if (message_ring_size(lane) > lane->mask) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    channel_push_expedited(current_channel, data);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+#if NEED_BROADCAST
+
+#if CORO_BUS_BROADCAST_LOG
+
+// Recalculate the free space lower bound. Returns a full channel if
+// there is one.
+static coro_bus_channel *broadcast_log_refresh(const coro_bus *coroutines_bus) {
+    broadcast_log *log = coroutines_bus->log;
+    log->min_free = SIZE_MAX;
+    for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+        const std::size_t free_count = channel_free_count(current_channel);
+        if (free_count == 0) {
+            log->min_free = 0;
+            return current_channel;
+        }
+        if (log->min_free > free_count) {
+            log->min_free = free_count;
+        }
+    }
+    return nullptr;
+}
+
+static int broadcast_log_publish(broadcast_log *log, const unsigned data) {
+    if (log->slots.data == nullptr || message_ring_size(&log->slots) > log->slots.mask) {
+        if (!message_ring_grow(&log->slots)) {
+            coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+            return -1;
+        }
+    }
+    message_ring_push(&log->slots, broadcast_slot {data, static_cast<unsigned>(log->channel_count)});
+    --log->min_free;
+
+    // Each channel got one message, so one receiver per channel is
+    // enough.
+    coro_bus_channel *current_channel;
+    coro_bus_channel *tmp;
+    rlist_foreach_entry_safe(current_channel, &log->recv_waiting, in_recv_waiting, tmp) {
         wakeup_queue_wakeup_first(&current_channel->recv_queue);
+        if (rlist_empty(&current_channel->recv_queue.coroutines)) {
+            rlist_del_entry(current_channel, in_recv_waiting);
+        }
+    }
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_try_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
+    if (!is_bus_has_any_channels(coroutines_bus)) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    if (coroutines_bus->log->min_free == 0 && broadcast_log_refresh(coroutines_bus) != nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    return broadcast_log_publish(coroutines_bus->log, data);
+}
+
+int coro_bus_broadcast_timed(const coro_bus *coroutines_bus, const unsigned data, const double timeout) {
+    const std::uint64_t deadline = bus_deadline(timeout);
+    while (true) {
+        if (!is_bus_has_any_channels(coroutines_bus)) {
+            coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+            return -1;
+        }
+        coro_bus_channel *full_channel = nullptr;
+        if (coroutines_bus->log->min_free == 0) {
+            full_channel = broadcast_log_refresh(coroutines_bus);
+        }
+        if (full_channel == nullptr) {
+            return broadcast_log_publish(coroutines_bus->log, data);
+        }
+        // Wait for that channel to have space (or be closed), then retry
+        if (!wakeup_queue_suspend_this(&full_channel->send_queue, deadline)) {
+            return -1;
+        }
+    }
+}
+
+#else
+
+int coro_bus_try_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
+    if (!is_bus_has_any_channels(coroutines_bus)) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+
+    // if any existing channel is full -> fail, send nowhere
+    for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+        if (channel_free_count(current_channel) == 0) {
+            coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+            return -1;
+        }
+    }
+
+    // Commit to all.
+    for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+        channel_push_values(current_channel, &data, 1);
     }
 
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return 0;
 }
 
-int coro_bus_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
+int coro_bus_broadcast_timed(const coro_bus *coroutines_bus, const unsigned data, const double timeout) {
+    const std::uint64_t deadline = bus_deadline(timeout);
     while (true) {
         if (!is_bus_has_any_channels(coroutines_bus)) {
             coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
@@ -308,50 +1343,52 @@ int coro_bus_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
         }
 
         // Find any full channel
-        int full_idx = -1;
-        for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-            const auto *current_channel = get_bus_channel(coroutines_bus, index);
-            if (current_channel == nullptr)
-                continue;
-            if (current_channel->message_queue.size() >= current_channel->size_limit) {
-                full_idx = index;
+        coro_bus_channel *full_channel = nullptr;
+        for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+            if (channel_free_count(current_channel) == 0) {
+                full_channel = current_channel;
                 break;
             }
         }
 
-        if (full_idx < 0) {
+        if (full_channel == nullptr) {
             // All have space -> commit
-            for (int index = 0; index < coroutines_bus->channel_count; ++index) {
-                auto *current_channel = get_bus_channel(coroutines_bus, index);
-                if (current_channel == nullptr) {
-                    continue;
-                }
-                current_channel->message_queue.push_back(data);
-                wakeup_queue_wakeup_first(&current_channel->recv_queue);
+            for (coro_bus_channel *current_channel : channel_list(&coroutines_bus->live_channels)) {
+                channel_push_values(current_channel, &data, 1);
             }
             coro_bus_errno_set(CORO_BUS_ERR_NONE);
             return 0;
         }
 
         // Wait for that channel to have space (or be closed), then retry
-        auto *current_channel = get_bus_channel(coroutines_bus, full_idx);
-        if (current_channel == nullptr) {
-            continue;
+        if (!wakeup_queue_suspend_this(&full_channel->send_queue, deadline)) {
+            return -1;
         }
-        wakeup_queue_suspend_this(&current_channel->send_queue);
     }
 }
 
+#endif    // CORO_BUS_BROADCAST_LOG
+
+int coro_bus_broadcast(const coro_bus *coroutines_bus, const unsigned data) {
+    return coro_bus_broadcast_timed(coroutines_bus, data, -1);
+}
+
 #endif    // NEED_BROADCAST
 
 #if NEED_BATCH
 
 int coro_bus_send_v(const coro_bus *coroutines_bus, const int channel, const unsigned *data, const unsigned count) {
+    return coro_bus_send_v_timed(coroutines_bus, channel, data, count, -1);
+}
+
+int coro_bus_send_v_timed(const coro_bus *coroutines_bus, const int channel, const unsigned *data,
+                          const unsigned count, const double timeout) {
     if (data == nullptr && count != 0) {
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
         return -1;
     }
 
+    const std::uint64_t deadline = bus_deadline(timeout);
     while (true) {
         coro_bus_channel *current_channel = get_bus_channel(coroutines_bus, channel);
         if (current_channel == nullptr) {
@@ -359,23 +1396,18 @@ int coro_bus_send_v(const coro_bus *coroutines_bus, const int channel, const uns
             return -1;
         }
 
-        const std::size_t available_size = current_channel->size_limit - current_channel->message_queue.size();
+        const std::size_t available_size = channel_send_room(current_channel);
         if (available_size == 0) {
             // Block only when we can't send even 1
-            wakeup_queue_suspend_this(&current_channel->send_queue);
+            if (!wakeup_queue_suspend_this(&current_channel->send_queue, deadline, count)) {
+                return -1;
+            }
             continue;
         }
 
         const unsigned to_send = count < available_size ? count : static_cast<unsigned>(available_size);
 
-        for (unsigned index = 0; index < to_send; ++index) {
-            current_channel->message_queue.push_back(data[index]);
-        }
-
-        // Wake as many receivers as messages we produced
-        for (unsigned index = 0; index < to_send; ++index) {
-            wakeup_queue_wakeup_first(&current_channel->recv_queue);
-        }
+        channel_push_values(current_channel, data, to_send);
 
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
         return static_cast<int>(to_send);
@@ -394,7 +1426,7 @@ int coro_bus_try_send_v(const coro_bus *coroutines_bus, const int channel, const
         return -1;
     }
 
-    const std::size_t available_size = current_channel->size_limit - current_channel->message_queue.size();
+    const std::size_t available_size = channel_send_room(current_channel);
     if (available_size == 0) {
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
@@ -402,24 +1434,24 @@ int coro_bus_try_send_v(const coro_bus *coroutines_bus, const int channel, const
 
     const unsigned to_send = count < available_size ? count : static_cast<unsigned>(available_size);
 
-    for (unsigned index = 0; index < to_send; ++index) {
-        current_channel->message_queue.push_back(data[index]);
-    }
-
-    for (unsigned index = 0; index < to_send; ++index) {
-        wakeup_queue_wakeup_first(&current_channel->recv_queue);
-    }
+    channel_push_values(current_channel, data, to_send);
 
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return static_cast<int>(to_send);
 }
 
 int coro_bus_recv_v(const coro_bus *coroutines_bus, const int channel, unsigned *data, const unsigned capacity) {
+    return coro_bus_recv_v_timed(coroutines_bus, channel, data, capacity, -1);
+}
+
+int coro_bus_recv_v_timed(const coro_bus *coroutines_bus, const int channel, unsigned *data,
+                          const unsigned capacity, const double timeout) {
     if (data == nullptr && capacity != 0) {
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
         return -1;
     }
 
+    const std::uint64_t deadline = bus_deadline(timeout);
     while (true) {
         coro_bus_channel *current_channel = get_bus_channel(coroutines_bus, channel);
         if (current_channel == nullptr) {
@@ -427,25 +1459,32 @@ int coro_bus_recv_v(const coro_bus *coroutines_bus, const int channel, unsigned
             return -1;
         }
 
-        if (current_channel->message_queue.empty()) {
+        const std::size_t ready_count = channel_value_count(current_channel);
+        if (ready_count == 0) {
             // Block only when we can't receive even 1
-            wakeup_queue_suspend_this(&current_channel->recv_queue);
+            wakeup_entry entry {};
+            entry.slot = capacity > 0 ? data : nullptr;
+            entry.want = capacity;
+            channel_log_wait_recv(current_channel);
+            if (!wakeup_queue_suspend_entry(&current_channel->recv_queue, &entry, deadline)) {
+                return -1;
+            }
+            if (entry.is_done) {
+                // Take whatever else was queued after the handed over one
+                int count = 0;
+                if (capacity > 1) {
+                    count = coro_bus_try_recv_v(coroutines_bus, channel, data + 1, capacity - 1);
+                }
+                coro_bus_errno_set(CORO_BUS_ERR_NONE);
+                return count > 0 ? count + 1 : 1;
+            }
             continue;
         }
 
-        const unsigned to_receive = current_channel->message_queue.size() < capacity
-                                            ? static_cast<unsigned>(current_channel->message_queue.size())
-                                            : capacity;
+        const unsigned to_receive = ready_count < capacity ? static_cast<unsigned>(ready_count) : capacity;
 
-        for (unsigned index = 0; index < to_receive; ++index) {
-            data[index] = current_channel->message_queue.front();
-            current_channel->message_queue.pop_front();
-        }
-
-        // Wake as many senders as slots we freed (or until none wait)
-        for (unsigned i = 0; i < to_receive; ++i) {
-            wakeup_queue_wakeup_first(&current_channel->send_queue);
-        }
+        // Wakes enough senders to fill the slots we freed
+        channel_pop_values(current_channel, data, to_receive);
 
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
         return static_cast<int>(to_receive);
@@ -464,26 +1503,368 @@ int coro_bus_try_recv_v(const coro_bus *coroutines_bus, const int channel, unsig
         return -1;
     }
 
-    if (current_channel->message_queue.empty()) {
+    const std::size_t ready_count = channel_value_count(current_channel);
+    if (ready_count == 0) {
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
     }
 
-    const unsigned to_receive = current_channel->message_queue.size() < capacity
-                                        ? static_cast<unsigned>(current_channel->message_queue.size())
-                                        : capacity;
+    const unsigned to_receive = ready_count < capacity ? static_cast<unsigned>(ready_count) : capacity;
+
+    channel_pop_values(current_channel, data, to_receive);
+
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return static_cast<int>(to_receive);
+}
+
+#endif    // NEED_BATCH
+
+////////////////////////////////////////////////////////////////////////////////
+// Generic messages.
+
+const void *coro_bus_msg_data(const coro_bus_msg *msg) {
+    return msg->heap != nullptr ? msg->heap : msg->inline_data;
+}
+
+void coro_bus_msg_destroy(coro_bus_msg *msg) {
+    std::free(msg->heap);
+    msg->heap = nullptr;
+    msg->size = 0;
+}
 
-    for (unsigned index = 0; index < to_receive; ++index) {
-        data[index] = current_channel->message_queue.front();
-        current_channel->message_queue.pop_front();
+static bool channel_fits_msg(const coro_bus_channel *channel, const std::size_t size) {
+    if (channel_free_count(channel) == 0) {
+        return false;
     }
+    // Too big messages still go through an otherwise empty channel,
+    // or they would never be sent.
+    return channel->byte_limit == 0 || channel->byte_count == 0 ||
+           channel->byte_count + size <= channel->byte_limit;
+}
 
-    for (unsigned index = 0; index < to_receive; ++index) {
-        wakeup_queue_wakeup_first(&current_channel->send_queue);
+static bool channel_push_msg(coro_bus_channel *channel, const void *ptr, const std::size_t size) {
+    if (channel->msg_queue.data == nullptr &&
+        !message_ring_create(&channel->msg_queue, channel->size_limit)) {
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return false;
+    }
+    coro_bus_msg msg;
+    msg.size = size;
+    msg.heap = nullptr;
+    if (size <= CORO_BUS_MSG_INLINE_SIZE) {
+        std::memcpy(msg.inline_data, ptr, size);
+    } else {
+        // The sender gives the buffer away.
+        msg.heap = const_cast<void *>(ptr);
     }
+    message_ring_push(&channel->msg_queue, msg);
+    channel->byte_count += size;
+    wakeup_queue_wakeup_first(&channel->msg_recv_queue);
+    ++channel->send_count;
+    channel_on_push(channel);
+    return true;
+}
 
+static void channel_pop_msgs(coro_bus_channel *channel, coro_bus_msg *msgs, const std::size_t count) {
+    message_ring_pop_n(&channel->msg_queue, msgs, count);
+    for (std::size_t index = 0; index < count; ++index) {
+        channel->byte_count -= msgs[index].size;
+    }
+    channel_on_pop(channel, count);
+}
+
+int coro_bus_try_send_msg(const coro_bus *coroutines_bus, const int channel, const void *ptr, const std::size_t size) {
+    auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    if (!channel_fits_msg(current_channel, size)) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    if (!channel_push_msg(current_channel, ptr, size)) {
+        return -1;
+    }
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
-    return static_cast<int>(to_receive);
+    return 0;
+}
+
+int coro_bus_send_msg(const coro_bus *coroutines_bus, const int channel, const void *ptr, const std::size_t size) {
+    while (true) {
+        if (coro_bus_try_send_msg(coroutines_bus, channel, ptr, size) == 0) {
+            return 0;
+        }
+        if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+            return -1;
+        }
+        auto *current_channel = get_bus_channel(coroutines_bus, channel);
+        if (!wakeup_queue_suspend_this(&current_channel->msg_send_queue)) {
+            return -1;
+        }
+    }
+}
+
+int coro_bus_try_recv_msg(const coro_bus *coroutines_bus, const int channel, coro_bus_msg *msg) {
+    assert(msg != nullptr);
+    auto *current_channel = get_bus_channel(coroutines_bus, channel);
+    if (current_channel == nullptr) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+    if (message_ring_size(&current_channel->msg_queue) == 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    channel_pop_msgs(current_channel, msg, 1);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_recv_msg(const coro_bus *coroutines_bus, const int channel, coro_bus_msg *msg) {
+    while (true) {
+        if (coro_bus_try_recv_msg(coroutines_bus, channel, msg) == 0) {
+            return 0;
+        }
+        if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+            return -1;
+        }
+        auto *current_channel = get_bus_channel(coroutines_bus, channel);
+        if (!wakeup_queue_suspend_this(&current_channel->msg_recv_queue)) {
+            return -1;
+        }
+    }
+}
+
+#if NEED_BATCH
+
+int coro_bus_send_msg_v(const coro_bus *coroutines_bus, const int channel, const coro_bus_iov *iov, const unsigned count) {
+    if (iov == nullptr && count != 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_NONE);
+        return -1;
+    }
+    while (true) {
+        auto *current_channel = get_bus_channel(coroutines_bus, channel);
+        if (current_channel == nullptr) {
+            coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+            return -1;
+        }
+        unsigned sent = 0;
+        while (sent < count && channel_fits_msg(current_channel, iov[sent].size)) {
+            if (!channel_push_msg(current_channel, iov[sent].ptr, iov[sent].size)) {
+                return sent > 0 ? static_cast<int>(sent) : -1;
+            }
+            ++sent;
+        }
+        if (sent > 0 || count == 0) {
+            coro_bus_errno_set(CORO_BUS_ERR_NONE);
+            return static_cast<int>(sent);
+        }
+        // Block only when we can't send even 1
+        if (!wakeup_queue_suspend_this(&current_channel->msg_send_queue)) {
+            return -1;
+        }
+    }
+}
+
+int coro_bus_recv_msg_v(const coro_bus *coroutines_bus, const int channel, coro_bus_msg *msgs, const unsigned capacity) {
+    if (msgs == nullptr && capacity != 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_NONE);
+        return -1;
+    }
+    while (true) {
+        auto *current_channel = get_bus_channel(coroutines_bus, channel);
+        if (current_channel == nullptr) {
+            coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+            return -1;
+        }
+        const std::size_t size = message_ring_size(&current_channel->msg_queue);
+        if (size == 0) {
+            if (!wakeup_queue_suspend_this(&current_channel->msg_recv_queue)) {
+                return -1;
+            }
+            continue;
+        }
+        const unsigned to_receive = size < capacity ? static_cast<unsigned>(size) : capacity;
+        channel_pop_msgs(current_channel, msgs, to_receive);
+        coro_bus_errno_set(CORO_BUS_ERR_NONE);
+        return static_cast<int>(to_receive);
+    }
 }
 
 #endif    // NEED_BATCH
+
+// Cross-thread channels.
+
+// The waiters on either side announce themselves in the counter before
+// the final check, and the other side posts one eventfd token per
+// operation while anyone waits. The eventfd is a semaphore, so a token
+// is never taken by more than one waiter. Only one coroutine can wait
+// on a descriptor, the others wait for it in the queue.
+struct mt_event {
+    int fd = -1;
+    std::atomic<int> waiter_count {0};
+    bool is_coro_waiting = false;
+    wakeup_queue coro_queue {};
+};
+
+struct coro_bus_mt_channel {
+    explicit coro_bus_mt_channel(const std::size_t capacity) : queue(capacity) {}
+
+    mpmc_ring<unsigned> queue;
+    mt_event not_empty;
+    mt_event not_full;
+};
+
+static bool mt_event_create(mt_event *event) {
+    event->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (event->fd < 0) {
+        return false;
+    }
+    wakeup_queue_init(&event->coro_queue);
+    return true;
+}
+
+static void mt_event_destroy(mt_event *event) {
+    if (event->fd >= 0) {
+        close(event->fd);
+    }
+}
+
+static void mt_event_post(mt_event *event) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (event->waiter_count.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::uint64_t one = 1;
+    const ssize_t rc = write(event->fd, &one, sizeof(one));
+    assert(rc == sizeof(one));
+    (void)rc;
+}
+
+static void mt_event_take_token(const mt_event *event) {
+    std::uint64_t token;
+    // Can be taken by another waiter already, then it is a spurious
+    // wakeup.
+    const ssize_t rc = read(event->fd, &token, sizeof(token));
+    (void)rc;
+}
+
+// Returns false, with the errno set, if the coroutine is cancelled.
+// Otherwise the caller must retry its operation.
+static bool mt_event_wait(mt_event *event, const coro_bus_mt_channel *channel,
+                          bool (*is_ready)(const coro_bus_mt_channel *)) {
+    const bool is_coro = coro_this() != nullptr;
+    // Who is woken up here takes the descriptor, or passes the wakeup
+    // on if doesn't have to wait.
+    while (is_coro && event->is_coro_waiting) {
+        if (!wakeup_queue_suspend_this(&event->coro_queue)) {
+            return false;
+        }
+    }
+    event->waiter_count.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool is_ok = true;
+    if (!is_ready(channel)) {
+        if (is_coro) {
+            event->is_coro_waiting = true;
+            if (coro_wait_fd(event->fd, CORO_FD_READ, -1) < 0 && errno == ECANCELED) {
+                coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+                is_ok = false;
+            }
+            event->is_coro_waiting = false;
+        } else {
+            pollfd pfd {event->fd, POLLIN, 0};
+            while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+            }
+        }
+        mt_event_take_token(event);
+    }
+    event->waiter_count.fetch_sub(1, std::memory_order_relaxed);
+    if (is_coro) {
+        // Let the next coroutine take the descriptor.
+        wakeup_queue_wakeup_first(&event->coro_queue);
+    }
+    return is_ok;
+}
+
+static bool mt_channel_has_data(const coro_bus_mt_channel *channel) {
+    return channel->queue.can_pop();
+}
+
+static bool mt_channel_has_space(const coro_bus_mt_channel *channel) {
+    return channel->queue.can_push();
+}
+
+coro_bus_mt_channel *coro_bus_mt_channel_new(const std::size_t size_limit) {
+    std::size_t capacity = 2;
+    while (capacity < size_limit) {
+        // A ring cell is the value with its sequence number.
+        if (capacity > SIZE_MAX / 2 / (sizeof(std::size_t) + sizeof(unsigned))) {
+            coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+            return nullptr;
+        }
+        capacity *= 2;
+    }
+    coro_bus_mt_channel *channel;
+    try {
+        channel = new coro_bus_mt_channel(capacity);
+    } catch (const std::bad_alloc &) {
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return nullptr;
+    }
+    if (!mt_event_create(&channel->not_empty) || !mt_event_create(&channel->not_full)) {
+        coro_bus_mt_channel_delete(channel);
+        coro_bus_errno_set(CORO_BUS_MEMORY_ERR);
+        return nullptr;
+    }
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return channel;
+}
+
+void coro_bus_mt_channel_delete(coro_bus_mt_channel *channel) {
+    if (channel == nullptr) {
+        return;
+    }
+    mt_event_destroy(&channel->not_empty);
+    mt_event_destroy(&channel->not_full);
+    delete channel;
+}
+
+int coro_bus_mt_try_send(coro_bus_mt_channel *channel, const unsigned data) {
+    if (!channel->queue.push(data)) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    mt_event_post(&channel->not_empty);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_mt_send(coro_bus_mt_channel *channel, const unsigned data) {
+    while (coro_bus_mt_try_send(channel, data) != 0) {
+        if (!mt_event_wait(&channel->not_full, channel, mt_channel_has_space)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int coro_bus_mt_try_recv(coro_bus_mt_channel *channel, unsigned *data) {
+    if (!channel->queue.pop(*data)) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+    mt_event_post(&channel->not_full);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+    return 0;
+}
+
+int coro_bus_mt_recv(coro_bus_mt_channel *channel, unsigned *data) {
+    while (coro_bus_mt_try_recv(channel, data) != 0) {
+        if (!mt_event_wait(&channel->not_empty, channel, mt_channel_has_data)) {
+            return -1;
+        }
+    }
+    return 0;
+}
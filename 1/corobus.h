@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 /**
  * Here you should specify which bonuses do you want via the
@@ -16,10 +17,66 @@ enum coro_bus_error_code {
     CORO_BUS_ERR_WOULD_BLOCK,
     CORO_BUS_ERR_NOT_IMPLEMENTED,
     CORO_BUS_MEMORY_ERR,
+    /** The waiting coroutine was cancelled with coro_cancel(). */
+    CORO_BUS_ERR_CANCELLED,
+    /** A timed operation couldn't complete in time. */
+    CORO_BUS_ERR_TIMEOUT,
 };
 
 struct coro_bus;
 
+enum {
+    /** Generic messages up to this size are copied into the channel. */
+    CORO_BUS_MSG_INLINE_SIZE = 48,
+    /**
+     * Expedited messages a channel holds at once, besides its size
+     * limit.
+     */
+    CORO_BUS_EXPEDITED_SIZE = 16,
+};
+
+/**
+ * A received generic message. Small ones carry the payload inside,
+ * large ones own a buffer allocated with malloc(). The receiver must
+ * call coro_bus_msg_destroy(), or take the ownership over @a heap.
+ */
+struct coro_bus_msg {
+    /** Payload size in bytes. */
+    size_t size;
+    /** Payload of a large message. NULL for small ones. */
+    void *heap;
+    /** Payload of a small message. */
+    unsigned char inline_data[CORO_BUS_MSG_INLINE_SIZE];
+};
+
+/** A generic message to send in a batch. */
+struct coro_bus_iov {
+    const void *ptr;
+    size_t size;
+};
+
+/**
+ * Counters of a channel, or of the whole bus. The messages sent
+ * count the broadcasts too. A message sent right into a suspended
+ * receiver is counted, but increases no size.
+ */
+struct coro_bus_stats {
+    uint64_t send_count;
+    uint64_t recv_count;
+    /** The biggest number of messages the channel has held at once. */
+    size_t max_size;
+    /** How many times the senders got suspended on a full channel. */
+    uint64_t send_wait_count;
+    /** Total time spent by the senders in suspension. */
+    uint64_t send_wait_ns;
+    /** How many times the receivers got suspended on an empty channel. */
+    uint64_t recv_wait_count;
+    /** Total time spent by the receivers in suspension. */
+    uint64_t recv_wait_ns;
+    /** Messages which went into the overflow file. */
+    uint64_t overflow_count;
+};
+
 /** Get the latest error happened in coro_bus. */
 coro_bus_error_code coro_bus_errno();
 
@@ -47,6 +104,39 @@ void coro_bus_delete(coro_bus *coroutines_bus);
  */
 int coro_bus_channel_open(coro_bus *coroutines_bus, size_t size_limit);
 
+/**
+ * Same as coro_bus_channel_open(), but the generic messages are
+ * also limited by their total size.
+ * @param byte_limit Maximum bytes of the generic messages the
+ *     channel can hold at once. 0 means no limit. A single message
+ *     bigger than that still can be sent into a channel having
+ *     no bytes.
+ */
+int coro_bus_channel_open_ex(coro_bus *coroutines_bus, size_t size_limit, size_t byte_limit);
+
+/**
+ * Let the channel take the unsigned messages over its size limit
+ * instead of blocking the senders. They are appended to a file
+ * mapped into memory, and go into the channel in their order as the
+ * receivers free the space. Only when the file is full too, the
+ * senders block. The broadcasts and the generic messages don't go
+ * there, and a broadcast can get ahead of the messages in the file.
+ * The file is created in the directory and deleted right away, it
+ * is gone with the channel.
+ * @param dir Directory for the file.
+ * @param file_limit Maximum size of the file in bytes, rounded down
+ *     to a power of two of the messages, but at least a page. 0
+ *     removes the file.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel has messages in its
+ *       current file.
+ *     - CORO_BUS_MEMORY_ERR - couldn't create or map the file.
+ */
+int coro_bus_channel_set_overflow(const coro_bus *coroutines_bus, int channel, const char *dir, size_t file_limit);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -57,6 +147,20 @@ int coro_bus_channel_open(coro_bus *coroutines_bus, size_t size_limit);
  */
 void coro_bus_channel_close(const coro_bus *coroutines_bus, int channel);
 
+/**
+ * Get the counters of the channel.
+ * @param coroutines_bus Bus where the channel is located.
+ * @param channel Descriptor of the channel, or -1 for the totals of
+ *     the whole bus, including the closed channels. max_size is the
+ *     biggest of the channels then.
+ * @param[out] stats The counters.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int coro_bus_stats(const coro_bus *coroutines_bus, int channel, struct coro_bus_stats *stats);
+
 /**
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
@@ -71,6 +175,17 @@ void coro_bus_channel_close(const coro_bus *coroutines_bus, int channel);
  */
 int coro_bus_send(const coro_bus *coroutines_bus, int channel, unsigned data);
 
+/**
+ * Same as coro_bus_send(), but waits no longer than the timeout.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int coro_bus_send_timed(const coro_bus *coroutines_bus, int channel, unsigned data, double timeout);
+
 /**
  * Same as coro_bus_send(), but if the channel is full, the
  * function immediately returns. It never suspends the current
@@ -101,6 +216,17 @@ int coro_bus_try_send(const coro_bus *coroutines_bus, int channel, unsigned data
  */
 int coro_bus_recv(const coro_bus *coroutines_bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_recv(), but waits no longer than the timeout.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int coro_bus_recv_timed(const coro_bus *coroutines_bus, int channel, unsigned *data, double timeout);
+
 /**
  * Same as coro_bus_recv(), but if the channel is empty, the
  * function immediately returns. It never suspends the current
@@ -117,6 +243,81 @@ int coro_bus_recv(const coro_bus *coroutines_bus, int channel, unsigned *data);
  */
 int coro_bus_try_recv(const coro_bus *coroutines_bus, int channel, unsigned *data);
 
+/**
+ * Receive a message from whichever of the channels has one first.
+ * If all of them are empty, the coroutine is suspended on all of
+ * them at once until any gets a message or is gone.
+ * @param coroutines_bus Bus where the channels are located.
+ * @param channels Descriptors of the channels to recv data from.
+ * @param count Size of @a channels.
+ * @param data Output parameter to save the data to.
+ * @param which Output parameter to save the index in @a channels
+ *     of the channel the message is received from. Or of the missing
+ *     channel on the CORO_BUS_ERR_NO_CHANNEL error.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't exist,
+ *       or no channels are given.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine was cancelled.
+ */
+int coro_bus_select(const coro_bus *coroutines_bus, const int *channels, int count, unsigned *data, int *which);
+
+/**
+ * Control traffic ahead of the bulk one. Within a channel the
+ * expedited messages go before all the queued ones, in a small lane
+ * of their own, so they can be sent into a channel full of the usual
+ * messages. Between the channels coro_bus_select_weighted() serves
+ * the ones with the expedited messages first, then the highest
+ * priority, and the channels of the same priority in proportion to
+ * their weights. Only the unsigned messages have the lane.
+ */
+
+/**
+ * Set how coro_bus_select_weighted() serves the channel. A new
+ * channel has priority 0 and weight 1.
+ * @param priority The channels of a higher one are served first.
+ * @param weight Share of the channel among the ones of the same
+ *     priority. 0 is taken as 1.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int coro_bus_channel_set_priority(const coro_bus *coroutines_bus, int channel, int priority, unsigned weight);
+
+/**
+ * Same as coro_bus_send(), but the message is received before the
+ * ones already queued. If the channel has CORO_BUS_EXPEDITED_SIZE
+ * of them, then the coroutine is suspended until one is received.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_MEMORY_ERR - no memory for the expedited messages.
+ */
+int coro_bus_send_expedited(const coro_bus *coroutines_bus, int channel, unsigned data);
+
+/**
+ * Same as coro_bus_send_expedited(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the expedited lane is full.
+ *     - CORO_BUS_MEMORY_ERR - no memory for the expedited messages.
+ */
+int coro_bus_try_send_expedited(const coro_bus *coroutines_bus, int channel, unsigned data);
+
+/**
+ * Same as coro_bus_select(), but the message is taken from the
+ * channel with expedited messages, or else of the highest priority.
+ * Among the channels of the same priority each gets its weight's
+ * share of the receives while they have messages, interleaved.
+ */
+int coro_bus_select_weighted(const coro_bus *coroutines_bus, const int *channels, int count, unsigned *data,
+                             int *which);
+
 #if NEED_BROADCAST /* Bonus 1 */
 
 /**
@@ -133,6 +334,18 @@ int coro_bus_try_recv(const coro_bus *coroutines_bus, int channel, unsigned *dat
  */
 int coro_bus_broadcast(const coro_bus *coroutines_bus, unsigned data);
 
+/**
+ * Same as coro_bus_broadcast(), but waits no longer than the
+ * timeout.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval 0 Success. Sent to all the channels.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_TIMEOUT - some channel stayed full.
+ */
+int coro_bus_broadcast_timed(const coro_bus *coroutines_bus, unsigned data, double timeout);
+
 /**
  * Same as coro_bus_broadcast(), but if any of the channels are
  * full, it instantly returns, not suspends.
@@ -169,6 +382,18 @@ int coro_bus_try_broadcast(const coro_bus *current_coroutine_bus, unsigned data)
  */
 int coro_bus_send_v(const coro_bus *coroutines_bus, int channel, const unsigned *data, unsigned count);
 
+/**
+ * Same as coro_bus_send_v(), but waits no longer than the timeout.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval >0 How many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int coro_bus_send_v_timed(const coro_bus *coroutines_bus, int channel, const unsigned *data, unsigned count,
+                          double timeout);
+
 /**
  * Same as coro_bus_send_v(), but fails instantly in case the
  * channel is full and doesn't fit a single message.
@@ -206,6 +431,18 @@ int coro_bus_try_send_v(const struct coro_bus *coroutines_bus, int channel, cons
  */
 int coro_bus_recv_v(const coro_bus *coroutines_bus, int channel, unsigned *data, unsigned capacity);
 
+/**
+ * Same as coro_bus_recv_v(), but waits no longer than the timeout.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval >0 How many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int coro_bus_recv_v_timed(const coro_bus *coroutines_bus, int channel, unsigned *data, unsigned capacity,
+                          double timeout);
+
 /**
  * Same as coro_bus_recv_v(), but fails instantly if the channel
  * is empty.
@@ -225,3 +462,142 @@ int coro_bus_recv_v(const coro_bus *coroutines_bus, int channel, unsigned *data,
 int coro_bus_try_recv_v(const coro_bus *coroutines_bus, int channel, unsigned *data, unsigned capacity);
 
 #endif /* Bonus 2 */
+
+/**
+ * Generic messages. They go through the same channels as the
+ * unsigned ones and count against the same size limit, but are
+ * queued separately - the order between the two kinds is not kept.
+ */
+
+/** Payload of a received message. */
+const void *coro_bus_msg_data(const coro_bus_msg *msg);
+
+/** Free the payload of a received message, if it owns one. */
+void coro_bus_msg_destroy(coro_bus_msg *msg);
+
+/**
+ * Send a message of any size. Small ones, up to
+ * CORO_BUS_MSG_INLINE_SIZE, are copied. Bigger ones are handed over
+ * without copying: @a ptr must be allocated with malloc(), and on
+ * success it belongs to the receiver. Blocks the same as
+ * coro_bus_send(), also when the byte limit is reached.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason. The message
+ *     stays with the caller.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_MEMORY_ERR - no memory for the generic messages.
+ */
+int coro_bus_send_msg(const coro_bus *coroutines_bus, int channel, const void *ptr, size_t size);
+
+/**
+ * Same as coro_bus_send_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_MEMORY_ERR - no memory for the generic messages.
+ */
+int coro_bus_try_send_msg(const coro_bus *coroutines_bus, int channel, const void *ptr, size_t size);
+
+/**
+ * Receive a generic message. Blocks the same as coro_bus_recv().
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int coro_bus_recv_msg(const coro_bus *coroutines_bus, int channel, coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but never suspends.
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no generic messages.
+ */
+int coro_bus_try_recv_msg(const coro_bus *coroutines_bus, int channel, coro_bus_msg *msg);
+
+#if NEED_BATCH
+
+/**
+ * Send as many generic messages as fit, same as coro_bus_send_v().
+ * The sent big ones are handed over like in coro_bus_send_msg().
+ *
+ * @retval >0 Success, how many first messages of @a iov were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ */
+int coro_bus_send_msg_v(const coro_bus *coroutines_bus, int channel, const coro_bus_iov *iov, unsigned count);
+
+/**
+ * Receive as many generic messages as there are, up to @a capacity,
+ * same as coro_bus_recv_v().
+ *
+ * @retval >0 Success, how many messages were stored into @a msgs.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ */
+int coro_bus_recv_msg_v(const coro_bus *coroutines_bus, int channel, coro_bus_msg *msgs, unsigned capacity);
+
+#endif /* NEED_BATCH */
+
+/**
+ * A channel to pass messages between the OS threads and the
+ * coroutines. Any thread can send and receive, inside or outside
+ * of a coroutine. Blocking calls suspend the coroutine, or block
+ * the thread when called not in a coroutine. The coroutines of
+ * one channel must all run in one thread.
+ */
+struct coro_bus_mt_channel;
+
+/**
+ * Create a cross-thread channel.
+ * @param size_limit Maximum messages the channel holds at once,
+ *     rounded up to a power of two.
+ *
+ * @retval Not NULL The channel.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_MEMORY_ERR - no memory or descriptors.
+ */
+coro_bus_mt_channel *coro_bus_mt_channel_new(size_t size_limit);
+
+/**
+ * Delete the channel with all its messages. Nobody can be waiting
+ * on it or use it anymore.
+ */
+void coro_bus_mt_channel_delete(coro_bus_mt_channel *channel);
+
+/**
+ * Same as coro_bus_send(), but for the cross-thread channel. Can
+ * block the thread when not called in a coroutine.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine was cancelled.
+ */
+int coro_bus_mt_send(coro_bus_mt_channel *channel, unsigned data);
+
+/**
+ * Same as coro_bus_mt_send(), but never waits.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int coro_bus_mt_try_send(coro_bus_mt_channel *channel, unsigned data);
+
+/**
+ * Same as coro_bus_recv(), but for the cross-thread channel. Can
+ * block the thread when not called in a coroutine.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine was cancelled.
+ */
+int coro_bus_mt_recv(coro_bus_mt_channel *channel, unsigned *data);
+
+/**
+ * Same as coro_bus_mt_recv(), but never waits.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int coro_bus_mt_try_recv(coro_bus_mt_channel *channel, unsigned *data);
@@ -1,6 +1,7 @@
 #include "libcoro.h"
 
 #include "rlist.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -11,6 +12,107 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if LIBCORO_STATS && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define CORO_USE_EPOLL 1
+#else
+#define CORO_USE_EPOLL 0
+#endif
+
+/*
+ * By default the coroutines switch with a hand-written routine,
+ * which saves only the callee-saved registers and the stack
+ * pointer. That doesn't do any syscalls. The fallback creates
+ * the coroutines via sigaltstack() and switches them via
+ * sigsetjmp()/siglongjmp(). It works on any POSIX system.
+ */
+#ifndef LIBCORO_ASM_SWITCH
+#define LIBCORO_ASM_SWITCH 1
+#endif
+
+#if LIBCORO_ASM_SWITCH && defined(__ELF__) && \
+	(defined(__x86_64__) || defined(__aarch64__))
+#define CORO_USE_ASM_SWITCH 1
+#else
+#define CORO_USE_ASM_SWITCH 0
+#endif
+
+/*
+ * The M:N mode moves the coroutines between the threads, which
+ * the signal-based contexts can't survive. The sleeping threads
+ * are woken up via eventfd in their epoll.
+ */
+#if CORO_USE_ASM_SWITCH && CORO_USE_EPOLL
+#define CORO_USE_MT 1
+#else
+#define CORO_USE_MT 0
+#endif
+
+/*
+ * The scheduler statistics are collected only when requested at
+ * build time. They take a couple of timestamps per switch.
+ */
+#ifndef LIBCORO_STATS
+#define LIBCORO_STATS 0
+#endif
+
+/*
+ * The stack profiler fills every stack with a pattern before the
+ * coroutine function runs, and finds how much of it was touched
+ * after. It is for debug only, because it uses all the stack
+ * memory and is slow.
+ */
+#ifndef LIBCORO_STACK_PROFILE
+#define LIBCORO_STACK_PROFILE 0
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+enum {
+	CORO_DEFAULT_STACK_SIZE = 1024 * 1024,
+	/**
+	 * Stack sizes are rounded up to the powers of 2 starting
+	 * from 16KB. Each class has its own pool. The bigger
+	 * stacks are not pooled.
+	 */
+	CORO_STACK_CLASS_MIN_LOG2 = 14,
+	CORO_STACK_CLASS_COUNT = 10,
+	CORO_STACK_CLASS_MAX_SIZE = 1 << (CORO_STACK_CLASS_MIN_LOG2 +
+		CORO_STACK_CLASS_COUNT - 1),
+	/**
+	 * How many coroutines in a row can be taken from the
+	 * higher priority queues while the lower ones wait.
+	 */
+	CORO_STARVATION_LIMIT = 32,
+	/**
+	 * While there are runnable coroutines, the descriptors
+	 * are still checked once per this number of iterations.
+	 * So the IO waiters are not starved.
+	 */
+	CORO_IO_POLL_PERIOD = 64,
+	CORO_IO_EVENT_BATCH = 64,
+	/** Spins on a busy lock before yielding the CPU. */
+	CORO_SPIN_LIMIT = 128,
+};
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -29,20 +131,122 @@ struct coro {
 	enum coro_state state;
 	/** A value, returned by func. */
 	void *ret;
-	/** Stack, used by the coroutine. */
+	/**
+	 * Stack, used by the coroutine. It is preceded by a guard
+	 * page, so an overflow crashes instead of corrupting the
+	 * neighbour memory.
+	 */
 	uint8_t *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
+	/** Scheduling priority class. */
+	enum coro_priority priority;
+	/** Whether the coroutine goes to the pool after join. */
+	bool is_pooled;
+	/** Whether the last timed suspension has ended by timeout. */
+	bool is_timed_out;
+	/**
+	 * Whether registered in the epoll of the engine. Such a
+	 * coroutine, as well as a one in the timer heap, can't be
+	 * moved to another engine.
+	 */
+	bool is_waiting_fd;
+	/**
+	 * Whether suspended without a timer or a descriptor, so
+	 * only an explicit wakeup can resume it. Those are not
+	 * counted as active.
+	 */
+	bool is_inactive;
+	/**
+	 * A wakeup from another thread came while the coroutine
+	 * was running. The next suspension returns immediately
+	 * instead of losing it.
+	 */
+	bool is_wakeup_pending;
+	/**
+	 * The coroutine is cancelled. It doesn't suspend anymore,
+	 * only yields, so the waits return and can check the flag.
+	 */
+	bool is_cancelled;
+	/** Position in the timer heap. -1 when not there. */
+	int timer_idx;
+	/** When to wake the coroutine up, if it is in the timer heap. */
+	uint64_t deadline;
+	/** Name for debugging. */
+	char name[CORO_NAME_MAX];
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+	/** Values of the coroutine-local keys. */
+	void *locals[CORO_KEY_MAX];
+#if CORO_USE_ASM_SWITCH
+	/**
+	 * Last remembered stack position. The callee-saved
+	 * registers are stored on the stack right below it.
+	 */
+	void *sp;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#endif
+	/**
+	 * Engine which the coroutine belongs to. In the M:N mode
+	 * it changes when the coroutine is stolen by another
+	 * worker. Is protected by the lock of the old engine.
+	 */
+	struct coro_engine *engine;
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
+	/** Group the coroutine is spawned in, if any. */
+	struct coro_group *group;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+#if LIBCORO_STATS
+	/** Number of times the coroutine was resumed. */
+	uint64_t resume_count;
+	/** Ticks spent running. */
+	uint64_t run_ticks;
+	/** Ticks spent in the run queues. */
+	uint64_t wait_ticks;
+	/** When the coroutine was resumed last time. */
+	uint64_t resume_ticks;
+	/** When the coroutine was put into a run queue last time. */
+	uint64_t queue_ticks;
+#endif
+};
+
+struct coro_stack_class {
+	/** Pooled coroutines with this stack size. */
+	struct rlist pool;
+	/** Number of coroutines in the pool. */
+	size_t pool_size;
+};
+
+/** A coroutine waiting for events on a descriptor. */
+struct coro_fd_waiter {
+	/** The waiting coroutine. */
+	struct coro *coro;
+	/** Ready events, CORO_FD_* mask. */
+	int revents;
+};
+
+struct coro_run_queue {
+	/**
+	 * Coroutines to run in this iteration of the loop. The
+	 * list gets populated at the start of the iteration. The
+	 * high priority ones also get here when woken up, to run
+	 * before the rest of the iteration.
+	 */
+	struct rlist now;
+	/**
+	 * Coroutines to run in the next iteration of the loop.
+	 * The list gets populated by wakeups and yields and new
+	 * coros.
+	 */
+	struct rlist next;
 };
 
 struct coro_engine {
@@ -53,58 +257,780 @@ struct coro_engine {
 	struct coro sched;
 	/** Which coroutine works at this moment. */
 	struct coro *this_coro;
+	/**
+	 * Whether the engine is one of the M:N workers. Then the
+	 * run queues and the states of its coroutines are
+	 * protected by the lock. Otherwise it is not used.
+	 */
+	bool is_mt;
+	/**
+	 * Spinlock. It is held across the context switches, and
+	 * is released by the resumed coroutine. So no other
+	 * thread can see a coroutine in a queue before its
+	 * context is saved.
+	 */
+	int lock;
+	/**
+	 * Joiner of a coroutine which has just finished. It is
+	 * woken up after the switch and the unlock, because it
+	 * might belong to another engine. The finished coroutine
+	 * is counted as active until then, so the workers don't
+	 * stop in between.
+	 */
+	struct coro *deferred_wakeup;
+	/** Index in the worker list. */
+	int worker_id;
+	/** Whether the worker is going to sleep or sleeps. */
+	bool is_sleeping;
+	/** Eventfd to wake the sleeping worker up. */
+	int event_fd;
 
+	/** Run queues, one per priority class. */
+	struct coro_run_queue run_queues[CORO_PRIORITY_COUNT];
+	/** Number of coroutines in all the run queues. */
+	int run_count;
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * How many coroutines were taken in a row from a queue
+	 * having lower priority queues not empty.
 	 */
-	struct rlist coros_running_now;
+	int starvation_count;
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Min-heap of the coroutines suspended with a timeout, by
+	 * their deadlines.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
+	struct coro **timers;
+	int timer_count;
+	int timer_capacity;
+	/** Epoll descriptor, created on the first descriptor wait. */
+	int epoll_fd;
+	/** Number of coroutines waiting for descriptor events. */
+	int fd_wait_count;
+	/** Iterations since the last check of the descriptors. */
+	int io_skip_count;
+	/** Joined coroutines to be reused, by stack size class. */
+	struct coro_stack_class stack_classes[CORO_STACK_CLASS_COUNT];
+	/** Max number of pooled coroutines in each stack class. */
+	size_t pool_limit;
+	/** Default stack size of the new coroutines. */
+	size_t stack_size;
+#if !CORO_USE_ASM_SWITCH
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
 	 * rollback sigaltstack etc.
 	 */
 	sigjmp_buf start_point;
+#endif
+#if LIBCORO_STATS
+	/** Number of context switches, the scheduler included. */
+	uint64_t switch_count;
+	/** Number of coroutines taken from the pool. */
+	uint64_t pool_hit_count;
+	/** Number of coroutines created anew. */
+	uint64_t spawn_new_count;
+#endif
 };
 
+/** All the engines and the state shared by them. */
+struct coro_workers {
+	/** All the engines, the first one is the global one. */
+	struct coro_engine **engines;
+	/** Number of the engines. 1 means the M:N mode is off. */
+	int count;
+	/**
+	 * Number of coroutines which are running, ready to run, or
+	 * waiting for a timer or a descriptor. When it drops to 0,
+	 * nothing can wake the others up anymore, and the workers
+	 * stop.
+	 */
+	int active_count;
+	/** Number of the workers sleeping for lack of work. */
+	int sleeper_count;
+	/** Whether the workers should stop. */
+	bool is_done;
+	/** Total number of coroutines, including the pools. */
+	size_t coro_count;
+#if LIBCORO_STATS
+	/** Max coro_count ever reached. */
+	size_t coro_count_peak;
+	/** When the statistics started, to turn the ticks into time. */
+	uint64_t stats_start_ticks;
+	uint64_t stats_start_ns;
+#endif
+};
+
+static struct coro_engine glob_engine;
+static struct coro_workers workers;
+
+/**
+ * Engine of the thread running the scheduler. NULL in the other
+ * threads.
+ */
+static __thread struct coro_engine *coro_thread_engine = NULL;
+
+/**
+ * Not inlined, because a coroutine can be resumed by another
+ * thread, and the compiler may cache the thread-local address
+ * across a context switch.
+ */
+static struct coro_engine * __attribute__((noinline))
+coro_engine_of_thread(void)
+{
+	return coro_thread_engine;
+}
+
+/** Engine of the calling thread. */
+static struct coro_engine *
+coro_engine_current(void)
+{
+	struct coro_engine *engine = coro_engine_of_thread();
+	return engine != NULL ? engine : &glob_engine;
+}
+
+/**
+ * The coroutine running in the calling thread. The threads not
+ * running the scheduler have none, even though they share the
+ * global engine.
+ */
+static struct coro *
+coro_current(void)
+{
+	struct coro_engine *engine = coro_engine_of_thread();
+	return engine != NULL ? engine->this_coro : NULL;
+}
+
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if LIBCORO_STATS
+
+/**
+ * A cheap timestamp. Its frequency is found by comparing with the
+ * clock since the start.
+ */
+static uint64_t
+coro_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t res;
+	asm volatile("mrs %0, cntvct_el0" : "=r"(res));
+	return res;
+#else
+	return coro_clock_ns();
+#endif
+}
+
+static uint64_t
+coro_ticks_to_ns(uint64_t ticks)
+{
+	uint64_t total_ticks = coro_ticks() - workers.stats_start_ticks;
+	uint64_t total_ns = coro_clock_ns() - workers.stats_start_ns;
+	if (total_ticks == 0)
+		return 0;
+	return (uint64_t)((double)ticks * total_ns / total_ticks);
+}
+
+static void
+coro_stats_on_queue(struct coro *c)
+{
+	c->queue_ticks = coro_ticks();
+}
+
+static void
+coro_stats_on_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_ticks();
+	++engine->switch_count;
+	if (from != &engine->sched)
+		from->run_ticks += now - from->resume_ticks;
+	if (to != &engine->sched) {
+		to->wait_ticks += now - to->queue_ticks;
+		to->resume_ticks = now;
+		++to->resume_count;
+	}
+}
+
+static void
+coro_stats_on_count(size_t count)
+{
+	size_t peak = __atomic_load_n(&workers.coro_count_peak,
+		__ATOMIC_RELAXED);
+	while (count > peak &&
+	       !__atomic_compare_exchange_n(&workers.coro_count_peak, &peak,
+					    count, true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+}
+
+#else /* !LIBCORO_STATS */
+
+#define coro_stats_on_queue(c) do { (void)(c); } while (0)
+#define coro_stats_on_switch(engine, from, to) do {			\
+	(void)(engine); (void)(from); (void)(to);			\
+} while (0)
+#define coro_stats_on_count(count) do { (void)(count); } while (0)
+
+#endif /* !LIBCORO_STATS */
+
+static void
+coro_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+static bool
+coro_spin_trylock(int *lock)
+{
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void
+coro_spin_lock(int *lock)
+{
+	int spin_count = 0;
+	while (!coro_spin_trylock(lock)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+			if (++spin_count < CORO_SPIN_LIMIT) {
+				coro_cpu_relax();
+				continue;
+			}
+			spin_count = 0;
+			sched_yield();
+		}
+	}
+}
+
+static void
+coro_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static void
+coro_mt_wakeup(struct coro_engine *waker, struct coro *coro);
+
+static void
+coro_engine_add_run_count(struct coro_engine *engine, int delta)
+{
+	/* Also read by the thieves without the lock. */
+	__atomic_store_n(&engine->run_count, engine->run_count + delta,
+		__ATOMIC_RELAXED);
+}
+
+/**
+ * Wake a sleeping worker up. Only once per its sleep, so the busy
+ * workers don't flood it.
+ */
+static void
+coro_engine_notify(struct coro_engine *engine)
+{
+	if (!__atomic_exchange_n(&engine->is_sleeping, false,
+				 __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	ssize_t rc = write(engine->event_fd, &one, sizeof(one));
+	assert(rc == sizeof(one));
+	(void)rc;
+}
+
+static void
+coro_workers_stop(void)
+{
+	__atomic_store_n(&workers.is_done, true, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < workers.count; ++i)
+		coro_engine_notify(workers.engines[i]);
+}
+
+static void
+coro_active_add(struct coro_engine *engine, int delta)
+{
+	if (!engine->is_mt) {
+		workers.active_count += delta;
+		return;
+	}
+	if (__atomic_add_fetch(&workers.active_count, delta,
+			       __ATOMIC_SEQ_CST) == 0)
+		coro_workers_stop();
+}
+
+static void
+coro_engine_lock(struct coro_engine *engine)
+{
+	if (engine->is_mt)
+		coro_spin_lock(&engine->lock);
+}
+
+static void
+coro_engine_unlock(struct coro_engine *engine)
+{
+	if (!engine->is_mt)
+		return;
+	struct coro *deferred = engine->deferred_wakeup;
+	engine->deferred_wakeup = NULL;
+	coro_spin_unlock(&engine->lock);
+	if (deferred != NULL) {
+		coro_mt_wakeup(engine, deferred);
+		coro_active_add(engine, -1);
+	}
+}
+
+/**
+ * Lock the engine owning the coroutine. It might change until
+ * the lock is taken.
+ */
+static struct coro_engine *
+coro_lock_owner(struct coro *c)
+{
+	while (true) {
+		struct coro_engine *engine =
+			__atomic_load_n(&c->engine, __ATOMIC_ACQUIRE);
+		coro_engine_lock(engine);
+		if (engine == __atomic_load_n(&c->engine, __ATOMIC_RELAXED))
+			return engine;
+		coro_engine_unlock(engine);
+	}
+}
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+static size_t
+coro_stack_size_normalize(size_t size)
+{
+	size_t page_size = coro_page_size();
+	if (size == 0)
+		size = CORO_DEFAULT_STACK_SIZE;
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+	if (size > CORO_STACK_CLASS_MAX_SIZE)
+		return (size + page_size - 1) & ~(page_size - 1);
+	size_t class_size = (size_t)1 << CORO_STACK_CLASS_MIN_LOG2;
+	while (class_size < size)
+		class_size <<= 1;
+	if (class_size < page_size)
+		class_size = page_size;
+	return class_size;
+}
+
+/** Stack size to allocate for the given usable size. */
+static size_t
+coro_stack_size_for(size_t size)
+{
+#if !CORO_USE_ASM_SWITCH
+	/*
+	 * The coroutines start in a signal handler, and its frame
+	 * stays on top of the stack forever. With the big vector
+	 * registers it takes more than 10KB.
+	 */
+	long frame_size = MINSIGSTKSZ;
+#ifdef _SC_MINSIGSTKSZ
+	if (sysconf(_SC_MINSIGSTKSZ) > frame_size)
+		frame_size = sysconf(_SC_MINSIGSTKSZ);
+#endif
+	if (size != 0)
+		size += frame_size;
+#endif
+	return coro_stack_size_normalize(size);
+}
+
+/**
+ * Stack class index of the normalized stack size. -1 if the
+ * size is not pooled.
+ */
+static int
+coro_stack_class_idx(size_t size)
+{
+	if (size > CORO_STACK_CLASS_MAX_SIZE)
+		return -1;
+	int idx = 0;
+	while (((size_t)1 << (CORO_STACK_CLASS_MIN_LOG2 + idx)) < size)
+		++idx;
+	assert(((size_t)1 << (CORO_STACK_CLASS_MIN_LOG2 + idx)) == size);
+	return idx;
+}
+
+/**
+ * The stack is reserved with mmap() and is not backed by physical
+ * memory until touched. Also it is not accounted as committed
+ * memory, so a huge number of the coroutines can be created
+ * while they use only a small part of their stacks. The lowest
+ * page is not accessible to catch an overflow.
+ */
+static void
+coro_stack_create(struct coro *c, size_t size)
+{
+	size_t page_size = coro_page_size();
+	assert(size == coro_stack_size_normalize(size));
+	uint8_t *map = (uint8_t *)mmap(NULL, size + page_size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	/*
+	 * The guard splits the mapping in two. With very many
+	 * coroutines that can hit the process limit on the mapping
+	 * count. Then the stack still works, just without the
+	 * guard.
+	 */
+	if (mprotect(map, page_size, PROT_NONE) != 0 && errno != ENOMEM)
+		handle_error();
+	c->stack = map + page_size;
+	c->stack_size = size;
+}
+
+static void
+coro_stack_destroy(struct coro *c)
+{
+	size_t page_size = coro_page_size();
+	if (munmap(c->stack - page_size, c->stack_size + page_size) != 0)
+		handle_error();
+	c->stack = NULL;
+	c->stack_size = 0;
+}
+
 static void
 coro_engine_create(struct coro_engine *engine)
 {
 	memset(engine, 0, sizeof(*engine));
+	engine->stack_size = coro_stack_size_normalize(0);
+	engine->sched.engine = engine;
+	engine->sched.timer_idx = -1;
+	engine->epoll_fd = -1;
+	engine->event_fd = -1;
 	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		rlist_create(&engine->run_queues[i].now);
+		rlist_create(&engine->run_queues[i].next);
+	}
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&engine->stack_classes[i].pool);
+	engine->pool_limit = SIZE_MAX;
 }
 
+#if CORO_USE_ASM_SWITCH
+
+/**
+ * Save the callee-saved registers of the current context on its
+ * stack, remember the stack pointer in @a from_sp, and restore
+ * the context saved at @a to_sp. Floating point control state is
+ * not saved - it is shared by all the coroutines of the thread.
+ */
+extern "C" void
+coro_asm_switch(void **from_sp, void *to_sp);
+
+/**
+ * First instruction of each new coroutine. The initial stack is
+ * built so that coro_asm_switch() "returns" here with the
+ * coroutine pointer in a callee-saved register. It is passed
+ * further to coro_asm_entry().
+ */
+extern "C" void
+coro_asm_start(void);
+
+#if defined(__x86_64__)
+
+asm(
+"	.text\n"
+"	.globl coro_asm_switch\n"
+"	.hidden coro_asm_switch\n"
+"	.type coro_asm_switch, @function\n"
+"coro_asm_switch:\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+"	.size coro_asm_switch, .-coro_asm_switch\n"
+"\n"
+"	.globl coro_asm_start\n"
+"	.hidden coro_asm_start\n"
+"	.type coro_asm_start, @function\n"
+"coro_asm_start:\n"
+"	movq %rbx, %rdi\n"
+"	call coro_asm_entry@PLT\n"
+"	ud2\n"
+"	.size coro_asm_start, .-coro_asm_start\n"
+);
+
+enum {
+	/** r15, r14, r13, r12, rbx, rbp, return address. */
+	CORO_ASM_FRAME_WORDS = 7,
+	CORO_ASM_FRAME_ARG = 4,
+	CORO_ASM_FRAME_RET = 6,
+};
+
+#elif defined(__aarch64__)
+
+asm(
+"	.text\n"
+"	.globl coro_asm_switch\n"
+"	.hidden coro_asm_switch\n"
+"	.type coro_asm_switch, %function\n"
+"coro_asm_switch:\n"
+"	sub sp, sp, #160\n"
+"	stp d8, d9, [sp, #0]\n"
+"	stp d10, d11, [sp, #16]\n"
+"	stp d12, d13, [sp, #32]\n"
+"	stp d14, d15, [sp, #48]\n"
+"	stp x19, x20, [sp, #64]\n"
+"	stp x21, x22, [sp, #80]\n"
+"	stp x23, x24, [sp, #96]\n"
+"	stp x25, x26, [sp, #112]\n"
+"	stp x27, x28, [sp, #128]\n"
+"	stp x29, x30, [sp, #144]\n"
+"	mov x9, sp\n"
+"	str x9, [x0]\n"
+"	mov sp, x1\n"
+"	ldp d8, d9, [sp, #0]\n"
+"	ldp d10, d11, [sp, #16]\n"
+"	ldp d12, d13, [sp, #32]\n"
+"	ldp d14, d15, [sp, #48]\n"
+"	ldp x19, x20, [sp, #64]\n"
+"	ldp x21, x22, [sp, #80]\n"
+"	ldp x23, x24, [sp, #96]\n"
+"	ldp x25, x26, [sp, #112]\n"
+"	ldp x27, x28, [sp, #128]\n"
+"	ldp x29, x30, [sp, #144]\n"
+"	add sp, sp, #160\n"
+"	ret\n"
+"	.size coro_asm_switch, .-coro_asm_switch\n"
+"\n"
+"	.globl coro_asm_start\n"
+"	.hidden coro_asm_start\n"
+"	.type coro_asm_start, %function\n"
+"coro_asm_start:\n"
+"	mov x0, x19\n"
+"	bl coro_asm_entry\n"
+"	brk #0\n"
+"	.size coro_asm_start, .-coro_asm_start\n"
+);
+
+enum {
+	/** d8-d15, x19-x28, x29 (fp), x30 (lr). */
+	CORO_ASM_FRAME_WORDS = 20,
+	/** x19. */
+	CORO_ASM_FRAME_ARG = 8,
+	/** x30. */
+	CORO_ASM_FRAME_RET = 19,
+};
+
+#endif
+
 static void
-coro_engine_resume_next(struct coro_engine *engine)
+coro_ctx_switch(struct coro *from, struct coro *to)
+{
+	coro_asm_switch(&from->sp, to->sp);
+}
+
+#else /* !CORO_USE_ASM_SWITCH */
+
+static void
+coro_ctx_switch(struct coro *from, struct coro *to)
+{
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+}
+
+#endif /* !CORO_USE_ASM_SWITCH */
+
+/**
+ * Take the next coroutine to run in this iteration. The higher
+ * priorities go first, but not for too long, so the lower ones
+ * still make progress under a constant load of the higher ones.
+ * NULL means the iteration is over.
+ */
+static struct coro *
+coro_engine_pop_now(struct coro_engine *engine)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
+	int prio = 0;
+	while (prio < CORO_PRIORITY_COUNT &&
+	       rlist_empty(&engine->run_queues[prio].now))
+		++prio;
+	if (prio == CORO_PRIORITY_COUNT)
+		return NULL;
+	int lower = prio + 1;
+	while (lower < CORO_PRIORITY_COUNT &&
+	       rlist_empty(&engine->run_queues[lower].now))
+		++lower;
+	if (lower == CORO_PRIORITY_COUNT) {
+		engine->starvation_count = 0;
+	} else if (++engine->starvation_count > CORO_STARVATION_LIMIT) {
+		engine->starvation_count = 0;
+		prio = lower;
+	}
+	coro_engine_add_run_count(engine, -1);
+	return rlist_shift_entry(&engine->run_queues[prio].now,
 		struct coro, link);
+}
+
+/** Queue a runnable coroutine to run on the next iteration. */
+static void
+coro_engine_push_next(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	rlist_add_tail_entry(&engine->run_queues[c->priority].next, c, link);
+	coro_engine_add_run_count(engine, 1);
+	coro_stats_on_queue(c);
+}
+
+static bool
+coro_engine_has_now(const struct coro_engine *engine)
+{
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		if (!rlist_empty(&engine->run_queues[i].now))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Switch to the next coroutine of this iteration, or back to the
+ * scheduler. Is called with the engine locked, and returns with
+ * the engine of the resumed coroutine locked - in the M:N mode it
+ * might be resumed by another worker.
+ */
+static struct coro_engine *
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	struct coro *to = coro_engine_pop_now(engine);
+	/*
+	 * When the iteration is over, the control goes back to
+	 * the scheduler.
+	 */
+	if (to == NULL)
+		to = &engine->sched;
 	struct coro *from = engine->this_coro;
 	assert(from != NULL);
 
 	engine->this_coro = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
+	coro_stats_on_switch(engine, from, to);
+	if (from != &engine->sched)
+		TRACE_END("coro");
+	if (to != &engine->sched)
+		TRACE_BEGIN("coro", to);
+	coro_ctx_switch(from, to);
+	engine = from->engine;
 	assert(rlist_empty(&from->link));
 	assert(engine->this_coro == NULL);
 	engine->this_coro = from;
+	return engine;
+}
+
+static void
+coro_timer_set(struct coro_engine *engine, int idx, struct coro *c)
+{
+	engine->timers[idx] = c;
+	c->timer_idx = idx;
+}
+
+static void
+coro_timer_sift_up(struct coro_engine *engine, int idx)
+{
+	struct coro *c = engine->timers[idx];
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		struct coro *p = engine->timers[parent];
+		if (p->deadline <= c->deadline)
+			break;
+		coro_timer_set(engine, idx, p);
+		idx = parent;
+	}
+	coro_timer_set(engine, idx, c);
+}
+
+static void
+coro_timer_sift_down(struct coro_engine *engine, int idx)
+{
+	struct coro *c = engine->timers[idx];
+	while (true) {
+		int child = idx * 2 + 1;
+		if (child >= engine->timer_count)
+			break;
+		if (child + 1 < engine->timer_count &&
+		    engine->timers[child + 1]->deadline <
+		    engine->timers[child]->deadline)
+			++child;
+		struct coro *ch = engine->timers[child];
+		if (c->deadline <= ch->deadline)
+			break;
+		coro_timer_set(engine, idx, ch);
+		idx = child;
+	}
+	coro_timer_set(engine, idx, c);
+}
+
+static void
+coro_timer_add(struct coro_engine *engine, struct coro *c, uint64_t deadline)
+{
+	assert(c->timer_idx < 0);
+	if (engine->timer_count == engine->timer_capacity) {
+		int new_capacity = engine->timer_capacity * 2;
+		if (new_capacity == 0)
+			new_capacity = 16;
+		struct coro **new_timers = new struct coro *[new_capacity];
+		if (engine->timer_count > 0) {
+			memcpy(new_timers, engine->timers,
+				sizeof(*new_timers) * engine->timer_count);
+		}
+		delete[] engine->timers;
+		engine->timers = new_timers;
+		engine->timer_capacity = new_capacity;
+	}
+	c->deadline = deadline;
+	int idx = engine->timer_count++;
+	coro_timer_set(engine, idx, c);
+	coro_timer_sift_up(engine, idx);
 }
 
 static void
+coro_timer_remove(struct coro_engine *engine, struct coro *c)
+{
+	int idx = c->timer_idx;
+	assert(idx >= 0 && idx < engine->timer_count);
+	assert(engine->timers[idx] == c);
+	c->timer_idx = -1;
+	struct coro *last = engine->timers[--engine->timer_count];
+	if (last == c)
+		return;
+	coro_timer_set(engine, idx, last);
+	if (idx > 0 && engine->timers[(idx - 1) / 2]->deadline > last->deadline)
+		coro_timer_sift_up(engine, idx);
+	else
+		coro_timer_sift_down(engine, idx);
+}
+
+/**
+ * Suspend the current coroutine. Returns the engine it is resumed
+ * by.
+ */
+static struct coro_engine *
 coro_engine_suspend(struct coro_engine *engine)
 {
 	struct coro *this_coro = engine->this_coro;
@@ -115,78 +1041,859 @@ coro_engine_suspend(struct coro_engine *engine)
 	}
 	assert(rlist_empty(&this_coro->link));
 	assert(this_coro->state == CORO_STATE_RUNNING);
+	coro_engine_lock(engine);
+	if (this_coro->is_wakeup_pending) {
+		this_coro->is_wakeup_pending = false;
+		coro_engine_unlock(engine);
+		return engine;
+	}
+	if (this_coro->is_cancelled) {
+		/*
+		 * Still let the others run. Otherwise who waits in
+		 * a loop would never let the awaited thing happen.
+		 */
+		coro_engine_push_next(engine, this_coro);
+		engine = coro_engine_resume_next(engine);
+		coro_engine_unlock(engine);
+		return engine;
+	}
 	this_coro->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	this_coro->is_inactive = this_coro->timer_idx < 0 &&
+		!this_coro->is_waiting_fd;
+	if (this_coro->is_inactive)
+		coro_active_add(engine, -1);
+	engine = coro_engine_resume_next(engine);
+	coro_engine_unlock(engine);
+	return engine;
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	assert(rlist_empty(&this_coro->link));
+	assert(this_coro->state == CORO_STATE_RUNNING);
+	coro_engine_lock(engine);
+	coro_engine_push_next(engine, this_coro);
+	engine = coro_engine_resume_next(engine);
+	coro_engine_unlock(engine);
+}
+
+/**
+ * Make a suspended coroutine runnable. The engine owning it must
+ * be locked. Returns whether the coroutine was suspended.
+ */
+static bool
+coro_engine_wakeup_locked(struct coro_engine *engine, struct coro *coro)
+{
+	if (coro->state == CORO_STATE_RUNNING)
+		return false;
+	if (coro->state == CORO_STATE_FINISHED)
+		return false;
+	assert(coro->state == CORO_STATE_SUSPENDED);
+	assert(rlist_empty(&coro->link));
+	assert(coro->engine == engine);
+	coro->state = CORO_STATE_RUNNING;
+	if (coro->is_inactive) {
+		coro->is_inactive = false;
+		coro_active_add(engine, 1);
+	}
+	if (coro->priority == CORO_PRIORITY_HIGH) {
+		/* Don't wait for the whole next iteration. */
+		rlist_add_tail_entry(&engine->run_queues[coro->priority].now,
+			coro, link);
+		coro_engine_add_run_count(engine, 1);
+		coro_stats_on_queue(coro);
+		return true;
+	}
+	coro_engine_push_next(engine, coro);
+	return true;
+}
+
+/**
+ * Wakeup in the M:N mode. @a waker is the engine of the calling
+ * thread, NULL if it is not a worker. A coroutine of another
+ * engine might be running right now, and is going to suspend. So
+ * such a wakeup is remembered for its next suspension.
+ */
+static void
+coro_mt_wakeup(struct coro_engine *waker, struct coro *coro)
+{
+	struct coro_engine *engine = coro_lock_owner(coro);
+	bool is_woken = coro_engine_wakeup_locked(engine, coro);
+	if (!is_woken && engine != waker &&
+	    coro->state == CORO_STATE_RUNNING)
+		coro->is_wakeup_pending = true;
+	coro_engine_unlock(engine);
+	if (is_woken && engine != waker)
+		coro_engine_notify(engine);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	if (!engine->is_mt) {
+		coro_engine_wakeup_locked(engine, coro);
+		return;
+	}
+	coro_mt_wakeup(coro_engine_of_thread(), coro);
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: suspension with timeout outside of a "
+			"coroutine\n");
+		exit(-1);
+	}
+	uint64_t deadline = coro_clock_ns();
+	if (timeout > 0)
+		deadline += (uint64_t)(timeout * 1000000000);
+	this_coro->is_timed_out = false;
+	coro_timer_add(engine, this_coro, deadline);
+	/* The coroutine is pinned to the engine by the timer. */
+	engine = coro_engine_suspend(engine);
+	if (this_coro->timer_idx >= 0)
+		coro_timer_remove(engine, this_coro);
+	return !this_coro->is_timed_out;
+}
+
+static void
+coro_engine_sleep(struct coro_engine *engine, double timeout)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: sleep outside of a coroutine\n");
+		exit(-1);
+	}
+	uint64_t deadline = coro_clock_ns();
+	if (timeout > 0)
+		deadline += (uint64_t)(timeout * 1000000000);
+	do {
+		uint64_t now = coro_clock_ns();
+		double left = 0;
+		if (deadline > now)
+			left = (deadline - now) / 1000000000.0;
+		/* Once the timer is gone, it might be stolen. */
+		coro_engine_suspend_timeout(this_coro->engine, left);
+	} while (coro_clock_ns() < deadline && !this_coro->is_cancelled);
+}
+
+/** Wakeup all the coroutines whose deadlines are reached. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	if (engine->timer_count == 0)
+		return;
+	uint64_t now = coro_clock_ns();
+	while (engine->timer_count > 0) {
+		struct coro *c = engine->timers[0];
+		if (c->deadline > now)
+			break;
+		coro_timer_remove(engine, c);
+		if (c->state == CORO_STATE_SUSPENDED) {
+			c->is_timed_out = true;
+			coro_engine_wakeup_locked(engine, c);
+		}
+	}
+}
+
+/**
+ * Nothing to run, but the timers are waiting. Block the thread
+ * until the closest deadline.
+ */
+static void
+coro_engine_wait_timers(struct coro_engine *engine)
+{
+	assert(engine->timer_count > 0);
+	uint64_t deadline = engine->timers[0]->deadline;
+	uint64_t now = coro_clock_ns();
+	if (deadline <= now)
+		return;
+	uint64_t left = deadline - now;
+	struct timespec ts;
+	ts.tv_sec = left / 1000000000;
+	ts.tv_nsec = left % 1000000000;
+	/* Interruption is fine, the caller re-checks the timers. */
+	nanosleep(&ts, NULL);
+}
+
+#if CORO_USE_EPOLL
+
+static int
+coro_wait_fd_events_to_epoll(int events)
+{
+	int res = 0;
+	if ((events & CORO_FD_READ) != 0)
+		res |= EPOLLIN | EPOLLRDHUP;
+	if ((events & CORO_FD_WRITE) != 0)
+		res |= EPOLLOUT;
+	return res;
+}
+
+static int
+coro_wait_fd_events_from_epoll(int events)
+{
+	int res = 0;
+	if ((events & (EPOLLIN | EPOLLRDHUP)) != 0)
+		res |= CORO_FD_READ;
+	if ((events & EPOLLOUT) != 0)
+		res |= CORO_FD_WRITE;
+	if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+		res |= CORO_FD_ERROR;
+	return res;
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: descriptor wait outside of a coroutine\n");
+		exit(-1);
+	}
+	if (this_coro->is_cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+	if (engine->epoll_fd < 0) {
+		engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (engine->epoll_fd < 0)
+			return -1;
+	}
+	struct coro_fd_waiter waiter;
+	waiter.coro = this_coro;
+	waiter.revents = 0;
+	struct epoll_event ev;
+	ev.events = coro_wait_fd_events_to_epoll(events);
+	ev.data.ptr = &waiter;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+	++engine->fd_wait_count;
+	this_coro->is_waiting_fd = true;
+	if (timeout < 0)
+		engine = coro_engine_suspend(engine);
+	else
+		coro_engine_suspend_timeout(engine, timeout);
+	this_coro->is_waiting_fd = false;
+	--engine->fd_wait_count;
+	int rc = epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	assert(rc == 0);
+	(void)rc;
+	if (waiter.revents == 0 && this_coro->is_cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return waiter.revents;
+}
+
+/**
+ * Wakeup the coroutines whose descriptors are ready. If @a block,
+ * then wait until at least one is ready, or until the closest
+ * timer deadline, or until another worker wakes this one up. Is
+ * called with the engine locked, but waits unlocked.
+ */
+static void
+coro_engine_process_fds(struct coro_engine *engine, bool block)
+{
+	int timeout_ms = 0;
+	if (block) {
+		timeout_ms = -1;
+		if (engine->timer_count > 0) {
+			uint64_t deadline = engine->timers[0]->deadline;
+			uint64_t now = coro_clock_ns();
+			timeout_ms = 0;
+			/* Round up to not wake up too early and spin. */
+			if (deadline > now)
+				timeout_ms = (deadline - now + 999999) / 1000000;
+		}
+	}
+	struct epoll_event events[CORO_IO_EVENT_BATCH];
+	coro_engine_unlock(engine);
+	int count = epoll_wait(engine->epoll_fd, events, CORO_IO_EVENT_BATCH,
+		timeout_ms);
+	TRACE_INSTANT("coro epoll wakeup", count);
+	coro_engine_lock(engine);
+	for (int i = 0; i < count; ++i) {
+		struct coro_fd_waiter *w = (decltype(w))events[i].data.ptr;
+		if (w == NULL) {
+			/* The worker was notified via the eventfd. */
+			uint64_t value;
+			ssize_t rc = read(engine->event_fd, &value,
+				sizeof(value));
+			assert(rc == sizeof(value));
+			(void)rc;
+			continue;
+		}
+		w->revents |= coro_wait_fd_events_from_epoll(events[i].events);
+		coro_engine_wakeup_locked(engine, w->coro);
+	}
+	engine->io_skip_count = 0;
+}
+
+#else /* !CORO_USE_EPOLL */
+
+/**
+ * Without epoll the descriptor is checked by the coroutine
+ * itself, with a sleep between the checks.
+ */
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	enum { POLL_PERIOD_MS = 1 };
+	uint64_t deadline = coro_clock_ns();
+	if (timeout > 0)
+		deadline += (uint64_t)(timeout * 1000000000);
+	while (true) {
+		if (engine->this_coro->is_cancelled) {
+			errno = ECANCELED;
+			return -1;
+		}
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if ((events & CORO_FD_READ) != 0)
+			pfd.events |= POLLIN;
+		if ((events & CORO_FD_WRITE) != 0)
+			pfd.events |= POLLOUT;
+		if (poll(&pfd, 1, 0) < 0)
+			return -1;
+		int res = 0;
+		if ((pfd.revents & POLLIN) != 0)
+			res |= CORO_FD_READ;
+		if ((pfd.revents & POLLOUT) != 0)
+			res |= CORO_FD_WRITE;
+		if ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+			res |= CORO_FD_ERROR;
+		if (res != 0)
+			return res;
+		if (timeout >= 0 && coro_clock_ns() >= deadline)
+			return 0;
+		if (coro_engine_suspend_timeout(engine, POLL_PERIOD_MS / 1000.0))
+			return 0;
+	}
+}
+
+static void
+coro_engine_process_fds(struct coro_engine *engine, bool block)
+{
+	(void)engine;
+	(void)block;
+	assert(engine->fd_wait_count == 0);
+}
+
+#endif /* !CORO_USE_EPOLL */
+
+static bool
+coro_is_pinned(const struct coro *c)
+{
+	return c->timer_idx >= 0 || c->is_waiting_fd;
+}
+
+/**
+ * Move up to @a count of the not pinned coroutines from the tail
+ * of the victim's @a list to the head of @a stolen.
+ */
+static int
+coro_mt_steal_from(struct rlist *list, struct rlist *stolen, int count,
+	struct coro_engine *thief)
+{
+	int res = 0;
+	struct coro *c, *tmp;
+	rlist_foreach_entry_safe_reverse(c, list, link, tmp) {
+		if (res == count)
+			break;
+		if (coro_is_pinned(c))
+			continue;
+		rlist_del_entry(c, link);
+		__atomic_store_n(&c->engine, thief, __ATOMIC_RELEASE);
+		rlist_add_entry(stolen, c, link);
+		++res;
+	}
+	return res;
+}
+
+/**
+ * Take a half of the runnable coroutines of some other worker.
+ * The busy ones are skipped instead of waiting for their locks.
+ */
+static bool
+coro_mt_steal(struct coro_engine *thief)
+{
+	RLIST_HEAD(stolen);
+	int count = 0;
+	for (int i = 1; i < workers.count && count == 0; ++i) {
+		struct coro_engine *victim = workers.engines[
+			(thief->worker_id + i) % workers.count];
+		if (__atomic_load_n(&victim->run_count, __ATOMIC_RELAXED) == 0)
+			continue;
+		if (!coro_spin_trylock(&victim->lock))
+			continue;
+		int want = (victim->run_count + 1) / 2;
+		/* The lower priorities suffer from a busy worker most. */
+		for (int p = CORO_PRIORITY_COUNT - 1; p >= 0; --p) {
+			struct coro_run_queue *q = &victim->run_queues[p];
+			count += coro_mt_steal_from(&q->next, &stolen,
+				want - count, thief);
+			count += coro_mt_steal_from(&q->now, &stolen,
+				want - count, thief);
+		}
+		coro_engine_add_run_count(victim, -count);
+		/* A foreign engine never has a deferred wakeup. */
+		assert(victim->deferred_wakeup == NULL);
+		coro_spin_unlock(&victim->lock);
+	}
+	if (count == 0)
+		return false;
+	coro_engine_lock(thief);
+	while (!rlist_empty(&stolen)) {
+		struct coro *c = rlist_shift_entry(&stolen, struct coro, link);
+		coro_engine_push_next(thief, c);
+	}
+	coro_engine_unlock(thief);
+	return true;
+}
+
+/**
+ * Let a sleeping worker steal, when this one has more than it can
+ * run at once.
+ */
+static void
+coro_mt_share_work(struct coro_engine *engine)
+{
+	if (engine->run_count < 2 ||
+	    __atomic_load_n(&workers.sleeper_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	for (int i = 1; i < workers.count; ++i) {
+		struct coro_engine *e = workers.engines[
+			(engine->worker_id + i) % workers.count];
+		if (__atomic_load_n(&e->is_sleeping, __ATOMIC_SEQ_CST)) {
+			coro_engine_notify(e);
+			return;
+		}
+	}
+}
+
+/**
+ * Nothing to run in this worker. Steal from the others, or sleep
+ * until they give some work, or a timer or a descriptor is ready.
+ * Is called with the engine locked. Returns false when all the
+ * workers are done.
+ */
+static bool
+coro_mt_wait_work(struct coro_engine *engine)
+{
+	coro_engine_unlock(engine);
+	bool has_work = coro_mt_steal(engine);
+	if (has_work) {
+		coro_engine_lock(engine);
+		return true;
+	}
+	__atomic_store_n(&engine->is_sleeping, true, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&workers.sleeper_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * Check again after announcing the sleep. Whoever gives
+	 * the work after that, also sends a notification.
+	 */
+	has_work = __atomic_load_n(&workers.is_done, __ATOMIC_SEQ_CST) ||
+		coro_mt_steal(engine);
+	coro_engine_lock(engine);
+	if (!has_work && engine->run_count == 0)
+		coro_engine_process_fds(engine, true);
+	__atomic_store_n(&engine->is_sleeping, false, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&workers.sleeper_count, 1, __ATOMIC_SEQ_CST);
+	return !__atomic_load_n(&workers.is_done, __ATOMIC_SEQ_CST);
+}
+
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	coro_engine_lock(engine);
+	while (true) {
+		/*
+		 * Other workers wake up the high priority ones right
+		 * into this list even between the iterations.
+		 */
+		assert(engine->is_mt || !coro_engine_has_now(engine));
+		coro_engine_process_timers(engine);
+		for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+			struct coro_run_queue *q = &engine->run_queues[i];
+			rlist_splice_tail(&q->now, &q->next);
+		}
+		if (!coro_engine_has_now(engine)) {
+			if (engine->is_mt) {
+				if (!coro_mt_wait_work(engine))
+					break;
+				continue;
+			}
+			if (engine->fd_wait_count > 0) {
+				coro_engine_process_fds(engine, true);
+				continue;
+			}
+			if (engine->timer_count == 0)
+				break;
+			coro_engine_wait_timers(engine);
+			continue;
+		}
+		if (engine->is_mt)
+			coro_mt_share_work(engine);
+		if (engine->fd_wait_count > 0 &&
+		    ++engine->io_skip_count >= CORO_IO_POLL_PERIOD)
+			coro_engine_process_fds(engine, false);
+
+		assert(engine->this_coro == NULL);
+		engine->this_coro = &engine->sched;
+		assert(rlist_empty(&engine->sched.link));
+		/*
+		 * The control comes back to the scheduler in the end
+		 * of this iteration of the loop. The scheduler never
+		 * changes its engine.
+		 */
+		struct coro_engine *e = coro_engine_resume_next(engine);
+		assert(e == engine);
+		(void)e;
+		assert(!coro_engine_has_now(engine));
+		assert(engine->this_coro == &engine->sched);
+		engine->this_coro = NULL;
+		if (engine->deferred_wakeup != NULL) {
+			coro_engine_unlock(engine);
+			coro_engine_lock(engine);
+		}
+	}
+	coro_engine_unlock(engine);
+}
+
+static void
+coro_count_add(long delta)
+{
+	/* The coroutines can be created and deleted by any worker. */
+	size_t count = __atomic_add_fetch(&workers.coro_count, delta,
+		__ATOMIC_RELAXED);
+	coro_stats_on_count(count);
+}
+
+static void
+coro_engine_delete_coro(struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	coro_stack_destroy(c);
+	delete c;
+	assert(workers.coro_count > 0);
+	coro_count_add(-1);
+}
+
+/** Free the pooled coroutines above @a keep in each stack class. */
+static void
+coro_engine_shrink_pool(struct coro_engine *engine, size_t keep)
+{
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_class *sc = &engine->stack_classes[i];
+		while (sc->pool_size > keep) {
+			/* The tail is the least recently used. */
+			struct coro *c = rlist_shift_tail_entry(&sc->pool,
+				struct coro, link);
+			--sc->pool_size;
+			coro_engine_delete_coro(c);
+		}
+	}
+}
+
+static void
+coro_engine_set_stack_size(struct coro_engine *engine, size_t size)
+{
+	engine->stack_size = coro_stack_size_for(size);
+}
+
+static void
+coro_engine_set_pool_limit(struct coro_engine *engine, size_t limit)
+{
+	engine->pool_limit = limit;
+	coro_engine_shrink_pool(engine, limit);
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this_coro == NULL);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		assert(rlist_empty(&engine->run_queues[i].now));
+		assert(rlist_empty(&engine->run_queues[i].next));
+	}
+	coro_engine_shrink_pool(engine, 0);
+	assert(engine->timer_count == 0);
+	delete[] engine->timers;
+	assert(engine->fd_wait_count == 0);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
+	if (engine->event_fd >= 0)
+		close(engine->event_fd);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * Coroutines spawned and joined together. The members don't have
+ * joiners, instead the last finished one wakes up the group
+ * joiner. The members might finish in different workers, so the
+ * group is synchronized with atomics rather than an engine lock.
+ */
+struct coro_group {
+	/** Number of the members. */
+	int count;
+	/** Number of the not finished members. */
+	int pending;
+	/**
+	 * Coroutine waiting for the group, NULL if nobody is yet,
+	 * or CORO_GROUP_DONE when all the members are finished.
+	 */
+	struct coro *joiner;
+	/** The members. */
+	struct coro **coros;
+};
+
+#define CORO_GROUP_DONE ((struct coro *)-1)
+
+/**
+ * Account a finished member of the group. Returns the joiner to
+ * wake up, if the member was the last one.
+ */
+static struct coro *
+coro_group_finish_one(struct coro_group *group)
+{
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) != 0)
+		return NULL;
+	struct coro *joiner = __atomic_exchange_n(&group->joiner,
+		CORO_GROUP_DONE, __ATOMIC_ACQ_REL);
+	assert(joiner != CORO_GROUP_DONE);
+	return joiner;
+}
+
+/** A slot of the coroutine-local keys, common for all threads. */
+struct coro_key_slot {
+	bool is_used;
+	void (*destructor)(void *);
+};
+
+static struct coro_key_slot coro_keys[CORO_KEY_MAX];
+static pthread_mutex_t coro_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Destroy the coroutine-local values, the same as the threads do
+ * on exit. Runs in the coroutine, so the destructors can use the
+ * scheduler.
+ */
+static void
+coro_locals_destroy(struct coro *c)
+{
+	for (int i = 0; i < CORO_KEY_MAX; ++i) {
+		void *value = c->locals[i];
+		if (value == NULL)
+			continue;
+		c->locals[i] = NULL;
+		void (*destructor)(void *) =
+			__atomic_load_n(&coro_keys[i].destructor,
+				__ATOMIC_ACQUIRE);
+		if (destructor != NULL)
+			destructor(value);
+	}
+}
+
+#if LIBCORO_STACK_PROFILE
+
+enum {
+	/**
+	 * Bytes below the caller's frame not filled with the
+	 * pattern, with space for the filling function itself.
+	 */
+	CORO_STACK_PROFILE_MARGIN = 256,
+};
+
+static const uint64_t coro_stack_canary = 0x5afec0de5afec0deULL;
+
+/** Stack usage of all coroutines with the same function. */
+struct coro_stack_profile {
+	coro_f func;
+	/** Name of the last coroutine with this function. */
+	char name[CORO_NAME_MAX];
+	size_t run_count;
+	size_t max_used;
+	size_t total_used;
+	size_t stack_size;
+};
+
+/** The profiles, common for all threads. */
+static struct {
+	pthread_mutex_t mutex;
+	struct coro_stack_profile *profiles;
+	int count;
+	int capacity;
+} coro_stack_profiles = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+/**
+ * Fill the stack below the caller's frame with the pattern. The
+ * stack grows down, so all that is not used yet.
+ */
+static void __attribute__((noinline))
+coro_stack_profile_fill(struct coro *c)
+{
+	uint8_t *end = (uint8_t *)__builtin_frame_address(0) -
+		CORO_STACK_PROFILE_MARGIN;
+	assert(end > c->stack && end <= c->stack + c->stack_size);
+	uint64_t *pos = (uint64_t *)c->stack;
+	while ((uint8_t *)(pos + 1) <= end)
+		*pos++ = coro_stack_canary;
 }
 
+/** Account how deep the coroutine has got into its stack. */
 static void
-coro_engine_yield(struct coro_engine *engine)
+coro_stack_profile_commit(struct coro *c, coro_f func)
 {
-	struct coro *this_coro = engine->this_coro;
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this_coro, link);
-	coro_engine_resume_next(engine);
+	const uint64_t *pos = (const uint64_t *)c->stack;
+	const uint64_t *end = (const uint64_t *)(c->stack + c->stack_size);
+	while (pos < end && *pos == coro_stack_canary)
+		++pos;
+	size_t used = (const uint8_t *)end - (const uint8_t *)pos;
+
+	pthread_mutex_lock(&coro_stack_profiles.mutex);
+	struct coro_stack_profile *p = NULL;
+	for (int i = 0; i < coro_stack_profiles.count && p == NULL; ++i) {
+		if (coro_stack_profiles.profiles[i].func == func)
+			p = &coro_stack_profiles.profiles[i];
+	}
+	if (p == NULL) {
+		if (coro_stack_profiles.count == coro_stack_profiles.capacity) {
+			int cap = coro_stack_profiles.capacity * 2;
+			if (cap == 0)
+				cap = 16;
+			void *mem = realloc(coro_stack_profiles.profiles,
+				cap * sizeof(*p));
+			if (mem == NULL)
+				handle_error();
+			coro_stack_profiles.profiles =
+				(struct coro_stack_profile *)mem;
+			coro_stack_profiles.capacity = cap;
+		}
+		p = &coro_stack_profiles.profiles[coro_stack_profiles.count++];
+		memset(p, 0, sizeof(*p));
+		p->func = func;
+	}
+	memcpy(p->name, c->name, CORO_NAME_MAX);
+	++p->run_count;
+	p->total_used += used;
+	if (used > p->max_used)
+		p->max_used = used;
+	if (c->stack_size > p->stack_size)
+		p->stack_size = c->stack_size;
+	pthread_mutex_unlock(&coro_stack_profiles.mutex);
 }
 
+/** Print and forget the collected profiles. */
 static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+coro_stack_profile_report(void)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	pthread_mutex_lock(&coro_stack_profiles.mutex);
+	if (coro_stack_profiles.count > 0)
+		printf("Coroutine stack usage, bytes:\n");
+	for (int i = 0; i < coro_stack_profiles.count; ++i) {
+		struct coro_stack_profile *p = &coro_stack_profiles.profiles[i];
+		printf("    %p '%s': runs %zu, max %zu, avg %zu, of %zu\n",
+			(void *)p->func, p->name, p->run_count, p->max_used,
+			p->total_used / p->run_count, p->stack_size);
+	}
+	free(coro_stack_profiles.profiles);
+	coro_stack_profiles.profiles = NULL;
+	coro_stack_profiles.count = 0;
+	coro_stack_profiles.capacity = 0;
+	pthread_mutex_unlock(&coro_stack_profiles.mutex);
 }
 
+#endif /* LIBCORO_STACK_PROFILE */
+
+/**
+ * Body of each coroutine. Runs its functions one by one, because
+ * a finished coroutine can be reused via the pool.
+ */
 static void
-coro_engine_run(struct coro_engine *engine)
+coro_body_loop(struct coro *c)
 {
+	struct coro_engine *engine = c->engine;
+	engine->this_coro = c;
+	/* Whoever has switched here, has locked the engine. */
+	coro_engine_unlock(engine);
 	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
-
-		assert(engine->this_coro == NULL);
-		engine->this_coro = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
+#if LIBCORO_STACK_PROFILE
+		coro_stack_profile_fill(c);
+		coro_f func = c->func;
+#endif
+		c->ret = c->func(c->func_arg);
+		coro_locals_destroy(c);
+#if LIBCORO_STACK_PROFILE
+		coro_stack_profile_commit(c, func);
+#endif
+		engine = c->engine;
+		coro_engine_lock(engine);
+		c->func = NULL;
+		assert(c->state == CORO_STATE_RUNNING);
+		c->state = CORO_STATE_FINISHED;
+		struct coro *joiner = c->joiner;
+		if (c->group != NULL)
+			joiner = coro_group_finish_one(c->group);
+		if (joiner != NULL && engine->is_mt) {
+			engine->deferred_wakeup = joiner;
+		} else {
+			if (joiner != NULL)
+				coro_engine_wakeup_locked(engine, joiner);
+			coro_active_add(engine, -1);
+		}
+		engine = coro_engine_resume_next(engine);
+		coro_engine_unlock(engine);
 		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
+		 * Here it is restarted already, must have its
+		 * state restored.
 		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this_coro == &engine->sched);
-		engine->this_coro = NULL;
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
 	}
 }
 
+#if CORO_USE_ASM_SWITCH
+
+/* Called only from the asm, so LTO must be told it is used. */
+extern "C" __attribute__((used)) void
+coro_asm_entry(struct coro *c)
+{
+	coro_body_loop(c);
+	abort();
+}
+
+/**
+ * Build the initial stack frame, which coro_asm_switch() will
+ * "return" from into coro_asm_start(). No need to touch anything
+ * else - until the first resume the coroutine is just memory.
+ */
 static void
-coro_engine_destroy(struct coro_engine *engine)
+coro_ctx_create(struct coro *c)
 {
-	assert(engine->this_coro == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		delete[] c->stack;
-		delete c;
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	/*
+	 * When the frame is popped, the stack pointer must be
+	 * 16-aligned so that the call in coro_asm_start() is
+	 * ABI-compliant.
+	 */
+	uintptr_t top = (uintptr_t)(c->stack + c->stack_size);
+	top &= ~(uintptr_t)15;
+	void **frame = (void **)top - CORO_ASM_FRAME_WORDS;
+	memset(frame, 0, CORO_ASM_FRAME_WORDS * sizeof(*frame));
+	frame[CORO_ASM_FRAME_ARG] = c;
+	frame[CORO_ASM_FRAME_RET] = (void *)coro_asm_start;
+	c->sp = frame;
 }
 
+#else /* !CORO_USE_ASM_SWITCH */
+
 static __thread struct coro_engine *new_coro_engine = NULL;
 
 /**
@@ -196,9 +1903,25 @@ static __thread struct coro_engine *new_coro_engine = NULL;
  * constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_body(int signum, siginfo_t *info, void *uctx)
 {
 	(void)signum;
+	(void)info;
+	/*
+	 * The interrupted context is never returned to - the
+	 * handler leaves via siglongjmp(). But the unwinders (like
+	 * backtrace() in heap_help) would walk into it through the
+	 * signal frame, and find there a long gone stack. Make the
+	 * coroutine stack end here instead.
+	 */
+	ucontext_t *uc = (ucontext_t *)uctx;
+#if defined(__x86_64__)
+	uc->uc_mcontext.gregs[REG_RIP] = 0;
+#elif defined(__aarch64__)
+	uc->uc_mcontext.pc = 0;
+#else
+	(void)uc;
+#endif
 	struct coro_engine *my_engine = new_coro_engine;
 	new_coro_engine = NULL;
 
@@ -214,38 +1937,13 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finally start work.
 	 */
-	my_engine->this_coro = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+	coro_body_loop(c);
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro *c)
 {
-	struct coro *c = new coro();
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = new uint8_t[stack_size];
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
+	struct coro_engine *engine = c->engine;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -261,15 +1959,15 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
+	newsa.sa_sigaction = coro_body;
+	newsa.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
@@ -306,102 +2004,628 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
 
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+#endif /* !CORO_USE_ASM_SWITCH */
+
+static void
+coro_set_name(struct coro *c, const char *name)
+{
+	if (name == NULL) {
+		c->name[0] = 0;
+		return;
+	}
+	strncpy(c->name, name, CORO_NAME_MAX - 1);
+	c->name[CORO_NAME_MAX - 1] = 0;
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, size_t stack_size)
+{
+	struct coro *c = new coro();
+	c->state = CORO_STATE_RUNNING;
+	c->ret = NULL;
+	coro_stack_create(c, stack_size);
+	c->joiner = NULL;
+	c->group = NULL;
+	c->engine = engine;
+	c->timer_idx = -1;
+	rlist_create(&c->link);
+	coro_ctx_create(c);
+	coro_count_add(1);
 	return c;
 }
 
+/**
+ * Take a coroutine from the pool or create a new one, ready to be
+ * queued to run.
+ */
 static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn_prepare(struct coro_engine *engine, coro_f func,
+	void *func_arg, const struct coro_attr *attr)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+	size_t stack_size = engine->stack_size;
+	if (attr->stack_size != 0)
+		stack_size = coro_stack_size_for(attr->stack_size);
+	int class_idx = coro_stack_class_idx(stack_size);
+	bool is_pooled = attr->is_pooled && class_idx >= 0;
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
+	struct coro *c = NULL;
+	if (is_pooled) {
+		struct coro_stack_class *sc = &engine->stack_classes[class_idx];
+		if (sc->pool_size > 0) {
+			c = rlist_shift_entry(&sc->pool, struct coro, link);
+			--sc->pool_size;
+			c->state = CORO_STATE_RUNNING;
+#if LIBCORO_STATS
+			++engine->pool_hit_count;
+#endif
+		}
+	}
+	if (c == NULL) {
+		c = coro_engine_spawn_new(engine, stack_size);
+#if LIBCORO_STATS
+		++engine->spawn_new_count;
+#endif
+	}
+#if LIBCORO_STATS
+	c->resume_count = 0;
+	c->run_ticks = 0;
+	c->wait_ticks = 0;
+#endif
 	c->func = func;
 	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	c->priority = attr->priority;
+	c->is_pooled = is_pooled;
+	c->is_waiting_fd = false;
+	c->is_inactive = false;
+	c->is_wakeup_pending = false;
+	c->is_cancelled = false;
+	memset(c->locals, 0, sizeof(c->locals));
+	coro_set_name(c, attr->name);
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	const struct coro_attr *attr)
+{
+	struct coro *c = coro_engine_spawn_prepare(engine, func, func_arg, attr);
+	/* Now scheduler can work with that coroutine. */
+	coro_engine_lock(engine);
+	coro_active_add(engine, 1);
+	coro_engine_push_next(engine, c);
+	coro_engine_unlock(engine);
 	return c;
 }
 
+/** Put a joined coroutine into the pool or free it. */
+static void
+coro_engine_release(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->state == CORO_STATE_FINISHED);
+	assert(rlist_empty(&c->link));
+	if (!c->is_pooled) {
+		coro_engine_delete_coro(c);
+		return;
+	}
+	struct coro_stack_class *sc =
+		&engine->stack_classes[coro_stack_class_idx(c->stack_size)];
+	if (sc->pool_size >= engine->pool_limit) {
+		coro_engine_delete_coro(c);
+		return;
+	}
+	/* It might have finished in another worker. */
+	__atomic_store_n(&c->engine, engine, __ATOMIC_RELEASE);
+	/* The head is the most recently used, its stack is hot. */
+	rlist_add_entry(&sc->pool, c, link);
+	++sc->pool_size;
+}
+
+/**
+ * Shrink the pool to @a keep coroutines per stack class, and
+ * return physical memory of the kept stacks to the system. Their
+ * contexts are created anew, since the stacks get zeroed.
+ */
+static void
+coro_engine_trim(struct coro_engine *engine, size_t keep)
+{
+	coro_engine_shrink_pool(engine, keep);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_class *sc = &engine->stack_classes[i];
+		struct coro *c;
+		rlist_foreach_entry(c, &sc->pool, link) {
+			if (madvise(c->stack, c->stack_size, MADV_DONTNEED) != 0)
+				handle_error();
+			coro_ctx_create(c);
+		}
+	}
+}
+
+static size_t
+coro_engine_pool_size(const struct coro_engine *engine)
+{
+	size_t res = 0;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		res += engine->stack_classes[i].pool_size;
+	return res;
+}
+
 static void *
 coro_engine_join(struct coro_engine *engine, struct coro *coro)
 {
+	struct coro *this_coro = engine->this_coro;
+	assert(coro->group == NULL);
+	struct coro_engine *owner = coro_lock_owner(coro);
 	assert(coro->joiner == NULL);
-	coro->joiner = engine->this_coro;
+	coro->joiner = this_coro;
 	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
+		coro->state == CORO_STATE_SUSPENDED) {
+		coro_engine_unlock(owner);
+		engine = coro_engine_suspend(engine);
+		owner = coro_lock_owner(coro);
+	}
 	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this_coro);
+	assert(coro->joiner == this_coro);
 	coro->joiner = NULL;
 	void *ret = coro->ret;
 	coro->ret = NULL;
 	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	coro_engine_unlock(owner);
+	coro_engine_release(engine, coro);
 	return ret;
 }
 
-//////////////////////////////////////////////////////////////////
+/**
+ * Spawn all the members at once. They are queued in one splice,
+ * in the given order.
+ */
+static struct coro_group *
+coro_engine_spawn_group(struct coro_engine *engine, const coro_f *funcs,
+	void *const *args, int count)
+{
+	assert(count >= 0);
+	struct coro_group *group = new coro_group();
+	group->count = count;
+	group->pending = count;
+	group->joiner = count == 0 ? CORO_GROUP_DONE : NULL;
+	group->coros = new struct coro *[count];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	struct rlist batch;
+	rlist_create(&batch);
+	for (int i = 0; i < count; ++i) {
+		struct coro *c = coro_engine_spawn_prepare(engine, funcs[i],
+			args[i], &attr);
+		c->group = group;
+		coro_stats_on_queue(c);
+		rlist_add_tail_entry(&batch, c, link);
+		group->coros[i] = c;
+	}
+	coro_engine_lock(engine);
+	coro_active_add(engine, count);
+	rlist_splice_tail(&engine->run_queues[attr.priority].next, &batch);
+	coro_engine_add_run_count(engine, count);
+	coro_engine_unlock(engine);
+	return group;
+}
 
-static struct coro_engine glob_engine;
+static void
+coro_engine_group_join(struct coro_engine *engine, struct coro_group *group,
+	void **results)
+{
+	struct coro *expected = NULL;
+	if (__atomic_compare_exchange_n(&group->joiner, &expected,
+					engine->this_coro, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Woken up once, by the last member. */
+		while (__atomic_load_n(&group->joiner, __ATOMIC_ACQUIRE) !=
+		       CORO_GROUP_DONE)
+			engine = coro_engine_suspend(engine);
+	}
+	for (int i = 0; i < group->count; ++i) {
+		struct coro *c = group->coros[i];
+		/*
+		 * The member might be still leaving its stack. It
+		 * holds the engine lock until then.
+		 */
+		struct coro_engine *owner = coro_lock_owner(c);
+		assert(c->state == CORO_STATE_FINISHED);
+		assert(rlist_empty(&c->link));
+		coro_engine_unlock(owner);
+		if (results != NULL)
+			results[i] = c->ret;
+		c->ret = NULL;
+		c->group = NULL;
+		coro_engine_release(engine, c);
+	}
+	delete[] group->coros;
+	delete group;
+}
+
+#if CORO_USE_MT
+
+/** Make the engine a worker of the M:N mode. */
+static void
+coro_engine_create_worker(struct coro_engine *engine, int worker_id)
+{
+	engine->is_mt = true;
+	engine->worker_id = worker_id;
+	if (engine->epoll_fd < 0) {
+		engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (engine->epoll_fd < 0)
+			handle_error();
+	}
+	engine->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (engine->event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->event_fd,
+		      &ev) != 0)
+		handle_error();
+}
+
+#endif /* CORO_USE_MT */
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_engine *engine = (decltype(engine))arg;
+	coro_thread_engine = engine;
+	coro_engine_run(engine);
+	coro_thread_engine = NULL;
+	return NULL;
+}
+
+static void
+coro_workers_run(void)
+{
+	workers.is_done = workers.active_count == 0;
+	int thread_count = workers.count - 1;
+	pthread_t *threads = new pthread_t[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_engine *engine = workers.engines[i + 1];
+		engine->stack_size = glob_engine.stack_size;
+		coro_engine_set_pool_limit(engine, glob_engine.pool_limit);
+		if (pthread_create(&threads[i], NULL, coro_worker_f,
+				   engine) != 0)
+			handle_error();
+	}
+	coro_worker_f(&glob_engine);
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	delete[] threads;
+}
+
+//////////////////////////////////////////////////////////////////
 
 void
 coro_sched_init(void)
 {
 	coro_engine_create(&glob_engine);
+	memset(&workers, 0, sizeof(workers));
+	workers.count = 1;
+#if LIBCORO_STATS
+	workers.stats_start_ticks = coro_ticks();
+	workers.stats_start_ns = coro_clock_ns();
+#endif
+}
+
+void
+coro_sched_set_thread_count(int count)
+{
+	assert(workers.count == 1);
+	assert(coro_engine_of_thread() == NULL);
+#if CORO_USE_MT
+	if (count <= 1)
+		return;
+	workers.engines = new struct coro_engine *[count];
+	workers.engines[0] = &glob_engine;
+	for (int i = 1; i < count; ++i) {
+		workers.engines[i] = new struct coro_engine;
+		coro_engine_create(workers.engines[i]);
+	}
+	for (int i = 0; i < count; ++i)
+		coro_engine_create_worker(workers.engines[i], i);
+	workers.count = count;
+#else
+	(void)count;
+#endif
+}
+
+int
+coro_sched_thread_count(void)
+{
+	return workers.count;
 }
 
 void
 coro_sched_run(void)
 {
-	coro_engine_run(&glob_engine);
+	if (workers.count == 1)
+		coro_worker_f(&glob_engine);
+	else
+		coro_workers_run();
+}
+
+void
+coro_sched_set_stack_size(size_t size)
+{
+	coro_engine_set_stack_size(coro_engine_current(), size);
+}
+
+void
+coro_sched_set_pool_limit(size_t limit)
+{
+	coro_engine_set_pool_limit(coro_engine_current(), limit);
+}
+
+void
+coro_sched_trim(size_t keep)
+{
+	coro_engine_trim(coro_engine_current(), keep);
+}
+
+size_t
+coro_sched_pool_size(void)
+{
+	return coro_engine_pool_size(coro_engine_current());
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->coro_count = __atomic_load_n(&workers.coro_count,
+		__ATOMIC_RELAXED);
+#if LIBCORO_STATS
+	struct coro_engine *engines[] = {&glob_engine};
+	struct coro_engine **list = engines;
+	if (workers.count > 1)
+		list = workers.engines;
+	/* The other workers' numbers might be a bit stale. */
+	for (int i = 0; i < workers.count; ++i) {
+		struct coro_engine *e = list[i];
+		stats->switch_count += __atomic_load_n(&e->switch_count,
+			__ATOMIC_RELAXED);
+		stats->pool_hit_count += __atomic_load_n(&e->pool_hit_count,
+			__ATOMIC_RELAXED);
+		stats->spawn_new_count += __atomic_load_n(&e->spawn_new_count,
+			__ATOMIC_RELAXED);
+	}
+	stats->coro_count_peak = __atomic_load_n(&workers.coro_count_peak,
+		__ATOMIC_RELAXED);
+	uint64_t duration = coro_clock_ns() - workers.stats_start_ns;
+	if (duration > 0) {
+		stats->switches_per_sec = stats->switch_count * 1000000000.0 /
+			duration;
+	}
+#endif
 }
 
 void
 coro_sched_destroy(void)
 {
+	for (int i = 1; i < workers.count; ++i) {
+		coro_engine_destroy(workers.engines[i]);
+		delete workers.engines[i];
+	}
+	delete[] workers.engines;
 	coro_engine_destroy(&glob_engine);
+	assert(workers.coro_count == 0);
+	memset(&workers, 0, sizeof(workers));
+	workers.count = 1;
+#if LIBCORO_STACK_PROFILE
+	coro_stack_profile_report();
+#endif
+}
+
+size_t
+coro_stack_max_used(coro_f func)
+{
+	size_t res = 0;
+#if LIBCORO_STACK_PROFILE
+	pthread_mutex_lock(&coro_stack_profiles.mutex);
+	for (int i = 0; i < coro_stack_profiles.count; ++i) {
+		if (coro_stack_profiles.profiles[i].func == func)
+			res = coro_stack_profiles.profiles[i].max_used;
+	}
+	pthread_mutex_unlock(&coro_stack_profiles.mutex);
+#else
+	(void)func;
+#endif
+	return res;
 }
 
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this_coro;
+	return coro_current();
+}
+
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *))
+{
+	pthread_mutex_lock(&coro_keys_mutex);
+	for (int i = 0; i < CORO_KEY_MAX; ++i) {
+		struct coro_key_slot *slot = &coro_keys[i];
+		if (slot->is_used)
+			continue;
+		slot->is_used = true;
+		__atomic_store_n(&slot->destructor, destructor,
+			__ATOMIC_RELEASE);
+		pthread_mutex_unlock(&coro_keys_mutex);
+		*key = i;
+		return 0;
+	}
+	pthread_mutex_unlock(&coro_keys_mutex);
+	errno = EAGAIN;
+	return -1;
+}
+
+void
+coro_key_delete(coro_key_t key)
+{
+	assert(key >= 0 && key < CORO_KEY_MAX);
+	pthread_mutex_lock(&coro_keys_mutex);
+	struct coro_key_slot *slot = &coro_keys[key];
+	assert(slot->is_used);
+	slot->is_used = false;
+	__atomic_store_n(&slot->destructor, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&coro_keys_mutex);
+}
+
+void *
+coro_getspecific(coro_key_t key)
+{
+	assert(key >= 0 && key < CORO_KEY_MAX);
+	struct coro *c = coro_current();
+	if (c == NULL)
+		return NULL;
+	return c->locals[key];
+}
+
+int
+coro_setspecific(coro_key_t key, const void *value)
+{
+	assert(key >= 0 && key < CORO_KEY_MAX);
+	struct coro *c = coro_current();
+	if (c == NULL) {
+		errno = EPERM;
+		return -1;
+	}
+	c->locals[key] = (void *)value;
+	return 0;
+}
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	attr->stack_size = 0;
+	attr->name = NULL;
+	attr->priority = CORO_PRIORITY_NORMAL;
+	attr->is_pooled = true;
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, &attr);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, attr);
+}
+
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#if LIBCORO_STATS
+	stats->resume_count = coro->resume_count;
+	uint64_t run_ticks = coro->run_ticks;
+	/* The current slice is not accounted yet. */
+	if (coro->engine->this_coro == coro)
+		run_ticks += coro_ticks() - coro->resume_ticks;
+	stats->run_time_ns = coro_ticks_to_ns(run_ticks);
+	stats->wait_time_ns = coro_ticks_to_ns(coro->wait_ticks);
+#else
+	(void)coro;
+#endif
+}
+
+const char *
+coro_name(const struct coro *coro)
+{
+	return coro->name;
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority)
+{
+	assert(priority >= 0 && priority < CORO_PRIORITY_COUNT);
+	coro->priority = priority;
+}
+
+enum coro_priority
+coro_priority(const struct coro *coro)
+{
+	return coro->priority;
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_current(), coro);
+}
+
+struct coro_group *
+coro_spawn_group(const coro_f *funcs, void *const *args, int count)
+{
+	return coro_engine_spawn_group(coro_engine_current(), funcs, args,
+		count);
+}
+
+void
+coro_group_join(struct coro_group *group, void **results)
+{
+	coro_engine_group_join(coro_engine_current(), group, results);
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	struct coro_engine *owner = coro_lock_owner(coro);
+	coro->is_cancelled = true;
+	coro_engine_unlock(owner);
+	coro_engine_wakeup(coro_engine_current(), coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *c = coro_current();
+	return c != NULL && c->is_cancelled;
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(coro_engine_current());
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_timeout(coro_engine_current(), timeout);
+}
+
+void
+coro_sleep(double timeout)
+{
+	coro_engine_sleep(coro_engine_current(), timeout);
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	return coro_engine_wait_fd(coro_engine_current(), fd, events, timeout);
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_current());
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro_engine_current(), coro);
 }
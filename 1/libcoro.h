@@ -1,21 +1,175 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct coro;
+struct coro_group;
 typedef void *(*coro_f)(void *);
 
+enum {
+	/** Max length of a coroutine name, including terminating 0. */
+	CORO_NAME_MAX = 32,
+	/** Max number of coroutine-local keys existing at once. */
+	CORO_KEY_MAX = 16,
+};
+
+/** Coroutine-local storage key, see coro_key_create(). */
+typedef int coro_key_t;
+
+/**
+ * Scheduling priority class of a coroutine. Within one iteration
+ * of the scheduler the runnable coroutines of higher classes run
+ * first. The high priority ones, when woken up, run still in the
+ * current iteration instead of the next one. The lower classes
+ * are guaranteed to make progress anyway.
+ */
+enum coro_priority {
+	CORO_PRIORITY_HIGH,
+	CORO_PRIORITY_NORMAL,
+	CORO_PRIORITY_LOW,
+	CORO_PRIORITY_COUNT,
+};
+
+/** Parameters of a new coroutine. */
+struct coro_attr {
+	/**
+	 * Stack size. 0 means the engine's default set by
+	 * coro_sched_set_stack_size().
+	 */
+	size_t stack_size;
+	/**
+	 * Name for debugging. It is copied and truncated to
+	 * CORO_NAME_MAX. NULL means no name.
+	 */
+	const char *name;
+	/** Scheduling priority class. */
+	enum coro_priority priority;
+	/**
+	 * Reuse the coroutine after join for the next ones with
+	 * the same stack size class. Otherwise it is freed on
+	 * join.
+	 */
+	bool is_pooled;
+};
+
+/**
+ * Scheduling statistics of a coroutine. Collected only when built
+ * with LIBCORO_STATS, otherwise all zeros.
+ */
+struct coro_stats {
+	/** How many times the coroutine was resumed. */
+	uint64_t resume_count;
+	/** Time spent running, in nanoseconds. */
+	uint64_t run_time_ns;
+	/** Time spent ready to run in the queues, in nanoseconds. */
+	uint64_t wait_time_ns;
+};
+
+/**
+ * Statistics of the whole scheduler since coro_sched_init().
+ * Besides coro_count, collected only when built with
+ * LIBCORO_STATS, otherwise zeros.
+ */
+struct coro_sched_stats {
+	/** Number of context switches, the scheduler included. */
+	uint64_t switch_count;
+	/** Average context switches per second. */
+	double switches_per_sec;
+	/** New coroutines taken from the pool. */
+	uint64_t pool_hit_count;
+	/** New coroutines created with a new stack. */
+	uint64_t spawn_new_count;
+	/** Number of coroutines now, including the pooled ones. */
+	size_t coro_count;
+	/** Max number of coroutines ever existed at once. */
+	size_t coro_count_peak;
+};
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
 
+/**
+ * Run the coroutines in @a count threads, M:N. Each thread has
+ * its own scheduler with its own pools, the calling thread being
+ * one of them. The idle threads steal the runnable coroutines from
+ * the busy ones, so a coroutine can be resumed by another thread
+ * after any suspension or yield. It must not keep pointers to
+ * thread-local variables across those. The coroutines waiting
+ * for a timer or a descriptor stay in their thread.
+ *
+ * Can be called once after coro_sched_init(), before running.
+ * Without the assembly context switch and epoll it does nothing.
+ * The stack size and the pool limit are inherited by the threads
+ * from the calling one on each run, and then are per thread.
+ */
+void
+coro_sched_set_thread_count(int count);
+
+/** Number of the threads running the coroutines. */
+int
+coro_sched_thread_count(void);
+
 /**
  * Run the coroutines processing while there are any runnable
- * ones.
+ * ones. In the M:N mode - while any coroutine runs, is ready to
+ * run, or waits for a timer or a descriptor.
  */
 void
 coro_sched_run(void);
 
+/**
+ * Set the stack size of the new coroutines. 0 means the default
+ * size, which is 1MB. The stacks only reserve the address space.
+ * Physical memory is used as much as the coroutines really touch.
+ * The bottom of each stack is protected, so an overflow crashes
+ * right away.
+ *
+ * The sizes are rounded up to a power of 2 up to 8MB, and the
+ * joined coroutines are pooled separately for each such size
+ * class. The bigger stacks are never pooled.
+ */
+void
+coro_sched_set_stack_size(size_t size);
+
+/**
+ * Set the max number of joined coroutines kept for reuse in each
+ * stack size class. The excess is freed right away. By default
+ * there is no limit.
+ */
+void
+coro_sched_set_pool_limit(size_t limit);
+
+/**
+ * Free the pooled coroutines so that at most @a keep remain in
+ * each stack size class. The physical memory of the remaining
+ * ones' stacks is returned to the system too. Useful after a
+ * burst of coroutines to return the memory usage to normal.
+ */
+void
+coro_sched_trim(size_t keep);
+
+/** Number of the joined coroutines kept for reuse. */
+size_t
+coro_sched_pool_size(void);
+
+/** Collect the scheduler statistics, of all the threads. */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/**
+ * Max stack depth in bytes used by the coroutines with this
+ * function since the last coro_sched_destroy(). Collected only
+ * when built with LIBCORO_STACK_PROFILE, otherwise 0. Then the
+ * stacks are filled with a pattern before each coroutine function
+ * runs, and coro_sched_destroy() prints the usage grouped by the
+ * function.
+ */
+size_t
+coro_stack_max_used(coro_f func);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -38,6 +192,73 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Create a key for coroutine-local values, like pthread keys.
+ * Each coroutine has its own value of each key, NULL since the
+ * start. The keys are common for all the threads and are not
+ * reset by coro_sched_destroy().
+ *
+ * When the coroutine function returns, the destructor, if any, is
+ * called for each not NULL value of the key. It runs in that
+ * coroutine, before the joiner is woken up.
+ *
+ * @retval 0 Success, the key is stored into @a key.
+ * @retval -1 All CORO_KEY_MAX keys are used, errno is EAGAIN.
+ */
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *));
+
+/**
+ * Delete the key. The values are not destroyed. The key may
+ * not be used by anyone anymore.
+ */
+void
+coro_key_delete(coro_key_t key);
+
+/**
+ * Value of the key in the current coroutine. NULL outside of the
+ * coroutines.
+ */
+void *
+coro_getspecific(coro_key_t key);
+
+/**
+ * Set value of the key in the current coroutine.
+ *
+ * @retval 0 Success.
+ * @retval -1 Called outside of a coroutine, errno is EPERM.
+ */
+int
+coro_setspecific(coro_key_t key, const void *value);
+
+/** Initialize the coroutine attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/** Same as coro_new(), but with the given attributes. */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/** Name of the coroutine given at creation. Empty if none. */
+const char *
+coro_name(const struct coro *coro);
+
+/** Collect the statistics of a not yet joined coroutine. */
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Change priority class of the coroutine. If the coroutine is
+ * already queued to run, it takes effect since its next wakeup or
+ * yield.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority priority);
+
+/** Get priority class of the coroutine. */
+enum coro_priority
+coro_priority(const struct coro *coro);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,6 +267,42 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Spawn @a count coroutines at once, the i-th calls funcs[i] with
+ * args[i]. They are created with the default attributes and start
+ * in the given order. The members can't be joined one by one, only
+ * all together with coro_group_join().
+ */
+struct coro_group *
+coro_spawn_group(const coro_f *funcs, void *const *args, int count);
+
+/**
+ * Wait for all the members of the group and free them together
+ * with the group. The joiner is woken up only once, by the last
+ * finished member.
+ *
+ * @param results If not NULL, the i-th member's result is stored
+ *        into results[i].
+ */
+void
+coro_group_join(struct coro_group *group, void **results);
+
+/**
+ * Cancel the coroutine. It is woken up, and since then doesn't
+ * sleep anymore: coro_suspend() and coro_suspend_timeout() only
+ * yield, coro_sleep() returns early, coro_wait_fd() fails with
+ * ECANCELED. The coroutine is supposed to check
+ * coro_is_cancelled() after its waits and finish. It still has
+ * to be joined. Cancellation of a finished coroutine does
+ * nothing.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Whether the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
@@ -54,6 +311,49 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the coroutine is woken up
+ * automatically when the timeout in seconds passes. While
+ * nothing else is runnable, the scheduler blocks the thread
+ * until the closest timeout instead of spinning.
+ *
+ * @retval true Woken up by coro_wakeup().
+ * @retval false The timeout has passed.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Pause the current coroutine for the given number of seconds.
+ * Wakeups in the meantime are ignored.
+ */
+void
+coro_sleep(double timeout);
+
+enum coro_fd_event {
+	CORO_FD_READ = 1,
+	CORO_FD_WRITE = 2,
+	/** Error or hangup. Only reported, can't be waited for. */
+	CORO_FD_ERROR = 4,
+};
+
+/**
+ * Suspend the current coroutine until the descriptor has any of
+ * the given events, CORO_FD_READ and/or CORO_FD_WRITE. While
+ * nothing is runnable, the scheduler blocks in the kernel until
+ * any of the descriptors is ready or the closest timer expires.
+ * Only one coroutine can wait on the same descriptor at a time.
+ * @param fd Descriptor to wait on.
+ * @param events Mask of CORO_FD_* events to wait for.
+ * @param timeout Timeout in seconds. Negative means infinity.
+ *
+ * @retval >0 Mask of the ready CORO_FD_* events.
+ * @retval 0 Timeout or the coroutine was woken up explicitly.
+ * @retval -1 Error, check errno.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -66,6 +366,10 @@ coro_yield(void);
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
  * this function is a nop.
+ *
+ * In the M:N mode it can be called from any thread. A wakeup of
+ * a coroutine running in another thread is not lost - its next
+ * suspension returns right away.
  */
 void
 coro_wakeup(struct coro *coro);
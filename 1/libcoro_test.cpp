@@ -2,6 +2,14 @@
 
 #include "unit.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +170,603 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int
+test_stack_recurse(int depth)
+{
+	volatile char frame[1024];
+	frame[0] = 1;
+	if (depth == 0)
+		return 0;
+	return test_stack_recurse(depth - 1) + frame[0];
+}
+
+static void *
+test_stack_use_f(void *arg)
+{
+	int depth = *(int *)arg;
+	*(int *)arg = test_stack_recurse(depth);
+	return NULL;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	coro_sched_set_stack_size(64 * 1024);
+	int arg = 40;
+	struct coro *c = coro_new(test_stack_use_f, &arg);
+	unit_check(coro_join(c) == NULL, "small stack fits its usage");
+	unit_check(arg == 40, "recursion result");
+
+	coro_sched_set_stack_size(0);
+	arg = 500;
+	c = coro_new(test_stack_use_f, &arg);
+	unit_check(coro_join(c) == NULL, "default stack fits more");
+	unit_check(arg == 500, "deep recursion result");
+
+	size_t used = coro_stack_max_used(test_stack_use_f);
+#if LIBCORO_STACK_PROFILE
+	unit_check(used >= 500 * 1024, "profiler saw the deepest run");
+	unit_check(used < 1024 * 1024, "but not more");
+#else
+	unit_check(used == 0, "no stack profile");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_get_name_f(void *arg)
+{
+	(void)arg;
+	return (void *)coro_name(coro_this());
+}
+
+static void
+test_new_ex(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.name = "a_rather_long_name_to_be_truncated_somewhere";
+	attr.stack_size = 16 * 1024;
+	attr.is_pooled = false;
+	struct coro *c = coro_new_ex(test_get_name_f, NULL, &attr);
+	unit_check(strlen(coro_name(c)) == CORO_NAME_MAX - 1, "name is truncated");
+	unit_check(strncmp(coro_name(c), attr.name, CORO_NAME_MAX - 1) == 0,
+		"name is kept");
+	coro_join(c);
+
+	attr.stack_size = 8 * 1024 * 1024;
+	attr.name = NULL;
+	int arg = 2000;
+	c = coro_new_ex(test_stack_use_f, &arg, &attr);
+	unit_check(coro_join(c) == NULL, "big stack is used");
+	unit_check(arg == 2000, "deep recursion result");
+
+	c = coro_new(test_get_name_f, NULL);
+	unit_check(*(const char *)coro_join(c) == 0, "no name by default");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_pool_trim(void)
+{
+	unit_test_start();
+
+	const int coro_count = 10;
+	struct coro *coros[coro_count];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	int arg = 0;
+	coro_sched_trim(0);
+	unit_check(coro_sched_pool_size() == 0, "pool is empty");
+	for (int i = 0; i < coro_count; ++i) {
+		attr.stack_size = i % 2 == 0 ? 32 * 1024 : 128 * 1024;
+		coros[i] = coro_new_ex(test_stack_use_f, &arg, &attr);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(coro_sched_pool_size() == coro_count, "all are pooled");
+
+	coro_sched_trim(2);
+	unit_check(coro_sched_pool_size() == 4, "2 are kept in each class");
+	arg = 20;
+	struct coro *c = coro_new_ex(test_stack_use_f, &arg, &attr);
+	unit_check(coro_sched_pool_size() == 3, "trimmed coro is reused");
+	coro_join(c);
+	unit_check(arg == 20, "trimmed coro works");
+
+	coro_sched_set_pool_limit(1);
+	unit_check(coro_sched_pool_size() == 2, "limit is applied");
+	c = coro_new_ex(test_stack_use_f, &arg, &attr);
+	struct coro *c2 = coro_new_ex(test_stack_use_f, &arg, &attr);
+	coro_join(c);
+	coro_join(c2);
+	unit_check(coro_sched_pool_size() == 2, "limit holds on join");
+	coro_sched_set_pool_limit(SIZE_MAX);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_prio_order {
+	int ids[3];
+	int size;
+};
+
+struct test_prio_ctx {
+	struct test_prio_order *order;
+	int id;
+};
+
+static void *
+test_prio_record_f(void *arg)
+{
+	struct test_prio_ctx *ctx = (decltype(ctx))arg;
+	ctx->order->ids[ctx->order->size++] = ctx->id;
+	return NULL;
+}
+
+struct test_prio_ping_ctx {
+	struct coro *peer;
+	int ping_count;
+	int done_count;
+};
+
+static void *
+test_prio_ping_f(void *arg)
+{
+	struct test_prio_ping_ctx *ctx = (decltype(ctx))arg;
+	for (; ctx->done_count < ctx->ping_count; ++ctx->done_count) {
+		coro_wakeup(ctx->peer);
+		coro_suspend();
+	}
+	coro_wakeup(ctx->peer);
+	return NULL;
+}
+
+static void *
+test_prio_progress_f(void *arg)
+{
+	struct test_prio_ping_ctx *ctx = (decltype(ctx))arg;
+	return (void *)(intptr_t)ctx->done_count;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct test_prio_order order;
+	order.size = 0;
+	struct test_prio_ctx ctx[3];
+	struct coro *coros[3];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	for (int i = 0; i < 3; ++i) {
+		ctx[i].order = &order;
+		ctx[i].id = i;
+		attr.priority = i == 2 ? CORO_PRIORITY_HIGH : CORO_PRIORITY_LOW;
+		coros[i] = coro_new_ex(test_prio_record_f, &ctx[i], &attr);
+	}
+	unit_check(coro_priority(coros[2]) == CORO_PRIORITY_HIGH, "priority");
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_check(order.size == 3, "all have run");
+	unit_check(order.ids[0] == 2, "high priority goes first");
+	unit_check(order.ids[1] == 0 && order.ids[2] == 1,
+		"then the others in order");
+
+	unit_msg("high priority ping-pong doesn't starve the others");
+	struct test_prio_ping_ctx ping[2];
+	attr.priority = CORO_PRIORITY_HIGH;
+	for (int i = 0; i < 2; ++i) {
+		ping[i].ping_count = 1000;
+		ping[i].done_count = 0;
+		coros[i] = coro_new_ex(test_prio_ping_f, &ping[i], &attr);
+	}
+	ping[0].peer = coros[1];
+	ping[1].peer = coros[0];
+	struct coro *normal = coro_new(test_prio_progress_f, &ping[0]);
+	intptr_t progress = (intptr_t)coro_join(normal);
+	unit_check(progress < ping[0].ping_count, "normal coro wasn't starved");
+	unit_check(coro_join(coros[0]) == NULL, "ping finished");
+	unit_check(coro_join(coros[1]) == NULL, "pong finished");
+	unit_check(ping[0].done_count == 1000, "all pings are done");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void *
+test_sleep_f(void *arg)
+{
+	coro_sleep(*(double *)arg);
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	return (void *)(intptr_t)coro_suspend_timeout(*(double *)arg);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	double timeout = 0.05;
+	double start = test_now();
+	struct coro *c = coro_new(test_sleep_f, &timeout);
+	coro_wakeup(c);
+	coro_join(c);
+	double duration = test_now() - start;
+	unit_check(duration >= timeout, "sleep ignores wakeups");
+	unit_check(duration < 1, "sleep isn't too long");
+
+	start = test_now();
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == (void *)false, "timed out");
+	unit_check(test_now() - start >= timeout, "after the timeout");
+
+	timeout = 10;
+	start = test_now();
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)true, "woken up before timeout");
+	unit_check(test_now() - start < 1, "didn't wait for the timeout");
+
+	unit_msg("many timers with different deadlines");
+	const int coro_count = 20;
+	struct coro *coros[coro_count];
+	double timeouts[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		timeouts[i] = ((i * 7) % coro_count) / 1000.0;
+		coros[i] = coro_new(test_suspend_timeout_f, &timeouts[i]);
+	}
+	start = test_now();
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)false);
+	unit_check(test_now() - start >= (coro_count - 1) / 1000.0,
+		"all timed out");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_wait_fd_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	coro_sleep(0.02);
+	char c = 'x';
+	unit_assert(write(fd, &c, 1) == 1);
+	return NULL;
+}
+
+static void *
+test_wait_fd_reader_f(void *arg)
+{
+	int fd = *(int *)arg;
+	return (void *)(intptr_t)coro_wait_fd(fd, CORO_FD_READ, -1);
+}
+
+struct test_wait_fd_busy_ctx {
+	int fd;
+	bool is_done;
+};
+
+static void *
+test_wait_fd_busy_reader_f(void *arg)
+{
+	struct test_wait_fd_busy_ctx *ctx = (decltype(ctx))arg;
+	int rc = coro_wait_fd(ctx->fd, CORO_FD_READ, -1);
+	ctx->is_done = true;
+	return (void *)(intptr_t)rc;
+}
+
+static void
+test_wait_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	double start = test_now();
+	unit_check(coro_wait_fd(fds[0], CORO_FD_READ, 0.02) == 0, "timeout");
+	unit_check(test_now() - start >= 0.02, "after the timeout");
+	unit_check(coro_wait_fd(fds[0], CORO_FD_WRITE, -1) == CORO_FD_WRITE,
+		"write is ready at once");
+
+	struct coro *reader = coro_new(test_wait_fd_reader_f, &fds[0]);
+	struct coro *writer = coro_new(test_wait_fd_writer_f, &fds[1]);
+	unit_check(coro_join(reader) == (void *)CORO_FD_READ, "read is ready");
+	coro_join(writer);
+	char c;
+	unit_assert(read(fds[0], &c, 1) == 1);
+
+	unit_msg("a busy coroutine doesn't starve the descriptors");
+	struct test_wait_fd_busy_ctx ctx;
+	ctx.fd = fds[0];
+	ctx.is_done = false;
+	reader = coro_new(test_wait_fd_busy_reader_f, &ctx);
+	coro_yield();
+	writer = coro_new(test_wait_fd_writer_f, &fds[1]);
+	coro_join(writer);
+	int yield_count = 0;
+	while (!ctx.is_done && yield_count < 1000000) {
+		coro_yield();
+		++yield_count;
+	}
+	unit_check(ctx.is_done, "woken up while others run");
+	unit_check(coro_join(reader) == (void *)CORO_FD_READ, "read is ready");
+	unit_assert(read(fds[0], &c, 1) == 1);
+
+	unit_msg("one waiter per descriptor");
+	reader = coro_new(test_wait_fd_reader_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_wait_fd(fds[0], CORO_FD_READ, 0) == -1, "busy");
+	coro_wakeup(reader);
+	unit_check(coro_join(reader) == (void *)0, "explicit wakeup");
+
+	close(fds[0]);
+	close(fds[1]);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before;
+	coro_sched_stats(&before);
+	int yield_count = 10;
+	struct coro *c = coro_new(test_stats_f, &yield_count);
+	/* Let it finish, but keep not joined. */
+	for (int i = 0; i <= yield_count; ++i)
+		coro_yield();
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	struct coro_sched_stats after;
+	coro_sched_stats(&after);
+	coro_join(c);
+	unit_check(after.coro_count >= 2, "coro count");
+#if LIBCORO_STATS
+	unit_check(stats.resume_count == (uint64_t)yield_count + 1,
+		"resume count");
+	unit_check(after.switch_count > before.switch_count, "switches");
+	unit_check(after.switches_per_sec > 0, "switch rate");
+	unit_check(after.pool_hit_count + after.spawn_new_count ==
+		before.pool_hit_count + before.spawn_new_count + 1, "spawns");
+	unit_check(after.coro_count_peak >= after.coro_count, "peak");
+	struct coro_stats self;
+	coro_stats(coro_this(), &self);
+	unit_check(self.resume_count > 0 && self.run_time_ns > 0,
+		"the running coroutine");
+#else
+	unit_check(stats.resume_count == 0 && after.switch_count == 0,
+		"compiled out");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_key_destroy_count = 0;
+
+static void
+test_key_destructor(void *value)
+{
+	unit_assert(value == &test_key_destroy_count);
+	++test_key_destroy_count;
+}
+
+static void *
+test_key_f(void *arg)
+{
+	coro_key_t key = *(coro_key_t *)arg;
+	unit_assert(coro_getspecific(key) == NULL);
+	unit_assert(coro_setspecific(key, coro_this()) == 0);
+	coro_yield();
+	void *res = coro_getspecific(key);
+	return (void *)(res == coro_this());
+}
+
+static void *
+test_key_destroy_f(void *arg)
+{
+	coro_key_t key = *(coro_key_t *)arg;
+	unit_assert(coro_setspecific(key, &test_key_destroy_count) == 0);
+	return NULL;
+}
+
+static void
+test_keys(void)
+{
+	unit_test_start();
+
+	coro_key_t key;
+	unit_assert(coro_key_create(&key, NULL) == 0);
+	struct coro *c1 = coro_new(test_key_f, &key);
+	struct coro *c2 = coro_new(test_key_f, &key);
+	unit_check(coro_setspecific(key, &key) == 0, "set in this coro");
+	coro_yield();
+	unit_check(coro_getspecific(key) == &key, "not changed by others");
+	unit_check(coro_join(c1) == (void *)true, "first has own value");
+	unit_check(coro_join(c2) == (void *)true, "second has own value");
+	unit_assert(coro_setspecific(key, NULL) == 0);
+	coro_key_delete(key);
+
+	unit_assert(coro_key_create(&key, test_key_destructor) == 0);
+	coro_join(coro_new(test_key_destroy_f, &key));
+	unit_check(test_key_destroy_count == 1, "destructor is called");
+	int yield_count = 1;
+	coro_join(coro_new(test_stats_f, &yield_count));
+	unit_check(test_key_destroy_count == 1, "not for NULL values");
+	coro_key_delete(key);
+
+	coro_key_t keys[CORO_KEY_MAX];
+	int count = 0;
+	while (count < CORO_KEY_MAX && coro_key_create(&keys[count], NULL) == 0)
+		++count;
+	unit_check(coro_key_create(&key, NULL) == -1 && errno == EAGAIN,
+		"key limit");
+	while (count > 0)
+		coro_key_delete(keys[--count]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_group_f(void *arg)
+{
+	intptr_t i = (intptr_t)arg;
+	for (intptr_t j = 0; j < i % 3; ++j)
+		coro_yield();
+	return (void *)(i * i);
+}
+
+static void
+test_group(void)
+{
+	unit_test_start();
+
+	const int count = 10;
+	coro_f funcs[count];
+	void *args[count];
+	void *results[count];
+	for (int i = 0; i < count; ++i) {
+		funcs[i] = test_group_f;
+		args[i] = (void *)(intptr_t)i;
+	}
+	struct coro_group *group = coro_spawn_group(funcs, args, count);
+	coro_group_join(group, results);
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i)
+		is_ok = is_ok && results[i] == (void *)(intptr_t)(i * i);
+	unit_check(is_ok, "all results");
+
+	group = coro_spawn_group(funcs, args, count);
+	/* Let them all finish before the join. */
+	for (int i = 0; i < 5; ++i)
+		coro_yield();
+	coro_group_join(group, NULL);
+	unit_msg("joined a finished group");
+
+	coro_group_join(coro_spawn_group(funcs, args, 0), NULL);
+	unit_msg("joined an empty group");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_cancel_suspend_f(void *arg)
+{
+	(void)arg;
+	while (!coro_is_cancelled())
+		coro_suspend();
+	return NULL;
+}
+
+static void *
+test_cancel_wait_fd_f(void *arg)
+{
+	int rc = coro_wait_fd(*(int *)arg, CORO_FD_READ, -1);
+	return (void *)(rc == -1 && errno == ECANCELED);
+}
+
+static void *
+test_cancel_join_f(void *arg)
+{
+	/* A cancelled joiner still waits, not spins forever. */
+	return coro_join((struct coro *)arg);
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	unit_check(!coro_is_cancelled(), "not cancelled by default");
+	struct coro *c = coro_new(test_cancel_suspend_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == NULL, "suspended one is cancelled");
+
+	double timeout = 10;
+	double start = test_now();
+	c = coro_new(test_sleep_f, &timeout);
+	coro_yield();
+	coro_cancel(c);
+	coro_join(c);
+	unit_check(test_now() - start < 1, "sleep is interrupted");
+
+	int fds[2];
+	unit_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	c = coro_new(test_cancel_wait_fd_f, &fds[0]);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)true,
+		"descriptor wait is interrupted");
+	close(fds[0]);
+	close(fds[1]);
+
+	timeout = 0.02;
+	c = coro_new(test_sleep_f, &timeout);
+	struct coro *joiner = coro_new(test_cancel_join_f, c);
+	coro_yield();
+	coro_cancel(joiner);
+	coro_join(joiner);
+	unit_msg("cancelled join waits for the coroutine");
+
+	c = coro_new(test_cancel_suspend_f, NULL);
+	coro_cancel(c);
+	unit_check(coro_join(c) == NULL, "cancelled before start");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,9 +776,212 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_new_ex();
+	test_pool_trim();
+	test_priority();
+	test_timers();
+	test_wait_fd();
+	test_stats();
+	test_keys();
+	test_group();
+	test_cancel();
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_MT_THREAD_COUNT = 4,
+};
+
+static __thread bool test_mt_is_thread_seen = false;
+
+struct test_mt_spread_ctx {
+	int thread_count;
+	int migration_count;
+	long sum;
+};
+
+static void
+test_mt_mark_thread(struct test_mt_spread_ctx *ctx)
+{
+	if (test_mt_is_thread_seen)
+		return;
+	test_mt_is_thread_seen = true;
+	__atomic_add_fetch(&ctx->thread_count, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+test_mt_spread_f(void *arg)
+{
+	struct test_mt_spread_ctx *ctx = (decltype(ctx))arg;
+	long sum = 0;
+	for (int i = 0; i < 200; ++i) {
+		pthread_t self = pthread_self();
+		test_mt_mark_thread(ctx);
+		for (int j = 0; j < 10000; ++j)
+			sum += j % 7;
+		coro_yield();
+		if (!pthread_equal(self, pthread_self())) {
+			__atomic_add_fetch(&ctx->migration_count, 1,
+				__ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&ctx->sum, sum, __ATOMIC_RELAXED);
+	/*
+	 * On a single CPU the other threads might not even get a
+	 * chance before the work is done. Give it to them.
+	 */
+	double deadline = test_now() + 5;
+	while (__atomic_load_n(&ctx->thread_count, __ATOMIC_RELAXED) < 2 &&
+	       test_now() < deadline) {
+		test_mt_mark_thread(ctx);
+		coro_yield();
+	}
 	return NULL;
 }
 
+static void
+test_mt_spread(void)
+{
+	unit_test_start();
+
+	struct test_mt_spread_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	const int coro_count = 32;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_spread_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	long expected = 0;
+	for (int j = 0; j < 10000; ++j)
+		expected += j % 7;
+	expected *= 200 * coro_count;
+	unit_check(ctx.sum == expected, "all the work is done");
+	unit_check(ctx.thread_count > 1, "in several threads");
+	unit_msg("migrations: %d", ctx.migration_count);
+
+	unit_test_finish();
+}
+
+struct test_mt_pingpong_ctx {
+	struct coro *players[2];
+	int turn;
+	int round_count;
+};
+
+struct test_mt_player {
+	struct test_mt_pingpong_ctx *game;
+	int id;
+};
+
+static void *
+test_mt_player_f(void *arg)
+{
+	struct test_mt_player *p = (decltype(p))arg;
+	struct test_mt_pingpong_ctx *game = p->game;
+	for (int i = 0; i < game->round_count; ++i) {
+		while (__atomic_load_n(&game->turn, __ATOMIC_ACQUIRE) != p->id)
+			coro_suspend();
+		__atomic_store_n(&game->turn, 1 - p->id, __ATOMIC_RELEASE);
+		coro_wakeup(game->players[1 - p->id]);
+	}
+	return NULL;
+}
+
+static void
+test_mt_wakeup(void)
+{
+	unit_test_start();
+
+	const int game_count = 8;
+	struct test_mt_pingpong_ctx games[game_count];
+	struct test_mt_player players[game_count][2];
+	for (int i = 0; i < game_count; ++i) {
+		games[i].turn = 0;
+		games[i].round_count = 2000;
+		for (int j = 0; j < 2; ++j) {
+			players[i][j].game = &games[i];
+			players[i][j].id = j;
+			games[i].players[j] = coro_new(test_mt_player_f,
+				&players[i][j]);
+		}
+	}
+	for (int i = 0; i < game_count; ++i) {
+		coro_join(games[i].players[0]);
+		coro_join(games[i].players[1]);
+	}
+	unit_check(true, "no wakeups are lost");
+
+	unit_test_finish();
+}
+
+static void
+test_mt_timers(void)
+{
+	unit_test_start();
+
+	double timeout = 0.05;
+	const int coro_count = 16;
+	struct coro *coros[coro_count];
+	double start = test_now();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sleep_f, &timeout);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	double duration = test_now() - start;
+	unit_check(duration >= timeout, "slept");
+	unit_check(duration < 1, "concurrently");
+
+	unit_test_finish();
+}
+
+static void *
+test_mt_group_f(void *arg)
+{
+	int *counter = (int *)arg;
+	for (int i = 0; i < 100; ++i) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_mt_group(void)
+{
+	unit_test_start();
+
+	const int count = 64;
+	coro_f funcs[count];
+	void *args[count];
+	int counter = 0;
+	for (int i = 0; i < count; ++i) {
+		funcs[i] = test_mt_group_f;
+		args[i] = &counter;
+	}
+	for (int i = 0; i < 20; ++i)
+		coro_group_join(coro_spawn_group(funcs, args, count), NULL);
+	unit_check(counter == 20 * count * 100, "all members are done");
+
+	unit_test_finish();
+}
+
+static void *
+coro_mt_main_f(void *arg)
+{
+	(void)arg;
+	test_mt_spread();
+	test_mt_wakeup();
+	test_mt_timers();
+	test_mt_group();
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int
 main(void)
 {
@@ -183,5 +991,17 @@ main(void)
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
 	coro_sched_destroy();
+
+	coro_sched_init();
+	coro_sched_set_thread_count(TEST_MT_THREAD_COUNT);
+	if (coro_sched_thread_count() == TEST_MT_THREAD_COUNT) {
+		main_coro = coro_new(coro_mt_main_f, NULL);
+		coro_sched_run();
+		rc = coro_join(main_coro);
+		unit_check(rc == NULL, "M:N main coro rc");
+	} else {
+		unit_msg("M:N mode is not supported");
+	}
+	coro_sched_destroy();
 	return 0;
 }
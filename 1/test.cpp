@@ -2,8 +2,14 @@
 
 #include "unit.h"
 #include "corobus.h"
+#include "coro_channel.h"
 
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <memory>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -176,6 +182,22 @@ test_channel_reopen(void)
 	coro_bus_channel_close(bus, c1);
 	coro_bus_channel_close(bus, c2);
 
+	unit_msg("a reused channel starts fresh");
+	c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	coro_bus_channel_close(bus, c1);
+	c1 = coro_bus_channel_open(bus, 3);
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 0 && stats.max_size == 0);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == i);
+	coro_bus_channel_close(bus, c1);
+
 	unit_msg("open and close many times");
 	c1 = coro_bus_channel_open(bus, 2);
 	for (int i = 0; i < 100; ++i) {
@@ -185,6 +207,24 @@ test_channel_reopen(void)
 	}
 	coro_bus_channel_close(bus, c1);
 
+	unit_msg("holes are reused before the table grows");
+	const int count = 16;
+	int descs[count];
+	for (int i = 0; i < count; ++i) {
+		descs[i] = coro_bus_channel_open(bus, 1);
+		unit_assert(descs[i] >= 0);
+	}
+	for (int i = 0; i < count; i += 2)
+		coro_bus_channel_close(bus, descs[i]);
+	for (int i = 0; i < count; i += 2) {
+		c1 = coro_bus_channel_open(bus, 1);
+		unit_assert(c1 >= 0 && c1 < count);
+		unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+		unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	}
+	unit_assert(coro_bus_channel_open(bus, 1) >= count);
+	unit_msg("the bus deletes the channels left open");
+
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -743,6 +783,825 @@ test_wakeup_on_close(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_cancel_waiters(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("cancel a receiver");
+	unsigned data1 = 987;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	unsigned data2 = 654;
+	struct ctx_recv recv_ctx2;
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	coro_cancel(recv_ctx1.worker);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(data1 == 987);
+
+	unit_msg("the other receiver still works");
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(recv_join(&recv_ctx2) == 0);
+	unit_assert(data2 == 123);
+
+	unit_msg("cancel a sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct ctx_send send_ctx1;
+	send_start(&send_ctx1, bus, c1, 2);
+	coro_yield();
+	unit_assert(send_ctx1.is_started && !send_ctx1.is_done);
+	coro_cancel(send_ctx1.worker);
+	unit_assert(send_join(&send_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0);
+	unit_assert(data1 == 1);
+	unit_assert(coro_bus_try_recv(bus, c1, &data1) != 0);
+
+	unit_msg("cancel and close before the receiver wakes up");
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	coro_cancel(recv_ctx1.worker);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_recv_handoff(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a waiting receiver gets the message bypassing the channel");
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(data1 == 1);
+	unit_msg("the channel stays empty and can take one more");
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(recv_join(&recv_ctx1) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0);
+	unit_assert(data1 == 2);
+
+	unit_msg("cancel after the handoff doesn't lose the message");
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	coro_cancel(recv_ctx1.worker);
+	unit_assert(recv_join(&recv_ctx1) == 0);
+	unit_assert(data1 == 4);
+
+	unit_msg("the order is kept when the channel is not empty");
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unsigned data2 = 0;
+	struct ctx_recv recv_ctx2;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(recv_join(&recv_ctx1) == 0);
+	unit_assert(recv_join(&recv_ctx2) == 0);
+	unit_assert(data1 == 5 && data2 == 6);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	const int *channels;
+	int count;
+	bool is_weighted;
+	unsigned data;
+	int which;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = (decltype(ctx))arg;
+	if (ctx->is_weighted) {
+		ctx->rc = coro_bus_select_weighted(ctx->bus, ctx->channels,
+			ctx->count, &ctx->data, &ctx->which);
+	} else {
+		ctx->rc = coro_bus_select(ctx->bus, ctx->channels, ctx->count,
+			&ctx->data, &ctx->which);
+	}
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start_ex(struct ctx_select *ctx, struct coro_bus *bus,
+	const int *channels, int count, bool is_weighted)
+{
+	ctx->bus = bus;
+	ctx->channels = channels;
+	ctx->count = count;
+	ctx->is_weighted = is_weighted;
+	ctx->data = 0;
+	ctx->which = -1;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus,
+	const int *channels, int count)
+{
+	select_start_ex(ctx, bus, channels, count, false);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int channels[3];
+	for (int i = 0; i < 3; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 2);
+		unit_assert(channels[i] >= 0);
+	}
+	unsigned data = 0;
+	int which = -1;
+
+	unit_msg("no channels");
+	unit_assert(coro_bus_select(bus, channels, 0, &data, &which) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a message is ready");
+	unit_assert(coro_bus_send(bus, channels[1], 10) == 0);
+	unit_assert(coro_bus_select(bus, channels, 3, &data, &which) == 0);
+	unit_assert(data == 10 && which == 1);
+
+	unit_msg("wait on all the channels");
+	struct ctx_select ctx1;
+	select_start(&ctx1, bus, channels, 3);
+	coro_yield();
+	unit_assert(!ctx1.is_done);
+	coro_wakeup(ctx1.worker);
+	coro_yield();
+	unit_assert(!ctx1.is_done);
+	unit_assert(coro_bus_send(bus, channels[2], 20) == 0);
+	unit_assert(select_join(&ctx1) == 0);
+	unit_assert(ctx1.data == 20 && ctx1.which == 2);
+	unit_msg("the other channels have no waiters left");
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_send(bus, channels[0], 30) == 0);
+	unit_assert(coro_bus_stats(bus, channels[0], &stats) == 0);
+	unit_assert(stats.recv_wait_count == 2);
+	unit_assert(coro_bus_try_recv(bus, channels[0], &data) == 0);
+	unit_assert(data == 30);
+
+	unit_msg("a wakeup of a busy selector is passed on");
+	struct ctx_select ctx2;
+	select_start(&ctx1, bus, channels, 2);
+	select_start(&ctx2, bus, channels, 2);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, channels[0], 40) == 0);
+	unit_assert(coro_bus_send(bus, channels[1], 50) == 0);
+	unit_assert(select_join(&ctx1) == 0);
+	unit_assert(select_join(&ctx2) == 0);
+	unit_assert(ctx1.data + ctx2.data == 90);
+	unit_assert(ctx1.which != ctx2.which);
+
+	unit_msg("a closed channel interrupts the wait");
+	select_start(&ctx1, bus, channels, 3);
+	coro_yield();
+	coro_bus_channel_close(bus, channels[1]);
+	unit_assert(select_join(&ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(ctx1.which == 1);
+	unit_assert(coro_bus_select(bus, channels, 3, &data, &which) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("cancel");
+	channels[1] = channels[2];
+	select_start(&ctx1, bus, channels, 2);
+	coro_yield();
+	coro_cancel(ctx1.worker);
+	unit_assert(select_join(&ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+
+	unit_msg("many channels");
+	const int count = 20;
+	int many[count];
+	for (int i = 0; i < count; ++i) {
+		many[i] = coro_bus_channel_open(bus, 1);
+		unit_assert(many[i] >= 0);
+	}
+	select_start(&ctx1, bus, many, count);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, many[count - 1], 60) == 0);
+	unit_assert(select_join(&ctx1) == 0);
+	unit_assert(ctx1.data == 60 && ctx1.which == count - 1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void *
+send_expedited_f(void *arg)
+{
+	struct ctx_send *ctx = (decltype(ctx))arg;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_send_expedited(ctx->bus, ctx->channel, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_expedited(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unsigned data = 0;
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_try_send_expedited(bus, c1 + 1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a full channel still takes the expedited ones");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_expedited(bus, c1, 10) == 0);
+	unit_assert(coro_bus_send_expedited(bus, c1, 11) == 0);
+
+	unit_msg("and they are received first, in their order");
+	unsigned expected[] = {10, 11, 1, 2};
+	for (unsigned value : expected) {
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+		unit_assert(data == value);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	unit_msg("a waiting receiver gets one right away");
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_try_send_expedited(bus, c1, 20) == 0);
+	unit_assert(data == 20);
+	unit_assert(recv_join(&recv_ctx) == 0);
+
+	unit_msg("the lane has its own limit");
+	for (unsigned i = 0; i < CORO_BUS_EXPEDITED_SIZE; ++i)
+		unit_assert(coro_bus_try_send_expedited(bus, c1, 100 + i) == 0);
+	unit_assert(coro_bus_try_send_expedited(bus, c1, 200) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_send send_ctx;
+	send_ctx.bus = bus;
+	send_ctx.channel = c1;
+	send_ctx.data = 200;
+	send_ctx.rc = -1;
+	send_ctx.is_started = false;
+	send_ctx.is_done = false;
+	send_ctx.worker = coro_new(send_expedited_f, &send_ctx);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_msg("the usual messages still fit");
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+
+#if NEED_BATCH
+	unit_msg("a batch takes the lane first");
+	unsigned batch[CORO_BUS_EXPEDITED_SIZE + 2];
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 4) == 4);
+	unit_assert(batch[0] == 100 && batch[3] == 103);
+	unit_assert(send_join(&send_ctx) == 0);
+	int count = coro_bus_try_recv_v(bus, c1, batch,
+		CORO_BUS_EXPEDITED_SIZE + 2);
+	unit_assert(count == CORO_BUS_EXPEDITED_SIZE - 4 + 1 + 1);
+	unit_assert(batch[count - 3] == 100 + CORO_BUS_EXPEDITED_SIZE - 1);
+	unit_assert(batch[count - 2] == 200);
+	unit_assert(batch[count - 1] == 3);
+#else
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+	while (coro_bus_try_recv(bus, c1, &data) == 0);
+#endif
+
+	unit_msg("counted in the stats");
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == stats.recv_count);
+	unit_assert(stats.send_count == 2 + 2 + 1 + CORO_BUS_EXPEDITED_SIZE +
+		1 + 1);
+
+	unit_msg("a closed channel wakes up the expedited senders");
+	for (unsigned i = 0; i < CORO_BUS_EXPEDITED_SIZE; ++i)
+		unit_assert(coro_bus_try_send_expedited(bus, c1, i) == 0);
+	send_ctx.is_done = false;
+	send_ctx.worker = coro_new(send_expedited_f, &send_ctx);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	unit_assert(send_join(&send_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_overflow(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unsigned data = 0;
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_channel_set_overflow(bus, c1 + 1, ".", 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_msg("no directory");
+	unit_assert(coro_bus_channel_set_overflow(bus, c1, "./no_such_dir",
+		1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_MEMORY_ERR);
+
+	unit_msg("the senders don't block over the limit");
+	/* The least file is a page. */
+	unsigned file_size = sysconf(_SC_PAGESIZE) / sizeof(unsigned);
+	unit_assert(coro_bus_channel_set_overflow(bus, c1, ".", 1) == 0);
+	for (unsigned i = 0; i < 2 + file_size; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_msg("the file can't be replaced while it has messages");
+	unit_assert(coro_bus_channel_set_overflow(bus, c1, ".", 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a blocked sender is woken up by a receiver");
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 2 + file_size);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+
+	unit_msg("everything comes in the order of sending");
+	for (unsigned i = 1; i < 3 + file_size; ++i) {
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+		unit_assert(data == i);
+		/* A new message goes after the older ones in the file. */
+		if (i == 10)
+			unit_assert(coro_bus_try_send(bus, c1, 3 + file_size) == 0);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+	unit_assert(data == 3 + file_size);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+#if NEED_BATCH
+	unit_msg("a batch goes through the file too");
+	unsigned batch[16];
+	for (unsigned i = 0; i < 16; ++i)
+		batch[i] = i;
+	unit_assert(coro_bus_try_send_v(bus, c1, batch, 16) == 16);
+	unsigned got[16];
+	int count = 0;
+	while (count < 16) {
+		int rc = coro_bus_try_recv_v(bus, c1, got + count, 16 - count);
+		unit_assert(rc > 0);
+		count += rc;
+	}
+	for (unsigned i = 0; i < 16; ++i)
+		unit_assert(got[i] == i);
+#endif
+
+	unit_msg("counted in the stats");
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == stats.recv_count);
+	unit_assert(stats.overflow_count > file_size);
+	unit_assert(stats.max_size == 2);
+
+	unit_msg("the file can be removed when empty");
+	unit_assert(coro_bus_channel_set_overflow(bus, c1, ".", 0) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+
+	unit_msg("a channel is closed with the messages in the file");
+	unit_assert(coro_bus_channel_set_overflow(bus, c1, ".", 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+	coro_bus_channel_close(bus, c1);
+	int c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_try_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 3) != 0);
+	unit_msg("and one is deleted with them");
+	unit_assert(coro_bus_channel_set_overflow(bus, c2, ".", 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 3) == 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+typedef coro_channel<std::unique_ptr<int>, 2> test_channel;
+
+struct ctx_channel {
+	test_channel *channel;
+	std::unique_ptr<int> value;
+	enum coro_channel_status status;
+	bool is_done;
+};
+
+static void *
+channel_send_f(void *arg)
+{
+	struct ctx_channel *ctx = (decltype(ctx))arg;
+	ctx->status = ctx->channel->send(ctx->value);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+channel_recv_f(void *arg)
+{
+	struct ctx_channel *ctx = (decltype(ctx))arg;
+	ctx->status = ctx->channel->recv(ctx->value);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_channel_template(void)
+{
+	unit_test_start();
+	std::unique_ptr<test_channel> channel(new test_channel());
+	std::unique_ptr<int> value;
+	unit_assert(test_channel::capacity() == 2);
+
+	unit_msg("the messages are moved in and out in order");
+	unit_assert(channel->try_recv(value) == CORO_CHANNEL_WOULD_BLOCK);
+	unit_assert(channel->try_send(std::unique_ptr<int>(new int(1))) ==
+		CORO_CHANNEL_OK);
+	unit_assert(channel->send(std::unique_ptr<int>(new int(2))) ==
+		CORO_CHANNEL_OK);
+	unit_assert(channel->size() == 2);
+	value.reset(new int(3));
+	unit_assert(channel->try_send(value) == CORO_CHANNEL_WOULD_BLOCK);
+	unit_assert(value != nullptr && *value == 3);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_OK);
+	unit_assert(*value == 1);
+	unit_assert(channel->try_recv(value) == CORO_CHANNEL_OK);
+	unit_assert(*value == 2);
+
+	unit_msg("a sender waits for space");
+	struct ctx_channel send_ctx;
+	send_ctx.channel = channel.get();
+	send_ctx.is_done = false;
+	channel->try_send(std::unique_ptr<int>(new int(10)));
+	channel->try_send(std::unique_ptr<int>(new int(11)));
+	send_ctx.value.reset(new int(12));
+	struct coro *worker = coro_new(channel_send_f, &send_ctx);
+	coro_yield();
+	unit_assert(!send_ctx.is_done);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_OK && *value == 10);
+	coro_join(worker);
+	unit_assert(send_ctx.status == CORO_CHANNEL_OK);
+	unit_assert(send_ctx.value == nullptr);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_OK && *value == 11);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_OK && *value == 12);
+
+	unit_msg("a waiting receiver gets a message right away");
+	struct ctx_channel recv_ctx;
+	recv_ctx.channel = channel.get();
+	recv_ctx.is_done = false;
+	worker = coro_new(channel_recv_f, &recv_ctx);
+	coro_yield();
+	unit_assert(!recv_ctx.is_done);
+	unit_assert(channel->try_send(std::unique_ptr<int>(new int(20))) ==
+		CORO_CHANNEL_OK);
+	unit_assert(channel->size() == 0);
+	coro_join(worker);
+	unit_assert(recv_ctx.status == CORO_CHANNEL_OK && *recv_ctx.value == 20);
+
+	unit_msg("cancel a waiting receiver");
+	recv_ctx.is_done = false;
+	worker = coro_new(channel_recv_f, &recv_ctx);
+	coro_yield();
+	coro_cancel(worker);
+	coro_join(worker);
+	unit_assert(recv_ctx.status == CORO_CHANNEL_CANCELLED);
+	unit_assert(channel->try_send(std::unique_ptr<int>(new int(21))) ==
+		CORO_CHANNEL_OK);
+	unit_assert(channel->size() == 1);
+
+	unit_msg("close wakes up the waiters and keeps the messages");
+	channel->try_send(std::unique_ptr<int>(new int(22)));
+	send_ctx.is_done = false;
+	send_ctx.value.reset(new int(23));
+	worker = coro_new(channel_send_f, &send_ctx);
+	coro_yield();
+	channel->close();
+	coro_join(worker);
+	unit_assert(send_ctx.status == CORO_CHANNEL_CLOSED);
+	unit_assert(*send_ctx.value == 23);
+	unit_assert(channel->try_send(std::unique_ptr<int>(new int(24))) ==
+		CORO_CHANNEL_CLOSED);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_OK && *value == 21);
+	unit_msg("the rest is destroyed with the channel");
+	channel.reset();
+
+	unit_msg("a receiver of an empty closed channel fails");
+	channel.reset(new test_channel());
+	recv_ctx.channel = channel.get();
+	worker = coro_new(channel_recv_f, &recv_ctx);
+	coro_yield();
+	channel->close();
+	coro_join(worker);
+	unit_assert(recv_ctx.status == CORO_CHANNEL_CLOSED);
+	unit_assert(channel->recv(value) == CORO_CHANNEL_CLOSED);
+
+	unit_test_finish();
+}
+
+static void
+test_select_weighted(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int channels[3];
+	for (int i = 0; i < 3; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 16);
+		unit_assert(channels[i] >= 0);
+	}
+	unsigned data = 0;
+	int which = -1;
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_channel_set_priority(bus, 100, 0, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_select_weighted(bus, channels, 0, &data,
+		&which) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the weights share the receives, interleaved");
+	unit_assert(coro_bus_channel_set_priority(bus, channels[0], 0, 3) == 0);
+	for (unsigned i = 0; i < 8; ++i) {
+		unit_assert(coro_bus_send(bus, channels[0], i) == 0);
+		unit_assert(coro_bus_send(bus, channels[1], 100 + i) == 0);
+	}
+	int counts[2] = {0, 0};
+	int run = 0;
+	int max_run = 0;
+	for (int i = 0; i < 8; ++i) {
+		unit_assert(coro_bus_select_weighted(bus, channels, 2, &data,
+			&which) == 0);
+		unit_assert(data == (unsigned)(which * 100 + counts[which]));
+		++counts[which];
+		run = which == 0 ? run + 1 : 0;
+		if (run > max_run)
+			max_run = run;
+	}
+	unit_assert(counts[0] == 6 && counts[1] == 2);
+	unit_assert(max_run <= 3);
+
+	unit_msg("the empty ones are skipped");
+	while (coro_bus_try_recv(bus, channels[1], &data) == 0);
+	for (int i = 0; i < 2; ++i) {
+		unit_assert(coro_bus_select_weighted(bus, channels, 2, &data,
+			&which) == 0);
+		unit_assert(which == 0);
+	}
+
+	unit_msg("a higher priority goes first");
+	unit_assert(coro_bus_channel_set_priority(bus, channels[2], 1, 1) == 0);
+	unit_assert(coro_bus_send(bus, channels[2], 300) == 0);
+	unit_assert(coro_bus_select_weighted(bus, channels, 3, &data,
+		&which) == 0);
+	unit_assert(which == 2 && data == 300);
+
+	unit_msg("an expedited message goes before any priority");
+	unit_assert(coro_bus_send(bus, channels[2], 301) == 0);
+	unit_assert(coro_bus_try_send_expedited(bus, channels[1], 400) == 0);
+	unit_assert(coro_bus_select_weighted(bus, channels, 3, &data,
+		&which) == 0);
+	unit_assert(which == 1 && data == 400);
+	unit_assert(coro_bus_select_weighted(bus, channels, 3, &data,
+		&which) == 0);
+	unit_assert(which == 2 && data == 301);
+
+	unit_msg("wait on all the channels");
+	while (coro_bus_try_recv(bus, channels[0], &data) == 0);
+	struct ctx_select ctx;
+	select_start_ex(&ctx, bus, channels, 3, true);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, channels[1], 500) == 0);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(ctx.data == 500 && ctx.which == 1);
+
+	unit_msg("a closed channel interrupts the wait");
+	select_start_ex(&ctx, bus, channels, 3, true);
+	coro_yield();
+	coro_bus_channel_close(bus, channels[2]);
+	unit_assert(select_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(ctx.which == 2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_delayed_send {
+	struct coro_bus *bus;
+	int channel;
+	unsigned data;
+	double delay;
+};
+
+static void *
+delayed_send_f(void *arg)
+{
+	struct ctx_delayed_send *ctx = (decltype(ctx))arg;
+	coro_sleep(ctx->delay);
+	unit_assert(coro_bus_send(ctx->bus, ctx->channel, ctx->data) == 0);
+	return NULL;
+}
+
+static void
+test_timeouts(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unsigned data = 0;
+
+	unit_msg("recv from an empty channel");
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+
+	unit_msg("send to a full channel");
+	unit_assert(coro_bus_send_timed(bus, c1, 1, 0) == 0);
+	unit_assert(coro_bus_send_timed(bus, c1, 2, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 0) == 0);
+	unit_assert(data == 1);
+
+	unit_msg("the channel has no waiters after a timeout");
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_wait_count == 1);
+	unit_assert(stats.recv_wait_count == 1);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 3);
+
+	unit_msg("a message comes in time");
+	struct ctx_delayed_send ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.data = 4;
+	ctx.delay = 0.01;
+	struct coro *worker = coro_new(delayed_send_f, &ctx);
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 10) == 0);
+	unit_assert(data == 4);
+	unit_assert(coro_join(worker) == NULL);
+
+	unit_msg("negative timeout is infinity");
+	ctx.data = 5;
+	worker = coro_new(delayed_send_f, &ctx);
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, -1) == 0);
+	unit_assert(data == 5);
+	unit_assert(coro_join(worker) == NULL);
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_recv_timed(bus, c1 + 1, &data, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast");
+	unit_assert(coro_bus_broadcast_timed(bus, 6, 0) == 0);
+	unit_assert(coro_bus_broadcast_timed(bus, 7, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 6);
+#endif
+
+#if NEED_BATCH
+	unit_msg("vector");
+	unsigned buf[2] = {8, 9};
+	unit_assert(coro_bus_recv_v_timed(bus, c1, buf, 2, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_send_v_timed(bus, c1, buf, 2, 0.01) == 1);
+	unit_assert(coro_bus_send_v_timed(bus, c1, buf, 2, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_v_timed(bus, c1, buf, 2, 0) == 1);
+	unit_assert(buf[0] == 8);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, 0, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 0 && stats.recv_count == 0);
+	unit_assert(stats.max_size == 0);
+
+	unit_msg("a full channel suspends the sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 3);
+	coro_yield();
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 3 && stats.recv_count == 1);
+	unit_assert(stats.max_size == 2);
+	unit_assert(stats.send_wait_count == 1 && stats.send_wait_ns > 0);
+	unit_assert(stats.recv_wait_count == 0 && stats.recv_wait_ns == 0);
+
+	unit_msg("an empty channel suspends the receiver");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 4 && stats.recv_count == 4);
+	unit_assert(stats.recv_wait_count == 1 && stats.recv_wait_ns > 0);
+
+	unit_msg("the bus totals include the closed channels");
+	int c2 = coro_bus_channel_open(bus, 5);
+	unit_assert(c2 >= 0);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_send(bus, c2, i) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_stats(bus, -1, &stats) == 0);
+	unit_assert(stats.send_count == 9 && stats.recv_count == 4);
+	unit_assert(stats.max_size == 5);
+	unit_assert(stats.send_wait_count == 1 && stats.recv_wait_count == 1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_close_non_empty_bus(void)
 {
@@ -1016,6 +1875,80 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_broadcast_mixed(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("broadcasts and sends keep the order");
+	int c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_broadcast(bus, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_broadcast(bus, 4) == 0);
+	unit_assert(coro_bus_send(bus, c2, 5) == 0);
+	unsigned data = 0;
+	for (unsigned expected = 1; expected <= 4; ++expected)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == expected);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 4);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 5);
+
+	unit_msg("broadcasts count in the channel size");
+	unit_assert(coro_bus_broadcast(bus, 6) == 0);
+	unit_assert(coro_bus_broadcast(bus, 7) == 0);
+	unit_assert(coro_bus_send(bus, c1, 8) == 0);
+	unit_assert(coro_bus_send(bus, c1, 9) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 10) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_broadcast(bus, 10) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_msg("space freed in the full channel is noticed");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 6);
+	unit_assert(coro_bus_try_broadcast(bus, 10) == 0);
+
+	unit_msg("a new channel doesn't get the old broadcasts");
+	int c3 = coro_bus_channel_open(bus, 4);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_try_recv(bus, c3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("closing a channel with unread broadcasts");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_broadcast(bus, 11) == 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 6);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 7);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 10);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 11);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 11);
+
+	unit_msg("many broadcasts with a batch receiver");
+	unsigned batch[4];
+	for (unsigned round = 0; round < 100; ++round) {
+		for (unsigned i = 0; i < 4; ++i)
+			unit_assert(coro_bus_broadcast(bus, round * 4 + i) == 0);
+		unit_assert(coro_bus_recv_v(bus, c2, batch, 4) == 4);
+		for (unsigned i = 0; i < 4; ++i) {
+			unit_assert(batch[i] == round * 4 + i);
+			unit_assert(coro_bus_recv(bus, c3, &data) == 0);
+			unit_assert(data == round * 4 + i);
+		}
+	}
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c3);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_vector_basic(void)
 {
@@ -1208,6 +2141,28 @@ test_send_vector_blocking(void)
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
 
+	unit_msg("a batch sender is woken once for the whole range");
+	unit_assert(coro_bus_send_v(bus, c1, data3, 3) == 3);
+	struct coro_bus_stats stats;
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	uint64_t wait_count = stats.send_wait_count;
+	send_v_start(&ctx, bus, c1, data4, 3);
+	struct ctx_send send_ctx1, send_ctx2;
+	send_start(&send_ctx1, bus, c1, 8);
+	send_start(&send_ctx2, bus, c1, 9);
+	coro_yield();
+	unit_assert(coro_bus_recv_v(bus, c1, data3, 3) == 3);
+	unit_assert(send_v_join(&ctx) == 3);
+	unit_assert(coro_bus_stats(bus, c1, &stats) == 0);
+	unit_msg("the single senders weren't woken in vain");
+	unit_assert(stats.send_wait_count == wait_count + 3);
+	unit_assert(!send_ctx1.is_done && !send_ctx2.is_done);
+	unit_assert(coro_bus_recv_v(bus, c1, data3, 3) == 3);
+	unit_assert(send_join(&send_ctx1) == 0);
+	unit_assert(send_join(&send_ctx2) == 0);
+	unit_assert(coro_bus_recv_v(bus, c1, data3, 3) == 2);
+	unit_assert(data3[0] == 8 && data3[1] == 9);
+
 	coro_bus_channel_close(bus, c1);
 	coro_bus_delete(bus);
 	unit_test_finish();
@@ -1606,6 +2561,300 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_msg_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unit_msg("small message is copied");
+	char small[] = "hello";
+	unit_assert(coro_bus_send_msg(bus, c1, small, sizeof(small)) == 0);
+	small[0] = 'j';
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.size == sizeof(small) && msg.heap == NULL);
+	unit_assert(strcmp((const char *)coro_bus_msg_data(&msg), "hello") == 0);
+	coro_bus_msg_destroy(&msg);
+
+	unit_msg("big message is handed over");
+	size_t big_size = CORO_BUS_MSG_INLINE_SIZE * 10;
+	char *big = (char *)malloc(big_size);
+	memset(big, 'x', big_size);
+	unit_assert(coro_bus_send_msg(bus, c1, big, big_size) == 0);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.size == big_size && msg.heap == big);
+	unit_assert(coro_bus_msg_data(&msg) == big);
+	coro_bus_msg_destroy(&msg);
+
+	unit_msg("kinds share the count limit");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, small, 2) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, small, 3) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_msg(bus, c1, small, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.size == 2);
+
+	unit_msg("pending big messages are freed on close");
+	big = (char *)malloc(big_size);
+	unit_assert(coro_bus_send_msg(bus, c1, big, big_size) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_send_msg {
+	struct coro_bus *bus;
+	int channel;
+	size_t size;
+	int rc;
+};
+
+static void *
+send_msg_f(void *arg)
+{
+	struct ctx_send_msg *ctx = (decltype(ctx))arg;
+	char buf[CORO_BUS_MSG_INLINE_SIZE];
+	memset(buf, 0, sizeof(buf));
+	ctx->rc = coro_bus_send_msg(ctx->bus, ctx->channel, buf, ctx->size);
+	return NULL;
+}
+
+static void
+test_msg_byte_limit(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_ex(bus, 10, 40);
+	unit_assert(c1 >= 0);
+
+	char buf[CORO_BUS_MSG_INLINE_SIZE];
+	memset(buf, 0, sizeof(buf));
+	unit_assert(coro_bus_send_msg(bus, c1, buf, 30) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, buf, 20) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_msg(bus, c1, buf, 10) == 0);
+
+	unit_msg("sender waits for bytes");
+	struct ctx_send_msg ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.size = 20;
+	ctx.rc = 1;
+	struct coro *sender = coro_new(send_msg_f, &ctx);
+	coro_yield();
+	unit_assert(ctx.rc == 1);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.size == 30);
+	coro_join(sender);
+	unit_assert(ctx.rc == 0);
+
+	unit_msg("too big message goes through an empty channel");
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.size == 10);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.size == 20);
+	size_t big_size = 100;
+	char *big = (char *)malloc(big_size);
+	unit_assert(coro_bus_try_send_msg(bus, c1, big, big_size) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, buf, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0 && msg.heap == big);
+	coro_bus_msg_destroy(&msg);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+#if NEED_BATCH
+
+static void
+test_msg_vector(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unsigned values[4] = {1, 2, 3, 4};
+	struct coro_bus_iov iov[4];
+	for (int i = 0; i < 4; ++i) {
+		iov[i].ptr = &values[i];
+		iov[i].size = sizeof(values[i]);
+	}
+	unit_assert(coro_bus_send_msg_v(bus, c1, iov, 4) == 3);
+	struct coro_bus_msg msgs[4];
+	unit_assert(coro_bus_recv_msg_v(bus, c1, msgs, 2) == 2);
+	unit_assert(coro_bus_send_msg_v(bus, c1, iov + 3, 1) == 1);
+	unit_assert(coro_bus_recv_msg_v(bus, c1, msgs + 2, 2) == 2);
+	for (int i = 0; i < 4; ++i) {
+		unsigned value;
+		memcpy(&value, coro_bus_msg_data(&msgs[i]), sizeof(value));
+		unit_assert(value == values[i]);
+		coro_bus_msg_destroy(&msgs[i]);
+	}
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	MT_THREAD_COUNT = 3,
+	MT_MSG_COUNT = 5000,
+};
+
+struct ctx_mt {
+	struct coro_bus_mt_channel *channel;
+	unsigned first;
+	unsigned long long sum;
+};
+
+static void *
+mt_send_thread_f(void *arg)
+{
+	struct ctx_mt *ctx = (decltype(ctx))arg;
+	for (unsigned i = 0; i < MT_MSG_COUNT; ++i)
+		unit_fail_if(coro_bus_mt_send(ctx->channel, ctx->first + i) != 0);
+	return NULL;
+}
+
+static void *
+mt_recv_thread_f(void *arg)
+{
+	struct ctx_mt *ctx = (decltype(ctx))arg;
+	ctx->sum = 0;
+	for (unsigned i = 0; i < MT_MSG_COUNT; ++i) {
+		unsigned data;
+		unit_fail_if(coro_bus_mt_recv(ctx->channel, &data) != 0);
+		ctx->sum += data;
+	}
+	return NULL;
+}
+
+static void *
+mt_recv_coro_f(void *arg)
+{
+	struct ctx_mt *ctx = (decltype(ctx))arg;
+	unsigned data;
+	unit_fail_if(coro_bus_mt_recv(ctx->channel, &data) != 0);
+	ctx->sum += data;
+	return NULL;
+}
+
+static void *
+mt_recv_cancelled_f(void *arg)
+{
+	struct coro_bus_mt_channel *channel = (decltype(channel))arg;
+	unsigned data;
+	unit_fail_if(coro_bus_mt_recv(channel, &data) == 0);
+	unit_fail_if(coro_bus_errno() != CORO_BUS_ERR_CANCELLED);
+	return NULL;
+}
+
+static void
+test_mt_channel(void)
+{
+	unit_test_start();
+	struct coro_bus_mt_channel *channel = coro_bus_mt_channel_new(4);
+	unit_assert(channel != NULL);
+
+	unit_msg("try-functions");
+	unsigned data = 0;
+	unit_assert(coro_bus_mt_try_recv(channel, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_mt_try_send(channel, i) == 0);
+	unit_assert(coro_bus_mt_try_send(channel, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 4; ++i) {
+		unit_assert(coro_bus_mt_try_recv(channel, &data) == 0);
+		unit_assert(data == i);
+	}
+
+	unit_msg("threads send to a coroutine");
+	pthread_t threads[MT_THREAD_COUNT];
+	struct ctx_mt ctx[MT_THREAD_COUNT];
+	unsigned long long expected = 0;
+	for (int i = 0; i < MT_THREAD_COUNT; ++i) {
+		ctx[i].channel = channel;
+		ctx[i].first = i * MT_MSG_COUNT;
+		for (unsigned j = 0; j < MT_MSG_COUNT; ++j)
+			expected += ctx[i].first + j;
+		unit_assert(pthread_create(&threads[i], NULL, mt_send_thread_f,
+			&ctx[i]) == 0);
+	}
+	unsigned long long sum = 0;
+	for (int i = 0; i < MT_THREAD_COUNT * MT_MSG_COUNT; ++i) {
+		unit_assert(coro_bus_mt_recv(channel, &data) == 0);
+		sum += data;
+	}
+	for (int i = 0; i < MT_THREAD_COUNT; ++i)
+		unit_assert(pthread_join(threads[i], NULL) == 0);
+	unit_assert(sum == expected);
+
+	unit_msg("a coroutine sends to the threads");
+	for (int i = 0; i < MT_THREAD_COUNT; ++i) {
+		unit_assert(pthread_create(&threads[i], NULL, mt_recv_thread_f,
+			&ctx[i]) == 0);
+	}
+	for (int i = 0; i < MT_THREAD_COUNT * MT_MSG_COUNT; ++i)
+		unit_assert(coro_bus_mt_send(channel, i) == 0);
+	sum = 0;
+	for (int i = 0; i < MT_THREAD_COUNT; ++i) {
+		unit_assert(pthread_join(threads[i], NULL) == 0);
+		sum += ctx[i].sum;
+	}
+	unit_assert(sum == expected);
+
+	unit_msg("many coroutines wait for the threads");
+	const int coro_count = 5;
+	struct coro *coros[coro_count];
+	struct ctx_mt coro_ctx;
+	coro_ctx.channel = channel;
+	coro_ctx.sum = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(mt_recv_coro_f, &coro_ctx);
+	coro_yield();
+	ctx[0].first = 1;
+	unit_assert(pthread_create(&threads[0], NULL, mt_send_thread_f,
+		&ctx[0]) == 0);
+	for (int i = coro_count; i < MT_MSG_COUNT; ++i) {
+		unit_assert(coro_bus_mt_recv(channel, &data) == 0);
+		coro_ctx.sum += data;
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_assert(pthread_join(threads[0], NULL) == 0);
+	unit_assert(coro_ctx.sum ==
+		(unsigned long long)MT_MSG_COUNT * (MT_MSG_COUNT + 1) / 2);
+
+	unit_msg("cancel a waiting coroutine");
+	struct coro *worker = coro_new(mt_recv_cancelled_f, channel);
+	coro_yield();
+	coro_cancel(worker);
+	unit_assert(coro_join(worker) == NULL);
+
+	coro_bus_mt_channel_delete(channel);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1625,11 +2874,21 @@ coro_main_f(void *arg)
 	test_stress_send_recv_concurrent();
 	test_send_recv_very_many();
 	test_wakeup_on_close();
+	test_cancel_waiters();
+	test_recv_handoff();
+	test_select();
+	test_expedited();
+	test_select_weighted();
+	test_overflow();
+	test_channel_template();
+	test_timeouts();
+	test_stats();
 	test_close_non_empty_bus();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_mixed();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1638,6 +2897,13 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+
+	test_msg_basic();
+	test_msg_byte_limit();
+#if NEED_BATCH
+	test_msg_vector();
+	test_mt_channel();
+#endif
 	return NULL;
 }
 
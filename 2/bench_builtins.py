@@ -0,0 +1,75 @@
+import argparse
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+parser = argparse.ArgumentParser(description='Benchmark of the shell builtins')
+parser.add_argument('-e', type=str, default='./build/mybash',
+                    help='executable shell file')
+parser.add_argument('--count', type=int, default=20 * 1000,
+                    help='Number of the commands in each script')
+parser.add_argument('--runs', type=int, default=3,
+                    help='Number of runs of each script, the best is taken')
+args = parser.parse_args()
+
+shell = os.path.abspath(args.e)
+
+# Each case is run as is, when the commands are done by the shell itself, and
+# with the programs by the full path, when each of them is a fork + exec.
+# The commands are like in tests.txt: one per line, some in pipelines. The
+# last field is how many processes the builtins save per line. In a pipeline
+# too, a builtin stage runs in the shell and passes its output in a memfd.
+cases = [
+    ('echo', 'echo "line number {i}" with args\n',
+     '{echo} "line number {i}" with args\n', 'forks', 1),
+    ('true && false ||', 'true && false || echo {i}\n',
+     '{true} && {false} || {echo} {i}\n', 'forks', 3),
+    ('test', 'test {i} -ge 0 && [ -d . ]\n',
+     '{test} {i} -ge 0 && {test} -d .\n', 'forks', 2),
+    ('pwd', 'pwd\n', '{pwd}\n', 'forks', 1),
+    ('echo | wc', 'echo {i} | wc -c\n', '{echo} {i} | wc -c\n', 'forks', 1),
+    ('echo | echo | wc', 'echo {i} | echo {i} | wc -c\n',
+     '{echo} {i} | {echo} {i} | wc -c\n', 'forks', 2),
+]
+
+programs = {}
+for name in ['echo', 'true', 'false', 'test', 'pwd']:
+    path = shutil.which(name, path='/bin:/usr/bin')
+    if path is None:
+        print('Can\'t find the program {}'.format(name))
+        exit(-1)
+    programs[name] = path
+
+
+def run_script(script):
+    best = None
+    with tempfile.TemporaryDirectory() as work_dir:
+        for _ in range(args.runs):
+            start = time.monotonic()
+            p = subprocess.run([shell], input=script.encode(), cwd=work_dir,
+                               stdout=subprocess.DEVNULL,
+                               stderr=subprocess.DEVNULL)
+            duration = time.monotonic() - start
+            if p.returncode != 0:
+                print('The shell failed with {}'.format(p.returncode))
+                exit(-1)
+            if best is None or duration < best:
+                best = duration
+    return best
+
+
+for name, builtin_line, program_line, saved_name, saved_count in cases:
+    builtin_script = ''.join([builtin_line.format(i=i)
+                              for i in range(args.count)])
+    program_script = ''.join([program_line.format(i=i, **programs)
+                              for i in range(args.count)])
+    builtin_time = run_script(builtin_script)
+    program_time = run_script(program_script)
+    print(name)
+    print('    builtin: {:.0f} lines/s'.format(args.count / builtin_time))
+    print('    program: {:.0f} lines/s'.format(args.count / program_time))
+    print('    speedup: {:.1f}x'.format(program_time / builtin_time))
+    print('    {} avoided: {:.0f}/s'.format(
+        saved_name, args.count * saved_count / builtin_time))
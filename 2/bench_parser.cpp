@@ -0,0 +1,193 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#if BENCH_ALLOC_COUNT
+#include "heap_help.h"
+#endif
+
+enum {
+#if BENCH_ALLOC_COUNT
+	/* Heap help makes each allocation slow, the input is smaller. */
+	BENCH_RUN_COUNT = 1,
+	BENCH_INPUT_SIZE = 1024 * 1024,
+#else
+	BENCH_RUN_COUNT = 5,
+	BENCH_INPUT_SIZE = 32 * 1024 * 1024,
+#endif
+	BENCH_CHUNK_SIZE = 16 * 1024,
+	/* Lines are split between the feeds all the time. */
+	BENCH_SMALL_CHUNK_SIZE = 100,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Total allocations so far. Only counted with heap help. */
+static uint64_t
+bench_alloc_count(void)
+{
+#if BENCH_ALLOC_COUNT
+	return heaph_get_total_alloc_count();
+#else
+	return 0;
+#endif
+}
+
+/** Repeat the line until the input is big enough. */
+static std::string
+bench_make_input(const std::string &line)
+{
+	std::string res;
+	res.reserve(BENCH_INPUT_SIZE + line.size());
+	while (res.size() < BENCH_INPUT_SIZE)
+		res += line;
+	return res;
+}
+
+struct bench_result {
+	double mb_per_sec;
+	double lines_per_sec;
+	double allocs_per_line;
+};
+
+/**
+ * Feed the input in chunks like the shell reads the stdin, and pop
+ * the lines as they get complete. The lines with errors are counted
+ * too.
+ */
+static struct bench_result
+bench_parse(const std::string &input, size_t chunk_size)
+{
+	struct parser *p = parser_new();
+	uint64_t line_count = 0;
+	uint64_t start_allocs = bench_alloc_count();
+	uint64_t start = bench_now_ns();
+	for (size_t pos = 0; pos < input.size(); pos += chunk_size) {
+		size_t size = std::min(chunk_size, input.size() - pos);
+		parser_feed(p, input.data() + pos, size);
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			++line_count;
+			delete line;
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	uint64_t allocs = bench_alloc_count() - start_allocs;
+	parser_delete(p);
+	struct bench_result res;
+	res.mb_per_sec = input.size() * 1000.0 / duration;
+	res.lines_per_sec = line_count * 1000000000.0 / duration;
+	res.allocs_per_line = line_count == 0 ? 0 :
+		(double)allocs / line_count;
+	return res;
+}
+
+static void
+bench_run_chunked(const char *name, const std::string &input,
+	size_t chunk_size)
+{
+	std::vector<struct bench_result> results;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		results.push_back(bench_parse(input, chunk_size));
+	std::sort(results.begin(), results.end(),
+		[](const struct bench_result &a, const struct bench_result &b) {
+			return a.mb_per_sec < b.mb_per_sec;
+		});
+	const struct bench_result &med = results[results.size() / 2];
+	printf("%s\n", name);
+	printf("    min: %.2lf MB/s\n", results.front().mb_per_sec);
+	printf("    med: %.2lf MB/s\n", med.mb_per_sec);
+	printf("    max: %.2lf MB/s\n", results.back().mb_per_sec);
+	printf("    med: %.0lf lines/s\n", med.lines_per_sec);
+#if BENCH_ALLOC_COUNT
+	printf("    allocations: %.2lf per line\n", med.allocs_per_line);
+#endif
+}
+
+static void
+bench_run(const char *name, const std::string &line)
+{
+	bench_run_chunked(name, bench_make_input(line), BENCH_CHUNK_SIZE);
+}
+
+/**
+ * A random mix of all the token kinds, lines with syntax errors
+ * included. The seed is fixed so the runs are comparable.
+ */
+static std::string
+bench_make_random_input(void)
+{
+	static const char *tokens[] = {
+		"echo", "ls", "-la", "some_file.txt", "/usr/bin/path",
+		"\"quoted string\"", "'single quoted'", "\"with \\\" escape\"",
+		"es\\ caped", "\\\\", "|", "&&", "||", ">", ">>", "&",
+		"# comment", "\"multi\nline\"", "\n", "\n",
+	};
+	const int token_count = sizeof(tokens) / sizeof(tokens[0]);
+	uint64_t state = 42;
+	std::string res;
+	res.reserve(BENCH_INPUT_SIZE + 64);
+	while (res.size() < BENCH_INPUT_SIZE) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		res += tokens[(state >> 33) % token_count];
+		res += ' ';
+	}
+	res += '\n';
+	return res;
+}
+
+int
+main(void)
+{
+	bench_run("Short commands", "ls -la\necho 123 | grep 1\n");
+	bench_run_chunked("Short commands, 100 byte feeds",
+		bench_make_input("ls -la\necho 123 | grep 1\n"),
+		BENCH_SMALL_CHUNK_SIZE);
+
+	std::string line = "cmd";
+	for (int i = 0; i < 20; ++i)
+		line += " argument_number_" + std::to_string(i) + "_long_path/to/file";
+	line += "\n";
+	bench_run("Long plain arguments", line);
+
+	line = "echo \"";
+	for (int i = 0; i < 20; ++i)
+		line += "some pasted data line " + std::to_string(i) + " ";
+	line += "\" >> out.txt\n";
+	bench_run("Long quoted string", line);
+
+	line = "true";
+	for (int i = 0; i < 25; ++i)
+		line += " && echo " + std::to_string(i) + " || false";
+	line += "\n";
+	bench_run("Deep && || chain", line);
+
+	line = "echo";
+	for (int i = 0; i < 10; ++i) {
+		line += " a\\ b\\\"c 'it''s' \"x \\\" y \\\\ z\" \\# \\' ";
+		line += std::to_string(i);
+	}
+	line += "\n";
+	bench_run("Heavy quoting and escaping", line);
+
+	bench_run("Pipes, redirects, background",
+		"cat file.txt | grep -v pattern | sort | uniq -c > out.txt &\n");
+
+	bench_run_chunked("Random mix with errors", bench_make_random_input(),
+		BENCH_CHUNK_SIZE);
+	return 0;
+}
@@ -5,9 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	std::string buffer;
-};
+#ifndef PARSER_SIMD
+#if defined(__SSE2__)
+#define PARSER_SIMD 1
+#else
+#define PARSER_SIMD 0
+#endif
+#endif
+
+#if PARSER_SIMD
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -33,164 +41,403 @@ token_reset(struct token *t)
 	t->type = TOKEN_TYPE_NONE;
 }
 
+/**
+ * A token can be split between the feeds. Its already seen part is
+ * kept here, so the parsing goes on right from where the data ended,
+ * and each byte is looked at once however the input is chunked.
+ */
+struct tokenizer {
+	/** The spaces before the token are skipped. */
+	bool is_started = false;
+	/** The open quote or 0. */
+	char quote = 0;
+	/** The last byte was a backslash escaping the next one. */
+	bool is_escape = false;
+	/** The last byte was '&', '|' or '>', it can be doubled. */
+	char op = 0;
+	bool is_comment = false;
+	/** The type is NONE until the token is complete. */
+	struct token token;
+};
+
+static void
+tokenizer_reset(struct tokenizer *t)
+{
+	t->is_started = false;
+	t->quote = 0;
+	t->is_escape = false;
+	t->op = 0;
+	t->is_comment = false;
+	token_reset(&t->token);
+}
+
+/** What is expected next in the line being parsed. */
+enum parser_stage {
+	PARSER_STAGE_BODY,
+	/** After '>' or '>>'. */
+	PARSER_STAGE_OUT_FILE,
+	/** After the output file. */
+	PARSER_STAGE_AFTER_OUT,
+	/** After '&'. */
+	PARSER_STAGE_AFTER_BACKGROUND,
+	/** The line has an error, it is skipped till its end. */
+	PARSER_STAGE_SKIP,
+};
+
+struct parser {
+	std::string buffer;
+	/**
+	 * The data given with parser_feed_external(), parsed in place.
+	 * The buffer is empty while it is set.
+	 */
+	const char *external = NULL;
+	size_t external_size = 0;
+	/** Start of the not yet consumed data. */
+	size_t offset = 0;
+	/**
+	 * The incomplete line. All the data fed for it so far is
+	 * consumed, the line and the tokenizer keep what was in it.
+	 */
+	struct command_line *line = NULL;
+	enum parser_stage stage = PARSER_STAGE_BODY;
+	/** Of the skipped line. */
+	enum parser_error error = PARSER_ERR_NONE;
+	struct tokenizer tokenizer;
+};
+
+/**
+ * The blocks grow twice, so a line with many arguments takes a few
+ * allocations, not one per argument.
+ */
+static std::string_view
+line_arena_dup(struct line_arena *a, const std::string &str)
+{
+	size_t size = str.size() + 1;
+	if (a->left < size) {
+		size_t block_size = 256;
+		if (!a->blocks.empty())
+			block_size = 2 * (a->pos + a->left - a->blocks.back().get());
+		if (block_size < size)
+			block_size = size;
+		a->blocks.emplace_back(new char[block_size]);
+		a->pos = a->blocks.back().get();
+		a->left = block_size;
+	}
+	char *res = a->pos;
+	memcpy(res, str.data(), str.size());
+	res[str.size()] = 0;
+	a->pos += size;
+	a->left -= size;
+	return std::string_view(res, str.size());
+}
+
 struct parser *
 parser_new(void)
 {
 	return new parser();
 }
 
+/** Copy the rest of the external data in, to append to it. */
+static void
+parser_own_external(struct parser *p)
+{
+	if (p->external == NULL)
+		return;
+	p->buffer.assign(p->external + p->offset, p->external_size - p->offset);
+	p->external = NULL;
+	p->external_size = 0;
+	p->offset = 0;
+}
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	parser_own_external(p);
 	p->buffer.append(str, len);
 }
 
+void
+parser_feed_external(struct parser *p, const char *str, size_t len)
+{
+	parser_own_external(p);
+	if (p->offset != p->buffer.size()) {
+		p->buffer.append(str, len);
+		return;
+	}
+	p->buffer.clear();
+	p->offset = 0;
+	if (len == 0)
+		return;
+	p->external = str;
+	p->external_size = len;
+}
+
+/**
+ * The consumed data is only skipped. It is moved out when it is not
+ * less than the rest, so each byte is moved a constant number of
+ * times on average, and the parsing stays linear.
+ */
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_consume(struct parser *p, size_t size)
 {
-	assert(p->buffer.size() >= size);
-	p->buffer.erase(0, size);
+	if (p->external != NULL) {
+		assert(p->external_size - p->offset >= size);
+		p->offset += size;
+		if (p->offset == p->external_size) {
+			p->external = NULL;
+			p->external_size = 0;
+			p->offset = 0;
+		}
+		return;
+	}
+	assert(p->buffer.size() - p->offset >= size);
+	p->offset += size;
+	if (p->offset == p->buffer.size()) {
+		p->buffer.clear();
+		p->offset = 0;
+	} else if (p->offset > 65536 &&
+		   p->offset >= p->buffer.size() - p->offset) {
+		p->buffer.erase(0, p->offset);
+		p->offset = 0;
+	}
 }
 
-static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+/**
+ * Characters which can start or end something in a token. Besides the
+ * listed ones, all the bytes up to the space are treated the same, so
+ * the vector check is a range. The parse_token() switch handles them
+ * one by one anyway, being special or not.
+ */
+static bool
+parse_is_special(unsigned char c)
 {
-	token_reset(out);
+	switch (c) {
+	case '"':
+	case '#':
+	case '&':
+	case '\'':
+	case '>':
+	case '\\':
+	case '|':
+		return true;
+	default:
+		return c <= ' ';
+	}
+}
+
+/** Find the first special character or the end. */
+static const char *
+parse_skip_plain(const char *pos, const char *end)
+{
+	/* Most often it is called right at a special one. */
+	if (pos < end && parse_is_special(*pos))
+		return pos;
+#if PARSER_SIMD
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i specials[] = {
+		_mm_set1_epi8('"'), _mm_set1_epi8('#'), _mm_set1_epi8('&'),
+		_mm_set1_epi8('\''), _mm_set1_epi8('>'), _mm_set1_epi8('\\'),
+		_mm_set1_epi8('|'),
+	};
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		/* Unsigned v <= ' '. */
+		__m128i mask = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+		for (const __m128i &c : specials)
+			mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, c));
+		int bits = _mm_movemask_epi8(mask);
+		if (bits != 0)
+			return pos + __builtin_ctz(bits);
+		pos += 16;
+	}
+#endif
+	while (pos < end && !parse_is_special(*pos))
+		++pos;
+	return pos;
+}
+
+/**
+ * Inside quotes only the quote and the backslash mean something,
+ * even the spaces and the new lines are a part of the token.
+ */
+static const char *
+parse_skip_quoted(const char *pos, const char *end, char quote)
+{
+#if PARSER_SIMD
+	const __m128i quote_v = _mm_set1_epi8(quote);
+	const __m128i backslash_v = _mm_set1_epi8('\\');
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i mask = _mm_or_si128(_mm_cmpeq_epi8(v, quote_v),
+					    _mm_cmpeq_epi8(v, backslash_v));
+		int bits = _mm_movemask_epi8(mask);
+		if (bits != 0)
+			return pos + __builtin_ctz(bits);
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != quote && *pos != '\\')
+		++pos;
+	return pos;
+}
+
+/** The byte after a backslash, outside of the quotes or in '"'. */
+static void
+parse_append_escaped(struct token *out, char quote, char c)
+{
+	/* A line continuation. */
+	if (c == '\n')
+		return;
+	/* In '"' the backslash stays unless it escapes a special one. */
+	if (quote == '"' && c != '\\' && c != '"')
+		out->data += '\\';
+	out->data += c;
+}
+
+/** The byte after '&', '|' or '>' tells if the operator is doubled. */
+static const char *
+parse_finish_operator(const char *pos, char c, struct token *out)
+{
+	bool is_double = *pos == c;
+	switch(c) {
+	case '&':
+		out->type = is_double ? TOKEN_TYPE_AND : TOKEN_TYPE_BACKGROUND;
+		break;
+	case '|':
+		out->type = is_double ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+		break;
+	case '>':
+		out->type = is_double ? TOKEN_TYPE_OUT_APPEND :
+			TOKEN_TYPE_OUT_NEW;
+		break;
+	default:
+		assert(false);
+		break;
+	}
+	return is_double ? pos + 1 : pos;
+}
+
+/** Skip till the end of the line, the new line is the token then. */
+static size_t
+parse_skip_comment(const char *pos, const char *end, const char *begin,
+		   struct token *out)
+{
+	const char *new_line = (const char *)memchr(pos, '\n', end - pos);
+	if (new_line == NULL)
+		return end - begin;
+	out->type = TOKEN_TYPE_NEW_LINE;
+	return new_line + 1 - begin;
+}
+
+/**
+ * Continue the token from where the previous call stopped. Returns
+ * the number of the used bytes. The token is complete when its type
+ * is set. Otherwise all the data is used and more is needed.
+ */
+static size_t
+parse_token(const char *pos, const char *end, struct tokenizer *t)
+{
+	struct token *out = &t->token;
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
+	if (pos == end)
+		return 0;
+	if (t->is_comment)
+		return parse_skip_comment(pos, end, begin, out);
+	if (t->op != 0) {
+		char c = t->op;
+		t->op = 0;
+		return parse_finish_operator(pos, c, out) - begin;
+	}
+	if (t->is_escape) {
+		t->is_escape = false;
+		parse_append_escaped(out, t->quote, *pos);
 		++pos;
 	}
-	char quote = 0;
+	if (!t->is_started) {
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
+		}
+		if (pos == end)
+			return pos - begin;
+		t->is_started = true;
+	}
 	while (pos < end) {
+		const char *plain_end = t->quote == 0 ?
+			parse_skip_plain(pos, end) :
+			parse_skip_quoted(pos, end, t->quote);
+		if (plain_end != pos) {
+			out->data.append(pos, plain_end - pos);
+			pos = plain_end;
+			continue;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
 		case '"':
-			if (quote == 0) {
-				quote = c;
+			if (t->quote == 0) {
+				t->quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
-			if (quote != c)
+			if (t->quote != c)
 				goto append_and_next;
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
-				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				out->data += '\\';
+			if (t->quote == '\'')
 				goto append_and_next;
-			}
-			assert(quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
-				++pos;
-				continue;
+			if (pos == end) {
+				t->is_escape = true;
+				return pos - begin;
 			}
-			goto append_and_next;
+			parse_append_escaped(out, t->quote, *pos);
+			++pos;
+			continue;
 		case '&':
 		case '|':
 		case '>':
-			if (quote != 0)
+			if (t->quote != 0)
 				goto append_and_next;
 			if (!out->data.empty()) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
 			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
+			if (pos == end) {
+				t->op = c;
+				return pos - begin;
 			}
-			return pos - begin;
+			return parse_finish_operator(pos, c, out) - begin;
 		case ' ':
 		case '\t':
 		case '\r':
-			if (quote != 0)
+			if (t->quote != 0)
 				goto append_and_next;
 			assert(!out->data.empty());
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
-			if (quote != 0)
+			if (t->quote != 0)
 				goto append_and_next;
 			assert(!out->data.empty());
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
-			if (quote != 0)
+			if (t->quote != 0)
 				goto append_and_next;
 			if (!out->data.empty()) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
-			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			t->is_comment = true;
+			return parse_skip_comment(pos + 1, end, begin, out);
 		default:
 			goto append_and_next;
 		}
@@ -198,154 +445,200 @@ parse_token(const char *pos, const char *end, struct token *out)
 		out->data += c;
 		++pos;
 	}
-	return 0;
+	return pos - begin;
+}
+
+/**
+ * The commands array is complete only in the end of the line, and
+ * could move while growing. So the expressions get the pointers to
+ * their commands only then.
+ */
+static void
+command_line_link(struct command_line *line)
+{
+	struct command *cmd = line->commands.data();
+	for (expr &e : line->exprs) {
+		if (e.type == EXPR_TYPE_COMMAND)
+			e.cmd = cmd++;
+	}
+	assert(cmd == line->commands.data() + line->commands.size());
+}
+
+static enum parser_error
+parser_add_operator(struct command_line *line, enum expr_type type,
+		    enum parser_error no_left_arg,
+		    enum parser_error left_arg_not_a_command)
+{
+	if (line->exprs.empty())
+		return no_left_arg;
+	if (line->exprs.back().type != EXPR_TYPE_COMMAND)
+		return left_arg_not_a_command;
+	expr e;
+	e.type = type;
+	line->exprs.push_back(e);
+	return PARSER_ERR_NONE;
+}
+
+/** A token of the commands part of the line, before any redirect. */
+static enum parser_error
+parser_add_body_token(struct parser *p, struct token *token, bool *is_end)
+{
+	struct command_line *line = p->line;
+	switch(token->type) {
+	case TOKEN_TYPE_STR:
+		if (!line->exprs.empty() &&
+		    line->exprs.back().type == EXPR_TYPE_COMMAND) {
+			line->commands.back().args.push_back(
+				line_arena_dup(&line->arena, token->data));
+			return PARSER_ERR_NONE;
+		}
+		line->exprs.emplace_back();
+		line->commands.emplace_back();
+		line->commands.back().exe =
+			line_arena_dup(&line->arena, token->data);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_NEW_LINE:
+		/* Skip empty lines. */
+		*is_end = !line->exprs.empty();
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_PIPE:
+		return parser_add_operator(line, EXPR_TYPE_PIPE,
+			PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+			PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+	case TOKEN_TYPE_AND:
+		return parser_add_operator(line, EXPR_TYPE_AND,
+			PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+			PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+	case TOKEN_TYPE_OR:
+		return parser_add_operator(line, EXPR_TYPE_OR,
+			PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+			PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+	case TOKEN_TYPE_OUT_NEW:
+		line->out_type = OUTPUT_TYPE_FILE_NEW;
+		p->stage = PARSER_STAGE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_APPEND:
+		line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		p->stage = PARSER_STAGE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_BACKGROUND:
+		line->is_background = true;
+		p->stage = PARSER_STAGE_AFTER_BACKGROUND;
+		return PARSER_ERR_NONE;
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
+	}
+}
+
+/** Take the complete or the skipped line out of the parser. */
+static struct command_line *
+parser_take_line(struct parser *p)
+{
+	struct command_line *line = p->line;
+	p->line = NULL;
+	p->stage = PARSER_STAGE_BODY;
+	p->error = PARSER_ERR_NONE;
+	return line;
 }
 
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = new command_line();
-	char *pos = p->buffer.data();
+	*out = NULL;
+	if (p->line == NULL) {
+		p->line = new command_line();
+		/* Enough for most of the lines without regrowing. */
+		p->line->exprs.reserve(4);
+		p->line->commands.reserve(2);
+	}
+	const char *data = p->buffer.data();
+	size_t size = p->buffer.size();
+	if (p->external != NULL) {
+		data = p->external;
+		size = p->external_size;
+	}
+	const char *pos = data + p->offset;
 	const char *begin = pos;
-	char *end = pos + p->buffer.size();
-	struct token token;
-	enum parser_error res = PARSER_ERR_NONE;
+	const char *end = data + size;
+	struct token *token = &p->tokenizer.token;
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		expr e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (!line->exprs.empty() && line->exprs.back().type == EXPR_TYPE_COMMAND) {
-				line->exprs.back().cmd->args.emplace_back(std::move(token.data));
-				continue;
-			}
-			e.type = EXPR_TYPE_COMMAND;
-			e.cmd.emplace();
-			e.cmd->exe = std::move(token.data);
-			line->exprs.emplace_back(std::move(e));
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->exprs.empty())
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e.type = EXPR_TYPE_PIPE;
-			line->exprs.emplace_back(std::move(e));
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+	while (true) {
+		pos += parse_token(pos, end, &p->tokenizer);
+		if (token->type == TOKEN_TYPE_NONE) {
+			/* The line and the tokenizer keep what was parsed. */
+			parser_consume(p, pos - begin);
+			return PARSER_ERR_NONE;
+		}
+		enum parser_error res = PARSER_ERR_NONE;
+		bool is_end = false;
+		switch(p->stage) {
+		case PARSER_STAGE_BODY:
+			res = parser_add_body_token(p, token, &is_end);
+			break;
+		case PARSER_STAGE_OUT_FILE:
+			if (token->type != TOKEN_TYPE_STR) {
+				res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				break;
 			}
-			e.type = EXPR_TYPE_AND;
-			line->exprs.emplace_back(std::move(e));
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
+			p->line->out_file = std::move(token->data);
+			p->stage = PARSER_STAGE_AFTER_OUT;
+			break;
+		case PARSER_STAGE_AFTER_OUT:
+			if (token->type == TOKEN_TYPE_BACKGROUND) {
+				p->line->is_background = true;
+				p->stage = PARSER_STAGE_AFTER_BACKGROUND;
+				break;
 			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+			/* Fallthrough. */
+		case PARSER_STAGE_AFTER_BACKGROUND:
+			if (token->type == TOKEN_TYPE_NEW_LINE)
+				is_end = true;
+			else
+				res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+			break;
+		case PARSER_STAGE_SKIP:
+			/*
+			 * The line can't be executed but can't just crash
+			 * here because of that.
+			 */
+			if (token->type == TOKEN_TYPE_NEW_LINE) {
+				res = p->error;
+				tokenizer_reset(&p->tokenizer);
+				parser_consume(p, pos - begin);
+				delete parser_take_line(p);
+				return res;
 			}
-			e.type = EXPR_TYPE_OR;
-			line->exprs.emplace_back(std::move(e));
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			break;
 		default:
 			assert(false);
+			break;
 		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+		tokenizer_reset(&p->tokenizer);
+		if (res != PARSER_ERR_NONE) {
+			p->error = res;
+			p->stage = PARSER_STAGE_SKIP;
+			continue;
 		}
-		line->out_file = std::move(token.data);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(!line->exprs.empty());
+		if (!is_end)
+			continue;
 		parser_consume(p, pos - begin);
-		if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+		struct command_line *line = parser_take_line(p);
+		/* A line can start with '>' or '&', then it has no commands. */
+		if (line->exprs.empty() ||
+		    line->exprs.back().type != EXPR_TYPE_COMMAND) {
+			delete line;
+			return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 		}
+		command_line_link(line);
 		*out = line;
 		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
-	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
-
-return_no_line:
-	delete line;
-	*out = NULL;
-	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	delete p->line;
 	delete p;
 }
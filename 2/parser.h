@@ -1,10 +1,10 @@
 #pragma once
 
-#include <list>
-#include <optional>
+#include <memory>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct parser;
@@ -22,9 +22,14 @@ enum parser_error {
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
 };
 
+/**
+ * The strings point into the arena of their command line and are
+ * valid while it lives. Each of them is followed by a zero byte, so
+ * data() can be passed as a C string.
+ */
 struct command {
-	std::string exe;
-	std::vector<std::string> args;
+	std::string_view exe;
+	std::vector<std::string_view> args;
 };
 
 enum expr_type {
@@ -36,8 +41,11 @@ enum expr_type {
 
 struct expr {
 	enum expr_type type = EXPR_TYPE_COMMAND;
-	/** Valid if the type is COMMAND. */
-	std::optional<command> cmd;
+	/**
+	 * Valid if the type is COMMAND, NULL otherwise. Points into the
+	 * commands of the line.
+	 */
+	struct command *cmd = NULL;
 };
 
 enum output_type {
@@ -46,8 +54,26 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+/**
+ * Storage of the strings of a command line. They are copied in one
+ * after another, and a new block is added when the last one is full,
+ * so the strings never move.
+ */
+struct line_arena {
+	std::vector<std::unique_ptr<char[]>> blocks;
+	char *pos = nullptr;
+	size_t left = 0;
+};
+
+/**
+ * The expressions are stored flat, in the order of the line, and the
+ * commands are in a separate array in the same order. So the commands
+ * of one pipeline are next to each other.
+ */
 struct command_line {
-	std::list<expr> exprs;
+	line_arena arena;
+	std::vector<expr> exprs;
+	std::vector<command> commands;
 	enum output_type out_type = OUTPUT_TYPE_STDOUT;
 	/** Non-empty if the out type is FILE. */
 	std::string out_file;
@@ -60,6 +86,15 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Same as parser_feed(), but the data is parsed where it is, without
+ * copying in. It must stay valid and unchanged until the parser is
+ * deleted or is fed again. An incomplete tail is copied into the
+ * parser only when more data is fed after it.
+ */
+void
+parser_feed_external(struct parser *p, const char *str, size_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
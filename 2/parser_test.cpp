@@ -868,6 +868,8 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "> test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, " &", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -882,6 +884,203 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_many_lines(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("Feed a big script at once");
+	const int count = 100000;
+	std::string script;
+	for (int i = 0; i < count; ++i)
+		script += "echo " + std::to_string(i) + "\n";
+	/* The last line is incomplete. */
+	script += "echo";
+	parser_feed(p, script.data(), script.size());
+	int line_count = 0;
+	for (; line_count < count; ++line_count) {
+		if (parser_pop_next(p, &line) != PARSER_ERR_NONE ||
+		    line == NULL)
+			break;
+		unit_assert(line->exprs.size() == 1);
+		expr *e = &line->exprs.front();
+		unit_assert(e->cmd);
+		unit_assert(e->cmd->args.size() == 1);
+		unit_assert(e->cmd->args[0] == std::to_string(line_count));
+		delete line;
+	}
+	unit_check(line_count == count, "all lines");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "the last one is incomplete");
+
+	unit_msg("Finish the last line");
+	parser_feed(p, " end\n", 5);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	expr *e = &line->exprs.front();
+	unit_assert(e->cmd);
+	unit_check(e->cmd->exe == "echo", "exe");
+	unit_check(e->cmd->args.size() == 1 && e->cmd->args[0] == "end",
+		   "args");
+	unit_check(strcmp(e->cmd->exe.data(), "echo") == 0 &&
+		   strcmp(e->cmd->args[0].data(), "end") == 0,
+		   "zero-terminated");
+	delete line;
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_external(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("Lines are parsed in place");
+	std::string script = "echo 1\necho 2\nec";
+	parser_feed_external(p, script.data(), script.size());
+	for (int i = 1; i <= 2; ++i) {
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			   line != NULL, "parse");
+		unit_assert(line != NULL);
+		unit_check(line->commands.size() == 1 &&
+			   line->commands[0].args.size() == 1 &&
+			   line->commands[0].args[0] == std::to_string(i), "args");
+		delete line;
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "the last one is incomplete");
+
+	unit_msg("The tail is copied when more is fed");
+	parser_feed(p, "ho 3\n", 5);
+	/* The external data doesn't have to live any longer. */
+	script.assign(script.size(), 'x');
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		   line != NULL, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->commands[0].exe == "echo" &&
+		   line->commands[0].args.size() == 1 &&
+		   line->commands[0].args[0] == "3", "line");
+	delete line;
+
+	unit_msg("Or appended to the not consumed data");
+	parser_feed(p, "echo ", 5);
+	std::string rest = "4\n";
+	parser_feed_external(p, rest.data(), rest.size());
+	rest.clear();
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		   line != NULL, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->commands[0].args.size() == 1 &&
+		   line->commands[0].args[0] == "4", "line");
+	delete line;
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+/** Lines as a string, to compare how they are parsed. */
+static std::string
+test_dump_lines(struct parser *p)
+{
+	std::string res;
+	struct command_line *line = NULL;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			res += "error " + std::to_string(err) + "\n";
+			continue;
+		}
+		if (line == NULL)
+			break;
+		for (const expr &e : line->exprs) {
+			res += std::to_string(e.type);
+			if (e.cmd == NULL)
+				continue;
+			res += " [" + std::string(e.cmd->exe) + "]";
+			for (std::string_view arg : e.cmd->args)
+				res += " [" + std::string(arg) + "]";
+		}
+		res += " > " + std::to_string(line->out_type) + " [" +
+		       line->out_file + "] " +
+		       std::to_string(line->is_background) + "\n";
+		delete line;
+	}
+	return res;
+}
+
+static void
+test_split_feed(void)
+{
+	unit_test_start();
+	const std::string script =
+		"echo \"a \\\" b\" 'c d' e\\ f # comment\n"
+		"ls | grep x && echo 1 || echo 2\n"
+		"cmd >> \"out file\" &\n"
+		"x > y\n"
+		"echo ab\\\ncd \"multi\nline\"\n"
+		" | bad\n"
+		"echo after error\n"
+		"a > &&\n"
+		"last\n";
+
+	struct parser *p = parser_new();
+	parser_feed(p, script.data(), script.size());
+	std::string expected = test_dump_lines(p);
+	parser_delete(p);
+	unit_check(expected.find("[after] [error]") != std::string::npos &&
+		   expected.find("error ") != std::string::npos, "parsed");
+
+	unit_msg("Split at each byte");
+	bool is_same = true;
+	for (size_t split = 1; split < script.size(); ++split) {
+		p = parser_new();
+		parser_feed(p, script.data(), split);
+		std::string got = test_dump_lines(p);
+		parser_feed(p, script.data() + split, script.size() - split);
+		got += test_dump_lines(p);
+		parser_delete(p);
+		is_same = is_same && got == expected;
+	}
+	unit_check(is_same, "same result");
+
+	unit_msg("Fed by one byte");
+	p = parser_new();
+	std::string got;
+	for (char c : script) {
+		parser_feed(p, &c, 1);
+		got += test_dump_lines(p);
+	}
+	parser_delete(p);
+	unit_check(got == expected, "same result");
+
+	unit_msg("A huge line by one byte takes linear time");
+	p = parser_new();
+	const int size = 1000000;
+	parser_feed(p, "echo \"", 6);
+	struct command_line *line = NULL;
+	for (int i = 0; i < size; ++i) {
+		parser_feed(p, "x", 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\"\n", 2);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		   line != NULL, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->commands[0].args.size() == 1 &&
+		   line->commands[0].args[0].size() == size, "arg");
+	delete line;
+	parser_delete(p);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -897,5 +1096,8 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_many_lines();
+	test_feed_external();
+	test_split_feed();
 	return 0;
 }
@@ -1,23 +1,42 @@
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <ostream>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "parser.h"
+#include "userfs.h"
 
 namespace utils {
 
+// Of the job scheduler, they need the execution which goes after the helpers
+bool jobFinished(pid_t child_pid);
+void jobsWait(bool is_queue_only);
+int jobWait(pid_t child_pid);
+
 namespace {
 
 /* ------------------------------------------- codes ------------------------------------------- */
@@ -37,10 +56,94 @@ struct Exit {
     bool terminate_shell = false;
 };
 
+// A range of the line commands, they are stored in order
 struct Pipeline {
-    std::vector<command> commands;
+    command *commands = nullptr;
+    std::size_t count = 0;
     std::size_t pipes_count = 0;
+    // The one before the pipeline, COMMAND for the first one
+    expr_type operation = EXPR_TYPE_COMMAND;
+};
+
+// Like the bash hash: a command name is searched in PATH once, and then the
+// found file is run directly. Dropped when PATH changes, and an entry is
+// dropped when its file fails to run.
+struct PathCache {
+    bool is_path_set = false;
+    std::string path_variable;
+    std::unordered_map<std::string, std::string> paths;
+};
+
+PathCache path_cache;
+
+// Where a builtin writes: the descriptor, or the userfs file of a redirection
+// when the builtin is run by the shell itself
+struct Output {
+    int descriptor = STDOUT_FILENO;
+    int memory_descriptor = error_code;
+    const char *memory_name = nullptr;
+};
+
+// A command done by the shell itself instead of exec. Runs in the shell, or in
+// a forked child for a pipeline stage, with the stdout at the output.
+struct Builtin {
+    std::string_view name;
+    int (*run)(const std::vector<std::string_view> &arguments, const Output &output);
+    // The forms it doesn't do are run by the program, nullptr if it does all
+    bool (*is_supported)(const std::vector<std::string_view> &arguments);
+};
+
+// SIGCHLD is blocked and read from a signalfd, the commands are started with
+// the mask the shell had before
+sigset_t spawn_signal_mask;
+
+// A detached command line waiting for its turn
+struct QueuedJob {
+    std::unique_ptr<command_line> line;
+    Exit last_exit_status;
 };
+
+// The detached command lines, like `xargs -P`: up to max_count run at once,
+// the others are started in order as the running ones end. While none run,
+// nothing is polled between the commands.
+struct Jobs {
+    std::size_t max_count = 256;
+    std::unordered_set<pid_t> running;
+    // Not a deque, it allocates already when created, before the heap checks
+    std::list<QueuedJob> queue;
+    // Of the foreground commands, reaped while waiting for the jobs
+    std::unordered_map<pid_t, int> reaped_statuses;
+};
+
+Jobs jobs;
+
+// The redirections into the paths starting with MYBASH_MEMORY_PREFIX go to the
+// files of an in-process userfs, for the temporary files of the scripts. The
+// prefix is cut off, the rest is the name in userfs. A builtin run by the shell
+// writes right into the file, without syscalls. A process gets a memfd, which
+// is copied into the file when the process ends. The builtin cat reads the
+// files, also in a pipeline stage, as a fork has a copy of them. But the writes
+// done in a fork, like in a background job, stay in that fork. Empty when off.
+std::string memory_prefix;
+
+// Free it before the exit, the leak checks run before the static destructors
+void pathCacheClear() {
+    PathCache empty;
+    std::swap(path_cache, empty);
+}
+
+// Also for a child, the jobs of the shell are not its
+void jobsClear() {
+    Jobs empty;
+    empty.max_count = jobs.max_count;
+    std::swap(jobs, empty);
+}
+
+void memoryFilesClear() {
+    std::string empty;
+    std::swap(memory_prefix, empty);
+    ufs_destroy();
+}
 /* -------------------------------------------- *** -------------------------------------------- */
 
 /* ------------------------------------------ helpers ------------------------------------------ */
@@ -52,11 +155,106 @@ void closeOpened(int &pipe_descriptor) {
     }
 }
 
+// A forked child which doesn't exec needs only the standard descriptors, the
+// rest are of the shell. They are closed with one call, however many there
+// are. Returns false if the kernel can't do that.
+bool closeNotStandard() {
+    return close_range(STDERR_FILENO + 1, ~0U, 0) == success;
+}
+
+bool isMemoryPath(const std::string_view path) {
+    return !memory_prefix.empty() && path.size() > memory_prefix.size() &&
+           path.compare(0, memory_prefix.size(), memory_prefix) == 0;
+}
+
+// The path is zero-terminated, and so is its name in userfs
+const char *memoryName(const std::string_view path) {
+    return path.data() + memory_prefix.size();
+}
+
+// The userfs errors are told like the system ones
+int memoryErrno() {
+    switch (ufs_errno()) {
+        case UFS_ERR_NO_FILE: return ENOENT;
+        case UFS_ERR_NO_MEM: return ENOMEM;
+        case UFS_ERR_INVALID_ARG: return EINVAL;
+        case UFS_ERR_EXISTS: return EEXIST;
+        case UFS_ERR_NOT_EMPTY: return ENOTEMPTY;
+        case UFS_ERR_NO_PERMISSION: return EACCES;
+        default: return EIO;
+    }
+}
+
+// Opens the userfs file of a redirection like open() would do it, created,
+// truncated or appended to. Returns its userfs descriptor or error_code.
+int memoryFileOpen(const output_type current_type, const std::string &current_file) {
+    int flags = UFS_CREATE | UFS_WRITE_ONLY;
+    if (current_type == OUTPUT_TYPE_FILE_APPEND) {
+        flags |= UFS_APPEND;
+    }
+    const int file_descriptor = ufs_open(memoryName(current_file), flags);
+    if (file_descriptor == error_code) {
+        std::cerr << "bash: " << current_file << ": " << strerror(memoryErrno()) << "\n";
+        return error_code;
+    }
+    if (current_type == OUTPUT_TYPE_FILE_NEW && ufs_resize(file_descriptor, 0) == error_code) {
+        std::cerr << "bash: " << current_file << ": " << strerror(memoryErrno()) << "\n";
+        ufs_close(file_descriptor);
+        return error_code;
+    }
+    return file_descriptor;
+}
+
+// A process can't write into userfs, it gets a memfd instead. The file is
+// created or truncated now, like by bash before the command starts, and the
+// memfd data is appended to it when the command ends.
+int memoryBridgeOpen(const output_type current_type, const std::string &current_file) {
+    const int file_descriptor = memoryFileOpen(current_type, current_file);
+    if (file_descriptor == error_code) {
+        return error_code;
+    }
+    ufs_close(file_descriptor);
+    const int bridge_descriptor = memfd_create(memoryName(current_file), MFD_CLOEXEC);
+    if (bridge_descriptor == error_code) {
+        std::cerr << "bash: memfd_create: " << strerror(errno) << "\n";
+    }
+    return bridge_descriptor;
+}
+
+// Returns success or the errno
+int memoryBridgeCommit(const int bridge_descriptor, const std::string &current_file) {
+    struct stat bridge_stat {};
+    if (fstat(bridge_descriptor, &bridge_stat) == error_code) {
+        return errno;
+    }
+    if (bridge_stat.st_size == 0) {
+        return success;
+    }
+    const auto size = static_cast<std::size_t>(bridge_stat.st_size);
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, bridge_descriptor, 0);
+    if (map == MAP_FAILED) {
+        return errno;
+    }
+    int error_number = success;
+    const int file_descriptor = ufs_open(memoryName(current_file), UFS_CREATE | UFS_WRITE_ONLY | UFS_APPEND);
+    if (file_descriptor == error_code || ufs_write(file_descriptor, static_cast<const char *>(map), size) < 0) {
+        error_number = memoryErrno();
+    }
+    if (file_descriptor != error_code) {
+        ufs_close(file_descriptor);
+    }
+    munmap(map, size);
+    return error_number;
+}
+
 // if outputFileOpen == error_code -> last_status = 1
 int outputFileOpen(const output_type current_type, const std::string &current_file) {
     if (current_type == OUTPUT_TYPE_STDOUT) {
         return error_code;
     }
+    if (isMemoryPath(current_file)) {
+        return memoryBridgeOpen(current_type, current_file);
+    }
 
     int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
     if (current_type == OUTPUT_TYPE_FILE_NEW) {
@@ -74,6 +272,22 @@ int outputFileOpen(const output_type current_type, const std::string &current_fi
     return file_descriptor;
 }
 
+// Closes the descriptor of outputFileOpen() when the command has ended, a
+// memfd is copied into its file first. Returns false if the copy failed.
+bool outputFileClose(int &file_descriptor, const std::string &current_file) {
+    if (file_descriptor == error_code || !isMemoryPath(current_file)) {
+        closeOpened(file_descriptor);
+        return true;
+    }
+    const int error_number = memoryBridgeCommit(file_descriptor, current_file);
+    closeOpened(file_descriptor);
+    if (error_number != success) {
+        std::cerr << "bash: " << current_file << ": " << strerror(error_number) << "\n";
+        return false;
+    }
+    return true;
+}
+
 int statusToBash(const int status) {
     int result = success;
     if (WIFEXITED(status)) {
@@ -87,7 +301,29 @@ int statusToBash(const int status) {
 }
 
 int waitForChild(const pid_t child_pid) {
+    if (const auto found = jobs.reaped_statuses.find(child_pid); found != jobs.reaped_statuses.end()) {
+        const int status = found->second;
+        jobs.reaped_statuses.erase(found);
+        return statusToBash(status);
+    }
     int status;
+    // The queued jobs are started as soon as the running end, a foreground
+    // command can be waiting for one of them
+    while (!jobs.queue.empty()) {
+        const pid_t wait_pid = waitpid(-1, &status, 0);
+        if (wait_pid == error_code && errno == EINTR) {
+            continue;
+        }
+        if (wait_pid == error_code) {
+            return failure;
+        }
+        if (wait_pid == child_pid) {
+            return statusToBash(status);
+        }
+        if (!jobFinished(wait_pid)) {
+            jobs.reaped_statuses.emplace(wait_pid, status);
+        }
+    }
     while (true) {
         const pid_t wait_pid = waitpid(child_pid, &status, 0);
         if (wait_pid == error_code && errno == EINTR) {
@@ -102,7 +338,7 @@ int waitForChild(const pid_t child_pid) {
     return statusToBash(status);
 }
 
-int executeBuiltInChangeDirectory(const std::vector<std::string> &arguments,
+int executeBuiltInChangeDirectory(const std::vector<std::string_view> &arguments,
                                   const output_type current_type = OUTPUT_TYPE_STDOUT,
                                   const std::string &current_file = "") {
     int last_status = success;
@@ -140,14 +376,15 @@ int executeBuiltInChangeDirectory(const std::vector<std::string> &arguments,
             std::cerr << "bash: cd: " << home_path_variable << ": " << strerror(errno) << "\n";
         }
     } else if (arguments.size() == 1) {
-        const std::string &path_variable = arguments.at(0);
+        // The parser keeps the arguments zero-terminated
+        const std::string_view path_variable = arguments.at(0);
         if (path_variable.empty()) {
             std::cerr << "bash: cd: No such file or directory\n";
             closeOpened(redirect_file_descriptors);
             return failure;
         }
         // change directory of process
-        if (chdir(path_variable.c_str()) != error_code) {
+        if (chdir(path_variable.data()) != error_code) {
             last_status = success;
         } else {
             last_status = failure;
@@ -162,16 +399,54 @@ int executeBuiltInChangeDirectory(const std::vector<std::string> &arguments,
     return last_status;
 }
 
-Exit executeParentBuiltInExit(const std::vector<std::string> &arguments) {
+// Only the shell has jobs, `wait` in a child of it returns at once
+int executeBuiltInWait(const std::vector<std::string_view> &arguments, const bool is_shell,
+                       const output_type current_type = OUTPUT_TYPE_STDOUT, const std::string &current_file = "") {
+    // redirect cs if needed (bash do this)
+    if (current_type != OUTPUT_TYPE_STDOUT) {
+        int redirect_file_descriptors = outputFileOpen(current_type, current_file);
+        if (redirect_file_descriptors <= error_code) {
+            return failure;
+        }
+        closeOpened(redirect_file_descriptors);
+    }
+    if (!is_shell) {
+        return success;
+    }
+    if (arguments.empty()) {
+        jobsWait(false);
+        return success;
+    }
+    int last_status = success;
+    for (const std::string_view argument : arguments) {
+        errno = success;
+        char *end_of_string = nullptr;
+        const long child_pid = std::strtol(argument.data(), &end_of_string, 10);
+        if (errno != success || end_of_string == argument.data() || *end_of_string != '\0' || child_pid <= 0) {
+            std::cerr << "bash: wait: `" << argument << "': not a pid or valid job spec\n";
+            last_status = 2;
+            continue;
+        }
+        // the statuses of the ended ones are not kept
+        last_status = jobWait(static_cast<pid_t>(child_pid));
+        if (last_status == error_code) {
+            std::cerr << "bash: wait: pid " << child_pid << " is not a child of this shell\n";
+            last_status = 127;
+        }
+    }
+    return last_status;
+}
+
+Exit executeParentBuiltInExit(const std::vector<std::string_view> &arguments) {
     if (arguments.empty()) {
         return Exit {success, true};
     }
 
     errno = success;
     char *end_of_string = nullptr;
-    const long status = std::strtol(arguments.at(0).c_str(), &end_of_string, 10);
+    const long status = std::strtol(arguments.at(0).data(), &end_of_string, 10);
 
-    if (errno != success || end_of_string == arguments.at(0).c_str() || *end_of_string != '\0') {
+    if (errno != success || end_of_string == arguments.at(0).data() || *end_of_string != '\0') {
         std::cerr << "bash: exit: " << arguments.at(0) << ": numeric argument required\n";
         return Exit {2, true};
     }
@@ -187,6 +462,9 @@ Exit builtinRunInParent(const command &command, const output_type current_type,
     if (command.exe == "cd") {
         return Exit {executeBuiltInChangeDirectory(command.args, current_type, current_file), false};
     }
+    if (command.exe == "wait") {
+        return Exit {executeBuiltInWait(command.args, true, current_type, current_file), false};
+    }
     if (command.exe == "exit" && current_type == OUTPUT_TYPE_STDOUT) {
         return executeParentBuiltInExit(command.args);
     }
@@ -205,16 +483,16 @@ Exit builtinRunInParent(const command &command, const output_type current_type,
     return Exit {error_code, false};
 }
 
-int executeChildBuiltInExit(const std::vector<std::string> &arguments) {
+int executeChildBuiltInExit(const std::vector<std::string_view> &arguments) {
     if (arguments.empty()) {
         return success;
     }
 
     errno = success;
     char *end_of_string = nullptr;
-    const long status = std::strtol(arguments.at(0).c_str(), &end_of_string, 10);
+    const long status = std::strtol(arguments.at(0).data(), &end_of_string, 10);
 
-    if (errno != success || end_of_string == arguments.at(0).c_str() || *end_of_string != '\0') {
+    if (errno != success || end_of_string == arguments.at(0).data() || *end_of_string != '\0') {
         std::cerr << "bash: exit: " << arguments.at(0) << ": numeric argument required\n";
         return 2;
     }
@@ -230,6 +508,9 @@ int builtinRunInChild(const command &command, const output_type current_type, co
     if (command.exe == "cd") {
         return executeBuiltInChangeDirectory(command.args, current_type, current_file);
     }
+    if (command.exe == "wait") {
+        return executeBuiltInWait(command.args, false, current_type, current_file);
+    }
     // ReSharper disable once CppDFAConstantConditions
     if (command.exe == "exit" && current_type == OUTPUT_TYPE_STDOUT) {
         return executeChildBuiltInExit(command.args);
@@ -255,44 +536,671 @@ void reapAll(const std::vector<pid_t> &pids) {
     }
 }
 
+// The strings are zero-terminated in the line arena, so argv points right
+// at them. posix_spawn() doesn't change them despite taking char *.
 std::vector<char *> generateArguments(command &command) {
     std::vector<char *> arguments;
     arguments.reserve(command.args.size() + 2);
 
     // First value:
-    arguments.push_back(command.exe.data());
+    arguments.push_back(const_cast<char *>(command.exe.data()));
     // All arguments:
     std::transform(std::begin(command.args),
                    std::end(command.args),
                    std::back_inserter(arguments),
-                   [](std::string &argument) -> char * { return argument.data(); });
+                   [](std::string_view argument) -> char * { return const_cast<char *>(argument.data()); });
     // End for arguments:
     arguments.push_back(nullptr);
     return arguments;
 }
 
-void execute(const std::vector<char *> &arguments) {
-    if (const auto execute_result = execvp(arguments.at(0), arguments.data()); execute_result == error_code) {
-        if (errno == ENOENT) {
-            std::cerr << "bash: " << arguments.at(0) << ": command not found\n";
-            _exit(127);
+bool isBuiltin(const command &command) {
+    return command.exe == "cd" || command.exe == "exit" || command.exe == "wait";
+}
+
+// Returns success with the file path, or the errno that execvp() would end
+// with. The names with a slash are not searched.
+int findExecutable(const std::string &name, std::string &result, bool &is_cached) {
+    is_cached = false;
+    if (name.find('/') != std::string::npos) {
+        result = name;
+        return success;
+    }
+    const char *path_raw = std::getenv("PATH");
+    if (path_cache.is_path_set != (path_raw != nullptr) ||
+        (path_raw != nullptr && path_cache.path_variable != path_raw)) {
+        path_cache.paths.clear();
+        path_cache.is_path_set = path_raw != nullptr;
+        path_cache.path_variable = path_raw != nullptr ? path_raw : "";
+    }
+    if (const auto found = path_cache.paths.find(name); found != path_cache.paths.end()) {
+        result = found->second;
+        is_cached = true;
+        return success;
+    }
+
+    // Same default as execvp()
+    const std::string_view path = path_raw != nullptr ? path_raw : "/bin:/usr/bin";
+    int error_number = ENOENT;
+    std::size_t begin = 0;
+    while (begin <= path.size()) {
+        std::size_t end = path.find(':', begin);
+        if (end == std::string_view::npos) {
+            end = path.size();
         }
-        std::cerr << "bash: " << arguments.at(0) << ": " << strerror(errno) << "\n";
-        _exit(126);
+        // An empty entry is the current directory
+        std::string candidate(path.substr(begin, end - begin));
+        if (candidate.empty()) {
+            candidate = ".";
+        }
+        candidate += '/';
+        candidate += name;
+        begin = end + 1;
+
+        struct stat file_stat;
+        if (stat(candidate.c_str(), &file_stat) != success || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+        if (access(candidate.c_str(), X_OK) != success) {
+            error_number = EACCES;
+            continue;
+        }
+        result = path_cache.paths.emplace(name, std::move(candidate)).first->second;
+        return success;
     }
+    return error_number;
+}
+
+// posix_spawn() doesn't copy the page tables of the shell like fork() does,
+// glibc runs the child in the same memory until exec. The file descriptors
+// are wired with the file actions. All the others are opened with O_CLOEXEC,
+// so nothing leaks into the child. Returns the pid, or error_code with the
+// status like bash would have if the command can't be run.
+pid_t spawnCommand(command &command, const int input_descriptor, const int output_descriptor, int &spawn_status) {
+    posix_spawn_file_actions_t actions;
+    if (const int error_number = posix_spawn_file_actions_init(&actions); error_number != success) {
+        std::cerr << "bash: posix_spawn: " << strerror(error_number) << "\n";
+        spawn_status = failure;
+        return error_code;
+    }
+    posix_spawnattr_t attributes;
+    if (const int error_number = posix_spawnattr_init(&attributes); error_number != success) {
+        std::cerr << "bash: posix_spawn: " << strerror(error_number) << "\n";
+        posix_spawn_file_actions_destroy(&actions);
+        spawn_status = failure;
+        return error_code;
+    }
+    int error_number = posix_spawnattr_setsigmask(&attributes, &spawn_signal_mask);
+    if (error_number == success) {
+        error_number = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+    }
+    if (error_number == success && input_descriptor != error_code) {
+        error_number = posix_spawn_file_actions_adddup2(&actions, input_descriptor, STDIN_FILENO);
+    }
+    if (error_number == success && output_descriptor != error_code) {
+        error_number = posix_spawn_file_actions_adddup2(&actions, output_descriptor, STDOUT_FILENO);
+    }
+    pid_t child_pid = error_code;
+    const std::vector<char *> arguments = generateArguments(command);
+    const std::string name(command.exe);
+    std::string file_path;
+    bool is_cached = false;
+    if (error_number == success) {
+        error_number = findExecutable(name, file_path, is_cached);
+    }
+    if (error_number == success) {
+        error_number = posix_spawn(&child_pid, file_path.c_str(), &actions, &attributes, arguments.data(), environ);
+    }
+    if (error_number != success && is_cached) {
+        // The file could be moved or deleted since, search again
+        path_cache.paths.erase(name);
+        error_number = findExecutable(name, file_path, is_cached);
+        if (error_number == success) {
+            error_number = posix_spawn(&child_pid, file_path.c_str(), &actions, &attributes, arguments.data(), environ);
+        }
+    }
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error_number == success) {
+        return child_pid;
+    }
+    path_cache.paths.erase(name);
+    if (error_number == ENOENT) {
+        std::cerr << "bash: " << arguments.at(0) << ": command not found\n";
+        spawn_status = 127;
+    } else {
+        std::cerr << "bash: " << arguments.at(0) << ": " << strerror(error_number) << "\n";
+        spawn_status = 126;
+    }
+    return error_code;
+}
+
+// `cat` of the named files is done by the shell itself, there is nothing to
+// exec for just copying them. The options and the stdin are left to the real
+// one.
+bool catIsSupported(const std::vector<std::string_view> &arguments) {
+    if (arguments.empty()) {
+        return false;
+    }
+    return std::none_of(std::begin(arguments), std::end(arguments),
+                        [](std::string_view argument) { return argument.empty() || argument.front() == '-'; });
+}
+
+// `a | cat | b` is the same as `a | b`, such a stage needs no process
+bool isPassThrough(const command &command) {
+    return command.exe == "cat" && command.args.empty();
+}
+
+// Returns success or the errno
+int writeAll(const Output &output, std::string_view data) {
+    if (output.memory_descriptor != error_code) {
+        if (!data.empty() && ufs_write(output.memory_descriptor, data.data(), data.size()) < 0) {
+            return memoryErrno();
+        }
+        return success;
+    }
+    while (!data.empty()) {
+        const ssize_t written = write(output.descriptor, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return success;
+}
+
+constexpr std::size_t copy_buffer_size = 64 * 1024;
+
+// sendfile() copies in the kernel, without the data going through the shell
+// memory. Not all the descriptors support it, then it is a plain loop.
+// Returns success or the errno.
+int copyDescriptor(const int input_descriptor, const Output &output) {
+    bool is_sendfile = output.memory_descriptor == error_code;
+    while (is_sendfile) {
+        const ssize_t written = sendfile(output.descriptor, input_descriptor, nullptr, 1 << 30);
+        if (written == 0) {
+            return success;
+        }
+        if (written > 0) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return errno;
+        }
+        is_sendfile = false;
+    }
+    std::unique_ptr<char[]> buffer(new char[copy_buffer_size]);
+    while (true) {
+        const ssize_t bytes_read = read(input_descriptor, buffer.get(), copy_buffer_size);
+        if (bytes_read == 0) {
+            return success;
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (const int error_number = writeAll(output, std::string_view(buffer.get(), bytes_read));
+            error_number != success) {
+            return error_number;
+        }
+    }
+}
+
+// Returns success or the errno
+int copyMemoryFile(const int memory_descriptor, const Output &output) {
+    std::unique_ptr<char[]> buffer(new char[copy_buffer_size]);
+    while (true) {
+        const ssize_t bytes_read = ufs_read(memory_descriptor, buffer.get(), copy_buffer_size);
+        if (bytes_read == 0) {
+            return success;
+        }
+        if (bytes_read < 0) {
+            return memoryErrno();
+        }
+        if (const int error_number = writeAll(output, std::string_view(buffer.get(), bytes_read));
+            error_number != success) {
+            return error_number;
+        }
+    }
+}
+
+// A userfs file, the output can be the same file
+int catMemoryFile(const std::string_view argument, const Output &output) {
+    const int input_descriptor = ufs_open(memoryName(argument), UFS_READ_ONLY);
+    if (input_descriptor == error_code) {
+        std::cerr << "cat: " << argument << ": " << strerror(memoryErrno()) << "\n";
+        return failure;
+    }
+    int status = success;
+    struct ufs_file_stat input_stat {};
+    if (output.memory_descriptor != error_code && std::strcmp(memoryName(argument), output.memory_name) == 0 &&
+        ufs_stat(input_descriptor, &input_stat) == success && input_stat.size > 0) {
+        std::cerr << "cat: " << argument << ": input file is output file\n";
+        status = failure;
+    } else if (const int error_number = copyMemoryFile(input_descriptor, output); error_number != success) {
+        std::cerr << "cat: " << argument << ": " << strerror(error_number) << "\n";
+        status = failure;
+    }
+    ufs_close(input_descriptor);
+    return status;
+}
+
+// Messages and the status are like of the coreutils cat
+int catRun(const std::vector<std::string_view> &arguments, const Output &output) {
+    struct stat output_stat {};
+    const bool is_output_regular = output.memory_descriptor == error_code &&
+                                   fstat(output.descriptor, &output_stat) == success && S_ISREG(output_stat.st_mode);
+    int status = success;
+    for (const std::string_view argument : arguments) {
+        if (isMemoryPath(argument)) {
+            status = std::max(status, catMemoryFile(argument, output));
+            continue;
+        }
+        const int input_descriptor = open(argument.data(), O_RDONLY | O_CLOEXEC);
+        if (input_descriptor == error_code) {
+            std::cerr << "cat: " << argument << ": " << strerror(errno) << "\n";
+            status = failure;
+            continue;
+        }
+        struct stat input_stat {};
+        int error_number = success;
+        if (fstat(input_descriptor, &input_stat) == error_code) {
+            error_number = errno;
+        } else if (S_ISDIR(input_stat.st_mode)) {
+            error_number = EISDIR;
+        } else if (is_output_regular && input_stat.st_dev == output_stat.st_dev &&
+                   input_stat.st_ino == output_stat.st_ino && input_stat.st_size > 0) {
+            // it would never end for `cat a >> a`
+            std::cerr << "cat: " << argument << ": input file is output file\n";
+            status = failure;
+        } else {
+            error_number = copyDescriptor(input_descriptor, output);
+        }
+        close(input_descriptor);
+        if (error_number != success) {
+            std::cerr << "cat: " << argument << ": " << strerror(error_number) << "\n";
+            status = failure;
+        }
+    }
+    return status;
+}
+
+// The escapes of `echo -e`. Returns false on \c, nothing is printed after it.
+bool echoAppendEscaped(std::string &output, const std::string_view argument) {
+    constexpr std::string_view octal_digits = "01234567";
+    constexpr std::string_view hex_digits = "0123456789abcdefABCDEF";
+    for (std::size_t index = 0; index < argument.size(); ++index) {
+        if (argument[index] != '\\' || index + 1 == argument.size()) {
+            output += argument[index];
+            continue;
+        }
+        const char escape = argument[++index];
+        switch (escape) {
+            case 'a': output += '\a'; break;
+            case 'b': output += '\b'; break;
+            case 'e':
+            case 'E': output += '\033'; break;
+            case 'f': output += '\f'; break;
+            case 'n': output += '\n'; break;
+            case 'r': output += '\r'; break;
+            case 't': output += '\t'; break;
+            case 'v': output += '\v'; break;
+            case '\\': output += '\\'; break;
+            case 'c': return false;
+            case '0':
+            case 'x': {
+                const std::string_view digits = escape == '0' ? octal_digits : hex_digits;
+                const std::size_t max_count = escape == '0' ? 3 : 2;
+                std::size_t count = 0;
+                unsigned value = 0;
+                while (count < max_count && index + 1 < argument.size() &&
+                       digits.find(argument[index + 1]) != std::string_view::npos) {
+                    const char digit = argument[++index];
+                    value = value * (escape == '0' ? 8 : 16) +
+                            static_cast<unsigned>(std::isdigit(digit) ? digit - '0' : std::tolower(digit) - 'a' + 10);
+                    ++count;
+                }
+                if (escape == 'x' && count == 0) {
+                    output += "\\x";
+                } else {
+                    output += static_cast<char>(value);
+                }
+                break;
+            }
+            default:
+                output += '\\';
+                output += escape;
+                break;
+        }
+    }
+    return true;
+}
+
+// Like the bash one: -n, -e and -E, in any combination
+int echoRun(const std::vector<std::string_view> &arguments, const Output &target) {
+    bool is_newline = true;
+    bool is_escapes = false;
+    std::size_t first = 0;
+    for (; first < arguments.size(); ++first) {
+        const std::string_view argument = arguments[first];
+        if (argument.size() < 2 || argument.front() != '-' ||
+            argument.find_first_not_of("neE", 1) != std::string_view::npos) {
+            break;
+        }
+        for (const char option : argument.substr(1)) {
+            if (option == 'n') {
+                is_newline = false;
+            } else {
+                is_escapes = option == 'e';
+            }
+        }
+    }
+    std::string output;
+    for (std::size_t index = first; index < arguments.size(); ++index) {
+        if (index != first) {
+            output += ' ';
+        }
+        if (!is_escapes) {
+            output += arguments[index];
+        } else if (!echoAppendEscaped(output, arguments[index])) {
+            is_newline = false;
+            break;
+        }
+    }
+    if (is_newline) {
+        output += '\n';
+    }
+    if (const int error_number = writeAll(target, output); error_number != success) {
+        std::cerr << "bash: echo: write error: " << strerror(error_number) << "\n";
+        return failure;
+    }
+    return success;
+}
+
+int trueRun(const std::vector<std::string_view> &, const Output &) {
+    return success;
+}
+
+int falseRun(const std::vector<std::string_view> &, const Output &) {
+    return failure;
+}
+
+// The options are left to the program
+bool pwdIsSupported(const std::vector<std::string_view> &arguments) {
+    return arguments.empty();
+}
+
+int pwdRun(const std::vector<std::string_view> &, const Output &target) {
+    std::unique_ptr<char, decltype(&std::free)> path(getcwd(nullptr, 0), &std::free);
+    if (path == nullptr) {
+        std::cerr << "bash: pwd: " << strerror(errno) << "\n";
+        return failure;
+    }
+    std::string output(path.get());
+    output += '\n';
+    if (const int error_number = writeAll(target, output); error_number != success) {
+        std::cerr << "bash: pwd: write error: " << strerror(error_number) << "\n";
+        return failure;
+    }
+    return success;
+}
+
+// `test` and `[` return 2 on a syntax error
+constexpr int test_error = 2;
+
+int testNegate(const int status) {
+    return status == test_error ? status : (status == success ? failure : success);
+}
+
+int testResult(const bool value) {
+    return value ? success : failure;
+}
+
+bool testIsUnary(const std::string_view operation) {
+    return operation.size() == 2 && operation.front() == '-' &&
+           std::string_view("abcdefghknprstuwxzGLNOS").find(operation[1]) != std::string_view::npos;
+}
+
+bool testIsBinary(const std::string_view operation) {
+    constexpr std::string_view operations[] = {"=",   "==",  "!=",  "<",   ">",   "-eq", "-ne", "-lt",
+                                               "-le", "-gt", "-ge", "-ef", "-nt", "-ot", "-a",  "-o"};
+    return std::find(std::begin(operations), std::end(operations), operation) != std::end(operations);
+}
+
+bool testInteger(const std::string_view name, const std::string_view argument, long long &value) {
+    errno = success;
+    char *end = nullptr;
+    // The parser keeps the arguments zero-terminated
+    value = std::strtoll(argument.data(), &end, 10);
+    bool is_valid = errno == success && end != argument.data();
+    while (is_valid && *end != '\0') {
+        is_valid = std::isspace(static_cast<unsigned char>(*end++));
+    }
+    if (!is_valid) {
+        std::cerr << "bash: " << name << ": " << argument << ": integer expression expected\n";
+    }
+    return is_valid;
+}
+
+int testUnary(const std::string_view name, const std::string_view operation, const std::string_view operand) {
+    if (!testIsUnary(operation)) {
+        std::cerr << "bash: " << name << ": " << operation << ": unary operator expected\n";
+        return test_error;
+    }
+    const char type = operation[1];
+    if (type == 'z' || type == 'n') {
+        return testResult(operand.empty() == (type == 'z'));
+    }
+    if (type == 't') {
+        long long descriptor = 0;
+        if (!testInteger(name, operand, descriptor)) {
+            return test_error;
+        }
+        return testResult(descriptor >= 0 && descriptor <= INT_MAX && isatty(static_cast<int>(descriptor)));
+    }
+    if (type == 'r' || type == 'w' || type == 'x') {
+        const int mode = type == 'r' ? R_OK : (type == 'w' ? W_OK : X_OK);
+        return testResult(faccessat(AT_FDCWD, operand.data(), mode, AT_EACCESS) == success);
+    }
+    struct stat file_stat {};
+    if (type == 'h' || type == 'L') {
+        return testResult(lstat(operand.data(), &file_stat) == success && S_ISLNK(file_stat.st_mode));
+    }
+    if (stat(operand.data(), &file_stat) == error_code) {
+        return failure;
+    }
+    switch (type) {
+        case 'b': return testResult(S_ISBLK(file_stat.st_mode));
+        case 'c': return testResult(S_ISCHR(file_stat.st_mode));
+        case 'd': return testResult(S_ISDIR(file_stat.st_mode));
+        case 'f': return testResult(S_ISREG(file_stat.st_mode));
+        case 'g': return testResult(file_stat.st_mode & S_ISGID);
+        case 'k': return testResult(file_stat.st_mode & S_ISVTX);
+        case 'p': return testResult(S_ISFIFO(file_stat.st_mode));
+        case 's': return testResult(file_stat.st_size > 0);
+        case 'u': return testResult(file_stat.st_mode & S_ISUID);
+        case 'G': return testResult(file_stat.st_gid == getegid());
+        case 'N':
+            return testResult(file_stat.st_mtim.tv_sec > file_stat.st_atim.tv_sec ||
+                              (file_stat.st_mtim.tv_sec == file_stat.st_atim.tv_sec &&
+                               file_stat.st_mtim.tv_nsec > file_stat.st_atim.tv_nsec));
+        case 'O': return testResult(file_stat.st_uid == geteuid());
+        case 'S': return testResult(S_ISSOCK(file_stat.st_mode));
+        default: return success;    // -a, -e
+    }
+}
+
+// 1 if the first file is newer, -1 if older. A missing file is the oldest.
+int testCompareTime(const std::string_view left, const std::string_view right) {
+    struct stat left_stat {};
+    struct stat right_stat {};
+    const bool is_left = stat(left.data(), &left_stat) == success;
+    const bool is_right = stat(right.data(), &right_stat) == success;
+    if (!is_left || !is_right) {
+        return is_left ? 1 : (is_right ? -1 : 0);
+    }
+    if (left_stat.st_mtim.tv_sec != right_stat.st_mtim.tv_sec) {
+        return left_stat.st_mtim.tv_sec > right_stat.st_mtim.tv_sec ? 1 : -1;
+    }
+    if (left_stat.st_mtim.tv_nsec != right_stat.st_mtim.tv_nsec) {
+        return left_stat.st_mtim.tv_nsec > right_stat.st_mtim.tv_nsec ? 1 : -1;
+    }
+    return 0;
+}
+
+int testBinary(const std::string_view name, const std::string_view left, const std::string_view operation,
+               const std::string_view right) {
+    if (operation == "=" || operation == "==") {
+        return testResult(left == right);
+    }
+    if (operation == "!=") {
+        return testResult(left != right);
+    }
+    if (operation == "<" || operation == ">") {
+        return testResult(operation == "<" ? left < right : left > right);
+    }
+    if (operation == "-a" || operation == "-o") {
+        return testResult(operation == "-a" ? !left.empty() && !right.empty() : !left.empty() || !right.empty());
+    }
+    if (operation == "-ef") {
+        struct stat left_stat {};
+        struct stat right_stat {};
+        return testResult(stat(left.data(), &left_stat) == success && stat(right.data(), &right_stat) == success &&
+                          left_stat.st_dev == right_stat.st_dev && left_stat.st_ino == right_stat.st_ino);
+    }
+    if (operation == "-nt" || operation == "-ot") {
+        return testResult(testCompareTime(left, right) == (operation == "-nt" ? 1 : -1));
+    }
+    long long left_value = 0;
+    long long right_value = 0;
+    if (!testInteger(name, left, left_value) || !testInteger(name, right, right_value)) {
+        return test_error;
+    }
+    if (operation == "-eq") {
+        return testResult(left_value == right_value);
+    }
+    if (operation == "-ne") {
+        return testResult(left_value != right_value);
+    }
+    if (operation == "-lt") {
+        return testResult(left_value < right_value);
+    }
+    if (operation == "-le") {
+        return testResult(left_value <= right_value);
+    }
+    if (operation == "-gt") {
+        return testResult(left_value > right_value);
+    }
+    return testResult(left_value >= right_value);
+}
+
+// The POSIX rules by the argument count. The longer expressions with -a, -o
+// and the parentheses are left to the program.
+int testEvaluate(const std::string_view name, const std::string_view *arguments, const std::size_t count) {
+    switch (count) {
+        case 0: return failure;
+        case 1: return testResult(!arguments[0].empty());
+        case 2:
+            if (arguments[0] == "!") {
+                return testNegate(testEvaluate(name, arguments + 1, 1));
+            }
+            return testUnary(name, arguments[0], arguments[1]);
+        case 3:
+            if (testIsBinary(arguments[1])) {
+                return testBinary(name, arguments[0], arguments[1], arguments[2]);
+            }
+            if (arguments[0] == "!") {
+                return testNegate(testEvaluate(name, arguments + 1, 2));
+            }
+            if (arguments[0] == "(" && arguments[2] == ")") {
+                return testEvaluate(name, arguments + 1, 1);
+            }
+            std::cerr << "bash: " << name << ": " << arguments[1] << ": binary operator expected\n";
+            return test_error;
+        default:
+            if (arguments[0] == "!") {
+                return testNegate(testEvaluate(name, arguments + 1, 3));
+            }
+            if (arguments[0] == "(" && arguments[3] == ")") {
+                return testEvaluate(name, arguments + 1, 2);
+            }
+            std::cerr << "bash: " << name << ": too many arguments\n";
+            return test_error;
+    }
+}
+
+bool testIsSupported(const std::vector<std::string_view> &arguments) {
+    return arguments.size() <= 4;
+}
+
+int testRun(const std::vector<std::string_view> &arguments, const Output &) {
+    return testEvaluate("test", arguments.data(), arguments.size());
+}
+
+bool bracketIsSupported(const std::vector<std::string_view> &arguments) {
+    return arguments.size() <= 5;
+}
+
+int bracketRun(const std::vector<std::string_view> &arguments, const Output &) {
+    if (arguments.empty() || arguments.back() != "]") {
+        std::cerr << "bash: [: missing `]'\n";
+        return test_error;
+    }
+    return testEvaluate("[", arguments.data(), arguments.size() - 1);
+}
+
+// A new one is added here. cd, exit and wait are of the shell itself and are
+// run separately.
+constexpr Builtin builtins[] = {
+        {"echo", echoRun, nullptr},
+        {"true", trueRun, nullptr},
+        {"false", falseRun, nullptr},
+        {"pwd", pwdRun, pwdIsSupported},
+        {"test", testRun, testIsSupported},
+        {"[", bracketRun, bracketIsSupported},
+        {"cat", catRun, catIsSupported},
+};
+
+const Builtin *findBuiltin(const command &command) {
+    for (const Builtin &builtin : builtins) {
+        if (builtin.name == command.exe) {
+            const bool is_supported = builtin.is_supported == nullptr || builtin.is_supported(command.args);
+            return is_supported ? &builtin : nullptr;
+        }
+    }
+    return nullptr;
 }
 
 /* -------------------------------------------- *** -------------------------------------------- */
 }    // namespace
 
 Exit executeNonBackgroundCommand(command &command, const output_type current_type, const std::string &current_file) {
-    const std::vector<char *> arguments = generateArguments(command);
-
     // Run built ins
     if (const auto status = builtinRunInParent(command, current_type, current_file); status.last_status >= 0) {
         return status;
     }
 
+    const Builtin *builtin = findBuiltin(command);
+    if (builtin != nullptr && current_type != OUTPUT_TYPE_STDOUT && isMemoryPath(current_file)) {
+        Output output;
+        output.memory_descriptor = memoryFileOpen(current_type, current_file);
+        if (output.memory_descriptor == error_code) {
+            return {failure, false};
+        }
+        output.memory_name = memoryName(current_file);
+        const int status = builtin->run(command.args, output);
+        ufs_close(output.memory_descriptor);
+        return {status, false};
+    }
+
     int redirect_file_descriptors = error_code;
     if (current_type != OUTPUT_TYPE_STDOUT) {
         // open or create file
@@ -302,57 +1210,70 @@ Exit executeNonBackgroundCommand(command &command, const output_type current_typ
         }
     }
 
-    // fork process
-    const pid_t child_pid = fork();
-    if (child_pid <= error_code) {
-        std::cerr << "bash: fork: " << strerror(errno) << "\n";
-        closeOpened(redirect_file_descriptors);
-        return {failure, false};
-    }
-    // parent:
-    if (child_pid > 0) {
+    if (builtin != nullptr) {
+        Output output;
+        if (redirect_file_descriptors != error_code) {
+            output.descriptor = redirect_file_descriptors;
+        }
+        const int status = builtin->run(command.args, output);
         closeOpened(redirect_file_descriptors);
-        const auto result = waitForChild(child_pid);
-        return {result, false};
+        return {status, false};
     }
 
-    // child: (child_pid == 0)
-    if (current_type != OUTPUT_TYPE_STDOUT) {
-        if (dup2(redirect_file_descriptors, STDOUT_FILENO) == error_code) {
-            std::cerr << "bash: dup2: " << strerror(errno) << "\n";
-            closeOpened(redirect_file_descriptors);
-            _exit(failure);
-        }
+    int spawn_status = success;
+    const pid_t child_pid = spawnCommand(command, error_code, redirect_file_descriptors, spawn_status);
+    if (child_pid == error_code) {
         closeOpened(redirect_file_descriptors);
+        return {spawn_status, false};
     }
-
-    // execute command
-    execute(arguments);
-    return {success, false};
+    const int status = waitForChild(child_pid);
+    if (!outputFileClose(redirect_file_descriptors, current_file)) {
+        return {failure, false};
+    }
+    return {status, false};
 }
 
-int executePipelineNonBackgroundCommands(std::vector<command> &commands, const output_type current_type,
+int executePipelineNonBackgroundCommands(command *commands, const std::size_t count, const output_type current_type,
                                          const std::string &current_file) {
-    if (commands.empty()) {
+    if (count == 0) {
         return success;
     }
 
     int previous_pipe_read_file_descriptor = error_code;
     int redirect_file_descriptors = error_code;
+    // The memfd of a userfs file, kept till the pipeline ends
+    int bridge_file_descriptor = error_code;
     std::vector<pid_t> pids;
+    // Of the last command, if it ran in the shell or couldn't be started
+    int last_shell_status = error_code;
 
-    for (std::size_t index = 0; index < commands.size(); ++index) {
-        const bool is_not_last = index != commands.size() - 1;
+    for (std::size_t index = 0; index < count; ++index) {
+        const bool is_not_last = index != count - 1;
         const bool is_last = !is_not_last;
-        auto &current_command = commands.at(index);
+        auto &current_command = commands[index];
+        // keep the previous pipe for the next command
+        if (index != 0 && is_not_last && isPassThrough(current_command)) {
+            continue;
+        }
+
+        // The built ins of the table don't read the stdin, so they run in the
+        // shell, without a process. The output of such a stage goes into a
+        // memfd instead of a pipe, it doesn't wait for the reader, and the
+        // next stage reads it as its stdin.
+        const Builtin *builtin = findBuiltin(current_command);
 
         // create new pipe
         int pipes_file_descriptors[2];
         pipes_file_descriptors[Read] = error_code;
         pipes_file_descriptors[Write] = error_code;
         if (is_not_last) {
-            if (pipe(pipes_file_descriptors) == error_code) {
-                std::cerr << "bash: pipe: " << strerror(errno) << "\n";
+            if (builtin != nullptr) {
+                pipes_file_descriptors[Write] = memfd_create("pipe", MFD_CLOEXEC);
+            }
+            if (builtin != nullptr ? pipes_file_descriptors[Write] == error_code
+                                   : pipe2(pipes_file_descriptors, O_CLOEXEC) == error_code) {
+                std::cerr << "bash: " << (builtin != nullptr ? "memfd_create" : "pipe") << ": " << strerror(errno)
+                          << "\n";
                 closeOpened(redirect_file_descriptors);
                 closeOpened(previous_pipe_read_file_descriptor);
                 closeOpened(pipes_file_descriptors[Read]);
@@ -373,60 +1294,83 @@ int executePipelineNonBackgroundCommands(std::vector<command> &commands, const o
             }
         }
 
-        // fork process:
-        const pid_t child_pid = fork();
-        if (child_pid <= error_code) {
-            std::cerr << "bash: fork: " << strerror(errno) << "\n";
-            closeOpened(redirect_file_descriptors);
-            closeOpened(previous_pipe_read_file_descriptor);
-            closeOpened(pipes_file_descriptors[Read]);
-            closeOpened(pipes_file_descriptors[Write]);
-            reapAll(pids);
-            return failure;
-        }
+        if (builtin != nullptr) {
+            Output output;
+            if (is_not_last) {
+                output.descriptor = pipes_file_descriptors[Write];
+            } else if (redirect_file_descriptors != error_code) {
+                output.descriptor = redirect_file_descriptors;
+            }
+            const int status = builtin->run(current_command.args, output);
+            if (is_not_last) {
+                lseek(pipes_file_descriptors[Write], 0, SEEK_SET);
+                std::swap(pipes_file_descriptors[Read], pipes_file_descriptors[Write]);
+            } else {
+                last_shell_status = status;
+            }
+        } else if (!isBuiltin(current_command)) {
+            const int output_descriptor = is_not_last ? pipes_file_descriptors[Write] : redirect_file_descriptors;
+            int spawn_status = success;
+            const pid_t child_pid = spawnCommand(current_command, previous_pipe_read_file_descriptor,
+                                                 output_descriptor, spawn_status);
+            if (child_pid != error_code) {
+                pids.push_back(child_pid);
+            } else if (is_last) {
+                last_shell_status = spawn_status;
+            }
+        } else {
+            // cd, exit and wait need an own copy of the shell
+            const pid_t child_pid = fork();
+            if (child_pid <= error_code) {
+                std::cerr << "bash: fork: " << strerror(errno) << "\n";
+                closeOpened(redirect_file_descriptors);
+                closeOpened(previous_pipe_read_file_descriptor);
+                closeOpened(pipes_file_descriptors[Read]);
+                closeOpened(pipes_file_descriptors[Write]);
+                reapAll(pids);
+                return failure;
+            }
 
-        // in child:
-        if (child_pid == 0) {
-            if (previous_pipe_read_file_descriptor != error_code) {
-                if (dup2(previous_pipe_read_file_descriptor, STDIN_FILENO) == error_code) {
-                    std::cerr << "bash: dup2: " << strerror(errno) << "\n";
-                    _exit(failure);
+            // in child:
+            if (child_pid == 0) {
+                if (previous_pipe_read_file_descriptor != error_code) {
+                    if (dup2(previous_pipe_read_file_descriptor, STDIN_FILENO) == error_code) {
+                        std::cerr << "bash: dup2: " << strerror(errno) << "\n";
+                        _exit(failure);
+                    }
                 }
-            }
 
-            if (is_not_last) {
-                if (dup2(pipes_file_descriptors[Write], STDOUT_FILENO) == error_code) {
-                    std::cerr << "bash: dup2: " << strerror(errno) << "\n";
-                    _exit(failure);
+                if (is_not_last) {
+                    if (dup2(pipes_file_descriptors[Write], STDOUT_FILENO) == error_code) {
+                        std::cerr << "bash: dup2: " << strerror(errno) << "\n";
+                        _exit(failure);
+                    }
+                } else if (is_last && current_type != OUTPUT_TYPE_STDOUT) {
+                    if (dup2(redirect_file_descriptors, STDOUT_FILENO) == error_code) {
+                        std::cerr << "bash: dup2: " << strerror(errno) << "\n";
+                        closeOpened(redirect_file_descriptors);
+                        _exit(failure);
+                    }
                 }
-            } else if (is_last && current_type != OUTPUT_TYPE_STDOUT) {
-                if (dup2(redirect_file_descriptors, STDOUT_FILENO) == error_code) {
-                    std::cerr << "bash: dup2: " << strerror(errno) << "\n";
+
+                if (!closeNotStandard()) {
                     closeOpened(redirect_file_descriptors);
-                    _exit(failure);
+                    closeOpened(pipes_file_descriptors[Read]);
+                    closeOpened(pipes_file_descriptors[Write]);
+                    closeOpened(previous_pipe_read_file_descriptor);
                 }
-            }
-
-            closeOpened(redirect_file_descriptors);
-            closeOpened(pipes_file_descriptors[Read]);
-            closeOpened(pipes_file_descriptors[Write]);
-            closeOpened(previous_pipe_read_file_descriptor);
 
-            // Run built ins as child
-            if (const auto last_status = builtinRunInChild(current_command, OUTPUT_TYPE_STDOUT, ""); last_status >= 0) {
-                _exit(last_status);
+                // Run built ins as child
+                _exit(builtinRunInChild(current_command, OUTPUT_TYPE_STDOUT, ""));
             }
-
-            // execute
-            const std::vector<char *> arguments = generateArguments(current_command);
-            execute(arguments);
-            _exit(success);
+            pids.push_back(child_pid);
         }
 
         // in parent:
-        pids.push_back(child_pid);
-
         closeOpened(previous_pipe_read_file_descriptor);
+        if (is_last && isMemoryPath(current_file)) {
+            std::swap(bridge_file_descriptor, redirect_file_descriptors);
+        }
         closeOpened(redirect_file_descriptors);
 
         if (is_not_last) {
@@ -450,6 +1394,12 @@ int executePipelineNonBackgroundCommands(std::vector<command> &commands, const o
             last_status = result_wait;
         }
     }
+    if (last_shell_status != error_code) {
+        last_status = last_shell_status;
+    }
+    if (!outputFileClose(bridge_file_descriptor, current_file)) {
+        last_status = failure;
+    }
 
     return last_status;
 }
@@ -461,14 +1411,15 @@ Exit executeSinglePipeline(Pipeline &pipeline, const command_line *line, const b
         return exit_status;
     }
 
-    if (pipeline.commands.size() == 1 && pipeline.pipes_count == 0) {    // <- run only single command:
+    if (pipeline.count == 1 && pipeline.pipes_count == 0) {    // <- run only single command:
         const output_type current_type = apply_redirect ? line->out_type : OUTPUT_TYPE_STDOUT;
         const std::string &current_file = apply_redirect ? line->out_file : "";
-        exit_status = executeNonBackgroundCommand(pipeline.commands.at(0), current_type, current_file);
-    } else if (pipeline.commands.size() > 1 && pipeline.pipes_count > 0) {    // <- run pipe:
+        exit_status = executeNonBackgroundCommand(pipeline.commands[0], current_type, current_file);
+    } else if (pipeline.count > 1 && pipeline.pipes_count > 0) {    // <- run pipe:
         const output_type current_type = apply_redirect ? line->out_type : OUTPUT_TYPE_STDOUT;
         const std::string &current_file = apply_redirect ? line->out_file : "";
-        exit_status.last_status = executePipelineNonBackgroundCommands(pipeline.commands, current_type, current_file);
+        exit_status.last_status =
+                executePipelineNonBackgroundCommands(pipeline.commands, pipeline.count, current_type, current_file);
     }
     return exit_status;
 }
@@ -481,52 +1432,30 @@ Exit executeCommandLine(command_line *line, const Exit last_exit_status) {
         return exit_status;
     }
 
-    // filter commands
+    // split into pipelines, the commands of each are next to each other in the line
     std::vector<Pipeline> pipelines;
-    std::vector<expr_type> operations;
-    std::vector<command> commands;
-    std::size_t pipes_count = 0;
-    for (const auto &[type, command] : line->exprs) {
+    Pipeline current_pipeline {line->commands.data()};
+    for (const expr &current_expr : line->exprs) {
+        const expr_type type = current_expr.type;
         if (type == EXPR_TYPE_COMMAND) {
-            commands.push_back(command.value());
+            ++current_pipeline.count;
         } else if (type == EXPR_TYPE_PIPE) {
-            ++pipes_count;
-        } else if (type == EXPR_TYPE_AND) {
-            Pipeline new_pipeline {std::move(commands), pipes_count};
-            pipes_count = 0;
-            commands.clear();
-            if (new_pipeline.commands.size() != new_pipeline.pipes_count + 1) {
+            ++current_pipeline.pipes_count;
+        } else if (type == EXPR_TYPE_AND || type == EXPR_TYPE_OR) {
+            if (current_pipeline.count != current_pipeline.pipes_count + 1) {
                 return Exit {failure, false};
             }
-            pipelines.push_back(std::move(new_pipeline));
-            operations.push_back(EXPR_TYPE_AND);
-        } else if (type == EXPR_TYPE_OR) {
-            Pipeline new_pipeline {std::move(commands), pipes_count};
-            pipes_count = 0;
-            commands.clear();
-            if (new_pipeline.commands.size() != new_pipeline.pipes_count + 1) {
-                return Exit {failure, false};
-            }
-            pipelines.push_back(std::move(new_pipeline));
-            operations.push_back(EXPR_TYPE_OR);
+            pipelines.push_back(current_pipeline);
+            current_pipeline = Pipeline {current_pipeline.commands + current_pipeline.count, 0, 0, type};
         } else {
             return Exit {failure, false};
         }
     }
     // append last pipeline
-    if (!commands.empty()) {
-        Pipeline new_pipeline {std::move(commands), pipes_count};
-        pipes_count = 0;
-        commands.clear();
-        if (new_pipeline.commands.size() != new_pipeline.pipes_count + 1) {
-            return Exit {failure, false};
-        }
-        pipelines.push_back(std::move(new_pipeline));
-    }
-    // invariant check
-    if (pipelines.size() != operations.size() + 1) {
+    if (current_pipeline.count != current_pipeline.pipes_count + 1) {
         return Exit {failure, false};
     }
+    pipelines.push_back(current_pipeline);
 
     // main logic:
     for (std::size_t index = 0; index < pipelines.size(); ++index) {
@@ -537,13 +1466,9 @@ Exit executeCommandLine(command_line *line, const Exit last_exit_status) {
 
         const bool is_first_pipeline = index == 0;
         // && -> run only if status == 0 (run only if not first command)
-        const bool if_and_with_success =
-                is_first_pipeline ? false
-                                  : operations.at(index - 1) == EXPR_TYPE_AND && exit_status.last_status == success;
+        const bool if_and_with_success = pipeline.operation == EXPR_TYPE_AND && exit_status.last_status == success;
         // || -> run only if status != 0 (run only if not first command)
-        const bool if_or_without_success =
-                is_first_pipeline ? false
-                                  : operations.at(index - 1) == EXPR_TYPE_OR && exit_status.last_status != success;
+        const bool if_or_without_success = pipeline.operation == EXPR_TYPE_OR && exit_status.last_status != success;
         // Execution:
         if (is_first_pipeline || if_and_with_success || if_or_without_success) {
             exit_status = executeSinglePipeline(pipeline, line, is_last_pipeline, exit_status);
@@ -566,9 +1491,208 @@ void reapChildren() {
         if (current_pid <= 0) {
             break;
         }
+        jobFinished(current_pid);
+    }
+}
+
+bool jobStart(QueuedJob &job) {
+    const pid_t child_pid = fork();
+    if (child_pid <= error_code) {
+        std::cerr << "bash: fork: " << strerror(errno) << "\n";
+        return false;
+    }
+    if (child_pid > 0) {
+        jobs.running.insert(child_pid);
+        return true;
+    }
+    jobsClear();
+    // the signalfd is of the shell, the line needs nothing but the stdio
+    closeNotStandard();
+    const Exit exit_status = executeCommandLine(job.line.get(), job.last_exit_status);
+    _exit(exit_status.last_status);
+}
+
+void jobsStartQueued() {
+    while (!jobs.queue.empty() && jobs.running.size() < jobs.max_count) {
+        QueuedJob job = std::move(jobs.queue.front());
+        jobs.queue.pop_front();
+        jobStart(job);
+    }
+}
+
+// Returns false if it is not a job
+bool jobFinished(const pid_t child_pid) {
+    if (jobs.running.erase(child_pid) == 0) {
+        return false;
+    }
+    jobsStartQueued();
+    return true;
+}
+
+// Returns the status of the job, or error_code if there is no such running
+int jobWait(const pid_t child_pid) {
+    while (jobs.running.count(child_pid) != 0) {
+        int status = 0;
+        const pid_t wait_pid = waitpid(-1, &status, 0);
+        if (wait_pid == error_code && errno == EINTR) {
+            continue;
+        }
+        if (wait_pid == error_code) {
+            jobs.running.clear();
+            jobsStartQueued();
+            break;
+        }
+        jobFinished(wait_pid);
+        if (wait_pid == child_pid) {
+            return statusToBash(status);
+        }
+    }
+    return error_code;
+}
+
+// Returns false if it couldn't be started
+bool jobSubmit(std::unique_ptr<command_line> line, const Exit last_exit_status) {
+    QueuedJob job {std::move(line), last_exit_status};
+    if (jobs.running.size() < jobs.max_count && jobs.queue.empty()) {
+        return jobStart(job);
+    }
+    jobs.queue.push_back(std::move(job));
+    return true;
+}
+
+// Blocks until the queue is empty, or until all the jobs end for `wait`
+void jobsWait(const bool is_queue_only) {
+    while (!jobs.queue.empty() || (!is_queue_only && !jobs.running.empty())) {
+        int status = 0;
+        const pid_t wait_pid = waitpid(-1, &status, 0);
+        if (wait_pid == error_code && errno == EINTR) {
+            continue;
+        }
+        if (wait_pid == error_code) {
+            // lost somehow, give the place to the queued ones
+            jobs.running.clear();
+            jobsStartQueued();
+            continue;
+        }
+        jobFinished(wait_pid);
     }
 }
 
+// The limit is taken from MYBASH_MAX_JOBS, if it is set
+void jobsConfigure() {
+    const char *value = std::getenv("MYBASH_MAX_JOBS");
+    if (value == nullptr) {
+        return;
+    }
+    errno = success;
+    char *end = nullptr;
+    const long long max_count = std::strtoll(value, &end, 10);
+    if (errno != success || end == value || *end != '\0' || max_count <= 0) {
+        std::cerr << "bash: MYBASH_MAX_JOBS: " << value << ": invalid number\n";
+        return;
+    }
+    jobs.max_count = static_cast<std::size_t>(max_count);
+}
+
+// The memory files are on with MYBASH_MEMORY_PREFIX, like "/mem/"
+void memoryFilesConfigure() {
+    const char *value = std::getenv("MYBASH_MEMORY_PREFIX");
+    if (value != nullptr) {
+        memory_prefix = value;
+    }
+}
+
+// Detached commands are reaped when their SIGCHLD comes instead of polling
+// waitpid() around every read. Returns the descriptor to poll together with
+// the stdin, or error_code if the signals can't be read this way.
+int childSignalsOpen() {
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &child_mask, &spawn_signal_mask) == error_code) {
+        std::cerr << "bash: sigprocmask: " << strerror(errno) << "\n";
+        sigemptyset(&spawn_signal_mask);
+        return error_code;
+    }
+    const int signal_descriptor = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_descriptor == error_code) {
+        std::cerr << "bash: signalfd: " << strerror(errno) << "\n";
+        sigprocmask(SIG_SETMASK, &spawn_signal_mask, nullptr);
+    }
+    return signal_descriptor;
+}
+
+// The signals of several children can merge into one, so after draining
+// all the exited ones are collected
+void childSignalsReap(const int signal_descriptor) {
+    signalfd_siginfo info;
+    while (read(signal_descriptor, &info, sizeof(info)) > 0) {
+    }
+    reapChildren();
+}
+
+// A script file is parsed right from the page cache, without reading it in
+struct MappedInput {
+    void *map = nullptr;
+    std::size_t map_size = 0;
+    const char *data = nullptr;
+    std::size_t size = 0;
+};
+
+// Maps the stdin from its current position if it is a regular file. Empty
+// if it isn't, then it is read.
+MappedInput mapInput() {
+    MappedInput input;
+    struct stat input_stat {};
+    if (fstat(STDIN_FILENO, &input_stat) == error_code || !S_ISREG(input_stat.st_mode)) {
+        return input;
+    }
+    const off_t start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (start == error_code || start >= input_stat.st_size) {
+        return input;
+    }
+    const off_t page_size = sysconf(_SC_PAGESIZE);
+    const off_t map_start = start / page_size * page_size;
+    const std::size_t map_size = static_cast<std::size_t>(input_stat.st_size - map_start);
+    void *map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, map_start);
+    if (map == MAP_FAILED) {
+        return input;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    // the commands see the stdin at the end like after reading it all
+    lseek(STDIN_FILENO, input_stat.st_size, SEEK_SET);
+    input.map = map;
+    input.map_size = map_size;
+    input.data = static_cast<const char *>(map) + (start - map_start);
+    input.size = static_cast<std::size_t>(input_stat.st_size - start);
+    return input;
+}
+
+void unmapInput(MappedInput &input) {
+    if (input.map != nullptr) {
+        munmap(input.map, input.map_size);
+        input = MappedInput {};
+    }
+}
+
+// The pipe reads grow while they fill the whole chunk, and to what is already
+// in the pipe, so a long script takes few big reads
+constexpr std::size_t min_chunk_size = 16 * 1024;
+constexpr std::size_t max_chunk_size = 1024 * 1024;
+
+std::size_t readChunkSize(const std::size_t chunk_size) {
+    int available = 0;
+    if (ioctl(STDIN_FILENO, FIONREAD, &available) == error_code ||
+        static_cast<std::size_t>(available) <= chunk_size) {
+        return chunk_size;
+    }
+    std::size_t result = chunk_size;
+    while (result < static_cast<std::size_t>(available) && result < max_chunk_size) {
+        result *= 2;
+    }
+    return result;
+}
+
 Exit createAndExecuteCommand(parser *parser_object, const Exit current_last_exit_status) {
     Exit last_exit_status = current_last_exit_status;
 
@@ -583,25 +1707,20 @@ Exit createAndExecuteCommand(parser *parser_object, const Exit current_last_exit
         if (parser_error_code != PARSER_ERR_NONE) {
             continue;
         }
-        // wait for detached commands
-        reapChildren();
+        // the signal is read only between the chunks, collect them earlier
+        // if the chunk runs long
+        if (!jobs.running.empty()) {
+            reapChildren();
+        }
 
-        // if line is background process we fork
+        // if line is background process it is a job
         if (current_line_raw->is_background) {
-            // fork process:
-            const pid_t child_pid = fork();
-            if (child_pid <= error_code) {
-                std::cerr << "bash: fork: " << strerror(errno) << "\n";
+            if (!jobSubmit(std::move(current_line_owner), last_exit_status)) {
                 return Exit {failure, false};
             }
-            // parent: move to next command
-            if (child_pid > 0) {
-                last_exit_status.last_status = success;
-                continue;
-            }
-            // (child_pid == 0)
-            last_exit_status = executeCommandLine(current_line_raw, last_exit_status);
-            _exit(last_exit_status.last_status);
+            // move to next command
+            last_exit_status.last_status = success;
+            continue;
         }
 
         // if line is not background -> just execute
@@ -614,14 +1733,48 @@ Exit createAndExecuteCommand(parser *parser_object, const Exit current_last_exit
 int main() {
     parser *parser_object = parser_new();
     utils::Exit exit_status = {utils::success, false};
+    utils::jobsConfigure();
+    utils::memoryFilesConfigure();
 
-    constexpr std::size_t chunk_size = 16 * 1024;
-    char chunk_buffer[chunk_size];
+    std::size_t chunk_size = utils::min_chunk_size;
+    std::unique_ptr<char[]> chunk_buffer;
 
-    while (!exit_status.terminate_shell) {
-        utils::reapChildren();    // wait for detached commands
+    int signal_descriptor = utils::childSignalsOpen();
+    pollfd descriptors[2] = {{STDIN_FILENO, POLLIN, 0}, {signal_descriptor, POLLIN, 0}};
+    const nfds_t descriptors_count = signal_descriptor == utils::error_code ? 1 : 2;
 
-        const ssize_t bytes_to_read = read(STDIN_FILENO, chunk_buffer, chunk_size);
+    utils::MappedInput mapped_input = utils::mapInput();
+    if (mapped_input.data != nullptr) {
+        parser_feed_external(parser_object, mapped_input.data, mapped_input.size);
+        exit_status = utils::createAndExecuteCommand(parser_object, exit_status);
+    }
+
+    while (mapped_input.data == nullptr && !exit_status.terminate_shell) {
+        if (descriptors_count == 1) {
+            utils::reapChildren();    // wait for detached commands
+        } else {
+            if (poll(descriptors, descriptors_count, -1) == utils::error_code) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "bash: poll: " << strerror(errno) << "\n";
+                exit_status = {utils::failure, false};
+                break;
+            }
+            if (descriptors[1].revents != 0) {
+                utils::childSignalsReap(signal_descriptor);
+            }
+            if (descriptors[0].revents == 0) {
+                continue;
+            }
+        }
+
+        if (const std::size_t new_size = utils::readChunkSize(chunk_size);
+            chunk_buffer == nullptr || new_size != chunk_size) {
+            chunk_size = new_size;
+            chunk_buffer.reset(new char[chunk_size]);
+        }
+        const ssize_t bytes_to_read = read(STDIN_FILENO, chunk_buffer.get(), chunk_size);
         if (bytes_to_read == 0) {
             // EOF:
             utils::reapChildren();    // wait for detached commands
@@ -639,14 +1792,25 @@ int main() {
         }
 
         // Command parse
-        parser_feed(parser_object, chunk_buffer, static_cast<uint32_t>(bytes_to_read));
+        parser_feed(parser_object, chunk_buffer.get(), static_cast<uint32_t>(bytes_to_read));
         exit_status = utils::createAndExecuteCommand(parser_object, exit_status);
-        utils::reapChildren();    // wait for detached commands
+        if (static_cast<std::size_t>(bytes_to_read) == chunk_size && chunk_size < utils::max_chunk_size) {
+            chunk_size *= 2;
+            chunk_buffer.reset(new char[chunk_size]);
+        }
     }
 
     // optional final drain
     exit_status = utils::createAndExecuteCommand(parser_object, exit_status);
 
+    // the queued jobs are started, but not waited for like the running ones
+    utils::jobsWait(true);
+
+    utils::closeOpened(signal_descriptor);
     parser_delete(parser_object);
+    utils::unmapInput(mapped_input);
+    utils::pathCacheClear();
+    utils::jobsClear();
+    utils::memoryFilesClear();
     return exit_status.last_status;
 }
@@ -0,0 +1,387 @@
+#include "userfs.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#if BENCH_ALLOC_COUNT
+#include "heap_help.h"
+#endif
+
+enum {
+#if BENCH_ALLOC_COUNT
+	/* Heap help makes each allocation slow, the runs are shorter. */
+	BENCH_RUN_COUNT = 1,
+	BENCH_FILE_SIZE = 4 * 1024 * 1024,
+	BENCH_MAX_OP_COUNT = 64 * 1024,
+#else
+	BENCH_RUN_COUNT = 5,
+	BENCH_FILE_SIZE = 64 * 1024 * 1024,
+	BENCH_MAX_OP_COUNT = 1024 * 1024,
+#endif
+	BENCH_MAX_IO_SIZE = 1024 * 1024,
+	BENCH_RESIZE_STEP = 64 * 1024,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Total allocations so far. Only counted with heap help. */
+static uint64_t
+bench_alloc_count(void)
+{
+#if BENCH_ALLOC_COUNT
+	return heaph_get_total_alloc_count();
+#else
+	return 0;
+#endif
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("%s failed: %d\n", what, (int)ufs_errno());
+	exit(-1);
+}
+
+struct bench_result {
+	double mb_per_sec;
+	double ops_per_sec;
+	double allocs_per_op;
+};
+
+/** What a case measured, the setup is excluded. */
+struct bench_probe {
+	uint64_t start_ns;
+	uint64_t start_allocs;
+};
+
+static struct bench_probe
+bench_probe_start(void)
+{
+	struct bench_probe res;
+	res.start_allocs = bench_alloc_count();
+	res.start_ns = bench_now_ns();
+	return res;
+}
+
+static struct bench_result
+bench_probe_finish(const struct bench_probe *probe, uint64_t op_count,
+	uint64_t byte_count)
+{
+	uint64_t duration = bench_now_ns() - probe->start_ns;
+	uint64_t allocs = bench_alloc_count() - probe->start_allocs;
+	struct bench_result res;
+	res.mb_per_sec = byte_count * 1000.0 / duration;
+	res.ops_per_sec = op_count * 1000000000.0 / duration;
+	res.allocs_per_op = (double)allocs / op_count;
+	return res;
+}
+
+/** A case with its parameters, run on an empty filesystem. */
+typedef struct bench_result (*bench_f)(size_t param);
+
+static void
+bench_run(const char *name, bench_f func, size_t param, bool has_bytes)
+{
+	std::vector<struct bench_result> results;
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+		results.push_back(func(param));
+		ufs_destroy();
+	}
+	std::sort(results.begin(), results.end(),
+		[](const struct bench_result &a, const struct bench_result &b) {
+			return a.ops_per_sec < b.ops_per_sec;
+		});
+	const struct bench_result &med = results[results.size() / 2];
+	printf("%s\n", name);
+	if (has_bytes) {
+		printf("    min: %.2lf MB/s\n", results.front().mb_per_sec);
+		printf("    med: %.2lf MB/s\n", med.mb_per_sec);
+		printf("    max: %.2lf MB/s\n", results.back().mb_per_sec);
+	}
+	printf("    med: %.0lf ops/s\n", med.ops_per_sec);
+#if BENCH_ALLOC_COUNT
+	printf("    allocations: %.2lf per op\n", med.allocs_per_op);
+#endif
+}
+
+/** The whole file or as much as the ops limit lets. */
+static size_t
+bench_io_total(size_t io_size)
+{
+	return std::min<size_t>(BENCH_FILE_SIZE,
+		(size_t)BENCH_MAX_OP_COUNT * io_size);
+}
+
+/**
+ * Data for all the I/O. Not a global, heap help is not ready for the
+ * allocations at the static initialization.
+ */
+static char *
+bench_buffer(void)
+{
+	static std::vector<char> buffer(BENCH_MAX_IO_SIZE, 'x');
+	return buffer.data();
+}
+
+static int
+bench_open_filled(size_t size)
+{
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_check(fd != -1, "open");
+	for (size_t pos = 0; pos < size; pos += BENCH_MAX_IO_SIZE) {
+		size_t chunk = std::min<size_t>(BENCH_MAX_IO_SIZE, size - pos);
+		bench_check(ufs_write(fd, bench_buffer(), chunk) ==
+			(ssize_t)chunk, "write");
+	}
+	return fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct bench_result
+bench_seq_write_f(size_t io_size)
+{
+	size_t total = bench_io_total(io_size);
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_check(fd != -1, "open");
+	struct bench_probe probe = bench_probe_start();
+	for (size_t pos = 0; pos < total; pos += io_size) {
+		bench_check(ufs_write(fd, bench_buffer(), io_size) ==
+			(ssize_t)io_size, "write");
+	}
+	struct bench_result res = bench_probe_finish(&probe, total / io_size,
+		total);
+	ufs_close(fd);
+	return res;
+}
+
+/** The same data in all the blocks, they all are shared. */
+static struct bench_result
+bench_seq_write_dedup_f(size_t io_size)
+{
+	bench_check(ufs_set_dedup(true) == 0, "dedup");
+	return bench_seq_write_f(io_size);
+}
+
+static struct bench_result
+bench_seq_read_f(size_t io_size)
+{
+	size_t total = bench_io_total(io_size);
+	bench_check(ufs_close(bench_open_filled(total)) == 0, "close");
+	int fd = ufs_open("file", 0);
+	bench_check(fd != -1, "open");
+	struct bench_probe probe = bench_probe_start();
+	for (size_t pos = 0; pos < total; pos += io_size) {
+		bench_check(ufs_read(fd, bench_buffer(), io_size) ==
+			(ssize_t)io_size, "read");
+	}
+	struct bench_result res = bench_probe_finish(&probe, total / io_size,
+		total);
+	ufs_close(fd);
+	return res;
+}
+
+/**
+ * Offsets aligned to the I/O size at random over the whole file.
+ * The seed is fixed so the runs are comparable.
+ */
+static std::vector<size_t>
+bench_random_offsets(size_t io_size)
+{
+	size_t slot_count = BENCH_FILE_SIZE / io_size;
+	size_t count = bench_io_total(io_size) / io_size;
+	std::vector<size_t> res(count);
+	uint64_t state = 42;
+	for (size_t i = 0; i < count; ++i) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		res[i] = (state >> 16) % slot_count * io_size;
+	}
+	return res;
+}
+
+static struct bench_result
+bench_random_write_f(size_t io_size)
+{
+	std::vector<size_t> offsets = bench_random_offsets(io_size);
+	int fd = bench_open_filled(BENCH_FILE_SIZE);
+	struct bench_probe probe = bench_probe_start();
+	for (size_t offset : offsets) {
+		bench_check(ufs_pwrite(fd, bench_buffer(), io_size,
+			offset) == (ssize_t)io_size, "pwrite");
+	}
+	struct bench_result res = bench_probe_finish(&probe, offsets.size(),
+		offsets.size() * io_size);
+	ufs_close(fd);
+	return res;
+}
+
+static struct bench_result
+bench_random_read_f(size_t io_size)
+{
+	std::vector<size_t> offsets = bench_random_offsets(io_size);
+	int fd = bench_open_filled(BENCH_FILE_SIZE);
+	struct bench_probe probe = bench_probe_start();
+	for (size_t offset : offsets) {
+		bench_check(ufs_pread(fd, bench_buffer(), io_size,
+			offset) == (ssize_t)io_size, "pread");
+	}
+	struct bench_result res = bench_probe_finish(&probe, offsets.size(),
+		offsets.size() * io_size);
+	ufs_close(fd);
+	return res;
+}
+
+static void
+bench_io(void)
+{
+	const size_t io_sizes[] = {1, 16, 256, 4096, 64 * 1024, 1024 * 1024};
+	struct {
+		const char *name;
+		bench_f func;
+	} cases[] = {
+		{"Sequential write", bench_seq_write_f},
+		{"Sequential write with dedup", bench_seq_write_dedup_f},
+		{"Sequential read", bench_seq_read_f},
+		{"Random pwrite", bench_random_write_f},
+		{"Random pread", bench_random_read_f},
+	};
+	for (const auto &c : cases) {
+		for (size_t io_size : io_sizes) {
+			char name[128];
+			snprintf(name, sizeof(name), "%s, %zu byte I/O", c.name,
+				io_size);
+			bench_run(name, c.func, io_size, true);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<std::string>
+bench_file_names(size_t count)
+{
+	std::vector<std::string> res(count);
+	for (size_t i = 0; i < count; ++i)
+		res[i] = "file_" + std::to_string(i);
+	return res;
+}
+
+/** Open and close the existing files in a random order. */
+static struct bench_result
+bench_open_close_f(size_t file_count)
+{
+	std::vector<std::string> names = bench_file_names(file_count);
+	for (const std::string &name : names)
+		bench_check(ufs_close(ufs_open(name.c_str(), UFS_CREATE)) == 0,
+			"create");
+	uint64_t state = 42;
+	size_t op_count = BENCH_MAX_OP_COUNT;
+	struct bench_probe probe = bench_probe_start();
+	for (size_t i = 0; i < op_count; ++i) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		int fd = ufs_open(names[(state >> 16) % file_count].c_str(), 0);
+		bench_check(fd != -1, "open");
+		bench_check(ufs_close(fd) == 0, "close");
+	}
+	return bench_probe_finish(&probe, op_count, 0);
+}
+
+/** Create all the files, then delete them all. */
+static struct bench_result
+bench_create_delete_f(size_t file_count)
+{
+	std::vector<std::string> names = bench_file_names(file_count);
+	struct bench_probe probe = bench_probe_start();
+	for (const std::string &name : names) {
+		int fd = ufs_open(name.c_str(), UFS_CREATE);
+		bench_check(fd != -1, "create");
+		bench_check(ufs_close(fd) == 0, "close");
+	}
+	for (const std::string &name : names)
+		bench_check(ufs_delete(name.c_str()) == 0, "delete");
+	return bench_probe_finish(&probe, 2 * file_count, 0);
+}
+
+static void
+bench_files(void)
+{
+	const size_t file_counts[] = {1000, 100 * 1000};
+	for (size_t file_count : file_counts) {
+		char name[128];
+		snprintf(name, sizeof(name), "Open + close, %zu files, per "
+			"pair", file_count);
+		bench_run(name, bench_open_close_f, file_count, false);
+		snprintf(name, sizeof(name), "Create + delete, %zu files, per "
+			"call", file_count);
+		bench_run(name, bench_create_delete_f, file_count, false);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** Grow a file with holes and shrink it back. */
+static struct bench_result
+bench_resize_holes_f(size_t size)
+{
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_check(fd != -1, "open");
+	size_t op_count = BENCH_MAX_OP_COUNT / 16;
+	struct bench_probe probe = bench_probe_start();
+	for (size_t i = 0; i < op_count; i += 2) {
+		bench_check(ufs_resize(fd, size) == 0, "resize");
+		bench_check(ufs_resize(fd, 0) == 0, "resize");
+	}
+	struct bench_result res = bench_probe_finish(&probe, op_count, 0);
+	ufs_close(fd);
+	return res;
+}
+
+/** Shrink a written file step by step, so each resize frees blocks. */
+static struct bench_result
+bench_resize_shrink_f(size_t step)
+{
+	int fd = bench_open_filled(BENCH_FILE_SIZE);
+	size_t op_count = BENCH_FILE_SIZE / step;
+	struct bench_probe probe = bench_probe_start();
+	for (size_t size = BENCH_FILE_SIZE; size > 0; size -= step)
+		bench_check(ufs_resize(fd, size - step) == 0, "resize");
+	struct bench_result res = bench_probe_finish(&probe, op_count,
+		BENCH_FILE_SIZE);
+	ufs_close(fd);
+	return res;
+}
+
+static void
+bench_resize(void)
+{
+	bench_run("Resize a file of holes to 1 MiB and back, per resize",
+		bench_resize_holes_f, 1024 * 1024, false);
+	char name[128];
+	snprintf(name, sizeof(name), "Shrink a written file by %d bytes, per "
+		"resize", BENCH_RESIZE_STEP);
+	bench_run(name, bench_resize_shrink_f, BENCH_RESIZE_STEP, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	bench_io();
+	bench_files();
+	bench_resize();
+	return 0;
+}
@@ -1,7 +1,12 @@
 #include "userfs.h"
+#include "thread_pool.h"
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -469,6 +474,883 @@ test_resize(void)
 #endif
 }
 
+static void
+test_block_size(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_set_block_size(UFS_MIN_BLOCK_SIZE - 1) == -1,
+		"too small block size");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is 'invalid_arg'");
+	unit_check(ufs_set_block_size(UFS_MAX_BLOCK_SIZE + 1) == -1,
+		"too big block size");
+
+	const char *names[] = {"small_blocks", "big_blocks"};
+	const size_t sizes[] = {UFS_MIN_BLOCK_SIZE, UFS_MAX_BLOCK_SIZE};
+	const size_t data_size = 3 * UFS_MIN_BLOCK_SIZE + 100;
+	char *data = (char *)malloc(data_size);
+	char *buffer = (char *)malloc(data_size);
+	for (size_t i = 0; i < data_size; ++i)
+		data[i] = 'a' + i % ('z' - 'a' + 1);
+	int fds[2];
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(ufs_set_block_size(sizes[i]) != 0);
+		fds[i] = ufs_open(names[i], UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_msg("the files keep the block size they were created with");
+	for (int i = 0; i < 2; ++i) {
+		size_t progress = 0;
+		while (progress < data_size) {
+			size_t to_write = progress % 1234 + 1;
+			if (to_write > data_size - progress)
+				to_write = data_size - progress;
+			ssize_t rc = ufs_write(fds[i], data + progress, to_write);
+			if (rc != (ssize_t)to_write)
+				break;
+			progress += rc;
+		}
+		unit_check(progress == data_size, "write the data in parts");
+		int fd = ufs_open(names[i], 0);
+		unit_fail_if(fd == -1);
+		unit_check(ufs_read(fd, buffer, data_size) == (ssize_t)data_size,
+			"read the data at once");
+		unit_check(memcmp(data, buffer, data_size) == 0, "data is correct");
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+#if NEED_RESIZE
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(ufs_resize(fds[i], UFS_MIN_BLOCK_SIZE + 10) != 0);
+		unit_fail_if(ufs_resize(fds[i], data_size) != 0);
+		int fd = ufs_open(names[i], 0);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_read(fd, buffer, data_size) != (ssize_t)data_size);
+		bool ok = memcmp(data, buffer, UFS_MIN_BLOCK_SIZE + 10) == 0;
+		for (size_t j = UFS_MIN_BLOCK_SIZE + 10; j < data_size && ok; ++j)
+			ok = buffer[j] == 0;
+		unit_check(ok, "shrink and expand fill the tail with zeros");
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+#endif
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(ufs_close(fds[i]) != 0);
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	}
+	unit_fail_if(ufs_set_block_size(UFS_MIN_BLOCK_SIZE) != 0);
+	free(data);
+	free(buffer);
+
+	unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+#if NEED_RESIZE
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "head", 4) != 4);
+	const size_t size = 100 * 1024 * 1024;
+	unit_check(ufs_resize(fd, size) == 0, "resize to the max size");
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char buffer[2048];
+	unit_fail_if(ufs_read(fd2, buffer, 4) != 4);
+	unit_check(memcmp(buffer, "head", 4) == 0, "the data is kept");
+	bool ok = true;
+	size_t total = 4;
+	ssize_t rc;
+	while (ok) {
+		rc = ufs_read(fd2, buffer, sizeof(buffer));
+		if (rc <= 0)
+			break;
+		for (ssize_t i = 0; i < rc && ok; ++i)
+			ok = buffer[i] == 0;
+		total += rc;
+	}
+	unit_check(ok && total == size, "the rest reads as zeros");
+
+	unit_fail_if(ufs_resize(fd, size / 2) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	/* Move the first descriptor to the end by reading. */
+	while (ufs_read(fd, buffer, sizeof(buffer)) > 0) {
+	}
+	unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+	unit_fail_if(ufs_resize(fd2, size / 2 + 2) != 0);
+	unit_fail_if(ufs_resize(fd2, size / 2 + 4) != 0);
+	total = 0;
+	ssize_t last = 0;
+	while ((rc = ufs_read(fd2, buffer, sizeof(buffer))) > 0) {
+		total += rc;
+		last = rc;
+	}
+	unit_check(total == size / 2 + 4, "write at the end of a hole");
+	unit_check(last == 4 && memcmp(buffer, "ta\0\0", 4) == 0,
+		"the truncated tail reads as zeros");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+#endif
+	unit_test_finish();
+}
+
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "world", 5, 6) == 5, "pwrite at an offset");
+	unit_check(ufs_pwrite(fd, "hello ", 6, 0) == 6, "pwrite before it");
+	char buffer[16];
+	unit_check(ufs_read(fd, buffer, sizeof(buffer)) == 11, "the cursor is "
+		"not moved by pwrite");
+	unit_check(memcmp(buffer, "hello world", 11) == 0, "data is correct");
+	unit_check(ufs_pread(fd, buffer, 3, 4) == 3 &&
+		memcmp(buffer, "o w", 3) == 0, "pread at an offset");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), 11) == 0,
+		"pread at the end");
+	unit_check(ufs_pwrite(fd, "x", 1, 20) == 1, "pwrite beyond the end");
+	unit_fail_if(ufs_pread(fd, buffer, sizeof(buffer), 10) != 11);
+	unit_check(memcmp(buffer, "d\0\0\0\0\0\0\0\0\0x", 11) == 0,
+		"the gap is zeros");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char part1[] = "abc", part2[] = "", part3[] = "defgh";
+	struct iovec vector[3] = {
+		{part1, 3}, {part2, 0}, {part3, 5},
+	};
+	unit_check(ufs_writev(fd, vector, 3) == 8, "writev");
+	unit_check(ufs_writev(fd, vector, -1) == -1 &&
+		ufs_errno() == UFS_ERR_INVALID_ARG, "writev with a bad count");
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char out1[2], out2[10];
+	struct iovec out_vector[2] = {
+		{out1, sizeof(out1)}, {out2, sizeof(out2)},
+	};
+	unit_check(ufs_readv(fd2, out_vector, 2) == 8, "readv stops at the end");
+	unit_check(memcmp(out1, "ab", 2) == 0 &&
+		memcmp(out2, "cdefgh", 6) == 0, "data is correct");
+	unit_check(ufs_readv(fd2, out_vector, 2) == 0, "readv at the end");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+struct map_ctx {
+	char data[64];
+	size_t size;
+	int piece_count;
+	int stop_after;
+};
+
+static int
+map_f(const char *data, size_t size, void *arg)
+{
+	struct map_ctx *ctx = (struct map_ctx *)arg;
+	if (ctx->size + size <= sizeof(ctx->data))
+		memcpy(ctx->data + ctx->size, data, size);
+	ctx->size += size;
+	return ++ctx->piece_count == ctx->stop_after;
+}
+
+static void
+test_map_range(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "head", 4, 0) != 4);
+	unit_fail_if(ufs_pwrite(fd, "tail", 4, 2 * UFS_MIN_BLOCK_SIZE + 1) != 4);
+
+	struct map_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	unit_check(ufs_map_range(fd, 1, 5, map_f, &ctx) == 5, "map a range");
+	unit_check(ctx.piece_count == 1 && memcmp(ctx.data, "ead\0\0", 5) == 0,
+		"one piece inside a block");
+
+	memset(&ctx, 0, sizeof(ctx));
+	ssize_t rc = ufs_map_range(fd, 0, SIZE_MAX, map_f, &ctx);
+	unit_check(rc == 2 * UFS_MIN_BLOCK_SIZE + 5, "map till the end");
+	unit_check(ctx.piece_count == 3, "a piece per block, holes included");
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.stop_after = 2;
+	rc = ufs_map_range(fd, UFS_MIN_BLOCK_SIZE - 2, SIZE_MAX, map_f, &ctx);
+	unit_check(rc == UFS_MIN_BLOCK_SIZE + 2 && ctx.piece_count == 2,
+		"the callback stops the mapping");
+	unit_check(ufs_map_range(fd, 3 * UFS_MIN_BLOCK_SIZE, 1, map_f, &ctx) == 0,
+		"map at the end");
+
+	char buffer[4];
+	unit_check(ufs_read(fd, buffer, 4) == 4 && memcmp(buffer, "head", 4) == 0,
+		"the cursor is not moved");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_ITERATIONS = 200,
+};
+
+struct thread_ctx {
+	int shared_fd;
+	int index;
+	bool ok;
+};
+
+static void *
+thread_f(void *arg)
+{
+	struct thread_ctx *ctx = (struct thread_ctx *)arg;
+	char name[16], data[64], buffer[64];
+	snprintf(name, sizeof(name), "thread%d", ctx->index);
+	memset(data, 'a' + ctx->index, sizeof(data));
+	ctx->ok = true;
+	for (int i = 0; i < THREAD_ITERATIONS && ctx->ok; ++i) {
+		/* An own file, created and deleted each time. */
+		int fd = ufs_open(name, UFS_CREATE);
+		ctx->ok = fd != -1 &&
+			ufs_write(fd, data, sizeof(data)) == sizeof(data) &&
+			ufs_pread(fd, buffer, sizeof(buffer), 0) == sizeof(buffer) &&
+			memcmp(data, buffer, sizeof(data)) == 0 &&
+			ufs_close(fd) == 0 && ufs_delete(name) == 0;
+		/* A file shared by everyone, read in parallel. */
+		ctx->ok = ctx->ok &&
+			ufs_pread(ctx->shared_fd, buffer, 8, 8 * i) == 8 &&
+			memcmp(buffer, "01234567", 8) == 0;
+		/* And an error which is not seen by the others. */
+		ctx->ok = ctx->ok && ufs_open("no_such_file", 0) == -1 &&
+			ufs_errno() == UFS_ERR_NO_FILE;
+	}
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < THREAD_ITERATIONS; ++i)
+		unit_fail_if(ufs_write(fd, "01234567", 8) != 8);
+
+	pthread_t threads[THREAD_COUNT];
+	struct thread_ctx ctxs[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		ctxs[i].shared_fd = fd;
+		ctxs[i].index = i;
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_f,
+			&ctxs[i]) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+		ok = ok && ctxs[i].ok;
+	}
+	unit_check(ok, "files are used from many threads");
+	unit_check(ufs_errno() == UFS_ERR_NO_ERR, "the error code is per thread");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_descriptor_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 200;
+	int fds[count];
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	for (int i = count - 1; i >= 0; i -= 3)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	bool ok = true;
+	for (int i = count - 1 - (count - 1) / 3 * 3; i < count && ok; i += 3)
+		ok = ufs_open("file", 0) == fds[i];
+	unit_check(ok, "the lowest closed descriptors are reused first");
+	int next = ufs_open("file", 0);
+	unit_check(next > fds[count - 1], "then the table grows");
+	unit_fail_if(ufs_close(next) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	int fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "tail", 4, 3 * UFS_MIN_BLOCK_SIZE) != 4);
+	unit_fail_if(ufs_pwrite(fd, "head", 4, 0) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_set_block_size(UFS_MAX_BLOCK_SIZE) != 0);
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	/* An opened deleted file is not saved. */
+	int ghost_fd = ufs_open("ghost", UFS_CREATE);
+	unit_fail_if(ghost_fd == -1);
+	unit_fail_if(ufs_delete("ghost") != 0);
+	unit_check(ufs_image_save(path) == 0, "save an image");
+	unit_check(ufs_image_load(path) == -1 &&
+		ufs_errno() == UFS_ERR_INVALID_ARG, "load only when empty");
+	ufs_destroy();
+
+	unit_check(ufs_image_load("no_such_image.ufs") == -1 &&
+		ufs_errno() == UFS_ERR_IO, "load a missing image");
+	unit_check(ufs_image_load(path) == 0, "load the image");
+	char buffer[16];
+	fd = ufs_open("small", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buffer, 4, 0) == 4 &&
+		memcmp(buffer, "head", 4) == 0, "the first block is loaded");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer),
+		3 * UFS_MIN_BLOCK_SIZE - 2) == 6 &&
+		memcmp(buffer, "\0\0tail", 6) == 0, "the holes are loaded");
+	unit_fail_if(ufs_pwrite(fd, "HEAD", 4, 0) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("ghost", 0) == -1, "the deleted file is not saved");
+	fd = ufs_open("big", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, buffer, sizeof(buffer)) == 4 &&
+		memcmp(buffer, "data", 4) == 0, "the big block file is loaded");
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_write(fd, "new", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "other", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_image_save(path) == 0, "save over the loaded image");
+	ufs_destroy();
+
+	unit_fail_if(ufs_image_load(path) != 0);
+	fd = ufs_open("small", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, buffer, sizeof(buffer)) == 5 &&
+		memcmp(buffer, "other", 5) == 0, "the changes are saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("big", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, buffer, sizeof(buffer)) == 3 &&
+		memcmp(buffer, "new", 3) == 0, "the block size is saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	FILE *image = fopen(path, "r+");
+	unit_fail_if(image == NULL);
+	unit_fail_if(fputs("garbage", image) < 0);
+	unit_fail_if(fclose(image) != 0);
+	unit_check(ufs_image_load(path) == -1 && ufs_errno() == UFS_ERR_IO,
+		"a malformed image is not loaded");
+	unit_fail_if(remove(path) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("source", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	const size_t size = 3 * UFS_MIN_BLOCK_SIZE + 10;
+	char *data = (char *)malloc(size);
+	char *buffer = (char *)malloc(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 'a' + i % ('z' - 'a' + 1);
+	unit_fail_if(ufs_write(fd, data, size) != (ssize_t)size);
+	unit_check(ufs_clone("no_such_file", "clone") == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "clone a missing file");
+	unit_check(ufs_clone("source", "source") == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "clone into an existing file");
+	unit_check(ufs_clone("source", "clone") == 0, "clone");
+
+	int clone_fd = ufs_open("clone", 0);
+	unit_fail_if(clone_fd == -1);
+	unit_check(ufs_read(clone_fd, buffer, size) == (ssize_t)size &&
+		memcmp(buffer, data, size) == 0, "the clone has the same data");
+	unit_fail_if(ufs_pwrite(clone_fd, "CLONE", 5, 1) != 5);
+	unit_fail_if(ufs_pwrite(fd, "SOURCE", 6, UFS_MIN_BLOCK_SIZE) != 6);
+	unit_fail_if(ufs_pread(fd, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer, data, UFS_MIN_BLOCK_SIZE) == 0 &&
+		memcmp(buffer + UFS_MIN_BLOCK_SIZE, "SOURCE", 6) == 0,
+		"the clone writes do not touch the source");
+	unit_fail_if(ufs_pread(clone_fd, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer + 1, "CLONE", 5) == 0 &&
+		memcmp(buffer + UFS_MIN_BLOCK_SIZE, data + UFS_MIN_BLOCK_SIZE,
+		size - UFS_MIN_BLOCK_SIZE) == 0,
+		"the source writes do not touch the clone");
+#if NEED_RESIZE
+	unit_fail_if(ufs_resize(fd, 2 * UFS_MIN_BLOCK_SIZE + 1) != 0);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+	unit_fail_if(ufs_pread(clone_fd, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer + 2 * UFS_MIN_BLOCK_SIZE,
+		data + 2 * UFS_MIN_BLOCK_SIZE, size - 2 * UFS_MIN_BLOCK_SIZE) == 0,
+		"the source truncation does not touch the clone");
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("source") != 0);
+	unit_fail_if(ufs_pread(clone_fd, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer + UFS_MIN_BLOCK_SIZE, data + UFS_MIN_BLOCK_SIZE,
+		size - UFS_MIN_BLOCK_SIZE) == 0, "the clone outlives the source");
+	unit_fail_if(ufs_close(clone_fd) != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+	free(data);
+	free(buffer);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	const size_t size = 4 * UFS_MIN_BLOCK_SIZE + 10;
+	char *data = (char *)malloc(size);
+	char *buffer = (char *)malloc(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 'a' + i % ('z' - 'a' + 1);
+	struct ufs_fs_stat stat;
+	unit_fail_if(ufs_fs_stats(&stat) != 0);
+	size_t base_memory = stat.used_memory;
+
+	unit_fail_if(ufs_set_dedup(true) != 0);
+	int fd1 = ufs_open("copy1", UFS_CREATE);
+	int fd2 = ufs_open("copy2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, data, size) != (ssize_t)size);
+	/* Byte by byte, a block is shared only when written to its end. */
+	for (size_t i = 0; i < size; ++i)
+		unit_fail_if(ufs_write(fd2, data + i, 1) != 1);
+	unit_fail_if(ufs_fs_stats(&stat) != 0);
+	unit_check(stat.used_memory - base_memory ==
+		5 * UFS_MIN_BLOCK_SIZE + UFS_MIN_BLOCK_SIZE,
+		"the copies share the full blocks");
+	unit_fail_if(ufs_pread(fd2, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer, data, size) == 0, "the copy has the data");
+
+	unit_fail_if(ufs_pwrite(fd2, "COPY", 4, UFS_MIN_BLOCK_SIZE) != 4);
+	unit_fail_if(ufs_pread(fd1, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer, data, size) == 0,
+		"a write into a shared block doesn't touch the other file");
+	unit_fail_if(ufs_pread(fd2, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer + UFS_MIN_BLOCK_SIZE, "COPY", 4) == 0 &&
+		memcmp(buffer + UFS_MIN_BLOCK_SIZE + 4,
+		data + UFS_MIN_BLOCK_SIZE + 4, size - UFS_MIN_BLOCK_SIZE - 4) == 0,
+		"and changes the file");
+
+	unit_fail_if(ufs_pwrite(fd1, data, UFS_MIN_BLOCK_SIZE,
+		UFS_MIN_BLOCK_SIZE) != UFS_MIN_BLOCK_SIZE);
+	unit_fail_if(ufs_pwrite(fd2, data + UFS_MIN_BLOCK_SIZE,
+		UFS_MIN_BLOCK_SIZE, UFS_MIN_BLOCK_SIZE) != UFS_MIN_BLOCK_SIZE);
+	unit_fail_if(ufs_pread(fd1, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer + UFS_MIN_BLOCK_SIZE, data,
+		UFS_MIN_BLOCK_SIZE) == 0, "an indexed block is written in place");
+	unit_fail_if(ufs_pread(fd2, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer, data, size) == 0,
+		"and is not shared with its old data");
+	unit_fail_if(ufs_pwrite(fd1, data + UFS_MIN_BLOCK_SIZE,
+		UFS_MIN_BLOCK_SIZE, UFS_MIN_BLOCK_SIZE) != UFS_MIN_BLOCK_SIZE);
+	unit_fail_if(ufs_fs_stats(&stat) != 0);
+	unit_check(stat.used_memory - base_memory ==
+		5 * UFS_MIN_BLOCK_SIZE + UFS_MIN_BLOCK_SIZE,
+		"the same data is shared again");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("copy1") != 0);
+	unit_fail_if(ufs_pread(fd2, buffer, size, 0) != (ssize_t)size);
+	unit_check(memcmp(buffer, data, size) == 0, "the copy outlives the other");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy2") != 0);
+	unit_fail_if(ufs_fs_stats(&stat) != 0);
+	unit_check(stat.used_memory == base_memory, "all the blocks are freed");
+
+	unit_fail_if(ufs_set_dedup(false) != 0);
+	fd1 = ufs_open("copy1", UFS_CREATE);
+	fd2 = ufs_open("copy2", UFS_CREATE);
+	unit_fail_if(ufs_write(fd1, data, size) != (ssize_t)size);
+	unit_fail_if(ufs_write(fd2, data, size) != (ssize_t)size);
+	unit_fail_if(ufs_fs_stats(&stat) != 0);
+	unit_check(stat.used_memory - base_memory == 10 * UFS_MIN_BLOCK_SIZE,
+		"nothing is shared when it is off");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy1") != 0);
+	unit_fail_if(ufs_delete("copy2") != 0);
+	free(data);
+	free(buffer);
+
+	unit_test_finish();
+}
+
+static void
+test_resize_cursors(void)
+{
+	unit_test_start();
+#if NEED_RESIZE
+	char buffer[128];
+	memset(buffer, 'a', sizeof(buffer));
+	int fd1 = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd1 == -1);
+	unit_fail_if(ufs_write(fd1, buffer, 100) != 100);
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_resize(fd2, 10) != 0);
+	unit_fail_if(ufs_resize(fd2, 200) != 0);
+	int fd3 = ufs_open("file", 0);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_read(fd3, buffer, 30) != 30);
+	unit_fail_if(ufs_resize(fd2, 50) != 0);
+	unit_fail_if(ufs_resize(fd2, 60) != 0);
+
+	unit_fail_if(ufs_write(fd1, "1", 1) != 1);
+	unit_fail_if(ufs_write(fd3, "3", 1) != 1);
+	unit_fail_if(ufs_pread(fd2, buffer, sizeof(buffer), 0) != 60);
+	unit_check(buffer[10] == '1', "the cursor is moved to the smallest size "
+		"since its last use");
+	unit_check(buffer[30] == '3', "the later shrinks do not move the cursor "
+		"before them");
+	unit_fail_if(ufs_close(fd3) != 0);
+
+	/* The shrinks nobody waits for are dropped, the others still count. */
+	unit_fail_if(ufs_resize(fd2, 200) != 0);
+	memset(buffer, 'a', sizeof(buffer));
+	unit_fail_if(ufs_write(fd1, buffer, 139) != 139);
+	int fd4 = -1;
+	for (int i = 0; i < 100; ++i) {
+		unit_fail_if(ufs_resize(fd2, 100 + i) != 0);
+		unit_fail_if(ufs_resize(fd2, 200) != 0);
+		if (i == 50) {
+			fd4 = ufs_open("file", 0);
+			unit_fail_if(fd4 == -1);
+			unit_fail_if(ufs_read(fd4, buffer, 120) != 120);
+			unit_fail_if(ufs_read(fd4, buffer, 60) != 60);
+		}
+	}
+	unit_fail_if(ufs_write(fd1, "1", 1) != 1);
+	unit_fail_if(ufs_write(fd4, "4", 1) != 1);
+	unit_fail_if(ufs_pread(fd2, buffer, 1, 100) != 1);
+	unit_check(buffer[0] == '1', "the first waiting cursor is moved");
+	unit_fail_if(ufs_pread(fd2, buffer, 1, 151) != 1);
+	unit_check(buffer[0] == '4', "the later one is moved to its own");
+	unit_fail_if(ufs_close(fd4) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+#endif
+	unit_test_finish();
+}
+
+static int
+count_pieces_f(const char *data, size_t size, void *arg)
+{
+	(void)data;
+	(void)size;
+	++*(int *)arg;
+	return 0;
+}
+
+static void
+test_append_sequential(void)
+{
+	unit_test_start();
+#if NEED_OPEN_FLAGS
+	int fd1 = ufs_open("file", UFS_CREATE | UFS_APPEND);
+	unit_fail_if(fd1 == -1);
+	int fd2 = ufs_open("file", UFS_APPEND);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_write(fd1, "aaa", 3) != 3);
+	unit_fail_if(ufs_write(fd2, "bb", 2) != 2);
+	unit_fail_if(ufs_write(fd1, "c", 1) != 1);
+	char buffer[16];
+	unit_check(ufs_pread(fd1, buffer, sizeof(buffer), 0) == 6 &&
+		memcmp(buffer, "aaabbc", 6) == 0, "appends do not overwrite "
+		"each other");
+	unit_check(ufs_read(fd1, buffer, sizeof(buffer)) == 0, "the cursor is "
+		"at the end after an append");
+	unit_check(ufs_read(fd2, buffer, sizeof(buffer)) == 1 && buffer[0] == 'c',
+		"and stays there after the appends of others");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	int fd = ufs_open("file", UFS_CREATE | UFS_SEQUENTIAL);
+	unit_fail_if(fd == -1);
+	const size_t size = 300 * 1024;
+	char *data = (char *)calloc(1, size);
+	unit_fail_if(ufs_write(fd, data, size) != (ssize_t)size);
+	int piece_count = 0;
+	unit_fail_if(ufs_map_range(fd, 0, size, count_pieces_f,
+		&piece_count) != (ssize_t)size);
+	unit_check(piece_count == 2, "a sequential file has big blocks");
+	free(data);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+#endif
+	unit_test_finish();
+}
+
+static void
+test_directories(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("dir") == 0, "mkdir");
+	unit_check(ufs_mkdir("dir") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		"mkdir an existing directory");
+	unit_check(ufs_mkdir("missing/sub") == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "mkdir in a missing directory");
+	unit_check(ufs_mkdir("/dir/sub/") == 0, "mkdir a nested directory");
+	int fd = ufs_open("dir/sub/file", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a directory");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("file", 0) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		"the file is not in the root");
+	unit_check(ufs_open("missing/file", UFS_CREATE) == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "create in a missing directory");
+	unit_check(ufs_open("dir", UFS_CREATE) == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "open a directory");
+	unit_check(ufs_mkdir("dir/sub/file") == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "mkdir over a file");
+	fd = ufs_open("dir/file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	struct ufs_dir *dir = ufs_opendir("dir");
+	unit_fail_if(dir == NULL);
+	/* The listing is not affected by the changes. */
+	unit_fail_if(ufs_delete("dir/file") != 0);
+	bool has_sub = false, has_file = false;
+	int count = 0;
+	const struct ufs_dirent *entry;
+	while ((entry = ufs_readdir(dir)) != NULL) {
+		++count;
+		if (strcmp(entry->name, "sub") == 0 && entry->is_directory)
+			has_sub = true;
+		if (strcmp(entry->name, "file") == 0 && !entry->is_directory)
+			has_file = true;
+	}
+	unit_check(count == 2 && has_sub && has_file, "readdir");
+	ufs_closedir(dir);
+	unit_check(ufs_opendir("dir/sub/file") == NULL &&
+		ufs_errno() == UFS_ERR_NO_FILE, "opendir a file");
+	dir = ufs_opendir("/");
+	unit_fail_if(dir == NULL);
+	entry = ufs_readdir(dir);
+	unit_check(entry != NULL && strcmp(entry->name, "dir") == 0 &&
+		ufs_readdir(dir) == NULL, "opendir the root");
+	ufs_closedir(dir);
+
+	const char *path = "test_directories.ufs";
+	unit_check(ufs_image_save(path) == 0, "save an image with directories");
+	ufs_destroy();
+	unit_fail_if(ufs_image_load(path) != 0);
+	unit_fail_if(remove(path) != 0);
+	char buffer[16];
+	fd = ufs_open("dir/sub/file", 0);
+	unit_check(fd != -1 && ufs_read(fd, buffer, sizeof(buffer)) == 4 &&
+		memcmp(buffer, "data", 4) == 0, "the directories are loaded");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_check(ufs_rmdir("dir/sub") == -1 &&
+		ufs_errno() == UFS_ERR_NOT_EMPTY, "rmdir a not empty directory");
+	unit_fail_if(ufs_delete("dir/sub/file") != 0);
+	unit_check(ufs_rmdir("dir/sub") == 0, "rmdir an empty directory");
+	unit_check(ufs_rmdir("dir/sub") == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "rmdir a missing directory");
+	unit_check(ufs_rmdir("/") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		"rmdir the root");
+	unit_fail_if(ufs_rmdir("dir") != 0);
+	ufs_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_fs_stat fs_stat;
+	unit_fail_if(ufs_fs_stats(&fs_stat) != 0);
+	unit_check(fs_stat.file_count == 0 && fs_stat.used_memory == 0,
+		"an empty filesystem uses nothing");
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "a", 1, 2 * UFS_MIN_BLOCK_SIZE) != 1);
+	struct ufs_file_stat stat;
+	unit_check(ufs_stat(fd, &stat) == 0 &&
+		stat.size == 2 * UFS_MIN_BLOCK_SIZE + 1 && stat.block_count == 3 &&
+		stat.allocated_size == UFS_MIN_BLOCK_SIZE &&
+		stat.descriptor_count == 1 && !stat.is_deleted,
+		"the holes are not allocated");
+	unit_check(ufs_stat(fd + 1, &stat) == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "stat an invalid descriptor");
+	unit_fail_if(ufs_clone("file", "clone") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_fs_stats(&fs_stat) != 0);
+	unit_check(fs_stat.file_count == 1 && fs_stat.descriptor_count == 1 &&
+		fs_stat.deleted_file_count == 1 &&
+		fs_stat.deleted_allocated_size == UFS_MIN_BLOCK_SIZE &&
+		fs_stat.used_memory == UFS_MIN_BLOCK_SIZE &&
+		fs_stat.pool_memory >= UFS_MIN_BLOCK_SIZE,
+		"a shared block is used once, the deleted file is counted");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_set_memory_limit(2 * UFS_MIN_BLOCK_SIZE) != 0);
+	fd = ufs_open("clone", 0);
+	unit_fail_if(fd == -1);
+	/* The shared block is copied, the hole is allocated. */
+	unit_check(ufs_write(fd, "x", 1) == 1, "write within the limit");
+	char data[3 * UFS_MIN_BLOCK_SIZE] = {0};
+	unit_check(ufs_pwrite(fd, data, sizeof(data), 0) == -1 &&
+		ufs_errno() == UFS_ERR_NO_MEM, "write over the limit");
+	char buffer[1];
+	unit_check(ufs_read(fd, buffer, 1) == 1 && buffer[0] == 0,
+		"the failed write changes nothing");
+	unit_check(ufs_pwrite(fd, data, UFS_MIN_BLOCK_SIZE, 0) ==
+		UFS_MIN_BLOCK_SIZE, "overwrite does not need memory");
+	unit_fail_if(ufs_set_memory_limit(0) != 0);
+	unit_check(ufs_pwrite(fd, data, sizeof(data), 0) == sizeof(data),
+		"write without the limit");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_test_finish();
+}
+
+struct async_wait {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done_count;
+};
+
+static void
+async_done_f(struct ufs_async *request)
+{
+	struct async_wait *wait = (struct async_wait *)request->arg;
+	pthread_mutex_lock(&wait->mutex);
+	++wait->done_count;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->mutex);
+}
+
+static void
+async_wait_for(struct async_wait *wait, int count)
+{
+	pthread_mutex_lock(&wait->mutex);
+	while (wait->done_count < count)
+		pthread_cond_wait(&wait->cond, &wait->mutex);
+	pthread_mutex_unlock(&wait->mutex);
+}
+
+static void
+test_async(void)
+{
+	unit_test_start();
+
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(3, &pool) != 0);
+	struct async_wait wait;
+	pthread_mutex_init(&wait.mutex, NULL);
+	pthread_cond_init(&wait.cond, NULL);
+	wait.done_count = 0;
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Many pieces for the read, and a short last one. */
+	size_t size = 10 * 1024 * 1024 + 123;
+	char *data = (char *)malloc(size);
+	char *buffer = (char *)malloc(size + 100);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	struct ufs_async request;
+	memset(&request, 0, sizeof(request));
+	request.file_descriptor = fd;
+	request.buffer = data;
+	request.size = size;
+	request.on_done = async_done_f;
+	request.arg = &wait;
+	unit_check(ufs_write_async(pool, &request) == 0, "async write");
+	async_wait_for(&wait, 1);
+	unit_check(request.result == (ssize_t)size &&
+		request.error == UFS_ERR_NO_ERR, "all is written");
+
+	request.buffer = buffer;
+	request.size = size + 100;
+	unit_check(ufs_read_async(pool, &request) == 0, "async read");
+	async_wait_for(&wait, 2);
+	unit_check(request.result == (ssize_t)size &&
+		request.error == UFS_ERR_NO_ERR, "read stops at the end");
+	unit_check(memcmp(data, buffer, size) == 0, "data is correct");
+
+	request.offset = size - 3;
+	unit_check(ufs_read_async(pool, &request) == 0, "async read at an "
+		"offset");
+	async_wait_for(&wait, 3);
+	unit_check(request.result == 3 && memcmp(buffer, data + size - 3, 3) == 0,
+		"got the tail");
+
+	request.file_descriptor = fd + 1;
+	unit_check(ufs_read_async(pool, &request) == 0, "the descriptor is "
+		"checked later");
+	async_wait_for(&wait, 4);
+	unit_check(request.result == -1 && request.error == UFS_ERR_NO_FILE,
+		"the error is in the request");
+
+	unit_check(ufs_read_async(NULL, &request) == -1 &&
+		ufs_errno() == UFS_ERR_INVALID_ARG, "no pool");
+	request.on_done = NULL;
+	unit_check(ufs_write_async(pool, &request) == -1 &&
+		ufs_errno() == UFS_ERR_INVALID_ARG, "no callback");
+	unit_check(wait.done_count == 4, "no completion for the rejected ones");
+
+	/* The last task can be still returning from the callback. */
+	int rc;
+	while ((rc = thread_pool_delete(pool)) == TPOOL_ERR_HAS_TASKS)
+		sched_yield();
+	unit_fail_if(rc != 0);
+	pthread_cond_destroy(&wait.cond);
+	pthread_mutex_destroy(&wait.mutex);
+	free(buffer);
+	free(data);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1375,20 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_resize_cursors();
+	test_block_size();
+	test_sparse();
+	test_positional_io();
+	test_map_range();
+	test_append_sequential();
+	test_threads();
+	test_descriptor_reuse();
+	test_clone();
+	test_dedup();
+	test_image();
+	test_directories();
+	test_stats();
+	test_async();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
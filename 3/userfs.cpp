@@ -1,14 +1,38 @@
 #include "userfs.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "rlist.h"
+#include "rlistpp.h"
+#include "thread_pool.h"
+
+/**
+ * A listing of a directory. The entries are copied at the opening, so it can be read while the directory is changed,
+ * and does not hold any locks.
+ */
+struct ufs_dir {
+    std::vector<std::string> names;
+    std::vector<ufs_dirent> entries;
+    std::size_t position = 0;
+};
 
 namespace {
 
@@ -17,30 +41,121 @@ constexpr int success = 0;
 constexpr int failure = -1;
 
 enum {
-    BLOCK_SIZE = 512,
+    DEFAULT_BLOCK_SIZE = UFS_MIN_BLOCK_SIZE,
     MAX_FILE_SIZE = 1024 * 1024 * 100,
+    // Blocks are allocated by slabs of this size, or by one if they are bigger
+    SLAB_SIZE = 256 * 1024,
+    // Block size of the files created with UFS_SEQUENTIAL
+    SEQUENTIAL_BLOCK_SIZE = 256 * 1024,
+    // An async read is split into pieces of this size for the threads, and is run by this many tasks at most
+    ASYNC_PIECE_SIZE = 4 * 1024 * 1024,
+    ASYNC_MAX_TASKS = 16,
+};
+
+/**
+ * Block memory, taken from the pool of its size. Null is a hole which reads as zeros and gets allocated on the first
+ * write.
+ */
+using block = char *;
+
+/**
+ * Blocks of one size. The memory is allocated by slabs of several blocks and is only freed by ufs_destroy(). The
+ * blocks of truncated and deleted files go to the free list and are reused without touching the heap.
+ */
+struct block_pool {
+    explicit block_pool(const std::size_t size) : block_size(size) {}
+
+    // Size of each block
+    std::size_t block_size;
+    // Guards the free list and the slabs, the writers of different files allocate concurrently
+    std::mutex mutex;
+    // Free blocks. Each one keeps the pointer to the next one in its first bytes
+    block free_blocks = nullptr;
+    // Memory of all the blocks
+    std::vector<std::unique_ptr<char[]>> slabs;
+    /**
+     * Full blocks by their content hash, see ufs_set_dedup(). One block per hash, a collision only misses a sharing.
+     * With the hashes of the indexed blocks, to drop them when they are written in place or freed. Guarded by
+     * shared_blocks_mutex, not by the pool one.
+     */
+    std::unordered_map<std::uint64_t, block> dedup_blocks;
+    std::unordered_map<block, std::uint64_t> dedup_hashes;
 };
 
-// Block memory.
-struct block {
-    explicit block() { std::memset(memory, 0, BLOCK_SIZE); }
+struct file;
+
+struct directory {
+    // Name in the parent directory, empty for the root
+    std::string name;
+    // Null for the root
+    directory *parent = nullptr;
+    /**
+     * Entries by name. The keys point into the names of the entries. A name is either a file or a directory. The
+     * deleted files are not here.
+     */
+    std::unordered_map<std::string_view, file *> files;
+    std::unordered_map<std::string_view, directory *> directories;
+};
 
-    char memory[BLOCK_SIZE] = {0};
-    rlist in_block_list = RLIST_LINK_INITIALIZER;
+// A shrink of a file which some descriptors have not caught up with, see file::shrinks
+struct shrink_entry {
+    std::uint64_t generation;
+    std::size_t size;
+    /**
+     * The descriptors which move to this size: behind it, but not behind the entry before. They catch up under the
+     * shared file lock, so it is atomic.
+     */
+    std::atomic<int> waiting;
+
+    shrink_entry(const std::uint64_t generation, const std::size_t size, const int waiting)
+        : generation(generation), size(size), waiting(waiting) {}
+    shrink_entry(const shrink_entry &other)
+        : generation(other.generation), size(other.size), waiting(other.waiting.load(std::memory_order_relaxed)) {}
+    shrink_entry &operator=(const shrink_entry &other) {
+        generation = other.generation;
+        size = other.size;
+        waiting.store(other.waiting.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
 };
 
 struct file {
-    rlist blocks = RLIST_HEAD_INITIALIZER(blocks);
-    // File name
+    /**
+     * Block index. The block with a byte at offset N is blocks[N / block_size], so a seek at any position is O(1)
+     * and does not walk the previous blocks.
+     */
+    std::vector<block> blocks;
+    // Size of each block, fixed at the file creation
+    std::size_t block_size = DEFAULT_BLOCK_SIZE;
+    // Where the blocks are taken from
+    block_pool *pool = nullptr;
+    // Guards the blocks and the size. The readers share it, the writers own it
+    std::shared_mutex lock;
+    // File name in its directory
     std::string name;
+    // Directory of the file, null when the file is deleted
+    directory *parent = nullptr;
     // How many file descriptors are opened on the file
     int references = 0;
-    // Number of allocated blocks
-    std::size_t block_count = 0;
     // Size of this file
     std::size_t size = 0;
     // Is this file deleted
     bool is_this_deleted = false;
+    // Number of the blocks which are not holes, shared ones included
+    std::size_t allocated_blocks = 0;
+    /**
+     * Were the blocks ever shared with a clone or put into the dedup index. Only then they are looked up in
+     * shared_blocks and the index
+     */
+    bool has_shared_blocks = false;
+    // Number of the shrinks by ufs_resize(). The descriptors compare it with their own to see if they are behind
+    std::uint64_t shrink_generation = 0;
+    /**
+     * The shrinks, only those which are smaller than all the later ones. So the smallest size since a generation is the
+     * size of the first entry after it. The entries no descriptor waits for are dropped on the next shrink, so there
+     * are at most as many as the descriptors.
+     */
+    std::vector<shrink_entry> shrinks;
     // A link in the global file list
     rlist in_file_list = RLIST_LINK_INITIALIZER;
 };
@@ -48,19 +163,62 @@ struct file {
 struct filedesc {
     // Descriptor of this file
     file *at_file = nullptr;
-    // Current cursor position
+    // Serializes the calls moving the cursor, when the descriptor is shared by threads
+    std::mutex cursor_mutex;
+    // Current cursor position. It can be beyond the file end until syncCursor()
     std::size_t cursor_position = 0;
-    // Current block
-    block *current_block = nullptr;
-    // Current offset
-    std::size_t current_offset = 0;
+    // The file shrink generation which the cursor is checked against
+    std::uint64_t shrink_generation = 0;
     // Permissions:
     bool readable = false;
     bool writable = false;
+    // Are the writes done at the file end, see UFS_APPEND
+    bool is_append = false;
+};
+/**
+ * Image of the filesystem, see ufs_image_save(). It starts with the header, then go the directory entries, parents
+ * first, then the file entries, then the blocks from a page boundary. A directory entry is the size of its path and the
+ * path padded to 8 bytes. All the numbers are 64 bit in the native byte order.
+ */
+struct image_header {
+    char magic[8];
+    // Number of the directory entries
+    std::uint64_t directory_count;
+    // Number of the file entries
+    std::uint64_t file_count;
+    // Size of the whole image
+    std::uint64_t size;
+};
+
+/**
+ * An entry is followed by the path padded to 8 bytes, and then by the offsets of the blocks in the image, 0 for a
+ * hole.
+ */
+struct image_file {
+    std::uint64_t name_size;
+    std::uint64_t block_size;
+    std::uint64_t size;
+    std::uint64_t block_count;
+};
+
+constexpr char image_magic[8] = {'U', 'F', 'S', 'I', 'M', 'G', '0', '2'};
+constexpr std::size_t image_page_size = 4096;
+
+// A loaded image. Its pages are the memory of the blocks of the loaded files.
+struct image_mapping {
+    void *memory;
+    std::size_t size;
 };
 /* -------------------------------------------- *** -------------------------------------------- */
 
 /* ----------------------------------------- Variables ----------------------------------------- */
+/**
+ * Guards the file list and index, the descriptor table, the pool list and the new file block size. The calls changing
+ * them own it. The I/O calls share it, so their descriptor and file can not be closed or freed meanwhile. The lock
+ * order is: this one, a descriptor cursor, a file, the shared blocks, a pool.
+ */
+std::shared_mutex namespace_lock;
+
 /**
  * Intrusive list of all files. In this case the intrusiveness of the list also
  * grants the ability to remove items from any position in O(1) complexity
@@ -68,6 +226,17 @@ struct filedesc {
  */
 rlist file_list = RLIST_HEAD_INITIALIZER(file_list);
 
+// Typed view of file_list, for the range-for.
+auto allFiles() -> intrusive_list<file, &file::in_file_list> {
+    return intrusive_list<file, &file::in_file_list>(&file_list);
+}
+
+/**
+ * The directory tree. A lookup goes by the hash tables of the directories on the path, so it does not depend on the
+ * number of files elsewhere.
+ */
+directory root_directory;
+
 /**
  * An array of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
@@ -76,8 +245,49 @@ rlist file_list = RLIST_HEAD_INITIALIZER(file_list);
  */
 std::vector<std::unique_ptr<filedesc>> file_descriptors_table;
 
-// Global error code. Set from any function on any error.
-ufs_error_code ufs_last_error_code = UFS_ERR_NO_ERR;
+/**
+ * Bitmap of the NULL cells in file_descriptors_table, a bit per cell. The lowest free descriptor is found by the first
+ * set bit from first_free_word, and the words before it have no set bits.
+ */
+std::vector<std::uint64_t> free_descriptors;
+std::size_t first_free_word = 0;
+
+// Pools of the blocks by their size. There are only a few block sizes in use at once, so it is a list.
+std::vector<std::unique_ptr<block_pool>> block_pools;
+
+/**
+ * Loaded images. They are unmapped only by ufs_destroy(), because the blocks taken from them can move to the pools
+ * when the files are truncated or deleted.
+ */
+std::vector<image_mapping> image_mappings;
+
+/**
+ * Blocks shared by the file clones, with the number of files having each of them. A block with one owner is not here.
+ * A shared block is copied before a write, see writableBlock().
+ */
+std::unordered_map<block, std::size_t> shared_blocks;
+std::mutex shared_blocks_mutex;
+
+// Data of the holes for ufs_map_range(). It is never written, so takes no memory until read.
+const char zero_block[UFS_MAX_BLOCK_SIZE] = {};
+
+// Block size of the files created from now on, see ufs_set_block_size().
+std::size_t new_file_block_size = DEFAULT_BLOCK_SIZE;
+
+/**
+ * Bytes of the blocks held by the files, each shared block counted once. The free blocks of the pools are not here.
+ * Changed under the locks of different pools, so atomic.
+ */
+std::atomic<std::size_t> used_memory{0};
+
+// Limit of used_memory for the writes, 0 is no limit. See ufs_set_memory_limit().
+std::size_t memory_limit = 0;
+
+// Are the full blocks deduplicated on write. See ufs_set_dedup().
+bool is_dedup_enabled = false;
+
+// Error code of the thread. Set from any function on any error.
+thread_local ufs_error_code ufs_last_error_code = UFS_ERR_NO_ERR;
 /* -------------------------------------------- *** -------------------------------------------- */
 
 /* ------------------------------------------ Helpers ------------------------------------------ */
@@ -85,62 +295,220 @@ void set_ufs_errno(const ufs_error_code new_errno) {
     ufs_last_error_code = new_errno;
 }
 
-auto findFile(const char *filename) -> file * {
+/**
+ * Directory containing the last name of the path, and that name. The names are separated by one or more '/', and the
+ * ones at the start and the end are ignored. Null if a directory on the way does not exist, or if there are no names.
+ */
+auto resolvePath(const char *path, std::string_view &name) -> directory * {
+    std::string_view rest(path);
+    directory *current = &root_directory;
+    while (true) {
+        rest.remove_prefix(std::min(rest.find_first_not_of('/'), rest.size()));
+        const auto slash = rest.find('/');
+        name = rest.substr(0, slash);
+        if (slash == std::string_view::npos || rest.find_first_not_of('/', slash) == std::string_view::npos) {
+            return name.empty() ? nullptr : current;
+        }
+        const auto found = current->directories.find(name);
+        if (found == current->directories.end()) {
+            return nullptr;
+        }
+        current = found->second;
+        rest.remove_prefix(slash);
+    }
+}
+
+auto findFile(const char *path) -> file * {
     // ReSharper disable once CppDFAConstantConditions
-    if (filename == nullptr) {
+    if (path == nullptr) {
         return nullptr;
     }
 
-    file *result = nullptr;
-    rlist_foreach_entry(result, &file_list, in_file_list) {
-        if (result->name == filename) {
-            return result;
-        }
+    std::string_view name;
+    const auto parent = resolvePath(path, name);
+    if (parent == nullptr) {
+        return nullptr;
+    }
+    const auto found = parent->files.find(name);
+    if (found == parent->files.end()) {
+        return nullptr;
     }
-    return nullptr;
+    return found->second;
 }
 
-auto firstBlock(const file *current_file) -> block * {
-    if (current_file == nullptr || rlist_empty(&current_file->blocks)) {
+// Directory by its path. An empty path and "/" are the root.
+auto findDirectory(const char *path) -> directory * {
+    std::string_view name;
+    const auto parent = resolvePath(path, name);
+    if (parent == nullptr) {
+        return name.empty() && std::string_view(path).find_first_not_of('/') == std::string_view::npos
+                       ? &root_directory
+                       : nullptr;
+    }
+    const auto found = parent->directories.find(name);
+    if (found == parent->directories.end()) {
         return nullptr;
     }
-    return rlist_first_entry(&current_file->blocks, block, in_block_list);
+    return found->second;
 }
 
-auto nextBlock(const file *current_file, block *current_block) -> block * {
-    if (current_file == nullptr || current_block == nullptr) {
-        return nullptr;
+bool isNameTaken(const directory *parent, const std::string_view name) {
+    return parent->files.count(name) != 0 || parent->directories.count(name) != 0;
+}
+
+auto createDirectory(directory *parent, const std::string_view name) -> directory * {
+    const auto new_directory = new directory();
+    new_directory->name = name;
+    new_directory->parent = parent;
+    parent->directories.emplace(new_directory->name, new_directory);
+    return new_directory;
+}
+
+// Free the subdirectories recursively, the files must be already gone.
+void freeDirectories(directory *current_directory) {
+    for (const auto &entry : current_directory->directories) {
+        freeDirectories(entry.second);
+        delete entry.second;
     }
-    // is head check
-    if (current_block->in_block_list.next == &current_file->blocks) {
-        return nullptr;
+    std::unordered_map<std::string_view, directory *>().swap(current_directory->directories);
+    std::unordered_map<std::string_view, file *>().swap(current_directory->files);
+}
+
+// Full path of the entry in the tree, without the leading '/'.
+auto pathOf(const directory *parent, const std::string_view name) -> std::string {
+    std::string path(name);
+    for (; parent != &root_directory; parent = parent->parent) {
+        path.insert(0, 1, '/');
+        path.insert(0, parent->name);
     }
-    return rlist_next_entry(current_block, in_block_list);
+    return path;
 }
 
-bool appendBlock(file *current_file) {
-    if (current_file == nullptr) {
-        return false;
+auto findBlockPool(const std::size_t block_size) -> block_pool * {
+    for (const auto &pool : block_pools) {
+        if (pool->block_size == block_size) {
+            return pool.get();
+        }
+    }
+    block_pools.push_back(std::make_unique<block_pool>(block_size));
+    return block_pools.back().get();
+}
+
+auto allocateBlock(block_pool *pool) -> block {
+    const std::lock_guard guard(pool->mutex);
+    if (pool->free_blocks == nullptr) {
+        const std::size_t count = std::max<std::size_t>(1, SLAB_SIZE / pool->block_size);
+        pool->slabs.emplace_back(new char[count * pool->block_size]);
+        char *slab = pool->slabs.back().get();
+        for (std::size_t index = count; index > 0; --index) {
+            block free_block = slab + (index - 1) * pool->block_size;
+            std::memcpy(free_block, &pool->free_blocks, sizeof(block));
+            pool->free_blocks = free_block;
+        }
     }
+    const block result = pool->free_blocks;
+    std::memcpy(&pool->free_blocks, result, sizeof(block));
+    used_memory += pool->block_size;
+    return result;
+}
+
+// The pool must be locked.
+void freeBlock(block_pool *pool, const block to_free) {
+    std::memcpy(to_free, &pool->free_blocks, sizeof(block));
+    pool->free_blocks = to_free;
+    used_memory -= pool->block_size;
+}
 
-    const auto new_block = new block();
-    rlist_add_tail(&current_file->blocks, &new_block->in_block_list);
-    ++current_file->block_count;
+/**
+ * Drop one owner of the block if it is shared. Returns whether it was shared, then it still belongs to the others.
+ * shared_blocks_mutex must be locked.
+ */
+bool unshareBlock(const block shared_block) {
+    const auto found = shared_blocks.find(shared_block);
+    if (found == shared_blocks.end()) {
+        return false;
+    }
+    if (--found->second == 1) {
+        shared_blocks.erase(found);
+    }
     return true;
 }
 
+/**
+ * Forget the block in the dedup index before it is changed or freed. shared_blocks_mutex must be locked.
+ */
+void dedupForget(block_pool *pool, const block indexed_block) {
+    const auto found = pool->dedup_hashes.find(indexed_block);
+    if (found == pool->dedup_hashes.end()) {
+        return;
+    }
+    pool->dedup_blocks.erase(found->second);
+    pool->dedup_hashes.erase(found);
+}
+
+// Return the blocks from the given index to the end back to the pool and drop them from the index.
+void truncateBlocks(file *current_file, const std::size_t block_count) {
+    std::unique_lock<std::mutex> shared_guard;
+    if (current_file->has_shared_blocks) {
+        shared_guard = std::unique_lock(shared_blocks_mutex);
+    }
+    const std::lock_guard guard(current_file->pool->mutex);
+    for (std::size_t index = block_count; index < current_file->blocks.size(); ++index) {
+        const block current_block = current_file->blocks[index];
+        if (current_block == nullptr) {
+            continue;
+        }
+        --current_file->allocated_blocks;
+        if (!current_file->has_shared_blocks) {
+            freeBlock(current_file->pool, current_block);
+        } else if (!unshareBlock(current_block)) {
+            dedupForget(current_file->pool, current_block);
+            freeBlock(current_file->pool, current_block);
+        }
+    }
+    if (block_count < current_file->blocks.size()) {
+        current_file->blocks.resize(block_count);
+    }
+}
+
+/**
+ * Memory of the block with the given index, allocated if it is a hole and copied if it is shared with a clone. A block
+ * which is going to be fully overwritten is not zeroed or copied.
+ */
+auto writableBlock(file *current_file, const std::size_t index, const bool is_overwrite) -> char * {
+    auto &current_block = current_file->blocks[index];
+    if (current_block != nullptr && current_file->has_shared_blocks) {
+        // Copy under the lock, or the other owner could see the block unshared and write it meanwhile.
+        const std::lock_guard guard(shared_blocks_mutex);
+        if (shared_blocks.count(current_block) != 0) {
+            const block copy = allocateBlock(current_file->pool);
+            if (!is_overwrite) {
+                std::memcpy(copy, current_block, current_file->block_size);
+            }
+            unshareBlock(current_block);
+            current_block = copy;
+        } else {
+            dedupForget(current_file->pool, current_block);
+        }
+    }
+    if (current_block == nullptr) {
+        current_block = allocateBlock(current_file->pool);
+        ++current_file->allocated_blocks;
+        if (!is_overwrite) {
+            std::memset(current_block, 0, current_file->block_size);
+        }
+    }
+    return current_block;
+}
+
 [[maybe_unused]] bool freeAllBlocks(file *current_file) {
     if (current_file == nullptr) {
         return false;
     }
 
-    while (!rlist_empty(&current_file->blocks)) {
-        const auto head_block = firstBlock(current_file);
-        rlist_del(&head_block->in_block_list);
-        delete head_block;
-    }
-    current_file->block_count = 0;
-
+    truncateBlocks(current_file, 0);
+    // swap because of the capacity
+    std::vector<block>().swap(current_file->blocks);
     return true;
 }
 
@@ -160,44 +528,166 @@ bool isValidFileDescriptor(const int file_descriptor) {
 }
 
 bool setCursor(const std::unique_ptr<filedesc> &current_file_descriptor, const std::size_t new_cursor_position) {
-    if (current_file_descriptor == nullptr) {
+    if (current_file_descriptor == nullptr || current_file_descriptor->at_file == nullptr) {
         return false;
     }
-    const auto current_file = current_file_descriptor->at_file;
-    if (current_file == nullptr) {
-        return false;
+    current_file_descriptor->cursor_position = new_cursor_position;
+    current_file_descriptor->shrink_generation = current_file_descriptor->at_file->shrink_generation;
+    return true;
+}
+
+/**
+ * The shrink the descriptor moves to, null if it is not behind. It doesn't wait for it anymore, its cursor must be
+ * moved. The file must be locked, at least for reading.
+ */
+auto catchUpShrinks(filedesc *descriptor) -> shrink_entry * {
+    file *current_file = descriptor->at_file;
+    if (descriptor->shrink_generation == current_file->shrink_generation) {
+        return nullptr;
     }
+    const auto shrink = std::upper_bound(std::begin(current_file->shrinks),
+                                         std::end(current_file->shrinks),
+                                         descriptor->shrink_generation,
+                                         [](const std::uint64_t generation, const shrink_entry &entry) -> bool {
+                                             return generation < entry.generation;
+                                         });
+    assert(shrink != std::end(current_file->shrinks));
+    shrink->waiting.fetch_sub(1, std::memory_order_relaxed);
+    descriptor->shrink_generation = current_file->shrink_generation;
+    return &*shrink;
+}
 
-    // set new value
-    current_file_descriptor->cursor_position = new_cursor_position;
-    // rebuild cached values
-    current_file_descriptor->current_block = nullptr;
-    current_file_descriptor->current_offset = 0;
+/**
+ * Move the cursor to the smallest size the file was shrunk to since the last check, if it is beyond that. The file
+ * must be locked.
+ */
+void syncCursor(filedesc *descriptor) {
+    if (const shrink_entry *shrink = catchUpShrinks(descriptor); shrink != nullptr) {
+        descriptor->cursor_position = std::min(descriptor->cursor_position, shrink->size);
+    }
+}
 
-    const std::size_t target_block_index = new_cursor_position / BLOCK_SIZE;
-    const std::size_t target_block_offset = new_cursor_position % BLOCK_SIZE;
+// Content hash of a block for the dedup index. Four independent lanes, so the multiplications overlap.
+auto blockHash(const char *data, const std::size_t size) -> std::uint64_t {
+    constexpr std::uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    std::uint64_t lanes[4] = {size, size + 1, size + 2, size + 3};
+    std::size_t offset = 0;
+    for (; offset + sizeof(lanes) <= size; offset += sizeof(lanes)) {
+        for (std::size_t lane = 0; lane < 4; ++lane) {
+            std::uint64_t word;
+            std::memcpy(&word, data + offset + lane * sizeof(word), sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * multiplier;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    std::uint64_t hash = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+    for (; offset < size; ++offset) {
+        hash = (hash ^ static_cast<unsigned char>(data[offset])) * multiplier;
+    }
+    return (hash ^ (hash >> 32)) * multiplier;
+}
 
-    if (target_block_index < current_file->block_count) {
-        // walk until needed block:
-        auto block = firstBlock(current_file);
-        if (block == nullptr) {
-            return false;
+/**
+ * Share the just written full block with an identical one from the dedup index, or put it there. The block belongs
+ * only to this file, writableBlock() made sure of that.
+ */
+void dedupBlock(file *current_file, const std::size_t index) {
+    auto &current_block = current_file->blocks[index];
+    block_pool *pool = current_file->pool;
+    const std::uint64_t hash = blockHash(current_block, current_file->block_size);
+    current_file->has_shared_blocks = true;
+    const std::lock_guard guard(shared_blocks_mutex);
+    const auto [found, is_new] = pool->dedup_blocks.try_emplace(hash, current_block);
+    if (is_new) {
+        pool->dedup_hashes.emplace(current_block, hash);
+        return;
+    }
+    const block same_block = found->second;
+    // The index is locked, so the block can't be written meanwhile, a write would drop it from the index first
+    if (std::memcmp(same_block, current_block, current_file->block_size) != 0) {
+        return;
+    }
+    auto &owner_count = shared_blocks[same_block];
+    owner_count = std::max<std::size_t>(owner_count, 1) + 1;
+    {
+        const std::lock_guard pool_guard(pool->mutex);
+        freeBlock(pool, current_block);
+    }
+    current_block = same_block;
+}
+
+// Copy the buffer into the file at the given position. The range must be inside the block index.
+void writeBlocks(file *current_file, std::size_t position, const char *buffer, const std::size_t size) {
+    const std::size_t block_size = current_file->block_size;
+    std::size_t done = 0;
+    while (done < size) {
+        const std::size_t offset = position % block_size;
+        const std::size_t chunk = std::min(block_size - offset, size - done);
+        char *memory = writableBlock(current_file, position / block_size, chunk == block_size);
+        std::memcpy(memory + offset, buffer + done, chunk);
+        if (is_dedup_enabled && offset + chunk == block_size) {
+            dedupBlock(current_file, position / block_size);
         }
-        for (std::size_t index = 0; index < target_block_index; ++index) {
-            block = nextBlock(current_file, block);
-            assert(block != nullptr);
+        done += chunk;
+        position += chunk;
+    }
+}
+
+// Copy the file data at the given position into the buffer. The range must be inside the block index.
+void readBlocks(const file *current_file, std::size_t position, char *buffer, const std::size_t size) {
+    const std::size_t block_size = current_file->block_size;
+    std::size_t done = 0;
+    while (done < size) {
+        const std::size_t offset = position % block_size;
+        const std::size_t chunk = std::min(block_size - offset, size - done);
+        const auto &current_block = current_file->blocks[position / block_size];
+        if (current_block == nullptr) {
+            std::memset(buffer + done, 0, chunk);
+        } else {
+            std::memcpy(buffer + done, current_block + offset, chunk);
         }
-        current_file_descriptor->current_block = block;
-        current_file_descriptor->current_offset = target_block_offset;
+        done += chunk;
+        position += chunk;
     }
-    return true;
 }
 
-auto fileDescriptorsFirstNullCell() -> std::vector<std::unique_ptr<filedesc>>::iterator {
-    return std::find_if(
-            std::begin(file_descriptors_table),
-            std::end(file_descriptors_table),
-            [](const std::unique_ptr<filedesc> &descriptor_pointer) -> bool { return descriptor_pointer == nullptr; });
+// Prepare the cursor of the descriptor for a write. The file must be locked for writing.
+void syncWriteCursor(filedesc *descriptor) {
+    if (descriptor->is_append) {
+        // The shrinks are irrelevant, the cursor only follows the end.
+        catchUpShrinks(descriptor);
+        descriptor->cursor_position = descriptor->at_file->size;
+        return;
+    }
+    syncCursor(descriptor);
+}
+
+// Put the descriptor into the lowest NULL cell of the table or append it. Returns the cell index.
+auto fileDescriptorsInsert(std::unique_ptr<filedesc> descriptor) -> std::size_t {
+    while (first_free_word < free_descriptors.size() && free_descriptors[first_free_word] == 0) {
+        ++first_free_word;
+    }
+    if (first_free_word == free_descriptors.size()) {
+        file_descriptors_table.push_back(std::move(descriptor));
+        const std::size_t index = file_descriptors_table.size() - 1;
+        if (index / 64 == free_descriptors.size()) {
+            free_descriptors.push_back(0);
+        }
+        return index;
+    }
+    auto &word = free_descriptors[first_free_word];
+    const std::size_t index = first_free_word * 64 + __builtin_ctzll(word);
+    word &= word - 1;
+    file_descriptors_table[index] = std::move(descriptor);
+    return index;
+}
+
+// Empty the cell of the table, so it can be taken again.
+void fileDescriptorsErase(const std::size_t index) {
+    file_descriptors_table[index].reset(nullptr);
+    const std::size_t word_index = index / 64;
+    free_descriptors[word_index] |= std::uint64_t{1} << (index % 64);
+    first_free_word = std::min(first_free_word, word_index);
 }
 
 [[maybe_unused]] bool ensureEnoughCapacity(file *file, const std::size_t end_pos) {
@@ -207,13 +697,10 @@ auto fileDescriptorsFirstNullCell() -> std::vector<std::unique_ptr<filedesc>>::i
     if (end_pos == 0) {
         return true;
     }
-    const std::size_t needed_blocks = (end_pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    while (file->block_count < needed_blocks) {
-        // ReSharper disable once CppDFAConstantConditions
-        if (!appendBlock(file)) {
-            // ReSharper disable once CppDFAUnreachableCode
-            return false;
-        }
+    // The new blocks are holes until written.
+    const std::size_t needed_blocks = (end_pos + file->block_size - 1) / file->block_size;
+    if (file->blocks.size() < needed_blocks) {
+        file->blocks.resize(needed_blocks);
     }
     return true;
 }
@@ -226,6 +713,354 @@ auto fileDescriptorsFirstNullCell() -> std::vector<std::unique_ptr<filedesc>>::i
     return true;
 }
 
+/**
+ * Descriptor by its number if it is valid and has the needed permissions. Otherwise the error is set and the result is
+ * null.
+ */
+auto openedDescriptor(const int file_descriptor, const bool is_read, const bool is_write) -> filedesc * {
+    if (!isValidFileDescriptor(file_descriptor)) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return nullptr;
+    }
+    const auto &descriptor_pointer = file_descriptors_table[file_descriptor - 1];
+    if ((is_read && !descriptor_pointer->readable) || (is_write && !descriptor_pointer->writable)) {
+        set_ufs_errno(UFS_ERR_NO_PERMISSION);
+        return nullptr;
+    }
+    assert(descriptor_pointer->at_file != nullptr);
+    return descriptor_pointer.get();
+}
+
+/**
+ * Bytes to be allocated by a write of the range: its holes and the blocks shared with the clones. The file must be
+ * locked.
+ */
+auto writeAllocationSize(const file *current_file, const std::size_t position, const std::size_t size)
+        -> std::size_t {
+    if (size == 0) {
+        return 0;
+    }
+    const std::size_t first_block = position / current_file->block_size;
+    const std::size_t end_block = (position + size - 1) / current_file->block_size + 1;
+    const std::size_t indexed_end = std::min(end_block, current_file->blocks.size());
+    std::size_t count = end_block - std::max(first_block, indexed_end);
+    std::unique_lock<std::mutex> shared_guard;
+    if (current_file->has_shared_blocks) {
+        shared_guard = std::unique_lock(shared_blocks_mutex);
+    }
+    for (std::size_t index = first_block; index < indexed_end; ++index) {
+        const block current_block = current_file->blocks[index];
+        if (current_block == nullptr ||
+            (current_file->has_shared_blocks && shared_blocks.count(current_block) != 0)) {
+            ++count;
+        }
+    }
+    return count * current_file->block_size;
+}
+
+/**
+ * Make sure the file can be written at the given range and its block index covers it. The memory limit is checked
+ * before anything is written, so a write either fits entirely or does nothing.
+ */
+bool prepareWrite(file *current_file, const std::size_t position, const std::size_t size) {
+    if (position > MAX_FILE_SIZE || size > MAX_FILE_SIZE - position) {
+        set_ufs_errno(UFS_ERR_NO_MEM);
+        return false;
+    }
+    if (memory_limit != 0) {
+        const std::size_t needed = writeAllocationSize(current_file, position, size);
+        const std::size_t used = used_memory;
+        if (used > memory_limit || needed > memory_limit - used) {
+            set_ufs_errno(UFS_ERR_NO_MEM);
+            return false;
+        }
+    }
+    if (!ensureEnoughCapacity(current_file, position + size)) {
+        set_ufs_errno(UFS_ERR_NO_MEM);
+        return false;
+    }
+    return true;
+}
+
+// The file got written up to the given position.
+void finishWrite(file *current_file, const std::size_t end_position) {
+    current_file->size = std::max(current_file->size, end_position);
+}
+
+// Read the file at the given position, not further than its end. Returns how many bytes are read.
+auto readAt(const file *current_file, const std::size_t position, char *buffer, const std::size_t size) -> std::size_t {
+    if (position >= current_file->size) {
+        return 0;
+    }
+    const auto bytes_to_read = std::min(size, current_file->size - position);
+    readBlocks(current_file, position, buffer, bytes_to_read);
+    return bytes_to_read;
+}
+
+auto createFile(directory *parent, const std::string_view name, const std::size_t block_size) -> file * {
+    const auto new_file = new file();
+    new_file->name = name;
+    new_file->parent = parent;
+    new_file->references = 0;
+    new_file->size = 0;
+    new_file->block_size = block_size;
+    new_file->pool = findBlockPool(block_size);
+    new_file->is_this_deleted = false;
+    rlist_add_tail_entry(&file_list, new_file, in_file_list);
+    parent->files.emplace(new_file->name, new_file);
+    return new_file;
+}
+
+constexpr auto alignUp(const std::size_t value, const std::size_t alignment) -> std::size_t {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Directories of the subtree, parents first.
+void collectDirectories(directory *current_directory, std::vector<directory *> &result) {
+    for (const auto &entry : current_directory->directories) {
+        result.push_back(entry.second);
+        collectDirectories(entry.second, result);
+    }
+}
+
+auto imagePathSize(const std::string &path) -> std::size_t {
+    return sizeof(std::uint64_t) + alignUp(path.size(), 8);
+}
+
+auto imageFileEntrySize(const std::string &path, const file *current_file) -> std::size_t {
+    return sizeof(image_file) + alignUp(path.size(), 8) + current_file->blocks.size() * sizeof(std::uint64_t);
+}
+
+auto imageWritePath(char *position, const std::string &path) -> char * {
+    std::memcpy(position, path.data(), path.size());
+    return position + alignUp(path.size(), 8);
+}
+
+/**
+ * Fill the image memory of the given size, which was computed for the current files. The paths are by directory and
+ * by file in the file list order.
+ */
+void imageFill(char *image,
+               const std::size_t size,
+               const std::size_t data_offset,
+               const std::vector<std::string> &directory_paths,
+               const std::vector<std::string> &file_paths) {
+    image_header header{};
+    std::memcpy(header.magic, image_magic, sizeof(image_magic));
+    header.directory_count = directory_paths.size();
+    header.file_count = file_paths.size();
+    header.size = size;
+    char *entry_position = image + sizeof(image_header);
+    for (const auto &path : directory_paths) {
+        const std::uint64_t path_size = path.size();
+        std::memcpy(entry_position, &path_size, sizeof(path_size));
+        entry_position = imageWritePath(entry_position + sizeof(path_size), path);
+    }
+    std::size_t data_position = data_offset;
+    std::size_t file_index = 0;
+    for (file *current_file : allFiles()) {
+        const auto &path = file_paths[file_index++];
+        image_file entry{};
+        entry.name_size = path.size();
+        entry.block_size = current_file->block_size;
+        entry.size = current_file->size;
+        entry.block_count = current_file->blocks.size();
+        std::memcpy(entry_position, &entry, sizeof(entry));
+        entry_position = imageWritePath(entry_position + sizeof(entry), path);
+        for (const block current_block : current_file->blocks) {
+            std::uint64_t offset = 0;
+            if (current_block != nullptr) {
+                offset = data_position;
+                std::memcpy(image + data_position, current_block, current_file->block_size);
+                data_position += current_file->block_size;
+            }
+            std::memcpy(entry_position, &offset, sizeof(offset));
+            entry_position += sizeof(offset);
+        }
+    }
+    assert(data_position == size);
+    std::memcpy(image, &header, sizeof(header));
+}
+
+// A file entry of an image, checked to point only inside the image.
+struct image_entry {
+    std::string path;
+    std::size_t block_size;
+    std::size_t size;
+    const char *block_offsets;
+    std::size_t block_count;
+};
+
+// Read a path of the given size at the position, if it fits into the image.
+bool imageReadPath(const char *image,
+                   const std::size_t size,
+                   std::size_t &position,
+                   const std::uint64_t path_size,
+                   std::string &path) {
+    if (path_size > size - position || alignUp(path_size, 8) > size - position) {
+        return false;
+    }
+    path.assign(image + position, path_size);
+    position += alignUp(path_size, 8);
+    return path.find('\0') == std::string::npos;
+}
+
+/**
+ * Read and check the entries of the image. Returns false if the image is malformed: an offset or a size out of the
+ * image, a wrong block size or count. The paths are checked later, when the entries are created.
+ */
+bool imageParse(const char *image,
+                const std::size_t size,
+                std::vector<std::string> &directory_paths,
+                std::vector<image_entry> &entries) {
+    if (size < sizeof(image_header)) {
+        return false;
+    }
+    image_header header;
+    std::memcpy(&header, image, sizeof(header));
+    if (std::memcmp(header.magic, image_magic, sizeof(image_magic)) != 0 || header.size != size) {
+        return false;
+    }
+    std::size_t position = sizeof(image_header);
+    for (std::uint64_t index = 0; index < header.directory_count; ++index) {
+        std::uint64_t path_size;
+        if (size - position < sizeof(path_size)) {
+            return false;
+        }
+        std::memcpy(&path_size, image + position, sizeof(path_size));
+        position += sizeof(path_size);
+        std::string path;
+        if (!imageReadPath(image, size, position, path_size, path)) {
+            return false;
+        }
+        directory_paths.push_back(std::move(path));
+    }
+    for (std::uint64_t index = 0; index < header.file_count; ++index) {
+        image_file entry;
+        if (size - position < sizeof(entry)) {
+            return false;
+        }
+        std::memcpy(&entry, image + position, sizeof(entry));
+        position += sizeof(entry);
+        if (entry.block_size < UFS_MIN_BLOCK_SIZE || entry.block_size > UFS_MAX_BLOCK_SIZE ||
+            entry.size > MAX_FILE_SIZE ||
+            entry.block_count != (entry.size + entry.block_size - 1) / entry.block_size) {
+            return false;
+        }
+        std::string path;
+        if (!imageReadPath(image, size, position, entry.name_size, path)) {
+            return false;
+        }
+        if (entry.block_count > (size - position) / sizeof(std::uint64_t)) {
+            return false;
+        }
+        const char *block_offsets = image + position;
+        position += entry.block_count * sizeof(std::uint64_t);
+        for (std::size_t block_index = 0; block_index < entry.block_count; ++block_index) {
+            std::uint64_t offset;
+            std::memcpy(&offset, block_offsets + block_index * sizeof(offset), sizeof(offset));
+            if (offset != 0 && (offset % image_page_size != 0 || offset > size || entry.block_size > size - offset)) {
+                return false;
+            }
+        }
+        entries.push_back({std::move(path), entry.block_size, entry.size, block_offsets, entry.block_count});
+    }
+    return true;
+}
+
+// Delete all the files and directories. The filesystem is expected to have no descriptors.
+void freeNamespace() {
+    while (!rlist_empty(&file_list)) {
+        const auto current_file = rlist_first_entry(&file_list, file, in_file_list);
+        rlist_del(&current_file->in_file_list);
+        freeAllBlocks(current_file);
+        delete current_file;
+    }
+    freeDirectories(&root_directory);
+}
+
+/**
+ * An async request in the pool. Its tasks take the pieces one by one till none are left, so the request is done by
+ * any number of them, and the last one to finish completes it.
+ */
+struct async_op {
+    ufs_async *request = nullptr;
+    bool is_write = false;
+    std::size_t piece_count = 0;
+    std::atomic<std::size_t> next_piece{0};
+    std::atomic<std::size_t> done_size{0};
+    // The first error of the pieces
+    std::atomic<int> error{UFS_ERR_NO_ERR};
+    // The tasks not finished yet, and one more for the submitter
+    std::atomic<int> task_count{0};
+};
+
+void asyncRelease(async_op *op) {
+    if (op->task_count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    ufs_async *request = op->request;
+    request->error = static_cast<ufs_error_code>(op->error.load(std::memory_order_relaxed));
+    request->result = request->error != UFS_ERR_NO_ERR ? failure
+                                                       : static_cast<ssize_t>(op->done_size.load(std::memory_order_relaxed));
+    delete op;
+    request->on_done(request);
+}
+
+// A piece after an EOF reads nothing, so the read pieces are always the beginning of the range
+void asyncRun(void *arg) {
+    const auto op = static_cast<async_op *>(arg);
+    const ufs_async *request = op->request;
+    while (true) {
+        const std::size_t piece = op->next_piece.fetch_add(1, std::memory_order_relaxed);
+        if (piece >= op->piece_count) {
+            break;
+        }
+        const std::size_t begin = piece * ASYNC_PIECE_SIZE;
+        const std::size_t size = op->is_write ? request->size : std::min<std::size_t>(ASYNC_PIECE_SIZE, request->size - begin);
+        const ssize_t result = op->is_write
+                                   ? ufs_pwrite(request->file_descriptor, request->buffer, size, request->offset)
+                                   : ufs_pread(request->file_descriptor, request->buffer + begin, size,
+                                               request->offset + begin);
+        if (result < 0) {
+            int expected = UFS_ERR_NO_ERR;
+            op->error.compare_exchange_strong(expected, ufs_errno(), std::memory_order_relaxed);
+            continue;
+        }
+        op->done_size.fetch_add(static_cast<std::size_t>(result), std::memory_order_relaxed);
+    }
+    asyncRelease(op);
+}
+
+int asyncSubmit(thread_pool *pool, ufs_async *request, const bool is_write) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (pool == nullptr || request == nullptr || request->on_done == nullptr ||
+        (request->buffer == nullptr && request->size != 0)) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    const auto op = new async_op();
+    op->request = request;
+    op->is_write = is_write;
+    // Even an empty one checks the descriptor
+    op->piece_count = is_write ? 1 : std::max<std::size_t>(1, (request->size + ASYNC_PIECE_SIZE - 1) / ASYNC_PIECE_SIZE);
+    const int task_count = static_cast<int>(std::min<std::size_t>(op->piece_count, ASYNC_MAX_TASKS));
+    op->task_count.store(task_count + 1, std::memory_order_relaxed);
+    int submitted = 0;
+    while (submitted < task_count && thread_pool_submit(pool, asyncRun, op) == 0) {
+        ++submitted;
+    }
+    if (submitted == 0) {
+        delete op;
+        set_ufs_errno(UFS_ERR_NO_MEM);
+        return failure;
+    }
+    // The submitted tasks do all the pieces anyway
+    op->task_count.fetch_sub(task_count - submitted, std::memory_order_relaxed);
+    asyncRelease(op);
+    return success;
+}
+
 /* -------------------------------------------- *** -------------------------------------------- */
 }    // namespace
 
@@ -239,27 +1074,29 @@ int ufs_open(const char *filename, const int flags) {
         set_ufs_errno(UFS_ERR_NO_FILE);
         return failure;
     }
+    const std::unique_lock namespace_guard(namespace_lock);
 
     // Create new file descriptor:
     auto new_file_descriptor = std::make_unique<filedesc>();
     // Find file or create
     if (const auto found_file = findFile(filename); found_file == nullptr) {
-        if ((flags & UFS_CREATE) == 0) {
+        std::string_view name;
+        const auto parent = resolvePath(filename, name);
+        if ((flags & UFS_CREATE) == 0 || parent == nullptr) {
             set_ufs_errno(UFS_ERR_NO_FILE);
             return failure;
         }
+        if (isNameTaken(parent, name)) {
+            set_ufs_errno(UFS_ERR_EXISTS);
+            return failure;
+        }
 
-        // Create new file:
-        const auto new_file = new file();
-        new_file->name = filename;
-        new_file->references = 0;
-        new_file->size = 0;
-        new_file->block_count = 0;
-        new_file->is_this_deleted = false;
-        rlist_add_tail_entry(&file_list, new_file, in_file_list);
-
-        // Add file to descriptor
-        new_file_descriptor->at_file = new_file;
+        // Add new file to descriptor
+        std::size_t block_size = new_file_block_size;
+        if ((flags & UFS_SEQUENTIAL) != 0) {
+            block_size = std::max<std::size_t>(block_size, SEQUENTIAL_BLOCK_SIZE);
+        }
+        new_file_descriptor->at_file = createFile(parent, name, block_size);
     } else {
         new_file_descriptor->at_file = found_file;
     }
@@ -280,146 +1117,209 @@ int ufs_open(const char *filename, const int flags) {
         new_file_descriptor->readable = false;
         new_file_descriptor->writable = true;
     }
+    new_file_descriptor->is_append = (flags & UFS_APPEND) != 0;
 
     // Calculate descriptor
-    int descriptor;
-    if (const auto find_iter = fileDescriptorsFirstNullCell(); find_iter == std::end(file_descriptors_table)) {
-        file_descriptors_table.push_back(std::move(new_file_descriptor));
-        descriptor = static_cast<int>(file_descriptors_table.size());
-    } else {
-        *find_iter = std::move(new_file_descriptor);
-        descriptor = static_cast<int>(std::distance(std::begin(file_descriptors_table), find_iter)) + 1;
+    return static_cast<int>(fileDescriptorsInsert(std::move(new_file_descriptor))) + 1;
+}
+
+ssize_t ufs_write(const int file_descriptor, const char *buffer, const std::size_t size) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, false, true);
+    if (descriptor == nullptr) {
+        return failure;
+    }
+    if (size == 0) {
+        return success;
     }
+    const std::lock_guard cursor_guard(descriptor->cursor_mutex);
+    const std::unique_lock file_guard(descriptor->at_file->lock);
+    syncWriteCursor(descriptor);
+    if (!prepareWrite(descriptor->at_file, descriptor->cursor_position, size)) {
+        return failure;
+    }
+    writeBlocks(descriptor->at_file, descriptor->cursor_position, buffer, size);
+    descriptor->cursor_position += size;
+    finishWrite(descriptor->at_file, descriptor->cursor_position);
 
-    return descriptor;
+    return static_cast<ssize_t>(size);
 }
 
-ssize_t ufs_write(const int file_descriptor, const char *buffer, const std::size_t size) {
+ssize_t ufs_read(const int file_descriptor, char *buffer, const std::size_t size) {
     set_ufs_errno(UFS_ERR_NO_ERR);
-    if (!isValidFileDescriptor(file_descriptor)) {
-        set_ufs_errno(UFS_ERR_NO_FILE);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, true, false);
+    if (descriptor == nullptr) {
         return failure;
     }
-    const auto descriptor_index = file_descriptor - 1;
-    const auto &descriptor_pointer = file_descriptors_table[descriptor_index];
-    if (!descriptor_pointer->writable) {
-        set_ufs_errno(UFS_ERR_NO_PERMISSION);
+    const std::lock_guard cursor_guard(descriptor->cursor_mutex);
+    const std::shared_lock file_guard(descriptor->at_file->lock);
+    syncCursor(descriptor);
+    const auto bytes_read = readAt(descriptor->at_file, descriptor->cursor_position, buffer, size);
+    descriptor->cursor_position += bytes_read;
+
+    return static_cast<ssize_t>(bytes_read);
+}
+
+ssize_t ufs_pwrite(const int file_descriptor, const char *buffer, const std::size_t size, const std::size_t offset) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, false, true);
+    if (descriptor == nullptr) {
         return failure;
     }
     if (size == 0) {
         return success;
     }
-
-    if (size > MAX_FILE_SIZE - descriptor_pointer->cursor_position) {
-        set_ufs_errno(UFS_ERR_NO_MEM);
+    const std::unique_lock file_guard(descriptor->at_file->lock);
+    if (!prepareWrite(descriptor->at_file, offset, size)) {
         return failure;
     }
+    writeBlocks(descriptor->at_file, offset, buffer, size);
+    finishWrite(descriptor->at_file, offset + size);
 
-    const auto end_position = descriptor_pointer->cursor_position + size;
-    if (end_position > MAX_FILE_SIZE) {
-        set_ufs_errno(UFS_ERR_NO_MEM);
+    return static_cast<ssize_t>(size);
+}
+
+ssize_t ufs_pread(const int file_descriptor, char *buffer, const std::size_t size, const std::size_t offset) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, true, false);
+    if (descriptor == nullptr) {
         return failure;
     }
+    const std::shared_lock file_guard(descriptor->at_file->lock);
+    return static_cast<ssize_t>(readAt(descriptor->at_file, offset, buffer, size));
+}
 
-    assert(descriptor_pointer->at_file != nullptr);
-    if (!ensureEnoughCapacity(descriptor_pointer->at_file, end_position)) {
-        set_ufs_errno(UFS_ERR_NO_MEM);
+ssize_t ufs_writev(const int file_descriptor, const iovec *vector, const int count) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, false, true);
+    if (descriptor == nullptr) {
         return failure;
     }
-    if (descriptor_pointer->current_block == nullptr) {
-        setCursor(descriptor_pointer, descriptor_pointer->cursor_position);
-    }
-
-    std::size_t bytes_written = 0;
-    while (bytes_written < size) {
-        const std::size_t available = BLOCK_SIZE - descriptor_pointer->current_offset;
-        const std::size_t chunk = std::min(available, size - bytes_written);
-        std::memcpy(descriptor_pointer->current_block->memory + descriptor_pointer->current_offset,
-                    buffer + bytes_written,
-                    chunk);
-        bytes_written += chunk;
-        descriptor_pointer->cursor_position += chunk;
-        descriptor_pointer->current_offset += chunk;
-        if (descriptor_pointer->current_offset == BLOCK_SIZE) {
-            descriptor_pointer->current_block =
-                    nextBlock(descriptor_pointer->at_file, descriptor_pointer->current_block);
-            descriptor_pointer->current_offset = 0;
-            // cursor to next block
-            if (descriptor_pointer->current_block == nullptr) {
-                setCursor(descriptor_pointer, descriptor_pointer->cursor_position);
-            }
+    if (count < 0) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    // Validate and allocate once for all the buffers.
+    std::size_t total_size = 0;
+    for (int index = 0; index < count; ++index) {
+        if (vector[index].iov_len > MAX_FILE_SIZE - total_size) {
+            set_ufs_errno(UFS_ERR_NO_MEM);
+            return failure;
         }
+        total_size += vector[index].iov_len;
+    }
+    if (total_size == 0) {
+        return success;
+    }
+    const std::lock_guard cursor_guard(descriptor->cursor_mutex);
+    const std::unique_lock file_guard(descriptor->at_file->lock);
+    syncWriteCursor(descriptor);
+    if (!prepareWrite(descriptor->at_file, descriptor->cursor_position, total_size)) {
+        return failure;
+    }
+    for (int index = 0; index < count; ++index) {
+        writeBlocks(descriptor->at_file,
+                    descriptor->cursor_position,
+                    static_cast<const char *>(vector[index].iov_base),
+                    vector[index].iov_len);
+        descriptor->cursor_position += vector[index].iov_len;
     }
-    descriptor_pointer->at_file->size = std::max(descriptor_pointer->at_file->size, end_position);
+    finishWrite(descriptor->at_file, descriptor->cursor_position);
 
-    return static_cast<ssize_t>(bytes_written);
+    return static_cast<ssize_t>(total_size);
 }
 
-ssize_t ufs_read(const int file_descriptor, char *buffer, const std::size_t size) {
+ssize_t ufs_readv(const int file_descriptor, const iovec *vector, const int count) {
     set_ufs_errno(UFS_ERR_NO_ERR);
-    if (!isValidFileDescriptor(file_descriptor)) {
-        set_ufs_errno(UFS_ERR_NO_FILE);
-        return -1;
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, true, false);
+    if (descriptor == nullptr) {
+        return failure;
     }
-    const auto descriptor_index = file_descriptor - 1;
-    const auto &descriptor_pointer = file_descriptors_table[descriptor_index];
-    if (!descriptor_pointer->readable) {
-        set_ufs_errno(UFS_ERR_NO_PERMISSION);
+    if (count < 0) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
         return failure;
     }
-    if (size == 0) {
-        return success;
+    const std::lock_guard cursor_guard(descriptor->cursor_mutex);
+    const std::shared_lock file_guard(descriptor->at_file->lock);
+    syncCursor(descriptor);
+    std::size_t total_size = 0;
+    for (int index = 0; index < count; ++index) {
+        const auto bytes_read = readAt(descriptor->at_file,
+                                       descriptor->cursor_position,
+                                       static_cast<char *>(vector[index].iov_base),
+                                       vector[index].iov_len);
+        descriptor->cursor_position += bytes_read;
+        total_size += bytes_read;
+        if (bytes_read < vector[index].iov_len) {
+            break;
+        }
     }
-    const auto file = descriptor_pointer->at_file;
-    assert(file != nullptr);
 
-    if (descriptor_pointer->cursor_position >= file->size) {
+    return static_cast<ssize_t>(total_size);
+}
+
+ssize_t ufs_map_range(const int file_descriptor,
+                      const std::size_t offset,
+                      const std::size_t size,
+                      const ufs_map_f callback,
+                      void *ctx) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, true, false);
+    if (descriptor == nullptr) {
+        return failure;
+    }
+    const auto current_file = descriptor->at_file;
+    const std::shared_lock file_guard(current_file->lock);
+    if (offset >= current_file->size) {
         return success;
     }
-
-    const auto remaining_bytes = file->size - descriptor_pointer->cursor_position;
-    const auto bytes_to_read = std::min(size, remaining_bytes);
-    if (descriptor_pointer->current_block == nullptr && bytes_to_read > 0) {
-        setCursor(descriptor_pointer, descriptor_pointer->cursor_position);
-    }
-
-    std::size_t bytes_read_total = 0;
-    while (bytes_read_total < bytes_to_read) {
-        const auto available_bytes = BLOCK_SIZE - descriptor_pointer->current_offset;
-        const std::size_t chunk = std::min(available_bytes, bytes_to_read - bytes_read_total);
-        std::memcpy(buffer + bytes_read_total,
-                    descriptor_pointer->current_block->memory + descriptor_pointer->current_offset,
-                    chunk);
-        bytes_read_total += chunk;
-        descriptor_pointer->cursor_position += chunk;
-        descriptor_pointer->current_offset += chunk;
-        if (descriptor_pointer->current_offset == BLOCK_SIZE) {
-            descriptor_pointer->current_block =
-                    nextBlock(descriptor_pointer->at_file, descriptor_pointer->current_block);
-            descriptor_pointer->current_offset = 0;
-            // cursor to next block
-            if (descriptor_pointer->current_block == nullptr) {
-                setCursor(descriptor_pointer, descriptor_pointer->cursor_position);
-            }
+    const std::size_t block_size = current_file->block_size;
+    const std::size_t end_position = offset + std::min(size, current_file->size - offset);
+    std::size_t position = offset;
+    while (position < end_position) {
+        const std::size_t block_offset = position % block_size;
+        const std::size_t chunk = std::min(block_size - block_offset, end_position - position);
+        const auto current_block = current_file->blocks[position / block_size];
+        const char *data = current_block == nullptr ? zero_block : current_block + block_offset;
+        position += chunk;
+        if (callback(data, chunk, ctx) != 0) {
+            break;
         }
     }
 
-    return static_cast<ssize_t>(bytes_read_total);
+    return static_cast<ssize_t>(position - offset);
+}
+
+int ufs_read_async(thread_pool *pool, ufs_async *request) {
+    return asyncSubmit(pool, request, false);
+}
+
+int ufs_write_async(thread_pool *pool, ufs_async *request) {
+    return asyncSubmit(pool, request, true);
 }
 
 int ufs_close(const int file_descriptor) {
     set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::unique_lock namespace_guard(namespace_lock);
     if (!isValidFileDescriptor(file_descriptor)) {
         set_ufs_errno(UFS_ERR_NO_FILE);
         return failure;
     }
 
     const auto descriptor_index = file_descriptor - 1;
-    auto &descriptor_pointer = file_descriptors_table[descriptor_index];
-    const auto file = descriptor_pointer->at_file;
+    const auto file = file_descriptors_table[descriptor_index]->at_file;
     assert(file != nullptr);
+    // The I/O calls are out, the file is not locked
+    catchUpShrinks(file_descriptors_table[descriptor_index].get());
     // remove from table
-    descriptor_pointer.reset(nullptr);
+    fileDescriptorsErase(descriptor_index);
     --file->references;
     if (file->references == 0 && file->is_this_deleted == true) {
         freeAllBlocks(file);
@@ -435,6 +1335,7 @@ int ufs_delete(const char *filename) {
         set_ufs_errno(UFS_ERR_NO_FILE);
         return failure;
     }
+    const std::unique_lock namespace_guard(namespace_lock);
     const auto file_to_delete = findFile(filename);
     if (file_to_delete == nullptr) {
         set_ufs_errno(UFS_ERR_NO_FILE);
@@ -443,6 +1344,8 @@ int ufs_delete(const char *filename) {
 
     // Make ghost file
     rlist_del(&file_to_delete->in_file_list);
+    file_to_delete->parent->files.erase(file_to_delete->name);
+    file_to_delete->parent = nullptr;
     file_to_delete->is_this_deleted = true;
     if (file_to_delete->references == 0) {
         freeAllBlocks(file_to_delete);
@@ -456,33 +1359,29 @@ int ufs_delete(const char *filename) {
 
 int ufs_resize(const int file_descriptor, const std::size_t new_size) {
     set_ufs_errno(UFS_ERR_NO_ERR);
-    if (!isValidFileDescriptor(file_descriptor)) {
-        set_ufs_errno(UFS_ERR_NO_FILE);
-        return -1;
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor_pointer = openedDescriptor(file_descriptor, false, true);
+    if (descriptor_pointer == nullptr) {
+        return failure;
     }
     if (new_size > MAX_FILE_SIZE) {
         set_ufs_errno(UFS_ERR_NO_MEM);
-        return -1;
-    }
-
-    const auto descriptor_index = file_descriptor - 1;
-    const auto &descriptor_pointer = file_descriptors_table[descriptor_index];
-    if (!descriptor_pointer->writable) {
-        set_ufs_errno(UFS_ERR_NO_PERMISSION);
         return failure;
     }
     const auto current_file = descriptor_pointer->at_file;
-    assert(current_file != nullptr);
+    const std::lock_guard cursor_guard(descriptor_pointer->cursor_mutex);
+    const std::unique_lock file_guard(current_file->lock);
     const std::size_t old_size = current_file->size;
     if (new_size == old_size) {
         return success;
     }
+    const std::size_t block_size = current_file->block_size;
 
     // shrink:
     if (new_size < old_size) {
         std::size_t needed_blocks;
         if (new_size != 0) {
-            needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            needed_blocks = (new_size + block_size - 1) / block_size;
         } else {
             needed_blocks = 0;
         }
@@ -490,31 +1389,42 @@ int ufs_resize(const int file_descriptor, const std::size_t new_size) {
         if (needed_blocks == 0) {
             freeAllBlocks(current_file);
         } else {
-            while (current_file->block_count > needed_blocks) {
-                const auto last_block = rlist_last_entry(&current_file->blocks, block, in_block_list);
-                rlist_del(&last_block->in_block_list);
-                delete last_block;
-                --current_file->block_count;
-            }
-            if (new_size % BLOCK_SIZE != 0) {
-                const auto last_block = rlist_last_entry(&current_file->blocks, block, in_block_list);
-                const auto current_offset = new_size % BLOCK_SIZE;
-                std::memset(last_block->memory + current_offset, 0, BLOCK_SIZE - current_offset);
+            truncateBlocks(current_file, needed_blocks);
+            if (new_size % block_size != 0) {
+                const auto current_offset = new_size % block_size;
+                if (current_file->blocks.back() != nullptr) {
+                    const auto last_block = writableBlock(current_file, needed_blocks - 1, false);
+                    std::memset(last_block + current_offset, 0, block_size - current_offset);
+                }
             }
         }
         current_file->size = new_size;
 
-        // clamp all descriptors
-        for (const auto &descriptor : file_descriptors_table) {
-            if (descriptor == nullptr) {
-                continue;
-            }
-            if (descriptor->at_file != current_file) {
-                continue;
-            }
-            if (descriptor->cursor_position >= new_size) {
-                setCursor(descriptor, new_size);
-            }
+        /*
+         * The other descriptors catch up on their next cursor I/O, see syncCursor(). This one does right away, so a
+         * file with one descriptor keeps no shrinks.
+         */
+        syncCursor(descriptor_pointer);
+        auto &shrinks = current_file->shrinks;
+        shrinks.erase(std::remove_if(std::begin(shrinks), std::end(shrinks),
+                                     [](const shrink_entry &entry) -> bool {
+                                         return entry.waiting.load(std::memory_order_relaxed) == 0;
+                                     }),
+                      std::end(shrinks));
+        // Those at the last shrink are behind this one now, and so are those waiting for the bigger ones
+        int waiting = current_file->references - 1;
+        for (const auto &entry : shrinks) {
+            waiting -= entry.waiting.load(std::memory_order_relaxed);
+        }
+        while (!shrinks.empty() && shrinks.back().size >= new_size) {
+            waiting += shrinks.back().waiting.load(std::memory_order_relaxed);
+            shrinks.pop_back();
+        }
+        ++current_file->shrink_generation;
+        descriptor_pointer->cursor_position = std::min(descriptor_pointer->cursor_position, new_size);
+        descriptor_pointer->shrink_generation = current_file->shrink_generation;
+        if (waiting > 0) {
+            shrinks.emplace_back(current_file->shrink_generation, new_size, waiting);
         }
     }
     // expand
@@ -523,26 +1433,368 @@ int ufs_resize(const int file_descriptor, const std::size_t new_size) {
             set_ufs_errno(UFS_ERR_NO_MEM);
             return failure;
         }
-        if (old_size > 0 && (old_size % BLOCK_SIZE) != 0) {
-            const std::size_t idx = old_size / BLOCK_SIZE;
-            const std::size_t off = old_size % BLOCK_SIZE;
+        if (old_size > 0 && (old_size % block_size) != 0) {
+            const std::size_t idx = old_size / block_size;
+            const std::size_t off = old_size % block_size;
 
-            block *current_block = firstBlock(current_file);
-            for (std::size_t index = 0; current_block != nullptr && index < idx; ++index) {
-                current_block = nextBlock(current_file, current_block);
+            if (current_file->blocks[idx] != nullptr) {
+                std::memset(writableBlock(current_file, idx, false) + off, 0, block_size - off);
             }
+        }
+        current_file->size = new_size;
+    }
+
+    return success;
+}
+
+#endif
+
+int ufs_set_block_size(const std::size_t block_size) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (block_size < UFS_MIN_BLOCK_SIZE || block_size > UFS_MAX_BLOCK_SIZE) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    new_file_block_size = block_size;
+    return success;
+}
 
+int ufs_stat(const int file_descriptor, ufs_file_stat *stat) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto descriptor = openedDescriptor(file_descriptor, false, false);
+    if (descriptor == nullptr) {
+        return failure;
+    }
+    if (stat == nullptr) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    const file *current_file = descriptor->at_file;
+    const std::shared_lock file_guard(descriptor->at_file->lock);
+    stat->size = current_file->size;
+    stat->block_size = current_file->block_size;
+    stat->block_count = current_file->blocks.size();
+    stat->allocated_size = current_file->allocated_blocks * current_file->block_size;
+    stat->descriptor_count = current_file->references;
+    stat->is_deleted = current_file->is_this_deleted;
+    return success;
+}
+
+int ufs_fs_stats(ufs_fs_stat *stat) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (stat == nullptr) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    *stat = {};
+    const std::shared_lock namespace_guard(namespace_lock);
+    for ([[maybe_unused]] const file *current_file : allFiles()) {
+        ++stat->file_count;
+    }
+    // The deleted files are reachable only by their descriptors.
+    std::unordered_set<const file *> deleted_files;
+    for (const auto &descriptor : file_descriptors_table) {
+        if (descriptor == nullptr) {
+            continue;
+        }
+        ++stat->descriptor_count;
+        file *deleted_file = descriptor->at_file;
+        if (!deleted_file->is_this_deleted || !deleted_files.insert(deleted_file).second) {
+            continue;
+        }
+        const std::shared_lock file_guard(deleted_file->lock);
+        stat->deleted_allocated_size += deleted_file->allocated_blocks * deleted_file->block_size;
+    }
+    stat->deleted_file_count = deleted_files.size();
+    stat->used_memory = used_memory;
+    for (const auto &pool : block_pools) {
+        const std::lock_guard guard(pool->mutex);
+        const std::size_t count = std::max<std::size_t>(1, SLAB_SIZE / pool->block_size);
+        stat->pool_memory += pool->slabs.size() * count * pool->block_size;
+    }
+    for (const auto &mapping : image_mappings) {
+        stat->image_memory += mapping.size;
+    }
+    stat->memory_limit = memory_limit;
+    return success;
+}
+
+int ufs_set_memory_limit(const std::size_t limit) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::unique_lock namespace_guard(namespace_lock);
+    memory_limit = limit;
+    return success;
+}
+
+int ufs_set_dedup(const bool is_enabled) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    const std::unique_lock namespace_guard(namespace_lock);
+    is_dedup_enabled = is_enabled;
+    return success;
+}
+
+int ufs_clone(const char *source, const char *destination) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (source == nullptr || destination == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    file *source_file = findFile(source);
+    if (source_file == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    std::string_view name;
+    const auto parent = resolvePath(destination, name);
+    if (parent == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    if (isNameTaken(parent, name)) {
+        set_ufs_errno(UFS_ERR_EXISTS);
+        return failure;
+    }
+    file *new_file = createFile(parent, name, source_file->block_size);
+    new_file->size = source_file->size;
+    new_file->blocks = source_file->blocks;
+    new_file->allocated_blocks = source_file->allocated_blocks;
+    new_file->has_shared_blocks = true;
+    source_file->has_shared_blocks = true;
+    const std::lock_guard guard(shared_blocks_mutex);
+    for (const block current_block : new_file->blocks) {
+        if (current_block != nullptr) {
+            auto &owner_count = shared_blocks[current_block];
+            owner_count = std::max<std::size_t>(owner_count, 1) + 1;
+        }
+    }
+    return success;
+}
+
+int ufs_mkdir(const char *path) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (path == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    std::string_view name;
+    const auto parent = resolvePath(path, name);
+    if (parent == nullptr) {
+        set_ufs_errno(name.empty() ? UFS_ERR_EXISTS : UFS_ERR_NO_FILE);
+        return failure;
+    }
+    if (isNameTaken(parent, name)) {
+        set_ufs_errno(UFS_ERR_EXISTS);
+        return failure;
+    }
+    createDirectory(parent, name);
+    return success;
+}
+
+int ufs_rmdir(const char *path) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (path == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    const auto directory_to_delete = findDirectory(path);
+    if (directory_to_delete == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return failure;
+    }
+    if (directory_to_delete == &root_directory || !directory_to_delete->files.empty() ||
+        !directory_to_delete->directories.empty()) {
+        set_ufs_errno(UFS_ERR_NOT_EMPTY);
+        return failure;
+    }
+    directory_to_delete->parent->directories.erase(directory_to_delete->name);
+    delete directory_to_delete;
+    return success;
+}
+
+ufs_dir *ufs_opendir(const char *path) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (path == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return nullptr;
+    }
+    const std::shared_lock namespace_guard(namespace_lock);
+    const auto found = findDirectory(path);
+    if (found == nullptr) {
+        set_ufs_errno(UFS_ERR_NO_FILE);
+        return nullptr;
+    }
+    auto result = std::make_unique<ufs_dir>();
+    result->names.reserve(found->directories.size() + found->files.size());
+    result->entries.reserve(found->directories.size() + found->files.size());
+    for (const auto &entry : found->directories) {
+        result->names.emplace_back(entry.first);
+        result->entries.push_back({result->names.back().c_str(), true});
+    }
+    for (const auto &entry : found->files) {
+        result->names.emplace_back(entry.first);
+        result->entries.push_back({result->names.back().c_str(), false});
+    }
+    return result.release();
+}
+
+const ufs_dirent *ufs_readdir(ufs_dir *dir) {
+    if (dir == nullptr || dir->position == dir->entries.size()) {
+        return nullptr;
+    }
+    return &dir->entries[dir->position++];
+}
+
+void ufs_closedir(ufs_dir *dir) {
+    delete dir;
+}
+
+int ufs_image_save(const char *path) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (path == nullptr) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    std::size_t data_offset = sizeof(image_header);
+    std::size_t data_size = 0;
+    std::vector<directory *> directories;
+    collectDirectories(&root_directory, directories);
+    std::vector<std::string> directory_paths;
+    for (const directory *current_directory : directories) {
+        directory_paths.push_back(pathOf(current_directory->parent, current_directory->name));
+        data_offset += imagePathSize(directory_paths.back());
+    }
+    std::vector<std::string> file_paths;
+    for (file *current_file : allFiles()) {
+        file_paths.push_back(pathOf(current_file->parent, current_file->name));
+        data_offset += imageFileEntrySize(file_paths.back(), current_file);
+        for (const block current_block : current_file->blocks) {
             if (current_block != nullptr) {
-                std::memset(current_block->memory + off, 0, BLOCK_SIZE - off);
+                data_size += current_file->block_size;
             }
         }
-        current_file->size = new_size;
     }
+    data_offset = alignUp(data_offset, image_page_size);
+    const std::size_t size = data_offset + data_size;
 
+    /*
+     * The image is written aside and then renamed, so a crash leaves the previous checkpoint intact. It also keeps
+     * alive the previous image if it is loaded, the mapping is private and would see the changes of its file.
+     */
+    const std::string temporary_path = std::string(path) + ".tmp";
+    const int image_descriptor = open(temporary_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (image_descriptor < 0) {
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
+    bool is_ok = ftruncate(image_descriptor, static_cast<off_t>(size)) == 0;
+    if (is_ok) {
+        void *image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, image_descriptor, 0);
+        is_ok = image != MAP_FAILED;
+        if (is_ok) {
+            imageFill(static_cast<char *>(image), size, data_offset, directory_paths, file_paths);
+            is_ok = msync(image, size, MS_SYNC) == 0;
+            munmap(image, size);
+        }
+    }
+    is_ok = close(image_descriptor) == 0 && is_ok;
+    if (!is_ok || rename(temporary_path.c_str(), path) != 0) {
+        unlink(temporary_path.c_str());
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
     return success;
 }
 
-#endif
+int ufs_image_load(const char *path) {
+    set_ufs_errno(UFS_ERR_NO_ERR);
+    if (path == nullptr) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+    const std::unique_lock namespace_guard(namespace_lock);
+    const bool is_empty =
+            rlist_empty(&file_list) &&
+            std::all_of(std::begin(file_descriptors_table),
+                        std::end(file_descriptors_table),
+                        [](const std::unique_ptr<filedesc> &descriptor_pointer) { return descriptor_pointer == nullptr; });
+    if (!is_empty) {
+        set_ufs_errno(UFS_ERR_INVALID_ARG);
+        return failure;
+    }
+
+    const int image_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    if (image_descriptor < 0) {
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
+    struct stat image_stat {};
+    if (fstat(image_descriptor, &image_stat) != 0 || image_stat.st_size < static_cast<off_t>(sizeof(image_header))) {
+        close(image_descriptor);
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
+    const auto size = static_cast<std::size_t>(image_stat.st_size);
+    // Private, so the blocks can be changed in place without touching the image until the next save.
+    void *image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_descriptor, 0);
+    close(image_descriptor);
+    if (image == MAP_FAILED) {
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
+    const auto image_memory = static_cast<char *>(image);
+    std::vector<std::string> directory_paths;
+    std::vector<image_entry> entries;
+    bool is_ok = imageParse(image_memory, size, directory_paths, entries);
+    std::vector<file *> new_files;
+    for (std::size_t index = 0; is_ok && index < directory_paths.size(); ++index) {
+        std::string_view name;
+        directory *parent = resolvePath(directory_paths[index].c_str(), name);
+        is_ok = parent != nullptr && !isNameTaken(parent, name);
+        if (is_ok) {
+            createDirectory(parent, name);
+        }
+    }
+    for (std::size_t index = 0; is_ok && index < entries.size(); ++index) {
+        std::string_view name;
+        directory *parent = resolvePath(entries[index].path.c_str(), name);
+        is_ok = parent != nullptr && !isNameTaken(parent, name);
+        if (is_ok) {
+            new_files.push_back(createFile(parent, name, entries[index].block_size));
+        }
+    }
+    if (!is_ok) {
+        // No blocks are taken from the image yet, so they do not get into the pools.
+        freeNamespace();
+        munmap(image, size);
+        set_ufs_errno(UFS_ERR_IO);
+        return failure;
+    }
+
+    // The data is not copied, the blocks are the image pages.
+    for (std::size_t file_index = 0; file_index < entries.size(); ++file_index) {
+        const auto &entry = entries[file_index];
+        file *new_file = new_files[file_index];
+        new_file->size = entry.size;
+        new_file->blocks.resize(entry.block_count);
+        for (std::size_t index = 0; index < entry.block_count; ++index) {
+            std::uint64_t offset;
+            std::memcpy(&offset, entry.block_offsets + index * sizeof(offset), sizeof(offset));
+            if (offset != 0) {
+                new_file->blocks[index] = image_memory + offset;
+                ++new_file->allocated_blocks;
+                used_memory += entry.block_size;
+            }
+        }
+    }
+    image_mappings.push_back({image, size});
+    return success;
+}
 
 void ufs_destroy() {
     /*
@@ -554,6 +1806,7 @@ void ufs_destroy() {
      * The recommended way of freeing the memory is to swap()
      * the vector with a temporary empty vector.
      */
+    const std::unique_lock namespace_guard(namespace_lock);
     for (auto &descriptor : file_descriptors_table) {
         if (descriptor == nullptr) {
             continue;
@@ -568,13 +1821,20 @@ void ufs_destroy() {
         }
     }
 
-    while (!rlist_empty(&file_list)) {
-        const auto current_file = rlist_first_entry(&file_list, file, in_file_list);
-        rlist_del(&current_file->in_file_list);
-        freeAllBlocks(current_file);
-        delete current_file;
+    freeNamespace();
+    std::unordered_map<block, std::size_t>().swap(shared_blocks);
+    std::vector<std::unique_ptr<block_pool>>().swap(block_pools);
+    for (const auto &mapping : image_mappings) {
+        munmap(mapping.memory, mapping.size);
     }
+    std::vector<image_mapping>().swap(image_mappings);
     // swap because of the capacity
     std::vector<std::unique_ptr<filedesc>>().swap(file_descriptors_table);
+    std::vector<std::uint64_t>().swap(free_descriptors);
+    first_free_word = 0;
+    new_file_block_size = DEFAULT_BLOCK_SIZE;
+    used_memory = 0;
+    memory_limit = 0;
+    is_dedup_enabled = false;
     set_ufs_errno(UFS_ERR_NO_ERR);
 }
@@ -1,14 +1,23 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cstddef>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks. The files
+ * are in a tree of directories. A file is named by a path, the
+ * names of the directories and of the file separated by '/', like
+ * "dir/subdir/file". A path without '/' is a file in the root
+ * directory. There are no "." and ".." entries.
+ *
+ * All the functions can be called from any threads. Reads of a
+ * file run in parallel, writes to a file are serialized, and the
+ * calls on different files do not wait for each other except for
+ * open, close, delete, clone and the image calls, which stop all
+ * the I/O for a moment. The error code is per thread.
  */
 
 /**
@@ -53,22 +62,47 @@ enum open_flags {
      * into the file.
      */
     UFS_READ_WRITE = UFS_READ_ONLY | UFS_WRITE_ONLY,
+    /**
+     * Each write through the descriptor goes to the end of the
+     * file, also when other descriptors append meanwhile. The
+     * reads go from the cursor, which is moved to the end by each
+     * write.
+     */
+    UFS_APPEND = 0b1000,
+    /**
+     * A hint that the file is going to be written and read from
+     * start to end in big pieces. The file created with it has
+     * big blocks, unless ufs_set_block_size() is already bigger,
+     * so the I/O goes in fewer and bigger copies. It does not
+     * change anything for an existing file.
+     */
+    UFS_SEQUENTIAL = 0b10000,
 #endif
 };
 
+/** Limits of a file block size, see ufs_set_block_size(). */
+enum {
+    UFS_MIN_BLOCK_SIZE = 4 * 1024,
+    UFS_MAX_BLOCK_SIZE = 1024 * 1024,
+};
+
 /** Possible errors from all functions. */
 enum ufs_error_code {
     UFS_ERR_NO_ERR = 0,
     UFS_ERR_NO_FILE,
     UFS_ERR_NO_MEM,
     UFS_ERR_NOT_IMPLEMENTED,
+    UFS_ERR_INVALID_ARG,
+    UFS_ERR_IO,
+    UFS_ERR_EXISTS,
+    UFS_ERR_NOT_EMPTY,
 
 #if NEED_OPEN_FLAGS
     UFS_ERR_NO_PERMISSION,
 #endif
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 ufs_error_code ufs_errno();
 
 /**
@@ -79,7 +113,8 @@ ufs_error_code ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or no such directory on the path.
+ *     - UFS_ERR_EXISTS - the path is a directory.
  */
 int ufs_open(const char *filename, int flags);
 
@@ -92,7 +127,8 @@ int ufs_open(const char *filename, int flags);
  * @retval > 0 How many bytes were written.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
- *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the memory limit
+ *       is reached, see ufs_set_memory_limit().
  */
 ssize_t ufs_write(int file_descriptor, const char *buffer, std::size_t size);
 
@@ -109,6 +145,162 @@ ssize_t ufs_write(int file_descriptor, const char *buffer, std::size_t size);
  */
 ssize_t ufs_read(int file_descriptor, char *buffer, std::size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor
+ * cursor is not used and not changed, so the descriptor can be
+ * shared by the writers of different ranges. Writing beyond the
+ * end of the file leaves a hole of zeros before the data.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param buffer Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the memory limit
+ *       is reached, see ufs_set_memory_limit().
+ */
+ssize_t ufs_pwrite(int file_descriptor, const char *buffer, std::size_t size,
+                   std::size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * cursor is not used and not changed.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param buffer Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t ufs_pread(int file_descriptor, char *buffer, std::size_t size,
+                  std::size_t offset);
+
+/**
+ * Write the buffers one after another from the descriptor cursor,
+ * like ufs_write() of each of them, but the descriptor and the
+ * total size are checked once. Either all the data is written, or
+ * nothing.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param vector Buffers to write.
+ * @param count Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the memory limit
+ *       is reached, see ufs_set_memory_limit().
+ *     - UFS_ERR_INVALID_ARG - negative @a count.
+ */
+ssize_t ufs_writev(int file_descriptor, const struct iovec *vector, int count);
+
+/**
+ * Read into the buffers one after another from the descriptor
+ * cursor, like ufs_read() into each of them. Stops at the end of
+ * the file.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param vector Buffers to read into.
+ * @param count Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a count.
+ */
+ssize_t ufs_readv(int file_descriptor, const struct iovec *vector, int count);
+
+/**
+ * Callback of ufs_map_range() for each contiguous piece of the
+ * file data. Return not 0 to stop the mapping.
+ */
+typedef int (*ufs_map_f)(const char *data, std::size_t size, void *ctx);
+
+/**
+ * Give the file data at the given range to the callback without
+ * copying it, piece by piece in the order of the offsets. A piece
+ * is never bigger than a block. The memory is valid only during
+ * the callback and must not be changed. The file is locked for
+ * reading during the whole call, so the callback must not write
+ * it, nor open, close, delete or resize any files. The descriptor
+ * cursor is not used and not changed.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param offset Position in the file to start from.
+ * @param size Maximum bytes to map.
+ * @param callback Function to call for each piece.
+ * @param ctx Argument for the callback.
+ *
+ * @retval >= 0 How many bytes were given to the callback, including
+ *     the piece on which it stopped. Less than @a size at EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t ufs_map_range(int file_descriptor, std::size_t offset,
+                      std::size_t size, ufs_map_f callback, void *ctx);
+
+struct thread_pool;
+struct ufs_async;
+
+/** Completion of an async request, called in a thread of the pool. */
+typedef void (*ufs_async_f)(struct ufs_async *request);
+
+/**
+ * A read or a write run in a thread pool of the homework 4, see
+ * ufs_read_async(). The caller fills the request and keeps it and
+ * the buffer till the completion.
+ */
+struct ufs_async {
+    /** File descriptor from ufs_open(). */
+    int file_descriptor;
+    /** Buffer to read into or to write from. */
+    char *buffer;
+    std::size_t size;
+    /** Position in the file, the descriptor cursor is not used. */
+    std::size_t offset;
+    /** Called once when the request is done. */
+    ufs_async_f on_done;
+    /** Anything for the completion. */
+    void *arg;
+    /**
+     * Set before on_done is called: the result like of ufs_pread()
+     * or ufs_pwrite(), and the error code when it is -1.
+     */
+    ssize_t result;
+    enum ufs_error_code error;
+};
+
+/**
+ * Read from the file like ufs_pread(), but in the threads of @a pool.
+ * A big read is split into pieces read by many threads at once. The
+ * call doesn't wait, so a coroutine scheduler or an event loop goes
+ * on meanwhile. The completion comes from a pool thread, and the
+ * waiter is to be woken up from there. For example, a coroutine can
+ * wait in coro_bus_mt_recv() for the completion sending the request
+ * id with coro_bus_mt_try_send(). The file must stay open till the
+ * completion.
+ * @param pool Thread pool to run in.
+ * @param request The request, with on_done.
+ *
+ * @retval 0 Success, on_done will be called.
+ * @retval -1 Error occurred, on_done won't be called. Check
+ *     ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no pool, request, callback or buffer.
+ *     - UFS_ERR_NO_MEM - the pool has too many tasks.
+ */
+int ufs_read_async(struct thread_pool *pool, struct ufs_async *request);
+
+/**
+ * Write to the file like ufs_pwrite(), but in a thread of @a pool,
+ * see ufs_read_async(). A write is not split, as the writes to one
+ * file are serialized anyway, but the writes to different files run
+ * in parallel.
+ */
+int ufs_write_async(struct thread_pool *pool, struct ufs_async *request);
+
 /**
  * Close a file.
  * @param file_descriptor File descriptor from ufs_open().
@@ -156,6 +348,207 @@ int ufs_resize(int file_descriptor, std::size_t new_size);
 
 #endif
 
+/**
+ * Set the block size of the files created after the call. The
+ * existing files keep their block size. Bigger blocks make the
+ * large sequential reads and writes copy the data in fewer and
+ * bigger chunks, but even an empty file takes a whole block once
+ * anything is written into it.
+ *
+ * @param block_size New block size, from UFS_MIN_BLOCK_SIZE to
+ *     UFS_MAX_BLOCK_SIZE.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - the size is out of the limits.
+ */
+int ufs_set_block_size(std::size_t block_size);
+
+/** Memory usage of a file, see ufs_stat(). */
+struct ufs_file_stat {
+    /** Size of the file data. */
+    std::size_t size;
+    std::size_t block_size;
+    /** Blocks covering the size, holes included. */
+    std::size_t block_count;
+    /**
+     * Bytes of the blocks which are not holes. The blocks shared
+     * with the clones are counted in each of them.
+     */
+    std::size_t allocated_size;
+    /** Opened descriptors of the file. */
+    int descriptor_count;
+    /** The file is deleted but still holds the memory. */
+    bool is_deleted;
+};
+
+/**
+ * Get the memory usage of the file opened by the descriptor.
+ * @param file_descriptor File descriptor from ufs_open().
+ * @param[out] stat The usage.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int ufs_stat(int file_descriptor, struct ufs_file_stat *stat);
+
+/** Memory usage of the whole filesystem, see ufs_fs_stats(). */
+struct ufs_fs_stat {
+    /** Files in the directories. */
+    std::size_t file_count;
+    /** Deleted files kept by their opened descriptors. */
+    std::size_t deleted_file_count;
+    /** Bytes allocated by the deleted files. */
+    std::size_t deleted_allocated_size;
+    std::size_t descriptor_count;
+    /**
+     * Bytes of the blocks held by all the files, each shared block
+     * counted once. This is what the memory limit is about.
+     */
+    std::size_t used_memory;
+    /**
+     * Bytes taken from the heap for the blocks, the free ones
+     * included. It is not returned to the heap until ufs_destroy().
+     */
+    std::size_t pool_memory;
+    /** Bytes of the loaded images, see ufs_image_load(). */
+    std::size_t image_memory;
+    /** See ufs_set_memory_limit(), 0 if there is no limit. */
+    std::size_t memory_limit;
+};
+
+/**
+ * Get the memory usage of the filesystem. It takes the time by the
+ * number of the files and descriptors.
+ * @param[out] stat The usage.
+ * @retval 0 Success.
+ */
+int ufs_fs_stats(struct ufs_fs_stat *stat);
+
+/**
+ * Limit the memory held by the file blocks, used_memory in
+ * ufs_fs_stat. A write which would need to allocate more fails
+ * before changing anything. The writes into different files are
+ * checked concurrently and can together exceed the limit by their
+ * sizes. Resizes are not limited.
+ * @param limit Limit in bytes, 0 to remove it.
+ * @retval 0 Success.
+ */
+int ufs_set_memory_limit(std::size_t limit);
+
+/**
+ * Deduplicate the file blocks by their content. Each block written
+ * to its end is hashed, and if another block has the same data,
+ * the file takes that one instead, shared like with a clone. Then
+ * the memory is taken by the different blocks rather than by the
+ * copies of the files. The hashing makes the writes slower. The
+ * blocks written before are not deduplicated, and the shared ones
+ * stay shared when it is turned off. Off by default.
+ * @param is_enabled Whether to deduplicate the next writes.
+ * @retval 0 Success.
+ */
+int ufs_set_dedup(bool is_enabled);
+
+/**
+ * Create a file with the same data as another one, without copying
+ * it. The files share the blocks, and a block is copied only when
+ * one of the files writes into it, so the clone takes the memory
+ * only of what is changed.
+ *
+ * @param source Name of the file to clone.
+ * @param destination Name of the new file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file as @a source, or no such
+ *       directory on the path of @a destination.
+ *     - UFS_ERR_EXISTS - @a destination already exists.
+ */
+int ufs_clone(const char *source, const char *destination);
+
+/**
+ * Create a directory.
+ * @param path Path of the new directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory on the path.
+ *     - UFS_ERR_EXISTS - a file or a directory with this path
+ *       exists.
+ */
+int ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries, or is the
+ *       root.
+ */
+int ufs_rmdir(const char *path);
+
+/** An entry of a directory listing. */
+struct ufs_dirent {
+    /** Name in the directory, without the path. */
+    const char *name;
+    bool is_directory;
+};
+
+/** A directory listing, see ufs_opendir(). */
+struct ufs_dir;
+
+/**
+ * List a directory. The listing is made at once, in no particular
+ * order, and is not affected by the later changes. It takes the
+ * time and the memory by the directory size.
+ * @param path Path of the directory. "" and "/" are the root.
+ * @retval not NULL The listing, to be freed by ufs_closedir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ */
+struct ufs_dir *ufs_opendir(const char *path);
+
+/**
+ * Get the next entry of the listing. It is valid until the listing
+ * is closed.
+ * @retval NULL No more entries.
+ */
+const struct ufs_dirent *ufs_readdir(struct ufs_dir *dir);
+
+/** Free the listing. */
+void ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Save all the files into an image at the given path, which can be
+ * loaded by ufs_image_load() in another process. The directories
+ * are saved too. The opened but deleted files are not saved. The image is written next to the
+ * path, synced to the disk and then renamed, so the path always
+ * has either the previous or the new complete image. It takes the
+ * disk space of the files' allocated blocks.
+ *
+ * @param path Path of the image on the disk.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can't be written.
+ */
+int ufs_image_save(const char *path);
+
+/**
+ * Load the files from an image made by ufs_image_save(). The
+ * filesystem must have no files and descriptors, like right after
+ * the start or after ufs_destroy(). The image is mapped into the
+ * memory and its pages become the file blocks, so the load does not
+ * read or copy the data, and only the pages which are used get read
+ * from the disk. The changes are not written back into the image
+ * until the next save.
+ *
+ * @param path Path of the image on the disk.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - the filesystem is not empty.
+ *     - UFS_ERR_IO - the image can't be read or is malformed.
+ */
+int ufs_image_load(const char *path);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
@@ -0,0 +1,291 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	/* Batch size of the batch submission. */
+	BENCH_BATCH_SIZE = 64,
+	/* Tasks pushed by one task in a fan-out burst. */
+	BENCH_FAN_OUT = 64,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_check(int rc, const char *what)
+{
+	if (rc == 0)
+		return;
+	printf("%s failed: %d\n", what, rc);
+	exit(-1);
+}
+
+static void
+bench_empty_cb(void *arg)
+{
+	(void)arg;
+}
+
+/** Keep the CPU busy for the given number of nanoseconds. */
+static void
+bench_busy_cb(void *arg)
+{
+	uint64_t duration = *(const uint64_t *)arg;
+	uint64_t start = bench_now_ns();
+	while (bench_now_ns() - start < duration) {
+	}
+}
+
+static void
+bench_report(const char *name, std::vector<double> &tasks_per_sec)
+{
+	std::sort(tasks_per_sec.begin(), tasks_per_sec.end());
+	printf("%s\n", name);
+	printf("    min: %.0lf tasks/s\n", tasks_per_sec.front());
+	printf("    med: %.0lf tasks/s\n",
+		tasks_per_sec[tasks_per_sec.size() / 2]);
+	printf("    max: %.0lf tasks/s\n", tasks_per_sec.back());
+}
+
+struct bench_ctx {
+	struct thread_pool *pool;
+	int task_count;
+	/* Task duration for bench_busy_cb(), 0 for the empty tasks. */
+	uint64_t duration_ns;
+	bool is_batch;
+	std::vector<struct thread_task *> tasks;
+};
+
+typedef void (*bench_f)(struct bench_ctx *ctx);
+
+/**
+ * A fresh pool for each thread count. The first run only starts the
+ * threads and is not counted. A run returns after all its tasks are
+ * done, and the result is the tasks per second.
+ */
+static void
+bench_run(const char *name, bench_f func, struct bench_ctx *ctx)
+{
+	int thread_counts[] = {1, 2, 4, 8, 16, TPOOL_MAX_THREADS};
+	for (int thread_count : thread_counts) {
+		bench_check(thread_pool_new(thread_count, &ctx->pool),
+			"pool new");
+		std::vector<double> results;
+		for (int i = 0; i <= BENCH_RUN_COUNT; ++i) {
+			uint64_t start = bench_now_ns();
+			func(ctx);
+			uint64_t duration = bench_now_ns() - start;
+			if (i > 0)
+				results.push_back(ctx->task_count * 1e9 / duration);
+		}
+		/* A submitted task is still in the pool right after its callback. */
+		int rc;
+		while ((rc = thread_pool_delete(ctx->pool)) ==
+		       TPOOL_ERR_HAS_TASKS)
+			sched_yield();
+		bench_check(rc, "pool delete");
+		char full_name[128];
+		snprintf(full_name, sizeof(full_name), "%s, %d thread%s", name,
+			thread_count, thread_count == 1 ? "" : "s");
+		bench_report(full_name, results);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_push_join_f(struct bench_ctx *ctx)
+{
+	struct thread_task **tasks = ctx->tasks.data();
+	if (ctx->is_batch) {
+		for (int i = 0; i < ctx->task_count; i += BENCH_BATCH_SIZE) {
+			int count = std::min((int)BENCH_BATCH_SIZE,
+				ctx->task_count - i);
+			bench_check(thread_pool_push_tasks(ctx->pool, tasks + i,
+				count), "push tasks");
+		}
+	} else {
+		for (int i = 0; i < ctx->task_count; ++i)
+			bench_check(thread_pool_push_task(ctx->pool, tasks[i]),
+				"push");
+	}
+	for (int i = 0; i < ctx->task_count; ++i)
+		bench_check(thread_task_join(tasks[i]), "join");
+}
+
+static void
+bench_push_join(const char *name, int task_count, uint64_t duration_ns)
+{
+	struct bench_ctx ctx;
+	ctx.task_count = task_count;
+	ctx.duration_ns = duration_ns;
+	ctx.tasks.resize(task_count);
+	for (struct thread_task *&t : ctx.tasks) {
+		if (duration_ns == 0)
+			thread_task_new_cb(&t, bench_empty_cb, NULL);
+		else
+			thread_task_new_cb(&t, bench_busy_cb, &ctx.duration_ns);
+	}
+	char full_name[128];
+	ctx.is_batch = false;
+	snprintf(full_name, sizeof(full_name), "%s, single push", name);
+	bench_run(full_name, bench_push_join_f, &ctx);
+	ctx.is_batch = true;
+	snprintf(full_name, sizeof(full_name), "%s, batch push of %d", name,
+		(int)BENCH_BATCH_SIZE);
+	bench_run(full_name, bench_push_join_f, &ctx);
+	for (struct thread_task *t : ctx.tasks)
+		thread_task_delete(t);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_fan_out_ctx {
+	struct thread_pool *pool;
+	struct thread_task **children;
+};
+
+/** A task pushing the next burst from inside the pool. */
+static void
+bench_fan_out_cb(void *arg)
+{
+	struct bench_fan_out_ctx *ctx = (struct bench_fan_out_ctx *)arg;
+	bench_check(thread_pool_push_tasks(ctx->pool, ctx->children,
+		BENCH_FAN_OUT), "push the burst");
+}
+
+static void
+bench_fan_out_f(struct bench_ctx *ctx)
+{
+	int burst_count = ctx->task_count / BENCH_FAN_OUT;
+	struct bench_fan_out_ctx fan_out;
+	fan_out.pool = ctx->pool;
+	fan_out.children = ctx->tasks.data() + 1;
+	struct thread_task *root;
+	thread_task_new_cb(&root, bench_fan_out_cb, &fan_out);
+	for (int i = 0; i < burst_count; ++i) {
+		bench_check(thread_pool_push_task(ctx->pool, root), "push");
+		bench_check(thread_task_join(root), "join");
+		for (int j = 0; j < BENCH_FAN_OUT; ++j)
+			bench_check(thread_task_join(fan_out.children[j]),
+				"join");
+	}
+	thread_task_delete(root);
+}
+
+static void
+bench_fan_out(void)
+{
+	struct bench_ctx ctx;
+	ctx.task_count = 64 * 1000;
+	ctx.duration_ns = 1000;
+	ctx.is_batch = true;
+	ctx.tasks.resize(BENCH_FAN_OUT + 1);
+	for (int i = 1; i <= BENCH_FAN_OUT; ++i) {
+		thread_task_new_cb(&ctx.tasks[i], bench_busy_cb,
+			&ctx.duration_ns);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "Fan-out bursts of %d 1 us tasks, "
+		"pushed by a task", (int)BENCH_FAN_OUT);
+	bench_run(name, bench_fan_out_f, &ctx);
+	for (int i = 1; i <= BENCH_FAN_OUT; ++i)
+		thread_task_delete(ctx.tasks[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int bench_done_count;
+
+static void
+bench_count_cb(void *arg)
+{
+	(void)arg;
+	__atomic_add_fetch(&bench_done_count, 1, __ATOMIC_RELAXED);
+}
+
+/** Half of the tasks are created, pushed and detached, the others joined. */
+static void
+bench_join_detach_f(struct bench_ctx *ctx)
+{
+	__atomic_store_n(&bench_done_count, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < ctx->task_count; ++i) {
+		struct thread_task *t;
+		thread_task_new_cb(&t, bench_count_cb, NULL);
+		bench_check(thread_pool_push_task(ctx->pool, t), "push");
+		if (i % 2 == 0)
+			bench_check(thread_task_detach(t), "detach");
+		else
+			ctx->tasks[i / 2] = t;
+	}
+	for (int i = 0; i < ctx->task_count / 2; ++i) {
+		bench_check(thread_task_join(ctx->tasks[i]), "join");
+		thread_task_delete(ctx->tasks[i]);
+	}
+	while (__atomic_load_n(&bench_done_count, __ATOMIC_RELAXED) !=
+	       ctx->task_count)
+		sched_yield();
+}
+
+static void
+bench_join_detach(void)
+{
+	struct bench_ctx ctx;
+	ctx.task_count = 100 * 1000;
+	ctx.duration_ns = 0;
+	ctx.is_batch = false;
+	ctx.tasks.resize(ctx.task_count / 2);
+	bench_run("Mixed join and detach, empty tasks created each time",
+		bench_join_detach_f, &ctx);
+}
+
+/** Fire and forget, the tasks are reused by the pool. */
+static void
+bench_submit_f(struct bench_ctx *ctx)
+{
+	__atomic_store_n(&bench_done_count, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < ctx->task_count; ++i)
+		bench_check(thread_pool_submit(ctx->pool, bench_count_cb, NULL),
+			"submit");
+	while (__atomic_load_n(&bench_done_count, __ATOMIC_RELAXED) !=
+	       ctx->task_count)
+		sched_yield();
+}
+
+static void
+bench_submit(void)
+{
+	struct bench_ctx ctx;
+	ctx.task_count = 100 * 1000;
+	ctx.duration_ns = 0;
+	ctx.is_batch = false;
+	bench_run("Submit, empty tasks", bench_submit_f, &ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	bench_push_join("Empty tasks", 100 * 1000, 0);
+	bench_push_join("1 us tasks", 20 * 1000, 1000);
+	bench_push_join("10 us tasks", 5 * 1000, 10 * 1000);
+	bench_push_join("100 us tasks", 1000, 100 * 1000);
+	bench_fan_out();
+	bench_join_detach();
+	bench_submit();
+	return 0;
+}
@@ -1,8 +1,12 @@
 #include "thread_pool.h"
 #include "unit.h"
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void
 test_new(void)
@@ -28,6 +32,85 @@ test_new(void)
 	unit_test_finish();
 }
 
+static void
+test_new_ex(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options options;
+	options.max_threads = TPOOL_THREAD_LIMIT + 1;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too big thread count is "\
+		   "forbidden");
+	options.max_threads = 0;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "0 thread count is forbidden");
+	options.max_threads = 1;
+	int bad_cpu = -1;
+	options.cpus = &bad_cpu;
+	options.cpu_count = 1;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a bad CPU is forbidden");
+
+	/*
+	 * More threads than thread_pool_new() allows, all working at once.
+	 */
+	options.max_threads = 2 * TPOOL_MAX_THREADS;
+	options.cpu_count = 0;
+	unit_check(thread_pool_new_ex(&options, &p) == 0,
+		   "more threads are allowed");
+	int started = 0;
+	int arg = 0;
+	struct thread_task *tasks[2 * TPOOL_MAX_THREADS];
+	for (struct thread_task *&t : tasks) {
+		unit_fail_if(thread_task_new(&t, [&started, &arg]() {
+			__atomic_add_fetch(&started, 1, __ATOMIC_RELAXED);
+			while (__atomic_load_n(&arg, __ATOMIC_RELAXED) == 0)
+				usleep(100);
+		}) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+	}
+	while (__atomic_load_n(&started, __ATOMIC_RELAXED) !=
+	       2 * TPOOL_MAX_THREADS)
+		usleep(100);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (struct thread_task *t : tasks) {
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_check(true, "all the threads run at once");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/*
+	 * The threads run on the given CPU.
+	 */
+	int cpu = sched_getcpu();
+	unit_fail_if(cpu < 0);
+	options.max_threads = 3;
+	options.cpus = &cpu;
+	options.cpu_count = 1;
+	unit_check(thread_pool_new_ex(&options, &p) == 0,
+		   "pin the threads to a CPU");
+	int wrong_cpu = 0;
+	for (struct thread_task *&t : tasks) {
+		unit_fail_if(thread_task_new(&t, [cpu, &wrong_cpu]() {
+			if (sched_getcpu() != cpu)
+				__atomic_store_n(&wrong_cpu, 1,
+						 __ATOMIC_RELAXED);
+		}) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+	}
+	for (struct thread_task *t : tasks) {
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_check(wrong_cpu == 0, "the tasks run on that CPU");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static thread_task_f
 task_make_inc(int *arg)
 {
@@ -121,6 +204,37 @@ test_push(void)
 	unit_test_finish();
 }
 
+static void
+task_inc_cb(void *arg)
+{
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static void
+test_callback_task(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int arg = 0;
+	unit_check(thread_task_new_cb(&t, NULL, &arg) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a callback is needed");
+	unit_check(thread_task_new_cb(&t, task_inc_cb, &arg) == 0,
+		   "created a callback task");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 1, "the callback is called with its argument");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 2, "and again after a re-push");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_thread_pool_delete(void)
 {
@@ -171,6 +285,89 @@ map_reduce_inc(struct thread_pool *p, struct thread_task **tasks, int count,
 	}
 }
 
+struct push_ctx {
+	struct thread_pool *pool;
+	int *arg;
+};
+
+static void *
+push_many_f(void *arg)
+{
+	struct push_ctx *ctx = (struct push_ctx *)arg;
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	map_reduce_inc(ctx->pool, tasks, count, ctx->arg);
+	delete[] tasks;
+	return NULL;
+}
+
+static void
+test_push_concurrent(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(TPOOL_MAX_THREADS, &p) != 0);
+	int arg = 0;
+	/*
+	 * The tasks pushed from any thread, the pool workers included, are
+	 * all executed.
+	 */
+	struct push_ctx ctx = {p, &arg};
+	const int thread_count = 4;
+	pthread_t threads[thread_count];
+	for (int i = 0; i < thread_count; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, push_many_f, &ctx));
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, [&ctx]() { push_many_f(&ctx); }) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	for (int i = 0; i < thread_count; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(arg == (thread_count + 1) * 1000, "all the tasks are done");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_batch(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(5, &p) != 0);
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_make_inc(&arg)) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0,
+		   "pushed a batch");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(arg == count, "all the batch is done");
+	/*
+	 * A bad task fails the whole batch.
+	 */
+	unit_fail_if(thread_pool_push_task(p, tasks[10]) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, 20) ==
+		   TPOOL_ERR_TASK_IN_POOL, "a task in the batch is in a pool");
+	unit_fail_if(thread_task_join(tasks[10]) != 0);
+	unit_check(thread_task_is_finished(tasks[0]) &&
+		   thread_task_delete(tasks[0]) == 0, "nothing is pushed");
+	unit_check(thread_pool_push_tasks(p, tasks, TPOOL_MAX_TASKS + 1) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too many tasks");
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	for (int i = 1; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	delete[] tasks;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_thread_pool_max_tasks(void)
 {
@@ -316,6 +513,493 @@ test_detach_stress(void)
 #endif
 }
 
+static void
+test_then(void)
+{
+	unit_test_start();
+
+	/*
+	 * One thread is enough for any chain, nobody is blocked in a join.
+	 */
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int step = 0;
+	int arg = 0;
+	struct thread_task *first;
+	struct thread_task *second;
+	struct thread_task *third;
+	unit_fail_if(thread_task_new(&first, task_make_wait_for(&arg)) != 0);
+	unit_fail_if(thread_task_new(&second, [&step]() {
+		if (step == 0)
+			step = 1;
+	}) != 0);
+	unit_fail_if(thread_task_new(&third, [&step]() {
+		if (step == 1)
+			step = 2;
+	}) != 0);
+	unit_check(thread_task_then(first, second) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "the predecessor is to be pushed");
+	unit_fail_if(thread_pool_push_task(p, first) != 0);
+	unit_check(thread_task_then(first, second) == 0, "then");
+	unit_check(thread_task_then(second, third) == 0, "then of then");
+	unit_check(thread_task_then(first, second) == TPOOL_ERR_TASK_IN_POOL,
+		   "the next task is already in a pool");
+	unit_check(thread_task_then(first, first) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a task can't wait for itself");
+	unit_check(thread_task_delete(second) == TPOOL_ERR_TASK_IN_POOL,
+		   "a waiting task can't be deleted");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(third) != 0);
+	unit_check(step == 2, "the tasks run in order");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "the not joined tasks are in the pool");
+	unit_fail_if(thread_task_join(first) != 0);
+	unit_fail_if(thread_task_join(second) != 0);
+	unit_check(thread_task_then(first, second) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "the joined task is not pushed");
+	step = 0;
+	unit_fail_if(thread_pool_push_task(p, first) != 0);
+	unit_fail_if(thread_task_then(first, second) != 0);
+	unit_fail_if(thread_task_join(second) != 0);
+	unit_check(step == 1, "then after a re-push");
+	/*
+	 * A predecessor which has run doesn't delay.
+	 */
+	unit_fail_if(thread_task_then(first, third) != 0);
+	unit_fail_if(thread_task_join(third) != 0);
+	unit_check(step == 2, "then on a task that has run");
+	unit_fail_if(thread_task_join(first) != 0);
+	unit_fail_if(thread_task_delete(first) != 0);
+	unit_fail_if(thread_task_delete(second) != 0);
+	unit_fail_if(thread_task_delete(third) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/*
+	 * Fan out and in.
+	 */
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	arg = 0;
+	int sum = 0;
+	struct thread_task *root;
+	struct thread_task *tasks[8];
+	struct thread_task *last;
+	unit_fail_if(thread_task_new_cb(&root, task_inc_cb, &arg) != 0);
+	unit_fail_if(thread_task_new(&last, [&arg, &sum]() {
+		sum = __atomic_load_n(&arg, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	for (struct thread_task *&t : tasks) {
+		unit_fail_if(thread_task_new_cb(&t, task_inc_cb, &arg) != 0);
+		unit_fail_if(thread_task_then(root, t) != 0);
+	}
+	unit_check(thread_task_when_all(tasks, 0, last) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "when all of nothing");
+	unit_check(thread_task_when_all(tasks, 8, last) == 0, "when all");
+	unit_fail_if(thread_task_join(last) != 0);
+	unit_check(sum == 9, "the last task runs after all the others");
+	unit_fail_if(thread_task_join(root) != 0);
+	unit_fail_if(thread_task_delete(root) != 0);
+	for (struct thread_task *t : tasks) {
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_fail_if(thread_task_delete(last) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int64_t count = 100000;
+	const int64_t grain = 100;
+	char *marks = new char[count]();
+	int bad_pieces = 0;
+	int rc = thread_pool_parallel_for(p, 10, 10 + count, grain,
+		[&](int64_t begin, int64_t end) {
+			if ((begin - 10) % grain != 0 || end - begin > grain)
+				__atomic_store_n(&bad_pieces, 1, __ATOMIC_RELAXED);
+			for (int64_t i = begin; i < end; ++i)
+				++marks[i - 10];
+		});
+	unit_check(rc == 0, "parallel for");
+	bool is_once = true;
+	for (int64_t i = 0; i < count; ++i)
+		is_once = is_once && marks[i] == 1;
+	unit_check(is_once, "each element is done once");
+	unit_check(bad_pieces == 0, "in the pieces of the grain");
+	delete[] marks;
+	unit_check(thread_pool_parallel_for(p, 0, 10, 0,
+		[](int64_t, int64_t) {}) == TPOOL_ERR_INVALID_ARGUMENT,
+		"the grain must be positive");
+	unit_check(thread_pool_parallel_for(p, 10, 0, 1,
+		[](int64_t, int64_t) { abort(); }) == 0, "an empty range");
+
+	int64_t sum = -1;
+	rc = thread_pool_parallel_reduce(p, 0, count + 1, 77, (int64_t)0,
+		[](int64_t begin, int64_t end) {
+			int64_t res = 0;
+			for (int64_t i = begin; i < end; ++i)
+				res += i;
+			return res;
+		},
+		[](int64_t a, int64_t b) { return a + b; }, &sum);
+	unit_check(rc == 0 && sum == count * (count + 1) / 2,
+		   "parallel reduce");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/*
+	 * Nested in a task, even for the only thread.
+	 */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *t;
+	int64_t nested_sum = 0;
+	unit_fail_if(thread_task_new(&t, [p, &nested_sum]() {
+		thread_pool_parallel_reduce(p, 0, 1000, 10, (int64_t)0,
+			[](int64_t begin, int64_t) { return begin; },
+			[](int64_t a, int64_t b) { return a + b; },
+			&nested_sum);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(nested_sum == 49500, "parallel reduce in a task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_arena(void)
+{
+	unit_test_start();
+
+	unit_check(thread_pool_current_arena() == NULL,
+		   "no arena outside of the workers");
+	unit_check(thread_arena_alloc(NULL, 10) == NULL, "no arena, no memory");
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	/*
+	 * The next task of the worker gets the same memory.
+	 */
+	void *first = NULL;
+	void *second = NULL;
+	bool is_ok = true;
+	for (void **res : {&first, &second}) {
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, [res, &is_ok]() {
+			struct thread_arena *arena = thread_pool_current_arena();
+			char *a = (char *)thread_arena_alloc(arena, 3);
+			char *b = (char *)thread_arena_alloc(arena, 100);
+			// Bigger than a chunk.
+			char *c = (char *)thread_arena_alloc(arena, 1 << 20);
+			if (a == NULL || b == NULL || c == NULL ||
+			    (uintptr_t)b % alignof(std::max_align_t) != 0 ||
+			    (b >= a && b < a + 3)) {
+				is_ok = false;
+				return;
+			}
+			memset(a, 1, 3);
+			memset(b, 2, 100);
+			memset(c, 3, 1 << 20);
+			*res = a;
+		}) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_check(is_ok, "allocated and aligned");
+	unit_check(first != NULL && first == second,
+		   "the memory is reused by the next task");
+
+	/*
+	 * The pieces run by a waiting task don't free its memory.
+	 */
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, [p, &is_ok]() {
+		struct thread_arena *arena = thread_pool_current_arena();
+		int *value = (int *)thread_arena_alloc(arena, sizeof(int));
+		*value = 42;
+		thread_pool_parallel_for(p, 0, 100, 1,
+			[](int64_t, int64_t) {
+				int *v = (int *)thread_arena_alloc(
+					thread_pool_current_arena(),
+					sizeof(int));
+				*v = 7;
+			});
+		int *next = (int *)thread_arena_alloc(arena, sizeof(int));
+		is_ok = *value == 42 && next != value;
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(is_ok, "nested tasks keep the memory of the outer one");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int arg = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_make_wait_for(&arg)) != 0);
+	unit_check(thread_task_set_priority(blocker,
+		   (thread_task_priority)10) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no such priority");
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_check(thread_task_set_priority(blocker, TPOOL_PRIORITY_HIGH) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change a pushed task");
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	/*
+	 * The urgent ones go first, but not all of them before the others.
+	 */
+	int order[30];
+	int next = 0;
+	struct thread_task *tasks[30];
+	for (int i = 0; i < 30; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [i, &order, &next]() {
+			order[next++] = i;
+		}) != 0);
+		if (i != 0) {
+			unit_fail_if(thread_task_set_priority(tasks[i],
+				TPOOL_PRIORITY_HIGH) != 0);
+		}
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (struct thread_task *t : tasks)
+		unit_fail_if(thread_task_join(t) != 0);
+	unit_check(order[0] == 1, "the urgent task goes first");
+	int normal_position = 0;
+	while (order[normal_position] != 0)
+		++normal_position;
+	unit_check(normal_position < 10, "the normal task is not starved");
+	for (struct thread_task *t : tasks)
+		unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_join(blocker) != 0);
+
+	/*
+	 * Deadlines.
+	 */
+	arg = 0;
+	int runs = 0;
+	struct thread_task *late;
+	unit_fail_if(thread_task_new_cb(&late, task_inc_cb, &runs) != 0);
+	unit_check(thread_task_set_deadline(late, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "the deadline can't be negative");
+	unit_check(thread_task_set_deadline(late, 0.01) == 0,
+		   "set the deadline");
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_fail_if(thread_pool_push_task(p, late) != 0);
+	usleep(50000);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(late) != 0);
+	unit_check(runs == 0 && thread_task_is_expired(late),
+		   "the late task is skipped");
+	unit_fail_if(thread_task_set_deadline(late, 10) != 0);
+	unit_fail_if(thread_pool_push_task(p, late) != 0);
+	unit_fail_if(thread_task_join(late) != 0);
+	unit_check(runs == 1 && !thread_task_is_expired(late),
+		   "the task in time is run");
+	unit_fail_if(thread_task_delete(late) != 0);
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	thread_pool_stat stat;
+	unit_check(thread_pool_stats(NULL, &stat) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "stats of no pool");
+	if (thread_pool_stats(p, &stat) == TPOOL_ERR_NOT_IMPLEMENTED) {
+		unit_fail_if(thread_pool_delete(p) != 0);
+		unit_test_finish();
+		return;
+	}
+	unit_check(stat.thread_count == 0 && stat.queue_latency.count == 0 &&
+		   stat.workers.empty(), "a new pool did nothing");
+	struct thread_task *tasks[10];
+	for (struct thread_task *&t : tasks) {
+		unit_fail_if(thread_task_new(&t, []() { usleep(1000); }) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+	}
+	for (struct thread_task *t : tasks)
+		unit_fail_if(thread_task_join(t) != 0);
+	// A worker counts a task right after its join can return.
+	do {
+		usleep(100);
+		unit_fail_if(thread_pool_stats(p, &stat) != 0);
+	} while (stat.run_time.count != 10);
+	unit_check(stat.pending_task_count == 0 &&
+		   stat.queued_task_count == 0, "no tasks in the pool");
+	unit_check(stat.queue_latency.count == 10 &&
+		   stat.run_time.count == 10, "each task is counted");
+	unit_check(stat.run_time.p50_ns >= 1000000 &&
+		   stat.run_time.mean_ns >= 1000000 &&
+		   stat.run_time.max_ns >= stat.run_time.p99_ns &&
+		   stat.run_time.p99_ns >= stat.run_time.p50_ns,
+		   "the run time is measured");
+	uint64_t task_count = 0;
+	uint64_t busy_ns = 0;
+	for (const thread_pool_worker_stat &worker : stat.workers) {
+		task_count += worker.task_count;
+		busy_ns += worker.busy_ns;
+	}
+	unit_check(!stat.workers.empty() && task_count == 10 &&
+		   busy_ns >= 10 * 1000000, "the work of the threads");
+	for (struct thread_task *t : tasks)
+		unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_timeout(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_set_idle_timeout(p, 0) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "the timeout must be positive");
+	unit_check(thread_pool_set_idle_timeout(p, 0.01) == 0,
+		   "set the idle timeout");
+	int arg = 0;
+	struct thread_task *tasks[8];
+	for (int round = 0; round < 3; ++round) {
+		for (struct thread_task *&t : tasks) {
+			unit_fail_if(thread_task_new_cb(&t, task_inc_cb,
+							&arg) != 0);
+			unit_fail_if(thread_pool_push_task(p, t) != 0);
+		}
+		for (struct thread_task *t : tasks) {
+			unit_fail_if(thread_task_join(t) != 0);
+			unit_fail_if(thread_task_delete(t) != 0);
+		}
+		// Let the idle threads exit.
+		usleep(50000);
+	}
+	unit_check(arg == 3 * 8, "the tasks run after the threads exit");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_submit(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_submit(p, (thread_task_cb)NULL, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "submit needs a function");
+	int arg = 0;
+	bool is_ok = true;
+	/* Enough for the tasks to be reused many times. */
+	for (int i = 0; i < 3000; ++i)
+		is_ok = is_ok && thread_pool_submit(p, task_inc_cb, &arg) == 0;
+	for (int i = 0; i < 100; ++i) {
+		is_ok = is_ok && thread_pool_submit(p, [&arg]() {
+			__atomic_add_fetch(&arg, 1, __ATOMIC_RELAXED);
+		}) == 0;
+	}
+	/* The workers submit into their own queues. */
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, [p, &arg, &is_ok]() {
+		for (int i = 0; i < 100; ++i) {
+			if (thread_pool_submit(p, task_inc_cb, &arg) != 0)
+				is_ok = false;
+		}
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(is_ok, "submit the tasks");
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != 3200)
+		usleep(100);
+	unit_msg("all the submitted tasks have run");
+	/* The last ones might be finishing yet. */
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+}
+
+static void
+test_notify(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int fd = -1;
+	int rc = thread_pool_finished_fd(p, &fd);
+	unit_check(rc == 0 || rc == TPOOL_ERR_NOT_IMPLEMENTED, "get the fd");
+	int arg = 0;
+	struct thread_task *tasks[10];
+	for (struct thread_task *&t : tasks) {
+		unit_fail_if(thread_task_new_cb(&t, task_inc_cb, &arg) != 0);
+		unit_fail_if(thread_task_set_notify(t, true) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+	}
+#if NEED_DETACH
+	unit_check(thread_task_detach(tasks[0]) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "a notifying task can't be detached");
+#endif
+	unit_check(thread_task_set_notify(tasks[0], false) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change a task in a pool");
+	/* Take them in batches, like an event loop does. */
+	int total = 0;
+	bool is_joined = true;
+	while (total < 10) {
+		if (fd >= 0) {
+			struct pollfd pfd = {fd, POLLIN, 0};
+			unit_fail_if(poll(&pfd, 1, 1000) != 1);
+		}
+		struct thread_task *popped[3];
+		int count = 0;
+		unit_fail_if(thread_pool_pop_finished(p, popped, 3, &count)
+			     != 0);
+		for (int i = 0; i < count; ++i) {
+			is_joined = is_joined &&
+				    thread_task_is_finished(popped[i]);
+			unit_fail_if(thread_task_delete(popped[i]) != 0);
+		}
+		total += count;
+	}
+	unit_check(total == 10 && is_joined, "all the tasks are popped joined");
+	unit_check(arg == 10, "and have run");
+	int count = -1;
+	unit_check(thread_pool_pop_finished(p, NULL, 0, &count) == 0 &&
+		   count == 0, "nothing is left");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_detach_long(void)
 {
@@ -358,8 +1042,20 @@ main(int argc, char **argv)
 	unit_test_start();
 
 	test_new();
+	test_new_ex();
 	test_push();
+	test_callback_task();
 	test_thread_pool_delete();
+	test_push_concurrent();
+	test_push_batch();
+	test_then();
+	test_parallel_for();
+	test_arena();
+	test_priority();
+	test_stats();
+	test_idle_timeout();
+	test_submit();
+	test_notify();
 	test_thread_pool_max_tasks();
 	test_timed_join();
 	test_detach_stress();
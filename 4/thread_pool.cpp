@@ -1,27 +1,107 @@
 #include "thread_pool.h"
 
+#include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <ctime>
 #include <deque>
 #include <limits>
-#include <unordered_set>
+#include <memory>
+#include <new>
 #include <utility>
 #include <vector>
 
+#include "adaptive_lock.h"
+#include "clock.h"
+#include "ring.h"
+#include "trace.h"
+
+#ifndef THREAD_POOL_LOCK_FREE_QUEUE
+#define THREAD_POOL_LOCK_FREE_QUEUE 1
+#endif
+
+#ifndef THREAD_POOL_STATS
+#define THREAD_POOL_STATS 1
+#endif
+
+// The joiners wait on the task state word itself where there are futexes, on the pool condition elsewhere
+#ifndef THREAD_POOL_FUTEX
+#if defined(__linux__)
+#define THREAD_POOL_FUTEX 1
+#else
+#define THREAD_POOL_FUTEX 0
+#endif
+#endif
+
 /* ----------------------------------------- Variables ----------------------------------------- */
 namespace {
 constexpr int success = 0;
 constexpr int failure = -1;
 constexpr auto nsec_per_sec = 1'000'000'000L;
+// The data written by one thread is kept off the cache lines the others read or write
+constexpr std::size_t cache_line_size = 64;
+// Initial capacity of a worker deque, it grows twice when full
+constexpr std::int64_t deque_initial_capacity = 256;
+// Most tasks a worker moves from the injector into its deque at once
+constexpr std::size_t injector_batch_limit = 32;
+// Longest spin of an idle worker before it sleeps, and how long it spins at first
+constexpr std::int64_t max_spin_ns = 50'000;
+constexpr std::int64_t initial_spin_ns = 10'000;
+// Most pauses between the checks of the queues while spinning
+constexpr int max_spin_backoff = 64;
+// Most urgent tasks a worker runs in a row while the others wait
+constexpr int urgent_streak_limit = 8;
+// Most finished submitted tasks kept for reuse by a worker, and by the pool for the other threads
+constexpr std::size_t worker_free_task_limit = 64;
+constexpr std::size_t pool_free_task_limit = 1024;
+// Longest deadline, so the time in nanoseconds does not overflow
+constexpr double max_deadline_seconds = 1e9;
+// The first chunk of a worker arena, the next ones are twice the previous
+constexpr std::size_t arena_initial_chunk_size = 64 * 1024;
+// An arena keeps its chunks for the next tasks up to this size in total
+constexpr std::size_t arena_keep_size = 1024 * 1024;
+#if THREAD_POOL_STATS
+// The histograms have 8 buckets per power of 2, so a percentile is within 12.5%
+constexpr int histogram_sub_bits = 3;
+constexpr std::size_t histogram_sub_count = std::size_t {1} << histogram_sub_bits;
+constexpr std::size_t histogram_bucket_count = (64 - histogram_sub_bits + 1) * histogram_sub_count;
+#endif
 }    // namespace
 /* -------------------------------------------- *** -------------------------------------------- */
 
 /* ------------------------------------------- Types ------------------------------------------- */
+/**
+ * Memory of the tasks of a worker, see thread_pool_current_arena(). The chunks are filled one by one, and a task
+ * ending rolls the position back to where it began, so the tasks run inside of a task free only theirs.
+ */
+struct thread_arena {
+    struct chunk {
+        std::unique_ptr<char[]> memory;
+        std::size_t size;
+    };
+    std::vector<chunk> chunks;
+    // The chunk being filled and the bytes used in it. The chunks after it are free
+    std::size_t current = 0;
+    std::size_t used = 0;
+    std::size_t total_size = 0;
+};
+
 namespace {
 enum class State : std::int32_t {
     New,
@@ -30,58 +110,479 @@ enum class State : std::int32_t {
     Finished,
 };
 
+// The task state word is the state in the low bits and the flags.
+constexpr std::uint32_t state_mask = 0b11;
+constexpr std::uint32_t joined_flag = 0b100;
+constexpr std::uint32_t detached_flag = 0b1000;
+// Someone waits for the task to finish, on the state word futex or on the pool joined_cv
+constexpr std::uint32_t has_waiters_flag = 0b10000;
+// The last run was skipped, it couldn't start before the deadline
+constexpr std::uint32_t expired_flag = 0b100000;
+
+constexpr State stateOf(const std::uint32_t word) {
+    return static_cast<State>(word & state_mask);
+}
+
+constexpr std::uint32_t withState(const std::uint32_t word, const State state) {
+    return (word & ~state_mask) | static_cast<std::uint32_t>(state);
+}
+
+// Finished and joined, or never pushed. Such a task can be pushed and deleted.
+constexpr bool isFree(const std::uint32_t word) {
+    return stateOf(word) == State::New || (stateOf(word) == State::Finished && (word & joined_flag) != 0);
+}
+
 void initializeConditionVariable(pthread_cond_t *condition);
+void initializeDeadline(timespec *deadline, double delay_seconds);
+std::int64_t nowNs();
+
+/**
+ * Chase-Lev work-stealing deque of one worker. The owner pushes and takes at the bottom without locks, the other
+ * workers steal at the top with a CAS. Only the owner grows the array, the old ones are kept until the deque is
+ * destroyed because a stealer can still be reading them.
+ */
+struct task_deque {
+    struct task_array {
+        explicit task_array(const std::int64_t new_capacity)
+            : capacity(new_capacity), tasks(new std::atomic<thread_task *>[new_capacity]) {}
+
+        thread_task *get(const std::int64_t index) const {
+            return tasks[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void put(const std::int64_t index, thread_task *task) {
+            tasks[index & (capacity - 1)].store(task, std::memory_order_relaxed);
+        }
+
+        // Power of 2
+        std::int64_t capacity;
+        std::unique_ptr<std::atomic<thread_task *>[]> tasks;
+    };
+
+    task_deque() {
+        arrays.push_back(std::make_unique<task_array>(deque_initial_capacity));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only.
+    void push(thread_task *task) {
+        const std::int64_t old_bottom = bottom.load(std::memory_order_relaxed);
+        const std::int64_t old_top = top.load(std::memory_order_acquire);
+        task_array *current = array.load(std::memory_order_relaxed);
+        if (old_bottom - old_top > current->capacity - 1) {
+            arrays.push_back(std::make_unique<task_array>(current->capacity * 2));
+            task_array *grown = arrays.back().get();
+            for (std::int64_t index = old_top; index < old_bottom; ++index) {
+                grown->put(index, current->get(index));
+            }
+            array.store(grown, std::memory_order_release);
+            current = grown;
+        }
+        current->put(old_bottom, task);
+        // Sequentially consistent, so a worker going to sleep either sees the task or is seen as idle.
+        bottom.store(old_bottom + 1, std::memory_order_seq_cst);
+    }
+
+    // Owner only. The last task is raced for with the stealers.
+    thread_task *take() {
+        const std::int64_t new_bottom = bottom.load(std::memory_order_relaxed) - 1;
+        const task_array *current = array.load(std::memory_order_relaxed);
+        bottom.store(new_bottom, std::memory_order_seq_cst);
+        std::int64_t old_top = top.load(std::memory_order_seq_cst);
+        if (old_top > new_bottom) {
+            bottom.store(new_bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        thread_task *task = current->get(new_bottom);
+        if (old_top == new_bottom) {
+            if (!top.compare_exchange_strong(
+                        old_top, old_top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            bottom.store(new_bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Any thread. Null if empty or lost a race.
+    thread_task *steal() {
+        std::int64_t old_top = top.load(std::memory_order_seq_cst);
+        const std::int64_t old_bottom = bottom.load(std::memory_order_seq_cst);
+        if (old_top >= old_bottom) {
+            return nullptr;
+        }
+        thread_task *task = array.load(std::memory_order_acquire)->get(old_top);
+        if (!top.compare_exchange_strong(old_top, old_top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+
+    // The ends are changed by different threads, keep them on different cache lines.
+    alignas(cache_line_size) std::atomic<std::int64_t> top {0};
+    alignas(cache_line_size) std::atomic<std::int64_t> bottom {0};
+    std::atomic<task_array *> array {nullptr};
+    std::vector<std::unique_ptr<task_array>> arrays;
+};
+
+#if THREAD_POOL_STATS
+
+// Counters of one worker. Only the worker changes them, without RMW, and the stats just read them.
+void addTo(std::atomic<std::uint64_t> &counter, const std::uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+/**
+ * Nanoseconds in log-linear buckets, like an HDR histogram: the values below histogram_sub_count have a bucket each,
+ * and each next power of 2 is split in histogram_sub_count buckets.
+ */
+struct latency_histogram {
+    static std::size_t bucketOf(const std::uint64_t value) {
+        if (value < histogram_sub_count) {
+            return static_cast<std::size_t>(value);
+        }
+        const int exponent = 63 - __builtin_clzll(value);
+        const std::uint64_t sub_bucket = (value >> (exponent - histogram_sub_bits)) & (histogram_sub_count - 1);
+        return static_cast<std::size_t>(exponent - histogram_sub_bits + 1) * histogram_sub_count + sub_bucket;
+    }
+
+    // The biggest value of the bucket
+    static std::uint64_t bucketLimit(const std::size_t bucket) {
+        if (bucket < histogram_sub_count) {
+            return bucket;
+        }
+        const int shift = static_cast<int>(bucket / histogram_sub_count) - 1;
+        const std::uint64_t lower = (histogram_sub_count + bucket % histogram_sub_count) << shift;
+        return lower + ((std::uint64_t {1} << shift) - 1);
+    }
+
+    void record(const std::int64_t value_ns) {
+        const auto value = static_cast<std::uint64_t>(std::max<std::int64_t>(value_ns, 0));
+        addTo(buckets[bucketOf(value)], 1);
+        addTo(count, 1);
+        addTo(sum_ns, value);
+        if (value > max_ns.load(std::memory_order_relaxed)) {
+            max_ns.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    std::array<std::atomic<std::uint64_t>, histogram_bucket_count> buckets {};
+    std::atomic<std::uint64_t> count {0};
+    std::atomic<std::uint64_t> sum_ns {0};
+    std::atomic<std::uint64_t> max_ns {0};
+};
+
+struct worker_stats {
+    // From the push to the start of a task
+    latency_histogram queue_latency;
+    latency_histogram run_time;
+    std::atomic<std::uint64_t> busy_ns {0};
+    std::atomic<std::uint64_t> idle_ns {0};
+    std::atomic<std::uint64_t> steal_count {0};
+};
+
+#endif
+
+#if THREAD_POOL_LOCK_FREE_QUEUE
+
+/**
+ * Ring size for all the tasks a pool can have, so a push never finds it full. TPOOL_MAX_TASKS rounded up to a power
+ * of 2.
+ */
+constexpr std::size_t injectorCapacity() {
+    std::size_t capacity = 1;
+    while (capacity < TPOOL_MAX_TASKS) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+#endif
+
+/**
+ * The first line is read by the stealers, the deque has the lines of its ends, and the rest is written by the worker
+ * alone. Aligned, so the contexts of the neighbour workers have no common lines.
+ */
+struct alignas(cache_line_size) worker_context {
+    worker_context(thread_pool *new_pool, const int new_index, const int new_cpu, const int new_node)
+        : pool(new_pool), index(new_index), cpu(new_cpu), node(new_node) {}
+
+    thread_pool *pool;
+    // Position in the pool workers
+    int index;
+    // The CPU the thread is pinned to and its NUMA node, or -1 when not known
+    int cpu;
+    int node;
+    task_deque deque;
+    /**
+     * Average time the worker was idle before the next task came. The spin is a few times that, when it is short
+     * enough, so the bursts of tasks are caught without sleeping and the quiet periods don't burn the CPU.
+     */
+    alignas(cache_line_size) std::int64_t average_idle_ns = initial_spin_ns;
+    // Urgent tasks run since the last other one
+    int urgent_streak = 0;
+    // Submitted tasks run by this worker, to be reused by its own submits first
+    std::vector<thread_task *> free_tasks;
+    thread_arena arena;
+#if THREAD_POOL_STATS
+    worker_stats stats;
+#endif
+};
+
+// A task waiting for another one, in the list of the dependents of that one
+struct task_dependent {
+    thread_task *task;
+    task_dependent *next;
+};
+
+// The end of the dependents of a task that has run. The ones added after it are ready at once
+task_dependent *closedDependents() {
+    return reinterpret_cast<task_dependent *>(std::uintptr_t {1});
+}
+
+/**
+ * A thread_pool_parallel_for() call. The range is cut into the blocks of grain elements, the tasks get the halves of
+ * the halves of it, down to leaf_blocks blocks.
+ */
+struct parallel_job {
+    thread_pool *pool;
+    const thread_range_f *function;
+    std::int64_t begin;
+    std::int64_t end;
+    std::int64_t grain;
+    std::int64_t leaf_blocks;
+    // Blocks not done yet. The one who does the last sets done, under the mutex. Apart from the read-only fields
+    alignas(cache_line_size) std::atomic<std::int64_t> remaining_blocks;
+    bool done = false;
+    pthread_mutex_t mutex {};
+    pthread_cond_t done_cv {};
+    // The pushed parts. Done doesn't mean their tasks are out of the pool, the caller joins them before returning.
+    std::atomic<struct parallel_part *> parts {nullptr};
+};
+
+// A part of a job for a task, the blocks from first to last not including it
+struct parallel_part {
+    parallel_job *job;
+    std::int64_t first_block;
+    std::int64_t last_block;
+    thread_task *task;
+    parallel_part *next;
+};
 
 }    // namespace
 
+/**
+ * The tasks pushed into the pool go to the injector queue, lock-free unless THREAD_POOL_LOCK_FREE_QUEUE is 0. The
+ * workers move them from there in batches into their own deques, and steal from the deques of each other when out of
+ * work. So neither the pushes nor the busy workers take any locks. The workers sleep on the pool mutex and condition
+ * only when they find no tasks anywhere.
+ */
 struct thread_pool {
-    explicit thread_pool(const int new_max_threads) : max_threads(new_max_threads) {
-        const auto result = pthread_mutex_init(&mutex, nullptr);
+    thread_pool(const int new_max_threads, std::vector<int> new_cpus, std::vector<int> new_cpu_nodes)
+        : max_threads(new_max_threads), cpus(std::move(new_cpus)), cpu_nodes(std::move(new_cpu_nodes)),
+          workers(new_max_threads) {
+        auto result = pthread_mutex_init(&mutex, nullptr);
         assert(result == success);
+#if !THREAD_POOL_FUTEX
+        result = pthread_mutex_init(&join_mutex, nullptr);
+        assert(result == success);
+        initializeConditionVariable(&joined_cv);
+#endif
+        (void)result;
         initializeConditionVariable(&has_task_cv);
+        has_worker_key = pthread_key_create(&worker_key, nullptr) == success;
     }
     ~thread_pool() {
+        if (has_worker_key) {
+            pthread_key_delete(worker_key);
+        }
+#if !THREAD_POOL_FUTEX
+        pthread_cond_destroy(&joined_cv);
+        pthread_mutex_destroy(&join_mutex);
+#endif
         pthread_cond_destroy(&has_task_cv);
         pthread_mutex_destroy(&mutex);
+#if defined(__linux__)
+        if (finished_fd.load() >= 0) {
+            close(finished_fd.load());
+        }
+#endif
     }
 
-    std::vector<pthread_t> threads;
-    std::deque<thread_task *> tasks_queue;
-    std::unordered_set<thread_task *> tasks_in_pool;
+    /*
+     * The fields are grouped by who writes them how often. Each group of the often written ones has its own cache
+     * lines, so a push, a take and a join don't invalidate what the others only read.
+     */
 
+    // Read-only after the creation
     int max_threads = 0;
-    mutable pthread_mutex_t mutex {};
+    // The workers are pinned to these CPUs in turn, the nodes are for the stealing
+    std::vector<int> cpus;
+    std::vector<int> cpu_nodes;
+    // The context of the worker in its thread, so the pool functions called from a task can use its deque
+    pthread_key_t worker_key {};
+    bool has_worker_key = false;
+    // The first thread_count are started, their contexts are not changed after that
+    std::vector<std::unique_ptr<worker_context>> workers;
+
+    // Pushed tasks not taken by any worker yet
+#if THREAD_POOL_LOCK_FREE_QUEUE
+    mpmc_ring<thread_task *> injector {injectorCapacity()};
+#else
+    alignas(cache_line_size) std::deque<thread_task *> injector;
+    adaptive_lock injector_mutex ADAPTIVE_LOCK_INITIALIZER;
+#endif
+    /**
+     * Size of the injector, to check it without touching it. It is changed after the injector, so can be below zero
+     * for a moment. Every push and take change it.
+     */
+    alignas(cache_line_size) std::atomic<std::int64_t> injector_size {0};
+
+    /**
+     * Pushed and not yet joined or detached-and-finished tasks. It is all thread_pool_delete() and the task limit need,
+     * whether a task is queued or running is in its own state. Every push and join change it.
+     */
+    alignas(cache_line_size) std::atomic<std::size_t> pending_task_count {0};
+
+    // Read by each push and each search for a task, changed only when the workers start, sleep and exit
+    alignas(cache_line_size) std::atomic<int> thread_count {0};
+    // Workers sleeping or going to sleep on has_task_cv. Changed under mutex
+    std::atomic<int> idle_workers {0};
+    // Size of the urgent lane below
+    std::atomic<std::int64_t> urgent_size {0};
+
+    /**
+     * The lane of the high priority tasks, checked before all the other queues. It is usually empty and the size tells
+     * so without the lock.
+     */
+    alignas(cache_line_size) std::deque<thread_task *> urgent_tasks;
+    adaptive_lock urgent_mutex ADAPTIVE_LOCK_INITIALIZER;
+
+    // Guards the threads and the sleeping of the workers
+    alignas(cache_line_size) mutable pthread_mutex_t mutex {};
     pthread_cond_t has_task_cv {};
     bool stop = false;
-    int idle_workers = 0;
+    // Guarded by mutex
+    std::vector<pthread_t> threads;
+    // Exited idle workers, to be joined. Guarded by mutex
+    std::vector<pthread_t> reaped_threads;
+    // An idle worker with the biggest index exits after that many seconds. Guarded by mutex
+    double idle_timeout = std::numeric_limits<double>::infinity();
+
+    /**
+     * Finished tasks with the notification, a lock-free stack of the workers, newest first. The consumer takes it all
+     * at once. The eventfd is signalled after each push, created on demand under mutex
+     */
+    alignas(cache_line_size) std::atomic<thread_task *> finished_tasks {nullptr};
+    std::atomic<int> finished_fd {-1};
+    // Taken from finished_tasks and not popped yet, oldest first. Only the consumer touches it
+    alignas(cache_line_size) thread_task *taken_finished = nullptr;
+
+    // Submitted tasks for reuse by the threads which are not the workers, filled by the workers with too many
+    alignas(cache_line_size) std::vector<thread_task *> free_tasks;
+    adaptive_lock free_tasks_mutex ADAPTIVE_LOCK_INITIALIZER;
+
+#if !THREAD_POOL_FUTEX
+    /**
+     * The joiners of all the tasks wait here, the tasks have no own mutexes and conditions. A task which got a
+     * waiter wakes them all up when finished.
+     */
+    pthread_mutex_t join_mutex {};
+    pthread_cond_t joined_cv {};
+#endif
 };
 
-struct thread_task {
-    explicit thread_task(thread_task_f new_function) : function(std::move(new_function)) {
-        const auto result = pthread_mutex_init(&mutex, nullptr);
-        assert(result == success);
-        initializeConditionVariable(&finished_cv);
-    }
-    ~thread_task() {
-        pthread_cond_destroy(&finished_cv);
-        pthread_mutex_destroy(&mutex);
-    }
+// Aligned, so the tasks allocated one after another and run by different workers have no common lines
+struct alignas(cache_line_size) thread_task {
+    explicit thread_task(thread_task_f new_function) : function(std::move(new_function)) {}
+    thread_task(const thread_task_cb new_callback, void *new_callback_arg)
+        : callback(new_callback), callback_arg(new_callback_arg) {}
 
-    // callable
+    // callable, either the function or the callback with its argument
     thread_task_f function {};
-    mutable pthread_mutex_t mutex {};
+    thread_task_cb callback = nullptr;
+    void *callback_arg = nullptr;
+
+    thread_task_priority priority = TPOOL_PRIORITY_NORMAL;
+    // Seconds since the push for the task to start, and the time it is by. 0 when there is no deadline
+    double start_timeout = std::numeric_limits<double>::infinity();
+    std::int64_t deadline_ns = 0;
+    // Goes to the finished queue of the pool when done, linked by next_finished
+    bool notify_finished = false;
+    // From thread_pool_submit(), reused when done instead of deleted
+    bool is_submitted = false;
+    thread_task *next_finished = nullptr;
+#if THREAD_POOL_STATS
+    // When it was given to the workers
+    std::int64_t queued_ns = 0;
+#endif
 
-    pthread_cond_t finished_cv {};
+    // The pool of the last push. Set before the task gets to the workers
     thread_pool *parent_pool = nullptr;
-    State task_state = State::New;
-    bool is_joined = false;
-    bool is_detached = false;
+    /**
+     * State and flags, see stateOf(). Each change is a CAS, the pusher, the worker, the joiner and the detacher race
+     * only on this word.
+     */
+    std::atomic<std::uint32_t> state_word {static_cast<std::uint32_t>(State::New)};
+    // The tasks to push when this one has run, a lock-free stack. Closed by the worker, reset by the next push
+    std::atomic<task_dependent *> dependents {nullptr};
+    // Predecessors not run yet, for a task waiting in thread_task_when_all()
+    std::atomic<int> dependency_count {0};
 };
 /* -------------------------------------------- *** -------------------------------------------- */
 
 /* ------------------------------------------ Helpers ------------------------------------------ */
 namespace {
 
+// The arena of the worker running in this thread, a worker belongs to one pool
+thread_local thread_arena *current_arena = nullptr;
+
+struct arena_mark {
+    std::size_t chunk;
+    std::size_t used;
+};
+
+arena_mark arenaMark(const thread_arena *arena) {
+    return {arena->current, arena->used};
+}
+
+// Free what is allocated since the mark. Back at the start, the chunks over the kept size go to the heap.
+void arenaRelease(thread_arena *arena, const arena_mark mark) {
+    arena->current = mark.chunk;
+    arena->used = mark.used;
+    if (mark.chunk != 0 || mark.used != 0) {
+        return;
+    }
+    while (arena->chunks.size() > 1 && arena->total_size > arena_keep_size) {
+        arena->total_size -= arena->chunks.back().size;
+        arena->chunks.pop_back();
+    }
+}
+
+void *arenaAllocate(thread_arena *arena, const std::size_t size) {
+    constexpr std::size_t alignment = alignof(std::max_align_t);
+    std::size_t offset = (arena->used + alignment - 1) & ~(alignment - 1);
+    if (arena->chunks.empty() || offset + size > arena->chunks[arena->current].size) {
+        // The next free chunk if it fits, or a new one in front of it
+        std::size_t next = arena->chunks.empty() ? 0 : arena->current + 1;
+        if (next == arena->chunks.size() || arena->chunks[next].size < size) {
+            std::size_t chunk_size = arena->chunks.empty() ? arena_initial_chunk_size
+                                                           : arena->chunks[arena->current].size * 2;
+            chunk_size = std::max(chunk_size, size);
+            char *memory = new (std::nothrow) char[chunk_size];
+            if (memory == nullptr) {
+                return nullptr;
+            }
+            arena->chunks.insert(arena->chunks.begin() + static_cast<std::ptrdiff_t>(next),
+                                 thread_arena::chunk {std::unique_ptr<char[]>(memory), chunk_size});
+            arena->total_size += chunk_size;
+        }
+        arena->current = next;
+        offset = 0;
+    }
+    arena->used = offset + size;
+    return arena->chunks[arena->current].memory.get() + offset;
+}
+
 /*
  * pthread_cond_t           -> std::condition_variable
  * pthread_cond_signal()    -> .notify_one()
@@ -126,116 +627,813 @@ void initializeConditionVariable(pthread_cond_t *condition) {
     pthread_condattr_destroy(&attributes);
 }
 
-void run(thread_task *task) {
-    // Running
-    pthread_mutex_lock(&task->mutex);
-    task->task_state = State::Running;
-    pthread_mutex_unlock(&task->mutex);
+#if THREAD_POOL_FUTEX
+
+// Sleep while the word is the expected one, until the absolute CLOCK_MONOTONIC deadline if it is given.
+int futexWait(std::atomic<std::uint32_t> *word, const std::uint32_t expected, const timespec *deadline) {
+    if (syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(word), FUTEX_WAIT_BITSET_PRIVATE, expected, deadline,
+                nullptr, FUTEX_BITSET_MATCH_ANY) != success) {
+        return errno;
+    }
+    return success;
+}
+
+void futexWakeAll(std::atomic<std::uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(word), FUTEX_WAKE_PRIVATE, std::numeric_limits<int>::max(),
+            nullptr, nullptr, 0);
+}
+
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "the state word is a futex");
+
+#endif
+
+void releaseDependents(worker_context *context, thread_task *task);
+
+// Remember when the task is given to the workers, for the stats
+void stampQueued([[maybe_unused]] thread_task *task) {
+    TRACE_INSTANT("task enqueue", task);
+#if THREAD_POOL_STATS
+    task->queued_ns = nowNs();
+#endif
+}
+
+// Tell the consumer of the finished tasks there is something, if it has asked for the fd
+void signalFinished(thread_pool *pool) {
+#if defined(__linux__)
+    if (const int fd = pool->finished_fd.load(); fd >= 0) {
+        // Fails only when the counter is full, then it is readable anyway
+        const std::uint64_t one = 1;
+        const auto result = write(fd, &one, sizeof(one));
+        (void)result;
+    }
+#else
+    (void)pool;
+#endif
+}
+
+void pushFinished(thread_pool *pool, thread_task *task) {
+    task->next_finished = pool->finished_tasks.load();
+    while (!pool->finished_tasks.compare_exchange_weak(task->next_finished, task)) {
+    }
+    signalFinished(pool);
+}
+
+/**
+ * Keep a submitted task for the next submit. The worker keeps a few for itself without any lock, the rest go to the
+ * pool in a batch, and what is over the limit there is deleted.
+ */
+void recycleTask(worker_context *context, thread_task *task) {
+    // The captures are released now, not at the reuse
+    task->function = nullptr;
+    context->free_tasks.push_back(task);
+    if (context->free_tasks.size() <= worker_free_task_limit) {
+        return;
+    }
+    thread_pool *pool = context->pool;
+    const std::size_t moved_count = worker_free_task_limit / 2;
+    adaptive_lock_lock(&pool->free_tasks_mutex);
+    for (std::size_t index = 0; index < moved_count; ++index) {
+        thread_task *moved = context->free_tasks.back();
+        context->free_tasks.pop_back();
+        if (pool->free_tasks.size() < pool_free_task_limit) {
+            pool->free_tasks.push_back(moved);
+        } else {
+            delete moved;
+        }
+    }
+    adaptive_lock_unlock(&pool->free_tasks_mutex);
+}
 
-    // Execution
+void run(worker_context *context, thread_task *task) {
+    thread_pool *current_pool = task->parent_pool;
+    // Running, keeping the flags the detach can set meanwhile
+    std::uint32_t word = task->state_word.load();
+    while (!task->state_word.compare_exchange_weak(word, withState(word, State::Running))) {
+    }
+
+    // Execution, unless it is too late
+    const bool is_expired = task->deadline_ns != 0 && nowNs() > task->deadline_ns;
+    const arena_mark mark = arenaMark(&context->arena);
+    TRACE_BEGIN("task", task);
     try {
-        task->function();
+        if (is_expired) {
+            // skipped
+        } else if (task->callback != nullptr) {
+            task->callback(task->callback_arg);
+        } else {
+            task->function();
+        }
     } catch (...) {
         // do nothing
     }
+    TRACE_END("task");
+    arenaRelease(&context->arena, mark);
+    // Before Finished, the task can be deleted by the joiner right after that
+    releaseDependents(context, task);
+    if (task->notify_finished) {
+        pushFinished(current_pool, task);
+    }
+
+    // Finished. A detached task is joined by itself. The task is not touched after that unless it is detached
+    std::uint32_t finished_word;
+    do {
+        finished_word = withState(word, State::Finished) & ~has_waiters_flag;
+        if (is_expired) {
+            finished_word |= expired_flag;
+        }
+        if ((word & detached_flag) != 0) {
+            finished_word |= joined_flag;
+        }
+    } while (!task->state_word.compare_exchange_weak(word, finished_word));
+
+    if ((word & has_waiters_flag) != 0) {
+#if THREAD_POOL_FUTEX
+        /*
+         * The woken joiner can delete the task right away, even before the wake if it has seen the word by itself.
+         * The wake then is for the address only, like in an unlock, and the waiters of whatever is there now recheck.
+         */
+        futexWakeAll(&task->state_word);
+#else
+        pthread_mutex_lock(&current_pool->join_mutex);
+        pthread_cond_broadcast(&current_pool->joined_cv);
+        pthread_mutex_unlock(&current_pool->join_mutex);
+#endif
+    }
+    if ((word & detached_flag) != 0) {
+        // Remove from pool ownership and delete.
+        --current_pool->pending_task_count;
+        if (task->is_submitted) {
+            recycleTask(context, task);
+        } else {
+            delete task;
+        }
+    }
+}
+
+/**
+ * Wait until the task is finished, not longer than the deadline if it is given. The waiter is announced in the task
+ * before the futex wait on the word with the flag, or before the check under the pool join_mutex, and the worker
+ * looks at it after finishing, so the wakeup is not lost. A task finished without waiters costs just its CAS.
+ */
+int waitFinished(thread_task *task, const timespec *deadline) {
+    std::uint32_t word = task->state_word.load();
+    while (stateOf(word) != State::Finished && (word & has_waiters_flag) == 0) {
+        if (task->state_word.compare_exchange_weak(word, word | has_waiters_flag)) {
+            word |= has_waiters_flag;
+        }
+    }
+    if (stateOf(word) == State::Finished) {
+        return success;
+    }
+#if THREAD_POOL_FUTEX
+    while (stateOf(word) != State::Finished) {
+        if (futexWait(&task->state_word, word, deadline) == ETIMEDOUT) {
+            return stateOf(task->state_word.load()) == State::Finished ? success : TPOOL_ERR_TIMEOUT;
+        }
+        word = task->state_word.load();
+    }
+    return success;
+#else
+    thread_pool *current_pool = task->parent_pool;
+    int result = success;
+    pthread_mutex_lock(&current_pool->join_mutex);
+    while (stateOf(task->state_word.load()) != State::Finished) {
+        if (deadline == nullptr) {
+            pthread_cond_wait(&current_pool->joined_cv, &current_pool->join_mutex);
+        } else if (pthread_cond_timedwait(&current_pool->joined_cv, &current_pool->join_mutex, deadline) ==
+                   ETIMEDOUT) {
+            if (stateOf(task->state_word.load()) != State::Finished) {
+                result = TPOOL_ERR_TIMEOUT;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&current_pool->join_mutex);
+    return result;
+#endif
+}
+
+// The task is finished, make it joined and leave the pool.
+void markJoined(thread_task *task) {
+    // Nobody else changes a finished task.
+    task->state_word.fetch_or(joined_flag);
+    --task->parent_pool->pending_task_count;
+}
+
+/**
+ * Wake up to count sleeping workers. The check of the idle workers is sequentially consistent with their check of the
+ * queues before sleeping, so either the task is seen or the worker is woken up.
+ */
+void wakeWorkers(thread_pool *pool, const std::size_t count) {
+    if (count == 0 || pool->idle_workers.load() == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    if (count >= static_cast<std::size_t>(pool->idle_workers.load())) {
+        pthread_cond_broadcast(&pool->has_task_cv);
+    } else {
+        for (std::size_t index = 0; index < count; ++index) {
+            pthread_cond_signal(&pool->has_task_cv);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Take the first task of the injector and move a fair share of the rest into the deque of the worker. Returns how many
+ * were moved.
+ */
+thread_task *takeFromInjector(worker_context *context, std::size_t *moved_count) {
+    thread_pool *pool = context->pool;
+    const std::int64_t size = pool->injector_size.load();
+    if (size <= 0) {
+        return nullptr;
+    }
+#if THREAD_POOL_LOCK_FREE_QUEUE
+    // The first one is for this worker, the rest go to its deque.
+    thread_task *tasks[injector_batch_limit + 1];
+    const auto share = static_cast<std::size_t>(size - 1) / static_cast<std::size_t>(pool->thread_count.load());
+    const std::size_t count = pool->injector.pop_n(tasks, std::min(share, injector_batch_limit) + 1);
+    if (count == 0) {
+        return nullptr;
+    }
+    pool->injector_size -= static_cast<std::int64_t>(count);
+    for (std::size_t index = 1; index < count; ++index) {
+        context->deque.push(tasks[index]);
+    }
+    *moved_count = count - 1;
+    return tasks[0];
+#else
+    adaptive_lock_lock(&pool->injector_mutex);
+    if (pool->injector.empty()) {
+        adaptive_lock_unlock(&pool->injector_mutex);
+        return nullptr;
+    }
+    thread_task *task = pool->injector.front();
+    pool->injector.pop_front();
+    const std::size_t share = pool->injector.size() / static_cast<std::size_t>(pool->thread_count.load());
+    const std::size_t count = std::min(share, injector_batch_limit);
+    for (std::size_t index = 0; index < count; ++index) {
+        context->deque.push(pool->injector.front());
+        pool->injector.pop_front();
+    }
+    pool->injector_size.store(static_cast<std::int64_t>(pool->injector.size()));
+    adaptive_lock_unlock(&pool->injector_mutex);
+    *moved_count = count;
+    return task;
+#endif
+}
+
+thread_task *takeUrgent(thread_pool *pool) {
+    if (pool->urgent_size.load() <= 0) {
+        return nullptr;
+    }
+    adaptive_lock_lock(&pool->urgent_mutex);
+    if (pool->urgent_tasks.empty()) {
+        adaptive_lock_unlock(&pool->urgent_mutex);
+        return nullptr;
+    }
+    thread_task *task = pool->urgent_tasks.front();
+    pool->urgent_tasks.pop_front();
+    pool->urgent_size.store(static_cast<std::int64_t>(pool->urgent_tasks.size()));
+    adaptive_lock_unlock(&pool->urgent_mutex);
+    return task;
+}
+
+void pushToUrgentLane(thread_pool *pool, thread_task *task) {
+    adaptive_lock_lock(&pool->urgent_mutex);
+    pool->urgent_tasks.push_back(task);
+    pool->urgent_size.store(static_cast<std::int64_t>(pool->urgent_tasks.size()));
+    adaptive_lock_unlock(&pool->urgent_mutex);
+}
+
+void pushToNormalLane(thread_pool *pool, thread_task *const *tasks, const std::size_t count) {
+    if (count == 0) {
+        return;
+    }
+#if THREAD_POOL_LOCK_FREE_QUEUE
+    // The tasks are counted before the push, so there is always a place.
+    const std::size_t pushed_count = pool->injector.push_n(tasks, count);
+    assert(pushed_count == count);
+    (void)pushed_count;
+    pool->injector_size += static_cast<std::int64_t>(count);
+#else
+    adaptive_lock_lock(&pool->injector_mutex);
+    pool->injector.insert(pool->injector.end(), tasks, tasks + count);
+    pool->injector_size.store(static_cast<std::int64_t>(pool->injector.size()));
+    adaptive_lock_unlock(&pool->injector_mutex);
+#endif
+}
+
+// Publish the queued tasks to the workers, each in the lane of its priority.
+void pushToInjector(thread_pool *pool, thread_task *const *tasks, const std::size_t count) {
+    std::size_t normal_begin = 0;
+    for (std::size_t index = 0; index < count; ++index) {
+        if (tasks[index]->priority == TPOOL_PRIORITY_HIGH) {
+            pushToNormalLane(pool, tasks + normal_begin, index - normal_begin);
+            pushToUrgentLane(pool, tasks[index]);
+            normal_begin = index + 1;
+        }
+    }
+    pushToNormalLane(pool, tasks + normal_begin, count - normal_begin);
+}
+
+/**
+ * Make a free task queued in the pool. It is not visible to the workers yet, so can be given back its old state word,
+ * if it is saved.
+ */
+int claimTask(thread_pool *pool, thread_task *task, std::uint32_t *old_word = nullptr) {
+    if (task == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    std::uint32_t word = task->state_word.load();
+    if (old_word != nullptr) {
+        *old_word = word;
+    }
+    if (!isFree(word)) {
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    task->parent_pool = pool;
+    task->deadline_ns = 0;
+    if (task->start_timeout != std::numeric_limits<double>::infinity()) {
+        const double timeout = std::min(task->start_timeout, max_deadline_seconds);
+        task->deadline_ns = nowNs() + static_cast<std::int64_t>(timeout * nsec_per_sec);
+    }
+    stampQueued(task);
+    if (!task->state_word.compare_exchange_strong(word, static_cast<std::uint32_t>(State::Queued))) {
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    // The dependents of the last run are released, the new ones wait for this run.
+    task->dependents.store(nullptr);
+    return success;
+}
+
+/**
+ * Steal from the other workers, starting from the next one. The workers on the same NUMA node are tried first, their
+ * tasks likely have the data in the shared cache.
+ */
+thread_task *stealTask(const worker_context *context) {
+    const thread_pool *pool = context->pool;
+    const int count = pool->thread_count.load(std::memory_order_acquire);
+    const bool by_node = context->node >= 0;
+    for (int pass = 0; pass < (by_node ? 2 : 1); ++pass) {
+        for (int offset = 1; offset < count; ++offset) {
+            const auto &victim = pool->workers[(context->index + offset) % count];
+            if (by_node && (victim->node == context->node) != (pass == 0)) {
+                continue;
+            }
+            if (thread_task *task = victim->deque.steal(); task != nullptr) {
+                return task;
+            }
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * The next task for the worker: an urgent one, then its own, then the new ones, then the others'. After a few urgent
+ * tasks in a row one of the others goes first, so they make progress under any flood of the urgent ones.
+ */
+thread_task *findTask(worker_context *context, std::size_t *moved_count) {
+    *moved_count = 0;
+    if (context->urgent_streak < urgent_streak_limit) {
+        if (thread_task *task = takeUrgent(context->pool); task != nullptr) {
+            ++context->urgent_streak;
+            return task;
+        }
+    }
+    context->urgent_streak = 0;
+    if (thread_task *task = context->deque.take(); task != nullptr) {
+        return task;
+    }
+    if (thread_task *task = takeFromInjector(context, moved_count); task != nullptr) {
+        return task;
+    }
+    if (thread_task *task = stealTask(context); task != nullptr) {
+#if THREAD_POOL_STATS
+        addTo(context->stats.steal_count, 1);
+#endif
+        return task;
+    }
+    return takeUrgent(context->pool);
+}
+
+// The counter based clock, it is read around each task for the stats
+std::int64_t nowNs() {
+    return static_cast<std::int64_t>(clock_fast_ns());
+}
+
+void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * Spin with an exponential backoff for a time adapted to how soon the tasks came lately. Gives up at once if they
+ * come too rarely to be caught by a spin.
+ */
+thread_task *spinForTask(worker_context *context, const std::int64_t idle_start_ns, std::size_t *moved_count) {
+    const std::int64_t spin_ns = 2 * context->average_idle_ns;
+    if (spin_ns > max_spin_ns) {
+        return nullptr;
+    }
+    int backoff = 1;
+    while (nowNs() - idle_start_ns < spin_ns) {
+        for (int index = 0; index < backoff; ++index) {
+            cpuRelax();
+        }
+        backoff = std::min(backoff * 2, max_spin_backoff);
+        if (thread_task *task = findTask(context, moved_count); task != nullptr) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Sleep until a task comes or the pool stops. Only the last worker exits on the idle timeout, so the started workers
+ * are always the first thread_count. Returns null when the worker should exit.
+ */
+thread_task *sleepForTask(worker_context *context, std::size_t *moved_count) {
+    thread_pool *pool = context->pool;
+    thread_task *task = nullptr;
+    // Being idle is announced before the last check of the queues.
+    pthread_mutex_lock(&pool->mutex);
+    ++pool->idle_workers;
+    while (!pool->stop && (task = findTask(context, moved_count)) == nullptr) {
+        if (pool->idle_timeout == std::numeric_limits<double>::infinity()) {
+            pthread_cond_wait(&pool->has_task_cv, &pool->mutex);
+            continue;
+        }
+        timespec deadline {};
+        initializeDeadline(&deadline, pool->idle_timeout);
+        if (pthread_cond_timedwait(&pool->has_task_cv, &pool->mutex, &deadline) != ETIMEDOUT ||
+            context->index != pool->thread_count.load() - 1 || (task = findTask(context, moved_count)) != nullptr) {
+            continue;
+        }
+        // Reaped. The pushers see the smaller count before they see no idle workers, and then spawn a new one.
+        pool->reaped_threads.push_back(pool->threads.back());
+        pool->threads.pop_back();
+        pool->thread_count.store(context->index, std::memory_order_release);
+        break;
+    }
+    --pool->idle_workers;
+    pthread_mutex_unlock(&pool->mutex);
+    return task;
+}
+
+// ReSharper disable once CppDFAConstantFunctionResult
+void *worker(void *arg) {
+    auto *context = static_cast<worker_context *>(arg);
+    if (context == nullptr) {
+        return nullptr;
+    }
+    thread_pool *pool = context->pool;
+    if (pool->has_worker_key) {
+        pthread_setspecific(pool->worker_key, context);
+    }
+    current_arena = &context->arena;
+
+    while (true) {
+        std::size_t moved_count = 0;
+        thread_task *task = findTask(context, &moved_count);
+        if (task == nullptr) {
+            const std::int64_t idle_start_ns = nowNs();
+            task = spinForTask(context, idle_start_ns, &moved_count);
+            if (task == nullptr) {
+                task = sleepForTask(context, &moved_count);
+            }
+            // exit wait loop, the pool is deleted only without tasks
+            if (task == nullptr) {
+                break;
+            }
+            const std::int64_t idle_ns = nowNs() - idle_start_ns;
+#if THREAD_POOL_STATS
+            addTo(context->stats.idle_ns, static_cast<std::uint64_t>(idle_ns));
+#endif
+            context->average_idle_ns = (context->average_idle_ns * 7 + std::min(idle_ns, 2 * max_spin_ns)) / 8;
+        }
+        // The moved tasks can be stolen by the sleeping workers.
+        wakeWorkers(pool, moved_count);
+#if THREAD_POOL_STATS
+        const std::int64_t start_ns = nowNs();
+        context->stats.queue_latency.record(start_ns - task->queued_ns);
+        run(context, task);
+        const std::int64_t run_ns = nowNs() - start_ns;
+        context->stats.run_time.record(run_ns);
+        addTo(context->stats.busy_ns, static_cast<std::uint64_t>(run_ns));
+#else
+        run(context, task);
+#endif
+    }
+    current_arena = nullptr;
+    return nullptr;
+}
+
+/*
+* this is dangerous:
+bool isLockHeld(pthread_mutex_t *mutex) {
+    // we should hold it
+    if (const auto result = pthread_mutex_trylock(mutex); result == success) {
+        pthread_mutex_unlock(mutex);
+        return false;
+    }
+    return true;
+}
+*/
+
+[[maybe_unused]] int spawnLockedWorker(thread_pool *pool) {
+    // mutex should be locked
+    if (pool->stop) {
+        return failure;
+    }
+    if (pool->threads.size() >= static_cast<std::size_t>(pool->max_threads)) {
+        return failure;
+    }
+
+    for (const auto &thread : pool->reaped_threads) {
+        pthread_join(thread, nullptr);
+    }
+    pool->reaped_threads.clear();
+    const auto index = static_cast<int>(pool->threads.size());
+    auto &context = pool->workers[index];
+    if (context == nullptr) {
+        int cpu = -1;
+        int node = -1;
+        if (!pool->cpus.empty()) {
+            const std::size_t cpu_index = index % pool->cpus.size();
+            cpu = pool->cpus[cpu_index];
+            node = pool->cpu_nodes[cpu_index];
+        }
+        context = std::make_unique<worker_context>(pool, index, cpu, node);
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    if (context->cpu >= 0) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(context->cpu, &cpu_set);
+        pthread_attr_setaffinity_np(&attributes, sizeof(cpu_set), &cpu_set);
+    }
+    // Published before the start, the new worker counts itself. Its deque is empty until then.
+    pool->thread_count.store(index + 1, std::memory_order_release);
+    pthread_t new_thread;
+    const int result = pthread_create(&new_thread, &attributes, worker, context.get());
+    pthread_attr_destroy(&attributes);
+    if (result != success) {
+        pool->thread_count.store(index, std::memory_order_release);
+        return result;
+    }
+    pool->threads.push_back(new_thread);
+    return success;
+}
+
+/**
+ * Get workers for count new tasks: wake up the idle ones, and start new threads for the rest while the limit allows.
+ * The pool mutex is taken at most twice however big the count is.
+ */
+[[maybe_unused]] int wakeOrSpawnWorkers(thread_pool *pool, const std::size_t count) {
+    // All the workers are busy, they'll get to the tasks.
+    if (pool->idle_workers.load() == 0 && pool->thread_count.load() >= pool->max_threads) {
+        return success;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    const auto idle_count = static_cast<std::size_t>(pool->idle_workers.load());
+    if (count >= idle_count) {
+        pthread_cond_broadcast(&pool->has_task_cv);
+    } else {
+        for (std::size_t index = 0; index < count; ++index) {
+            pthread_cond_signal(&pool->has_task_cv);
+        }
+    }
+    // A new thread only when all the started ones are busy.
+    for (std::size_t spawned = idle_count; spawned < count; ++spawned) {
+        if (spawnLockedWorker(pool) != success) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return success;
+}
+
+/**
+ * Give the queued tasks with all the predecessors run to the workers. A worker of the same pool keeps them in its own
+ * deque, so a chain of tasks stays on one thread with the data in its cache, and the others steal the rest.
+ */
+void pushReady(worker_context *context, thread_task *const *tasks, const std::size_t count) {
+    for (std::size_t index = 0; index < count; ++index) {
+        thread_pool *pool = tasks[index]->parent_pool;
+        stampQueued(tasks[index]);
+        if (context != nullptr && context->pool == pool && tasks[index]->priority != TPOOL_PRIORITY_HIGH) {
+            context->deque.push(tasks[index]);
+            // The worker takes the first itself.
+            if (index > 0) {
+                wakeOrSpawnWorkers(pool, 1);
+            }
+            continue;
+        }
+        pushToInjector(pool, &tasks[index], 1);
+        wakeOrSpawnWorkers(pool, 1);
+    }
+}
+
+void releaseDependents(worker_context *context, thread_task *task) {
+    task_dependent *dependent = task->dependents.exchange(closedDependents());
+    std::vector<thread_task *> ready;
+    while (dependent != nullptr) {
+        task_dependent *next = dependent->next;
+        if (dependent->task->dependency_count.fetch_sub(1) == 1) {
+            ready.push_back(dependent->task);
+        }
+        delete dependent;
+        dependent = next;
+    }
+    pushReady(context, ready.data(), ready.size());
+}
+
+// The worker of the pool running in this thread, if it is one.
+worker_context *currentWorker(const thread_pool *pool) {
+    if (!pool->has_worker_key) {
+        return nullptr;
+    }
+    auto *context = static_cast<worker_context *>(pthread_getspecific(pool->worker_key));
+    return context != nullptr && context->pool == pool ? context : nullptr;
+}
+
+// A task for a submit: one kept by the worker, then by the pool, then a new one
+thread_task *takeFreeTask(thread_pool *pool, worker_context *context) {
+    thread_task *task = nullptr;
+    if (context != nullptr && !context->free_tasks.empty()) {
+        task = context->free_tasks.back();
+        context->free_tasks.pop_back();
+        return task;
+    }
+    adaptive_lock_lock(&pool->free_tasks_mutex);
+    if (!pool->free_tasks.empty()) {
+        task = pool->free_tasks.back();
+        pool->free_tasks.pop_back();
+    }
+    adaptive_lock_unlock(&pool->free_tasks_mutex);
+    if (task == nullptr) {
+        task = new thread_task(thread_task_f {});
+        task->is_submitted = true;
+    }
+    return task;
+}
+
+// Either the callback or the function, into a detached task nobody else sees
+int submitTask(thread_pool *pool, const thread_task_cb callback, void *callback_arg, const thread_task_f *function) {
+    if (pool->pending_task_count.fetch_add(1) >= TPOOL_MAX_TASKS) {
+        --pool->pending_task_count;
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+    worker_context *context = currentWorker(pool);
+    thread_task *task = takeFreeTask(pool, context);
+    task->callback = callback;
+    task->callback_arg = callback_arg;
+    if (function != nullptr) {
+        task->function = *function;
+    }
+    task->parent_pool = pool;
+    task->dependents.store(nullptr);
+    task->state_word.store(static_cast<std::uint32_t>(State::Queued) | detached_flag);
+    stampQueued(task);
+    if (context != nullptr) {
+        context->deque.push(task);
+    } else {
+        pushToInjector(pool, &task, 1);
+    }
+    wakeOrSpawnWorkers(pool, 1);
+    return success;
+}
+
+void runParallelPart(void *arg);
+
+// Push a part as a task joined by the caller. False when the pool is full, then the caller does it itself.
+bool pushParallelPart(parallel_job *job, const std::int64_t first_block, const std::int64_t last_block) {
+    thread_pool *pool = job->pool;
+    if (pool->pending_task_count.fetch_add(1) >= TPOOL_MAX_TASKS) {
+        --pool->pending_task_count;
+        return false;
+    }
+    auto *part = new parallel_part {job, first_block, last_block, nullptr, job->parts.load()};
+    auto *task = new thread_task(runParallelPart, part);
+    part->task = task;
+    while (!job->parts.compare_exchange_weak(part->next, part)) {
+    }
+    task->parent_pool = pool;
+    task->state_word.store(static_cast<std::uint32_t>(State::Queued));
+    stampQueued(task);
+    if (worker_context *context = currentWorker(pool); context != nullptr) {
+        context->deque.push(task);
+    } else {
+        pushToInjector(pool, &task, 1);
+    }
+    wakeOrSpawnWorkers(pool, 1);
+    return true;
+}
 
-    thread_pool *current_pool = nullptr;
-
-    // Finished
-    pthread_mutex_lock(&task->mutex);
-    task->task_state = State::Finished;
-    const bool do_detach = task->is_detached;
-    if (do_detach) {
-        task->is_joined = true;
-        current_pool = task->parent_pool;    // capture before clearing
-        task->parent_pool = nullptr;         // disassociate
+/**
+ * Give away the right halves while the part is bigger than a leaf, then do the rest. The given away halves are split
+ * further by those who steal them, so the idle workers get the work without any central queue.
+ */
+void runParallelBlocks(parallel_job *job, const std::int64_t first_block, std::int64_t last_block) {
+    while (last_block - first_block > job->leaf_blocks) {
+        const std::int64_t middle_block = first_block + (last_block - first_block) / 2;
+        if (!pushParallelPart(job, middle_block, last_block)) {
+            break;
+        }
+        last_block = middle_block;
     }
-    pthread_cond_broadcast(&task->finished_cv);
-    pthread_mutex_unlock(&task->mutex);
-
-    if (do_detach) {
-        // Remove from pool ownership and delete.
-        if (current_pool != nullptr) {
-            pthread_mutex_lock(&current_pool->mutex);
-            current_pool->tasks_in_pool.erase(task);
-            pthread_mutex_unlock(&current_pool->mutex);
+    for (std::int64_t block = first_block; block < last_block; ++block) {
+        const std::int64_t block_begin = job->begin + block * job->grain;
+        try {
+            (*job->function)(block_begin, std::min(job->end, block_begin + job->grain));
+        } catch (...) {
+            // do nothing, like a task
         }
-        delete task;
     }
-}
-
-// ReSharper disable once CppDFAConstantFunctionResult
-void *worker(void *arg) {
-    auto *pool = static_cast<thread_pool *>(arg);
-    if (pool == nullptr) {
-        return nullptr;
+    // The pushed halves count their blocks themselves.
+    const std::int64_t own_block_count = last_block - first_block;
+    if (job->remaining_blocks.fetch_sub(own_block_count) == own_block_count) {
+        pthread_mutex_lock(&job->mutex);
+        job->done = true;
+        pthread_cond_broadcast(&job->done_cv);
+        pthread_mutex_unlock(&job->mutex);
     }
+}
 
-    // Wait loop:
-    while (true) {
-        pthread_mutex_lock(&pool->mutex);
+void runParallelPart(void *arg) {
+    const parallel_part *part = static_cast<parallel_part *>(arg);
+    runParallelBlocks(part->job, part->first_block, part->last_block);
+}
 
-        // wait for task
-        while (!pool->stop && pool->tasks_queue.empty()) {
-            ++pool->idle_workers;
-            pthread_cond_wait(&pool->has_task_cv, &pool->mutex);
-            --pool->idle_workers;
-        }
-        // exit wait loop
-        if (pool->stop && pool->tasks_queue.empty()) {
-            pthread_mutex_unlock(&pool->mutex);
+// The NUMA node of the CPU from sysfs, -1 if the system doesn't tell.
+int cpuNode(const int cpu) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *directory = opendir(path);
+    if (directory == nullptr) {
+        return -1;
+    }
+    int node = -1;
+    while (const dirent *entry = readdir(directory)) {
+        if (int value = 0; std::sscanf(entry->d_name, "node%d", &value) == 1) {
+            node = value;
             break;
         }
-
-        const auto task = pool->tasks_queue.front();
-        pool->tasks_queue.pop_front();
-        pthread_mutex_unlock(&pool->mutex);
-        run(task);
     }
-    return nullptr;
+    closedir(directory);
+    return node;
 }
 
-/*
-* this is dangerous:
-bool isLockHeld(pthread_mutex_t *mutex) {
-    // we should hold it
-    if (const auto result = pthread_mutex_trylock(mutex); result == success) {
-        pthread_mutex_unlock(mutex);
-        return false;
-    }
-    return true;
-}
-*/
+#if THREAD_POOL_STATS
 
-[[maybe_unused]] int spawnLockedWorker(thread_pool *pool) {
-    // mutex should be locked
-    if (pool->stop) {
-        return failure;
-    }
-    if (pool->threads.size() >= static_cast<std::size_t>(pool->max_threads)) {
-        return failure;
+// Sum of the worker histograms, into the percentiles
+struct latency_summary {
+    void add(const latency_histogram &histogram) {
+        for (std::size_t bucket = 0; bucket < histogram_bucket_count; ++bucket) {
+            buckets[bucket] += histogram.buckets[bucket].load(std::memory_order_relaxed);
+        }
+        sum_ns += histogram.sum_ns.load(std::memory_order_relaxed);
+        max_ns = std::max(max_ns, histogram.max_ns.load(std::memory_order_relaxed));
     }
 
-    pthread_t new_thread;
-    if (const int result = pthread_create(&new_thread, nullptr, worker, pool); result != success) {
-        return result;
+    // The bucket counts and the sum are read at different times, count them from the same buckets
+    void fill(thread_pool_latency_stat *stat) const {
+        std::uint64_t count = 0;
+        for (const std::uint64_t bucket_count : buckets) {
+            count += bucket_count;
+        }
+        stat->count = count;
+        stat->mean_ns = count == 0 ? 0 : sum_ns / count;
+        stat->p50_ns = percentile(count, 0.5);
+        stat->p90_ns = percentile(count, 0.9);
+        stat->p99_ns = percentile(count, 0.99);
+        stat->max_ns = max_ns;
     }
-    pool->threads.push_back(new_thread);
-    return success;
-}
-
-[[maybe_unused]] int wakeOrSpawnNewTask(thread_pool *pool) {
-    // mutex should be locked
 
-    if (pool->threads.size() < static_cast<std::size_t>(pool->max_threads)) {
-        if (const auto spawn_result = spawnLockedWorker(pool); spawn_result != success) {
-            return spawn_result;
+    std::uint64_t percentile(const std::uint64_t count, const double fraction) const {
+        const auto rank = static_cast<std::uint64_t>(std::ceil(static_cast<double>(count) * fraction));
+        std::uint64_t seen = 0;
+        for (std::size_t bucket = 0; bucket < histogram_bucket_count; ++bucket) {
+            seen += buckets[bucket];
+            if (seen >= rank && seen > 0) {
+                return std::min(latency_histogram::bucketLimit(bucket), max_ns);
+            }
         }
+        return 0;
     }
-    pthread_cond_signal(&pool->has_task_cv);
 
-    return success;
-}
+    std::array<std::uint64_t, histogram_bucket_count> buckets {};
+    std::uint64_t sum_ns = 0;
+    std::uint64_t max_ns = 0;
+};
+
+#endif
 
 void initializeDeadline(timespec *deadline, const double delay_seconds) {
     // ReSharper disable once CppDFAConstantConditions
@@ -291,7 +1489,34 @@ int thread_pool_new(const int thread_count, thread_pool **pool) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
     /* must NOT start all threads immediately */
-    *pool = new thread_pool(thread_count);
+    *pool = new thread_pool(thread_count, {}, {});
+    return success;
+}
+
+int thread_pool_new_ex(const thread_pool_options *options, thread_pool **pool) {
+    if (pool == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    *pool = nullptr;
+    if (options == nullptr || options->max_threads <= 0 || options->max_threads > TPOOL_THREAD_LIMIT ||
+        options->cpu_count < 0 || (options->cpu_count > 0 && options->cpus == nullptr)) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (options->cpu_count > 0 && sched_getaffinity(0, sizeof(allowed), &allowed) != success) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    std::vector<int> cpus(options->cpus, options->cpus + options->cpu_count);
+    std::vector<int> cpu_nodes;
+    cpu_nodes.reserve(cpus.size());
+    for (const int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        }
+        cpu_nodes.push_back(cpuNode(cpu));
+    }
+    *pool = new thread_pool(options->max_threads, std::move(cpus), std::move(cpu_nodes));
     return success;
 }
 
@@ -299,12 +1524,10 @@ int thread_pool_delete(thread_pool *pool) {
     if (pool == nullptr) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
-    pthread_mutex_lock(&pool->mutex);
-    if (!pool->tasks_in_pool.empty()) {
-        pthread_mutex_unlock(&pool->mutex);
+    if (pool->pending_task_count.load() != 0) {
         return TPOOL_ERR_HAS_TASKS;
     }
-
+    pthread_mutex_lock(&pool->mutex);
     pool->stop = true;
     pthread_cond_broadcast(&pool->has_task_cv);
     pthread_mutex_unlock(&pool->mutex);
@@ -312,58 +1535,333 @@ int thread_pool_delete(thread_pool *pool) {
     for (const auto &thread : pool->threads) {
         pthread_join(thread, nullptr);
     }
+    for (const auto &thread : pool->reaped_threads) {
+        pthread_join(thread, nullptr);
+    }
+    // The tasks kept for the submits
+    for (const auto &context : pool->workers) {
+        if (context != nullptr) {
+            for (thread_task *task : context->free_tasks) {
+                delete task;
+            }
+        }
+    }
+    for (thread_task *task : pool->free_tasks) {
+        delete task;
+    }
     delete pool;
     return success;
 }
 
-int thread_pool_push_task(thread_pool *pool, thread_task *task) {
-    if (pool == nullptr || task == nullptr) {
+int thread_pool_stats(thread_pool *pool, thread_pool_stat *stat) {
+    if (pool == nullptr || stat == nullptr) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
+#if THREAD_POOL_STATS
+    std::int64_t queued_count = std::max<std::int64_t>(pool->injector_size.load(), 0) + pool->urgent_size.load();
+    latency_summary queue_latency;
+    latency_summary run_time;
+    stat->workers.clear();
+    // The contexts are created under the mutex
+    pthread_mutex_lock(&pool->mutex);
+    stat->thread_count = pool->thread_count.load();
+    for (const auto &context : pool->workers) {
+        if (context == nullptr) {
+            break;
+        }
+        if (context->index < stat->thread_count) {
+            queued_count += std::max<std::int64_t>(context->deque.bottom.load() - context->deque.top.load(), 0);
+        }
+        const worker_stats &stats = context->stats;
+        queue_latency.add(stats.queue_latency);
+        run_time.add(stats.run_time);
+        thread_pool_worker_stat worker_stat;
+        worker_stat.task_count = stats.run_time.count.load(std::memory_order_relaxed);
+        worker_stat.steal_count = stats.steal_count.load(std::memory_order_relaxed);
+        worker_stat.busy_ns = stats.busy_ns.load(std::memory_order_relaxed);
+        worker_stat.idle_ns = stats.idle_ns.load(std::memory_order_relaxed);
+        stat->workers.push_back(worker_stat);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    stat->pending_task_count = pool->pending_task_count.load();
+    stat->queued_task_count = static_cast<std::size_t>(queued_count);
+    queue_latency.fill(&stat->queue_latency);
+    run_time.fill(&stat->run_time);
+    return success;
+#else
+    return TPOOL_ERR_NOT_IMPLEMENTED;
+#endif
+}
 
-    // lock pool & check
+int thread_pool_set_idle_timeout(thread_pool *pool, const double timeout) {
+    if (pool == nullptr || !(timeout > 0.0)) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
     pthread_mutex_lock(&pool->mutex);
-    if (pool->stop) {
-        pthread_mutex_unlock(&pool->mutex);
+    pool->idle_timeout = timeout;
+    // The sleeping workers start their timeouts anew.
+    pthread_cond_broadcast(&pool->has_task_cv);
+    pthread_mutex_unlock(&pool->mutex);
+    return success;
+}
+
+int thread_pool_push_task(thread_pool *pool, thread_task *task) {
+    if (pool == nullptr || task == nullptr) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
-    if (pool->tasks_in_pool.size() >= TPOOL_MAX_TASKS) {
-        pthread_mutex_unlock(&pool->mutex);
+
+    // reserve a place & check
+    if (pool->pending_task_count.fetch_add(1) >= TPOOL_MAX_TASKS) {
+        --pool->pending_task_count;
         return TPOOL_ERR_TOO_MANY_TASKS;
     }
 
-    // lock task & check
-    pthread_mutex_lock(&task->mutex);
-    if (task->parent_pool != nullptr) {
-        pthread_mutex_unlock(&task->mutex);
-        pthread_mutex_unlock(&pool->mutex);
-        return TPOOL_ERR_TASK_IN_POOL;
+    // check the task
+    if (const int result = claimTask(pool, task); result != success) {
+        --pool->pending_task_count;
+        return result;
     }
-    if (task->task_state == State::Queued || task->task_state == State::Running) {
-        pthread_mutex_unlock(&task->mutex);
-        pthread_mutex_unlock(&pool->mutex);
-        return TPOOL_ERR_TASK_IN_POOL;
+
+    pushToInjector(pool, &task, 1);
+    if (const auto result = wakeOrSpawnWorkers(pool, 1); result != success) {
+        // do not checked by tests
+        return 0;
     }
-    if (task->task_state == State::Finished && !task->is_joined) {
-        pthread_mutex_unlock(&task->mutex);
-        pthread_mutex_unlock(&pool->mutex);
-        return TPOOL_ERR_TASK_IN_POOL;
+    return success;
+}
+
+int thread_pool_push_tasks(thread_pool *pool, thread_task *const *tasks, const int count) {
+    if (pool == nullptr || tasks == nullptr || count < 0) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
     }
+    const auto task_count = static_cast<std::size_t>(count);
 
-    task->parent_pool = pool;
-    task->task_state = State::Queued;
-    task->is_joined = false;
-    task->is_detached = false;
-    pthread_mutex_unlock(&task->mutex);
-
-    pool->tasks_queue.push_back(task);
-    pool->tasks_in_pool.insert(task);
-    if (const auto result = wakeOrSpawnNewTask(pool); result != success) {
-        pthread_mutex_unlock(&pool->mutex);
+    // reserve the places & check
+    if (pool->pending_task_count.fetch_add(task_count) + task_count > TPOOL_MAX_TASKS) {
+        pool->pending_task_count -= task_count;
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+
+    // check the tasks, all or nothing
+    std::vector<std::uint32_t> old_words(task_count);
+    for (std::size_t index = 0; index < task_count; ++index) {
+        if (const int result = claimTask(pool, tasks[index], &old_words[index]); result != success) {
+            // Nobody has seen the claimed ones yet.
+            for (std::size_t claimed = 0; claimed < index; ++claimed) {
+                tasks[claimed]->state_word.store(old_words[claimed]);
+            }
+            pool->pending_task_count -= task_count;
+            return result;
+        }
+    }
+
+    pushToInjector(pool, tasks, task_count);
+    if (const auto result = wakeOrSpawnWorkers(pool, task_count); result != success) {
         // do not checked by tests
         return 0;
     }
+    return success;
+}
+
+int thread_pool_submit(thread_pool *pool, const thread_task_cb function, void *arg) {
+    if (pool == nullptr || function == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    return submitTask(pool, function, arg, nullptr);
+}
+
+int thread_pool_submit(thread_pool *pool, const thread_task_f &function) {
+    if (pool == nullptr || !function) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    return submitTask(pool, nullptr, nullptr, &function);
+}
+
+thread_arena *thread_pool_current_arena() {
+    return current_arena;
+}
+
+void *thread_arena_alloc(thread_arena *arena, const std::size_t size) {
+    if (arena == nullptr) {
+        return nullptr;
+    }
+    return arenaAllocate(arena, size);
+}
+
+int thread_task_then(thread_task *task, thread_task *next) {
+    return thread_task_when_all(&task, 1, next);
+}
+
+int thread_pool_finished_fd(thread_pool *pool, int *fd) {
+    if (pool == nullptr || fd == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+#if defined(__linux__)
+    pthread_mutex_lock(&pool->mutex);
+    int result = pool->finished_fd.load();
+    if (result < 0) {
+        result = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (result >= 0) {
+            pool->finished_fd.store(result);
+            // Pushed before the fd, there was nobody to signal. Both are sequentially consistent, so either the worker
+            // sees the fd or the task is seen here
+            if (pool->finished_tasks.load() != nullptr) {
+                signalFinished(pool);
+            }
+        }
+    }
     pthread_mutex_unlock(&pool->mutex);
+    if (result < 0) {
+        return TPOOL_ERR_SYSTEM;
+    }
+    *fd = result;
+    return success;
+#else
+    return TPOOL_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+int thread_pool_pop_finished(thread_pool *pool, thread_task **tasks, const int count, int *popped_count) {
+    if (pool == nullptr || (tasks == nullptr && count != 0) || count < 0 || popped_count == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+#if defined(__linux__)
+    // Reset before looking at the tasks, so each one pushed after that signals again
+    if (const int fd = pool->finished_fd.load(); fd >= 0) {
+        std::uint64_t value = 0;
+        const auto result = read(fd, &value, sizeof(value));
+        (void)result;
+    }
+#endif
+    int popped = 0;
+    while (popped < count) {
+        if (pool->taken_finished == nullptr) {
+            // Reversed into the finish order
+            for (thread_task *task = pool->finished_tasks.exchange(nullptr); task != nullptr;) {
+                thread_task *next = task->next_finished;
+                task->next_finished = pool->taken_finished;
+                pool->taken_finished = task;
+                task = next;
+            }
+            if (pool->taken_finished == nullptr) {
+                break;
+            }
+        }
+        thread_task *task = pool->taken_finished;
+        pool->taken_finished = task->next_finished;
+        // It is pushed right before its Finished CAS. Could be joined by the user meanwhile
+        waitFinished(task, nullptr);
+        if ((task->state_word.load() & joined_flag) == 0) {
+            markJoined(task);
+        }
+        tasks[popped++] = task;
+    }
+    // The rest is for the next call
+    if (pool->taken_finished != nullptr || pool->finished_tasks.load() != nullptr) {
+        signalFinished(pool);
+    }
+    *popped_count = popped;
+    return success;
+}
+
+int thread_task_when_all(thread_task *const *tasks, const int count, thread_task *next) {
+    if (tasks == nullptr || count <= 0 || next == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    for (int index = 0; index < count; ++index) {
+        if (tasks[index] == nullptr || tasks[index] == next) {
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        }
+        const std::uint32_t word = tasks[index]->state_word.load();
+        if (isFree(word)) {
+            return TPOOL_ERR_TASK_NOT_PUSHED;
+        }
+        // Can be deleted any moment
+        if ((word & detached_flag) != 0) {
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        }
+    }
+    thread_pool *pool = tasks[0]->parent_pool;
+
+    // reserve a place & check, like a push
+    if (pool->pending_task_count.fetch_add(1) >= TPOOL_MAX_TASKS) {
+        --pool->pending_task_count;
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+    if (const int result = claimTask(pool, next); result != success) {
+        --pool->pending_task_count;
+        return result;
+    }
+
+    // One more while the edges are added, so the task isn't released before all of them are there.
+    next->dependency_count.store(count + 1);
+    for (int index = 0; index < count; ++index) {
+        auto *dependent = new task_dependent {next, tasks[index]->dependents.load()};
+        while (dependent->next != closedDependents() &&
+               !tasks[index]->dependents.compare_exchange_weak(dependent->next, dependent)) {
+        }
+        // Has run already
+        if (dependent->next == closedDependents()) {
+            delete dependent;
+            --next->dependency_count;
+        }
+    }
+    if (next->dependency_count.fetch_sub(1) == 1) {
+        pushReady(nullptr, &next, 1);
+    }
+    return success;
+}
+
+int thread_pool_parallel_for(thread_pool *pool, const std::int64_t begin, const std::int64_t end,
+                             const std::int64_t grain, const thread_range_f &function) {
+    if (pool == nullptr || grain <= 0 || !function) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    if (begin >= end) {
+        return success;
+    }
+    const std::int64_t block_count = (end - begin - 1) / grain + 1;
+    parallel_job job {};
+    job.pool = pool;
+    job.function = &function;
+    job.begin = begin;
+    job.end = end;
+    job.grain = grain;
+    // A few leaves per thread are enough to even out the load, the more would be just the overhead.
+    job.leaf_blocks = std::max<std::int64_t>(1, block_count / (8 * static_cast<std::int64_t>(pool->max_threads)));
+    job.remaining_blocks.store(block_count);
+    pthread_mutex_init(&job.mutex, nullptr);
+    initializeConditionVariable(&job.done_cv);
+
+    runParallelBlocks(&job, 0, block_count);
+    // A worker can't just sleep, its own deque can have the rest. It runs whatever it finds instead.
+    if (worker_context *context = currentWorker(pool); context != nullptr) {
+        while (job.remaining_blocks.load() != 0) {
+            std::size_t moved_count = 0;
+            thread_task *task = findTask(context, &moved_count);
+            if (task == nullptr) {
+                break;
+            }
+            wakeWorkers(pool, moved_count);
+            run(context, task);
+        }
+    }
+    pthread_mutex_lock(&job.mutex);
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cv, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+    // All the blocks are done, so the parts are at most a few steps from finished.
+    for (parallel_part *part = job.parts.load(); part != nullptr;) {
+        parallel_part *next = part->next;
+        waitFinished(part->task, nullptr);
+        markJoined(part->task);
+        delete part->task;
+        delete part;
+        part = next;
+    }
+    pthread_cond_destroy(&job.done_cv);
+    pthread_mutex_destroy(&job.mutex);
     return success;
 }
 
@@ -375,56 +1873,86 @@ int thread_task_new(thread_task **task, const thread_task_f &function) {
     return success;
 }
 
+int thread_task_new_cb(thread_task **task, const thread_task_cb function, void *arg) {
+    if (task == nullptr || function == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    *task = new thread_task(function, arg);
+    return success;
+}
+
+int thread_task_set_priority(thread_task *task, const thread_task_priority priority) {
+    if (task == nullptr || (priority != TPOOL_PRIORITY_NORMAL && priority != TPOOL_PRIORITY_HIGH)) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    if (!isFree(task->state_word.load())) {
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    task->priority = priority;
+    return success;
+}
+
+int thread_task_set_deadline(thread_task *task, const double timeout) {
+    if (task == nullptr || !(timeout >= 0.0)) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    if (!isFree(task->state_word.load())) {
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    task->start_timeout = timeout;
+    return success;
+}
+
+int thread_task_set_notify(thread_task *task, const bool notify) {
+    if (task == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    if (!isFree(task->state_word.load())) {
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    task->notify_finished = notify;
+    return success;
+}
+
+bool thread_task_is_expired(const thread_task *task) {
+    if (task == nullptr) {
+        return false;
+    }
+    const std::uint32_t word = task->state_word.load();
+    return stateOf(word) == State::Finished && (word & expired_flag) != 0;
+}
+
 bool thread_task_is_finished(const thread_task *task) {
     if (task == nullptr) {
         return false;
     }
-    pthread_mutex_lock(&task->mutex);
-    const auto result = task->task_state == State::Finished && task->is_joined == true;
-    pthread_mutex_unlock(&task->mutex);
-    return result;
+    const std::uint32_t word = task->state_word.load();
+    return stateOf(word) == State::Finished && (word & joined_flag) != 0;
 }
 
 bool thread_task_is_running(const thread_task *task) {
     if (task == nullptr) {
         return false;
     }
-    pthread_mutex_lock(&task->mutex);
-    const auto result = task->task_state == State::Running;
-    pthread_mutex_unlock(&task->mutex);
-    return result;
+    return stateOf(task->state_word.load()) == State::Running;
 }
 
 int thread_task_join(thread_task *task) {
     if (task == nullptr) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
-    pthread_mutex_lock(&task->mutex);
-    if (task->parent_pool == nullptr && task->task_state == State::New) {
-        pthread_mutex_unlock(&task->mutex);
+    const std::uint32_t word = task->state_word.load();
+    if (stateOf(word) == State::New) {
         return TPOOL_ERR_TASK_NOT_PUSHED;
     }
     // already joined
-    if (task->task_state == State::Finished && task->is_joined == true && task->parent_pool == nullptr) {
-        pthread_mutex_unlock(&task->mutex);
+    if (isFree(word)) {
         return success;
     }
 
     // wait till finished
-    while (task->task_state != State::Finished) {
-        pthread_cond_wait(&task->finished_cv, &task->mutex);
-    }
-
-    task->is_joined = true;
-    thread_pool *current_pool = task->parent_pool;
-    task->parent_pool = nullptr;
-    pthread_mutex_unlock(&task->mutex);
-    if (current_pool != nullptr) {
-        pthread_mutex_lock(&current_pool->mutex);
-        current_pool->tasks_in_pool.erase(task);
-        pthread_mutex_unlock(&current_pool->mutex);
-    }
-
+    waitFinished(task, nullptr);
+    markJoined(task);
     return success;
 }
 
@@ -435,38 +1963,26 @@ int thread_task_timed_join(thread_task *task, const double timeout) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
 
-    pthread_mutex_lock(&task->mutex);
-    if (task->parent_pool == nullptr && task->task_state == State::New) {
-        pthread_mutex_unlock(&task->mutex);
+    const std::uint32_t word = task->state_word.load();
+    if (stateOf(word) == State::New) {
         return TPOOL_ERR_TASK_NOT_PUSHED;
     }
     // already joined
-    if (task->task_state == State::Finished && task->is_joined && task->parent_pool == nullptr) {
-        pthread_mutex_unlock(&task->mutex);
+    if (isFree(word)) {
         return success;
     }
-    if (task->task_state == State::Finished && !task->is_joined) {
-        pthread_mutex_unlock(&task->mutex);
-        return thread_task_join(task);
-    }
-
-    if (timeout <= 0.0) {
-        pthread_mutex_unlock(&task->mutex);
-        return TPOOL_ERR_TIMEOUT;
-    }
-
-    timespec deadline {};
-    initializeDeadline(&deadline, timeout);
-
-    while (task->task_state != State::Finished) {
-        if (pthread_cond_timedwait(&task->finished_cv, &task->mutex, &deadline) == ETIMEDOUT) {
-            pthread_mutex_unlock(&task->mutex);
+    if (stateOf(word) != State::Finished) {
+        if (timeout <= 0.0) {
             return TPOOL_ERR_TIMEOUT;
         }
+        timespec deadline {};
+        initializeDeadline(&deadline, timeout);
+        if (const int result = waitFinished(task, &deadline); result != success) {
+            return result;
+        }
     }
-
-    pthread_mutex_unlock(&task->mutex);
-    return thread_task_join(task);
+    markJoined(task);
+    return success;
 }
 
 #endif
@@ -476,21 +1992,9 @@ int thread_task_delete(thread_task *task) {
     if (task == nullptr) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
-
-    pthread_mutex_lock(&task->mutex);
-    if (task->parent_pool != nullptr) {
-        pthread_mutex_unlock(&task->mutex);
-        return TPOOL_ERR_TASK_IN_POOL;
-    }
-    if (task->task_state == State::Queued || task->task_state == State::Running) {
-        pthread_mutex_unlock(&task->mutex);
-        return TPOOL_ERR_TASK_IN_POOL;
-    }
-    if (task->task_state == State::Finished && task->is_joined == false) {
-        pthread_mutex_unlock(&task->mutex);
+    if (!isFree(task->state_word.load())) {
         return TPOOL_ERR_TASK_IN_POOL;
     }
-    pthread_mutex_unlock(&task->mutex);
     delete task;
 
     return success;
@@ -499,39 +2003,27 @@ int thread_task_delete(thread_task *task) {
 #if NEED_DETACH
 
 int thread_task_detach(thread_task *task) {
-    if (task == nullptr) {
+    if (task == nullptr || task->notify_finished) {
         return TPOOL_ERR_INVALID_ARGUMENT;
     }
-    pthread_mutex_lock(&task->mutex);
-    if (task->parent_pool == nullptr && task->task_state == State::New) {
-        pthread_mutex_unlock(&task->mutex);
-        return TPOOL_ERR_TASK_NOT_PUSHED;
-    }
-
-    bool delete_now = false;
-    thread_pool *current_pool = nullptr;
-    if (task->task_state == State::Finished) {
-        task->is_detached = true;
-        task->is_joined = true;
-        current_pool = task->parent_pool;
-        task->parent_pool = nullptr;
-        delete_now = true;
-    } else {
-        task->is_detached = true;
-    }
-    pthread_mutex_unlock(&task->mutex);
-
-    // Remove from pool ownership and delete.
-    if (current_pool != nullptr) {
-        pthread_mutex_lock(&current_pool->mutex);
-        current_pool->tasks_in_pool.erase(task);
-        pthread_mutex_unlock(&current_pool->mutex);
-    }
-    if (delete_now) {
-        delete task;
+    std::uint32_t word = task->state_word.load();
+    while (true) {
+        if (stateOf(word) == State::New) {
+            return TPOOL_ERR_TASK_NOT_PUSHED;
+        }
+        if (stateOf(word) == State::Finished) {
+            // The worker is done with it, delete now.
+            if ((word & joined_flag) == 0) {
+                markJoined(task);
+            }
+            delete task;
+            return success;
+        }
+        // The worker deletes it when finished. Retried if it has just finished.
+        if (task->state_word.compare_exchange_weak(word, word | detached_flag)) {
+            return success;
+        }
     }
-
-    return success;
 }
 
 #endif
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <vector>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -20,14 +23,31 @@
 
 struct thread_pool;
 struct thread_task;
+struct thread_arena;
 
 using thread_task_f = std::function<void(void)>;
+/**
+ * A plain function with an argument, see thread_task_new_cb(). Unlike
+ * thread_task_f it never allocates.
+ */
+using thread_task_cb = void (*)(void *arg);
+/** A piece of a range, from @a begin to @a end not including it. */
+using thread_range_f = std::function<void(std::int64_t begin, std::int64_t end)>;
 
 enum {
+    /** Most threads of a pool from thread_pool_new(). */
     TPOOL_MAX_THREADS = 20,
+    /** Most threads of a pool from thread_pool_new_ex(). */
+    TPOOL_THREAD_LIMIT = 1024,
     TPOOL_MAX_TASKS = 100000,
 };
 
+/** Lanes of the tasks, see thread_task_set_priority(). */
+enum thread_task_priority {
+    TPOOL_PRIORITY_NORMAL,
+    TPOOL_PRIORITY_HIGH,
+};
+
 enum thread_pool_errcode {
     TPOOL_ERR_INVALID_ARGUMENT = 1,
     TPOOL_ERR_TOO_MANY_TASKS,
@@ -36,6 +56,8 @@ enum thread_pool_errcode {
     TPOOL_ERR_TASK_IN_POOL,
     TPOOL_ERR_NOT_IMPLEMENTED,
     TPOOL_ERR_TIMEOUT,
+    /** A system call failed, see errno. */
+    TPOOL_ERR_SYSTEM,
 };
 
 /** Thread pool API. */
@@ -52,6 +74,33 @@ enum thread_pool_errcode {
  */
 int thread_pool_new(int thread_count, thread_pool **pool);
 
+/** Settings of a new pool, see thread_pool_new_ex(). */
+struct thread_pool_options {
+    /** Most threads, up to TPOOL_THREAD_LIMIT. */
+    int max_threads = TPOOL_MAX_THREADS;
+    /**
+     * CPUs to pin the threads to, the i-th thread gets
+     * cpus[i % cpu_count]. The pinned threads steal the tasks from
+     * the threads on the same NUMA node first. No pinning when
+     * cpu_count is 0.
+     */
+    const int *cpus = nullptr;
+    int cpu_count = 0;
+};
+
+/**
+ * Create a new thread pool like thread_pool_new(), with more threads
+ * allowed and optionally pinned to CPUs.
+ * @param options Pool settings. Not used after the call.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_threads is too big or not
+ *       positive, or a CPU is not available to the process.
+ */
+int thread_pool_new_ex(const thread_pool_options *options, thread_pool **pool);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -61,6 +110,71 @@ int thread_pool_new(int thread_count, thread_pool **pool);
  */
 int thread_pool_delete(thread_pool *pool);
 
+/** Times of the tasks in nanoseconds. The percentiles are within 12.5%. */
+struct thread_pool_latency_stat {
+    std::uint64_t count = 0;
+    std::uint64_t mean_ns = 0;
+    std::uint64_t p50_ns = 0;
+    std::uint64_t p90_ns = 0;
+    std::uint64_t p99_ns = 0;
+    std::uint64_t max_ns = 0;
+};
+
+/** Work of one thread of a pool. */
+struct thread_pool_worker_stat {
+    std::uint64_t task_count = 0;
+    /** Tasks taken from the other threads. */
+    std::uint64_t steal_count = 0;
+    /** Time in the tasks and waiting for them. */
+    std::uint64_t busy_ns = 0;
+    std::uint64_t idle_ns = 0;
+};
+
+/** Snapshot of a pool, see thread_pool_stats(). */
+struct thread_pool_stat {
+    /** Threads running now. */
+    int thread_count = 0;
+    /** Pushed and not joined tasks. */
+    std::size_t pending_task_count = 0;
+    /** Tasks waiting for a thread, approximately. */
+    std::size_t queued_task_count = 0;
+    /** From the push to the start of a task. */
+    thread_pool_latency_stat queue_latency;
+    thread_pool_latency_stat run_time;
+    /** Each thread ever started, the exited ones included. */
+    std::vector<thread_pool_worker_stat> workers;
+};
+
+/**
+ * Get the load of @a pool since its creation: the queue latency and
+ * the run time of the tasks, and the work of each thread. The workers
+ * count it themselves at the cost of a clock read per task start and
+ * end, so the numbers are a little behind.
+ * @param pool Pool to look at.
+ * @param[out] stat Snapshot.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NOT_IMPLEMENTED - built without the stats.
+ */
+int thread_pool_stats(thread_pool *pool, thread_pool_stat *stat);
+
+/**
+ * Let the idle threads exit, so the pool shrinks back after a burst
+ * of tasks. A thread is started again when needed. By default the
+ * threads live until the pool is deleted. Before sleeping, an idle
+ * thread spins for a few microseconds if the tasks came that often
+ * lately.
+ * @param pool Pool to configure.
+ * @param timeout Seconds a thread stays idle before it exits. Pass
+ *   infinity to never exit.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the timeout is not positive.
+ */
+int thread_pool_set_idle_timeout(thread_pool *pool, double timeout);
+
 /**
  * Push @a task into thread pool queue. The task must not be
  * already pushed or deleted - otherwise this is undefined
@@ -75,6 +189,199 @@ int thread_pool_delete(thread_pool *pool);
  */
 int thread_pool_push_task(thread_pool *pool, thread_task *task);
 
+/**
+ * Push @a count tasks at once. It is like thread_pool_push_task()
+ * for each of them, but the tasks are published together and the
+ * idle workers are woken up with one call. Either all the tasks
+ * are pushed, or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool can't take that many tasks.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is already in a
+ *       pool.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a task is null or the count is
+ *       negative.
+ */
+int thread_pool_push_tasks(thread_pool *pool, thread_task *const *tasks,
+                           int count);
+
+/**
+ * Run @a function with @a arg in @a pool, fire and forget. There is
+ * no task to join or delete: it is taken from the finished submitted
+ * ones of the pool, so once the pool is warm a submit allocates
+ * nothing. The best for the many tasks like log and metric flushes.
+ * The pool can be deleted when they have run.
+ * @param pool Pool to run in.
+ * @param function Function to call.
+ * @param arg Argument of the function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks already.
+ */
+int thread_pool_submit(thread_pool *pool, thread_task_cb function,
+                       void *arg);
+
+/**
+ * Like thread_pool_submit() with a callback, for any callable. It is
+ * copied into the reused task, which allocates only when it doesn't
+ * fit into the std::function itself.
+ */
+int thread_pool_submit(thread_pool *pool, const thread_task_f &function);
+
+/**
+ * Get the arena of the worker running the current task, for the
+ * memory which the task needs only while it runs. An allocation is a
+ * bump of a pointer in the worker's own chunks, and all of them are
+ * freed at once when the task ends. So the tasks don't contend on
+ * the global heap, and once the worker is warm they don't touch it.
+ * A task which runs the other ones while waiting for them, like in
+ * thread_pool_parallel_for(), keeps its allocations, only theirs are
+ * freed.
+ * @retval nullptr The thread is not a worker of a pool.
+ */
+thread_arena *thread_pool_current_arena();
+
+/**
+ * Allocate @a size bytes from @a arena, aligned for any type. The
+ * memory is valid till the end of the current task, it is not freed
+ * separately. Nothing is constructed or destroyed in it.
+ * @param arena Arena of thread_pool_current_arena().
+ * @param size Bytes to allocate.
+ *
+ * @retval nullptr No arena or no memory.
+ */
+void *thread_arena_alloc(thread_arena *arena, std::size_t size);
+
+/**
+ * Push @a next when @a task has run, into the pool of @a task. No
+ * thread waits for it meanwhile, unlike a join inside a task. It is
+ * thread_task_when_all() with one task.
+ */
+int thread_task_then(thread_task *task, thread_task *next);
+
+/**
+ * Push @a next when all the @a tasks have run, into the pool of the
+ * first of them. A task that has run already does not delay it.
+ * From the call @a next counts as pushed: it can be joined, detached,
+ * and be a predecessor itself, so the tasks can form any DAG.
+ * @param tasks Predecessors. Pushed, not joined and not detached.
+ * @param count Number of the predecessors.
+ * @param next Task to push after them.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - a predecessor is not in a pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is already in a pool.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the pool can't take one more task.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no tasks, a null or detached
+ *       one, or @a next among them.
+ */
+int thread_task_when_all(thread_task *const *tasks, int count,
+                         thread_task *next);
+
+/**
+ * Get the eventfd of @a pool readable when a task with the
+ * notification is finished, see thread_task_set_notify(). It is for
+ * an event loop which can't block in a join: poll the fd, then take
+ * the tasks with thread_pool_pop_finished(). The fd belongs to the
+ * pool and is closed by thread_pool_delete().
+ * @param pool Pool to look at.
+ * @param[out] fd The eventfd. The same for each call.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NOT_IMPLEMENTED - no eventfd on this system.
+ *     - TPOOL_ERR_SYSTEM - the eventfd can't be created.
+ */
+int thread_pool_finished_fd(thread_pool *pool, int *fd);
+
+/**
+ * Take up to @a count finished tasks with the notification, in the
+ * order they finished, and join them. The fd stays readable while
+ * more are left. Called by one thread at a time, it never blocks.
+ * @param pool Pool of the tasks.
+ * @param[out] tasks The joined tasks, free to delete or push again.
+ * @param count Size of @a tasks.
+ * @param[out] popped_count Number of the taken tasks, 0 if none.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the count is negative.
+ */
+int thread_pool_pop_finished(thread_pool *pool, thread_task **tasks,
+                             int count, int *popped_count);
+
+/**
+ * Call @a function on the whole range from @a begin to @a end, in
+ * pieces in parallel, and return when all of them are done. The
+ * pieces are the blocks of @a grain elements, the last one can be
+ * shorter. The range is split in halves on demand between the
+ * workers, so it takes a few tasks per thread, not one per block.
+ * Can be called from a task of the same pool, the worker does the
+ * other tasks meanwhile.
+ * @param pool Pool to run in.
+ * @param begin First element.
+ * @param end Element after the last one.
+ * @param grain Size of a piece.
+ * @param function Function to call on each piece.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function, or the grain is
+ *       not positive.
+ */
+int thread_pool_parallel_for(thread_pool *pool, std::int64_t begin,
+                             std::int64_t end, std::int64_t grain,
+                             const thread_range_f &function);
+
+/**
+ * Map each piece of the range with @a map as in
+ * thread_pool_parallel_for(), and fold the results with @a combine
+ * starting from @a identity. The results are combined in the order
+ * of the pieces, so it is the same for each call even when
+ * @a combine is not associative, like for the floats.
+ * @param map T(std::int64_t begin, std::int64_t end).
+ * @param combine T(const T &, const T &).
+ * @param[out] result The folded results.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code, like thread_pool_parallel_for().
+ */
+template <typename T, typename Map, typename Combine>
+int thread_pool_parallel_reduce(thread_pool *pool, std::int64_t begin,
+                                std::int64_t end, std::int64_t grain,
+                                const T &identity, const Map &map,
+                                const Combine &combine, T *result) {
+    if (grain <= 0 || result == nullptr) {
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    // Not a vector<bool>, the neighbour results are written at once
+    struct slot {
+        T value;
+    };
+    const std::int64_t count = begin < end ? (end - begin - 1) / grain + 1 : 0;
+    std::vector<slot> slots(count, slot {identity});
+    const int result_code = thread_pool_parallel_for(
+        pool, begin, end, grain, [&](std::int64_t piece_begin, std::int64_t piece_end) {
+            slots[(piece_begin - begin) / grain].value = map(piece_begin, piece_end);
+        });
+    if (result_code != 0) {
+        return result_code;
+    }
+    T total = identity;
+    for (const slot &piece : slots) {
+        total = combine(total, piece.value);
+    }
+    *result = total;
+    return 0;
+}
+
 /** Thread pool task API. */
 
 /**
@@ -86,6 +393,69 @@ int thread_pool_push_task(thread_pool *pool, thread_task *task);
  */
 int thread_task_new(thread_task **task, const thread_task_f &function);
 
+/**
+ * Like thread_task_new(), but the task calls @a function with @a arg.
+ * The task is one allocation, without anything to construct for the
+ * callable. The best for the many tiny tasks.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument of the function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function.
+ */
+int thread_task_new_cb(thread_task **task, thread_task_cb function, void *arg);
+
+/**
+ * Set the lane of @a task for the next pushes. The high priority
+ * tasks are taken before all the others, but not more than a few in a
+ * row, so the normal ones still make progress.
+ * @param task Task to change. Not in a pool.
+ * @param priority New priority.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int thread_task_set_priority(thread_task *task, thread_task_priority priority);
+
+/**
+ * Skip @a task if it can't start within @a timeout seconds after each
+ * next push. The skipped task is finished as usual, its dependents
+ * run, and thread_task_is_expired() tells it was skipped.
+ * @param task Task to change. Not in a pool.
+ * @param timeout Seconds since the push. Infinity for no deadline.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the timeout is negative.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int thread_task_set_deadline(thread_task *task, double timeout);
+
+/**
+ * Make @a task go to the finished queue of its pool when it is done
+ * and signal the pool fd, see thread_pool_finished_fd(). Such a task
+ * is joined by thread_pool_pop_finished(), it can't be detached,
+ * deleted or pushed again before that.
+ * @param task Task to change. Not in a pool.
+ * @param notify Whether to notify.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int thread_task_set_notify(thread_task *task, bool notify);
+
+/**
+ * Check if the last run of @a task was skipped because of its
+ * deadline.
+ * @param task Task to check. Finished.
+ */
+bool thread_task_is_expired(const thread_task *task);
+
 /**
  * Check if @a task is finished and joined.
  * @param task Task to check.
@@ -149,6 +519,8 @@ int thread_task_delete(thread_task *task);
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a
  *       pool.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the task notifies, see
+ *       thread_task_set_notify().
  */
 int thread_task_detach(thread_task *task);
 
@@ -0,0 +1,419 @@
+#include "chat.h"
+#include "chat_server.h"
+#include "chat_tls.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * A load generator for the chat server. Many connections are driven by
+ * one epoll, each one speaks the chat protocol with frame_parser and
+ * enqueueFrame(). The messages carry their send time, so each delivery
+ * gives the end-to-end latency. Without an address the server is run
+ * in the same process, in its own thread. Its messages can go through
+ * a handler burning the CPU, in the loop or in a thread pool. With a
+ * certificate the connections are TLS, ended in the kernel on both
+ * sides, to compare with the plain ones.
+ */
+
+enum {
+	BENCH_EVENT_COUNT = 256,
+	/* Pacing period of the senders. */
+	BENCH_TICK_MS = 1,
+};
+
+struct bench_options {
+	const char *address = NULL;
+	int client_count = 100;
+	/* Messages per second of all the clients together. */
+	int rate = 1000;
+	int message_size = 64;
+	int duration_sec = 5;
+	int server_thread_count = 1;
+	/* CPU time of the message handler, none without it. */
+	int handler_us = 0;
+	/* Threads of the handler pool, 0 to handle in the loop. */
+	int handler_thread_count = 0;
+	/* PEM files of the TLS server, the certificate is the clients' CA. */
+	const char *tls_certificate = NULL;
+	const char *tls_key = NULL;
+};
+
+struct bench_conn {
+	int fd = -1;
+	bool is_connected = false;
+	/* The TLS handshake, the connection is plain after it. */
+	struct chat_tls_session *tls = NULL;
+	frame_parser input;
+	std::string out;
+	size_t out_offset = 0;
+};
+
+struct bench_ctx {
+	int epoll_fd = -1;
+	std::vector<bench_conn> conns;
+	int connected_count = 0;
+	struct chat_tls_context *tls = NULL;
+	std::string host;
+	std::string padding;
+	/* Latencies of all the deliveries, in nanoseconds. */
+	std::vector<uint64_t> latencies;
+	uint64_t sent_count = 0;
+	uint64_t delivered_count = 0;
+	uint64_t delivered_bytes = 0;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("%s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+bench_usage(void)
+{
+	printf("Usage: bench_chat [-a host:port] [-c clients] "
+	       "[-r messages/s] [-s message size] [-d seconds] "
+	       "[-t server threads] [-w handler us] "
+	       "[-p handler threads] [-e TLS certificate -k TLS key]\n");
+	exit(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+bench_conn_flush(struct bench_conn *conn)
+{
+	while (conn->out_offset < conn->out.size()) {
+		ssize_t rc = send(conn->fd, conn->out.data() + conn->out_offset,
+				  conn->out.size() - conn->out_offset,
+				  MSG_NOSIGNAL);
+		if (rc > 0) {
+			conn->out_offset += rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+	conn->out.clear();
+	conn->out_offset = 0;
+	return true;
+}
+
+/** The data starts with the send time, the rest is padding. */
+static void
+bench_conn_read(struct bench_ctx *ctx, struct bench_conn *conn)
+{
+	while (true) {
+		size_t space = 0;
+		char *dst = conn->input.reserve(16 * 1024, space);
+		ssize_t rc = recv(conn->fd, dst, space, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		bench_check(rc > 0, "recv");
+		conn->input.commit(rc);
+		uint64_t now = bench_now_ns();
+		std::string_view author;
+		std::string_view data;
+		while (conn->input.try_pop(author, data)) {
+			uint64_t sent_ns = strtoull(std::string(
+				data.substr(0, 20)).c_str(), NULL, 10);
+			ctx->latencies.push_back(now - sent_ns);
+			++ctx->delivered_count;
+			ctx->delivered_bytes += data.size();
+		}
+	}
+}
+
+static void
+bench_connect(struct bench_ctx *ctx, const struct addrinfo *addr)
+{
+	char name[32];
+	for (size_t i = 0; i < ctx->conns.size(); ++i) {
+		struct bench_conn *conn = &ctx->conns[i];
+		conn->fd = socket(addr->ai_family, addr->ai_socktype |
+				  SOCK_NONBLOCK, addr->ai_protocol);
+		bench_check(conn->fd >= 0, "socket");
+		/* Each message goes out at once, not with the next ones. */
+		int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			   sizeof(one));
+		int rc = connect(conn->fd, addr->ai_addr, addr->ai_addrlen);
+		bench_check(rc == 0 || errno == EINPROGRESS, "connect");
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = conn;
+		bench_check(epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, conn->fd,
+				      &ev) == 0, "epoll_ctl");
+		snprintf(name, sizeof(name), "bench_%zu", i);
+		enqueueFrame(conn->out, name, std::string_view());
+		if (ctx->tls != NULL) {
+			conn->tls = chat_tls_session_new(ctx->tls, conn->fd,
+							 ctx->host);
+			bench_check(conn->tls != NULL, "TLS session");
+		}
+	}
+}
+
+static void
+bench_process(struct bench_ctx *ctx, int timeout_ms)
+{
+	struct epoll_event events[BENCH_EVENT_COUNT];
+	int count = epoll_wait(ctx->epoll_fd, events, BENCH_EVENT_COUNT,
+			       timeout_ms);
+	bench_check(count >= 0 || errno == EINTR, "epoll_wait");
+	for (int i = 0; i < count; ++i) {
+		struct bench_conn *conn = (struct bench_conn *)events[i].data.ptr;
+		bench_check((events[i].events & (EPOLLERR | EPOLLHUP)) == 0,
+			    "connection");
+		if (conn->tls != NULL) {
+			int wanted = 0;
+			enum chat_tls_status status =
+				chat_tls_handshake(conn->tls, wanted);
+			bench_check(status != CHAT_TLS_FAILED, "TLS handshake");
+			if (status == CHAT_TLS_AGAIN)
+				continue;
+			chat_tls_session_delete(conn->tls);
+			conn->tls = NULL;
+			conn->is_connected = true;
+			++ctx->connected_count;
+			bench_conn_read(ctx, conn);
+			bench_check(bench_conn_flush(conn), "send");
+			continue;
+		}
+		if (!conn->is_connected && (events[i].events & EPOLLOUT)) {
+			conn->is_connected = true;
+			++ctx->connected_count;
+		}
+		if (events[i].events & EPOLLIN)
+			bench_conn_read(ctx, conn);
+		if (events[i].events & EPOLLOUT)
+			bench_check(bench_conn_flush(conn), "send");
+	}
+}
+
+/** The senders take turns, each message is sent by the next one. */
+static void
+bench_send(struct bench_ctx *ctx, uint64_t count)
+{
+	char stamp[32];
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_conn *conn =
+			&ctx->conns[ctx->sent_count % ctx->conns.size()];
+		int size = snprintf(stamp, sizeof(stamp), "%020llu",
+				    (unsigned long long)bench_now_ns());
+		memcpy(&ctx->padding[0], stamp, size);
+		enqueueFrame(conn->out, std::string_view(), ctx->padding);
+		bench_check(bench_conn_flush(conn), "send");
+		++ctx->sent_count;
+	}
+}
+
+static void
+bench_report(struct bench_ctx *ctx, uint64_t duration_ns)
+{
+	std::vector<uint64_t> &l = ctx->latencies;
+	std::sort(l.begin(), l.end());
+	double sec = duration_ns / 1e9;
+	printf("sent: %llu messages, %.0lf/s\n",
+	       (unsigned long long)ctx->sent_count, ctx->sent_count / sec);
+	printf("delivered: %llu messages, %.0lf/s, %.1lf MB/s\n",
+	       (unsigned long long)ctx->delivered_count,
+	       ctx->delivered_count / sec, ctx->delivered_bytes / sec / 1e6);
+	if (l.empty())
+		return;
+	const double percentiles[] = {50, 90, 99, 99.9};
+	printf("latency:");
+	for (double p : percentiles) {
+		size_t i = std::min(l.size() - 1, (size_t)(l.size() * p / 100));
+		printf(" p%g %.1lf us,", p, l[i] / 1e3);
+	}
+	printf(" max %.1lf us\n", l.back() / 1e3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::atomic<bool> bench_server_stop;
+
+/** Spins for the given microseconds, like a filter or a store would. */
+static bool
+bench_handler_f(void *arg, struct chat_message *message)
+{
+	(void)message;
+	uint64_t end = bench_now_ns() + *(int *)arg * 1000ull;
+	while (bench_now_ns() < end)
+		{};
+	return true;
+}
+
+/** The popped messages are dropped, the server only relays them. */
+static void
+bench_server_f(struct chat_server *server)
+{
+	struct chat_message_view batch[BENCH_EVENT_COUNT];
+	while (!bench_server_stop.load()) {
+		int rc = chat_server_update(server, 0.1);
+		bench_check(rc == 0 || rc == CHAT_ERR_TIMEOUT, "server update");
+		while (chat_server_pop_batch(server, batch,
+					     BENCH_EVENT_COUNT) > 0)
+			{};
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_options opts;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:c:r:s:d:t:w:p:e:k:")) != -1) {
+		switch (opt) {
+		case 'a': opts.address = optarg; break;
+		case 'c': opts.client_count = atoi(optarg); break;
+		case 'r': opts.rate = atoi(optarg); break;
+		case 's': opts.message_size = atoi(optarg); break;
+		case 'd': opts.duration_sec = atoi(optarg); break;
+		case 't': opts.server_thread_count = atoi(optarg); break;
+		case 'w': opts.handler_us = atoi(optarg); break;
+		case 'p': opts.handler_thread_count = atoi(optarg); break;
+		case 'e': opts.tls_certificate = optarg; break;
+		case 'k': opts.tls_key = optarg; break;
+		default: bench_usage();
+		}
+	}
+	if (opts.client_count < 2 || opts.rate < 1 ||
+	    opts.message_size < 20 || opts.duration_sec < 1 ||
+	    opts.handler_us < 0 || opts.handler_thread_count < 0 ||
+	    (opts.tls_key != NULL && opts.tls_certificate == NULL))
+		bench_usage();
+
+	struct chat_server *server = NULL;
+	struct thread_pool *handler_pool = NULL;
+	std::thread server_thread;
+	char address[128];
+	if (opts.address == NULL) {
+		server = chat_server_new();
+		bench_check(chat_server_set_thread_count(server,
+			opts.server_thread_count) == 0, "server threads");
+		if (opts.handler_thread_count > 0) {
+			bench_check(thread_pool_new(opts.handler_thread_count,
+						    &handler_pool) == 0,
+				    "handler pool");
+		}
+		if (opts.handler_us > 0) {
+			bench_check(chat_server_set_message_handler(server,
+				bench_handler_f, &opts.handler_us,
+				handler_pool) == 0, "handler");
+		}
+		if (opts.tls_certificate != NULL) {
+			bench_check(chat_server_set_tls(server,
+				opts.tls_certificate, opts.tls_key) == 0,
+				"server TLS");
+		}
+		bench_check(chat_server_listen(server, 0) == 0, "listen");
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		bench_check(getsockname(chat_server_get_socket(server),
+					(sockaddr *)&addr, &len) == 0,
+			    "getsockname");
+		snprintf(address, sizeof(address), "127.0.0.1:%u",
+			 ntohs(addr.sin_port));
+		opts.address = address;
+		server_thread = std::thread(bench_server_f, server);
+	}
+	std::string host;
+	std::string port;
+	bench_check(parseAddress(opts.address, host, port) == 0, "address");
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addr = NULL;
+	bench_check(getaddrinfo(host.c_str(), port.c_str(), &hints,
+				&addr) == 0, "getaddrinfo");
+
+	struct bench_ctx ctx;
+	ctx.epoll_fd = epoll_create1(0);
+	bench_check(ctx.epoll_fd >= 0, "epoll_create1");
+	ctx.conns.resize(opts.client_count);
+	ctx.padding.assign(opts.message_size, 'x');
+	if (opts.tls_certificate != NULL) {
+		ctx.tls = chat_tls_client_context_new(opts.tls_certificate);
+		bench_check(ctx.tls != NULL, "client TLS");
+		ctx.host = host;
+	}
+	bench_connect(&ctx, addr);
+	freeaddrinfo(addr);
+	while (ctx.connected_count < opts.client_count)
+		bench_process(&ctx, BENCH_TICK_MS);
+	printf("%d clients, %d messages/s of %d bytes, %d s, server %s%s\n",
+	       opts.client_count, opts.rate, opts.message_size,
+	       opts.duration_sec, server != NULL ? "in process" : opts.address,
+	       ctx.tls != NULL ? ", TLS" : "");
+
+	/* Paced by the clock, a slow tick sends more the next time. */
+	uint64_t start = bench_now_ns();
+	uint64_t end = start + (uint64_t)opts.duration_sec * 1000000000;
+	uint64_t second_start = start;
+	uint64_t second_delivered = 0;
+	uint64_t now;
+	while ((now = bench_now_ns()) < end) {
+		uint64_t due = (now - start) * opts.rate / 1000000000;
+		bench_send(&ctx, due - ctx.sent_count);
+		bench_process(&ctx, BENCH_TICK_MS);
+		if (now - second_start >= 1000000000) {
+			printf("    %llu delivered/s\n", (unsigned long long)
+			       (ctx.delivered_count - second_delivered));
+			second_start = now;
+			second_delivered = ctx.delivered_count;
+		}
+	}
+	/* The messages in flight are waited for a bit. */
+	uint64_t expected = ctx.sent_count * (opts.client_count - 1);
+	uint64_t drain_end = bench_now_ns() + 1000000000;
+	while (ctx.delivered_count < expected && bench_now_ns() < drain_end)
+		bench_process(&ctx, BENCH_TICK_MS);
+	bench_report(&ctx, end - start);
+
+	for (struct bench_conn &conn : ctx.conns)
+		close(conn.fd);
+	close(ctx.epoll_fd);
+	chat_tls_context_delete(ctx.tls);
+	if (server != NULL) {
+		bench_server_stop.store(true);
+		server_thread.join();
+		chat_server_delete(server);
+		if (handler_pool != NULL)
+			thread_pool_delete(handler_pool);
+	}
+	return 0;
+}
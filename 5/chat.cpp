@@ -4,6 +4,8 @@
 #include <netinet/in.h>
 #include <poll.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 
 int setNonBlocking(const int file_descriptor) {
@@ -21,7 +23,7 @@ bool isSpace(const char character) {
     return std::isspace(static_cast<unsigned char>(character)) != 0;
 }
 
-std::string trimCopy(const std::string_view string) {
+std::string_view trimView(const std::string_view string) {
     size_t begin = 0;
     while (begin < string.size() && isSpace(string[begin])) {
         ++begin;
@@ -30,7 +32,11 @@ std::string trimCopy(const std::string_view string) {
     while (end > begin && isSpace(string[end - 1])) {
         --end;
     }
-    return std::string(string.substr(begin, end - begin));
+    return string.substr(begin, end - begin);
+}
+
+std::string trimCopy(const std::string_view string) {
+    return std::string(trimView(string));
 }
 
 void appendU32(std::string &buffer, const uint32_t value) {
@@ -53,11 +59,210 @@ void enqueueFrame(std::string &out, const std::string_view author, const std::st
         out.append(data.data(), data.size());
 }
 
-bool frame_parser::try_pop(std::string &author, std::string &data) {
-    author.clear();
-    data.clear();
+void appendMulticastHeader(std::string &buffer, const uint64_t sequence, const uint32_t sender_id) {
+    appendU32(buffer, static_cast<uint32_t>(sequence >> 32));
+    appendU32(buffer, static_cast<uint32_t>(sequence));
+    appendU32(buffer, sender_id);
+}
+
+bool readMulticastHeader(const char *data, const size_t size, uint64_t &sequence, uint32_t &sender_id) {
+    if (size < multicast_header_size) {
+        return false;
+    }
+    uint32_t high = 0;
+    uint32_t low = 0;
+    readU32(data, high);
+    readU32(data + 4, low);
+    readU32(data + 8, sender_id);
+    sequence = static_cast<uint64_t>(high) << 32 | low;
+    return true;
+}
+
+bool hasOption(std::string_view options, const std::string_view option) {
+    while (!options.empty()) {
+        const size_t end = std::min(options.find(' '), options.size());
+        if (options.substr(0, end) == option) {
+            return true;
+        }
+        options.remove_prefix(std::min(end + 1, options.size()));
+    }
+    return false;
+}
+
+bool findOption(std::string_view options, const std::string_view name, std::string_view &value) {
+    while (!options.empty()) {
+        const size_t end = std::min(options.find(' '), options.size());
+        const std::string_view option = options.substr(0, end);
+        if (option.size() > name.size() && option.substr(0, name.size()) == name && option[name.size()] == '=') {
+            value = option.substr(name.size() + 1);
+            return true;
+        }
+        options.remove_prefix(std::min(end + 1, options.size()));
+    }
+    return false;
+}
+
+void appendVarint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
 
-    const size_t available = buffer.size() - offset;
+size_t readVarint(const char *data, const size_t size, uint64_t &out) {
+    out = 0;
+    for (size_t index = 0; index < size && index < 10; ++index) {
+        const auto byte = static_cast<unsigned char>(data[index]);
+        out |= static_cast<uint64_t>(byte & 0x7f) << (7 * index);
+        if ((byte & 0x80) == 0) {
+            return index + 1;
+        }
+    }
+    return 0;
+}
+
+void enqueueCompactAuthor(std::string &out, const uint32_t author_id, const std::string_view author) {
+    appendVarint(out, static_cast<uint64_t>(author_id) << 1 | 1);
+    appendVarint(out, author.size());
+    out.append(author.data(), author.size());
+}
+
+void enqueueCompactFrame(std::string &out, const uint32_t author_id, const std::string_view data) {
+    appendVarint(out, static_cast<uint64_t>(author_id) << 1);
+    appendVarint(out, data.size());
+    out.append(data.data(), data.size());
+}
+
+namespace {
+// An empty buffer bigger than that is freed, so the idle connections don't keep the memory of their big frames
+constexpr size_t max_idle_buffer_size = 64 * 1024;
+
+// The deleted messages kept by a thread for the next ones
+constexpr size_t max_free_message_count = 256;
+
+struct free_message {
+    free_message *next;
+};
+
+struct message_free_list {
+    free_message *head = nullptr;
+    size_t count = 0;
+
+    ~message_free_list() {
+        while (head != nullptr) {
+            free_message *next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+};
+
+thread_local message_free_list free_messages;
+}    // namespace
+
+void *chat_message::operator new(const size_t size) {
+    message_free_list &list = free_messages;
+    if (size != sizeof(chat_message) || list.head == nullptr) {
+        return ::operator new(std::max(size, sizeof(chat_message)));
+    }
+    free_message *message = list.head;
+    list.head = message->next;
+    --list.count;
+    return message;
+}
+
+// Into the list of the deleting thread, whichever has allocated it
+void chat_message::operator delete(void *pointer) noexcept {
+    message_free_list &list = free_messages;
+    if (pointer == nullptr) {
+        return;
+    }
+    if (list.count == max_free_message_count) {
+        ::operator delete(pointer);
+        return;
+    }
+    auto *message = static_cast<free_message *>(pointer);
+    message->next = list.head;
+    list.head = message;
+    ++list.count;
+}
+
+char *frame_parser::reserve(const size_t min_space, size_t &space) {
+    if (offset == size) {
+        offset = 0;
+        size = 0;
+        if (buffer.size() > max_idle_buffer_size) {
+            buffer = std::string();
+        }
+    }
+    if (buffer.size() - size < min_space && offset > 0) {
+        std::memmove(buffer.data(), buffer.data() + offset, size - offset);
+        size -= offset;
+        offset = 0;
+    }
+    if (buffer.size() - size < min_space) {
+        buffer.resize(std::max(size + min_space, buffer.size() * 2));
+    }
+    space = buffer.size() - size;
+    return buffer.data() + size;
+}
+
+void frame_parser::commit(const size_t count) {
+    size += count;
+}
+
+void frame_parser::clear() {
+    buffer.clear();
+    offset = 0;
+    size = 0;
+    is_compact = false;
+    authors.clear();
+}
+
+// Ids are given by the server in order, so a table indexed by them stays small
+constexpr uint64_t max_author_id = 1 << 20;
+
+static bool try_pop_compact(frame_parser &parser, std::string_view &author, std::string_view &data) {
+    while (parser.offset < parser.size) {
+        const char *pointer = parser.buffer.data() + parser.offset;
+        const size_t available = parser.size - parser.offset;
+        uint64_t header = 0;
+        const size_t header_size = readVarint(pointer, available, header);
+        uint64_t length = 0;
+        const size_t length_size =
+            header_size == 0 ? 0 : readVarint(pointer + header_size, available - header_size, length);
+        if (length_size == 0 || available - header_size - length_size < length) {
+            return false;
+        }
+        const std::string_view body(pointer + header_size + length_size, length);
+        parser.offset += header_size + length_size + length;
+        const uint64_t author_id = header >> 1;
+        if ((header & 1) != 0) {
+            if (author_id < max_author_id) {
+                if (parser.authors.size() <= author_id) {
+                    parser.authors.resize(author_id + 1);
+                }
+                parser.authors[author_id].assign(body);
+            }
+            continue;
+        }
+        // An unknown id gives no author rather than a broken stream
+        author = author_id < parser.authors.size() ? std::string_view(parser.authors[author_id]) : std::string_view();
+        data = body;
+        return true;
+    }
+    return false;
+}
+
+bool frame_parser::try_pop(std::string_view &author, std::string_view &data) {
+    author = std::string_view();
+    data = std::string_view();
+    if (is_compact) {
+        return try_pop_compact(*this, author, data);
+    }
+
+    const size_t available = size - offset;
     if (available < 8)
         return false;
 
@@ -73,33 +278,81 @@ bool frame_parser::try_pop(std::string &author, std::string &data) {
     }
 
     const char *pointer = buffer.data() + offset + 8;
-    if (author_length != 0) {
-        author.assign(pointer, author_length);
+    author = std::string_view(pointer, author_length);
+    data = std::string_view(pointer + author_length, data_length);
+    offset += static_cast<size_t>(need);
+    return true;
+}
+
+bool message_queue::empty() const {
+    return head == entries.size();
+}
+
+void message_queue::push(const std::string_view author, const std::string_view data) {
+    entries.push_back(entry {static_cast<uint32_t>(author.size()), static_cast<uint32_t>(data.size())});
+    arena.append(author.data(), author.size());
+    arena.append(data.data(), data.size());
+}
+
+// Drop the popped ones, all at once when the queue is empty, or when they are the most of it
+void message_queue::reclaim() {
+    if (head == entries.size()) {
+        clear();
+        return;
     }
-    pointer += author_length;
-    if (data_length != 0) {
-        data.assign(pointer, data_length);
+    if (head * 2 > entries.size()) {
+        entries.erase(entries.begin(), entries.begin() + static_cast<ptrdiff_t>(head));
+        arena.erase(0, arena_offset);
+        head = 0;
+        arena_offset = 0;
     }
+}
 
-    offset += static_cast<size_t>(need);
+chat_message *message_queue::pop() {
+    chat_message_view view;
+    if (pop_batch(&view, 1) == 0) {
+        return nullptr;
+    }
+    auto *message = new chat_message();
+    message->author.assign(view.author);
+    message->data.assign(view.data);
+    return message;
+}
 
-    if (offset == buffer.size()) {
-        buffer.clear();
-        offset = 0;
-    } else if (offset > 65536) {
-        buffer.erase(0, offset);
-        offset = 0;
+size_t message_queue::pop_batch(chat_message_view *out, const size_t count) {
+    reclaim();
+    size_t popped = 0;
+    for (; popped < count && head < entries.size(); ++popped, ++head) {
+        const entry &item = entries[head];
+        out[popped].author = std::string_view(arena.data() + arena_offset, item.author_size);
+        out[popped].data = std::string_view(arena.data() + arena_offset + item.author_size, item.data_size);
+        arena_offset += item.author_size + item.data_size;
     }
-    return true;
+    return popped;
+}
+
+void message_queue::clear() {
+    if (arena.capacity() > max_idle_buffer_size) {
+        arena = std::string();
+    }
+    arena.clear();
+    arena_offset = 0;
+    entries.clear();
+    head = 0;
 }
 
 int parseAddress(const std::string_view address, std::string &host, std::string &port) {
-    // Expected: host:port. No IPv6 in this task.
+    // Expected: host:port
     const size_t position = address.rfind(':');
     if (position == std::string_view::npos || position == 0 || position + 1 >= address.size()) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    host.assign(address.substr(0, position));
+    std::string_view name = address.substr(0, position);
+    // An IPv6 one is in brackets: [::1]:1234
+    if (name.size() > 2 && name.front() == '[' && name.back() == ']') {
+        name = name.substr(1, name.size() - 2);
+    }
+    host.assign(name);
     port.assign(address.substr(position + 1));
     return 0;
 }
@@ -18,6 +18,8 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 enum chat_errcode {
     CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -35,17 +37,37 @@ enum chat_events {
     CHAT_EVENT_OUTPUT = 2,
 };
 
+/**
+ * Once the connections are established the messages go through the server and the clients without allocations: the
+ * frames are parsed in the buffers of the connections, queued in reused arrays and encoded into pooled frames. A
+ * message popped one by one is taken from a free list of the thread, so it allocates only the data too long to fit
+ * into a string in place.
+ */
 struct chat_message {
     /** Author's name. */
     std::string author;
     /** 0-terminate text. */
     std::string data;
+
+    static void *operator new(size_t size);
+    static void operator delete(void *pointer) noexcept;
+};
+
+/**
+ * A message popped in a batch. Points into the queue of the server or the client, valid till the next call with it.
+ */
+struct chat_message_view {
+    std::string_view author;
+    std::string_view data;
 };
 
 int setNonBlocking(int file_descriptor);
 
 bool isSpace(char character);
 
+// Points into the string, no copy
+std::string_view trimView(std::string_view string);
+
 std::string trimCopy(std::string_view string);
 
 void appendU32(std::string &buffer, uint32_t value);
@@ -54,11 +76,109 @@ void readU32(const char *pointer_to_data, uint32_t &out);
 
 void enqueueFrame(std::string &out, std::string_view author, std::string_view data);
 
+/**
+ * The options of a connection. A client offers them as the data of its handshake, separated by spaces, and the server
+ * answers with a frame of empty data and the ones it accepts as the author. The frames after the answer use them.
+ */
+constexpr std::string_view compact_framing_offer = "v2";
+// Both ways. The client sends an empty frame once it has the answer, and compresses all after it
+constexpr std::string_view compression_offer = "deflate";
+// The recent broadcasts the server keeps, sent right after the answer
+constexpr std::string_view history_offer = "history";
+// "room=<name>": the messages go to the clients of the same room only. Without it a client is in the common one
+constexpr std::string_view room_option = "room";
+
+/**
+ * The multicast of the broadcasts, for the trusted networks. A client offers "multicast", and the server answers with
+ * "multicast=<group address>:<port>,<subscriber id>,<first number>". Then each broadcast to the common room is sent
+ * once, as a datagram to the group: a header of the 64-bit number and the 32-bit id of the sending subscriber, 0 for
+ * none, then the classic frames. The subscribers don't get them over TCP, and skip the ones of their own id.
+ *   - A gap in the numbers is asked for with a control frame of "nack=<first>-<last>" as the author.
+ *   - Each number asked for comes over TCP as a control frame of "repair=<number>,<sender id>,<frame count>", then
+ *     its frames. No frames when it is not kept anymore. So do the broadcasts too big for a datagram.
+ *   - A heartbeat datagram, from the heartbeat sender and without frames, has the last number after a pause, for the
+ *     gaps at the end.
+ */
+constexpr std::string_view multicast_offer = "multicast";
+constexpr std::string_view multicast_nack = "nack";
+constexpr std::string_view multicast_repair = "repair";
+constexpr size_t multicast_header_size = 12;
+constexpr uint32_t multicast_heartbeat_sender = UINT32_MAX;
+
+void appendMulticastHeader(std::string &buffer, uint64_t sequence, uint32_t sender_id);
+
+// False when the datagram is shorter than the header
+bool readMulticastHeader(const char *data, size_t size, uint64_t &sequence, uint32_t &sender_id);
+
+bool hasOption(std::string_view options, std::string_view option);
+
+// The value of a "name=value" option
+bool findOption(std::string_view options, std::string_view name, std::string_view &value);
+
+/**
+ * The compact framing, for the frames from the server only. A frame starts with a varint of
+ * (author id << 1 | is definition):
+ *   - a definition, then a varint length and the name of the author, sent once before the first use of the id;
+ *   - a message, then a varint length and the data. The id 0 is no author.
+ */
+
+void appendVarint(std::string &buffer, uint64_t value);
+
+// The bytes the value takes, 0 when it is not complete yet
+size_t readVarint(const char *data, size_t size, uint64_t &out);
+
+void enqueueCompactAuthor(std::string &out, uint32_t author_id, std::string_view author);
+
+void enqueueCompactFrame(std::string &out, uint32_t author_id, std::string_view data);
+
+/**
+ * Frames read right into the buffer and parsed in place. The received data is from offset to size, the rest of the
+ * buffer is the space for the next read.
+ */
 struct frame_parser {
     std::string buffer;
     size_t offset = 0;
+    size_t size = 0;
+    // The frames are compact, and the authors they have defined, by id
+    bool is_compact = false;
+    std::vector<std::string> authors;
+
+    /**
+     * Get at least min_space bytes for a read right after the data. The parsed frames are dropped and the rest is
+     * moved to the front first, so the buffer grows only for the big frames. The views from try_pop() end here.
+     */
+    char *reserve(size_t min_space, size_t &space);
+    // Account the bytes read into the reserved space
+    void commit(size_t count);
+    void clear();
+
+    // The data points into the buffer, the author into it or into the authors. The definitions are not returned
+    bool try_pop(std::string_view &author, std::string_view &data);
+};
+
+/**
+ * The received messages, all in one buffer and a ring of their sizes, so a message is not an allocation. The space of
+ * the popped ones is reused on the next pop, so their views live till then.
+ */
+struct message_queue {
+    struct entry {
+        uint32_t author_size;
+        uint32_t data_size;
+    };
+    std::string arena;
+    size_t arena_offset = 0;
+    std::vector<entry> entries;
+    size_t head = 0;
+
+    bool empty() const;
+    void push(std::string_view author, std::string_view data);
+    // A copy the caller owns, for chat_*_pop_next()
+    chat_message *pop();
+    size_t pop_batch(chat_message_view *out, size_t count);
+    void clear();
 
-    bool try_pop(std::string &author, std::string &data);
+private:
+    void reclaim();
 };
 
 int parseAddress(std::string_view address, std::string &host, std::string &port);
@@ -4,25 +4,93 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <cctype>
+#include <chrono>
 #include <climits>
+#include <cstdio>
 #include <cstring>
-#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "chat.h"
+#include "chat_deflate.h"
+#include "chat_tls.h"
+
+using steady_clock = std::chrono::steady_clock;
+
+// How long the resolved addresses are reused by all the clients
+constexpr auto resolve_cache_time = std::chrono::seconds(30);
+
+// The next address is tried when the last one doesn't connect for that long, RFC 8305
+constexpr auto attempt_delay = std::chrono::milliseconds(250);
+
+// The biggest datagram of the server, with the header
+constexpr size_t multicast_receive_size = 64 * 1024;
+
+// The frames of a multicast broadcast, received after a gap
+struct multicast_payload {
+    uint32_t sender_id = 0;
+    std::string frames;
+};
+
+struct resolved_address {
+    sockaddr_storage address;
+    socklen_t length;
+    int family;
+};
 
 struct chat_client {
     int socket = -1;
     std::string name;
     bool name_sent = false;
+    // The options offered in the handshake, and whether the answer is still awaited
+    bool wants_compact = false;
+    bool wants_compression = false;
+    bool wants_history = false;
+    std::string room;
+    bool is_offer_pending = false;
+    // Set when the server has accepted the compression
+    chat_deflate *deflate = nullptr;
+    chat_inflate *inflate = nullptr;
+    // The TLS of the next connects, and the handshake in progress with the events it waits for. The host of the
+    // address is checked in the certificate
+    chat_tls_context *tls_context = nullptr;
+    chat_tls_session *tls = nullptr;
+    int tls_events = 0;
+    std::string host;
 
-    std::deque<chat_message *> incoming;
+    // The broadcasts by multicast: the group socket, the own id, the next number to deliver, the last one asked for,
+    // and the ones received after a gap
+    bool wants_multicast = false;
+    in_addr multicast_interface {};
+    int multicast_socket = -1;
+    uint32_t multicast_id = 0;
+    uint64_t next_sequence = 0;
+    uint64_t nack_sequence = 0;
+    std::map<uint64_t, multicast_payload> early_payloads;
+    // The repair being read over TCP, and its frames left
+    multicast_payload repair;
+    uint64_t repair_sequence = 0;
+    size_t repair_left = 0;
+
+    // The async connect: the addresses left to try, and the sockets connecting now, oldest first
+    bool is_connecting = false;
+    std::vector<resolved_address> addresses;
+    size_t next_address = 0;
+    std::vector<int> attempts;
+    steady_clock::time_point next_attempt_time;
+
+    message_queue incoming;
 
     std::string feed_buffer;
 
@@ -30,9 +98,19 @@ struct chat_client {
     size_t out_offset = 0;
 
     frame_parser input;
+
+    // The group it is in, if any
+    chat_client_group *group = nullptr;
+};
+
+struct chat_client_group {
+    int epoll_file_descriptor = -1;
 };
 
 static bool clientFlush(chat_client *client) {
+    // The frames wait for the end of the TLS handshake
+    if (client->tls != nullptr)
+        return true;
     while (client->socket >= 0 && client->out_offset < client->out_buffer.size()) {
         const size_t left = client->out_buffer.size() - client->out_offset;
         const ssize_t value = send(client->socket, client->out_buffer.data() + client->out_offset, left, MSG_NOSIGNAL);
@@ -55,26 +133,147 @@ static bool clientFlush(chat_client *client) {
     return true;
 }
 
+// The frames go out compressed when the server has accepted that
+static bool client_send(chat_client *client, const std::string_view frames) {
+    if (client->deflate == nullptr) {
+        client->out_buffer.append(frames.data(), frames.size());
+        return true;
+    }
+    return chat_deflate_write(client->deflate, frames, true, client->out_buffer);
+}
+
+// The answer to the offer: the options accepted by the server, used from the next frame on
+static bool client_join_multicast(chat_client *client, std::string_view value);
+
+static bool client_accept_options(chat_client *client, const std::string_view options) {
+    client->is_offer_pending = false;
+    client->input.is_compact = hasOption(options, compact_framing_offer);
+    std::string_view multicast;
+    if (findOption(options, multicast_offer, multicast) && !client_join_multicast(client, multicast))
+        return false;
+    if (!hasOption(options, compression_offer))
+        return true;
+    client->deflate = chat_deflate_new();
+    client->inflate = chat_inflate_new();
+    if (client->deflate == nullptr || client->inflate == nullptr)
+        return false;
+    // The output is compressed after an empty frame, the input right after the answer
+    enqueueFrame(client->out_buffer, std::string_view(), std::string_view());
+    return chat_inflate_rest(client->inflate, client->input);
+}
+
+// The messages of the frames, except the own ones
+static void client_deliver(chat_client *client, const uint32_t sender_id, const std::string_view frames) {
+    if (sender_id == client->multicast_id)
+        return;
+    for (size_t offset = 0; offset + 8 <= frames.size();) {
+        uint32_t author_length = 0;
+        uint32_t data_length = 0;
+        readU32(frames.data() + offset, author_length);
+        readU32(frames.data() + offset + 4, data_length);
+        if (frames.size() - offset - 8 < static_cast<uint64_t>(author_length) + data_length)
+            return;
+        client->incoming.push(frames.substr(offset + 8, author_length),
+                              frames.substr(offset + 8 + author_length, data_length));
+        offset += 8 + author_length + data_length;
+    }
+}
+
+// Ask for the broadcasts of the range over TCP
+static bool client_nack(chat_client *client, const uint64_t first, const uint64_t last) {
+    std::string frame;
+    enqueueFrame(frame, std::string(multicast_nack) + "=" + std::to_string(first) + "-" + std::to_string(last),
+                 std::string_view());
+    client->nack_sequence = std::max(client->nack_sequence, last);
+    return client_send(client, frame);
+}
+
+// A numbered broadcast, by a datagram or a repair. Delivered in the order of the numbers, a gap is asked for once
+static bool client_take_multicast(chat_client *client, const uint64_t sequence, const uint32_t sender_id,
+                                  const std::string_view frames) {
+    if (sequence < client->next_sequence)
+        return true;
+    if (sender_id == multicast_heartbeat_sender) {
+        // The last number, asked for again if still missing
+        const uint64_t last =
+            client->early_payloads.empty() ? sequence : client->early_payloads.begin()->first - 1;
+        return last < client->next_sequence || client_nack(client, client->next_sequence, last);
+    }
+    if (sequence > client->next_sequence) {
+        multicast_payload &payload = client->early_payloads[sequence];
+        payload.sender_id = sender_id;
+        payload.frames.assign(frames);
+        const uint64_t first = std::max(client->next_sequence, client->nack_sequence + 1);
+        return first >= sequence || client_nack(client, first, sequence - 1);
+    }
+    client_deliver(client, sender_id, frames);
+    ++client->next_sequence;
+    while (!client->early_payloads.empty() && client->early_payloads.begin()->first == client->next_sequence) {
+        const multicast_payload &payload = client->early_payloads.begin()->second;
+        client_deliver(client, payload.sender_id, payload.frames);
+        client->early_payloads.erase(client->early_payloads.begin());
+        ++client->next_sequence;
+    }
+    return true;
+}
+
+// "<number>,<sender id>,<frame count>", the frames come next
+static bool client_start_repair(chat_client *client, const std::string_view value) {
+    unsigned long long sequence = 0;
+    unsigned sender_id = 0;
+    size_t count = 0;
+    if (std::sscanf(std::string(value).c_str(), "%llu,%u,%zu", &sequence, &sender_id, &count) != 3)
+        return false;
+    if (count == 0)
+        return client_take_multicast(client, sequence, sender_id, std::string_view());
+    client->repair_sequence = sequence;
+    client->repair.sender_id = sender_id;
+    client->repair.frames.clear();
+    client->repair_left = count;
+    return true;
+}
+
 static bool client_read(chat_client *client) {
-    char temporary[64 * 1024];
     while (true) {
-        const ssize_t value = recv(client->socket, temporary, sizeof(temporary), 0);
+        // The compressed bytes go through a buffer of their own, the plain ones right into the input
+        char compressed[4 * 1024];
+        size_t space = sizeof(compressed);
+        char *destination = client->inflate != nullptr ? compressed : client->input.reserve(4 * 1024, space);
+        const ssize_t value = recv(client->socket, destination, space, 0);
         if (value > 0) {
-            client->input.buffer.append(temporary, static_cast<size_t>(value));
+            if (client->inflate == nullptr) {
+                client->input.commit(static_cast<size_t>(value));
+            } else if (!chat_inflate_write(client->inflate, compressed, static_cast<size_t>(value), client->input)) {
+                return false;
+            }
 
-            std::string parsed_author;
-            std::string parsed_data;
+            std::string_view parsed_author;
+            std::string_view parsed_data;
             while (client->input.try_pop(parsed_author, parsed_data)) {
-                if (parsed_data.empty())
+                if (client->repair_left > 0) {
+                    enqueueFrame(client->repair.frames, parsed_author, parsed_data);
+                    if (--client->repair_left == 0 &&
+                        !client_take_multicast(client, client->repair_sequence, client->repair.sender_id,
+                                               client->repair.frames))
+                        return false;
                     continue;
+                }
+                if (parsed_data.empty()) {
+                    std::string_view repair;
+                    if (client->multicast_socket >= 0 && findOption(parsed_author, multicast_repair, repair)) {
+                        if (!client_start_repair(client, repair))
+                            return false;
+                    } else if (client->is_offer_pending) {
+                        if (!client_accept_options(client, parsed_author))
+                            return false;
+                    } else if (!client_send(client, std::string(8, '\0'))) {
+                        // A ping, answered with an empty frame too
+                        return false;
+                    }
+                    continue;
+                }
 
-                auto *message = new chat_message();
-                message->author = std::move(parsed_author);
-                message->data = std::move(parsed_data);
-                client->incoming.push_back(message);
-
-                parsed_author.clear();
-                parsed_data.clear();
+                client->incoming.push(parsed_author, parsed_data);
             }
             continue;
         }
@@ -92,6 +291,362 @@ static bool client_read(chat_client *client) {
     return true;
 }
 
+namespace {
+
+struct resolve_entry {
+    std::vector<resolved_address> addresses;
+    steady_clock::time_point expire_time;
+};
+
+// Shared by the clients of all the threads. Only the successes are kept
+std::mutex resolve_mutex;
+std::unordered_map<std::string, resolve_entry> resolve_cache;
+
+}    // namespace
+
+static int client_resolve(const std::string &host, const std::string &port, const int family,
+                          std::vector<resolved_address> &addresses) {
+    std::string key = std::to_string(family);
+    key.append("/").append(host).append(":").append(port);
+    const steady_clock::time_point now = steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(resolve_mutex);
+        const auto found = resolve_cache.find(key);
+        if (found != resolve_cache.end() && found->second.expire_time > now) {
+            addresses = found->second.addresses;
+            return 0;
+        }
+    }
+
+    addrinfo hints {};
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = family;
+
+    addrinfo *address_result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &address_result) != 0) {
+        return CHAT_ERR_NO_ADDR;
+    }
+    addresses.clear();
+    for (const addrinfo *it = address_result; it != nullptr; it = it->ai_next) {
+        resolved_address item {};
+        std::memcpy(&item.address, it->ai_addr, it->ai_addrlen);
+        item.length = it->ai_addrlen;
+        item.family = it->ai_family;
+        addresses.push_back(item);
+    }
+    freeaddrinfo(address_result);
+    if (addresses.empty()) {
+        return CHAT_ERR_NO_ADDR;
+    }
+
+    std::lock_guard<std::mutex> lock(resolve_mutex);
+    resolve_cache[key] = resolve_entry {addresses, now + resolve_cache_time};
+    return 0;
+}
+
+// The families take turns, so a dead one delays the other by one attempt only
+static void interleave_families(std::vector<resolved_address> &addresses) {
+    if (addresses.empty()) {
+        return;
+    }
+    std::vector<resolved_address> first;
+    std::vector<resolved_address> other;
+    for (const resolved_address &item : addresses) {
+        (item.family == addresses.front().family ? first : other).push_back(item);
+    }
+    addresses.clear();
+    for (size_t index = 0; index < first.size() || index < other.size(); ++index) {
+        if (index < first.size()) {
+            addresses.push_back(first[index]);
+        }
+        if (index < other.size()) {
+            addresses.push_back(other[index]);
+        }
+    }
+}
+
+// The handshake is queued already, it goes out with whatever is fed before the connect is done
+static void client_connected(chat_client *client, const int file_descriptor) {
+    for (const int attempt : client->attempts) {
+        if (attempt != file_descriptor) {
+            close(attempt);
+        }
+    }
+    client->attempts.clear();
+    client->addresses.clear();
+    client->is_connecting = false;
+    client->socket = file_descriptor;
+}
+
+// Start a non-blocking connect to the next address. False when there are no more of them
+static bool client_start_attempt(chat_client *client) {
+    while (client->next_address < client->addresses.size()) {
+        const resolved_address &item = client->addresses[client->next_address++];
+        const int file_descriptor = socket(item.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (file_descriptor < 0) {
+            continue;
+        }
+        if (connect(file_descriptor, reinterpret_cast<const sockaddr *>(&item.address), item.length) == 0) {
+            client->attempts.push_back(file_descriptor);
+            client_connected(client, file_descriptor);
+            return true;
+        }
+        if (errno != EINPROGRESS) {
+            close(file_descriptor);
+            continue;
+        }
+        client->attempts.push_back(file_descriptor);
+        client->next_attempt_time = steady_clock::now() + attempt_delay;
+        return true;
+    }
+    return false;
+}
+
+// Wait for the attempts, start the next one when it is time. Returns like chat_client_update()
+static int client_update_connect(chat_client *client, int timeout_ms) {
+    if (client->next_address < client->addresses.size()) {
+        const auto delay =
+            std::chrono::ceil<std::chrono::milliseconds>(client->next_attempt_time - steady_clock::now()).count();
+        const int delay_ms = delay > 0 ? static_cast<int>(delay) : 0;
+        if (timeout_ms < 0 || delay_ms < timeout_ms) {
+            timeout_ms = delay_ms;
+        }
+    }
+
+    std::vector<pollfd> pfds(client->attempts.size());
+    for (size_t index = 0; index < pfds.size(); ++index) {
+        pfds[index].fd = client->attempts[index];
+        pfds[index].events = POLLOUT;
+        pfds[index].revents = 0;
+    }
+    int result;
+    while (true) {
+        result = poll(pfds.data(), pfds.size(), timeout_ms);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    if (result < 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    int error = 0;
+    int connected = -1;
+    std::vector<int> pending;
+    for (const pollfd &pfd : pfds) {
+        if (pfd.revents == 0) {
+            pending.push_back(pfd.fd);
+            continue;
+        }
+        int socket_error = 0;
+        socklen_t length = sizeof(socket_error);
+        if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &socket_error, &length) != 0) {
+            socket_error = errno;
+        }
+        if (socket_error == 0 && connected < 0) {
+            connected = pfd.fd;
+            continue;
+        }
+        if (socket_error != 0) {
+            error = socket_error;
+        }
+        close(pfd.fd);
+    }
+    client->attempts = std::move(pending);
+    if (connected >= 0) {
+        client_connected(client, connected);
+        return 0;
+    }
+
+    // A failed attempt doesn't wait for the delay of the next one
+    const bool is_due = steady_clock::now() >= client->next_attempt_time;
+    if ((client->attempts.empty() || is_due) && client_start_attempt(client)) {
+        return 0;
+    }
+    if (client->attempts.empty()) {
+        client->is_connecting = false;
+        client->addresses.clear();
+        client->out_buffer.clear();
+        client->out_offset = 0;
+        errno = error != 0 ? error : ECONNREFUSED;
+        return CHAT_ERR_SYS;
+    }
+    return result == 0 ? CHAT_ERR_TIMEOUT : 0;
+}
+
+// The multicast is a part of the connection, it is gone with it
+static void client_leave_multicast(chat_client *client) {
+    if (client->multicast_socket < 0)
+        return;
+    close(client->multicast_socket);
+    client->multicast_socket = -1;
+    client->multicast_id = 0;
+    client->next_sequence = 0;
+    client->nack_sequence = 0;
+    client->early_payloads.clear();
+    client->repair_left = 0;
+}
+
+static void client_close(chat_client *client) {
+    chat_tls_session_delete(client->tls);
+    client->tls = nullptr;
+    client_leave_multicast(client);
+    close(client->socket);
+    client->socket = -1;
+}
+
+// The events of the multicast socket in a group, told apart by the low bit of the client
+static void *multicast_tag(chat_client *client) {
+    return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(client) | 1);
+}
+
+// The value of the answer: "<address>:<port>,<id>,<first number>"
+static bool client_join_multicast(chat_client *client, const std::string_view value) {
+    const size_t first_comma = value.find(',');
+    const size_t second_comma = value.find(',', first_comma + 1);
+    if (first_comma == std::string_view::npos || second_comma == std::string_view::npos)
+        return false;
+    std::string host;
+    std::string port;
+    if (parseAddress(value.substr(0, first_comma), host, port) != 0)
+        return false;
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(std::atoi(port.c_str())));
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+        return false;
+    const std::string numbers(value.substr(first_comma + 1));
+    unsigned id = 0;
+    unsigned long long first = 0;
+    if (std::sscanf(numbers.c_str(), "%u,%llu", &id, &first) != 2 || first == 0)
+        return false;
+    const int file_descriptor = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (file_descriptor < 0)
+        return false;
+    // All the clients of the host share the port, each gets all the datagrams of the group
+    constexpr int one = 1;
+    ip_mreq membership {};
+    membership.imr_multiaddr = address.sin_addr;
+    membership.imr_interface = client->multicast_interface;
+    if (setsockopt(file_descriptor, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        setsockopt(file_descriptor, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+        close(file_descriptor);
+        return false;
+    }
+    if (client->group != nullptr) {
+        epoll_event event {};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = multicast_tag(client);
+        if (epoll_ctl(client->group->epoll_file_descriptor, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
+            close(file_descriptor);
+            return false;
+        }
+    }
+    client->multicast_socket = file_descriptor;
+    client->multicast_id = id;
+    client->next_sequence = first;
+    client->nack_sequence = first - 1;
+    return true;
+}
+
+// All the datagrams till EAGAIN. The gaps are asked for right away
+static bool client_read_multicast(chat_client *client) {
+    char datagram[multicast_receive_size];
+    while (client->multicast_socket >= 0) {
+        const ssize_t value = recv(client->multicast_socket, datagram, sizeof(datagram), 0);
+        if (value < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        uint64_t sequence = 0;
+        uint32_t sender_id = 0;
+        const size_t size = static_cast<size_t>(value);
+        if (!readMulticastHeader(datagram, size, sequence, sender_id))
+            continue;
+        const std::string_view frames(datagram + multicast_header_size, size - multicast_header_size);
+        if (!client_take_multicast(client, sequence, sender_id, frames))
+            return false;
+    }
+    return clientFlush(client);
+}
+
+// The next step of the TLS handshake. Once it is done the socket is read and sent to as without TLS
+static bool client_handshake(chat_client *client) {
+    const chat_tls_status status = chat_tls_handshake(client->tls, client->tls_events);
+    if (status == CHAT_TLS_AGAIN)
+        return true;
+    if (status == CHAT_TLS_FAILED)
+        return false;
+    chat_tls_session_delete(client->tls);
+    client->tls = nullptr;
+    return client_read(client) && clientFlush(client);
+}
+
+// A fresh connection starts with the TLS handshake, if it is asked for
+static bool client_start_tls(chat_client *client) {
+    if (client->tls_context == nullptr)
+        return true;
+    client->tls = chat_tls_session_new(client->tls_context, client->socket, client->host);
+    return client->tls != nullptr && client_handshake(client);
+}
+
+// Handle what the socket is ready for. On a failure the socket is closed
+static bool client_process(chat_client *client, const bool is_error, const bool is_input, const bool is_output) {
+    bool is_ok = !is_error;
+    if (client->tls != nullptr) {
+        is_ok = is_ok && client_handshake(client);
+    } else {
+        if (is_ok && is_input) {
+            is_ok = client_read(client);
+        }
+        if (is_ok && is_output) {
+            is_ok = clientFlush(client);
+        }
+        if (is_ok && client->out_offset < client->out_buffer.size()) {
+            is_ok = clientFlush(client);
+        }
+    }
+
+    if (!is_ok) {
+        client_close(client);
+    }
+    return is_ok;
+}
+
+// A fresh connection starts with the handshake: the author, and the options offered if any
+static void client_start_output(chat_client *client) {
+    client->feed_buffer.clear();
+    client->out_buffer.clear();
+    client->out_offset = 0;
+    client->input.clear();
+    chat_deflate_delete(client->deflate);
+    chat_inflate_delete(client->inflate);
+    client->deflate = nullptr;
+    client->inflate = nullptr;
+    std::string options;
+    if (!client->name.empty()) {
+        if (client->wants_compact)
+            options.append(compact_framing_offer);
+        if (client->wants_compression)
+            options.append(options.empty() ? "" : " ").append(compression_offer);
+        if (client->wants_history)
+            options.append(options.empty() ? "" : " ").append(history_offer);
+        if (client->wants_multicast)
+            options.append(options.empty() ? "" : " ").append(multicast_offer);
+        if (!client->room.empty())
+            options.append(options.empty() ? "" : " ").append(room_option).append("=").append(client->room);
+    }
+    client->is_offer_pending = !options.empty();
+    enqueueFrame(client->out_buffer, client->name, options);
+    client->name_sent = true;
+}
+
 chat_client *chat_client_new(const std::string_view name) {
     auto *client = new chat_client();
     client->name.assign(name.data(), name.size());
@@ -103,14 +658,21 @@ void chat_client_delete(chat_client *client) {
         return;
     }
 
+    if (client->group != nullptr) {
+        chat_client_group_remove(client->group, client);
+    }
     if (client->socket >= 0) {
         close(client->socket);
     }
-
-    while (!client->incoming.empty()) {
-        delete client->incoming.front();
-        client->incoming.pop_front();
+    for (const int attempt : client->attempts) {
+        close(attempt);
     }
+    chat_deflate_delete(client->deflate);
+    chat_inflate_delete(client->inflate);
+    chat_tls_session_delete(client->tls);
+    chat_tls_context_delete(client->tls_context);
+    client_leave_multicast(client);
+
     delete client;
 }
 
@@ -118,7 +680,7 @@ int chat_client_connect(chat_client *client, const std::string_view address) {
     if (client == nullptr) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    if (client->socket >= 0) {
+    if (client->socket >= 0 || client->is_connecting) {
         return CHAT_ERR_ALREADY_STARTED;
     }
 
@@ -129,30 +691,24 @@ int chat_client_connect(chat_client *client, const std::string_view address) {
         return result;
     }
 
-    addrinfo hints {};
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_family = AF_INET;
-
-    addrinfo *address_result = nullptr;
-    result = getaddrinfo(host.c_str(), port.c_str(), &hints, &address_result);
+    std::vector<resolved_address> addresses;
+    result = client_resolve(host, port, AF_INET, addresses);
     if (result != 0) {
-        return CHAT_ERR_NO_ADDR;
+        return result;
     }
 
     int file_descriptor = -1;
-    for (const addrinfo *it = address_result; it != nullptr; it = it->ai_next) {
-        file_descriptor = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+    for (const resolved_address &item : addresses) {
+        file_descriptor = socket(item.family, SOCK_STREAM, 0);
         if (file_descriptor < 0) {
             continue;
         }
-        if (connect(file_descriptor, it->ai_addr, it->ai_addrlen) == 0) {
+        if (connect(file_descriptor, reinterpret_cast<const sockaddr *>(&item.address), item.length) == 0) {
             break;
         }
         close(file_descriptor);
         file_descriptor = -1;
     }
-    freeaddrinfo(address_result);
 
     if (file_descriptor < 0) {
         return CHAT_ERR_SYS;
@@ -165,51 +721,157 @@ int chat_client_connect(chat_client *client, const std::string_view address) {
     }
 
     client->socket = file_descriptor;
-    client->feed_buffer.clear();
-    client->out_buffer.clear();
-    client->out_offset = 0;
-    client->input.buffer.clear();
-    client->input.offset = 0;
-    client->name_sent = false;
+    client->host = host;
+    client_start_output(client);
+    if (!client_start_tls(client) || !clientFlush(client)) {
+        client_close(client);
+        return CHAT_ERR_SYS;
+    }
+    return 0;
+}
 
-    // Handshake: send author only once (author_len>0, data_len==0)
-    enqueueFrame(client->out_buffer, client->name, std::string_view());
-    client->name_sent = true;
-    if (!clientFlush(client)) {
-        close(client->socket);
-        client->socket = -1;
+int chat_client_connect_async(chat_client *client, const std::string_view address) {
+    if (client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+
+    std::string host;
+    std::string port;
+    int result = parseAddress(address, host, port);
+    if (result != 0) {
+        return result;
+    }
+    result = client_resolve(host, port, AF_UNSPEC, client->addresses);
+    if (result != 0) {
+        return result;
+    }
+    interleave_families(client->addresses);
+    client->next_address = 0;
+    client->host = host;
+
+    client_start_output(client);
+
+    client->is_connecting = true;
+    if (!client_start_attempt(client)) {
+        client->is_connecting = false;
+        client->addresses.clear();
+        client->out_buffer.clear();
         return CHAT_ERR_SYS;
     }
     return 0;
 }
 
-chat_message *chat_client_pop_next(chat_client *client) {
+int chat_client_set_compact_framing(chat_client *client, const bool is_enabled) {
     if (client == nullptr) {
-        return nullptr;
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
     }
-    if (client->incoming.empty()) {
+    client->wants_compact = is_enabled;
+    return 0;
+}
+
+int chat_client_set_compression(chat_client *client, const bool is_enabled) {
+    if (client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    if (is_enabled && !chat_compression_is_available()) {
+        return CHAT_ERR_NOT_IMPLEMENTED;
+    }
+    client->wants_compression = is_enabled;
+    return 0;
+}
+
+int chat_client_set_tls(chat_client *client, const bool is_enabled, const char *ca_file) {
+    if (client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    if (is_enabled && !chat_tls_is_available()) {
+        return CHAT_ERR_NOT_IMPLEMENTED;
+    }
+    chat_tls_context *context = nullptr;
+    if (is_enabled) {
+        context = chat_tls_client_context_new(ca_file);
+        if (context == nullptr) {
+            return CHAT_ERR_INVALID_ARGUMENT;
+        }
+    }
+    chat_tls_context_delete(client->tls_context);
+    client->tls_context = context;
+    return 0;
+}
+
+int chat_client_set_multicast(chat_client *client, const bool is_enabled, const char *interface_address) {
+    if (client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    in_addr interface {};
+    interface.s_addr = htonl(INADDR_ANY);
+    if (interface_address != nullptr && inet_pton(AF_INET, interface_address, &interface) != 1) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    client->wants_multicast = is_enabled;
+    client->multicast_interface = interface;
+    return 0;
+}
+
+int chat_client_set_history(chat_client *client, const bool is_enabled) {
+    if (client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    client->wants_history = is_enabled;
+    return 0;
+}
+
+int chat_client_set_room(chat_client *client, const std::string_view room) {
+    if (client == nullptr || room.find(' ') != std::string_view::npos) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->socket >= 0 || client->is_connecting) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    client->room.assign(room);
+    return 0;
+}
+
+chat_message *chat_client_pop_next(chat_client *client) {
+    if (client == nullptr) {
         return nullptr;
     }
+    return client->incoming.pop();
+}
 
-    chat_message *message = client->incoming.front();
-    client->incoming.pop_front();
-    return message;
+int chat_client_pop_batch(chat_client *client, chat_message_view *out, const int count) {
+    if (client == nullptr || out == nullptr || count <= 0) {
+        return 0;
+    }
+    return static_cast<int>(client->incoming.pop_batch(out, static_cast<size_t>(count)));
 }
 
 int chat_client_update(chat_client *client, const double timeout) {
     if (client == nullptr) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    if (client->socket < 0) {
+    if (client->socket < 0 && !client->is_connecting) {
         return CHAT_ERR_NOT_STARTED;
     }
 
-    const int events = chat_events_to_poll_events(chat_client_get_events(client));
-    pollfd pfd {};
-    std::memset(&pfd, 0, sizeof(pfd));
-    pfd.fd = client->socket;
-    pfd.events = static_cast<short>(events);
-
     int timeout_ms = -1;
     if (timeout >= 0) {
         double current_ms = timeout * 1000.0;
@@ -222,9 +884,36 @@ int chat_client_update(chat_client *client, const double timeout) {
         timeout_ms = static_cast<int>(current_ms + 0.5);
     }
 
+    if (client->is_connecting) {
+        const int result = client_update_connect(client, timeout_ms);
+        if (result != 0 || client->socket < 0) {
+            return result;
+        }
+        // Connected, the handshake and whatever is fed go now, after the TLS handshake if any
+        if (!client_start_tls(client) || !clientFlush(client)) {
+            client_close(client);
+            return CHAT_ERR_SYS;
+        }
+        return 0;
+    }
+
+    const int events = chat_events_to_poll_events(chat_client_get_events(client));
+    // The connection, and the multicast group if any
+    pollfd pfds[2];
+    std::memset(pfds, 0, sizeof(pfds));
+    pollfd &pfd = pfds[0];
+    pfd.fd = client->socket;
+    pfd.events = static_cast<short>(events);
+    nfds_t count = 1;
+    if (client->multicast_socket >= 0) {
+        pfds[1].fd = client->multicast_socket;
+        pfds[1].events = POLLIN;
+        count = 2;
+    }
+
     int result;
     while (true) {
-        result = poll(&pfd, 1, timeout_ms);
+        result = poll(pfds, count, timeout_ms);
         if (result < 0 && errno == EINTR) {
             continue;
         }
@@ -237,23 +926,15 @@ int chat_client_update(chat_client *client, const double timeout) {
         return CHAT_ERR_TIMEOUT;
     }
 
-    bool is_ok = true;
-    if ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
-        is_ok = false;
-    }
-    if (is_ok && (pfd.revents & POLLIN) != 0) {
-        is_ok = client_read(client);
-    }
-    if (is_ok && (pfd.revents & POLLOUT) != 0) {
-        is_ok = clientFlush(client);
+    if (count == 2 && pfds[1].revents != 0 && !client_read_multicast(client)) {
+        client_close(client);
+        return CHAT_ERR_SYS;
     }
-    if (is_ok && client->out_offset < client->out_buffer.size()) {
-        is_ok = clientFlush(client);
+    if (pfd.revents == 0) {
+        return 0;
     }
-
-    if (!is_ok) {
-        close(client->socket);
-        client->socket = -1;
+    const bool is_error = (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+    if (!client_process(client, is_error, (pfd.revents & POLLIN) != 0, (pfd.revents & POLLOUT) != 0)) {
         return CHAT_ERR_SYS;
     }
     return 0;
@@ -263,12 +944,26 @@ int chat_client_get_descriptor(const chat_client *client) {
     if (client == nullptr) {
         return -1;
     }
+    // The oldest attempt is the likeliest to connect
+    if (client->is_connecting && !client->attempts.empty()) {
+        return client->attempts.front();
+    }
     return client->socket;
 }
 
+int chat_client_get_multicast_descriptor(const chat_client *client) {
+    return client != nullptr ? client->multicast_socket : -1;
+}
+
 int chat_client_get_events(const chat_client *client) {
-    if (client == nullptr || client->socket < 0)
+    if (client == nullptr)
+        return 0;
+    if (client->is_connecting)
+        return CHAT_EVENT_OUTPUT;
+    if (client->socket < 0)
         return 0;
+    if (client->tls != nullptr)
+        return client->tls_events;
 
     int mask = CHAT_EVENT_INPUT;
     if (client->out_offset < client->out_buffer.size()) {
@@ -281,30 +976,159 @@ int chat_client_feed(chat_client *client, const char *message, const uint32_t ms
     if (client == nullptr || message == nullptr) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    if (client->socket < 0) {
+    // While connecting the messages are queued after the handshake
+    if (client->socket < 0 && !client->is_connecting) {
         return CHAT_ERR_NOT_STARTED;
     }
 
+    // Scanned once, the lines are trimmed in place and encoded right into the output. The buffer is cut once per
+    // call, so only an unfinished line is kept. The compressed ones are encoded aside and compressed together
+    std::string plain;
+    std::string &frames = client->deflate != nullptr ? plain : client->out_buffer;
     client->feed_buffer.append(message, message + msg_size);
+    const std::string &buffer = client->feed_buffer;
+    size_t begin = 0;
     while (true) {
-        const size_t position = client->feed_buffer.find('\n');
+        const size_t position = buffer.find('\n', begin);
         if (position == std::string::npos) {
             break;
         }
 
-        const std::string_view line(client->feed_buffer.data(), position);
-        std::string trimmed = trimCopy(line);
-        client->feed_buffer.erase(0, position + 1);
-
-        if (trimmed.empty()) {
+        const std::string_view line = trimView(std::string_view(buffer.data() + begin, position - begin));
+        begin = position + 1;
+        if (line.empty()) {
             continue;
         }
 
         // Regular messages: empty author (author already sent once)
-        enqueueFrame(client->out_buffer, std::string_view(), trimmed);
-        if (!clientFlush(client)) {
+        enqueueFrame(frames, std::string_view(), line);
+    }
+    client->feed_buffer.erase(0, begin);
+    if (!plain.empty() && !client_send(client, plain)) {
+        return CHAT_ERR_SYS;
+    }
+
+    if (!clientFlush(client)) {
+        return CHAT_ERR_SYS;
+    }
+    return 0;
+}
+
+chat_client_group *chat_client_group_new() {
+    const int file_descriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (file_descriptor < 0) {
+        return nullptr;
+    }
+    auto *group = new chat_client_group();
+    group->epoll_file_descriptor = file_descriptor;
+    return group;
+}
+
+void chat_client_group_delete(chat_client_group *group) {
+    if (group == nullptr) {
+        return;
+    }
+    // The clients stay, only the epoll is gone
+    close(group->epoll_file_descriptor);
+    delete group;
+}
+
+int chat_client_group_add(chat_client_group *group, chat_client *client) {
+    if (group == nullptr || client == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (client->group != nullptr) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    if (client->socket < 0) {
+        return CHAT_ERR_NOT_STARTED;
+    }
+
+    // Edge-triggered: the reads and the flushes go till EAGAIN anyway
+    epoll_event event {};
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    event.data.ptr = client;
+    if (epoll_ctl(group->epoll_file_descriptor, EPOLL_CTL_ADD, client->socket, &event) != 0) {
+        return CHAT_ERR_SYS;
+    }
+    if (client->multicast_socket >= 0) {
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = multicast_tag(client);
+        if (epoll_ctl(group->epoll_file_descriptor, EPOLL_CTL_ADD, client->multicast_socket, &event) != 0) {
+            epoll_ctl(group->epoll_file_descriptor, EPOLL_CTL_DEL, client->socket, nullptr);
             return CHAT_ERR_SYS;
         }
     }
+    client->group = group;
+    return 0;
+}
+
+int chat_client_group_remove(chat_client_group *group, chat_client *client) {
+    if (group == nullptr || client == nullptr || client->group != group) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    // A closed socket has left the epoll by itself
+    if (client->socket >= 0) {
+        epoll_ctl(group->epoll_file_descriptor, EPOLL_CTL_DEL, client->socket, nullptr);
+    }
+    if (client->multicast_socket >= 0) {
+        epoll_ctl(group->epoll_file_descriptor, EPOLL_CTL_DEL, client->multicast_socket, nullptr);
+    }
+    client->group = nullptr;
+    return 0;
+}
+
+int chat_client_group_update(chat_client_group *group, const double timeout) {
+    if (group == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+
+    int timeout_ms = -1;
+    if (timeout >= 0) {
+        double current_ms = timeout * 1000.0;
+        if (current_ms > static_cast<double>(INT_MAX)) {
+            current_ms = static_cast<double>(INT_MAX);
+        }
+        timeout_ms = static_cast<int>(current_ms + 0.5);
+    }
+
+    epoll_event events[64];
+    int count;
+    while (true) {
+        count = epoll_wait(group->epoll_file_descriptor, events, 64, timeout_ms);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    if (count < 0) {
+        return CHAT_ERR_SYS;
+    }
+    if (count == 0) {
+        return CHAT_ERR_TIMEOUT;
+    }
+
+    for (int index = 0; index < count; ++index) {
+        const auto tag = reinterpret_cast<uintptr_t>(events[index].data.ptr);
+        auto *client = reinterpret_cast<chat_client *>(tag & ~static_cast<uintptr_t>(1));
+        const uint32_t event = events[index].events;
+        if ((tag & 1) != 0) {
+            if (!client_read_multicast(client)) {
+                client_close(client);
+            }
+            continue;
+        }
+        // The data before a hangup is still read, the read sees the end then
+        const bool is_input = (event & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) != 0;
+        (void)client_process(client, (event & EPOLLERR) != 0, is_input, (event & EPOLLOUT) != 0);
+    }
     return 0;
 }
+
+int chat_client_group_get_descriptor(const chat_client_group *group) {
+    if (group == nullptr) {
+        return -1;
+    }
+    return group->epoll_file_descriptor;
+}
@@ -5,6 +5,8 @@
 #include <string_view>
 
 struct chat_client;
+struct chat_client_group;
+struct chat_message_view;
 
 /**
  * Create a new chat client. No bind, no listen, just allocate and
@@ -30,6 +32,116 @@ void chat_client_delete(struct chat_client *client);
  */
 int chat_client_connect(struct chat_client *client, std::string_view address);
 
+/**
+ * Start connecting to the given address without waiting. All the
+ * addresses of the name are tried, IPv6 and IPv4 in turns, the next
+ * one is started when the previous one doesn't connect for 250ms. The
+ * first to connect is used, chat_client_update() drives them and
+ * fails with CHAT_ERR_SYS when none has connected. The messages fed
+ * meanwhile are sent after the connect. The resolved addresses are
+ * shared by all the clients for a while.
+ *
+ * @param client Chat client.
+ * @param address Address to connect to, like in chat_client_connect().
+ *
+ * @retval 0 Success, connecting or connected.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_NO_ADDR - the addr couldn't be resolved to any IP.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_client_connect_async(struct chat_client *client, std::string_view address);
+
+/**
+ * Ask the server for the compact framing on the next connect: varint
+ * lengths, and each author name is sent once, then only its id. Needs
+ * a name, the offer is a part of the handshake.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ */
+int chat_client_set_compact_framing(struct chat_client *client, bool is_enabled);
+
+/**
+ * Ask the server to compress the connection both ways on the next
+ * connect, with one deflate stream per direction for all its life.
+ * Needs a name, like the compact framing.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without the compression.
+ */
+int chat_client_set_compression(struct chat_client *client, bool is_enabled);
+
+/**
+ * Encrypt the next connects with TLS, ended in the kernel like on the
+ * server, see chat_server_set_tls(). The certificate of the server is
+ * checked, with the host of the address. The messages fed before the
+ * handshake is done wait for it.
+ *
+ * @param client Chat client.
+ * @param is_enabled Use TLS.
+ * @param ca_file PEM file of the CA certificates, NULL for the ones
+ *     of the system.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the CA file can't be loaded.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without OpenSSL, or the
+ *       kernel has no TLS.
+ */
+int chat_client_set_tls(struct chat_client *client, bool is_enabled, const char *ca_file);
+
+/**
+ * Ask the server for the broadcasts by multicast on the next connect,
+ * see chat_server_set_multicast(). The client joins the group the
+ * server answers with, and asks for the datagrams it has missed over
+ * the connection. The messages are popped in the order the server has
+ * sent them either way. Not with the compact framing or a room, then
+ * the server sends all over TCP.
+ *
+ * @param client Chat client.
+ * @param is_enabled Ask for the multicast.
+ * @param interface_address IPv4 address of the interface to join the
+ *     group on, NULL for the one of the routing table.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not an address.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ */
+int chat_client_set_multicast(struct chat_client *client, bool is_enabled, const char *interface_address);
+
+/**
+ * Ask the server for the recent messages it keeps on the next
+ * connect, to catch up after a reconnect. They come first, as the
+ * usual messages. Needs a name, like the compact framing.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ */
+int chat_client_set_history(struct chat_client *client, bool is_enabled);
+
+/**
+ * Join the room on the next connect. The messages of the client go to
+ * the clients of the same room only, and it gets theirs and the ones
+ * of the server feed. Without a room a client is in the common one.
+ * Needs a name, like the compact framing.
+ *
+ * @param client Chat client.
+ * @param room Room name without spaces, empty for the common room.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a space in the name.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is connected or connecting.
+ */
+int chat_client_set_room(struct chat_client *client, std::string_view room);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -41,6 +153,19 @@ int chat_client_connect(struct chat_client *client, std::string_view address);
  */
 struct chat_message *chat_client_pop_next(struct chat_client *client);
 
+/**
+ * Pop up to count pending messages at once, without an allocation per
+ * message. The views point into the client and are valid till the next
+ * call with it.
+ *
+ * @param client Chat client.
+ * @param out Array of at least count views.
+ * @param count Most messages to pop.
+ *
+ * @retval >=0 Number of the popped messages.
+ */
+int chat_client_pop_batch(struct chat_client *client, struct chat_message_view *out, int count);
+
 /**
  * Wait for any update for the given timeout and do this update.
  *
@@ -65,6 +190,15 @@ int chat_client_update(struct chat_client *client, double timeout);
  */
 int chat_client_get_descriptor(const struct chat_client *client);
 
+/**
+ * Get the descriptor of the multicast group, wanted for the input when the
+ * client is waited for without chat_client_update() or a group.
+ *
+ * @retval >=0 A valid descriptor.
+ * @retval -1 Not in a group.
+ */
+int chat_client_get_multicast_descriptor(const struct chat_client *client);
+
 /**
  * Get a mask of chat_event values wanted by the client. Needed together with
  * client's descriptor for any waiting in poll/epoll/queue.
@@ -86,3 +220,61 @@ int chat_client_get_events(const struct chat_client *client);
  *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
  */
 int chat_client_feed(struct chat_client *client, const char *message, uint32_t msg_size);
+
+/**
+ * Create a group of clients updated together, with one epoll for all
+ * of them instead of a poll() per client.
+ *
+ * @retval not-NULL A group.
+ * @retval NULL A system error, check errno.
+ */
+struct chat_client_group *chat_client_group_new(void);
+
+/** Free the group. The clients are not deleted. */
+void chat_client_group_delete(struct chat_client_group *group);
+
+/**
+ * Add a connected client to the group. A deleted client leaves its
+ * group by itself.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is in a group already.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_client_group_add(struct chat_client_group *group, struct chat_client *client);
+
+/**
+ * Remove the client from the group.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the client is not in the group.
+ */
+int chat_client_group_remove(struct chat_client_group *group, struct chat_client *client);
+
+/**
+ * Wait for any update on any client of the group for the given timeout,
+ * and do the updates of all the clients which are ready. A client
+ * which fails is disconnected, its chat_client_get_descriptor() is -1
+ * after that.
+ *
+ * @param group Client group.
+ * @param timeout Timeout in seconds to wait for.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_TIMEOUT - no updates, timed out.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_client_group_update(struct chat_client_group *group, double timeout);
+
+/**
+ * Get the group's descriptor, to embed it into another event loop. It
+ * is readable when some client is ready.
+ *
+ * @retval >=0 A valid descriptor.
+ * @retval -1 No descriptor.
+ */
+int chat_client_group_get_descriptor(const struct chat_client_group *group);
@@ -0,0 +1,149 @@
+#include "chat_deflate.h"
+
+#ifndef CHAT_COMPRESSION
+#define CHAT_COMPRESSION 0
+#endif
+
+#if CHAT_COMPRESSION
+
+#include <zlib.h>
+
+// Raw deflate, without the zlib header and checksum: TCP checks the data already
+constexpr int window_bits = -15;
+constexpr int memory_level = 8;
+// Output space taken from the parser per inflate() call
+constexpr size_t inflate_chunk_size = 16 * 1024;
+
+struct chat_deflate {
+    z_stream stream {};
+};
+
+struct chat_inflate {
+    z_stream stream {};
+};
+
+bool chat_compression_is_available() {
+    return true;
+}
+
+chat_deflate *chat_deflate_new() {
+    auto *deflate = new chat_deflate();
+    if (deflateInit2(&deflate->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, memory_level,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete deflate;
+        return nullptr;
+    }
+    return deflate;
+}
+
+void chat_deflate_delete(chat_deflate *deflate) {
+    if (deflate == nullptr) {
+        return;
+    }
+    deflateEnd(&deflate->stream);
+    delete deflate;
+}
+
+bool chat_deflate_write(chat_deflate *deflate, const std::string_view input, const bool is_flush,
+                        std::string &output) {
+    z_stream &stream = deflate->stream;
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    const int flush = is_flush ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    while (true) {
+        const size_t size = output.size();
+        const size_t space = deflateBound(&stream, stream.avail_in) + 16;
+        output.resize(size + space);
+        stream.next_out = reinterpret_cast<Bytef *>(output.data() + size);
+        stream.avail_out = static_cast<uInt>(space);
+        const int result = ::deflate(&stream, flush);
+        output.resize(size + space - stream.avail_out);
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        }
+        // A flush is complete when the output has space left
+        if (stream.avail_in == 0 && stream.avail_out > 0) {
+            return true;
+        }
+    }
+}
+
+chat_inflate *chat_inflate_new() {
+    auto *inflate = new chat_inflate();
+    if (inflateInit2(&inflate->stream, window_bits) != Z_OK) {
+        delete inflate;
+        return nullptr;
+    }
+    return inflate;
+}
+
+void chat_inflate_delete(chat_inflate *inflate) {
+    if (inflate == nullptr) {
+        return;
+    }
+    inflateEnd(&inflate->stream);
+    delete inflate;
+}
+
+bool chat_inflate_write(chat_inflate *inflate, const char *data, const size_t size, frame_parser &output) {
+    z_stream &stream = inflate->stream;
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = static_cast<uInt>(size);
+    while (true) {
+        size_t space = 0;
+        char *destination = output.reserve(inflate_chunk_size, space);
+        stream.next_out = reinterpret_cast<Bytef *>(destination);
+        stream.avail_out = static_cast<uInt>(space);
+        const int result = ::inflate(&stream, Z_SYNC_FLUSH);
+        output.commit(space - stream.avail_out);
+        // The stream never ends, the connection does
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        }
+        if (stream.avail_in == 0 && stream.avail_out > 0) {
+            return true;
+        }
+    }
+}
+
+#else
+
+struct chat_deflate {};
+struct chat_inflate {};
+
+bool chat_compression_is_available() {
+    return false;
+}
+
+chat_deflate *chat_deflate_new() {
+    return nullptr;
+}
+
+void chat_deflate_delete(chat_deflate *deflate) {
+    delete deflate;
+}
+
+bool chat_deflate_write(chat_deflate *, std::string_view, bool, std::string &) {
+    return false;
+}
+
+chat_inflate *chat_inflate_new() {
+    return nullptr;
+}
+
+void chat_inflate_delete(chat_inflate *inflate) {
+    delete inflate;
+}
+
+bool chat_inflate_write(chat_inflate *, const char *, size_t, frame_parser &) {
+    return false;
+}
+
+#endif
+
+bool chat_inflate_rest(chat_inflate *inflate, frame_parser &parser) {
+    const std::string rest(parser.buffer.data() + parser.offset, parser.size - parser.offset);
+    parser.offset = 0;
+    parser.size = 0;
+    return rest.empty() || chat_inflate_write(inflate, rest.data(), rest.size(), parser);
+}
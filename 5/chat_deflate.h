@@ -0,0 +1,37 @@
+#pragma once
+
+/**
+ * Streaming compression of a connection, negotiated in the handshake. One deflate context lives as long as the
+ * connection, so the window of the data sent before serves as the dictionary for the next frames. Each write can end
+ * with a sync flush, after which the other side can decode all of it. Built with zlib when CHAT_COMPRESSION is set,
+ * otherwise the contexts can't be created.
+ */
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "chat.h"
+
+struct chat_deflate;
+struct chat_inflate;
+
+bool chat_compression_is_available();
+
+// Null when the compression is not built in or there is no memory
+chat_deflate *chat_deflate_new();
+
+void chat_deflate_delete(chat_deflate *deflate);
+
+// Append the compressed input to the output
+bool chat_deflate_write(chat_deflate *deflate, std::string_view input, bool is_flush, std::string &output);
+
+chat_inflate *chat_inflate_new();
+
+void chat_inflate_delete(chat_inflate *inflate);
+
+// Decompress right into the space of the parser. False when the stream is broken
+bool chat_inflate_write(chat_inflate *inflate, const char *data, size_t size, frame_parser &output);
+
+// The data of the parser not parsed yet is compressed: take it out and put it back decompressed
+bool chat_inflate_rest(chat_inflate *inflate, frame_parser &parser);
@@ -3,312 +3,3296 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <climits>
+#include <cstdio>
 #include <cstring>
 #include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "chat.h"
+#include "chat_deflate.h"
+#include "chat_tls.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#ifndef CHAT_SERVER_IO_URING
+#define CHAT_SERVER_IO_URING 1
+#endif
+
+#if CHAT_SERVER_IO_URING
+#include "chat_uring.h"
+#endif
+
+// Least space for a recv() into the input buffer of a peer
+constexpr size_t recv_min_size = 4 * 1024;
+
+// Most frames sent with one sendmsg(), as many as the system takes
+#ifdef IOV_MAX
+constexpr size_t send_batch_size = IOV_MAX;
+#else
+constexpr size_t send_batch_size = 1024;
+#endif
+
+// Most event loops of one server
+constexpr int max_thread_count = 256;
+
+// Peers allocated at once by a shard
+constexpr size_t peer_chunk_size = 64;
+
+// The state of a handoff goes in packets of that much, with that many descriptors each. Each side waits for the
+// other that long at most
+constexpr uint32_t handoff_version = 1;
+constexpr size_t handoff_packet_size = 64 * 1024;
+constexpr size_t handoff_descriptor_count = 250;
+constexpr int handoff_timeout_s = 5;
+
+// The sent frames at the front of a queue moved out at once, and the most kept by an empty one
+constexpr size_t out_queue_compact_size = 64;
+constexpr size_t out_queue_idle_size = 4096;
+
+// The frames and the events kept free by a shard. A frame bigger than that is freed, not to keep the big broadcasts
+constexpr size_t pooled_frame_count = 1024;
+constexpr size_t pooled_frame_capacity = 64 * 1024;
+constexpr size_t pooled_event_count = 1024;
+
+// The timer wheel of the idle peers: the resolution, and the slots of one turn. A later deadline waits for its turn
+constexpr uint64_t timer_tick_ms = 100;
+constexpr size_t timer_slot_count = 512;
+
+// Most authors interned for the compact framing. The later ones are sent without a name
+constexpr uint32_t max_author_count = 1 << 20;
+
+// The room of the clients which haven't chosen one, and the most rooms. The later ones share the common room
+constexpr uint32_t common_room = 0;
+constexpr uint32_t max_room_count = 1 << 20;
+// The room of a broadcast to all the clients
+constexpr uint32_t all_rooms = UINT32_MAX;
+
+// The most bytes of the frames in a multicast datagram, the bigger broadcasts go to the subscribers over TCP. The
+// datagrams kept for the repairs, and the pause after the last one before the heartbeat
+constexpr size_t multicast_datagram_size = 8 * 1024;
+constexpr size_t multicast_kept_count = 4096;
+constexpr uint64_t multicast_heartbeat_ms = 20;
+
+// Most messages of a shard in the handler pool. Its peers are not read while it has that many
+constexpr size_t max_handled_count = 1024;
+
+#if CHAT_SERVER_IO_URING
+// The ring of a shard, and the provided buffers its receives take
+constexpr unsigned ring_entries = 256;
+constexpr unsigned ring_buffer_count = 64;
+constexpr unsigned ring_buffer_size = 16 * 1024;
+
+// What a completion is for, in the low bits of its user data. The rest is the peer or the shard
+enum ring_request : uintptr_t {
+    ring_accept = 1,
+    ring_doorbell,
+    ring_recv,
+    ring_send,
+    ring_cancel,
+    ring_stats,
+};
+constexpr uintptr_t ring_request_mask = 7;
+#endif
+
+struct broadcast_pool;
+
+// An encoded frame and the count of its references. Taken from the pool of a shard and given back by the last one
+struct pooled_frame {
+    std::string data;
+    std::atomic<uint32_t> references {0};
+    // Null for the frames of no pool, deleted by the last reference
+    broadcast_pool *pool = nullptr;
+    pooled_frame *next = nullptr;
+};
+
+/**
+ * An encoded frame, shared by all the peers it is sent to. A broadcast is encoded once, and each peer only holds a
+ * reference and how much of it is sent already. The references are held and dropped by any shard.
+ */
+struct shared_frame {
+    shared_frame() = default;
+    shared_frame(std::nullptr_t) {}
+    explicit shared_frame(pooled_frame *frame) : frame(frame) {
+        frame->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    shared_frame(const shared_frame &other) : frame(other.frame) {
+        if (frame != nullptr) {
+            frame->references.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    shared_frame(shared_frame &&other) noexcept : frame(other.frame) {
+        other.frame = nullptr;
+    }
+    shared_frame &operator=(shared_frame other) noexcept {
+        std::swap(frame, other.frame);
+        return *this;
+    }
+    ~shared_frame() {
+        reset();
+    }
+
+    void reset();
+    const std::string &operator*() const {
+        return frame->data;
+    }
+    const std::string *operator->() const {
+        return &frame->data;
+    }
+    // For the encoding, before the frame is shared
+    std::string &buffer() const {
+        return frame->data;
+    }
+    bool operator==(std::nullptr_t) const {
+        return frame == nullptr;
+    }
+    bool operator!=(std::nullptr_t) const {
+        return frame != nullptr;
+    }
+
+private:
+    pooled_frame *frame = nullptr;
+};
+
+struct out_frame {
+    shared_frame frame;
+    size_t offset = 0;
+    // The acceptance of the compact framing or an author definition, never dropped as the frames after it need it
+    bool is_control = false;
+};
+
+/**
+ * The frames queued for a peer, an array and the position of its front. Unlike a deque it keeps its space, so the
+ * frames go through it without the allocations. The sent ones are moved out once they are half of it, and all the
+ * space is reused once it is empty.
+ */
+struct out_queue {
+    std::vector<out_frame> frames;
+    size_t head = 0;
+
+    bool empty() const {
+        return head == frames.size();
+    }
+    size_t size() const {
+        return frames.size() - head;
+    }
+    out_frame &front() {
+        return frames[head];
+    }
+    const out_frame &front() const {
+        return frames[head];
+    }
+    out_frame &back() {
+        return frames.back();
+    }
+    out_frame &operator[](const size_t index) {
+        return frames[head + index];
+    }
+    std::vector<out_frame>::iterator begin() {
+        return frames.begin() + static_cast<ptrdiff_t>(head);
+    }
+    std::vector<out_frame>::iterator end() {
+        return frames.end();
+    }
+    void push_back(out_frame &&frame) {
+        frames.push_back(std::move(frame));
+    }
+    void pop_front() {
+        frames[head].frame.reset();
+        if (++head == frames.size()) {
+            clear();
+        } else if (head >= out_queue_compact_size && head * 2 >= frames.size()) {
+            frames.erase(frames.begin(), begin());
+            head = 0;
+        }
+    }
+    void erase(const std::vector<out_frame>::iterator first, const std::vector<out_frame>::iterator last) {
+        frames.erase(first, last);
+        if (empty()) {
+            clear();
+        }
+    }
+    // The space of a queue which has been that long is freed
+    void clear() {
+        if (frames.capacity() > out_queue_idle_size) {
+            std::vector<out_frame>().swap(frames);
+        }
+        frames.clear();
+        head = 0;
+    }
+};
+
+// A broadcast in both framings. The compact one is encoded from the classic one for the first compact peer
+struct broadcast_frames {
+    shared_frame frame;
+    shared_frame compact_frame;
+    // The interned author of all the frames, 0 for none
+    uint32_t author_id = 0;
+    uint32_t room_id = common_room;
+    // The number of the multicast datagram, 0 when it is not multicast. The repair frame is sent to the subscribers
+    // instead of the datagram when it is too big
+    uint64_t sequence = 0;
+    shared_frame repair_frame;
+};
 
 struct chat_peer {
     int socket = -1;
-    std::string out_buffer;
-    size_t out_offset = 0;
+    // The TLS handshake in progress. The socket has the kernel TLS after it, and nothing is sent before
+    chat_tls_session *tls = nullptr;
+    // Changed each time the peer is reused, so a message back from the handler pool knows its sender is gone
+    uint64_t generation = 0;
+    uint32_t room_id = common_room;
+    // Positions in the lists of its shard, for the removal without a search
+    size_t peer_index = 0;
+    size_t room_index = 0;
+    size_t dirty_index = 0;
+    size_t held_index = 0;
+    out_queue out_frames;
+    // In the dirty peers of its shard, with the new frames not tried to send yet
+    bool is_dirty = false;
     frame_parser input;
 
     std::string author;
     bool has_author = false;
+    uint32_t author_id = 0;
+
+    // Gets the broadcasts by multicast, skipping the ones of this id
+    uint32_t multicast_id = 0;
+    // The frames to the peer are compact, and the authors it has got the definitions of, by id
+    bool is_compact = false;
+    std::vector<bool> known_authors;
+
+    // The compressed output, and the frames at the back of the queue not compressed yet
+    chat_deflate *deflate = nullptr;
+    size_t plain_count = 0;
+    // The compressed input, from the empty frame after the handshake
+    chat_inflate *inflate = nullptr;
+    bool is_inflating = false;
+
+    // Has sent a frame, so it is past the handshake and can be pinged
+    bool has_frames = false;
+    uint64_t last_input_ms = 0;
+    uint64_t last_ping_ms = 0;
+    // The slot of the timer wheel it is in, checked again when the slot is due
+    bool is_timed = false;
+    size_t timer_slot = 0;
+    size_t timer_index = 0;
+
+    // The bytes of the frames in the queue, and whether it is over the limit of the server
+    size_t queued_size = 0;
+    bool is_full = false;
+    // Over the limit with the disconnect policy or with a broken input, removed in the next flush
+    bool is_dropped = false;
+    // In the held peers of its shard, with the input not read till the shard is resumed
+    bool is_held = false;
+
+#if CHAT_SERVER_IO_URING
+    // Requests in the ring. A closed peer is deleted when the last of them is done
+    int ring_requests = 0;
+    bool is_closed = false;
+    // The multishot receive is in the ring, and whether it is cancelled for a pause
+    bool is_receiving = false;
+    bool is_recv_cancelled = false;
+    // The send in the ring points here and to the frames at the front
+    bool is_sending = false;
+    std::vector<iovec> send_vectors;
+    msghdr send_header {};
+#endif
 };
 
-struct chat_server {
+/**
+ * Counters of a shard. Written by its thread only, so the increments are plain loads and stores, and read by
+ * chat_server_get_stats() from the main one.
+ */
+struct shard_stats {
+    std::atomic<uint64_t> accepted_count {0};
+    std::atomic<uint64_t> closed_count {0};
+    std::atomic<uint64_t> received_message_count {0};
+    std::atomic<uint64_t> broadcast_message_count {0};
+    std::atomic<uint64_t> received_bytes {0};
+    std::atomic<uint64_t> sent_bytes {0};
+    std::atomic<uint64_t> eagain_count {0};
+    std::atomic<uint64_t> wakeup_count {0};
+    std::atomic<uint64_t> event_count {0};
+    std::atomic<uint64_t> multicast_count {0};
+    std::atomic<uint64_t> repair_count {0};
+    std::atomic<uint64_t> backlog_peer_counts[CHAT_STATS_BACKLOG_BUCKET_COUNT] = {};
+};
+
+static void stat_add(std::atomic<uint64_t> &counter, const uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static void stat_sub(std::atomic<uint64_t> &counter, const uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) - value, std::memory_order_relaxed);
+}
+
+// The range of chat_server_stats.backlog_peer_counts: none, then up to 1KB, 4KB and so on by 4 times
+static size_t backlog_bucket(const size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    size_t bucket = 1;
+    for (size_t bound = 1024; bucket < CHAT_STATS_BACKLOG_BUCKET_COUNT - 1 && size > bound; bound *= 4) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+/**
+ * The peers of a shard are taken from chunks and reused, so a connection doesn't allocate one and the peers are close
+ * in memory for the broadcasts.
+ */
+struct peer_pool {
+    std::vector<std::unique_ptr<chat_peer[]>> chunks;
+    std::vector<chat_peer *> free_peers;
+};
+
+// What a shard gets from the others: a broadcast for all its peers, and for the main shard a message to pop
+struct shard_event {
+    broadcast_frames frames;
+    // The frame is a message for the main shard to pop
+    bool is_message = false;
+    // Of the shard which has sent it, it goes back there
+    broadcast_pool *pool = nullptr;
+    shard_event *next = nullptr;
+};
+
+/**
+ * The frames and the events of the broadcasts of a shard, reused so a broadcast doesn't allocate once the server is
+ * warm. Only the shard takes them. Any shard gives them back through a lock-free stack, which the shard takes all at
+ * once when its own list is empty. Owned by the server, the frames of a shard can be held by the others after it.
+ */
+struct broadcast_pool {
+    pooled_frame *free_frames = nullptr;
+    size_t free_frame_count = 0;
+    std::atomic<pooled_frame *> returned_frames {nullptr};
+    shard_event *free_events = nullptr;
+    size_t free_event_count = 0;
+    std::atomic<shard_event *> returned_events {nullptr};
+
+    ~broadcast_pool();
+};
+
+template <typename T>
+static void delete_list(T *item) {
+    while (item != nullptr) {
+        T *next = item->next;
+        delete item;
+        item = next;
+    }
+}
+
+broadcast_pool::~broadcast_pool() {
+    delete_list(free_frames);
+    delete_list(returned_frames.load());
+    delete_list(free_events);
+    delete_list(returned_events.load());
+}
+
+// From any thread
+template <typename T>
+static void pool_give_back(std::atomic<T *> &returned, T *item) {
+    item->next = returned.load(std::memory_order_relaxed);
+    while (!returned.compare_exchange_weak(item->next, item, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+// The given back items become the free ones, the ones over the limit are deleted
+template <typename T>
+static T *pool_take_returned(std::atomic<T *> &returned, size_t &free_count, const size_t limit) {
+    T *items = returned.exchange(nullptr, std::memory_order_acquire);
+    T *last_kept = nullptr;
+    for (T *item = items; item != nullptr && free_count < limit; item = item->next) {
+        last_kept = item;
+        ++free_count;
+    }
+    if (last_kept == nullptr) {
+        delete_list(items);
+        return nullptr;
+    }
+    delete_list(last_kept->next);
+    last_kept->next = nullptr;
+    return items;
+}
+
+void shared_frame::reset() {
+    if (frame == nullptr) {
+        return;
+    }
+    if (frame->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (frame->pool != nullptr && frame->data.capacity() <= pooled_frame_capacity) {
+            pool_give_back(frame->pool->returned_frames, frame);
+        } else {
+            delete frame;
+        }
+    }
+    frame = nullptr;
+}
+
+// A frame of no pool, for the constant ones
+static shared_frame new_unpooled_frame(const std::string_view data) {
+    auto *frame = new pooled_frame();
+    frame->data.assign(data);
+    return shared_frame(frame);
+}
+
+struct handled_message;
+
+/**
+ * An event loop with its own listen socket on the server port, bound with SO_REUSEPORT when there are many, and its
+ * own peers. The main shard is run by chat_server_update(), each other one by its own thread. They share nothing but
+ * the inboxes.
+ */
+struct chat_shard {
+    chat_server *server = nullptr;
     int socket = -1;    // listen socket
     int epoll_file_descriptor = -1;
+    // An eventfd rung after a push into the inbox or a message handled in the pool. Only when there are many shards or
+    // a handler pool
+    int doorbell = -1;
     std::vector<chat_peer *> peers;
-    std::deque<chat_message *> incoming;
+    broadcast_pool *broadcasts = nullptr;
+    // The peers of each room, by id, so a broadcast goes through its room only
+    std::vector<std::vector<chat_peer *>> room_peers {1};
+    peer_pool pool;
+    // Peers with new frames, flushed at the end of an update or a feed
+    std::vector<chat_peer *> dirty_peers;
+    // Peers not read while the shard is paused
+    std::vector<chat_peer *> held_peers;
+    // All the bytes queued, read by the other threads for the stats
+    std::atomic<size_t> queued_size {0};
+    // The part of the server budget, 0 for none
+    size_t output_budget = 0;
+    // Peers over the output limit
+    int full_peers = 0;
+    shard_stats stats;
+    // The stats served as text, by the main shard only
+    int stats_socket = -1;
+    // The time of the current update, for the timers
+    uint64_t now_ms = 0;
+    // When the multicast heartbeat is due after the datagrams of the shard, 0 for none
+    uint64_t multicast_heartbeat_ms = 0;
+    // A hashed timer wheel: a slot per tick of a turn, the peers due in it. The deadlines are checked lazily, the input
+    // only moves the time of a peer, not the peer in the wheel
+    std::vector<std::vector<chat_peer *>> timer_slots;
+    std::vector<chat_peer *> expired_peers;
+    uint64_t timer_tick = 0;    // the next tick to check
+    size_t timer_count = 0;
+    // The last broadcasts, shared with the queues. Each shard keeps its own, they all see the same broadcasts
+    std::vector<broadcast_frames> history;
+    size_t history_head = 0;
+    // A lock-free stack of the other shards, newest first
+    std::atomic<shard_event *> inbox {nullptr};
+    // The messages given to the handler, oldest first, and how many of them are still in the pool
+    std::deque<handled_message *> handled_messages;
+    std::atomic<int> running_handlers {0};
+    std::atomic<bool> stop {false};
+    std::thread thread;
+
+#if CHAT_SERVER_IO_URING
+    // Used instead of the epoll when the system has it
+    chat_uring ring;
+    bool has_ring = false;
+    // All the requests in the ring, for the drain in the end
+    int ring_requests = 0;
+    uint64_t doorbell_value = 0;
+#endif
+};
+
+// A message given to the handler. Broadcast from the queue of its shard when it and all the ones before it are done
+struct handled_message {
+    chat_shard *shard = nullptr;
+    chat_message message;
+    // The sender doesn't get its own message, unless it is gone and the peer is reused
+    const chat_peer *sender = nullptr;
+    uint64_t sender_generation = 0;
+    uint32_t author_id = 0;
+    uint32_t room_id = common_room;
+    bool is_kept = false;
+    std::atomic<bool> is_done {false};
+};
+
+// A broadcast kept for the repairs
+struct multicast_entry {
+    uint64_t sequence = 0;
+    uint32_t sender_id = 0;
+    shared_frame frame;
+};
+
+// The datagrams to the group, numbered and sent under the lock by the shard of the broadcast
+struct multicast_channel {
+    int socket = -1;
+    // "<address>:<port>" for the answers
+    std::string group;
+    std::mutex mutex;
+    uint64_t next_sequence = 1;
+    // By the number modulo the size
+    std::vector<multicast_entry> kept;
+    std::atomic<uint32_t> next_subscriber_id {1};
+};
+
+struct chat_server {
+    int thread_count = 1;
+    size_t output_limit = 0;
+    chat_overflow_policy output_policy = CHAT_OVERFLOW_DISCONNECT;
+    size_t output_budget = 0;
+    size_t history_size = 0;
+    uint64_t idle_timeout_ms = 0;
+    uint64_t heartbeat_ms = 0;
+    chat_message_handler_f message_handler = nullptr;
+    void *message_handler_arg = nullptr;
+    thread_pool *message_pool = nullptr;
+    chat_tls_context *tls = nullptr;
+    multicast_channel multicast;
+    // The UNIX socket a new process takes the server over through
+    std::string handoff_path;
+    int handoff_socket = -1;
+    // The first one is the main. Not changed from the listen till the delete
+    std::vector<chat_shard *> shards;
+    // Of the shards, by index. Deleted after all of them and the kept broadcasts
+    std::vector<std::unique_ptr<broadcast_pool>> broadcast_pools;
+    message_queue incoming;
     std::string admin_feed_buffer;
+    uint32_t feed_author_id = 0;
+
+    // The authors of the compact framing and the rooms, shared by the shards. An id is taken on a handshake only
+    std::mutex author_mutex;
+    std::unordered_map<std::string, uint32_t> author_ids;
+    std::vector<std::string> author_names {std::string()};
+    // The rooms by name, the common one has none
+    std::unordered_map<std::string, uint32_t> room_ids;
 };
 
-static void peer_destroy(const chat_server *server, const chat_peer *peer) {
+// The id of the room, the same in all the shards
+static uint32_t server_intern_room(chat_server *server, const std::string_view room) {
+    const std::lock_guard<std::mutex> lock(server->author_mutex);
+    const auto found = server->room_ids.find(std::string(room));
+    if (found != server->room_ids.end()) {
+        return found->second;
+    }
+    if (server->room_ids.size() + 1 >= max_room_count) {
+        return common_room;
+    }
+    const auto room_id = static_cast<uint32_t>(server->room_ids.size() + 1);
+    server->room_ids.emplace(room, room_id);
+    return room_id;
+}
+
+// The id of the author, the same for all the peers of all the shards
+static uint32_t server_intern_author(chat_server *server, const std::string &author) {
+    const std::lock_guard<std::mutex> lock(server->author_mutex);
+    const auto found = server->author_ids.find(author);
+    if (found != server->author_ids.end()) {
+        return found->second;
+    }
+    if (server->author_names.size() >= max_author_count) {
+        return 0;
+    }
+    const auto author_id = static_cast<uint32_t>(server->author_names.size());
+    server->author_names.push_back(author);
+    server->author_ids.emplace(author, author_id);
+    return author_id;
+}
+
+// An empty frame of the pool of the shard, for the encoding
+static shared_frame shard_new_frame(chat_shard *shard) {
+    broadcast_pool *pool = shard->broadcasts;
+    if (pool->free_frames == nullptr) {
+        pool->free_frames = pool_take_returned(pool->returned_frames, pool->free_frame_count, pooled_frame_count);
+    }
+    pooled_frame *frame = pool->free_frames;
+    if (frame == nullptr) {
+        frame = new pooled_frame();
+        frame->pool = pool;
+        return shared_frame(frame);
+    }
+    pool->free_frames = frame->next;
+    --pool->free_frame_count;
+    frame->data.clear();
+    return shared_frame(frame);
+}
+
+static shard_event *shard_new_event(chat_shard *shard) {
+    broadcast_pool *pool = shard->broadcasts;
+    if (pool->free_events == nullptr) {
+        pool->free_events = pool_take_returned(pool->returned_events, pool->free_event_count, pooled_event_count);
+    }
+    shard_event *event = pool->free_events;
+    if (event == nullptr) {
+        event = new shard_event();
+        event->pool = pool;
+        return event;
+    }
+    pool->free_events = event->next;
+    --pool->free_event_count;
+    event->next = nullptr;
+    return event;
+}
+
+// Back to the shard which has sent it, without the frames
+static void shard_event_done(shard_event *event) {
+    event->frames = broadcast_frames();
+    event->is_message = false;
+    pool_give_back(event->pool->returned_events, event);
+}
+
+static void push_to(std::vector<chat_peer *> &peers, size_t chat_peer::*position, chat_peer *peer) {
+    peer->*position = peers.size();
+    peers.push_back(peer);
+}
+
+// Swap with the last one and pop, the position of the moved peer is updated
+static void remove_from(std::vector<chat_peer *> &peers, size_t chat_peer::*position, const chat_peer *peer) {
+    const size_t index = peer->*position;
+    chat_peer *last = peers.back();
+    peers[index] = last;
+    last->*position = index;
+    peers.pop_back();
+}
+
+static void shard_schedule(chat_shard *shard, chat_peer *peer);
+
+static chat_peer *shard_new_peer(chat_shard *shard, const int socket) {
+    peer_pool &pool = shard->pool;
+    if (pool.free_peers.empty()) {
+        pool.chunks.push_back(std::make_unique<chat_peer[]>(peer_chunk_size));
+        chat_peer *chunk = pool.chunks.back().get();
+        // Taken from the back, the first ones first
+        for (size_t index = peer_chunk_size; index > 0; --index) {
+            pool.free_peers.push_back(&chunk[index - 1]);
+        }
+    }
+    chat_peer *peer = pool.free_peers.back();
+    pool.free_peers.pop_back();
+    // The frames of an update go in one send already, Nagle would only hold them till the delayed ACK
+    constexpr int one = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    stat_add(shard->stats.accepted_count, 1);
+    stat_add(shard->stats.backlog_peer_counts[0], 1);
+    peer->socket = socket;
+    peer->peer_index = shard->peers.size();
+    shard->peers.push_back(peer);
+    push_to(shard->room_peers[common_room], &chat_peer::room_index, peer);
+    peer->last_input_ms = shard->now_ms;
+    peer->last_ping_ms = shard->now_ms;
+    shard_schedule(shard, peer);
+    return peer;
+}
+
+// Back to the pool. The peer must be removed from the lists already
+static void peer_destroy(chat_shard *shard, chat_peer *peer) {
     if (peer == nullptr) {
         return;
     }
 
-    if (server->epoll_file_descriptor >= 0 && peer->socket >= 0) {
-        epoll_ctl(server->epoll_file_descriptor, EPOLL_CTL_DEL, peer->socket, nullptr);
+    if (shard->epoll_file_descriptor >= 0 && peer->socket >= 0) {
+        epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_DEL, peer->socket, nullptr);
     }
 
     if (peer->socket >= 0) {
         close(peer->socket);
     }
+    chat_deflate_delete(peer->deflate);
+    chat_inflate_delete(peer->inflate);
+    chat_tls_session_delete(peer->tls);
+
+    // The buffers are kept for the next connection of the peer
+    const uint64_t generation = peer->generation + 1;
+    frame_parser input = std::move(peer->input);
+    out_queue out_frames = std::move(peer->out_frames);
+    input.clear();
+    out_frames.clear();
+    *peer = chat_peer();
+    peer->generation = generation;
+    peer->input = std::move(input);
+    peer->out_frames = std::move(out_frames);
+    shard->pool.free_peers.push_back(peer);
+}
+
+// Count the bytes queued for the peer, and whether it is over the limit now
+static void shard_account(chat_shard *shard, chat_peer *peer, const size_t added, const size_t removed) {
+    const size_t bucket = backlog_bucket(peer->queued_size);
+    peer->queued_size = peer->queued_size + added - removed;
+    const size_t new_bucket = backlog_bucket(peer->queued_size);
+    if (new_bucket != bucket) {
+        stat_sub(shard->stats.backlog_peer_counts[bucket], 1);
+        stat_add(shard->stats.backlog_peer_counts[new_bucket], 1);
+    }
+    shard->queued_size.store(shard->queued_size.load(std::memory_order_relaxed) + added - removed,
+                             std::memory_order_relaxed);
+    const size_t limit = shard->server->output_limit;
+    const bool is_full = limit != 0 && peer->queued_size > limit;
+    if (is_full != peer->is_full) {
+        peer->is_full = is_full;
+        shard->full_peers += is_full ? 1 : -1;
+    }
+}
+
+static bool shard_is_over_budget(const chat_shard *shard) {
+    return shard->output_budget != 0 && shard->queued_size.load(std::memory_order_relaxed) > shard->output_budget;
+}
+
+// With the pause policy the peers are not read while some output is over the limits. Nor while the handler pool has
+// too many messages of the shard
+static bool shard_is_paused(const chat_shard *shard) {
+    if (shard->handled_messages.size() >= max_handled_count) {
+        return true;
+    }
+    return shard->server->output_policy == CHAT_OVERFLOW_PAUSE_SENDERS &&
+           (shard->full_peers > 0 || shard_is_over_budget(shard));
+}
+
+static void shard_hold(chat_shard *shard, chat_peer *peer) {
+    if (!peer->is_held) {
+        peer->is_held = true;
+        push_to(shard->held_peers, &chat_peer::held_index, peer);
+    }
+}
+
+static void shard_remove_peer(chat_shard *shard, chat_peer *peer) {
+    remove_from(shard->peers, &chat_peer::peer_index, peer);
+    remove_from(shard->room_peers[peer->room_id], &chat_peer::room_index, peer);
+    if (peer->is_dirty) {
+        remove_from(shard->dirty_peers, &chat_peer::dirty_index, peer);
+    }
+    if (peer->is_held) {
+        remove_from(shard->held_peers, &chat_peer::held_index, peer);
+    }
+    if (peer->is_timed) {
+        remove_from(shard->timer_slots[peer->timer_slot], &chat_peer::timer_index, peer);
+        --shard->timer_count;
+    }
+    shard_account(shard, peer, 0, peer->queued_size);
+    stat_add(shard->stats.closed_count, 1);
+    stat_sub(shard->stats.backlog_peer_counts[0], 1);
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring && peer->ring_requests > 0) {
+        // Its requests end with errors now, the last one deletes it
+        peer->is_closed = true;
+        shutdown(peer->socket, SHUT_RDWR);
+        return;
+    }
+#endif
+    peer_destroy(shard, peer);
+}
+
+static bool peer_has_output(const chat_peer *peer) {
+    return !peer->out_frames.empty();
+}
+
+// Drop what is sent: the whole frames, and the beginning of the next one
+static void shard_consume(chat_shard *shard, chat_peer *peer, size_t size) {
+    shard_account(shard, peer, 0, size);
+    stat_add(shard->stats.sent_bytes, size);
+    while (size > 0) {
+        out_frame &front = peer->out_frames.front();
+        const size_t left = front.frame->size() - front.offset;
+        if (size < left) {
+            front.offset += size;
+            return;
+        }
+        size -= left;
+        peer->out_frames.pop_front();
+    }
+}
+
+/**
+ * The new frames of a compressing peer become one block, flushed so the peer can decode all of it. A block can't be
+ * dropped, the stream goes on from it.
+ */
+static bool shard_compress(chat_shard *shard, chat_peer *peer) {
+    if (peer->deflate == nullptr || peer->plain_count == 0) {
+        return true;
+    }
+    out_queue &frames = peer->out_frames;
+    const size_t first = frames.size() - peer->plain_count;
+    shared_frame block = shard_new_frame(shard);
+    size_t plain_size = 0;
+    for (size_t index = first; index < frames.size(); ++index) {
+        const bool is_last = index + 1 == frames.size();
+        if (!chat_deflate_write(peer->deflate, *frames[index].frame, is_last, block.buffer())) {
+            return false;
+        }
+        plain_size += frames[index].frame->size();
+    }
+    frames.erase(frames.begin() + static_cast<ptrdiff_t>(first), frames.end());
+    peer->plain_count = 0;
+    frames.push_back(out_frame {std::move(block), 0, true});
+    shard_account(shard, peer, frames.back().frame->size(), plain_size);
+    return true;
+}
+
+static bool shard_peer_send(chat_shard *shard, chat_peer *peer) {
+    // The frames wait for the end of the TLS handshake
+    if (peer->tls != nullptr) {
+        return true;
+    }
+    if (!shard_compress(shard, peer)) {
+        return false;
+    }
+    while (peer->socket >= 0 && peer_has_output(peer)) {
+        iovec vectors[send_batch_size];
+        size_t count = 0;
+        for (const out_frame &item : peer->out_frames) {
+            if (count == send_batch_size) {
+                break;
+            }
+            vectors[count].iov_base = const_cast<char *>(item.frame->data() + item.offset);
+            vectors[count].iov_len = item.frame->size() - item.offset;
+            ++count;
+        }
+        msghdr message {};
+        message.msg_iov = vectors;
+        message.msg_iovlen = count;
+        const ssize_t value = sendmsg(peer->socket, &message, MSG_NOSIGNAL);
+        if (value > 0) {
+            shard_consume(shard, peer, static_cast<size_t>(value));
+            continue;
+        }
+        if (value == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stat_add(shard->stats.eagain_count, 1);
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool shard_peer_flush(chat_shard *shard, chat_peer *peer) {
+    TRACE_BEGIN("peer flush", peer);
+    const bool is_ok = shard_peer_send(shard, peer);
+    TRACE_END("peer flush");
+    return is_ok;
+}
+
+static void shard_mark_dirty(chat_shard *shard, chat_peer *peer) {
+    if (!peer->is_dirty) {
+        peer->is_dirty = true;
+        push_to(shard->dirty_peers, &chat_peer::dirty_index, peer);
+    }
+}
+
+// The frames at the front which are being sent, they stay till the send is done
+static size_t peer_sending_count(const chat_peer *peer) {
+#if CHAT_SERVER_IO_URING
+    if (peer->is_sending) {
+        return peer->send_vectors.size();
+    }
+#endif
+    return !peer->out_frames.empty() && peer->out_frames.front().offset > 0 ? 1 : 0;
+}
+
+// Drop the oldest frames not being sent while the peer or the shard is over the limit
+static void shard_drop_oldest(chat_shard *shard, chat_peer *peer) {
+    const size_t limit = shard->server->output_limit;
+    out_queue &frames = peer->out_frames;
+    // The control frames met on the way are moved to the end of the kept ones. Only the plain ones of a compressing
+    // peer can be dropped
+    size_t kept = peer_sending_count(peer);
+    if (peer->deflate != nullptr) {
+        kept = std::max(kept, frames.size() - peer->plain_count);
+    }
+    size_t index = kept;
+    size_t size = 0;
+    for (; index < frames.size(); ++index) {
+        const bool is_peer_over = limit != 0 && peer->queued_size - size > limit;
+        const bool is_shard_over = shard->output_budget != 0 &&
+                                   shard->queued_size.load(std::memory_order_relaxed) - size > shard->output_budget;
+        if (!is_peer_over && !is_shard_over) {
+            break;
+        }
+        if (frames[index].is_control) {
+            if (kept != index) {
+                frames[kept] = std::move(frames[index]);
+            }
+            ++kept;
+            continue;
+        }
+        size += frames[index].frame->size();
+    }
+    frames.erase(frames.begin() + static_cast<ptrdiff_t>(kept), frames.begin() + static_cast<ptrdiff_t>(index));
+    if (peer->deflate != nullptr) {
+        peer->plain_count -= index - kept;
+    }
+    shard_account(shard, peer, 0, size);
+}
+
+// The queue is dropped right away, and the peer is removed in the next flush
+static void shard_overflow_disconnect(chat_shard *shard, chat_peer *peer) {
+    peer->is_dropped = true;
+    const size_t kept = peer_sending_count(peer);
+    size_t size = 0;
+    for (size_t index = kept; index < peer->out_frames.size(); ++index) {
+        size += peer->out_frames[index].frame->size();
+    }
+    peer->out_frames.erase(peer->out_frames.begin() + static_cast<ptrdiff_t>(kept), peer->out_frames.end());
+    peer->plain_count = 0;
+    shard_account(shard, peer, 0, size);
+    shard_mark_dirty(shard, peer);
+}
+
+static void shard_overflow(chat_shard *shard, chat_peer *peer) {
+    switch (shard->server->output_policy) {
+    case CHAT_OVERFLOW_DROP_OLDEST:
+        shard_drop_oldest(shard, peer);
+        break;
+    case CHAT_OVERFLOW_DISCONNECT:
+        shard_overflow_disconnect(shard, peer);
+        break;
+    case CHAT_OVERFLOW_PAUSE_SENDERS:
+        // The readers stop by themselves
+        break;
+    }
+}
+
+// The biggest queue of the shard, which a budget overflow is applied to. Null when nothing can be dropped
+static chat_peer *shard_biggest_queue(const chat_shard *shard) {
+    chat_peer *biggest = nullptr;
+    for (chat_peer *peer : shard->peers) {
+        if (peer->is_dropped || peer->out_frames.size() <= peer_sending_count(peer)) {
+            continue;
+        }
+        if (biggest == nullptr || peer->queued_size > biggest->queued_size) {
+            biggest = peer;
+        }
+    }
+    return biggest;
+}
+
+// The frame is sent later, with all the others queued till the end of the update
+static void shard_enqueue(chat_shard *shard, chat_peer *peer, const shared_frame &frame,
+                          const bool is_control = false) {
+    if (peer->is_dropped) {
+        return;
+    }
+    peer->out_frames.push_back(out_frame {frame, 0, is_control});
+    if (peer->deflate != nullptr) {
+        ++peer->plain_count;
+    }
+    shard_account(shard, peer, frame->size(), 0);
+    shard_mark_dirty(shard, peer);
+    if (shard->server->output_policy == CHAT_OVERFLOW_PAUSE_SENDERS) {
+        return;
+    }
+    if (peer->is_full) {
+        shard_overflow(shard, peer);
+    }
+    while (shard_is_over_budget(shard)) {
+        chat_peer *biggest = shard_biggest_queue(shard);
+        if (biggest == nullptr) {
+            break;
+        }
+        const size_t size = shard->queued_size.load(std::memory_order_relaxed);
+        shard_overflow(shard, biggest);
+        // Only the frames which can't be dropped are left
+        if (!biggest->is_dropped && shard->queued_size.load(std::memory_order_relaxed) == size) {
+            break;
+        }
+    }
+}
+
+#if CHAT_SERVER_IO_URING
+static void shard_ring_recv(chat_shard *shard, chat_peer *peer);
+static void shard_ring_send(chat_shard *shard, chat_peer *peer);
+#endif
+
+// One sendmsg() per peer for all the frames of a burst, not one send() per frame
+static void shard_flush_dirty(chat_shard *shard) {
+    for (chat_peer *peer : shard->dirty_peers) {
+        peer->is_dirty = false;
+    }
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        // A peer with a send in the ring sends the new frames when it is done
+        for (chat_peer *peer : shard->dirty_peers) {
+            if (peer->is_dropped) {
+                shard_remove_peer(shard, peer);
+            } else if (!peer->is_sending) {
+                shard_ring_send(shard, peer);
+            }
+        }
+        shard->dirty_peers.clear();
+        return;
+    }
+#endif
+    // Removal doesn't touch the list, the peers aren't dirty anymore
+    for (size_t index = 0; index < shard->dirty_peers.size(); ++index) {
+        chat_peer *peer = shard->dirty_peers[index];
+        if (peer->is_dropped || !shard_peer_flush(shard, peer)) {
+            shard_remove_peer(shard, peer);
+        }
+    }
+    shard->dirty_peers.clear();
+}
+
+static void shard_ring(const chat_shard *shard) {
+    const uint64_t one = 1;
+    // Fails only when the counter is full, then it is readable anyway
+    const ssize_t value = write(shard->doorbell, &one, sizeof(one));
+    (void)value;
+}
+
+static void shard_push_event(chat_shard *shard, shard_event *event) {
+    event->next = shard->inbox.load();
+    while (!shard->inbox.compare_exchange_weak(event->next, event)) {
+    }
+    shard_ring(shard);
+}
+
+// The classic frames of the block again, in the compact framing
+static shared_frame encode_compact(chat_shard *shard, const std::string &block, const uint32_t author_id) {
+    shared_frame frame = shard_new_frame(shard);
+    std::string &encoded = frame.buffer();
+    encoded.reserve(block.size());
+    for (size_t offset = 0; offset + 8 <= block.size();) {
+        uint32_t author_length = 0;
+        uint32_t data_length = 0;
+        readU32(block.data() + offset, author_length);
+        readU32(block.data() + offset + 4, data_length);
+        const size_t data_offset = offset + 8 + author_length;
+        enqueueCompactFrame(encoded, author_id, std::string_view(block.data() + data_offset, data_length));
+        offset = data_offset + data_length;
+    }
+    return frame;
+}
+
+// The name of the author goes before its first frame to the peer
+static void shard_enqueue_definition(chat_shard *shard, chat_peer *peer, const uint32_t author_id) {
+    if (peer->known_authors.size() <= author_id) {
+        peer->known_authors.resize(author_id + 1);
+    }
+    if (peer->known_authors[author_id]) {
+        return;
+    }
+    peer->known_authors[author_id] = true;
+    shared_frame definition = shard_new_frame(shard);
+    chat_server *server = shard->server;
+    {
+        const std::lock_guard<std::mutex> lock(server->author_mutex);
+        enqueueCompactAuthor(definition.buffer(), author_id, server->author_names[author_id]);
+    }
+    shard_enqueue(shard, peer, definition, true);
+}
+
+// The frames in the framing of the peer
+static void shard_enqueue_broadcast(chat_shard *shard, chat_peer *peer, broadcast_frames &frames) {
+    if (!peer->is_compact) {
+        shard_enqueue(shard, peer, frames.frame);
+        return;
+    }
+    if (frames.author_id != 0) {
+        shard_enqueue_definition(shard, peer, frames.author_id);
+    }
+    if (frames.compact_frame == nullptr) {
+        frames.compact_frame = encode_compact(shard, *frames.frame, frames.author_id);
+    }
+    shard_enqueue(shard, peer, frames.compact_frame);
+}
+
+// Kept in place of the oldest one when the history is full
+static void shard_remember(chat_shard *shard, const broadcast_frames &frames) {
+    const size_t size = shard->server->history_size;
+    if (size == 0) {
+        return;
+    }
+    if (shard->history.size() < size) {
+        shard->history.push_back(frames);
+        return;
+    }
+    shard->history[shard->history_head] = frames;
+    shard->history_head = (shard->history_head + 1) % size;
+}
+
+// All the history, oldest first, goes to the peer in the same sends as the rest of its queue
+static void shard_replay_history(chat_shard *shard, chat_peer *peer) {
+    const size_t size = shard->history.size();
+    for (size_t index = 0; index < size; ++index) {
+        broadcast_frames &frames = shard->history[(shard->history_head + index) % size];
+        if (frames.room_id == all_rooms || frames.room_id == peer->room_id) {
+            shard_enqueue_broadcast(shard, peer, frames);
+        }
+    }
+}
+
+// The peers a broadcast to the room goes to in the shard
+static const std::vector<chat_peer *> &shard_room_peers(const chat_shard *shard, const uint32_t room_id) {
+    static const std::vector<chat_peer *> no_peers;
+    if (room_id == all_rooms) {
+        return shard->peers;
+    }
+    return room_id < shard->room_peers.size() ? shard->room_peers[room_id] : no_peers;
+}
+
+// The multicast broadcast over TCP: a control frame of the number, the sender and the frame count, then the frames
+static shared_frame encode_repair(chat_shard *shard, const uint64_t sequence, const uint32_t sender_id,
+                                  const std::string &block) {
+    size_t count = 0;
+    for (size_t offset = 0; offset + 8 <= block.size(); ++count) {
+        uint32_t author_length = 0;
+        uint32_t data_length = 0;
+        readU32(block.data() + offset, author_length);
+        readU32(block.data() + offset + 4, data_length);
+        offset += 8 + author_length + data_length;
+    }
+    char header[64];
+    const int length = std::snprintf(header, sizeof(header), "%.*s=%llu,%u,%zu",
+                                     static_cast<int>(multicast_repair.size()), multicast_repair.data(),
+                                     static_cast<unsigned long long>(sequence), sender_id, count);
+    shared_frame frame = shard_new_frame(shard);
+    enqueueFrame(frame.buffer(), std::string_view(header, static_cast<size_t>(length)), std::string_view());
+    frame.buffer().append(block);
+    return frame;
+}
+
+static void shard_broadcast_local(chat_shard *shard, const chat_peer *sender, broadcast_frames &frames) {
+    for (chat_peer *peer : shard_room_peers(shard, frames.room_id)) {
+        // The subscribers have got the datagram, or get the repair. The sender gets it without the frames
+        if (frames.sequence != 0 && peer->multicast_id != 0) {
+            if (frames.repair_frame != nullptr) {
+                shard_enqueue(shard, peer, peer == sender ? encode_repair(shard, frames.sequence, 0, std::string())
+                                                          : frames.repair_frame);
+            }
+            continue;
+        }
+        if (sender != nullptr && peer == sender) {
+            continue;
+        }
+        shard_enqueue_broadcast(shard, peer, frames);
+    }
+    shard_remember(shard, frames);
+}
+
+// A message for chat_server_pop_next(), read from its classic frame
+static void server_push_incoming(chat_server *server, const std::string &frame) {
+    uint32_t author_length = 0;
+    uint32_t data_length = 0;
+    readU32(frame.data(), author_length);
+    readU32(frame.data() + 4, data_length);
+    server->incoming.push(std::string_view(frame.data() + 8, author_length),
+                          std::string_view(frame.data() + 8 + author_length, data_length));
+}
+
+/**
+ * Number a broadcast to the common room and send it to the group once for all the subscribers. Under the lock, so the
+ * datagrams go in the order of their numbers. A lost one is sent again over TCP when asked for.
+ */
+static void shard_multicast(chat_shard *origin, const chat_peer *sender, broadcast_frames &frames) {
+    multicast_channel &multicast = origin->server->multicast;
+    if (multicast.socket < 0 || (frames.room_id != common_room && frames.room_id != all_rooms)) {
+        return;
+    }
+    const uint32_t sender_id = sender != nullptr ? sender->multicast_id : 0;
+    const std::lock_guard<std::mutex> lock(multicast.mutex);
+    const uint64_t sequence = multicast.next_sequence++;
+    multicast_entry &entry = multicast.kept[sequence % multicast_kept_count];
+    entry.sequence = sequence;
+    entry.sender_id = sender_id;
+    entry.frame = frames.frame;
+    frames.sequence = sequence;
+    if (frames.frame->size() > multicast_datagram_size) {
+        frames.repair_frame = encode_repair(origin, sequence, sender_id, *frames.frame);
+        return;
+    }
+    // The header, short enough not to be allocated, and the frame as it is
+    std::string header;
+    appendMulticastHeader(header, sequence, sender_id);
+    iovec vectors[2] = {{header.data(), header.size()},
+                        {const_cast<char *>(frames.frame->data()), frames.frame->size()}};
+    msghdr message {};
+    message.msg_iov = vectors;
+    message.msg_iovlen = 2;
+    if (sendmsg(multicast.socket, &message, MSG_DONTWAIT) > 0) {
+        stat_add(origin->stats.multicast_count, 1);
+    }
+    origin->multicast_heartbeat_ms = origin->now_ms + multicast_heartbeat_ms;
+}
+
+/**
+ * Send the encoded frames to all the peers of all the shards except the sender. A message, a single frame, is for
+ * chat_server_pop_next() too, so the main shard takes it from the frame.
+ */
+static void shard_broadcast_frame(chat_shard *origin, const chat_peer *sender, broadcast_frames &frames,
+                                  const bool is_message) {
+    shard_multicast(origin, sender, frames);
+    shard_broadcast_local(origin, sender, frames);
+
+    chat_server *server = origin->server;
+    const chat_shard *main = server->shards.front();
+    if (is_message && origin == main) {
+        server_push_incoming(server, *frames.frame);
+    }
+    for (chat_shard *shard : server->shards) {
+        if (shard == origin) {
+            continue;
+        }
+        shard_event *event = shard_new_event(origin);
+        event->frames = frames;
+        event->is_message = is_message && shard == main;
+        shard_push_event(shard, event);
+    }
+}
+
+// The frame is encoded once for all the peers
+static void shard_broadcast_to(chat_shard *origin, const chat_peer *sender, const std::string_view author,
+                               const std::string_view data, const uint32_t author_id, const uint32_t room_id) {
+    shared_frame encoded = shard_new_frame(origin);
+    enqueueFrame(encoded.buffer(), author, data);
+    stat_add(origin->stats.broadcast_message_count, 1);
+    broadcast_frames frames;
+    frames.frame = std::move(encoded);
+    frames.author_id = author_id;
+    frames.room_id = room_id;
+    shard_broadcast_frame(origin, sender, frames, true);
+}
+
+static void shard_broadcast(chat_shard *origin, const chat_peer *sender, const std::string_view author,
+                            const std::string_view data) {
+    shard_broadcast_to(origin, sender, author, data, sender != nullptr ? sender->author_id : 0,
+                       sender != nullptr ? sender->room_id : common_room);
+}
+
+// In a thread of the pool. The message is not touched after it is done, the shard waits for the ring in its delete
+static void handled_message_run(void *arg) {
+    auto *handled = static_cast<handled_message *>(arg);
+    chat_shard *shard = handled->shard;
+    const chat_server *server = shard->server;
+    handled->is_kept = server->message_handler(server->message_handler_arg, &handled->message);
+    handled->is_done.store(true, std::memory_order_release);
+    shard_ring(shard);
+    shard->running_handlers.fetch_sub(1, std::memory_order_release);
+}
+
+// Broadcast the handled messages from the oldest one till the first still in the pool
+static void shard_take_handled(chat_shard *shard) {
+    while (!shard->handled_messages.empty()) {
+        handled_message *handled = shard->handled_messages.front();
+        if (!handled->is_done.load(std::memory_order_acquire)) {
+            return;
+        }
+        shard->handled_messages.pop_front();
+        if (handled->is_kept) {
+            const chat_peer *sender = handled->sender->generation == handled->sender_generation ? handled->sender
+                                                                                                : nullptr;
+            shard_broadcast_to(shard, sender, handled->message.author, handled->message.data, handled->author_id,
+                               handled->room_id);
+        }
+        delete handled;
+    }
+}
+
+// A message goes through the handler before the broadcast. In the pool it is copied, and the loop goes on
+static void shard_handle_message(chat_shard *shard, chat_peer *peer, const std::string_view author,
+                                 const std::string_view data) {
+    chat_server *server = shard->server;
+    if (server->message_handler == nullptr) {
+        shard_broadcast(shard, peer, author, data);
+        return;
+    }
+    if (server->message_pool == nullptr) {
+        chat_message message {std::string(author), std::string(data)};
+        if (server->message_handler(server->message_handler_arg, &message)) {
+            shard_broadcast(shard, peer, author, message.data);
+        }
+        return;
+    }
+    auto *handled = new handled_message();
+    handled->shard = shard;
+    handled->message.author.assign(author);
+    handled->message.data.assign(data);
+    handled->sender = peer;
+    handled->sender_generation = peer->generation;
+    handled->author_id = peer->author_id;
+    handled->room_id = peer->room_id;
+    shard->handled_messages.push_back(handled);
+    shard->running_handlers.fetch_add(1, std::memory_order_relaxed);
+    if (thread_pool_submit(server->message_pool, handled_message_run, handled) == 0) {
+        return;
+    }
+    // The pool is full, handled in place. Still broadcast after the ones before it
+    shard->running_handlers.fetch_sub(1, std::memory_order_relaxed);
+    handled->is_kept = server->message_handler(server->message_handler_arg, &handled->message);
+    handled->is_done.store(true, std::memory_order_relaxed);
+    shard_take_handled(shard);
+}
+
+/**
+ * Take all from the inbox, oldest first, and the messages back from the handler pool. The doorbell is read before, so
+ * each push after that rings it again.
+ */
+static void shard_take_events(chat_shard *shard) {
+    shard_event *events = nullptr;
+    for (shard_event *event = shard->inbox.exchange(nullptr); event != nullptr;) {
+        shard_event *next = event->next;
+        event->next = events;
+        events = event;
+        event = next;
+    }
+    while (events != nullptr) {
+        shard_event *event = events;
+        events = event->next;
+        shard_broadcast_local(shard, nullptr, event->frames);
+        if (event->is_message) {
+            server_push_incoming(shard->server, *event->frames.frame);
+        }
+        shard_event_done(event);
+    }
+    shard_take_handled(shard);
+}
+
+static bool shard_accept_pending(chat_shard *shard) {
+    while (true) {
+        sockaddr_in address {};
+        socklen_t address_length = sizeof(address);
+        const int file_descriptor = accept(shard->socket, reinterpret_cast<sockaddr *>(&address), &address_length);
+        if (file_descriptor < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+
+        if (setNonBlocking(file_descriptor) != 0) {
+            close(file_descriptor);
+            return false;
+        }
+
+        chat_peer *peer = shard_new_peer(shard, file_descriptor);
+        if (shard->server->tls != nullptr) {
+            peer->tls = chat_tls_session_new(shard->server->tls, file_descriptor, std::string_view());
+            if (peer->tls == nullptr) {
+                shard_remove_peer(shard, peer);
+                continue;
+            }
+        }
+
+        epoll_event event {};
+        std::memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        event.data.ptr = peer;
+
+        if (epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
+            shard_remove_peer(shard, peer);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The peer is removed in the next flush, its input is not parsed anymore
+static void shard_drop_peer(chat_shard *shard, chat_peer *peer) {
+    peer->is_dropped = true;
+    shard_mark_dirty(shard, peer);
+}
+
+// Put the received bytes into the input, decompressed if they are
+static void shard_peer_receive(chat_shard *shard, chat_peer *peer, const char *data, const size_t size) {
+    stat_add(shard->stats.received_bytes, size);
+    peer->last_input_ms = shard->now_ms;
+    if (peer->is_inflating) {
+        if (!chat_inflate_write(peer->inflate, data, size, peer->input)) {
+            shard_drop_peer(shard, peer);
+        }
+        return;
+    }
+    size_t space = 0;
+    std::memcpy(peer->input.reserve(size, space), data, size);
+    peer->input.commit(size);
+}
+
+static void shard_join_room(chat_shard *shard, chat_peer *peer, const uint32_t room_id) {
+    remove_from(shard->room_peers[peer->room_id], &chat_peer::room_index, peer);
+    if (shard->room_peers.size() <= room_id) {
+        shard->room_peers.resize(room_id + 1);
+    }
+    peer->room_id = room_id;
+    push_to(shard->room_peers[room_id], &chat_peer::room_index, peer);
+}
+
+// The data of the handshake is the offered options. The answer is the last classic frame of the peer
+static void shard_accept_options(chat_shard *shard, chat_peer *peer, const std::string_view options) {
+    std::string accepted;
+    if (hasOption(options, compact_framing_offer)) {
+        accepted.append(compact_framing_offer);
+    }
+    chat_deflate *deflate = nullptr;
+    chat_inflate *inflate = nullptr;
+    if (hasOption(options, compression_offer)) {
+        deflate = chat_deflate_new();
+        inflate = chat_inflate_new();
+        if (deflate != nullptr && inflate != nullptr) {
+            accepted.append(accepted.empty() ? "" : " ").append(compression_offer);
+        } else {
+            chat_deflate_delete(deflate);
+            chat_inflate_delete(inflate);
+            deflate = nullptr;
+            inflate = nullptr;
+        }
+    }
+    std::string_view room;
+    if (findOption(options, room_option, room)) {
+        shard_join_room(shard, peer, server_intern_room(shard->server, room));
+        accepted.append(accepted.empty() ? "" : " ").append(room_option).append("=").append(room);
+    }
+    // Not with the compact framing or a room: the datagrams are classic frames of the common room
+    multicast_channel &multicast = shard->server->multicast;
+    if (hasOption(options, multicast_offer) && multicast.socket >= 0 && !hasOption(accepted, compact_framing_offer) &&
+        peer->room_id == common_room) {
+        peer->multicast_id = multicast.next_subscriber_id.fetch_add(1, std::memory_order_relaxed);
+        uint64_t first = 0;
+        {
+            const std::lock_guard<std::mutex> lock(multicast.mutex);
+            first = multicast.next_sequence;
+        }
+        accepted.append(accepted.empty() ? "" : " ").append(multicast_offer).append("=").append(multicast.group);
+        accepted.append(",").append(std::to_string(peer->multicast_id)).append(",").append(std::to_string(first));
+    }
+    const bool is_replayed = hasOption(options, history_offer) && shard->server->history_size > 0;
+    if (is_replayed) {
+        accepted.append(accepted.empty() ? "" : " ").append(history_offer);
+    }
+    shared_frame answer = shard_new_frame(shard);
+    enqueueFrame(answer.buffer(), accepted, std::string_view());
+    shard_enqueue(shard, peer, answer, true);
+    peer->is_compact = hasOption(accepted, compact_framing_offer);
+    peer->deflate = deflate;
+    peer->inflate = inflate;
+    if (is_replayed) {
+        shard_replay_history(shard, peer);
+    }
+}
+
+// The datagrams of the range again, over TCP, the ones not kept anymore without the frames
+static void shard_multicast_repair(chat_shard *shard, chat_peer *peer, const std::string_view range) {
+    const size_t dash = range.find('-');
+    if (dash == std::string_view::npos) {
+        return;
+    }
+    uint64_t first = std::strtoull(std::string(range.substr(0, dash)).c_str(), nullptr, 10);
+    uint64_t last = std::strtoull(std::string(range.substr(dash + 1)).c_str(), nullptr, 10);
+    multicast_channel &multicast = shard->server->multicast;
+    std::vector<shared_frame> repairs;
+    {
+        const std::lock_guard<std::mutex> lock(multicast.mutex);
+        last = std::min(last, multicast.next_sequence - 1);
+        if (first == 0 || first > last) {
+            return;
+        }
+        // Older than the kept ones are lost anyway
+        first = std::max(first, last - std::min<uint64_t>(last, multicast_kept_count - 1));
+        for (uint64_t sequence = first; sequence <= last; ++sequence) {
+            const multicast_entry &entry = multicast.kept[sequence % multicast_kept_count];
+            repairs.push_back(entry.sequence == sequence
+                                  ? encode_repair(shard, sequence, entry.sender_id, *entry.frame)
+                                  : encode_repair(shard, sequence, 0, std::string()));
+        }
+    }
+    stat_add(shard->stats.repair_count, repairs.size());
+    for (const shared_frame &repair : repairs) {
+        shard_enqueue(shard, peer, repair);
+    }
+}
+
+// Handle all the complete frames received from the peer. The rest stays in the buffer when the shard is paused
+static void shard_peer_parse(chat_shard *shard, chat_peer *peer) {
+    // Parsed in place, copied only into the message which outlives the buffer
+    std::string_view parsed_author;
+    std::string_view parsed_data;
+    while (true) {
+        if (peer->is_dropped) {
+            return;
+        }
+        if (shard_is_paused(shard)) {
+            shard_hold(shard, peer);
+            return;
+        }
+        if (!peer->input.try_pop(parsed_author, parsed_data)) {
+            return;
+        }
+        peer->has_frames = true;
+        // Handshake: author, and the options if any
+        if (!peer->has_author && !parsed_author.empty()) {
+            peer->author.assign(parsed_author);
+            peer->has_author = true;
+            peer->author_id = server_intern_author(shard->server, peer->author);
+            if (!parsed_data.empty()) {
+                shard_accept_options(shard, peer, parsed_data);
+            }
+            continue;
+        }
+
+        if (parsed_data.empty()) {
+            std::string_view range;
+            if (peer->multicast_id != 0 && findOption(parsed_author, multicast_nack, range)) {
+                shard_multicast_repair(shard, peer, range);
+                continue;
+            }
+            // The input is compressed after it
+            if (peer->inflate != nullptr && !peer->is_inflating && parsed_author.empty()) {
+                peer->is_inflating = true;
+                if (!chat_inflate_rest(peer->inflate, peer->input)) {
+                    shard_drop_peer(shard, peer);
+                }
+            }
+            continue;
+        }
+
+        stat_add(shard->stats.received_message_count, 1);
+        const std::string_view author = peer->has_author ? std::string_view(peer->author) : std::string_view();
+        shard_handle_message(shard, peer, author, parsed_data);
+    }
+}
+
+static bool shard_peer_read(chat_shard *shard, chat_peer *peer) {
+    if (shard_is_paused(shard)) {
+        shard_hold(shard, peer);
+        return true;
+    }
+    while (true) {
+        // The compressed bytes go through a buffer of their own, the plain ones right into the input
+        char compressed[recv_min_size];
+        size_t space = sizeof(compressed);
+        char *destination = peer->is_inflating ? compressed : peer->input.reserve(recv_min_size, space);
+        const ssize_t value = recv(peer->socket, destination, space, 0);
+        if (value > 0) {
+            if (peer->is_inflating) {
+                shard_peer_receive(shard, peer, compressed, static_cast<size_t>(value));
+            } else {
+                peer->input.commit(static_cast<size_t>(value));
+                stat_add(shard->stats.received_bytes, static_cast<uint64_t>(value));
+                peer->last_input_ms = shard->now_ms;
+            }
+            shard_peer_parse(shard, peer);
+            if (peer->is_dropped) {
+                return false;
+            }
+            if (peer->is_held) {
+                // The rest is read on the resume
+                break;
+            }
+            continue;
+        }
+        if (value == 0) {
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stat_add(shard->stats.eagain_count, 1);
+            break;
+        }
+        return false;
+    }
+    return true;
+}
+
+// The next step of the TLS handshake. Once it is done the peer is read and sent to as any other
+static bool shard_peer_handshake(chat_shard *shard, chat_peer *peer) {
+    int events = 0;
+    const chat_tls_status status = chat_tls_handshake(peer->tls, events);
+    if (status == CHAT_TLS_AGAIN) {
+        return true;
+    }
+    if (status == CHAT_TLS_FAILED) {
+        return false;
+    }
+    chat_tls_session_delete(peer->tls);
+    peer->tls = nullptr;
+    // The events were taken by the handshake, the data after it can be in the socket already
+    return shard_peer_read(shard, peer) && shard_peer_flush(shard, peer);
+}
+
+// Parse and read the held peers again when the queues are sent. The epoll doesn't tell about the data left unread
+static void shard_resume(chat_shard *shard) {
+    if (shard->held_peers.empty() || shard_is_paused(shard)) {
+        return;
+    }
+    const std::vector<chat_peer *> peers = std::move(shard->held_peers);
+    shard->held_peers.clear();
+    for (chat_peer *peer : peers) {
+        peer->is_held = false;
+    }
+    // Only the peer itself can be removed on the way
+    for (chat_peer *peer : peers) {
+        shard_peer_parse(shard, peer);
+#if CHAT_SERVER_IO_URING
+        if (shard->has_ring) {
+            if (!peer->is_held && !peer->is_receiving && !peer->is_closed) {
+                shard_ring_recv(shard, peer);
+            }
+            continue;
+        }
+#endif
+        if (!peer->is_held && !shard_peer_read(shard, peer)) {
+            shard_remove_peer(shard, peer);
+        }
+    }
+}
+
+// Flush the dirty peers, and the frames of the held ones if the flush has resumed them
+static void shard_flush(chat_shard *shard) {
+    shard_flush_dirty(shard);
+    if (!shard->held_peers.empty()) {
+        shard_resume(shard);
+        shard_flush_dirty(shard);
+    }
+}
+
+static uint64_t clock_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// When the peer is to be closed for the silence or pinged. Never without the timeouts
+static uint64_t peer_deadline(const chat_server *server, const chat_peer *peer) {
+    uint64_t deadline = UINT64_MAX;
+    if (server->idle_timeout_ms != 0) {
+        deadline = peer->last_input_ms + server->idle_timeout_ms;
+    }
+    if (server->heartbeat_ms != 0) {
+        deadline = std::min(deadline, std::max(peer->last_input_ms, peer->last_ping_ms) + server->heartbeat_ms);
+    }
+    return deadline;
+}
+
+static void shard_schedule(chat_shard *shard, chat_peer *peer) {
+    const uint64_t deadline = peer_deadline(shard->server, peer);
+    if (deadline == UINT64_MAX) {
+        return;
+    }
+    if (shard->timer_slots.empty()) {
+        shard->timer_slots.resize(timer_slot_count);
+    }
+    if (shard->timer_count == 0) {
+        // The idle wheel has not turned, its ticks are skipped
+        shard->timer_tick = std::max(shard->timer_tick, shard->now_ms / timer_tick_ms);
+    }
+    // Rounded up, a peer is never checked before its deadline
+    const uint64_t tick = std::max((deadline + timer_tick_ms - 1) / timer_tick_ms, shard->timer_tick);
+    peer->timer_slot = tick % timer_slot_count;
+    push_to(shard->timer_slots[peer->timer_slot], &chat_peer::timer_index, peer);
+    peer->is_timed = true;
+    ++shard->timer_count;
+}
+
+// Close the peer silent for too long, ping the one silent for the heartbeat, and wait for the next deadline
+static void shard_check_peer(chat_shard *shard, chat_peer *peer) {
+    const chat_server *server = shard->server;
+    const uint64_t now = shard->now_ms;
+    if (server->idle_timeout_ms != 0 && now >= peer->last_input_ms + server->idle_timeout_ms) {
+        shard_drop_peer(shard, peer);
+        return;
+    }
+    if (server->heartbeat_ms != 0 && now >= std::max(peer->last_input_ms, peer->last_ping_ms) + server->heartbeat_ms) {
+        // An empty frame, which the client answers with one. Not before the handshake: the client could take it for
+        // the answer to its offer
+        if (peer->has_frames) {
+            static const shared_frame ping = new_unpooled_frame(std::string_view("\0\0\0\0\0\0\0\0", 8));
+            static const shared_frame compact_ping = new_unpooled_frame(std::string_view("\0\0", 2));
+            shard_enqueue(shard, peer, peer->is_compact ? compact_ping : ping);
+        }
+        peer->last_ping_ms = now;
+    }
+    shard_schedule(shard, peer);
+}
+
+// The last number after the datagrams of the shard, for the subscribers which have lost the last of them
+static void shard_multicast_heartbeat(chat_shard *shard) {
+    if (shard->multicast_heartbeat_ms == 0 || shard->now_ms < shard->multicast_heartbeat_ms) {
+        return;
+    }
+    shard->multicast_heartbeat_ms = 0;
+    multicast_channel &multicast = shard->server->multicast;
+    std::string datagram;
+    {
+        const std::lock_guard<std::mutex> lock(multicast.mutex);
+        appendMulticastHeader(datagram, multicast.next_sequence - 1, multicast_heartbeat_sender);
+    }
+    (void)send(multicast.socket, datagram.data(), datagram.size(), MSG_DONTWAIT);
+}
+
+// Check the slots due till now. After a long wait each slot is checked once, its peers are due anyway
+static void shard_expire(chat_shard *shard) {
+    shard_multicast_heartbeat(shard);
+    if (shard->timer_count == 0) {
+        return;
+    }
+    const uint64_t now_tick = shard->now_ms / timer_tick_ms;
+    uint64_t tick = shard->timer_tick;
+    if (now_tick >= tick + timer_slot_count) {
+        tick = now_tick + 1 - timer_slot_count;
+    }
+    for (; tick <= now_tick; ++tick) {
+        shard->timer_tick = tick + 1;
+        std::vector<chat_peer *> &slot = shard->timer_slots[tick % timer_slot_count];
+        if (slot.empty()) {
+            continue;
+        }
+        // Swapped out, the peers rescheduled into the same slot go to a new list
+        shard->expired_peers.swap(slot);
+        shard->timer_count -= shard->expired_peers.size();
+        for (chat_peer *peer : shard->expired_peers) {
+            peer->is_timed = false;
+        }
+        for (chat_peer *peer : shard->expired_peers) {
+            if (!peer->is_dropped) {
+                shard_check_peer(shard, peer);
+            }
+        }
+        shard->expired_peers.clear();
+    }
+}
+
+// Till the first slot with peers or the multicast heartbeat, or the given timeout if it is sooner. -1 is no timeout
+static int shard_wait_ms(const chat_shard *shard, int timeout_ms) {
+    if (shard->multicast_heartbeat_ms != 0) {
+        const uint64_t now = clock_ms();
+        const uint64_t until = shard->multicast_heartbeat_ms > now ? shard->multicast_heartbeat_ms - now : 0;
+        if (timeout_ms < 0 || until < static_cast<uint64_t>(timeout_ms)) {
+            timeout_ms = static_cast<int>(until);
+        }
+    }
+    if (shard->timer_count == 0) {
+        return timeout_ms;
+    }
+    uint64_t tick = shard->timer_tick;
+    while (shard->timer_slots[tick % timer_slot_count].empty()) {
+        ++tick;
+    }
+    const uint64_t now = clock_ms();
+    const uint64_t due = tick * timer_tick_ms;
+    const uint64_t until = due > now ? due - now : 0;
+    if (timeout_ms >= 0 && static_cast<uint64_t>(timeout_ms) < until) {
+        return timeout_ms;
+    }
+    return static_cast<int>(std::min<uint64_t>(until, INT_MAX));
+}
+
+static void server_collect_stats(const chat_server *server, chat_server_stats *stats) {
+    *stats = chat_server_stats();
+    for (const chat_shard *shard : server->shards) {
+        const shard_stats &counters = shard->stats;
+        stats->accepted_count += counters.accepted_count.load(std::memory_order_relaxed);
+        stats->closed_count += counters.closed_count.load(std::memory_order_relaxed);
+        stats->received_message_count += counters.received_message_count.load(std::memory_order_relaxed);
+        stats->broadcast_message_count += counters.broadcast_message_count.load(std::memory_order_relaxed);
+        stats->received_bytes += counters.received_bytes.load(std::memory_order_relaxed);
+        stats->sent_bytes += counters.sent_bytes.load(std::memory_order_relaxed);
+        stats->eagain_count += counters.eagain_count.load(std::memory_order_relaxed);
+        stats->wakeup_count += counters.wakeup_count.load(std::memory_order_relaxed);
+        stats->event_count += counters.event_count.load(std::memory_order_relaxed);
+        stats->multicast_count += counters.multicast_count.load(std::memory_order_relaxed);
+        stats->repair_count += counters.repair_count.load(std::memory_order_relaxed);
+        stats->queued_bytes += shard->queued_size.load(std::memory_order_relaxed);
+        for (size_t index = 0; index < CHAT_STATS_BACKLOG_BUCKET_COUNT; ++index) {
+            stats->backlog_peer_counts[index] += counters.backlog_peer_counts[index].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// One "name value" line per counter
+static std::string format_stats(const chat_server_stats &stats) {
+    static const char *const backlog_names[CHAT_STATS_BACKLOG_BUCKET_COUNT] = {
+        "backlog_peers_empty", "backlog_peers_1k", "backlog_peers_4k",
+        "backlog_peers_16k",   "backlog_peers_64k", "backlog_peers_256k",
+        "backlog_peers_1m",    "backlog_peers_4m",  "backlog_peers_more",
+    };
+    const std::pair<const char *, uint64_t> counters[] = {
+        {"accepted", stats.accepted_count},
+        {"closed", stats.closed_count},
+        {"received_messages", stats.received_message_count},
+        {"broadcast_messages", stats.broadcast_message_count},
+        {"received_bytes", stats.received_bytes},
+        {"sent_bytes", stats.sent_bytes},
+        {"eagain", stats.eagain_count},
+        {"wakeups", stats.wakeup_count},
+        {"events", stats.event_count},
+        {"multicast_datagrams", stats.multicast_count},
+        {"multicast_repairs", stats.repair_count},
+        {"queued_bytes", stats.queued_bytes},
+    };
+    std::string text;
+    const auto append = [&text](const char *name, const uint64_t value) {
+        char line[64];
+        const int size = std::snprintf(line, sizeof(line), "%s %llu\n", name, static_cast<unsigned long long>(value));
+        text.append(line, static_cast<size_t>(size));
+    };
+    for (const auto &[name, value] : counters) {
+        append(name, value);
+    }
+    for (size_t index = 0; index < CHAT_STATS_BACKLOG_BUCKET_COUNT; ++index) {
+        append(backlog_names[index], stats.backlog_peer_counts[index]);
+    }
+    return text;
+}
+
+// The text is small, a fresh connection takes it at once. Whoever is slower gets less
+static void serve_stats(const chat_server *server, const int file_descriptor) {
+    chat_server_stats stats {};
+    server_collect_stats(server, &stats);
+    const std::string text = format_stats(stats);
+    const ssize_t value = send(file_descriptor, text.data(), text.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)value;
+    close(file_descriptor);
+}
+
+static void shard_accept_stats(const chat_shard *shard) {
+    while (true) {
+        const int file_descriptor = accept(shard->stats_socket, nullptr, nullptr);
+        if (file_descriptor < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        serve_stats(shard->server, file_descriptor);
+    }
+}
+
+static bool server_accept_handoff(chat_server *server);
+
+// Handle what epoll has returned. False when the accept fails
+static bool shard_process(chat_shard *shard, const epoll_event *events, const int count) {
+    shard->now_ms = clock_ms();
+    stat_add(shard->stats.wakeup_count, 1);
+    stat_add(shard->stats.event_count, static_cast<uint64_t>(count));
+    for (int index = 0; index < count; ++index) {
+        void *tag = events[index].data.ptr;
+        const uint32_t event = events[index].events;
+
+        if (tag == shard) {
+            if (!shard_accept_pending(shard)) {
+                shard_flush_dirty(shard);
+                return false;
+            }
+            continue;
+        }
+        if (tag == &shard->stats_socket) {
+            shard_accept_stats(shard);
+            continue;
+        }
+        if (tag == &shard->server->handoff_socket) {
+            // The shards are gone then, the rest of the events is for the new process
+            if (server_accept_handoff(shard->server)) {
+                return true;
+            }
+            continue;
+        }
+        if (tag == &shard->doorbell) {
+            uint64_t value = 0;
+            const ssize_t size = read(shard->doorbell, &value, sizeof(value));
+            (void)size;
+            shard_take_events(shard);
+            continue;
+        }
+
+        auto *peer = static_cast<chat_peer *>(tag);
+        bool alive = true;
+
+        if (peer->tls != nullptr) {
+            if ((event & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0 || !shard_peer_handshake(shard, peer)) {
+                shard_remove_peer(shard, peer);
+            }
+            continue;
+        }
+
+        if ((event & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0) {
+            (void)shard_peer_read(shard, peer);
+            alive = false;
+        }
+
+        if (alive && (event & EPOLLIN) != 0) {
+            alive = shard_peer_read(shard, peer);
+        }
+        if (alive && (event & EPOLLOUT) != 0) {
+            alive = shard_peer_flush(shard, peer);
+        }
+
+        if (!alive) {
+            shard_remove_peer(shard, peer);
+        }
+    }
+    shard_expire(shard);
+    shard_flush(shard);
+    return true;
+}
+
+#if CHAT_SERVER_IO_URING
+/**
+ * The io_uring loop. The accept and the receives are multishot: one request gives a completion per connection or per
+ * chunk of data, the data in the provided buffers of the ring. A peer has at most one sendmsg() in the ring, for all
+ * its frames queued till then, the next one goes after it is done. All the requests of an update go in one enter.
+ */
+
+static uint64_t ring_tag(const void *object, const ring_request request) {
+    return reinterpret_cast<uintptr_t>(object) | request;
+}
+
+// No entry only when the kernel refuses the submission. Then the request is lost like a failed syscall
+static io_uring_sqe *shard_ring_request(chat_shard *shard, const void *object, const ring_request request) {
+    io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+    if (sqe == nullptr) {
+        return nullptr;
+    }
+    sqe->user_data = ring_tag(object, request);
+    ++shard->ring_requests;
+    return sqe;
+}
+
+// The receive ends with ECANCELED, the peer is not read till the shard is resumed
+static void shard_ring_cancel_recv(chat_shard *shard, chat_peer *peer) {
+    io_uring_sqe *sqe = shard_ring_request(shard, shard, ring_cancel);
+    if (sqe == nullptr) {
+        return;
+    }
+    peer->is_recv_cancelled = true;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ring_tag(peer, ring_recv);
+}
+
+static void shard_ring_accept(chat_shard *shard) {
+    io_uring_sqe *sqe = shard_ring_request(shard, shard, ring_accept);
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void shard_ring_accept_stats(chat_shard *shard) {
+    io_uring_sqe *sqe = shard_ring_request(shard, shard, ring_stats);
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->stats_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void shard_ring_doorbell(chat_shard *shard) {
+    io_uring_sqe *sqe = shard_ring_request(shard, shard, ring_doorbell);
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = shard->doorbell;
+    sqe->addr = reinterpret_cast<uintptr_t>(&shard->doorbell_value);
+    sqe->len = sizeof(shard->doorbell_value);
+}
+
+static void shard_ring_recv(chat_shard *shard, chat_peer *peer) {
+    io_uring_sqe *sqe = shard_ring_request(shard, peer, ring_recv);
+    if (sqe == nullptr) {
+        return;
+    }
+    ++peer->ring_requests;
+    peer->is_receiving = true;
+    peer->is_recv_cancelled = false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = peer->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = chat_uring_buffer_group;
+}
+
+static void shard_ring_send(chat_shard *shard, chat_peer *peer) {
+    if (!shard_compress(shard, peer)) {
+        // The receive ends with the error and removes the peer
+        shutdown(peer->socket, SHUT_RDWR);
+        return;
+    }
+    if (!peer_has_output(peer)) {
+        return;
+    }
+    io_uring_sqe *sqe = shard_ring_request(shard, peer, ring_send);
+    if (sqe == nullptr) {
+        return;
+    }
+    ++peer->ring_requests;
+    peer->is_sending = true;
+    // The frames stay at the front of the queue till the completion, the new ones are only appended
+    peer->send_vectors.clear();
+    for (const out_frame &item : peer->out_frames) {
+        if (peer->send_vectors.size() == send_batch_size) {
+            break;
+        }
+        peer->send_vectors.push_back({const_cast<char *>(item.frame->data() + item.offset),
+                                      item.frame->size() - item.offset});
+    }
+    peer->send_header = msghdr {};
+    peer->send_header.msg_iov = peer->send_vectors.data();
+    peer->send_header.msg_iovlen = peer->send_vectors.size();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = peer->socket;
+    sqe->addr = reinterpret_cast<uintptr_t>(&peer->send_header);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    TRACE_INSTANT("peer flush", peer);
+}
+
+// A peer closed before is deleted with its last request
+static bool peer_ring_release(chat_shard *shard, chat_peer *peer) {
+    if (!peer->is_closed) {
+        return false;
+    }
+    if (peer->ring_requests == 0) {
+        peer_destroy(shard, peer);
+    }
+    return true;
+}
+
+// False when the accept has failed
+static bool shard_ring_accepted(chat_shard *shard, const int result, const bool is_last) {
+    const bool is_stopped = shard->stop.load();
+    if (is_last && !is_stopped) {
+        shard_ring_accept(shard);
+    }
+    if (result < 0) {
+        return is_stopped;
+    }
+    if (is_stopped) {
+        close(result);
+        return true;
+    }
+    chat_peer *peer = shard_new_peer(shard, result);
+    shard_ring_recv(shard, peer);
+    return true;
+}
+
+static void shard_ring_received(chat_shard *shard, chat_peer *peer, const io_uring_cqe *cqe, const bool is_last) {
+    if (is_last) {
+        --peer->ring_requests;
+        peer->is_receiving = false;
+    }
+    if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+        const auto id = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        const bool is_used = cqe->res > 0 && !peer->is_closed;
+        if (is_used) {
+            shard_peer_receive(shard, peer, chat_uring_buffer(&shard->ring, id), static_cast<size_t>(cqe->res));
+        }
+        // Back to the kernel before the parsing, which can take long
+        chat_uring_return_buffer(&shard->ring, id);
+        if (is_used) {
+            shard_peer_parse(shard, peer);
+        }
+    }
+    if (peer_ring_release(shard, peer)) {
+        return;
+    }
+    if (cqe->res == -ECANCELED && peer->is_held) {
+        return;
+    }
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        shard_remove_peer(shard, peer);
+        return;
+    }
+    // Paused, the data in the flight is kept in the input buffer till the resume
+    if (peer->is_held) {
+        if (!is_last && !peer->is_recv_cancelled) {
+            shard_ring_cancel_recv(shard, peer);
+        }
+        return;
+    }
+    // Out of buffers, or the kernel has ended the multishot by itself
+    if (is_last) {
+        shard_ring_recv(shard, peer);
+    }
+}
+
+static void shard_ring_sent(chat_shard *shard, chat_peer *peer, const int result) {
+    --peer->ring_requests;
+    peer->is_sending = false;
+    if (peer_ring_release(shard, peer)) {
+        return;
+    }
+    if (result < 0) {
+        shard_remove_peer(shard, peer);
+        return;
+    }
+    shard_consume(shard, peer, static_cast<size_t>(result));
+    shard_ring_send(shard, peer);
+}
+
+// False when the accept has failed
+static bool shard_ring_complete(chat_shard *shard, const io_uring_cqe *cqe) {
+    const auto request = static_cast<ring_request>(cqe->user_data & ring_request_mask);
+    void *object = reinterpret_cast<void *>(static_cast<uintptr_t>(cqe->user_data & ~ring_request_mask));
+    const bool is_last = (cqe->flags & IORING_CQE_F_MORE) == 0;
+    if (is_last) {
+        --shard->ring_requests;
+    }
+    switch (request) {
+    case ring_accept:
+        return shard_ring_accepted(shard, cqe->res, is_last);
+    case ring_doorbell:
+        if (!shard->stop.load()) {
+            shard_take_events(shard);
+            shard_ring_doorbell(shard);
+        }
+        return true;
+    case ring_recv:
+        shard_ring_received(shard, static_cast<chat_peer *>(object), cqe, is_last);
+        return true;
+    case ring_send:
+        shard_ring_sent(shard, static_cast<chat_peer *>(object), cqe->res);
+        return true;
+    case ring_cancel:
+        return true;
+    case ring_stats:
+        if (is_last && !shard->stop.load()) {
+            shard_ring_accept_stats(shard);
+        }
+        if (cqe->res >= 0) {
+            serve_stats(shard->server, cqe->res);
+        }
+        return true;
+    }
+    return true;
+}
+
+// Handle all the completions there are, then submit the requests they have made
+static bool shard_ring_process(chat_shard *shard, int &count) {
+    shard->now_ms = clock_ms();
+    bool is_ok = true;
+    count = 0;
+    for (io_uring_cqe *cqe = chat_uring_peek(&shard->ring); cqe != nullptr; cqe = chat_uring_peek(&shard->ring)) {
+        // The handlers submit, the entry must not be overwritten under them
+        const io_uring_cqe completion = *cqe;
+        chat_uring_advance(&shard->ring);
+        is_ok = shard_ring_complete(shard, &completion) && is_ok;
+        ++count;
+    }
+    if (count > 0) {
+        stat_add(shard->stats.wakeup_count, 1);
+        stat_add(shard->stats.event_count, static_cast<uint64_t>(count));
+    }
+    if (!shard->stop.load()) {
+        shard_expire(shard);
+        shard_flush(shard);
+    }
+    return chat_uring_enter(&shard->ring, 0, nullptr) == 0 && is_ok;
+}
+
+// The requests made in the thread of the shard, so the kernel runs their work there
+static void shard_ring_start(chat_shard *shard) {
+    shard_ring_accept(shard);
+    if (shard->doorbell >= 0) {
+        shard_ring_doorbell(shard);
+    }
+    (void)chat_uring_enter(&shard->ring, 0, nullptr);
+}
+
+// Cancel all the requests and wait for the end of each, the closed peers are deleted on the way
+static void shard_ring_stop(chat_shard *shard) {
+    shard->stop.store(true);
+    // The accept and the doorbell read end even when the kernel can't cancel them all at once
+    shutdown(shard->socket, SHUT_RDWR);
+    if (shard->stats_socket >= 0) {
+        shutdown(shard->stats_socket, SHUT_RDWR);
+    }
+    if (shard->doorbell >= 0) {
+        shard_ring(shard);
+    }
+    for (chat_peer *peer : shard->dirty_peers) {
+        peer->is_dirty = false;
+    }
+    shard->dirty_peers.clear();
+    const std::vector<chat_peer *> peers = shard->peers;
+    for (chat_peer *peer : peers) {
+        shard_remove_peer(shard, peer);
+    }
+    io_uring_sqe *sqe = shard_ring_request(shard, shard, ring_cancel);
+    if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    int count = 0;
+    while (shard->ring_requests > 0) {
+        if (chat_uring_enter(&shard->ring, 1, nullptr) != 0) {
+            break;
+        }
+        (void)shard_ring_process(shard, count);
+    }
+}
+#endif
+
+// The loop of a shard with its own thread. A failed accept doesn't stop it, the next clients can be fine
+static void shard_run(chat_shard *shard) {
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        shard_ring_start(shard);
+        int count = 0;
+        while (!shard->stop.load()) {
+            const int timeout_ms = shard_wait_ms(shard, -1);
+            timespec until {};
+            until.tv_sec = timeout_ms / 1000;
+            until.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000 * 1000;
+            if (chat_uring_enter(&shard->ring, 1, timeout_ms < 0 ? nullptr : &until) != 0 && errno != ETIME) {
+                break;
+            }
+            TRACE_INSTANT("chat ring wakeup", 0);
+            (void)shard_ring_process(shard, count);
+        }
+        shard_ring_stop(shard);
+        return;
+    }
+#endif
+    epoll_event events[64];
+    while (!shard->stop.load()) {
+        const int value = epoll_wait(shard->epoll_file_descriptor, events, 64, shard_wait_ms(shard, -1));
+        TRACE_INSTANT("chat epoll wakeup", value);
+        if (value < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        (void)shard_process(shard, events, value);
+    }
+}
+
+static int shard_start_epoll(chat_shard *shard, bool has_doorbell);
+
+// On a new socket, or on the one taken over when it is given, already listening
+static int shard_listen(chat_shard *shard, const uint16_t port, const bool is_shared, const bool has_doorbell,
+                        const int taken_socket) {
+    if (taken_socket >= 0) {
+        shard->socket = taken_socket;
+        return shard_start_epoll(shard, has_doorbell);
+    }
+    const int file_descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (file_descriptor < 0) {
+        return CHAT_ERR_SYS;
+    }
+    shard->socket = file_descriptor;
+
+    constexpr int one = 1;
+    setsockopt(file_descriptor, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // The kernel spreads the new connections between the shards
+    if (is_shared && setsockopt(file_descriptor, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    sockaddr_in address {};
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        if (errno == EADDRINUSE) {
+            return CHAT_ERR_PORT_BUSY;
+        }
+        return CHAT_ERR_SYS;
+    }
+
+    if (listen(file_descriptor, 128) != 0) {
+        return CHAT_ERR_SYS;
+    }
+
+#if CHAT_SERVER_IO_URING
+    // Without io_uring in the kernel, or when it is forbidden, the epoll does the same. The sockets stay blocking
+    // for the ring: it never blocks on them, but fails the non-blocking accepts and reads instead of waiting. The TLS
+    // handshake waits for the readiness of the sockets, and a handoff stops the loops between the events, which the
+    // ring can't do without its requests taking the data. So the TLS servers and the ones with a handoff use the epoll
+    if (shard->server->tls == nullptr && shard->server->handoff_path.empty() &&
+        chat_uring_open(&shard->ring, ring_entries, ring_buffer_count, ring_buffer_size) == 0) {
+        shard->has_ring = true;
+        if (has_doorbell) {
+            shard->doorbell = eventfd(0, EFD_CLOEXEC);
+            if (shard->doorbell < 0) {
+                return CHAT_ERR_SYS;
+            }
+        }
+        return 0;
+    }
+#endif
+    return shard_start_epoll(shard, has_doorbell);
+}
+
+static int shard_start_epoll(chat_shard *shard, const bool has_doorbell) {
+    const int file_descriptor = shard->socket;
+    if (setNonBlocking(file_descriptor) != 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    shard->epoll_file_descriptor = epoll_create1(0);
+    if (shard->epoll_file_descriptor < 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    epoll_event event {};
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = shard;    // listen socket tag
+
+    if (epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    if (!has_doorbell) {
+        return 0;
+    }
+    shard->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->doorbell < 0) {
+        return CHAT_ERR_SYS;
+    }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &shard->doorbell;
+    if (epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_ADD, shard->doorbell, &event) != 0) {
+        return CHAT_ERR_SYS;
+    }
+    return 0;
+}
+
+// The thread must be joined already
+static void shard_destroy(chat_shard *shard) {
+    // The messages in the handler pool are dropped, but the pool still rings the doorbell
+    while (shard->running_handlers.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+    for (handled_message *handled : shard->handled_messages) {
+        delete handled;
+    }
+    shard->handled_messages.clear();
+
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        // The thread of a shard stops its ring itself, so does the main one when it is started
+        if (!shard->stop.load() && shard->ring_requests > 0) {
+            shard_ring_stop(shard);
+        }
+        chat_uring_close(&shard->ring);
+    }
+#endif
+    for (chat_peer *peer : shard->peers) {
+        peer_destroy(shard, peer);
+    }
+    shard->peers.clear();
+
+    for (shard_event *event = shard->inbox.exchange(nullptr); event != nullptr;) {
+        shard_event *next = event->next;
+        delete event;
+        event = next;
+    }
+
+    if (shard->epoll_file_descriptor >= 0 && shard->socket >= 0) {
+        epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_DEL, shard->socket, nullptr);
+    }
+
+    if (shard->socket >= 0) {
+        close(shard->socket);
+    }
+    if (shard->doorbell >= 0) {
+        close(shard->doorbell);
+    }
+    if (shard->stats_socket >= 0) {
+        close(shard->stats_socket);
+    }
+    if (shard->epoll_file_descriptor >= 0) {
+        close(shard->epoll_file_descriptor);
+    }
+    delete shard;
+}
+
+// Its file goes too. In a handoff it is before the new process binds its own there
+static void server_close_handoff(chat_server *server) {
+    if (server->handoff_socket < 0) {
+        return;
+    }
+    close(server->handoff_socket);
+    server->handoff_socket = -1;
+    unlink(server->handoff_path.c_str());
+}
+
+static void server_stop_shards(chat_server *server) {
+    server_close_handoff(server);
+    for (chat_shard *shard : server->shards) {
+        if (shard->thread.joinable()) {
+            shard->stop.store(true);
+            shard_ring(shard);
+            shard->thread.join();
+        }
+    }
+    for (chat_shard *shard : server->shards) {
+        shard_destroy(shard);
+    }
+    server->shards.clear();
+    // The last frames go back to the pools
+    for (multicast_entry &entry : server->multicast.kept) {
+        entry.frame.reset();
+    }
+    server->broadcast_pools.clear();
+}
+
+chat_server *chat_server_new() {
+    return new chat_server();
+}
+
+void chat_server_delete(chat_server *server) {
+    if (server == nullptr) {
+        return;
+    }
+
+    server_stop_shards(server);
+
+    server->incoming.clear();
+    chat_tls_context_delete(server->tls);
+    if (server->multicast.socket >= 0) {
+        close(server->multicast.socket);
+    }
+
+    delete server;
+}
+
+int chat_server_set_thread_count(chat_server *server, const int thread_count) {
+    if (server == nullptr || thread_count < 1 || thread_count > max_thread_count) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    server->thread_count = thread_count;
+    return 0;
+}
+
+int chat_server_set_output_limit(chat_server *server, const size_t limit, const chat_overflow_policy policy) {
+    if (server == nullptr || policy < CHAT_OVERFLOW_DROP_OLDEST || policy > CHAT_OVERFLOW_PAUSE_SENDERS) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    server->output_limit = limit;
+    server->output_policy = policy;
+    return 0;
+}
+
+int chat_server_set_output_budget(chat_server *server, const size_t budget) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    server->output_budget = budget;
+    return 0;
+}
+
+int chat_server_set_history_size(chat_server *server, const size_t size) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    server->history_size = size;
+    return 0;
+}
+
+int chat_server_set_idle_timeout(chat_server *server, const double timeout, const double heartbeat) {
+    if (server == nullptr || timeout < 0 || heartbeat < 0) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    // Not rounded to 0, which is none
+    server->idle_timeout_ms = timeout > 0 ? std::max<uint64_t>(1, static_cast<uint64_t>(timeout * 1000.0)) : 0;
+    server->heartbeat_ms = heartbeat > 0 ? std::max<uint64_t>(1, static_cast<uint64_t>(heartbeat * 1000.0)) : 0;
+    return 0;
+}
+
+int chat_server_set_message_handler(chat_server *server, const chat_message_handler_f handler, void *arg,
+                                    thread_pool *pool) {
+    if (server == nullptr || (handler == nullptr && pool != nullptr)) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    server->message_handler = handler;
+    server->message_handler_arg = arg;
+    server->message_pool = pool;
+    return 0;
+}
+
+int chat_server_set_tls(chat_server *server, const char *certificate_file, const char *key_file) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    if (certificate_file != nullptr && !chat_tls_is_available()) {
+        return CHAT_ERR_NOT_IMPLEMENTED;
+    }
+    chat_tls_context *tls = nullptr;
+    if (certificate_file != nullptr) {
+        tls = chat_tls_server_context_new(certificate_file, key_file);
+        if (tls == nullptr) {
+            return CHAT_ERR_INVALID_ARGUMENT;
+        }
+    }
+    chat_tls_context_delete(server->tls);
+    server->tls = tls;
+    return 0;
+}
+
+int chat_server_set_multicast(chat_server *server, const char *group, const char *interface_address) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    multicast_channel &multicast = server->multicast;
+    if (multicast.socket >= 0) {
+        close(multicast.socket);
+        multicast.socket = -1;
+    }
+    if (group == nullptr) {
+        return 0;
+    }
+    std::string host;
+    std::string port;
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    in_addr interface {};
+    interface.s_addr = htonl(INADDR_ANY);
+    if (parseAddress(group, host, port) != 0 || inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(address.sin_addr.s_addr)) || port.empty() ||
+        (interface_address != nullptr && inet_pton(AF_INET, interface_address, &interface) != 1)) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    address.sin_port = htons(static_cast<uint16_t>(std::atoi(port.c_str())));
+    const int file_descriptor = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (file_descriptor < 0) {
+        return CHAT_ERR_SYS;
+    }
+    // The subscribers on the same host get it too
+    const unsigned char loop = 1;
+    if (setsockopt(file_descriptor, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0 ||
+        setsockopt(file_descriptor, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) != 0 ||
+        connect(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        const int err = errno;
+        close(file_descriptor);
+        errno = err;
+        return CHAT_ERR_SYS;
+    }
+    multicast.socket = file_descriptor;
+    multicast.group = host + ":" + port;
+    multicast.kept.assign(multicast_kept_count, multicast_entry());
+    return 0;
+}
+
+int chat_server_set_handoff(chat_server *server, const char *path) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    if (path == nullptr) {
+        server->handoff_path.clear();
+        return 0;
+    }
+    const size_t path_size = std::strlen(path);
+    if (path_size == 0 || path_size >= sizeof(sockaddr_un::sun_path)) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    server->handoff_path.assign(path, path_size);
+    return 0;
+}
+
+// The stats socket of the main shard is accepted from in its loop
+static int shard_watch_stats(chat_shard *shard) {
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        shard_ring_accept_stats(shard);
+        return chat_uring_enter(&shard->ring, 0, nullptr) == 0 ? 0 : CHAT_ERR_SYS;
+    }
+#endif
+    epoll_event event {};
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->stats_socket;
+    if (setNonBlocking(shard->stats_socket) != 0 ||
+        epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_ADD, shard->stats_socket, &event) != 0) {
+        return CHAT_ERR_SYS;
+    }
+    return 0;
+}
+
+/**
+ * A shard per thread on the port, or on the listen sockets taken over, one per shard. A taken socket is set to -1 once
+ * its shard owns it. The threads are not started yet.
+ */
+static int server_open_shards(chat_server *server, const uint16_t port, std::vector<int> *taken_sockets) {
+    const bool is_shared = server->thread_count > 1;
+    // The handler pool gives the messages back through the doorbell too
+    const bool has_doorbell = is_shared || server->message_pool != nullptr;
+    uint16_t shard_port = port;
+    for (int index = 0; index < server->thread_count; ++index) {
+        auto *shard = new chat_shard();
+        shard->server = server;
+        server->broadcast_pools.push_back(std::make_unique<broadcast_pool>());
+        shard->broadcasts = server->broadcast_pools.back().get();
+        if (server->output_budget != 0) {
+            const size_t part = server->output_budget / static_cast<size_t>(server->thread_count);
+            shard->output_budget = part > 0 ? part : 1;
+        }
+        server->shards.push_back(shard);
+        int taken_socket = -1;
+        if (taken_sockets != nullptr) {
+            std::swap(taken_socket, (*taken_sockets)[static_cast<size_t>(index)]);
+        }
+        int result = shard_listen(shard, shard_port, is_shared, has_doorbell, taken_socket);
+#if CHAT_SERVER_IO_URING
+        if (result == 0 && index == 0 && shard->has_ring) {
+            shard_ring_start(shard);
+        }
+#endif
+        if (result == 0 && shard_port == 0 && taken_socket < 0) {
+            // The others join the port the system has picked
+            sockaddr_in address {};
+            socklen_t address_length = sizeof(address);
+            if (getsockname(shard->socket, reinterpret_cast<sockaddr *>(&address), &address_length) != 0) {
+                result = CHAT_ERR_SYS;
+            }
+            shard_port = ntohs(address.sin_port);
+        }
+        if (result != 0) {
+            const int err = errno;
+            server_stop_shards(server);
+            errno = err;
+            return result;
+        }
+    }
+    return 0;
+}
+
+static void server_start_threads(chat_server *server) {
+    for (size_t index = 1; index < server->shards.size(); ++index) {
+        chat_shard *shard = server->shards[index];
+        shard->stop.store(false);
+        shard->thread = std::thread(shard_run, shard);
+    }
+}
+
+// The UNIX socket of the handoff, watched by the main shard. A file left by a process gone is replaced
+static int server_open_handoff(chat_server *server) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, server->handoff_path.data(), server->handoff_path.size());
+    const int file_descriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (file_descriptor < 0) {
+        return CHAT_ERR_SYS;
+    }
+    unlink(server->handoff_path.c_str());
+    if (bind(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(file_descriptor, 1) != 0) {
+        const int err = errno;
+        close(file_descriptor);
+        errno = err;
+        return CHAT_ERR_SYS;
+    }
+    server->handoff_socket = file_descriptor;
+
+    epoll_event event {};
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &server->handoff_socket;
+    if (epoll_ctl(server->shards.front()->epoll_file_descriptor, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
+        return CHAT_ERR_SYS;
+    }
+    return 0;
+}
+
+int chat_server_listen(chat_server *server, const uint16_t port) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+
+    int result = server_open_shards(server, port, nullptr);
+    if (result == 0 && !server->handoff_path.empty()) {
+        result = server_open_handoff(server);
+        if (result != 0) {
+            const int err = errno;
+            server_stop_shards(server);
+            errno = err;
+        }
+    }
+    if (result != 0) {
+        return result;
+    }
+    server_start_threads(server);
+
+    server->admin_feed_buffer.clear();
+    return 0;
+}
+
+/**
+ * The hot restart. A new process connects to the handoff socket of the running one, which stops its loops and sends
+ * the listen sockets, the stats one and the sockets of the peers by SCM_RIGHTS, with what the peers have in their
+ * buffers. Then the old one closes its copies, and the new one goes on with the same connections. The state is a blob
+ * of varints and length-prefixed strings after a header of its size and the count of the descriptors, cut into the
+ * packets of the socket. A packet with descriptors and no data left has one byte of padding.
+ */
+
+static void append_bytes(std::string &buffer, const std::string_view bytes) {
+    appendVarint(buffer, bytes.size());
+    buffer.append(bytes);
+}
+
+// The fields of the blob in order, false past its end
+struct handoff_reader {
+    std::string_view data;
+
+    bool number(uint64_t &out) {
+        const size_t size = readVarint(data.data(), data.size(), out);
+        data.remove_prefix(size);
+        return size != 0;
+    }
+    bool bytes(std::string_view &out) {
+        uint64_t size = 0;
+        if (!number(size) || size > data.size()) {
+            return false;
+        }
+        out = data.substr(0, size);
+        data.remove_prefix(size);
+        return true;
+    }
+};
 
-    delete peer;
-}
+// A peer as the old process has sent it
+struct handoff_peer {
+    uint64_t shard_index = 0;
+    uint64_t room_id = common_room;
+    uint64_t author_id = 0;
+    uint64_t multicast_id = 0;
+    uint64_t flags = 0;
+    std::string_view author;
+    // A byte per author id, whether the peer has got its definition
+    std::string_view known_authors;
+    std::string_view input;
+    std::string_view output;
+};
 
-static void server_remove_peer(chat_server *server, const chat_peer *peer) {
-    for (size_t index = 0; index < server->peers.size(); ++index) {
-        if (server->peers[index] == peer) {
-            server->peers[index] = server->peers.back();
-            server->peers.pop_back();
-            break;
-        }
-    }
-    peer_destroy(server, peer);
-}
+enum handoff_flag {
+    HANDOFF_HAS_AUTHOR = 1,
+    HANDOFF_IS_COMPACT = 2,
+    HANDOFF_HAS_FRAMES = 4,
+};
 
-static bool peer_flush(chat_peer *peer) {
-    while (peer->socket >= 0 && peer->out_offset < peer->out_buffer.size()) {
-        const size_t left = peer->out_buffer.size() - peer->out_offset;
-        const ssize_t value = send(peer->socket, peer->out_buffer.data() + peer->out_offset, left, MSG_NOSIGNAL);
-        if (value > 0) {
-            peer->out_offset += static_cast<size_t>(value);
-            continue;
-        }
-        if (value == 0) {
-            break;
-        }
-        if (errno == EINTR) {
-            continue;
-        }
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return true;
-        }
-        return false;
+constexpr size_t handoff_header_size = 8;
+
+/**
+ * The state of the stopped shards, and the messages not popped yet, for the new process to pop. The peers in the
+ * middle of the TLS handshake or with the compression are not sent, their state is in the libraries. They are closed
+ * with the old process and connect again.
+ */
+static void server_save(const chat_server *server, std::string &blob, std::vector<int> &descriptors) {
+    blob.assign(handoff_header_size, '\0');
+    const chat_shard *main = server->shards.front();
+    appendVarint(blob, handoff_version);
+    appendVarint(blob, server->shards.size());
+    appendVarint(blob, main->stats_socket >= 0 ? 1 : 0);
+    for (const chat_shard *shard : server->shards) {
+        descriptors.push_back(shard->socket);
     }
-    if (peer->out_offset >= peer->out_buffer.size()) {
-        peer->out_buffer.clear();
-        peer->out_offset = 0;
+    if (main->stats_socket >= 0) {
+        descriptors.push_back(main->stats_socket);
     }
-    return true;
-}
 
-static void peer_enqueue_and_try_flush(chat_peer *peer, const std::string_view author, const std::string_view data) {
-    enqueueFrame(peer->out_buffer, author, data);
-    (void)peer_flush(peer);
-}
+    // By id, the compact peers know them so
+    appendVarint(blob, server->author_names.size() - 1);
+    for (size_t author_id = 1; author_id < server->author_names.size(); ++author_id) {
+        append_bytes(blob, server->author_names[author_id]);
+    }
+    appendVarint(blob, server->room_ids.size());
+    for (const auto &room : server->room_ids) {
+        append_bytes(blob, room.first);
+        appendVarint(blob, room.second);
+    }
+    appendVarint(blob, server->feed_author_id);
+    appendVarint(blob, server->multicast.next_sequence);
+    appendVarint(blob, server->multicast.next_subscriber_id.load());
+    const message_queue &incoming = server->incoming;
+    appendVarint(blob, incoming.entries.size() - incoming.head);
+    size_t arena_offset = incoming.arena_offset;
+    for (size_t index = incoming.head; index < incoming.entries.size(); ++index) {
+        const message_queue::entry &item = incoming.entries[index];
+        const std::string_view arena(incoming.arena);
+        append_bytes(blob, arena.substr(arena_offset, item.author_size));
+        append_bytes(blob, arena.substr(arena_offset + item.author_size, item.data_size));
+        arena_offset += item.author_size + item.data_size;
+    }
 
-static bool server_accept_pending(chat_server *server) {
-    while (true) {
-        sockaddr_in address {};
-        socklen_t address_length = sizeof(address);
-        const int file_descriptor = accept(server->socket, reinterpret_cast<sockaddr *>(&address), &address_length);
-        if (file_descriptor < 0) {
-            if (errno == EINTR) {
+    size_t peer_count = 0;
+    std::string peers;
+    std::string output;
+    for (size_t shard_index = 0; shard_index < server->shards.size(); ++shard_index) {
+        for (chat_peer *peer : server->shards[shard_index]->peers) {
+            if (peer->tls != nullptr || peer->deflate != nullptr || peer->inflate != nullptr || peer->is_dropped) {
                 continue;
             }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                break;
+            ++peer_count;
+            descriptors.push_back(peer->socket);
+            appendVarint(peers, shard_index);
+            appendVarint(peers, peer->room_id);
+            appendVarint(peers, peer->author_id);
+            appendVarint(peers, peer->multicast_id);
+            const int flags = (peer->has_author ? HANDOFF_HAS_AUTHOR : 0) | (peer->is_compact ? HANDOFF_IS_COMPACT : 0) |
+                              (peer->has_frames ? HANDOFF_HAS_FRAMES : 0);
+            appendVarint(peers, static_cast<uint64_t>(flags));
+            append_bytes(peers, peer->author);
+            appendVarint(peers, peer->known_authors.size());
+            for (const bool is_known : peer->known_authors) {
+                peers.push_back(is_known ? 1 : 0);
             }
-            return false;
-        }
-
-        if (setNonBlocking(file_descriptor) != 0) {
-            close(file_descriptor);
-            return false;
+            append_bytes(peers, std::string_view(peer->input.buffer).substr(peer->input.offset,
+                                                                            peer->input.size - peer->input.offset));
+            // The frames as one, from the unsent part of the front one
+            output.clear();
+            for (const out_frame &frame : peer->out_frames) {
+                output.append(std::string_view(*frame.frame).substr(frame.offset));
+            }
+            append_bytes(peers, output);
         }
+    }
+    appendVarint(blob, peer_count);
+    blob.append(peers);
 
-        auto *peer = new chat_peer();
-        peer->socket = file_descriptor;
-        server->peers.push_back(peer);
-
-        epoll_event event {};
-        std::memset(&event, 0, sizeof(event));
-        event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
-        event.data.ptr = peer;
+    std::string header;
+    appendU32(header, static_cast<uint32_t>(blob.size()));
+    appendU32(header, static_cast<uint32_t>(descriptors.size()));
+    blob.replace(0, handoff_header_size, header);
+}
 
-        if (epoll_ctl(server->epoll_file_descriptor, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
-            server_remove_peer(server, peer);
+static bool handoff_send(const int connection, const std::string &blob, const std::vector<int> &descriptors) {
+    size_t sent = 0;
+    size_t sent_descriptors = 0;
+    char padding = 0;
+    while (sent < blob.size() || sent_descriptors < descriptors.size()) {
+        const size_t size = std::min(blob.size() - sent, handoff_packet_size);
+        const size_t count = std::min(descriptors.size() - sent_descriptors, handoff_descriptor_count);
+        iovec vector {size > 0 ? const_cast<char *>(blob.data() + sent) : &padding, size > 0 ? size : 1};
+        msghdr message {};
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(handoff_descriptor_count * sizeof(int))];
+        if (count > 0) {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+            cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(count * sizeof(int));
+            std::memcpy(CMSG_DATA(header), descriptors.data() + sent_descriptors, count * sizeof(int));
+        }
+        if (sendmsg(connection, &message, MSG_NOSIGNAL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
         }
+        sent += size;
+        sent_descriptors += count;
     }
     return true;
 }
 
-static void server_broadcast(const chat_server *server, const chat_peer *sender, const std::string_view author,
-                             const std::string_view data) {
-    for (chat_peer *peer : server->peers) {
-        if (sender != nullptr && peer == sender) {
+// The descriptors are close-on-exec. The ones received are in the array even on a failure, for the caller to close
+static bool handoff_receive(const int connection, std::string &blob, std::vector<int> &descriptors) {
+    std::string packet(handoff_packet_size, '\0');
+    bool has_header = false;
+    uint32_t size = handoff_header_size;
+    uint32_t count = 0;
+    while (blob.size() < size || descriptors.size() < count) {
+        iovec vector {packet.data(), packet.size()};
+        msghdr message {};
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(handoff_descriptor_count * sizeof(int))];
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        const ssize_t value = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+        if (value < 0 && errno == EINTR) {
             continue;
         }
-        peer_enqueue_and_try_flush(peer, author, data);
-    }
-}
-
-static bool server_peer_read(chat_server *server, chat_peer *peer) {
-    char temporary[64 * 1024];
-    while (true) {
-        const ssize_t value = recv(peer->socket, temporary, sizeof(temporary), 0);
-        if (value > 0) {
-            peer->input.buffer.append(temporary, static_cast<size_t>(value));
-
-            std::string parsed_author;
-            std::string parsed_data;
-            while (peer->input.try_pop(parsed_author, parsed_data)) {
-                // Handshake: author only, empty data
-                if (!peer->has_author && !parsed_author.empty() && parsed_data.empty()) {
-                    peer->author = std::move(parsed_author);
-                    peer->has_author = true;
-                    parsed_author.clear();
-                    parsed_data.clear();
-                    continue;
-                }
-
-                if (parsed_data.empty()) {
-                    parsed_author.clear();
-                    parsed_data.clear();
-                    continue;
-                }
-
-                auto message = new chat_message();
-                message->author = peer->has_author ? peer->author : std::string();
-                message->data = std::move(parsed_data);
-                server->incoming.push_back(message);
-
-                const std::string_view author = peer->has_author ? std::string_view(peer->author) : std::string_view();
-                server_broadcast(server, peer, author, message->data);
-
-                parsed_author.clear();
-                parsed_data.clear();
+        if (value <= 0) {
+            // Closed by the old process in the middle
+            if (value == 0) {
+                errno = EPIPE;
             }
-            continue;
+            return false;
         }
-        if (value == 0) {
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            const size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t index = 0; index < received; ++index) {
+                int descriptor = -1;
+                std::memcpy(&descriptor, CMSG_DATA(header) + index * sizeof(int), sizeof(int));
+                descriptors.push_back(descriptor);
+            }
+        }
+        if ((message.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) != 0) {
+            errno = EPROTO;
             return false;
         }
-        if (errno == EINTR) {
-            continue;
+        const size_t data_size = static_cast<size_t>(value);
+        blob.append(packet.data(), has_header ? std::min<size_t>(data_size, size - blob.size()) : data_size);
+        if (!has_header && blob.size() >= handoff_header_size) {
+            readU32(blob.data(), size);
+            readU32(blob.data() + 4, count);
+            has_header = true;
         }
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            break;
+        if (!has_header || blob.size() > size || descriptors.size() > count) {
+            errno = EPROTO;
+            return false;
         }
-        return false;
     }
     return true;
 }
 
-chat_server *chat_server_new() {
-    return new chat_server();
-}
-
-void chat_server_delete(chat_server *server) {
-    if (server == nullptr) {
-        return;
+/**
+ * Stop the other loops, broadcast what the handler pool and the inboxes still have, and send it all. The shards are
+ * destroyed after a success. After a failure the loops go on as before
+ */
+static bool server_hand_off(chat_server *server, const int connection) {
+    for (size_t index = 1; index < server->shards.size(); ++index) {
+        chat_shard *shard = server->shards[index];
+        shard->stop.store(true);
+        shard_ring(shard);
+        shard->thread.join();
     }
-
-    while (!server->incoming.empty()) {
-        delete server->incoming.front();
-        server->incoming.pop_front();
+    for (chat_shard *shard : server->shards) {
+        while (shard->running_handlers.load(std::memory_order_acquire) > 0) {
+            std::this_thread::yield();
+        }
+        shard->now_ms = clock_ms();
+        shard_take_handled(shard);
     }
-
-    for (const chat_peer *peer : server->peers) {
-        peer_destroy(server, peer);
+    // Only sends, the input is not read anymore
+    for (chat_shard *shard : server->shards) {
+        shard_take_events(shard);
+        shard_flush_dirty(shard);
     }
-    server->peers.clear();
 
-    if (server->epoll_file_descriptor >= 0 && server->socket >= 0) {
-        epoll_ctl(server->epoll_file_descriptor, EPOLL_CTL_DEL, server->socket, nullptr);
+    std::string blob;
+    std::vector<int> descriptors;
+    server_save(server, blob, descriptors);
+    // The path is free for the new process once it has got all
+    server_close_handoff(server);
+    if (handoff_send(connection, blob, descriptors)) {
+        server_stop_shards(server);
+        // Popped from the new one
+        server->incoming.clear();
+        return true;
     }
+    (void)server_open_handoff(server);
+    server_start_threads(server);
+    return false;
+}
 
-    if (server->socket >= 0) {
-        close(server->socket);
+// Only a process of the same user takes the server over
+static bool server_accept_handoff(chat_server *server) {
+    const int connection = accept4(server->handoff_socket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0) {
+        return false;
     }
-    if (server->epoll_file_descriptor >= 0) {
-        close(server->epoll_file_descriptor);
+    ucred credentials {};
+    socklen_t credentials_size = sizeof(credentials);
+    timeval timeout {};
+    timeout.tv_sec = handoff_timeout_s;
+    bool is_done = false;
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) == 0 &&
+        credentials.uid == geteuid() &&
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0) {
+        is_done = server_hand_off(server, connection);
     }
-
-    delete server;
+    close(connection);
+    return is_done;
 }
 
-int chat_server_listen(chat_server *server, const uint16_t port) {
-    if (server == nullptr) {
-        return CHAT_ERR_INVALID_ARGUMENT;
+// A peer of the old process, with its buffers as they were. The data in its socket is read on the first event
+static void shard_adopt_peer(chat_shard *shard, const int socket, const handoff_peer &state) {
+    chat_peer *peer = shard_new_peer(shard, socket);
+    if (state.room_id != common_room) {
+        shard_join_room(shard, peer, static_cast<uint32_t>(state.room_id));
     }
-    if (server->socket >= 0) {
-        return CHAT_ERR_ALREADY_STARTED;
+    peer->author.assign(state.author);
+    peer->has_author = (state.flags & HANDOFF_HAS_AUTHOR) != 0;
+    peer->author_id = static_cast<uint32_t>(state.author_id);
+    peer->multicast_id = static_cast<uint32_t>(state.multicast_id);
+    peer->is_compact = (state.flags & HANDOFF_IS_COMPACT) != 0;
+    peer->has_frames = (state.flags & HANDOFF_HAS_FRAMES) != 0;
+    peer->known_authors.resize(state.known_authors.size());
+    for (size_t author_id = 0; author_id < state.known_authors.size(); ++author_id) {
+        peer->known_authors[author_id] = state.known_authors[author_id] != 0;
     }
-
-    const int file_descriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (file_descriptor < 0) {
-        return CHAT_ERR_SYS;
+    size_t space = 0;
+    std::memcpy(peer->input.reserve(state.input.size(), space), state.input.data(), state.input.size());
+    peer->input.commit(state.input.size());
+    if (!state.output.empty()) {
+        // Never dropped, it can start in the middle of a frame
+        shared_frame output = shard_new_frame(shard);
+        output.buffer().assign(state.output);
+        shard_enqueue(shard, peer, output, true);
     }
 
-    constexpr int one = 1;
-    setsockopt(file_descriptor, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    epoll_event event {};
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    event.data.ptr = peer;
+    if (epoll_ctl(shard->epoll_file_descriptor, EPOLL_CTL_ADD, socket, &event) != 0) {
+        shard_drop_peer(shard, peer);
+        return;
+    }
+    shard_peer_parse(shard, peer);
+}
 
-    sockaddr_in address {};
-    std::memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
+static bool handoff_read_peer(handoff_reader &reader, handoff_peer &peer) {
+    uint64_t known_count = 0;
+    if (!reader.number(peer.shard_index) || !reader.number(peer.room_id) || !reader.number(peer.author_id) ||
+        !reader.number(peer.multicast_id) || !reader.number(peer.flags) || !reader.bytes(peer.author) ||
+        !reader.number(known_count) || known_count > reader.data.size()) {
+        return false;
+    }
+    peer.known_authors = reader.data.substr(0, known_count);
+    reader.data.remove_prefix(known_count);
+    return reader.bytes(peer.input) && reader.bytes(peer.output) && peer.room_id < max_room_count;
+}
 
-    if (bind(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
-        const int err = errno;
-        close(file_descriptor);
-        if (err == EADDRINUSE) {
-            return CHAT_ERR_PORT_BUSY;
+/**
+ * The shards on the taken sockets, and the peers in them. The descriptors the server owns are set to -1 in the array.
+ * Fails with EPROTO in errno on a blob which doesn't parse
+ */
+static int server_restore(chat_server *server, const std::string &blob, std::vector<int> &descriptors) {
+    handoff_reader reader {std::string_view(blob).substr(handoff_header_size)};
+    uint64_t version = 0;
+    uint64_t shard_count = 0;
+    uint64_t has_stats = 0;
+    uint64_t author_count = 0;
+    uint64_t room_count = 0;
+    uint64_t feed_author_id = 0;
+    uint64_t next_sequence = 0;
+    uint64_t next_subscriber_id = 0;
+    if (!reader.number(version) || version != handoff_version || !reader.number(shard_count) || shard_count == 0 ||
+        shard_count > static_cast<uint64_t>(max_thread_count) || !reader.number(has_stats) || has_stats > 1 ||
+        shard_count + has_stats > descriptors.size() || !reader.number(author_count) ||
+        author_count >= max_author_count) {
+        errno = EPROTO;
+        return CHAT_ERR_SYS;
+    }
+    server->author_ids.clear();
+    server->author_names.assign(1, std::string());
+    for (uint64_t index = 0; index < author_count; ++index) {
+        std::string_view author;
+        if (!reader.bytes(author)) {
+            errno = EPROTO;
+            return CHAT_ERR_SYS;
         }
+        server->author_names.emplace_back(author);
+        server->author_ids.emplace(author, static_cast<uint32_t>(index + 1));
+    }
+    server->room_ids.clear();
+    if (!reader.number(room_count)) {
+        errno = EPROTO;
         return CHAT_ERR_SYS;
     }
-
-    if (listen(file_descriptor, 128) != 0) {
-        close(file_descriptor);
+    for (uint64_t index = 0; index < room_count; ++index) {
+        std::string_view room;
+        uint64_t room_id = 0;
+        if (!reader.bytes(room) || !reader.number(room_id) || room_id >= max_room_count) {
+            errno = EPROTO;
+            return CHAT_ERR_SYS;
+        }
+        server->room_ids.emplace(room, static_cast<uint32_t>(room_id));
+    }
+    if (!reader.number(feed_author_id) || !reader.number(next_sequence) || !reader.number(next_subscriber_id)) {
+        errno = EPROTO;
         return CHAT_ERR_SYS;
     }
-
-    if (setNonBlocking(file_descriptor) != 0) {
-        close(file_descriptor);
+    server->feed_author_id = static_cast<uint32_t>(feed_author_id);
+    server->multicast.next_sequence = next_sequence;
+    server->multicast.next_subscriber_id.store(static_cast<uint32_t>(next_subscriber_id));
+    uint64_t message_count = 0;
+    if (!reader.number(message_count)) {
+        errno = EPROTO;
         return CHAT_ERR_SYS;
     }
+    for (uint64_t index = 0; index < message_count; ++index) {
+        std::string_view author;
+        std::string_view data;
+        if (!reader.bytes(author) || !reader.bytes(data)) {
+            errno = EPROTO;
+            return CHAT_ERR_SYS;
+        }
+        server->incoming.push(author, data);
+    }
 
-    const int efd = epoll_create1(0);
-    if (efd < 0) {
-        close(file_descriptor);
-        return CHAT_ERR_SYS;
+    server->thread_count = static_cast<int>(shard_count);
+    int result = server_open_shards(server, 0, &descriptors);
+    if (result != 0) {
+        return result;
+    }
+    chat_shard *main = server->shards.front();
+    if (has_stats != 0) {
+        std::swap(main->stats_socket, descriptors[shard_count]);
+        result = shard_watch_stats(main);
     }
 
-    epoll_event event {};
-    std::memset(&event, 0, sizeof(event));
-    event.events = EPOLLIN | EPOLLET;
-    event.data.ptr = server;    // listen socket tag
+    const uint64_t now_ms = clock_ms();
+    for (chat_shard *shard : server->shards) {
+        shard->now_ms = now_ms;
+    }
+    uint64_t peer_count = 0;
+    if (result == 0 && !reader.number(peer_count)) {
+        errno = EPROTO;
+        result = CHAT_ERR_SYS;
+    }
+    size_t next_descriptor = shard_count + has_stats;
+    for (uint64_t index = 0; result == 0 && index < peer_count; ++index) {
+        handoff_peer peer;
+        if (!handoff_read_peer(reader, peer) || peer.shard_index >= shard_count ||
+            next_descriptor >= descriptors.size()) {
+            errno = EPROTO;
+            result = CHAT_ERR_SYS;
+            break;
+        }
+        int socket = -1;
+        std::swap(socket, descriptors[next_descriptor++]);
+        shard_adopt_peer(server->shards[peer.shard_index], socket, peer);
+    }
+    if (result == 0 && !server->handoff_path.empty()) {
+        result = server_open_handoff(server);
+    }
+    if (result != 0) {
+        const int err = errno;
+        server_stop_shards(server);
+        errno = err;
+        return result;
+    }
+    // The output of the peers goes right away, the messages of their input are broadcast already
+    for (chat_shard *shard : server->shards) {
+        shard_flush(shard);
+    }
+    server_start_threads(server);
+    return 0;
+}
 
-    if (epoll_ctl(efd, EPOLL_CTL_ADD, file_descriptor, &event) != 0) {
-        close(efd);
-        close(file_descriptor);
+int chat_server_take_over(chat_server *server, const char *path) {
+    if (server == nullptr || path == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (!server->shards.empty()) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    const size_t path_size = std::strlen(path);
+    if (path_size == 0 || path_size >= sizeof(address.sun_path)) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    std::memcpy(address.sun_path, path, path_size);
+    const int connection = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (connection < 0) {
         return CHAT_ERR_SYS;
     }
-
-    server->socket = file_descriptor;
-    server->epoll_file_descriptor = efd;
-    server->admin_feed_buffer.clear();
-    return 0;
+    timeval timeout {};
+    timeout.tv_sec = handoff_timeout_s;
+    if (setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        const int err = errno;
+        close(connection);
+        errno = err;
+        // No server to take over
+        return err == ENOENT || err == ECONNREFUSED ? CHAT_ERR_NO_ADDR : CHAT_ERR_SYS;
+    }
+    std::string blob;
+    std::vector<int> descriptors;
+    int result = handoff_receive(connection, blob, descriptors) ? 0 : CHAT_ERR_SYS;
+    int err = errno;
+    close(connection);
+    if (result == 0) {
+        result = server_restore(server, blob, descriptors);
+        err = errno;
+    }
+    for (const int descriptor : descriptors) {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+    }
+    errno = err;
+    if (result == 0) {
+        server->admin_feed_buffer.clear();
+    } else {
+        server->incoming.clear();
+    }
+    return result;
 }
 
 chat_message *chat_server_pop_next(chat_server *server) {
     if (server == nullptr) {
         return nullptr;
     }
-    if (server->incoming.empty()) {
-        return nullptr;
-    }
+    return server->incoming.pop();
+}
 
-    chat_message *message = server->incoming.front();
-    server->incoming.pop_front();
-    return message;
+int chat_server_pop_batch(chat_server *server, chat_message_view *out, const int count) {
+    if (server == nullptr || out == nullptr || count <= 0) {
+        return 0;
+    }
+    return static_cast<int>(server->incoming.pop_batch(out, static_cast<size_t>(count)));
 }
 
 int chat_server_update(chat_server *server, const double timeout) {
     if (server == nullptr) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    if (server->socket < 0 || server->epoll_file_descriptor < 0) {
+    if (server->shards.empty()) {
         return CHAT_ERR_NOT_STARTED;
     }
+    chat_shard *shard = server->shards.front();
 
     int timeout_ms = -1;
     if (timeout >= 0) {
@@ -322,10 +3306,31 @@ int chat_server_update(chat_server *server, const double timeout) {
         timeout_ms = static_cast<int>(current_ms + 0.5);
     }
 
+    // The timers of the peers can end the wait sooner
+    timeout_ms = shard_wait_ms(shard, timeout_ms);
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        timespec until {};
+        until.tv_sec = timeout_ms / 1000;
+        until.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000 * 1000;
+        if (chat_uring_enter(&shard->ring, timeout_ms == 0 ? 0 : 1, timeout_ms < 0 ? nullptr : &until) != 0 &&
+            errno != ETIME) {
+            return CHAT_ERR_SYS;
+        }
+        TRACE_INSTANT("chat ring wakeup", 0);
+        int count = 0;
+        if (!shard_ring_process(shard, count)) {
+            return CHAT_ERR_SYS;
+        }
+        return count == 0 ? CHAT_ERR_TIMEOUT : 0;
+    }
+#endif
+
     epoll_event events[64];
     int value;
     while (true) {
-        value = epoll_wait(server->epoll_file_descriptor, events, 64, timeout_ms);
+        value = epoll_wait(shard->epoll_file_descriptor, events, 64, timeout_ms);
+        TRACE_INSTANT("chat epoll wakeup", value);
         if (value < 0 && errno == EINTR) {
             continue;
         }
@@ -336,68 +3341,55 @@ int chat_server_update(chat_server *server, const double timeout) {
         return CHAT_ERR_SYS;
     }
     if (value == 0) {
+        if (shard->timer_count > 0 || shard->multicast_heartbeat_ms != 0) {
+            (void)shard_process(shard, events, 0);
+        }
         return CHAT_ERR_TIMEOUT;
     }
 
-    for (int index = 0; index < value; ++index) {
-        void *tag = events[index].data.ptr;
-        const uint32_t event = events[index].events;
-
-        if (tag == server) {
-            if (!server_accept_pending(server)) {
-                return CHAT_ERR_SYS;
-            }
-            continue;
-        }
-
-        auto *peer = static_cast<chat_peer *>(tag);
-        bool alive = true;
-
-        if ((event & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0) {
-            (void)server_peer_read(server, peer);
-            alive = false;
-        }
-
-        if (alive && (event & EPOLLIN) != 0) {
-            alive = server_peer_read(server, peer);
-        }
-        if (alive && (event & EPOLLOUT) != 0) {
-            alive = peer_flush(peer);
-        }
-        if (alive && peer->out_offset < peer->out_buffer.size()) {
-            alive = peer_flush(peer);
-        }
-
-        if (!alive) {
-            server_remove_peer(server, peer);
-        }
+    if (!shard_process(shard, events, value)) {
+        return CHAT_ERR_SYS;
     }
-
     return 0;
 }
 
 int chat_server_get_descriptor(const chat_server *server) {
-    if (server == nullptr) {
+    if (server == nullptr || server->shards.empty()) {
         return -1;
     }
-    return server->epoll_file_descriptor;
+    const chat_shard *shard = server->shards.front();
+#if CHAT_SERVER_IO_URING
+    // Readable when there are completions
+    if (shard->has_ring) {
+        return shard->ring.file_descriptor;
+    }
+#endif
+    return shard->epoll_file_descriptor;
 }
 
 int chat_server_get_socket(const chat_server *server) {
-    if (server == nullptr) {
+    if (server == nullptr || server->shards.empty()) {
         return -1;
     }
-    return server->socket;
+    return server->shards.front()->socket;
 }
 
 int chat_server_get_events(const chat_server *server) {
-    if (server == nullptr || server->socket < 0) {
+    if (server == nullptr || server->shards.empty()) {
         return 0;
     }
 
+    // The other shards send by themselves
     int mask = CHAT_EVENT_INPUT;
-    for (const chat_peer *peer : server->peers) {
-        if (peer->out_offset < peer->out_buffer.size()) {
+    const chat_shard *shard = server->shards.front();
+#if CHAT_SERVER_IO_URING
+    // The ring sends by itself too, the sends complete as input
+    if (shard->has_ring) {
+        return mask;
+    }
+#endif
+    for (const chat_peer *peer : shard->peers) {
+        if (peer_has_output(peer)) {
             mask |= CHAT_EVENT_OUTPUT;
             break;
         }
@@ -409,31 +3401,138 @@ int chat_server_feed(chat_server *server, const char *message, const uint32_t ms
     if (server == nullptr || message == nullptr) {
         return CHAT_ERR_INVALID_ARGUMENT;
     }
-    if (server->socket < 0) {
+    if (server->shards.empty()) {
         return CHAT_ERR_NOT_STARTED;
     }
+    chat_shard *shard = server->shards.front();
 
     // Must accept clients even if user never called update() yet
-    if (!server_accept_pending(server)) {
+    shard->now_ms = clock_ms();
+#if CHAT_SERVER_IO_URING
+    if (shard->has_ring) {
+        int count = 0;
+        if (chat_uring_enter(&shard->ring, 0, nullptr) != 0 || !shard_ring_process(shard, count)) {
+            return CHAT_ERR_SYS;
+        }
+    } else
+#endif
+    if (!shard_accept_pending(shard)) {
         return CHAT_ERR_SYS;
     }
 
+    // All the complete lines go to the peers as one block of frames, a single segment of each queue
     server->admin_feed_buffer.append(message, message + msg_size);
+    const std::string &buffer = server->admin_feed_buffer;
+    shared_frame block = shard_new_frame(shard);
+    uint64_t line_count = 0;
+    size_t begin = 0;
     while (true) {
-        const size_t position = server->admin_feed_buffer.find('\n');
+        const size_t position = buffer.find('\n', begin);
         if (position == std::string::npos) {
             break;
         }
 
-        const std::string_view line(server->admin_feed_buffer.data(), position);
-        std::string trimmed = trimCopy(line);
-        server->admin_feed_buffer.erase(0, position + 1);
-
-        if (trimmed.empty()) {
+        const std::string_view line = trimView(std::string_view(buffer.data() + begin, position - begin));
+        begin = position + 1;
+        if (line.empty()) {
             continue;
         }
 
-        server_broadcast(server, nullptr, std::string_view("server"), trimmed);
+        enqueueFrame(block.buffer(), std::string_view("server"), line);
+        ++line_count;
+    }
+    server->admin_feed_buffer.erase(0, begin);
+
+    if (!block->empty()) {
+        stat_add(shard->stats.broadcast_message_count, line_count);
+        if (server->feed_author_id == 0) {
+            server->feed_author_id = server_intern_author(server, "server");
+        }
+        broadcast_frames frames;
+        frames.frame = std::move(block);
+        frames.author_id = server->feed_author_id;
+        frames.room_id = all_rooms;
+        shard_broadcast_frame(shard, nullptr, frames, false);
+    }
+    shard_flush(shard);
+    return 0;
+}
+
+size_t chat_server_get_queued_size(const chat_server *server) {
+    if (server == nullptr) {
+        return 0;
+    }
+    size_t size = 0;
+    for (const chat_shard *shard : server->shards) {
+        size += shard->queued_size.load(std::memory_order_relaxed);
+    }
+    return size;
+}
+
+int chat_server_get_peer_queued_sizes(const chat_server *server, size_t *sizes, const int count) {
+    if (server == nullptr || server->shards.empty()) {
+        return 0;
+    }
+    const std::vector<chat_peer *> &peers = server->shards.front()->peers;
+    for (size_t index = 0; index < peers.size() && index < static_cast<size_t>(count); ++index) {
+        sizes[index] = peers[index]->queued_size;
+    }
+    return static_cast<int>(peers.size());
+}
+
+int chat_server_get_stats(const chat_server *server, chat_server_stats *stats) {
+    if (server == nullptr || stats == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (server->shards.empty()) {
+        return CHAT_ERR_NOT_STARTED;
     }
+    server_collect_stats(server, stats);
     return 0;
 }
+
+int chat_server_listen_stats(chat_server *server, const uint16_t port) {
+    if (server == nullptr) {
+        return CHAT_ERR_INVALID_ARGUMENT;
+    }
+    if (server->shards.empty()) {
+        return CHAT_ERR_NOT_STARTED;
+    }
+    chat_shard *shard = server->shards.front();
+    if (shard->stats_socket >= 0) {
+        return CHAT_ERR_ALREADY_STARTED;
+    }
+    const int file_descriptor = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (file_descriptor < 0) {
+        return CHAT_ERR_SYS;
+    }
+
+    constexpr int one = 1;
+    setsockopt(file_descriptor, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address {};
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    int result = 0;
+    if (bind(file_descriptor, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        result = errno == EADDRINUSE ? CHAT_ERR_PORT_BUSY : CHAT_ERR_SYS;
+    } else if (listen(file_descriptor, 16) != 0) {
+        result = CHAT_ERR_SYS;
+    }
+    if (result != 0) {
+        const int err = errno;
+        close(file_descriptor);
+        errno = err;
+        return result;
+    }
+    shard->stats_socket = file_descriptor;
+    return shard_watch_stats(shard);
+}
+
+int chat_server_get_stats_socket(const chat_server *server) {
+    if (server == nullptr || server->shards.empty()) {
+        return -1;
+    }
+    return server->shards.front()->stats_socket;
+}
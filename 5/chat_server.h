@@ -1,8 +1,64 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
+struct chat_message;
+struct chat_message_view;
+struct thread_pool;
+
+/** What happens to a client whose output queue is over the limit. */
+enum chat_overflow_policy {
+    /** Drop its oldest messages not being sent yet. */
+    CHAT_OVERFLOW_DROP_OLDEST = 1,
+    /** Disconnect it. */
+    CHAT_OVERFLOW_DISCONNECT,
+    /**
+     * Stop reading from the clients of its event loop till the queue
+     * is sent. The messages from the other loops are still queued.
+     */
+    CHAT_OVERFLOW_PAUSE_SENDERS,
+};
+
+enum {
+    /** Number of the ranges in chat_server_stats.backlog_peer_counts. */
+    CHAT_STATS_BACKLOG_BUCKET_COUNT = 9,
+};
+
+/**
+ * Counters of all the event loops of the server, since the listen. The
+ * rates are the differences of two snapshots.
+ */
+struct chat_server_stats {
+    /** Clients accepted and closed. */
+    uint64_t accepted_count;
+    uint64_t closed_count;
+    /** Messages got from the clients, and messages broadcast. */
+    uint64_t received_message_count;
+    uint64_t broadcast_message_count;
+    /** Bytes received from and sent to the clients. */
+    uint64_t received_bytes;
+    uint64_t sent_bytes;
+    /** Reads and writes which found the socket not ready. */
+    uint64_t eagain_count;
+    /** Wakeups of the loops with something to do, and the events. */
+    uint64_t wakeup_count;
+    uint64_t event_count;
+    /**
+     * Broadcasts sent as multicast datagrams, and the ones sent again
+     * over TCP for the gaps of the subscribers.
+     */
+    uint64_t multicast_count;
+    uint64_t repair_count;
+    /** Bytes queued for the clients now. */
+    uint64_t queued_bytes;
+    /**
+     * Clients by their queued bytes now: none, up to 1KB, 4KB, 16KB,
+     * 64KB, 256KB, 1MB, 4MB, and more.
+     */
+    uint64_t backlog_peer_counts[CHAT_STATS_BACKLOG_BUCKET_COUNT];
+};
 
 /**
  * Create a new chat server. No bind, no listen, just allocate and
@@ -13,6 +69,222 @@ struct chat_server *chat_server_new(void);
 /** Free all server's resources. */
 void chat_server_delete(struct chat_server *server);
 
+/**
+ * Run the server on many event loops, each with its own listen socket
+ * on the same port and its own clients. The kernel spreads the new
+ * clients between them. The loop of chat_server_update() is one of
+ * them, the others run in their own threads. All the messages are
+ * still popped from the server, and the broadcasts reach all the
+ * clients. Has to be set before chat_server_listen(), 1 by default.
+ *
+ * @param server Chat server.
+ * @param thread_count Number of the event loops.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not positive or too big count.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_thread_count(struct chat_server *server, int thread_count);
+
+/**
+ * Limit the output queued for each client. A client not reading its
+ * messages makes its queue grow with each broadcast, and the policy
+ * says what to do when it is over the limit. Has to be set before
+ * chat_server_listen(), no limit by default.
+ *
+ * @param server Chat server.
+ * @param limit Most bytes queued for one client, 0 for no limit.
+ * @param policy What to do with the client over the limit.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - unknown policy.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_output_limit(struct chat_server *server, size_t limit,
+                                 enum chat_overflow_policy policy);
+
+/**
+ * Limit the output queued for all the clients together. It is split
+ * evenly between the event loops. When a loop is over its part, the
+ * policy of chat_server_set_output_limit() is applied to its client
+ * with the biggest queue. Has to be set before chat_server_listen(),
+ * no limit by default.
+ *
+ * @param server Chat server.
+ * @param budget Most bytes queued for all the clients, 0 for no limit.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no server.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_output_budget(struct chat_server *server, size_t budget);
+
+/**
+ * Keep the last broadcasts for the clients which ask for them in the
+ * handshake, like the reconnecting ones. They are kept encoded, shared
+ * with the queues, and a client gets all of them right after the
+ * answer to its handshake. A feed of many lines is one broadcast. Has
+ * to be set before chat_server_listen(), none kept by default.
+ *
+ * @param server Chat server.
+ * @param size Most broadcasts kept, 0 for none.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no server.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_history_size(struct chat_server *server, size_t size);
+
+/**
+ * Close the clients which send nothing for the timeout, so the dead
+ * connections don't keep their memory. With a heartbeat the server
+ * pings each client silent for that long, and the clients of this
+ * library answer, so only the dead ones are closed. The deadlines are
+ * kept in a timer wheel of 100ms ticks, and the waits of the updates
+ * end at the due ticks. Has to be set before chat_server_listen(),
+ * none by default.
+ *
+ * @param server Chat server.
+ * @param timeout Seconds of silence before a client is closed, 0 for
+ *     never.
+ * @param heartbeat Seconds of silence before a client is pinged, 0 for
+ *     no pings.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative time.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_idle_timeout(struct chat_server *server, double timeout, double heartbeat);
+
+/**
+ * Work to do with each message before it is broadcast, like a filter
+ * or a store. The handler can change the data, and returns false to
+ * drop the message. In a pool it is called by many threads at once.
+ */
+typedef bool (*chat_message_handler_f)(void *arg, struct chat_message *message);
+
+/**
+ * Let a handler see each message of the clients before its broadcast.
+ * With a pool the handler runs in the pool threads, and the event
+ * loops go on meanwhile: a slow handler delays only the messages, not
+ * the other clients. Each loop gets its handled messages back through
+ * an eventfd and broadcasts them in the order they were received. A
+ * loop with too many of them in the pool stops reading its clients
+ * till they are back. Without a pool the handler runs in the loop.
+ * Has to be set before chat_server_listen(), none by default.
+ *
+ * @param server Chat server.
+ * @param handler Handler, NULL for none.
+ * @param arg Argument of the handler.
+ * @param pool Thread pool of the handler, NULL to run it in the loop.
+ *     Must outlive the server.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no server, or a pool without a
+ *       handler.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_message_handler(struct chat_server *server, chat_message_handler_f handler, void *arg,
+                                    struct thread_pool *pool);
+
+/**
+ * Send the broadcasts to the clients which ask for it by multicast,
+ * for the trusted networks: each message is sent once to the group,
+ * whatever the number of the clients, instead of a copy into each TCP
+ * stream. The datagrams are numbered, and a client asks for the ones
+ * it has missed over its TCP connection, they come back through it.
+ * The last broadcasts are kept for that. Only the clients of the
+ * common room with the classic framing get it, the others and the
+ * rooms go over TCP as before. Has to be set before
+ * chat_server_listen(), no multicast by default.
+ *
+ * @param server Chat server.
+ * @param group "<address>:<port>" of an IPv4 multicast group, NULL for
+ *     no multicast.
+ * @param interface_address IPv4 address of the interface to send from,
+ *     NULL for the one of the routing table.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not a multicast group or address.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_server_set_multicast(struct chat_server *server, const char *group, const char *interface_address);
+
+/**
+ * Encrypt the connections of the clients with TLS. The handshake is
+ * done in userspace, then the keys go into the kernel TLS of the
+ * socket, and the frames are sent and received as without it: one
+ * sendmsg() for many frames, the kernel encrypts the records on the
+ * way. A client which doesn't get the kernel TLS is closed, there is
+ * no userspace encryption of the data. The TLS server runs on epoll,
+ * not io_uring. Has to be set before chat_server_listen(), no TLS by
+ * default.
+ *
+ * @param server Chat server.
+ * @param certificate_file PEM file of the certificate chain, NULL for
+ *     no TLS.
+ * @param key_file PEM file of the private key.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the files can't be loaded.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without OpenSSL, or the
+ *       kernel has no TLS.
+ */
+int chat_server_set_tls(struct chat_server *server, const char *certificate_file, const char *key_file);
+
+/**
+ * Let a new process take the server over, for a restart without
+ * dropping the clients. The server listens on a UNIX socket at the
+ * path, and the process which calls chat_server_take_over() with it
+ * gets the listening sockets and the connections with what is queued
+ * for them, the old one stops. Only a process of the same user can
+ * take it over. The server with a handoff runs on epoll, not io_uring.
+ * Has to be set before chat_server_listen(), no handoff by default.
+ *
+ * @param server Chat server.
+ * @param path Path of the UNIX socket, an existing file is replaced.
+ *     NULL for no handoff.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the path is empty or too long.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_handoff(struct chat_server *server, const char *path);
+
+/**
+ * Take over the server listening for a handoff at the path, instead of
+ * chat_server_listen(). The new server has the port, the stats socket,
+ * the thread count, the clients and their rooms and authors of the old
+ * one, and the messages not popped from the old one yet. Not taken
+ * over are the history and the clients in the middle of the TLS
+ * handshake or with compression: they are disconnected and connect
+ * again. Once it is done, the old server has no messages to pop and
+ * its chat_server_update() returns CHAT_ERR_NOT_STARTED. The settings, and a handoff path for the next
+ * restart, are set before the call as for chat_server_listen().
+ *
+ * @param server Chat server.
+ * @param path Path of the UNIX socket of the old server.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the path is empty or too long.
+ *     - CHAT_ERR_NO_ADDR - no server at the path.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_server_take_over(struct chat_server *server, const char *path);
+
 /**
  * Try to listen for new clients on the given port.
  *
@@ -38,6 +310,19 @@ int chat_server_listen(struct chat_server *server, uint16_t port);
  */
 struct chat_message *chat_server_pop_next(struct chat_server *server);
 
+/**
+ * Pop up to count pending messages at once, without an allocation per
+ * message. The views point into the server and are valid till the next
+ * call with it.
+ *
+ * @param server Chat server.
+ * @param out Array of at least count views.
+ * @param count Most messages to pop.
+ *
+ * @retval >=0 Number of the popped messages.
+ */
+int chat_server_pop_batch(struct chat_server *server, struct chat_message_view *out, int count);
+
 /**
  * Wait for any update on any of the sockets for the given timeout
  * and do this update.
@@ -94,3 +379,62 @@ int chat_server_get_events(const struct chat_server *server);
  *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
  */
 int chat_server_feed(struct chat_server *server, const char *message, uint32_t msg_size);
+
+/**
+ * Get the bytes queued for all the clients of all the event loops.
+ */
+size_t chat_server_get_queued_size(const struct chat_server *server);
+
+/**
+ * Get the bytes queued for each client of the loop run by
+ * chat_server_update(). The clients of the other loops are only in
+ * chat_server_get_queued_size().
+ *
+ * @param server Chat server.
+ * @param sizes Array for the sizes, can be NULL when count is 0.
+ * @param count Size of the array.
+ *
+ * @return Number of the clients, can be more than count.
+ */
+int chat_server_get_peer_queued_sizes(const struct chat_server *server,
+                                      size_t *sizes, int count);
+
+/**
+ * Get the counters of the server. Can be called from the thread of
+ * chat_server_update() only, the other loops are read on the fly.
+ *
+ * @param server Chat server.
+ * @param stats Output.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no server or no output.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ */
+int chat_server_get_stats(const struct chat_server *server,
+                          struct chat_server_stats *stats);
+
+/**
+ * Serve the counters as plain text on another port: each connection
+ * gets the "name value" lines and is closed. It is served by
+ * chat_server_update().
+ *
+ * @param server Chat server.
+ * @param port Port to listen on.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ *     - CHAT_ERR_ALREADY_STARTED - the stats are served already.
+ *     - CHAT_ERR_PORT_BUSY - the port is already busy.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_server_listen_stats(struct chat_server *server, uint16_t port);
+
+/**
+ * Get the listening socket of the stats.
+ *
+ * @retval >=0 A valid descriptor.
+ * @retval -1 No descriptor.
+ */
+int chat_server_get_stats_socket(const struct chat_server *server);
@@ -1,10 +1,14 @@
 #include "chat.h"
 #include "chat_server.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -36,18 +40,114 @@ main(int argc, char **argv)
 		return -1;
 	}
 	struct chat_server *serv = chat_server_new();
-	rc = chat_server_listen(serv, port);
+	/*
+	 * With CHAT_HANDOFF=<path> the process started the same way later
+	 * takes the clients over from this one, for a restart. The first
+	 * one finds no server there and listens.
+	 */
+	const char *handoff_path = getenv("CHAT_HANDOFF");
+	rc = CHAT_ERR_NO_ADDR;
+	if (handoff_path != NULL) {
+		rc = chat_server_set_handoff(serv, handoff_path);
+		if (rc != 0) {
+			printf("Invalid handoff path\n");
+			chat_server_delete(serv);
+			return -1;
+		}
+		rc = chat_server_take_over(serv, handoff_path);
+		if (rc == 0)
+			printf("Taken over\n");
+		else if (rc != CHAT_ERR_NO_ADDR)
+			printf("Couldn't take over: %d\n", rc);
+	}
+	if (rc == CHAT_ERR_NO_ADDR)
+		rc = chat_server_listen(serv, port);
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
 		chat_server_delete(serv);
 		return -1;
 	}
-#if NEED_SERVER_FEED
 	/*
-	 * If want +5 points, then do similarly to the client_exe - create 2
-	 * pollfd objects, wait on STDIN_FILENO and on
-	 * chat_server_get_descriptor(), process events, etc.
+	 * The stats are served as text on the second port, if any. A server
+	 * taken over has the socket already.
 	 */
+	if (argc > 2 && chat_server_get_stats_socket(serv) < 0) {
+		uint16_t stats_port = 0;
+		if (port_from_str(argv[2], &stats_port) != 0) {
+			printf("Invalid stats port\n");
+			chat_server_delete(serv);
+			return -1;
+		}
+		rc = chat_server_listen_stats(serv, stats_port);
+		if (rc != 0) {
+			printf("Couldn't listen for stats: %d\n", rc);
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
+#if NEED_SERVER_FEED
+	struct pollfd poll_fds[2];
+	memset(poll_fds, 0, sizeof(poll_fds));
+
+	struct pollfd *poll_input = &poll_fds[0];
+	poll_input->fd = STDIN_FILENO;
+	poll_input->events = POLLIN;
+
+	struct pollfd *poll_server = &poll_fds[1];
+	poll_server->fd = chat_server_get_descriptor(serv);
+	assert(poll_server->fd >= 0);
+
+	const int buf_size = 1024;
+	char buf[buf_size];
+	bool is_handed_off = false;
+	while (true) {
+		poll_server->events =
+			chat_events_to_poll_events(chat_server_get_events(serv));
+		int rc = poll(poll_fds, 2, -1);
+		if (rc < 0) {
+			printf("Poll error: %d\n", errno);
+			break;
+		}
+		if (poll_input->revents != 0) {
+			poll_input->revents = 0;
+			rc = read(STDIN_FILENO, buf, buf_size - 1);
+			if (rc <= 0) {
+				/*
+				 * The end of the feed, the clients are still
+				 * served. Negative fd makes poll() skip it.
+				 */
+				poll_input->fd = -1;
+			} else {
+				rc = chat_server_feed(serv, buf, rc);
+				if (rc != 0) {
+					printf("Feed error: %d\n", rc);
+					break;
+				}
+			}
+		}
+		if (poll_server->revents != 0) {
+			poll_server->revents = 0;
+			rc = chat_server_update(serv, 0);
+			if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
+				printf("Update error: %d\n", rc);
+				break;
+			}
+			/*
+			 * Taken over by a new process. The messages got before
+			 * it are still popped.
+			 */
+			is_handed_off = chat_server_get_descriptor(serv) < 0;
+		}
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(serv)) != NULL) {
+			printf("%s: %s\n", msg->author.c_str(), msg->data.c_str());
+			delete msg;
+		}
+		if (is_handed_off) {
+			printf("Handed off\n");
+			break;
+		}
+	}
 #else
 	/*
 	 * The basic implementation without server messages. Just serving
@@ -55,6 +155,10 @@ main(int argc, char **argv)
 	 */
 	while (true) {
 		int rc = chat_server_update(serv, -1);
+		if (rc == CHAT_ERR_NOT_STARTED) {
+			printf("Handed off\n");
+			break;
+		}
 		if (rc != 0) {
 			printf("Update error: %d\n", rc);
 			break;
@@ -0,0 +1,227 @@
+#include "chat_tls.h"
+
+#ifndef CHAT_TLS
+#define CHAT_TLS 0
+#endif
+
+#if CHAT_TLS
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "chat.h"
+
+// The ciphers the kernel has, strongest last: the 128-bit ones are as safe and faster
+constexpr const char *cipher_list =
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+
+struct chat_tls_context {
+    SSL_CTX *context = nullptr;
+};
+
+struct chat_tls_session {
+    SSL *ssl = nullptr;
+};
+
+bool chat_tls_is_available() {
+    // A socket not connected yet fails the upper layer only when the kernel has it
+    static const bool is_available = [] {
+        const int file_descriptor = socket(AF_INET, SOCK_STREAM, 0);
+        if (file_descriptor < 0) {
+            return false;
+        }
+        const bool result = setsockopt(file_descriptor, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 ||
+                            errno == ENOTCONN;
+        close(file_descriptor);
+        return result;
+    }();
+    return is_available;
+}
+
+static chat_tls_context *tls_context_new(const SSL_METHOD *method) {
+    SSL_CTX *context = SSL_CTX_new(method);
+    if (context == nullptr) {
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+    if (SSL_CTX_set_cipher_list(context, cipher_list) != 1) {
+        SSL_CTX_free(context);
+        return nullptr;
+    }
+    auto *result = new chat_tls_context();
+    result->context = context;
+    return result;
+}
+
+chat_tls_context *chat_tls_server_context_new(const char *certificate_file, const char *key_file) {
+    if (certificate_file == nullptr || key_file == nullptr) {
+        return nullptr;
+    }
+    chat_tls_context *result = tls_context_new(TLS_server_method());
+    if (result == nullptr) {
+        return nullptr;
+    }
+    if (SSL_CTX_use_certificate_chain_file(result->context, certificate_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(result->context, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(result->context) != 1) {
+        ERR_clear_error();
+        chat_tls_context_delete(result);
+        return nullptr;
+    }
+    return result;
+}
+
+chat_tls_context *chat_tls_client_context_new(const char *ca_file) {
+    chat_tls_context *result = tls_context_new(TLS_client_method());
+    if (result == nullptr) {
+        return nullptr;
+    }
+    const int loaded = ca_file != nullptr ? SSL_CTX_load_verify_locations(result->context, ca_file, nullptr)
+                                          : SSL_CTX_set_default_verify_paths(result->context);
+    if (loaded != 1) {
+        ERR_clear_error();
+        chat_tls_context_delete(result);
+        return nullptr;
+    }
+    SSL_CTX_set_verify(result->context, SSL_VERIFY_PEER, nullptr);
+    return result;
+}
+
+void chat_tls_context_delete(chat_tls_context *context) {
+    if (context == nullptr) {
+        return;
+    }
+    SSL_CTX_free(context->context);
+    delete context;
+}
+
+chat_tls_session *chat_tls_session_new(chat_tls_context *context, const int socket, const std::string_view host) {
+    SSL *ssl = SSL_new(context->context);
+    if (ssl == nullptr) {
+        return nullptr;
+    }
+    // A socket BIO, the kernel TLS is set on its descriptor. It doesn't close it
+    if (SSL_set_fd(ssl, socket) != 1) {
+        SSL_free(ssl);
+        return nullptr;
+    }
+    if (SSL_is_server(ssl) == 0) {
+        const std::string name(host);
+        // An address is checked as an address, a name is also sent for the virtual hosts
+        if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name.c_str()) != 1) {
+            ERR_clear_error();
+            if (SSL_set1_host(ssl, name.c_str()) != 1 || SSL_set_tlsext_host_name(ssl, name.c_str()) != 1) {
+                SSL_free(ssl);
+                return nullptr;
+            }
+        }
+        SSL_set_connect_state(ssl);
+    } else {
+        SSL_set_accept_state(ssl);
+    }
+    auto *session = new chat_tls_session();
+    session->ssl = ssl;
+    return session;
+}
+
+void chat_tls_session_delete(chat_tls_session *session) {
+    if (session == nullptr) {
+        return;
+    }
+    // No close_notify: the connection goes on, or is closed anyway
+    SSL_free(session->ssl);
+    delete session;
+}
+
+chat_tls_status chat_tls_handshake(chat_tls_session *session, int &events) {
+    // OpenSSL writes with write(), a peer gone in the middle would kill the process with SIGPIPE. It is blocked for
+    // the step, and taken if it was raised by it
+    sigset_t pipe_set;
+    sigset_t old_set;
+    sigset_t pending_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending_set);
+    const bool was_pending = sigismember(&pending_set, SIGPIPE) == 1;
+
+    const int result = SSL_do_handshake(session->ssl);
+    const int error = result == 1 ? SSL_ERROR_NONE : SSL_get_error(session->ssl, result);
+
+    sigpending(&pending_set);
+    if (!was_pending && sigismember(&pending_set, SIGPIPE) == 1) {
+        const timespec no_wait {};
+        while (sigtimedwait(&pipe_set, nullptr, &no_wait) < 0 && errno == EINTR) {
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+
+    switch (error) {
+    case SSL_ERROR_NONE:
+        break;
+    case SSL_ERROR_WANT_READ:
+        events = CHAT_EVENT_INPUT;
+        return CHAT_TLS_AGAIN;
+    case SSL_ERROR_WANT_WRITE:
+        events = CHAT_EVENT_OUTPUT;
+        return CHAT_TLS_AGAIN;
+    default:
+        ERR_clear_error();
+        return CHAT_TLS_FAILED;
+    }
+    // OpenSSL has put the keys into the socket, if the kernel has taken them
+    if (BIO_get_ktls_send(SSL_get_wbio(session->ssl)) == 0 || BIO_get_ktls_recv(SSL_get_rbio(session->ssl)) == 0) {
+        return CHAT_TLS_FAILED;
+    }
+    return CHAT_TLS_DONE;
+}
+
+#else
+
+struct chat_tls_context {};
+struct chat_tls_session {};
+
+bool chat_tls_is_available() {
+    return false;
+}
+
+chat_tls_context *chat_tls_server_context_new(const char *, const char *) {
+    return nullptr;
+}
+
+chat_tls_context *chat_tls_client_context_new(const char *) {
+    return nullptr;
+}
+
+void chat_tls_context_delete(chat_tls_context *context) {
+    delete context;
+}
+
+chat_tls_session *chat_tls_session_new(chat_tls_context *, int, std::string_view) {
+    return nullptr;
+}
+
+void chat_tls_session_delete(chat_tls_session *session) {
+    delete session;
+}
+
+chat_tls_status chat_tls_handshake(chat_tls_session *, int &) {
+    return CHAT_TLS_FAILED;
+}
+
+#endif
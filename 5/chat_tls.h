@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+ * TLS of a connection, ended in the kernel. The handshake is done by OpenSSL on the non-blocking socket, driven by
+ * its events like any other I/O, and then the keys go into the kernel TLS of the socket for both ways. After that the
+ * socket is used as a plain one: send(), sendmsg() and recv() carry the data, the kernel encrypts and decrypts the
+ * records, and the session is deleted. Built with OpenSSL when CHAT_TLS is set, otherwise the contexts can't be
+ * created.
+ *
+ * Only TLS 1.2 with AES-GCM is negotiated: it is what the kernel takes both ways from OpenSSL 3.0, and it has no
+ * records after the handshake besides the data, which a plain recv() would fail on. A connection which doesn't get
+ * the kernel TLS fails the handshake rather than going on in userspace.
+ */
+
+#include <string_view>
+
+struct chat_tls_context;
+struct chat_tls_session;
+
+enum chat_tls_status {
+    // The socket has the kernel TLS, the session can be deleted
+    CHAT_TLS_DONE,
+    // Waiting for the socket, call the handshake again on its events
+    CHAT_TLS_AGAIN,
+    CHAT_TLS_FAILED,
+};
+
+// Built in, and the kernel has the TLS of the sockets
+bool chat_tls_is_available();
+
+// The certificate chain and the private key in the PEM files. Null when they can't be loaded
+chat_tls_context *chat_tls_server_context_new(const char *certificate_file, const char *key_file);
+
+// The server certificates are checked by the CA certificates of the PEM file, or of the system when it is null
+chat_tls_context *chat_tls_client_context_new(const char *ca_file);
+
+void chat_tls_context_delete(chat_tls_context *context);
+
+// The host is checked in the certificate of the server, for the client sessions only. Null when there is no memory
+chat_tls_session *chat_tls_session_new(chat_tls_context *context, int socket, std::string_view host);
+
+// The socket stays open
+void chat_tls_session_delete(chat_tls_session *session);
+
+// The next step of the handshake. The chat_events waited for are in the events when it is CHAT_TLS_AGAIN
+chat_tls_status chat_tls_handshake(chat_tls_session *session, int &events);
@@ -0,0 +1,207 @@
+#include "chat_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+namespace {
+
+int uringSetup(const unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uringEnter(const int file_descriptor, const unsigned to_submit, const unsigned wait_count, const unsigned flags,
+               const void *arg, const size_t arg_size) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_enter, file_descriptor, to_submit, wait_count, flags, arg, arg_size));
+}
+
+int uringRegister(const int file_descriptor, const unsigned opcode, const void *arg, const unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, file_descriptor, opcode, arg, count));
+}
+
+template <typename T>
+T *ringField(void *memory, const unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(memory) + offset);
+}
+
+// Unmap and close whatever is set up. The errno is kept
+void release(chat_uring *ring) {
+    const int err = errno;
+    if (ring->buffers != nullptr) {
+        munmap(ring->buffers, static_cast<size_t>(ring->buffer_count) * ring->buffer_size);
+    }
+    if (ring->buffer_ring != nullptr) {
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+    }
+    if (ring->sqes != nullptr) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->ring_memory != nullptr) {
+        munmap(ring->ring_memory, ring->ring_memory_size);
+    }
+    if (ring->file_descriptor >= 0) {
+        close(ring->file_descriptor);
+    }
+    *ring = chat_uring();
+    errno = err;
+}
+
+void *mapAnonymous(const size_t size) {
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+}
+
+}    // namespace
+
+int chat_uring_open(chat_uring *ring, const unsigned entries, const unsigned buffer_count,
+                    const unsigned buffer_size) {
+    io_uring_params params {};
+    std::memset(&params, 0, sizeof(params));
+    // The completions of the multishot requests come in bursts, the queue is bigger than the submission one
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8;
+    ring->file_descriptor = uringSetup(entries, &params);
+    if (ring->file_descriptor < 0) {
+        *ring = chat_uring();
+        return -1;
+    }
+    // One mapping for both rings and the timeouts of the waits, the kernels without them are too old anyway
+    constexpr unsigned required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required_features) != required_features) {
+        release(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->ring_memory_size = sq_size > cq_size ? sq_size : cq_size;
+    void *memory = mmap(nullptr, ring->ring_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->file_descriptor, IORING_OFF_SQ_RING);
+    if (memory == MAP_FAILED) {
+        release(ring);
+        return -1;
+    }
+    ring->ring_memory = memory;
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    memory = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->file_descriptor, IORING_OFF_SQES);
+    if (memory == MAP_FAILED) {
+        release(ring);
+        return -1;
+    }
+    ring->sqes = static_cast<io_uring_sqe *>(memory);
+
+    ring->sq_head = ringField<unsigned>(ring->ring_memory, params.sq_off.head);
+    ring->sq_tail = ringField<unsigned>(ring->ring_memory, params.sq_off.tail);
+    ring->sq_array = ringField<unsigned>(ring->ring_memory, params.sq_off.array);
+    ring->sq_mask = *ringField<unsigned>(ring->ring_memory, params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sq_submitted_tail = ring->sq_local_tail;
+    ring->cq_head = ringField<unsigned>(ring->ring_memory, params.cq_off.head);
+    ring->cq_tail = ringField<unsigned>(ring->ring_memory, params.cq_off.tail);
+    ring->cq_mask = *ringField<unsigned>(ring->ring_memory, params.cq_off.ring_mask);
+    ring->cqes = ringField<io_uring_cqe>(ring->ring_memory, params.cq_off.cqes);
+
+    ring->buffer_count = buffer_count;
+    ring->buffer_size = buffer_size;
+    ring->buffer_ring_size = buffer_count * sizeof(io_uring_buf);
+    ring->buffer_ring = static_cast<io_uring_buf_ring *>(mapAnonymous(ring->buffer_ring_size));
+    ring->buffers = static_cast<char *>(mapAnonymous(static_cast<size_t>(buffer_count) * buffer_size));
+    if (ring->buffer_ring == nullptr || ring->buffers == nullptr) {
+        release(ring);
+        return -1;
+    }
+    io_uring_buf_reg registration {};
+    std::memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = reinterpret_cast<uint64_t>(ring->buffer_ring);
+    registration.ring_entries = buffer_count;
+    registration.bgid = chat_uring_buffer_group;
+    if (uringRegister(ring->file_descriptor, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        release(ring);
+        return -1;
+    }
+    for (unsigned id = 0; id < buffer_count; ++id) {
+        chat_uring_return_buffer(ring, static_cast<uint16_t>(id));
+    }
+    return 0;
+}
+
+void chat_uring_close(chat_uring *ring) {
+    release(ring);
+}
+
+io_uring_sqe *chat_uring_get_sqe(chat_uring *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+        const int submitted =
+            uringEnter(ring->file_descriptor, ring->sq_local_tail - ring->sq_submitted_tail, 0, 0, nullptr, 0);
+        if (submitted > 0) {
+            ring->sq_submitted_tail += static_cast<unsigned>(submitted);
+        } else if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return nullptr;
+        }
+    }
+    const unsigned index = ring->sq_local_tail & ring->sq_mask;
+    io_uring_sqe *sqe = &ring->sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->sq_local_tail;
+    return sqe;
+}
+
+int chat_uring_enter(chat_uring *ring, const unsigned wait_count, const timespec *timeout) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    io_uring_getevents_arg arg {};
+    __kernel_timespec kernel_timeout {};
+    std::memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout != nullptr) {
+        kernel_timeout.tv_sec = timeout->tv_sec;
+        kernel_timeout.tv_nsec = timeout->tv_nsec;
+        arg.ts = reinterpret_cast<uint64_t>(&kernel_timeout);
+    }
+    while (true) {
+        const int submitted = uringEnter(ring->file_descriptor, ring->sq_local_tail - ring->sq_submitted_tail,
+                                         wait_count, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (submitted >= 0) {
+            ring->sq_submitted_tail += static_cast<unsigned>(submitted);
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+io_uring_cqe *chat_uring_peek(chat_uring *ring) {
+    const unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void chat_uring_advance(chat_uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *chat_uring_buffer(chat_uring *ring, const uint16_t id) {
+    return ring->buffers + static_cast<size_t>(id) * ring->buffer_size;
+}
+
+void chat_uring_return_buffer(chat_uring *ring, const uint16_t id) {
+    const uint16_t tail = ring->buffer_ring->tail;
+    // Not bufs[], in C++ the header puts an empty struct before it and shifts it by 8 bytes
+    io_uring_buf *buffer = reinterpret_cast<io_uring_buf *>(ring->buffer_ring) + (tail & (ring->buffer_count - 1));
+    buffer->addr = reinterpret_cast<uint64_t>(chat_uring_buffer(ring, id));
+    buffer->len = ring->buffer_size;
+    buffer->bid = id;
+    __atomic_store_n(&ring->buffer_ring->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
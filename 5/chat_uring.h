@@ -0,0 +1,75 @@
+#pragma once
+
+/**
+ * A minimal io_uring on the raw system calls, for the chat server. One thread submits and reaps. It has a ring of
+ * provided buffers for the multishot receives.
+ */
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+struct chat_uring {
+    int file_descriptor = -1;
+
+    // Submission queue. The tail is local till the enter
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;
+    unsigned sq_submitted_tail = 0;
+    io_uring_sqe *sqes = nullptr;
+
+    // Completion queue
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    void *ring_memory = nullptr;
+    size_t ring_memory_size = 0;
+    size_t sqes_size = 0;
+
+    // Provided buffers, the group the receives select from
+    io_uring_buf_ring *buffer_ring = nullptr;
+    size_t buffer_ring_size = 0;
+    char *buffers = nullptr;
+    unsigned buffer_count = 0;
+    unsigned buffer_size = 0;
+};
+
+// The group id of the provided buffers
+constexpr uint16_t chat_uring_buffer_group = 0;
+
+/**
+ * Set up the ring and register buffer_count buffers (a power of 2) of buffer_size bytes.
+ * @retval 0 Success.
+ * @retval -1 Error, see errno. Nothing to close.
+ */
+int chat_uring_open(chat_uring *ring, unsigned entries, unsigned buffer_count, unsigned buffer_size);
+
+// Cancels whatever is left in the kernel
+void chat_uring_close(chat_uring *ring);
+
+// A zeroed entry to fill. When the queue is full, it is submitted first
+io_uring_sqe *chat_uring_get_sqe(chat_uring *ring);
+
+/**
+ * Submit the new entries and wait for at least wait_count completions, not longer than the timeout if it is given.
+ * With wait_count 0 it only runs the pending completions of the kernel.
+ * @retval 0 Success.
+ * @retval -1 Error, see errno. ETIME when timed out.
+ */
+int chat_uring_enter(chat_uring *ring, unsigned wait_count, const timespec *timeout);
+
+// The oldest completion, null when none. Advance to the next one after it is handled
+io_uring_cqe *chat_uring_peek(chat_uring *ring);
+void chat_uring_advance(chat_uring *ring);
+
+// The data of a provided buffer, and its return to the ring when the data is used
+char *chat_uring_buffer(chat_uring *ring, uint16_t id);
+void chat_uring_return_buffer(chat_uring *ring, uint16_t id);
@@ -0,0 +1,379 @@
+#include "chat.h"
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * The chat server again, as the coroutines of 1/libcoro.cpp instead of
+ * the callbacks of chat_server.cpp. Each connection has two of them: a
+ * reader parsing its frames and sending each message into the corobus
+ * channels of the other connections, and a writer taking the messages
+ * from its own channel and sending them. Both wait for the socket in
+ * coro_wait_fd(), on the epoll of the scheduler. The writer waits on a
+ * dup() of the socket, as only one coroutine can wait on a descriptor.
+ * A message is encoded once, the channels carry pointers to it.
+ *
+ * Only the classic framing: the handshake options are all declined,
+ * and there are no rooms, history or stats. A client whose channel is
+ * full is disconnected, like with CHAT_OVERFLOW_DISCONNECT. It is for
+ * bench_chat, to compare with the callback server on the same load:
+ *
+ *     ./coro_server 8000 &
+ *     ./bench_chat -a localhost:8000
+ *     ./server 8001 &
+ *     ./bench_chat -a localhost:8001
+ *
+ * The stacks are mmap()ed, and only the touched pages take memory. A
+ * coroutine here touches a few KB, so the stacks are 64KB by default
+ * instead of 1MB, to keep the address space and the page tables of
+ * many connections small.
+ */
+
+enum {
+	CORO_SERVER_STACK_SIZE = 64 * 1024,
+	/* Messages queued for one client. */
+	CORO_SERVER_QUEUE_SIZE = 4096,
+	/* Messages sent with one sendmsg(). */
+	CORO_SERVER_BATCH_SIZE = 64,
+	CORO_SERVER_RECV_SIZE = 16 * 1024,
+};
+
+/** An encoded frame, shared by the channels it is sent to. */
+struct coro_frame {
+	std::string data;
+	int ref_count;
+};
+
+struct coro_peer {
+	int fd = -1;
+	/* A dup() of the socket for the writer to wait on. */
+	int write_fd = -1;
+	int channel = -1;
+	/* Not sent to anymore, the reader cleans it up. */
+	bool is_closed = false;
+	bool has_author = false;
+	std::string author;
+	frame_parser input;
+	size_t index = 0;
+	struct coro *writer = NULL;
+};
+
+struct coro_server {
+	int listen_fd = -1;
+	struct coro_bus *bus = NULL;
+	std::vector<struct coro_peer *> peers;
+	/* The finished readers, joined by the reaper. */
+	std::vector<struct coro *> finished;
+	struct coro *reaper = NULL;
+};
+
+/* The coroutines run in one thread, nothing here is shared. */
+static struct coro_server server;
+
+static void
+coro_frame_unref(struct coro_frame *frame)
+{
+	if (--frame->ref_count == 0)
+		delete frame;
+}
+
+/** Stop sending to the peer, and wake up both of its coroutines. */
+static void
+coro_peer_close(struct coro_peer *peer)
+{
+	if (peer->is_closed)
+		return;
+	peer->is_closed = true;
+	shutdown(peer->fd, SHUT_RDWR);
+	struct coro_peer *last = server.peers.back();
+	last->index = peer->index;
+	server.peers[peer->index] = last;
+	server.peers.pop_back();
+}
+
+/** False when the channel is full, then the peer is to be closed. */
+static bool
+coro_peer_send(struct coro_peer *peer, struct coro_frame *frame)
+{
+	if (coro_bus_try_send_msg(server.bus, peer->channel, &frame,
+				  sizeof(frame)) != 0)
+		return false;
+	++frame->ref_count;
+	return true;
+}
+
+/** The frame goes to all the peers but the sender. */
+static void
+coro_server_broadcast(const struct coro_peer *sender, std::string_view data)
+{
+	struct coro_frame *frame = new coro_frame();
+	enqueueFrame(frame->data, sender->author, data);
+	frame->ref_count = 1;
+	std::vector<struct coro_peer *> full;
+	for (struct coro_peer *peer : server.peers) {
+		if (peer != sender && !coro_peer_send(peer, frame))
+			full.push_back(peer);
+	}
+	coro_frame_unref(frame);
+	for (struct coro_peer *peer : full)
+		coro_peer_close(peer);
+}
+
+static void
+coro_peer_parse(struct coro_peer *peer)
+{
+	std::string_view author;
+	std::string_view data;
+	while (!peer->is_closed && peer->input.try_pop(author, data)) {
+		if (!peer->has_author && !author.empty()) {
+			peer->author.assign(author);
+			peer->has_author = true;
+			if (data.empty())
+				continue;
+			/* The options offered, none is accepted. */
+			struct coro_frame *answer = new coro_frame();
+			enqueueFrame(answer->data, std::string_view(),
+				     std::string_view());
+			answer->ref_count = 1;
+			if (!coro_peer_send(peer, answer))
+				coro_peer_close(peer);
+			coro_frame_unref(answer);
+			continue;
+		}
+		if (!data.empty())
+			coro_server_broadcast(peer, data);
+	}
+}
+
+/** Send the frames, waiting for the socket when it is full. */
+static bool
+coro_peer_write(struct coro_peer *peer, struct coro_frame *const *frames,
+		int count)
+{
+	struct iovec vecs[CORO_SERVER_BATCH_SIZE];
+	for (int i = 0; i < count; ++i) {
+		vecs[i].iov_base = &frames[i]->data[0];
+		vecs[i].iov_len = frames[i]->data.size();
+	}
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vecs;
+	msg.msg_iovlen = count;
+	while (msg.msg_iovlen > 0) {
+		ssize_t rc = sendmsg(peer->write_fd, &msg, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			if (peer->is_closed ||
+			    coro_wait_fd(peer->write_fd, CORO_FD_WRITE, -1) < 0)
+				return false;
+			continue;
+		}
+		size_t sent = rc;
+		while (msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			++msg.msg_iov;
+			--msg.msg_iovlen;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base +
+						sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
+/** Ends when the reader closes the channel, or on a send error. */
+static void *
+coro_peer_writer_f(void *arg)
+{
+	struct coro_peer *peer = (struct coro_peer *)arg;
+	struct coro_bus_msg msgs[CORO_SERVER_BATCH_SIZE];
+	struct coro_frame *frames[CORO_SERVER_BATCH_SIZE];
+	while (true) {
+		int count = coro_bus_recv_msg_v(server.bus, peer->channel, msgs,
+						CORO_SERVER_BATCH_SIZE);
+		if (count < 0)
+			break;
+		for (int i = 0; i < count; ++i) {
+			memcpy(&frames[i], coro_bus_msg_data(&msgs[i]),
+			       sizeof(frames[i]));
+			coro_bus_msg_destroy(&msgs[i]);
+		}
+		bool is_ok = coro_peer_write(peer, frames, count);
+		for (int i = 0; i < count; ++i)
+			coro_frame_unref(frames[i]);
+		if (!is_ok) {
+			coro_peer_close(peer);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads the peer till the end, then frees it together with the
+ * writer, and leaves itself to the reaper.
+ */
+static void *
+coro_peer_reader_f(void *arg)
+{
+	struct coro_peer *peer = (struct coro_peer *)arg;
+	while (!peer->is_closed) {
+		size_t space = 0;
+		char *dst = peer->input.reserve(CORO_SERVER_RECV_SIZE, space);
+		ssize_t rc = recv(peer->fd, dst, space, 0);
+		if (rc > 0) {
+			peer->input.commit(rc);
+			coro_peer_parse(peer);
+			continue;
+		}
+		if (rc == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			break;
+		if (coro_wait_fd(peer->fd, CORO_FD_READ, -1) < 0)
+			break;
+	}
+	coro_peer_close(peer);
+	/* The close drops the queued messages, so they are taken before. */
+	struct coro_bus_msg msg;
+	while (coro_bus_try_recv_msg(server.bus, peer->channel, &msg) == 0) {
+		struct coro_frame *frame;
+		memcpy(&frame, coro_bus_msg_data(&msg), sizeof(frame));
+		coro_bus_msg_destroy(&msg);
+		coro_frame_unref(frame);
+	}
+	coro_bus_channel_close(server.bus, peer->channel);
+	coro_join(peer->writer);
+	close(peer->write_fd);
+	close(peer->fd);
+	delete peer;
+	server.finished.push_back(coro_this());
+	coro_wakeup(server.reaper);
+	return NULL;
+}
+
+static void *
+coro_server_reaper_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		while (!server.finished.empty()) {
+			struct coro *reader = server.finished.back();
+			server.finished.pop_back();
+			coro_join(reader);
+		}
+		coro_suspend();
+	}
+	return NULL;
+}
+
+static void *
+coro_server_acceptor_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		int fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				/* Out of descriptors, the next ones can be fine. */
+				coro_sleep(0.01);
+				continue;
+			}
+			coro_wait_fd(server.listen_fd, CORO_FD_READ, -1);
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct coro_peer *peer = new coro_peer();
+		peer->fd = fd;
+		peer->write_fd = dup(fd);
+		peer->channel = coro_bus_channel_open(server.bus,
+						      CORO_SERVER_QUEUE_SIZE);
+		if (peer->write_fd < 0) {
+			coro_bus_channel_close(server.bus, peer->channel);
+			close(fd);
+			delete peer;
+			continue;
+		}
+		peer->index = server.peers.size();
+		server.peers.push_back(peer);
+		struct coro_attr attr;
+		coro_attr_create(&attr);
+		attr.is_pooled = true;
+		peer->writer = coro_new_ex(coro_peer_writer_f, peer, &attr);
+		coro_new_ex(coro_peer_reader_f, peer, &attr);
+	}
+	return NULL;
+}
+
+static int
+coro_server_listen(uint16_t port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return -1;
+	}
+	server.listen_fd = fd;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: coro_server <port> [stack KB]\n");
+		return -1;
+	}
+	int port = atoi(argv[1]);
+	size_t stack_size = CORO_SERVER_STACK_SIZE;
+	if (argc > 2)
+		stack_size = (size_t)atoi(argv[2]) * 1024;
+	if (port <= 0 || port > UINT16_MAX || stack_size == 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	if (coro_server_listen(port) != 0) {
+		printf("Couldn't listen: %s\n", strerror(errno));
+		return -1;
+	}
+	coro_sched_init();
+	coro_sched_set_stack_size(stack_size);
+	server.bus = coro_bus_new();
+	server.reaper = coro_new(coro_server_reaper_f, NULL);
+	coro_new(coro_server_acceptor_f, NULL);
+	/* Never ends, the server is stopped by a signal. */
+	coro_sched_run();
+	return 0;
+}
@@ -0,0 +1,318 @@
+// Boost 1.74 awaitable.hpp uses std::exchange without including it.
+#include <utility>
+
+#include "chat_alloc.h"
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Compares the two ways of writing a chat peer: the callback chains of chat_server.cpp
+// and the coroutines of chat_server_coro.cpp. Each peer reads '\n'-terminated lines from
+// a socket and sends every line back as a separate shared buffer, the way a broadcast
+// reaches a peer. The other end of each socket is a plain blocking thread.
+
+using bench_socket = boost::asio::local::stream_protocol::socket;
+using bench_buf = std::shared_ptr<const std::string>;
+
+enum
+{
+	BENCH_RECV_BUF_SIZE = 16 * 1024,
+	BENCH_WRITE_BATCH = 64,
+};
+
+// Splits the complete lines off the buffer start. Returns how many bytes are consumed.
+template <typename F>
+static size_t
+bench_parse_lines(
+	const char* data,
+	size_t size,
+	F&& on_line)
+{
+	size_t begin = 0;
+	const char* end;
+	while ((end = (const char*)memchr(data + begin, '\n', size - begin)) != nullptr) {
+		size_t len = end - data - begin + 1;
+		on_line(std::make_shared<const std::string>(data + begin, len));
+		begin += len;
+	}
+	return begin;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Every step is a separate handler in the strand, like chat_server_peer. Each line is
+// posted to the peer as a new broadcast would be.
+class bench_cb_peer final : public std::enable_shared_from_this<bench_cb_peer>
+{
+public:
+	bench_cb_peer(
+		boost::asio::io_context& ioCtx,
+		bench_socket&& sock)
+		: m_strand(ioCtx)
+		, m_sock(std::move(sock)), m_in_size(0), m_is_sending(false)
+	{
+		m_in_buf.resize(BENCH_RECV_BUF_SIZE);
+	}
+
+	void
+	start()
+	{
+		boost::asio::post(m_strand, std::bind(&bench_cb_peer::priv_in_strand_recv,
+			shared_from_this()));
+	}
+
+private:
+	void
+	priv_in_strand_recv()
+	{
+		m_sock.async_read_some(boost::asio::buffer(m_in_buf.data() + m_in_size,
+			m_in_buf.size() - m_in_size), chat_make_alloc_handler(m_recv_mem,
+			boost::asio::bind_executor(m_strand, std::bind(
+				&bench_cb_peer::priv_in_strand_on_recv, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2))));
+	}
+
+	void
+	priv_in_strand_on_recv(
+		const boost::system::error_code& err,
+		size_t size)
+	{
+		if (err)
+			return;
+		m_in_size += size;
+		size_t used = bench_parse_lines(m_in_buf.data(), m_in_size, [this](bench_buf buf) {
+			boost::asio::post(m_strand, [ref = shared_from_this(), this,
+				buf = std::move(buf)]() mutable {
+				m_out_queue.emplace_back(std::move(buf));
+				priv_in_strand_send();
+			});
+		});
+		memmove(m_in_buf.data(), m_in_buf.data() + used, m_in_size - used);
+		m_in_size -= used;
+		priv_in_strand_recv();
+	}
+
+	void
+	priv_in_strand_send()
+	{
+		if (m_is_sending or m_out_queue.empty())
+			return;
+		m_out_bufs.clear();
+		for (const bench_buf& buf : m_out_queue) {
+			if (m_out_bufs.size() == BENCH_WRITE_BATCH)
+				break;
+			m_out_bufs.emplace_back(boost::asio::buffer(*buf));
+		}
+		m_is_sending = true;
+		boost::asio::async_write(m_sock, m_out_bufs, chat_make_alloc_handler(m_send_mem,
+			boost::asio::bind_executor(m_strand, std::bind(
+				&bench_cb_peer::priv_in_strand_on_send, shared_from_this(),
+				std::placeholders::_1))));
+	}
+
+	void
+	priv_in_strand_on_send(
+		const boost::system::error_code& err)
+	{
+		m_is_sending = false;
+		if (err)
+			return;
+		m_out_queue.erase(m_out_queue.begin(), m_out_queue.begin() + m_out_bufs.size());
+		priv_in_strand_send();
+	}
+
+	boost::asio::io_context::strand m_strand;
+	bench_socket m_sock;
+	std::string m_in_buf;
+	size_t m_in_size;
+	std::deque<bench_buf> m_out_queue;
+	std::vector<boost::asio::const_buffer> m_out_bufs;
+	bool m_is_sending;
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A reader and a writer coroutine like in chat_server_coro.cpp. The lines go to the
+// queue right from the reader.
+class bench_co_peer final : public std::enable_shared_from_this<bench_co_peer>
+{
+public:
+	bench_co_peer(
+		boost::asio::io_context& ioCtx,
+		bench_socket&& sock)
+		: m_strand(boost::asio::make_strand(ioCtx))
+		, m_sock(std::move(sock))
+		, m_out_signal(ioCtx, boost::asio::steady_timer::time_point::max())
+		, m_is_stopped(false)
+	{
+	}
+
+	void
+	start()
+	{
+		boost::asio::co_spawn(m_strand, priv_reader(shared_from_this()),
+			boost::asio::detached);
+		boost::asio::co_spawn(m_strand, priv_writer(shared_from_this()),
+			boost::asio::detached);
+	}
+
+private:
+	boost::asio::awaitable<void>
+	priv_reader(
+		std::shared_ptr<bench_co_peer> /* ref */)
+	{
+		std::string buf(BENCH_RECV_BUF_SIZE, 0);
+		size_t size = 0;
+		while (true) {
+			boost::system::error_code err;
+			size += co_await m_sock.async_read_some(boost::asio::buffer(
+				buf.data() + size, buf.size() - size),
+				boost::asio::redirect_error(boost::asio::use_awaitable, err));
+			if (err)
+				break;
+			size_t used = bench_parse_lines(buf.data(), size, [this](bench_buf line) {
+				m_out_queue.emplace_back(std::move(line));
+				if (m_out_queue.size() == 1)
+					m_out_signal.cancel_one();
+			});
+			memmove(buf.data(), buf.data() + used, size - used);
+			size -= used;
+		}
+		m_is_stopped = true;
+		m_out_signal.cancel();
+	}
+
+	boost::asio::awaitable<void>
+	priv_writer(
+		std::shared_ptr<bench_co_peer> /* ref */)
+	{
+		std::vector<boost::asio::const_buffer> bufs;
+		while (not m_is_stopped) {
+			boost::system::error_code err;
+			if (m_out_queue.empty()) {
+				co_await m_out_signal.async_wait(
+					boost::asio::redirect_error(boost::asio::use_awaitable, err));
+				continue;
+			}
+			bufs.clear();
+			for (const bench_buf& buf : m_out_queue) {
+				if (bufs.size() == BENCH_WRITE_BATCH)
+					break;
+				bufs.emplace_back(boost::asio::buffer(*buf));
+			}
+			co_await boost::asio::async_write(m_sock, bufs,
+				boost::asio::redirect_error(boost::asio::use_awaitable, err));
+			if (err)
+				break;
+			m_out_queue.erase(m_out_queue.begin(), m_out_queue.begin() + bufs.size());
+		}
+	}
+
+	boost::asio::strand<boost::asio::io_context::executor_type> m_strand;
+	bench_socket m_sock;
+	boost::asio::steady_timer m_out_signal;
+	std::deque<bench_buf> m_out_queue;
+	bool m_is_stopped;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The client end. Writes all the lines from one thread and reads the echo from another.
+static void
+bench_client_f(
+	int fd,
+	uint32_t msg_count,
+	uint32_t msg_size)
+{
+	std::string msg(msg_size - 1, 'x');
+	msg.push_back('\n');
+	std::thread writer([&]() {
+		std::string batch;
+		for (uint32_t i = 0; i < 64; ++i)
+			batch.append(msg);
+		for (uint32_t sent = 0; sent < msg_count; sent += 64) {
+			size_t size = std::min<size_t>(msg_count - sent, 64) * msg.size();
+			for (size_t off = 0; off < size;) {
+				ssize_t rc = ::write(fd, batch.data() + off, size - off);
+				assert(rc > 0);
+				off += rc;
+			}
+		}
+	});
+	uint64_t expected = (uint64_t)msg_count * msg_size;
+	char buf[BENCH_RECV_BUF_SIZE];
+	while (expected > 0) {
+		ssize_t rc = ::read(fd, buf, sizeof(buf));
+		assert(rc > 0);
+		expected -= rc;
+	}
+	writer.join();
+}
+
+template <typename Peer>
+static double
+bench_run(
+	uint32_t peer_count,
+	uint32_t msg_count,
+	uint32_t msg_size)
+{
+	boost::asio::io_context ioctx(1);
+	std::vector<bench_socket> clients;
+	for (uint32_t i = 0; i < peer_count; ++i) {
+		bench_socket server_sock(ioctx);
+		clients.emplace_back(ioctx);
+		boost::asio::local::connect_pair(server_sock, clients.back());
+		std::make_shared<Peer>(ioctx, std::move(server_sock))->start();
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::thread worker([&ioctx]() { ioctx.run(); });
+	std::vector<std::thread> threads;
+	for (bench_socket& c : clients)
+		threads.emplace_back(bench_client_f, c.native_handle(), msg_count, msg_size);
+	for (std::thread& t : threads)
+		t.join();
+	double sec = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	for (bench_socket& c : clients)
+		c.close();
+	worker.join();
+	return (double)peer_count * msg_count / sec;
+}
+
+int
+main(int argc, char** argv)
+{
+	uint32_t peer_count = argc > 1 ? atoi(argv[1]) : 4;
+	uint32_t msg_count = argc > 2 ? atoi(argv[2]) : 500000;
+	uint32_t msg_size = argc > 3 ? atoi(argv[3]) : 64;
+	if (peer_count == 0 || msg_count == 0 || msg_size == 0) {
+		std::cout << "Usage: bench_peer [peers] [messages per peer] [message size]\n";
+		return -1;
+	}
+	std::cout << peer_count << " peers, " << msg_count << " messages of " << msg_size
+		<< " bytes each, one io_context thread\n";
+	double cb = bench_run<bench_cb_peer>(peer_count, msg_count, msg_size);
+	std::cout << "callbacks:  " << (uint64_t)cb << " msg/s\n";
+	double co = bench_run<bench_co_peer>(peer_count, msg_count, msg_size);
+	std::cout << "coroutines: " << (uint64_t)co << " msg/s\n";
+	return 0;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <boost/asio/associated_executor.hpp>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Handler memory for one kind of async operation which never has more than one instance
+// in flight. For example, all the reads of one socket. The operation state is then
+// allocated in the same storage each time instead of on the heap.
+class chat_handler_memory final
+{
+public:
+	chat_handler_memory() : m_is_used(false) {}
+	chat_handler_memory(const chat_handler_memory&) = delete;
+	chat_handler_memory& operator=(const chat_handler_memory&) = delete;
+
+	void*
+	allocate(
+		std::size_t size)
+	{
+		if (not m_is_used and size <= sizeof(m_storage)) {
+			m_is_used = true;
+			return &m_storage;
+		}
+		// Too big or there are more operations than expected. Still must work.
+		return ::operator new(size);
+	}
+
+	void
+	deallocate(
+		void* ptr)
+	{
+		if (ptr == &m_storage) {
+			assert(m_is_used);
+			m_is_used = false;
+			return;
+		}
+		::operator delete(ptr);
+	}
+
+private:
+	std::aligned_storage_t<1024> m_storage;
+	bool m_is_used;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The allocator handed to asio via the handler's associated allocator.
+template <typename T>
+class chat_handler_allocator final
+{
+public:
+	using value_type = T;
+
+	explicit chat_handler_allocator(
+		chat_handler_memory& mem) : m_memory(&mem) {}
+
+	template <typename U>
+	chat_handler_allocator(
+		const chat_handler_allocator<U>& other) noexcept : m_memory(other.m_memory) {}
+
+	T*
+	allocate(
+		std::size_t count) const
+	{
+		return static_cast<T*>(m_memory->allocate(sizeof(T) * count));
+	}
+
+	void
+	deallocate(
+		T* ptr,
+		std::size_t /* count */) const
+	{
+		m_memory->deallocate(ptr);
+	}
+
+	bool
+	operator==(
+		const chat_handler_allocator& other) const noexcept
+	{
+		return m_memory == other.m_memory;
+	}
+
+	bool
+	operator!=(
+		const chat_handler_allocator& other) const noexcept
+	{
+		return m_memory != other.m_memory;
+	}
+
+private:
+	chat_handler_memory* m_memory;
+
+	template <typename> friend class chat_handler_allocator;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Wraps a completion handler to make asio allocate its operation in the given memory.
+// The handler's executor (like a strand from bind_executor()) is kept.
+template <typename Handler>
+class chat_alloc_handler final
+{
+public:
+	using allocator_type = chat_handler_allocator<Handler>;
+	using executor_type = boost::asio::associated_executor_t<Handler>;
+
+	chat_alloc_handler(
+		chat_handler_memory& mem,
+		Handler handler)
+		: m_memory(mem), m_handler(std::move(handler)) {}
+
+	allocator_type
+	get_allocator() const noexcept
+	{
+		return allocator_type(m_memory);
+	}
+
+	executor_type
+	get_executor() const noexcept
+	{
+		return boost::asio::get_associated_executor(m_handler);
+	}
+
+	template <typename... Args>
+	void
+	operator()(
+		Args&&... args)
+	{
+		m_handler(std::forward<Args>(args)...);
+	}
+
+private:
+	chat_handler_memory& m_memory;
+	Handler m_handler;
+};
+
+template <typename Handler>
+static inline chat_alloc_handler<std::decay_t<Handler>>
+chat_make_alloc_handler(
+	chat_handler_memory& mem,
+	Handler&& handler)
+{
+	return chat_alloc_handler<std::decay_t<Handler>>(mem, std::forward<Handler>(handler));
+}
@@ -1,4 +1,5 @@
 #include "chat.h"
+#include "chat_alloc.h"
 #include "chat_client.h"
 
 #include <boost/asio/bind_executor.hpp>
@@ -90,6 +91,10 @@ private:
 	// Output buffer for prearing the next outgoing messages.
 	std::string m_out_buf;
 
+	// Handler memory of the one read and the one write which can be in flight.
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+
 	boost::asio::ip::tcp::resolver m_resolver;
 	const std::string m_name;
 
@@ -270,9 +275,9 @@ chat_client_peer::priv_in_strand_recv()
 	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
 	// size_t size = m_in_buf.capacity() - m_in_buf.length();
 	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
+	//	chat_make_alloc_handler(m_recv_mem, boost::asio::bind_executor(m_strand,
 	//		std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	//		std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
@@ -321,9 +326,9 @@ chat_client_peer::priv_in_strand_send()
 
 	// If the buffer m_out_buf contains a complete message, then send it using
 	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
+	//	chat_make_alloc_handler(m_send_mem, boost::asio::bind_executor(m_strand,
 	//		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
+	//			std::placeholders::_1, std::placeholders::_2))));
 	//
 	// You don't have to send whole messages. Could send the parts right away if your
 	// protocol is fine with that. But you might need to send full ones if you encode them
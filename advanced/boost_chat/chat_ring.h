@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/asio/buffer.hpp>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Input buffer of a socket. Reads go right into its free space, the received lines are
+// taken out as views without moving the rest of the data. The buffer only grows when a
+// single line doesn't fit into it.
+class chat_ring_buffer final
+{
+public:
+	explicit chat_ring_buffer(
+		size_t capacity)
+		: m_head(0), m_tail(0)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size *= 2;
+		m_buf.resize(size);
+	}
+
+	// Free space as a buffer sequence for async_read_some(). The second buffer is not
+	// empty when the space wraps around the end.
+	std::array<boost::asio::mutable_buffer, 2>
+	prepare()
+	{
+		if (size() == m_buf.size())
+			priv_grow();
+		size_t cap = m_buf.size();
+		size_t tail = m_tail & (cap - 1);
+		size_t free = cap - size();
+		size_t first = std::min(free, cap - tail);
+		return {boost::asio::buffer(m_buf.data() + tail, first),
+			boost::asio::buffer(m_buf.data(), free - first)};
+	}
+
+	void
+	commit(
+		size_t size)
+	{
+		assert(size <= m_buf.size() - this->size());
+		m_tail += size;
+	}
+
+	// Takes the next '\n'-terminated line out, without the '\n'. The view is valid until
+	// the next prepare(). Only a line wrapping around the end is copied.
+	bool
+	pop_line(
+		std::string_view& line)
+	{
+		size_t cap = m_buf.size();
+		size_t head = m_head & (cap - 1);
+		size_t first = std::min(size(), cap - head);
+		const char* pos = m_buf.data() + head;
+		const char* end = (const char*)memchr(pos, '\n', first);
+		if (end != nullptr) {
+			line = std::string_view(pos, end - pos);
+			m_head += line.size() + 1;
+			return true;
+		}
+		size_t second = size() - first;
+		end = (const char*)memchr(m_buf.data(), '\n', second);
+		if (end == nullptr)
+			return false;
+		m_scratch.assign(pos, first);
+		m_scratch.append(m_buf.data(), end - m_buf.data());
+		line = m_scratch;
+		m_head += line.size() + 1;
+		return true;
+	}
+
+	size_t
+	size() const
+	{
+		return m_tail - m_head;
+	}
+
+	size_t
+	capacity() const
+	{
+		return m_buf.size();
+	}
+
+private:
+	void
+	priv_grow()
+	{
+		size_t cap = m_buf.size();
+		size_t head = m_head & (cap - 1);
+		std::vector<char> buf(cap * 2);
+		memcpy(buf.data(), m_buf.data() + head, cap - head);
+		memcpy(buf.data() + cap - head, m_buf.data(), head);
+		m_buf.swap(buf);
+		m_head = 0;
+		m_tail = cap;
+	}
+
+	std::vector<char> m_buf;
+	// Positions grow infinitely, the index in the buffer is taken with the mask.
+	size_t m_head;
+	size_t m_tail;
+	// The line which wraps around the buffer end.
+	std::string m_scratch;
+};
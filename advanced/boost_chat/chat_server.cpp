@@ -1,12 +1,17 @@
 #include "chat.h"
+#include "chat_alloc.h"
+#include "chat_ring.h"
 #include "chat_server.h"
 
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <deque>
 #include <iostream>
-#include <list>
+#include <vector>
 
 enum chat_server_state
 {
@@ -21,11 +26,14 @@ enum chat_server_peer_state
 	CHAT_SERVER_PEER_STATE_STOPPED,
 };
 
+struct chat_server_core;
+
 class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
 {
 public:
 	chat_server_peer(
 		boost::asio::ip::tcp::socket&& sock,
+		chat_server_core& core,
 		std::shared_ptr<chat_server_ctx> server);
 	~chat_server_peer();
 
@@ -36,13 +44,16 @@ public:
 	stop();
 
 	void
-	feed_async(
-		std::string_view text);
+	send_async(
+		std::shared_ptr<const std::string> buf);
+
+	void
+	resume();
 
 private:
 	void
-	priv_in_strand_on_new_feed(
-		std::string&& text);
+	priv_in_strand_on_new_buf(
+		std::shared_ptr<const std::string>&& buf);
 
 	void
 	priv_in_strand_recv();
@@ -60,31 +71,57 @@ private:
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	void
+	priv_in_strand_pause();
+
 	void
 	priv_in_strand_stop();
 
 	chat_server_peer_state m_state;
 
+	chat_server_core& m_core;
+	// Index in the core's peers. Is only touched in the core's strand.
+	size_t m_core_slot;
 	boost::asio::io_context::strand m_strand;
 	boost::asio::ip::tcp::socket m_sock;
 	std::shared_ptr<chat_server_ctx> m_server;
 
-	std::string m_in_buf;
-	std::string m_out_buf;
+	chat_ring_buffer m_in_buf;
+	// Encoded broadcasts waiting to be sent. They are shared with the other peers and
+	// must not be changed.
+	std::deque<std::shared_ptr<const std::string>> m_out_queue;
+	// The gather list of the write in progress, made of the queue head.
+	std::vector<boost::asio::const_buffer> m_out_bufs;
+	size_t m_out_size;
+	bool m_is_sending;
+	// Each socket has at most one read and one write in flight. Their handlers are
+	// allocated here, so the steady-state IO doesn't touch the heap.
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
 
 	// <YOUR CODE IF NEEDED>
 
 	friend chat_server_ctx;
 };
 
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
-struct chat_server_request final
+// A slice of the server bound to one io_context. It owns the peers accepted into it and
+// does their part of each broadcast. With one io_context per thread the cores never
+// contend with each other.
+struct chat_server_core final
 {
-	chat_server_request(
-		chat_server_on_msg_f&& cb) : m_cb(std::move(cb)) {}
+	chat_server_core(
+		boost::asio::io_context& ioCtx)
+		: m_ioctx(ioCtx), m_strand(ioCtx), m_is_stopped(false) {}
 
-	chat_server_on_msg_f m_cb;
+	boost::asio::io_context& m_ioctx;
+	boost::asio::io_context::strand m_strand;
+	// A slot map. Each peer knows its slot, so removal swaps the last peer in and the
+	// broadcast walks a contiguous array.
+	std::vector<std::shared_ptr<chat_server_peer>> m_peers;
+	bool m_is_stopped;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -93,7 +130,7 @@ class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ct
 {
 public:
 	chat_server_ctx(
-		boost::asio::io_context& ioCtx);
+		const std::vector<boost::asio::io_context*>& ioCtxs);
 	~chat_server_ctx();
 
 	chat_errcode
@@ -120,18 +157,42 @@ private:
 
 	void
 	priv_in_strand_on_accept(
+		chat_server_core* core,
 		const boost::system::error_code& err,
 		boost::asio::ip::tcp::socket sock);
 
 	void
 	priv_in_strand_stop();
 
+	void
+	priv_in_core_on_new_peer(
+		chat_server_core* core,
+		std::shared_ptr<chat_server_peer> peer);
+
+	void
+	priv_in_core_stop(
+		chat_server_core* core);
+
 	void
 	priv_in_strand_on_new_request(
-		std::unique_ptr<chat_server_request> req);
+		chat_server_on_msg_f&& cb);
+
+	bool
+	priv_is_in_queue_full() const;
+
+	void
+	priv_peer_on_pause(
+		std::shared_ptr<chat_server_peer> peer);
+
+	void
+	priv_in_strand_on_msg_taken();
+
+	void
+	priv_in_strand_resume_peers();
 
 	void
 	priv_peer_on_recv(
+		const chat_server_peer* from,
 		std::unique_ptr<chat_message> msg);
 
 	void
@@ -143,12 +204,19 @@ private:
 		std::shared_ptr<chat_server_peer> peer);
 
 	void
-	priv_in_strand_peer_on_close(
+	priv_in_core_peer_on_close(
 		std::shared_ptr<chat_server_peer> peer);
 
 	void
-	priv_in_strand_on_new_feed(
-		std::string_view text);
+	priv_broadcast(
+		std::shared_ptr<const std::string> buf,
+		const chat_server_peer* from);
+
+	void
+	priv_in_core_on_new_buf(
+		chat_server_core* core,
+		std::shared_ptr<const std::string> buf,
+		const chat_server_peer* from);
 
 	chat_server_state m_state;
 
@@ -156,10 +224,18 @@ private:
 	boost::asio::ip::tcp::acceptor m_sock;
 	uint16_t m_port;
 
-	std::list<std::shared_ptr<chat_server_peer>> m_peers;
+	// Peers are spread over the cores round-robin. Each core is touched only in its own
+	// strand, the accept and the receive-requests stay in the main one.
+	std::vector<std::unique_ptr<chat_server_core>> m_cores;
+	size_t m_next_core;
 
-	std::list<std::unique_ptr<chat_server_request>> m_reqs;
-	std::list<std::unique_ptr<chat_message>> m_in_msgs;
+	std::deque<chat_server_on_msg_f> m_reqs;
+	std::deque<std::unique_ptr<chat_message>> m_in_msgs;
+	// The messages received from the peers and not yet taken by recv_async(). Including
+	// the ones still on the way to m_in_msgs, so the peers see it right away.
+	std::atomic<size_t> m_in_msg_count;
+	// The peers which stopped receiving until m_in_msgs is drained.
+	std::vector<std::shared_ptr<chat_server_peer>> m_paused_peers;
 
 	// <YOUR CODE IF NEEDED>
 
@@ -168,9 +244,41 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+enum
+{
+	// Max number of queued buffers written by one gather write.
+	CHAT_SERVER_WRITE_BATCH = 64,
+	// The peers stop receiving when the app has that many messages not taken by
+	// recv_async() and start again when it is down to the low watermark.
+	CHAT_SERVER_IN_QUEUE_HIGH = 1024,
+	CHAT_SERVER_IN_QUEUE_LOW = CHAT_SERVER_IN_QUEUE_HIGH / 4,
+	// A peer which doesn't read its broadcasts gets disconnected when more than that
+	// many bytes are queued for it.
+	CHAT_SERVER_OUT_QUEUE_MAX_SIZE = 16 * 1024 * 1024,
+};
+
+static std::shared_ptr<const std::string>
+chat_server_encode_msg(
+	const chat_message& /* msg */)
+{
+	// <YOUR CODE IF NEEDED>
+	abort();
+
+	// Encode the author and the data the way the clients expect them. It is done once
+	// per message, the result is sent to all the peers as is.
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 chat_server::chat_server(
 	boost::asio::io_context& ioCtx)
-	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+	: chat_server(std::vector<boost::asio::io_context*>{&ioCtx})
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& ioCtxs)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtxs))
 {
 	// <YOUR CODE IF NEEDED>
 }
@@ -213,11 +321,17 @@ chat_server::feed_async(
 
 chat_server_peer::chat_server_peer(
 	boost::asio::ip::tcp::socket&& sock,
+	chat_server_core& core,
 	std::shared_ptr<chat_server_ctx> server)
 	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
-	, m_strand(sock.get_executor().context())
+	, m_core(core)
+	, m_core_slot(SIZE_MAX)
+	, m_strand(core.m_ioctx)
 	, m_sock(std::move(sock))
 	, m_server(std::move(server))
+	, m_in_buf(CHAT_RECV_BUF_SIZE)
+	, m_out_size(0)
+	, m_is_sending(false)
 {
 }
 
@@ -241,26 +355,38 @@ chat_server_peer::stop()
 }
 
 void
-chat_server_peer::feed_async(
-	std::string_view text)
+chat_server_peer::send_async(
+	std::shared_ptr<const std::string> buf)
 {
 	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		text = std::string(text)]() mutable {
-		priv_in_strand_on_new_feed(std::move(text));
+		buf = std::move(buf)]() mutable {
+		priv_in_strand_on_new_buf(std::move(buf));
 	});
 }
 
 void
-chat_server_peer::priv_in_strand_on_new_feed(
-	std::string&& /* text */)
+chat_server_peer::resume()
 {
-	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
+	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_recv,
+		shared_from_this()));
+}
 
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+void
+chat_server_peer::priv_in_strand_on_new_buf(
+	std::shared_ptr<const std::string>&& buf)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	if (m_out_size > CHAT_SERVER_OUT_QUEUE_MAX_SIZE) {
+		// Holding more would let one stuck client eat all the memory. Slowing down the
+		// senders instead would stall the whole chat. A single big message still goes.
+		priv_in_strand_stop();
+		return;
+	}
+	m_out_size += buf->size();
+	m_out_queue.emplace_back(std::move(buf));
+	priv_in_strand_send();
 }
 
 void
@@ -273,16 +399,12 @@ chat_server_peer::priv_in_strand_recv()
 	// <YOUR CODE IF NEEDED>
 	abort();
 
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
+	// 1) Receive more data right into the free space of the ring. It grows x2 itself
+	// when a message doesn't fit.
+	// m_sock.async_receive(m_in_buf.prepare(),
+	//	chat_make_alloc_handler(m_recv_mem, boost::asio::bind_executor(m_strand,
 	//		std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	//		std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
@@ -296,14 +418,16 @@ chat_server_peer::priv_in_strand_on_recv(
 	abort();
 
 	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Send each extracted one
-	// to the server: m_server->priv_peer_on_recv(msg).
+	// m_in_buf.commit(size);
 	//
-	// 3) Keep receiving infinitely.
+	// 2) Parse the buffer trying to extract complete messages. The parser works on the
+	// views from m_in_buf (like pop_line()), the bytes are copied only into the
+	// chat_message. Send each extracted one to the server:
+	// m_server->priv_peer_on_recv(this, msg).
 	//
-	// In your code you might make m_in_buf more efficient.
+	// 3) Keep receiving infinitely. Unless the app doesn't keep up with the messages:
+	// if (m_server->priv_is_in_queue_full())
+	//	priv_in_strand_pause();
 }
 
 void
@@ -312,39 +436,48 @@ chat_server_peer::priv_in_strand_send()
 	assert(m_strand.running_in_this_thread());
 	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	if (m_is_sending or m_out_queue.empty())
+		return;
+	// The queued buffers are referenced, not copied. async_write() takes care of the
+	// partial writes and completes only when everything is sent.
+	m_out_bufs.clear();
+	for (const std::shared_ptr<const std::string>& buf : m_out_queue) {
+		if (m_out_bufs.size() == CHAT_SERVER_WRITE_BATCH)
+			break;
+		m_out_bufs.emplace_back(boost::asio::buffer(*buf));
+	}
+	m_is_sending = true;
+	boost::asio::async_write(m_sock, m_out_bufs, chat_make_alloc_handler(m_send_mem,
+		boost::asio::bind_executor(m_strand, std::bind(
+			&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
+			std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
 chat_server_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
+	const boost::system::error_code& err,
 	std::size_t /* size */)
 {
 	assert(m_strand.running_in_this_thread());
+	assert(m_is_sending);
+	m_is_sending = false;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	m_out_queue.erase(m_out_queue.begin(), m_out_queue.begin() + m_out_bufs.size());
+	m_out_size -= boost::asio::buffer_size(m_out_bufs);
+	m_out_bufs.clear();
+	priv_in_strand_send();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_server_peer::priv_in_strand_pause()
+{
+	assert(m_strand.running_in_this_thread());
+	// No receive is started, the data stays in the socket and TCP slows the client
+	// down. The server calls resume() when the app drains the messages.
+	m_server->priv_peer_on_pause(shared_from_this());
 }
 
 void
@@ -353,7 +486,7 @@ chat_server_peer::priv_in_strand_stop()
 	assert(m_strand.running_in_this_thread());
 	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
 		return;
-	m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
 	m_sock.close();
 	m_server->priv_peer_on_close(shared_from_this());
 	m_server.reset();
@@ -362,11 +495,17 @@ chat_server_peer::priv_in_strand_stop()
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_ctx::chat_server_ctx(
-	boost::asio::io_context& ioCtx)
+	const std::vector<boost::asio::io_context*>& ioCtxs)
 	: m_state(CHAT_SERVER_STATE_NEW)
-	, m_strand(ioCtx)
-	, m_sock(ioCtx)
-{
+	, m_strand(*ioCtxs.front())
+	, m_sock(*ioCtxs.front())
+	, m_next_core(0)
+	, m_in_msg_count(0)
+{
+	assert(not ioCtxs.empty());
+	m_cores.reserve(ioCtxs.size());
+	for (boost::asio::io_context* ioCtx : ioCtxs)
+		m_cores.emplace_back(std::make_unique<chat_server_core>(*ioCtx));
 	// <YOUR CODE IF NEEDED>
 }
 
@@ -414,11 +553,9 @@ void
 chat_server_ctx::recv_async(
 	chat_server_on_msg_f&& cb)
 {
-	std::unique_ptr<chat_server_request> req =
-		std::make_unique<chat_server_request>(std::move(cb));
 	boost::asio::post(m_strand,
-		[ref = shared_from_this(), req = std::move(req), this]() mutable {
-		priv_in_strand_on_new_request(std::move(req));
+		[ref = shared_from_this(), cb = std::move(cb), this]() mutable {
+		priv_in_strand_on_new_request(std::move(cb));
 	});
 }
 
@@ -426,8 +563,11 @@ void
 chat_server_ctx::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_ctx::priv_in_strand_on_new_feed,
-		shared_from_this(), std::string(text)));
+	// <YOUR CODE IF NEEDED>
+	//
+	// The text goes to the peers as is. If the protocol needs the feeds encoded, do it
+	// here, once for all the peers.
+	priv_broadcast(std::make_shared<const std::string>(text), nullptr);
 }
 
 void
@@ -435,13 +575,18 @@ chat_server_ctx::priv_in_strand_accept()
 {
 	assert(m_strand.running_in_this_thread());
 	assert(m_state == CHAT_SERVER_STATE_LISTEN);
-	m_sock.async_accept(boost::asio::bind_executor(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
+	// The socket is accepted right into the io_context of the next core, so all its
+	// IO is done by that core's thread.
+	chat_server_core* core = m_cores[m_next_core].get();
+	m_next_core = (m_next_core + 1) % m_cores.size();
+	m_sock.async_accept(core->m_ioctx, boost::asio::bind_executor(m_strand, std::bind(
+		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(), core,
 		std::placeholders::_1, std::placeholders::_2)));
 }
 
 void
 chat_server_ctx::priv_in_strand_on_accept(
+	chat_server_core* core,
 	const boost::system::error_code& err,
 	boost::asio::ip::tcp::socket sock)
 {
@@ -456,9 +601,10 @@ chat_server_ctx::priv_in_strand_on_accept(
 		return;
 	}
 	std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
-		std::move(sock), shared_from_this());
-	peer->start();
-	m_peers.emplace_back(std::move(peer));
+		std::move(sock), *core, shared_from_this());
+	boost::asio::post(core->m_strand, std::bind(
+		&chat_server_ctx::priv_in_core_on_new_peer, shared_from_this(), core,
+		std::move(peer)));
 	priv_in_strand_accept();
 }
 
@@ -470,29 +616,101 @@ chat_server_ctx::priv_in_strand_stop()
 		return;
 	m_state = CHAT_SERVER_STATE_STOPPED;
 	m_sock.close();
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
+	// The peers keep the server alive, must not keep them here.
+	m_paused_peers.clear();
+	for (std::unique_ptr<chat_server_core>& core : m_cores) {
+		boost::asio::post(core->m_strand, std::bind(
+			&chat_server_ctx::priv_in_core_stop, shared_from_this(), core.get()));
+	}
+}
+
+void
+chat_server_ctx::priv_in_core_on_new_peer(
+	chat_server_core* core,
+	std::shared_ptr<chat_server_peer> peer)
+{
+	assert(core->m_strand.running_in_this_thread());
+	if (core->m_is_stopped) {
+		peer->stop();
+		return;
+	}
+	peer->start();
+	peer->m_core_slot = core->m_peers.size();
+	core->m_peers.emplace_back(std::move(peer));
+}
+
+void
+chat_server_ctx::priv_in_core_stop(
+	chat_server_core* core)
+{
+	assert(core->m_strand.running_in_this_thread());
+	core->m_is_stopped = true;
+	for (std::shared_ptr<chat_server_peer>& p : core->m_peers)
 		p->stop();
-	m_peers.clear();
+	core->m_peers.clear();
 }
 
 void
 chat_server_ctx::priv_in_strand_on_new_request(
-	std::unique_ptr<chat_server_request> req)
+	chat_server_on_msg_f&& cb)
 {
 	assert(m_strand.running_in_this_thread());
 	if (not m_reqs.empty() or m_in_msgs.empty()) {
-		m_reqs.emplace_back(std::move(req));
+		m_reqs.emplace_back(std::move(cb));
 		return;
 	}
 	// Already have data to return. Then just return it.
-	req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
+	std::unique_ptr<chat_message> msg = std::move(m_in_msgs.front());
 	m_in_msgs.pop_front();
+	priv_in_strand_on_msg_taken();
+	cb(CHAT_ERR_NONE, std::move(msg));
+}
+
+bool
+chat_server_ctx::priv_is_in_queue_full() const
+{
+	return m_in_msg_count.load(std::memory_order_relaxed) >= CHAT_SERVER_IN_QUEUE_HIGH;
+}
+
+void
+chat_server_ctx::priv_peer_on_pause(
+	std::shared_ptr<chat_server_peer> peer)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		peer = std::move(peer)]() mutable {
+		m_paused_peers.emplace_back(std::move(peer));
+		// Could be drained while the peer was on the way here.
+		if (m_in_msg_count.load(std::memory_order_relaxed) <= CHAT_SERVER_IN_QUEUE_LOW)
+			priv_in_strand_resume_peers();
+	});
+}
+
+void
+chat_server_ctx::priv_in_strand_on_msg_taken()
+{
+	assert(m_strand.running_in_this_thread());
+	size_t count = m_in_msg_count.fetch_sub(1, std::memory_order_relaxed) - 1;
+	if (count <= CHAT_SERVER_IN_QUEUE_LOW)
+		priv_in_strand_resume_peers();
+}
+
+void
+chat_server_ctx::priv_in_strand_resume_peers()
+{
+	assert(m_strand.running_in_this_thread());
+	for (std::shared_ptr<chat_server_peer>& peer : m_paused_peers)
+		peer->resume();
+	m_paused_peers.clear();
 }
 
 void
 chat_server_ctx::priv_peer_on_recv(
+	const chat_server_peer* from,
 	std::unique_ptr<chat_message> msg)
 {
+	// The other peers get the message right from the sender's strand.
+	priv_broadcast(chat_server_encode_msg(*msg), from);
+	m_in_msg_count.fetch_add(1, std::memory_order_relaxed);
 	boost::asio::post(m_strand, [ref = shared_from_this(), this,
 		msg = std::move(msg)]() mutable {
 		priv_in_strand_peer_on_recv(std::move(msg));
@@ -508,43 +726,68 @@ chat_server_ctx::priv_in_strand_peer_on_recv(
 
 	// <YOUR CODE IF NEEDED>
 	//
-	// Serve the pending receive-requests if there are any.
+	// Serve the pending receive-requests if there are any. Each message handed to the
+	// app is accounted with priv_in_strand_on_msg_taken().
 }
 
 void
 chat_server_ctx::priv_peer_on_close(
 	std::shared_ptr<chat_server_peer> peer)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+	boost::asio::io_context::strand& strand = peer->m_core.m_strand;
+	boost::asio::post(strand, [ref = shared_from_this(), this,
 		peer = std::move(peer)]() mutable {
-		priv_in_strand_peer_on_close(std::move(peer));
+		priv_in_core_peer_on_close(std::move(peer));
 	});
 }
 
 void
-chat_server_ctx::priv_in_strand_peer_on_close(
+chat_server_ctx::priv_in_core_peer_on_close(
 	std::shared_ptr<chat_server_peer> peer)
 {
-	assert(m_strand.running_in_this_thread());
-	for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
-		if (*it == peer) {
-			m_peers.erase(it);
-			return;
+	chat_server_core& core = peer->m_core;
+	assert(core.m_strand.running_in_this_thread());
+	size_t slot = peer->m_core_slot;
+	if (slot < core.m_peers.size() && core.m_peers[slot] == peer) {
+		if (slot + 1 != core.m_peers.size()) {
+			core.m_peers[slot] = std::move(core.m_peers.back());
+			core.m_peers[slot]->m_core_slot = slot;
 		}
+		core.m_peers.pop_back();
+		peer->m_core_slot = SIZE_MAX;
+		return;
 	}
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
+	if (core.m_is_stopped)
 		return;
 	// Unreachable. If it is reachable, then you have a bug.
 	abort();
 }
 
 void
-chat_server_ctx::priv_in_strand_on_new_feed(
-	std::string_view text)
-{
-	assert(m_strand.running_in_this_thread());
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->feed_async(text);
+chat_server_ctx::priv_broadcast(
+	std::shared_ptr<const std::string> buf,
+	const chat_server_peer* from)
+{
+	// The buffer is encoded once and shared by all the peers. Each core fans it out to
+	// its own peers in parallel with the others.
+	for (std::unique_ptr<chat_server_core>& core : m_cores) {
+		boost::asio::post(core->m_strand, std::bind(
+			&chat_server_ctx::priv_in_core_on_new_buf, shared_from_this(),
+			core.get(), buf, from));
+	}
+}
+
+void
+chat_server_ctx::priv_in_core_on_new_buf(
+	chat_server_core* core,
+	std::shared_ptr<const std::string> buf,
+	const chat_server_peer* from)
+{
+	assert(core->m_strand.running_in_this_thread());
+	for (std::shared_ptr<chat_server_peer>& p : core->m_peers) {
+		if (p.get() != from)
+			p->send_async(buf);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
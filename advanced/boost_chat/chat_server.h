@@ -3,6 +3,7 @@
 #include "chat.h"
 
 #include <functional>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
@@ -15,6 +16,11 @@ class chat_server final
 public:
 	chat_server(
 		boost::asio::io_context& ioCtx);
+	// The peers are spread round-robin over the given contexts, one per core is the
+	// most scalable. The same context can be passed multiple times when it is run by
+	// several threads. The first one also serves the accept and the receive-requests.
+	chat_server(
+		const std::vector<boost::asio::io_context*>& ioCtxs);
 	~chat_server();
 
 	chat_errcode
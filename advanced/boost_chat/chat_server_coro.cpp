@@ -0,0 +1,684 @@
+// Boost 1.74 awaitable.hpp uses std::exchange without including it.
+#include <utility>
+
+#include "chat.h"
+#include "chat_ring.h"
+#include "chat_server.h"
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+// The same server as chat_server.cpp, but each peer is two coroutines instead of the
+// callback chains. The reader parses the frames right in its own frame, the writer
+// sleeps on a timer until the queue gets something. Both run in the strand of their
+// core, which also owns the core's peers. Then a broadcast reaches the local peers
+// without any more posts.
+//
+// The protocol is line based. A client first sends its name, then each message:
+//
+//     <name>\n<msg1>\n<msg2>\n...
+//
+// The server sends each message as two lines, the author and the data. The feeds have
+// the author "server".
+
+using chat_strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+enum chat_server_state
+{
+	CHAT_SERVER_STATE_NEW,
+	CHAT_SERVER_STATE_LISTEN,
+	CHAT_SERVER_STATE_STOPPED,
+};
+
+enum
+{
+	// Max number of queued buffers written by one gather write.
+	CHAT_SERVER_WRITE_BATCH = 64,
+	// Initial size of the input ring of a peer. Grows only for longer lines.
+	CHAT_SERVER_RECV_RING_SIZE = 16 * 1024,
+	// The peers stop reading when the app has that many messages not taken by
+	// recv_async() and start again when it is down to the low watermark.
+	CHAT_SERVER_IN_QUEUE_HIGH = 1024,
+	CHAT_SERVER_IN_QUEUE_LOW = CHAT_SERVER_IN_QUEUE_HIGH / 4,
+	// A peer which doesn't read its broadcasts gets disconnected when more than that
+	// many bytes are queued for it.
+	CHAT_SERVER_OUT_QUEUE_MAX_SIZE = 16 * 1024 * 1024,
+};
+
+class chat_server_peer;
+
+struct chat_server_core final
+{
+	chat_server_core(
+		boost::asio::io_context& ioCtx)
+		: m_ioctx(ioCtx), m_strand(boost::asio::make_strand(ioCtx)), m_is_stopped(false)
+	{}
+
+	boost::asio::io_context& m_ioctx;
+	chat_strand m_strand;
+	// A slot map, see the peer's m_core_slot.
+	std::vector<std::shared_ptr<chat_server_peer>> m_peers;
+	bool m_is_stopped;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
+{
+public:
+	chat_server_peer(
+		boost::asio::ip::tcp::socket&& sock,
+		chat_server_core& core,
+		std::shared_ptr<chat_server_ctx> server);
+
+	void
+	in_core_start();
+
+	void
+	in_core_stop();
+
+	void
+	in_core_send(
+		const std::shared_ptr<const std::string>& buf);
+
+	void
+	in_core_resume();
+
+private:
+	// The reference is a parameter to be in the coroutine frame since its creation.
+	boost::asio::awaitable<void>
+	priv_reader(
+		std::shared_ptr<chat_server_peer> ref);
+
+	boost::asio::awaitable<void>
+	priv_writer(
+		std::shared_ptr<chat_server_peer> ref);
+
+	chat_server_core& m_core;
+	size_t m_core_slot;
+	boost::asio::ip::tcp::socket m_sock;
+	// Wakes the writer up. Never expires by itself.
+	boost::asio::steady_timer m_out_signal;
+	// Wakes the paused reader up.
+	boost::asio::steady_timer m_in_signal;
+	std::shared_ptr<chat_server_ctx> m_server;
+	std::deque<std::shared_ptr<const std::string>> m_out_queue;
+	size_t m_out_size;
+	bool m_is_paused;
+	bool m_is_stopped;
+
+	friend chat_server_ctx;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ctx>
+{
+public:
+	chat_server_ctx(
+		const std::vector<boost::asio::io_context*>& ioCtxs);
+
+	chat_errcode
+	start(
+		uint16_t port);
+
+	uint16_t
+	port() const;
+
+	void
+	stop();
+
+	void
+	recv_async(
+		chat_server_on_msg_f&& cb);
+
+	void
+	feed_async(
+		std::string_view text);
+
+	void
+	in_core_peer_on_recv(
+		const chat_server_peer* from,
+		std::string_view author,
+		std::string_view data);
+
+	void
+	in_core_peer_on_close(
+		chat_server_peer* peer);
+
+	bool
+	is_in_queue_full() const;
+
+	void
+	in_core_peer_pause(
+		std::shared_ptr<chat_server_peer> peer);
+
+private:
+	boost::asio::awaitable<void>
+	priv_acceptor(
+		std::shared_ptr<chat_server_ctx> ref);
+
+	void
+	priv_broadcast(
+		std::shared_ptr<const std::string> buf,
+		const chat_server_peer* from);
+
+	void
+	priv_in_strand_on_new_msg(
+		std::unique_ptr<chat_message> msg);
+
+	void
+	priv_in_strand_on_new_feed(
+		std::string_view text);
+
+	void
+	priv_in_strand_on_msg_taken();
+
+	void
+	priv_in_strand_resume_peers();
+
+	chat_server_state m_state;
+
+	chat_strand m_strand;
+	boost::asio::ip::tcp::acceptor m_sock;
+	uint16_t m_port;
+
+	std::vector<std::unique_ptr<chat_server_core>> m_cores;
+	size_t m_next_core;
+
+	std::deque<chat_server_on_msg_f> m_reqs;
+	std::deque<std::unique_ptr<chat_message>> m_in_msgs;
+	// The messages received from the peers and not yet taken by recv_async(). Including
+	// the ones still on the way to m_in_msgs, so the peers see it right away.
+	std::atomic<size_t> m_in_msg_count;
+	// The peers which stopped reading until m_in_msgs is drained.
+	std::vector<std::shared_ptr<chat_server_peer>> m_paused_peers;
+	// Not finished line of the feeds.
+	std::string m_feed_buf;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static std::shared_ptr<const std::string>
+chat_server_encode_msg(
+	std::string_view author,
+	std::string_view data)
+{
+	std::string res;
+	res.reserve(author.size() + data.size() + 2);
+	res.append(author);
+	res.push_back('\n');
+	res.append(data);
+	res.push_back('\n');
+	return std::make_shared<const std::string>(std::move(res));
+}
+
+static std::string_view
+chat_trim(
+	std::string_view str)
+{
+	size_t begin = 0;
+	while (begin < str.size() && isspace((unsigned char)str[begin]))
+		++begin;
+	size_t end = str.size();
+	while (end > begin && isspace((unsigned char)str[end - 1]))
+		--end;
+	return str.substr(begin, end - begin);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server::chat_server(
+	boost::asio::io_context& ioCtx)
+	: chat_server(std::vector<boost::asio::io_context*>{&ioCtx})
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& ioCtxs)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtxs))
+{
+}
+
+chat_server::~chat_server()
+{
+	m_ctx->stop();
+}
+
+chat_errcode
+chat_server::start(
+	uint16_t port)
+{
+	return m_ctx->start(port);
+}
+
+uint16_t
+chat_server::port() const
+{
+	return m_ctx->port();
+}
+
+void
+chat_server::recv_async(
+	chat_server_on_msg_f&& cb)
+{
+	m_ctx->recv_async(std::move(cb));
+}
+
+void
+chat_server::feed_async(
+	std::string_view text)
+{
+	m_ctx->feed_async(text);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_peer::chat_server_peer(
+	boost::asio::ip::tcp::socket&& sock,
+	chat_server_core& core,
+	std::shared_ptr<chat_server_ctx> server)
+	: m_core(core)
+	, m_core_slot(SIZE_MAX)
+	, m_sock(std::move(sock))
+	, m_out_signal(core.m_ioctx, boost::asio::steady_timer::time_point::max())
+	, m_in_signal(core.m_ioctx, boost::asio::steady_timer::time_point::max())
+	, m_server(std::move(server))
+	, m_out_size(0)
+	, m_is_paused(false)
+	, m_is_stopped(false)
+{
+}
+
+void
+chat_server_peer::in_core_start()
+{
+	assert(m_core.m_strand.running_in_this_thread());
+	m_core_slot = m_core.m_peers.size();
+	m_core.m_peers.emplace_back(shared_from_this());
+	boost::asio::co_spawn(m_core.m_strand, priv_reader(shared_from_this()),
+		boost::asio::detached);
+	boost::asio::co_spawn(m_core.m_strand, priv_writer(shared_from_this()),
+		boost::asio::detached);
+}
+
+void
+chat_server_peer::in_core_stop()
+{
+	assert(m_core.m_strand.running_in_this_thread());
+	if (m_is_stopped)
+		return;
+	m_is_stopped = true;
+	boost::system::error_code err;
+	m_sock.close(err);
+	// The queue is not cleared, a write in progress can still use it.
+	m_out_signal.cancel();
+	m_in_signal.cancel();
+	m_server->in_core_peer_on_close(this);
+}
+
+void
+chat_server_peer::in_core_send(
+	const std::shared_ptr<const std::string>& buf)
+{
+	assert(m_core.m_strand.running_in_this_thread());
+	if (m_is_stopped)
+		return;
+	if (m_out_size > CHAT_SERVER_OUT_QUEUE_MAX_SIZE) {
+		// Holding more would let one stuck client eat all the memory. Slowing down the
+		// senders instead would stall the whole chat. A single big message still goes.
+		in_core_stop();
+		return;
+	}
+	m_out_size += buf->size();
+	m_out_queue.push_back(buf);
+	if (m_out_queue.size() == 1)
+		m_out_signal.cancel_one();
+}
+
+void
+chat_server_peer::in_core_resume()
+{
+	assert(m_core.m_strand.running_in_this_thread());
+	m_is_paused = false;
+	m_in_signal.cancel();
+}
+
+boost::asio::awaitable<void>
+chat_server_peer::priv_reader(
+	std::shared_ptr<chat_server_peer> /* ref */)
+{
+	chat_ring_buffer buf(CHAT_SERVER_RECV_RING_SIZE);
+	std::string name;
+	bool has_name = false;
+	try {
+		while (not m_is_stopped) {
+			if (m_server->is_in_queue_full()) {
+				// The data stays in the socket, then TCP slows the client down.
+				m_is_paused = true;
+				m_server->in_core_peer_pause(shared_from_this());
+				while (m_is_paused and not m_is_stopped) {
+					boost::system::error_code err;
+					co_await m_in_signal.async_wait(
+						boost::asio::redirect_error(boost::asio::use_awaitable, err));
+				}
+				continue;
+			}
+			buf.commit(co_await m_sock.async_read_some(buf.prepare(),
+				boost::asio::use_awaitable));
+			// The complete lines are handled right in the ring, as views. They are
+			// copied only into the messages.
+			std::string_view line;
+			while (buf.pop_line(line)) {
+				if (not has_name) {
+					name = line;
+					has_name = true;
+					continue;
+				}
+				line = chat_trim(line);
+				if (not line.empty())
+					m_server->in_core_peer_on_recv(this, name, line);
+			}
+		}
+	} catch (const boost::system::system_error&) {
+	}
+	in_core_stop();
+}
+
+boost::asio::awaitable<void>
+chat_server_peer::priv_writer(
+	std::shared_ptr<chat_server_peer> /* ref */)
+{
+	std::vector<boost::asio::const_buffer> bufs;
+	try {
+		while (not m_is_stopped) {
+			if (m_out_queue.empty()) {
+				boost::system::error_code err;
+				co_await m_out_signal.async_wait(
+					boost::asio::redirect_error(boost::asio::use_awaitable, err));
+				continue;
+			}
+			bufs.clear();
+			for (const std::shared_ptr<const std::string>& buf : m_out_queue) {
+				if (bufs.size() == CHAT_SERVER_WRITE_BATCH)
+					break;
+				bufs.emplace_back(boost::asio::buffer(*buf));
+			}
+			co_await boost::asio::async_write(m_sock, bufs, boost::asio::use_awaitable);
+			if (not m_is_stopped) {
+				m_out_queue.erase(m_out_queue.begin(),
+					m_out_queue.begin() + bufs.size());
+				m_out_size -= boost::asio::buffer_size(bufs);
+			}
+		}
+	} catch (const boost::system::system_error&) {
+	}
+	in_core_stop();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_ctx::chat_server_ctx(
+	const std::vector<boost::asio::io_context*>& ioCtxs)
+	: m_state(CHAT_SERVER_STATE_NEW)
+	, m_strand(boost::asio::make_strand(*ioCtxs.front()))
+	, m_sock(*ioCtxs.front())
+	, m_port(0)
+	, m_next_core(0)
+	, m_in_msg_count(0)
+{
+	assert(not ioCtxs.empty());
+	m_cores.reserve(ioCtxs.size());
+	for (boost::asio::io_context* ioCtx : ioCtxs)
+		m_cores.emplace_back(std::make_unique<chat_server_core>(*ioCtx));
+}
+
+chat_errcode
+chat_server_ctx::start(
+	uint16_t port)
+{
+	if (m_state != CHAT_SERVER_STATE_NEW)
+		return CHAT_ERR_ALREADY_STARTED;
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	boost::system::error_code err;
+	m_sock.open(endpoint.protocol(), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.set_option(boost::asio::socket_base::reuse_address(true), err);
+	m_sock.bind(endpoint, err);
+	if (err == boost::asio::error::address_in_use)
+		return CHAT_ERR_PORT_BUSY;
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.listen(boost::asio::socket_base::max_listen_connections, err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_port = m_sock.local_endpoint().port();
+	m_state = CHAT_SERVER_STATE_LISTEN;
+	boost::asio::co_spawn(m_strand, priv_acceptor(shared_from_this()),
+		boost::asio::detached);
+	return CHAT_ERR_NONE;
+}
+
+uint16_t
+chat_server_ctx::port() const
+{
+	assert(m_state != CHAT_SERVER_STATE_NEW);
+	return m_port;
+}
+
+void
+chat_server_ctx::stop()
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this]() {
+		if (m_state != CHAT_SERVER_STATE_LISTEN)
+			return;
+		m_state = CHAT_SERVER_STATE_STOPPED;
+		boost::system::error_code err;
+		m_sock.close(err);
+		// The peers keep the server alive, must not keep them here.
+		m_paused_peers.clear();
+		for (std::unique_ptr<chat_server_core>& core : m_cores) {
+			boost::asio::post(core->m_strand, [ref, core = core.get()]() {
+				core->m_is_stopped = true;
+				// Each stop removes the peer from the list.
+				while (not core->m_peers.empty())
+					core->m_peers.back()->in_core_stop();
+			});
+		}
+	});
+}
+
+void
+chat_server_ctx::recv_async(
+	chat_server_on_msg_f&& cb)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		cb = std::move(cb)]() mutable {
+		if (not m_in_msgs.empty()) {
+			std::unique_ptr<chat_message> msg = std::move(m_in_msgs.front());
+			m_in_msgs.pop_front();
+			priv_in_strand_on_msg_taken();
+			cb(CHAT_ERR_NONE, std::move(msg));
+			return;
+		}
+		m_reqs.emplace_back(std::move(cb));
+	});
+}
+
+void
+chat_server_ctx::feed_async(
+	std::string_view text)
+{
+	boost::asio::post(m_strand, std::bind(&chat_server_ctx::priv_in_strand_on_new_feed,
+		shared_from_this(), std::string(text)));
+}
+
+void
+chat_server_ctx::in_core_peer_on_recv(
+	const chat_server_peer* from,
+	std::string_view author,
+	std::string_view data)
+{
+	priv_broadcast(chat_server_encode_msg(author, data), from);
+	std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+	msg->m_author = author;
+	msg->m_data = data;
+	m_in_msg_count.fetch_add(1, std::memory_order_relaxed);
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		msg = std::move(msg)]() mutable {
+		priv_in_strand_on_new_msg(std::move(msg));
+	});
+}
+
+void
+chat_server_ctx::in_core_peer_on_close(
+	chat_server_peer* peer)
+{
+	chat_server_core& core = peer->m_core;
+	assert(core.m_strand.running_in_this_thread());
+	size_t slot = peer->m_core_slot;
+	if (slot >= core.m_peers.size() || core.m_peers[slot].get() != peer)
+		return;
+	if (slot + 1 != core.m_peers.size()) {
+		core.m_peers[slot] = std::move(core.m_peers.back());
+		core.m_peers[slot]->m_core_slot = slot;
+	}
+	peer->m_core_slot = SIZE_MAX;
+	// Can be the last reference to the peer.
+	core.m_peers.pop_back();
+}
+
+bool
+chat_server_ctx::is_in_queue_full() const
+{
+	return m_in_msg_count.load(std::memory_order_relaxed) >= CHAT_SERVER_IN_QUEUE_HIGH;
+}
+
+void
+chat_server_ctx::in_core_peer_pause(
+	std::shared_ptr<chat_server_peer> peer)
+{
+	assert(peer->m_core.m_strand.running_in_this_thread());
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		peer = std::move(peer)]() mutable {
+		m_paused_peers.emplace_back(std::move(peer));
+		// Could be drained while the peer was on the way here.
+		if (m_in_msg_count.load(std::memory_order_relaxed) <= CHAT_SERVER_IN_QUEUE_LOW)
+			priv_in_strand_resume_peers();
+	});
+}
+
+boost::asio::awaitable<void>
+chat_server_ctx::priv_acceptor(
+	std::shared_ptr<chat_server_ctx> ref)
+{
+	while (m_state == CHAT_SERVER_STATE_LISTEN) {
+		chat_server_core* core = m_cores[m_next_core].get();
+		m_next_core = (m_next_core + 1) % m_cores.size();
+		boost::system::error_code err;
+		boost::asio::ip::tcp::socket sock = co_await m_sock.async_accept(core->m_ioctx,
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		if (m_state != CHAT_SERVER_STATE_LISTEN)
+			break;
+		if (err) {
+			std::cout << "Chat server accept error: boost " << err << '\n';
+			abort();
+		}
+		std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
+			std::move(sock), *core, ref);
+		boost::asio::post(core->m_strand, [core, peer = std::move(peer)]() {
+			if (core->m_is_stopped)
+				return;
+			peer->in_core_start();
+		});
+	}
+}
+
+void
+chat_server_ctx::priv_broadcast(
+	std::shared_ptr<const std::string> buf,
+	const chat_server_peer* from)
+{
+	// dispatch() runs it right away for the core of the sender.
+	for (std::unique_ptr<chat_server_core>& core : m_cores) {
+		boost::asio::dispatch(core->m_strand, [core = core.get(), buf, from]() {
+			for (std::shared_ptr<chat_server_peer>& p : core->m_peers) {
+				if (p.get() != from)
+					p->in_core_send(buf);
+			}
+		});
+	}
+}
+
+void
+chat_server_ctx::priv_in_strand_on_new_msg(
+	std::unique_ptr<chat_message> msg)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_reqs.empty()) {
+		m_in_msgs.emplace_back(std::move(msg));
+		return;
+	}
+	chat_server_on_msg_f cb = std::move(m_reqs.front());
+	m_reqs.pop_front();
+	priv_in_strand_on_msg_taken();
+	cb(CHAT_ERR_NONE, std::move(msg));
+}
+
+void
+chat_server_ctx::priv_in_strand_on_msg_taken()
+{
+	assert(m_strand.running_in_this_thread());
+	size_t count = m_in_msg_count.fetch_sub(1, std::memory_order_relaxed) - 1;
+	if (count <= CHAT_SERVER_IN_QUEUE_LOW)
+		priv_in_strand_resume_peers();
+}
+
+void
+chat_server_ctx::priv_in_strand_resume_peers()
+{
+	assert(m_strand.running_in_this_thread());
+	for (std::shared_ptr<chat_server_peer>& peer : m_paused_peers) {
+		chat_strand& strand = peer->m_core.m_strand;
+		boost::asio::post(strand, [peer = std::move(peer)]() {
+			peer->in_core_resume();
+		});
+	}
+	m_paused_peers.clear();
+}
+
+void
+chat_server_ctx::priv_in_strand_on_new_feed(
+	std::string_view text)
+{
+	assert(m_strand.running_in_this_thread());
+	m_feed_buf.append(text);
+	size_t begin = 0;
+	size_t end;
+	while ((end = m_feed_buf.find('\n', begin)) != std::string::npos) {
+		std::string_view line = chat_trim(
+			std::string_view(m_feed_buf).substr(begin, end - begin));
+		begin = end + 1;
+		if (not line.empty())
+			priv_broadcast(chat_server_encode_msg("server", line), nullptr);
+	}
+	m_feed_buf.erase(0, begin);
+}
@@ -7,12 +7,14 @@
 #include <boost/asio/posix/stream_descriptor.hpp>
 #include <boost/asio/read.hpp>
 #include <iostream>
+#include <thread>
 
 class chat_server_app final
 {
 public:
 	chat_server_app(
-		uint16_t port);
+		uint16_t port,
+		uint32_t thread_count);
 
 	int
 	run();
@@ -35,6 +37,8 @@ private:
 		size_t size);
 
 	boost::asio::io_context m_ioctx;
+	// One more context per extra thread. Each has its own share of the peers.
+	std::vector<std::unique_ptr<boost::asio::io_context>> m_core_ioctxs;
 	boost::asio::io_context::strand m_strand;
 	chat_server m_server;
 
@@ -60,10 +64,42 @@ port_from_str(const char *str, uint16_t *port)
 	return 0;
 }
 
+static int
+thread_count_from_str(const char *str, uint32_t *count)
+{
+	errno = 0;
+	char *end = NULL;
+	long res = strtol(str, &end, 10);
+	if (res == 0 && errno != 0)
+		return -1;
+	if (*end != 0)
+		return -1;
+	if (res > 1024 || res < 1)
+		return -1;
+	*count = (uint32_t)res;
+	return 0;
+}
+
+static std::vector<boost::asio::io_context*>
+make_core_ioctxs(
+	boost::asio::io_context& main,
+	std::vector<std::unique_ptr<boost::asio::io_context>>& cores,
+	uint32_t thread_count)
+{
+	std::vector<boost::asio::io_context*> res;
+	res.push_back(&main);
+	for (uint32_t i = 1; i < thread_count; ++i) {
+		cores.emplace_back(std::make_unique<boost::asio::io_context>(1));
+		res.push_back(cores.back().get());
+	}
+	return res;
+}
+
 chat_server_app::chat_server_app(
-	uint16_t port)
+	uint16_t port,
+	uint32_t thread_count)
 	: m_strand(m_ioctx)
-	, m_server(m_ioctx)
+	, m_server(make_core_ioctxs(m_ioctx, m_core_ioctxs, thread_count))
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
@@ -75,8 +111,20 @@ chat_server_app::chat_server_app(
 int
 chat_server_app::run()
 {
+	std::vector<std::thread> threads;
+	for (std::unique_ptr<boost::asio::io_context>& ioctx : m_core_ioctxs) {
+		threads.emplace_back([&ioctx]() {
+			boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+				work(ioctx->get_executor());
+			ioctx->run();
+		});
+	}
 	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(m_ioctx.get_executor());
 	m_ioctx.run();
+	for (std::unique_ptr<boost::asio::io_context>& ioctx : m_core_ioctxs)
+		ioctx->stop();
+	for (std::thread& t : threads)
+		t.join();
 	return m_res;
 }
 
@@ -84,16 +132,20 @@ void
 chat_server_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_server.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_server_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// The callback is stored as std::function which would lose the executor of
+	// bind_executor(). Then the strand is entered explicitly.
+	m_server.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::post(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_server_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_server_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -111,7 +163,7 @@ chat_server_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
@@ -140,7 +192,7 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		std::cout << "Expected a port to listen on\n";
+		std::cout << "Expected a port to listen on and optionally a thread count\n";
 		return -1;
 	}
 	uint16_t port = 0;
@@ -149,6 +201,11 @@ main(int argc, char **argv)
 		std::cout << "Invalid port\n";
 		return -1;
 	}
-	chat_server_app app(port);
+	uint32_t thread_count = 1;
+	if (argc > 2 && thread_count_from_str(argv[2], &thread_count) != 0) {
+		std::cout << "Invalid thread count\n";
+		return -1;
+	}
+	chat_server_app app(port, thread_count);
 	return app.run();
 }
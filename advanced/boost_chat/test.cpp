@@ -1,10 +1,19 @@
 #include "chat.h"
+#include "chat_alloc.h"
 #include "chat_client.h"
+#include "chat_ring.h"
 #include "chat_server.h"
+#include "heap_help.h"
 #include "unitpp.h"
 
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
 #include <thread>
 
 enum
@@ -175,6 +184,132 @@ client_connect_blocking(
 	return err;
 }
 
+// Ping-pong over a socket pair with the handlers allocated in chat_handler_memory.
+class test_alloc_pair final
+{
+public:
+	test_alloc_pair()
+		: m_strand(m_ioctx), m_sock1(m_ioctx), m_sock2(m_ioctx), m_round_count(0)
+	{
+		boost::asio::local::connect_pair(m_sock1, m_sock2);
+		memset(m_out, 'x', sizeof(m_out));
+	}
+
+	void
+	run(
+		uint32_t round_count)
+	{
+		m_round_count = round_count;
+		m_ioctx.restart();
+		boost::asio::post(m_strand, std::bind(&test_alloc_pair::priv_send, this));
+		m_ioctx.run();
+		unit_assert(m_round_count == 0);
+	}
+
+private:
+	void
+	priv_send()
+	{
+		boost::asio::async_write(m_sock1, boost::asio::buffer(m_out),
+			chat_make_alloc_handler(m_send_mem, boost::asio::bind_executor(m_strand,
+			[this](const boost::system::error_code& err, size_t size) {
+			unit_assert(m_strand.running_in_this_thread());
+			unit_assert(not err && size == sizeof(m_out));
+		})));
+		boost::asio::async_read(m_sock2, boost::asio::buffer(m_in),
+			chat_make_alloc_handler(m_recv_mem, boost::asio::bind_executor(m_strand,
+			[this](const boost::system::error_code& err, size_t size) {
+			unit_assert(m_strand.running_in_this_thread());
+			unit_assert(not err && size == sizeof(m_in));
+			if (--m_round_count > 0)
+				priv_send();
+		})));
+	}
+
+	boost::asio::io_context m_ioctx;
+	boost::asio::io_context::strand m_strand;
+	boost::asio::local::stream_protocol::socket m_sock1;
+	boost::asio::local::stream_protocol::socket m_sock2;
+	chat_handler_memory m_send_mem;
+	chat_handler_memory m_recv_mem;
+	char m_out[128];
+	char m_in[128];
+	uint32_t m_round_count;
+};
+
+static void
+test_handler_alloc()
+{
+	unit_test_start();
+
+	test_alloc_pair pair;
+	unit_msg("warm up");
+	pair.run(10);
+
+	// Each run allocates a few things for the io_context itself. But it must not
+	// depend on the number of the operations done in the run.
+	uint64_t count0 = heaph_get_total_alloc_count();
+	pair.run(10);
+	uint64_t count1 = heaph_get_total_alloc_count();
+	pair.run(1000);
+	uint64_t count2 = heaph_get_total_alloc_count();
+	unit_check(count2 - count1 == count1 - count0, "no allocations per operation");
+}
+
+static size_t
+test_ring_write(
+	chat_ring_buffer& ring,
+	std::string_view data)
+{
+	std::array<boost::asio::mutable_buffer, 2> bufs = ring.prepare();
+	size_t size = boost::asio::buffer_copy(bufs, boost::asio::buffer(data));
+	ring.commit(size);
+	return size;
+}
+
+static void
+test_ring_buffer()
+{
+	unit_test_start();
+
+	chat_ring_buffer ring(16);
+	unit_check(ring.capacity() == 16, "capacity");
+	std::string_view line;
+	unit_check(not ring.pop_line(line), "empty");
+
+	unit_msg("lines in chunks");
+	test_ring_write(ring, "ab");
+	unit_assert(not ring.pop_line(line));
+	test_ring_write(ring, "c\nde\n");
+	unit_assert(ring.pop_line(line) && line == "abc");
+	unit_assert(ring.pop_line(line) && line == "de");
+	unit_check(not ring.pop_line(line) && ring.size() == 0, "all taken");
+
+	unit_msg("wrap around");
+	// The positions are at 7. The line goes through the buffer end.
+	unit_assert(test_ring_write(ring, "0123456789abcd\n") == 15);
+	unit_assert(ring.pop_line(line) && line == "0123456789abcd");
+	unit_check(ring.capacity() == 16, "no growth");
+	for (int i = 0; i < 10; ++i) {
+		unit_assert(test_ring_write(ring, "xyz\n") == 4);
+		unit_assert(ring.pop_line(line) && line == "xyz");
+	}
+	unit_check(ring.size() == 0, "wrapped many times");
+
+	unit_msg("long line");
+	std::string big(100, 'a');
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] += i % 26;
+	std::string_view rest = big;
+	while (not rest.empty())
+		rest.remove_prefix(test_ring_write(ring, rest));
+	test_ring_write(ring, "\nend\n");
+	unit_check(ring.capacity() == 128, "grown");
+	unit_assert(ring.pop_line(line) && line == big);
+	unit_assert(ring.pop_line(line) && line == "end");
+	unit_check(ring.size() == 0, "all taken");
+}
+
 static void
 test_trivial()
 {
@@ -438,6 +573,51 @@ test_multi_client(void)
 	}
 }
 
+static void
+test_multi_core(void)
+{
+	unit_test_start();
+
+	const uint32_t core_count = 3;
+	std::vector<std::unique_ptr<io_core>> cores;
+	std::vector<boost::asio::io_context*> ioctxs;
+	for (uint32_t i = 0; i < core_count; ++i) {
+		cores.emplace_back(std::make_unique<io_core>());
+		cores.back()->start(1);
+		ioctxs.push_back(&cores.back()->backend());
+	}
+	chat_server server(ioctxs);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+
+	// More clients than cores, so some of the cores have several peers.
+	uint32_t client_count = core_count * 2;
+	std::vector<std::unique_ptr<chat_client>> clis;
+	for (uint32_t i = 0; i < client_count; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(
+			cores[i % core_count]->backend(), "cli_" + std::to_string(i)));
+		unit_assert(client_connect_blocking(*clis.back(), endpoint) == CHAT_ERR_NONE);
+	}
+
+	unit_msg("Say hello");
+	clis[0]->feed_async("hello\n");
+	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
+	unit_check(rsp->m_data == "hello", "server got hello");
+	for (uint32_t i = 1; i < client_count; ++i) {
+		rsp = client_recv_blocking(*clis[i]);
+		unit_assert(rsp->m_data == "hello");
+		unit_assert(rsp->m_author == "cli_0");
+	}
+
+	unit_msg("Feed from the server");
+	server.feed_async("news\n");
+	for (uint32_t i = 0; i < client_count; ++i) {
+		rsp = client_recv_blocking(*clis[i]);
+		unit_assert(rsp->m_data == "news");
+	}
+	clis.clear();
+}
+
 struct test_stress_ctx final
 {
 	uint32_t msg_count;
@@ -523,6 +703,46 @@ test_stress()
 		threads[i]->join();
 }
 
+static void
+test_backpressure()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli1, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(
+		cli2, make_addr_str(server.port())) == CHAT_ERR_NONE);
+
+	unit_msg("send more than the server keeps for the app");
+	uint32_t count = 10000;
+	std::string batch;
+	for (uint32_t i = 0; i < count; ++i)
+		batch.append("msg" + std::to_string(i) + "\n");
+	cli1.feed_async(batch);
+	// Let the server hit the watermark and stop receiving.
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	unit_msg("drain");
+	for (uint32_t i = 0; i < count; ++i) {
+		std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+		unit_assert(msg->m_data == "msg" + std::to_string(i));
+	}
+	unit_check(true, "all received in order after the pause");
+	for (uint32_t i = 0; i < count; ++i) {
+		std::unique_ptr<chat_message> msg = client_recv_blocking(cli2);
+		unit_assert(msg->m_data == "msg" + std::to_string(i));
+	}
+	unit_check(true, "all broadcasted in order");
+}
+
 static void
 test_big_author()
 {
@@ -575,12 +795,16 @@ main(void)
 {
 	unit_test_start();
 
+	test_ring_buffer();
+	test_handler_alloc();
 	test_trivial();
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
 	test_multi_client();
+	test_multi_core();
 	test_stress();
+	test_backpressure();
 	test_big_author();
 	return 0;
 }
@@ -0,0 +1,194 @@
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+
+# The performance stage of test.sh: runs the benchmarks of a homework several
+# times, takes the median of each result, and compares it with the baseline
+# stored for the homework. A result is slow when it is worse than the baseline
+# by more than the threshold, or than the noise if that is bigger. The noise is
+# the spread of the runs relative to their median, the bigger of the current
+# and the baseline ones, doubled. The summary is printed, the details go to a
+# JSON file.
+#
+#     python3 perf.py --hw 3 --build ./build_perf --output perf.json
+#     python3 perf.py --hw 3 --build ./build_perf --update
+
+parser = argparse.ArgumentParser(description='Performance stage for a homework')
+parser.add_argument('--hw', type=int, required=True,
+                    help='homework number')
+parser.add_argument('--build', type=str, required=True,
+                    help='build directory with the benchmarks')
+parser.add_argument('--baseline', type=str, default=None,
+                    help='baseline file, baselines/hw<N>.json by default')
+parser.add_argument('--runs', type=int, default=3,
+                    help='number of runs of each benchmark')
+parser.add_argument('--threshold', type=float, default=0.2,
+                    help='relative slowdown which is not noise')
+parser.add_argument('--output', type=str, default=None,
+                    help='file for the JSON result')
+parser.add_argument('--update', action='store_true',
+                    help='store the results as the new baseline')
+args = parser.parse_args()
+
+# The benchmark targets of each homework with their arguments. They are built
+# optimized, without the leak checks.
+benchmarks = {
+    1: [['bench'], ['bench_corobus']],
+    2: [['bench_parser']],
+    3: [['bench_userfs']],
+    4: [['bench_thread_pool']],
+    # At a fixed rate the latency is what changes
+    5: [['bench_chat', '-d', '3']],
+}
+
+# Units of the times, the less the better. For the others, the rates, the more
+# the better.
+time_units = {'ns', 'us', 'ms', 's'}
+
+baseline_path = args.baseline
+if baseline_path is None:
+    baseline_path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                 'baselines', 'hw{}.json'.format(args.hw))
+
+
+def get_machine():
+    model = 'unknown'
+    try:
+        with open('/proc/cpuinfo') as f:
+            for line in f:
+                if line.startswith('model name'):
+                    model = line.split(':', 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    return '{}, {} cpus'.format(model, os.cpu_count())
+
+
+# The format of utils/bench.h and of the benchmarks printing like it: a line
+# with the name, then the indented stats. Each "med" is a result, a benchmark
+# can give several of them in different units. bench_chat has its own lines.
+def parse_output(bench, output):
+    results = {}
+    name = None
+    for line in output.splitlines():
+        if not line.strip():
+            continue
+        latency = re.match(r'latency:(.*)', line)
+        delivered = re.match(r'delivered: \d+ messages, ([\d.]+)/s', line)
+        if latency is not None:
+            for p, value in re.findall(r'p([\d.]+) ([\d.]+) us', latency.group(1)):
+                results['{}: latency p{}, us'.format(bench, p)] = float(value)
+            name = None
+        elif delivered is not None:
+            results['{}: delivered, messages/s'.format(bench)] = \
+                float(delivered.group(1))
+            name = None
+        elif not line[0].isspace():
+            name = line.strip()
+        elif name is not None:
+            med = re.match(r'\s+med: ([\d.]+) (.+)$', line)
+            if med is not None:
+                key = '{}: {}, {}'.format(bench, name, med.group(2))
+                results[key] = float(med.group(1))
+    return results
+
+
+def unit_of(key):
+    return key.rsplit(', ', 1)[1]
+
+
+def run_benchmarks():
+    runs = {}
+    for command in benchmarks[args.hw]:
+        path = os.path.join(args.build, command[0])
+        for _ in range(args.runs):
+            p = subprocess.run([path] + command[1:], stdout=subprocess.PIPE,
+                               stderr=subprocess.STDOUT)
+            output = p.stdout.decode(errors='replace')
+            if p.returncode != 0:
+                raise RuntimeError('{} failed with {}:\n{}'.format(
+                    command[0], p.returncode, output[-2000:]))
+            for key, value in parse_output(command[0], output).items():
+                runs.setdefault(key, []).append(value)
+    stats = {}
+    for key, values in runs.items():
+        median = statistics.median(values)
+        noise = (max(values) - min(values)) / median if median > 0 else 0
+        stats[key] = {'value': median, 'noise': noise}
+    return stats
+
+
+def compare(stats, baseline):
+    metrics = []
+    slow = []
+    for key, current in stats.items():
+        metric = {'name': key, 'unit': unit_of(key),
+                  'value': current['value'], 'noise': round(current['noise'], 4)}
+        base = baseline['metrics'].get(key) if baseline is not None else None
+        if base is not None and base['value'] > 0:
+            change = (current['value'] - base['value']) / base['value']
+            # Positive is slower
+            if unit_of(key) not in time_units:
+                change = -change
+            allowed = max(args.threshold,
+                          2 * max(current['noise'], base['noise']))
+            metric['baseline'] = base['value']
+            metric['change'] = round(change, 4)
+            metric['allowed'] = round(allowed, 4)
+            metric['is_slow'] = change > allowed
+            if metric['is_slow']:
+                slow.append(key)
+        metrics.append(metric)
+    return metrics, slow
+
+
+machine = get_machine()
+result = {'hw': args.hw, 'machine': machine, 'runs': args.runs,
+          'threshold': args.threshold}
+try:
+    stats = run_benchmarks()
+except (OSError, RuntimeError) as e:
+    result['status'] = 'ERR'
+    result['error'] = str(e)
+    stats = None
+
+if stats is not None and args.update:
+    with open(baseline_path, 'w') as f:
+        json.dump({'machine': machine, 'runs': args.runs, 'metrics': stats},
+                  f, indent=1, sort_keys=True)
+        f.write('\n')
+    print('Baseline stored in {}, {} results'.format(baseline_path, len(stats)))
+    sys.exit(0)
+
+if stats is not None:
+    baseline = None
+    if os.path.exists(baseline_path):
+        with open(baseline_path) as f:
+            baseline = json.load(f)
+        result['baseline_machine'] = baseline['machine']
+    metrics, slow = compare(stats, baseline)
+    result['metrics'] = metrics
+    result['slow'] = slow
+    if baseline is None:
+        result['status'] = 'NO_BASELINE'
+    else:
+        result['status'] = 'SLOW' if slow else 'OK'
+
+print('Performance: {}'.format(result['status']))
+if result['status'] == 'ERR':
+    print(result['error'])
+elif result.get('baseline_machine', machine) != machine:
+    print('The baseline is of another machine: {}'.format(
+        result['baseline_machine']))
+for key in result.get('slow', []):
+    metric = next(m for m in result['metrics'] if m['name'] == key)
+    print('    {}: {:.2f}, baseline {:.2f}, {:+.0f}% slower'.format(
+        key, metric['value'], metric['baseline'], metric['change'] * 100))
+
+if args.output is not None:
+    with open(args.output, 'w') as f:
+        json.dump(result, f)
@@ -15,6 +15,13 @@ fi
 status='"ERR"'
 score=0
 output=''
+performance='null'
+
+# The performance stage is optional: PERF=1, or "perf": true in the settings
+perf=$PERF
+if [ "$perf" != "1" ] && [ "$(jq -r '.perf // false' "$RESOURCES_DIR_MOUNT/allcups/settings.json" 2>/dev/null)" == "true" ]; then
+	perf=1
+fi
 
 if [ "$hw" -eq 1 ]; then
 	cp $RESOURCES_DIR_MOUNT/"$hw"/test.cpp /sysprog/solution
@@ -85,6 +92,31 @@ else
 	echo "Unknown or unsupported HW number"
 fi
 
+# The benchmarks are built from a copy, with the reference CMakeLists.txt
+# and benchmark sources, and without the leak checks. The result does not
+# change the score, the slow ones are only listed.
+if [ "$perf" == "1" ] && [ "$status" == '"OK"' ]; then
+	echo '⏱️ Running benchmarks'
+	rm -rf /sysprog/perf
+	cp -r /sysprog/solution /sysprog/perf
+	cp -n $RESOURCES_DIR_MOUNT/"$hw"/* /sysprog/perf 2>/dev/null
+	cp $RESOURCES_DIR_MOUNT/"$hw"/CMakeLists.txt /sysprog/perf
+	cp $RESOURCES_DIR_MOUNT/"$hw"/bench*.cpp /sysprog/perf
+	rm -rf /sysprog/perf/build
+	mkdir /sysprog/perf/build
+	cd /sysprog/perf/build
+	if cmake .. -DENABLE_LEAK_CHECKS=0 > /dev/null && make -j > /dev/null; then
+		python3 $RESOURCES_DIR_MOUNT/allcups/perf.py --hw "$hw" --build . \
+			--runs "${PERF_RUNS:-3}" --output /sysprog/perf.json
+		if [ -f /sysprog/perf.json ]; then
+			performance=$(cat /sysprog/perf.json)
+		fi
+	else
+		echo 'Benchmarks build failed'
+		performance='{"status": "ERR", "error": "build failed"}'
+	fi
+fi
+
 errors_json=$(echo "$output" | jq -R -s '.')
 
 echo '⚖️ Result:'
@@ -97,7 +129,8 @@ else
 	"status": $status,
 	"validationQuality": $score,
 	"testingQuality": $score,
-	"errors": [$errors_json]
+	"errors": [$errors_json],
+	"performance": $performance
 }
 EOF
 	)
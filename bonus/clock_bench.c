@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../utils/bench.h"
+#include "../utils/clock.h"
+
+/*
+ * The bonus task 1 of task_eng.txt: the cost of one clock_gettime() with
+ * CLOCK_REALTIME, CLOCK_MONOTONIC and CLOCK_MONOTONIC_RAW. Plus the cheaper
+ * ways to get the time, which utils/clock.h offers for the hot paths:
+ * CLOCK_MONOTONIC_COARSE, the raw CPU counter, the counter turned into
+ * nanoseconds, and the time cached by an event loop.
+ *
+ *     gcc -O2 clock_bench.c
+ *     ./a.out [<calls>]
+ *
+ * 50 mln calls per run by default, like the task proposes.
+ */
+
+enum {
+	CALL_COUNT = 50000000,
+};
+
+static void
+bench_clock_id(void *arg, uint64_t iter_count)
+{
+	clockid_t id = *(clockid_t *)arg;
+	struct timespec ts;
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		clock_gettime(id, &ts);
+		bench_do_not_optimize(ts.tv_nsec);
+	}
+}
+
+static void
+bench_ticks(void *arg, uint64_t iter_count)
+{
+	(void)arg;
+	for (uint64_t i = 0; i < iter_count; ++i)
+		bench_do_not_optimize(clock_ticks());
+}
+
+static void
+bench_fast(void *arg, uint64_t iter_count)
+{
+	(void)arg;
+	for (uint64_t i = 0; i < iter_count; ++i)
+		bench_do_not_optimize(clock_fast_ns());
+}
+
+static void
+bench_cache(void *arg, uint64_t iter_count)
+{
+	struct clock_cache *cache = arg;
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		bench_clobber();
+		bench_do_not_optimize(clock_cache_ns(cache));
+	}
+}
+
+static void
+bench_one(const char *name, bench_f func, void *arg, uint64_t count)
+{
+	struct bench_result res;
+	bench_run(name, func, arg, count, BENCH_RUN_COUNT, &res);
+	bench_print(&res);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t count = CALL_COUNT;
+	if (argc > 1)
+		count = strtoull(argv[1], NULL, 10);
+	if (count == 0) {
+		printf("Bad call count\n");
+		return -1;
+	}
+	clockid_t ids[] = {
+		CLOCK_REALTIME, CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW,
+		CLOCK_MONOTONIC_COARSE,
+	};
+	const char *names[] = {
+		"CLOCK_REALTIME", "CLOCK_MONOTONIC", "CLOCK_MONOTONIC_RAW",
+		"CLOCK_MONOTONIC_COARSE",
+	};
+	for (int i = 0; i < 4; ++i)
+		bench_one(names[i], bench_clock_id, &ids[i], count);
+	bench_one("clock_ticks (rdtsc)", bench_ticks, NULL, count);
+	/* The calibration is not measured. */
+	clock_fast_ns();
+	bench_one(clock_ticks_are_stable() ? "clock_fast_ns" :
+		  "clock_fast_ns (no stable counter, CLOCK_MONOTONIC)",
+		  bench_fast, NULL, count);
+	struct clock_cache cache;
+	clock_cache_update(&cache);
+	bench_one("clock_cache_ns", bench_cache, &cache, count);
+
+	/* How far the fast clock went from the one it imitates. */
+	uint64_t mono = clock_monotonic_ns();
+	uint64_t fast = clock_fast_ns();
+	printf("clock_fast_ns - CLOCK_MONOTONIC after the runs: %lld ns\n",
+	       (long long)(fast - mono));
+	return 0;
+}
@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../utils/bench.h"
+
+/*
+ * The bonus tasks 3-7 of task_eng.txt in one suite: the costs of the
+ * thread primitives which thread_pool and heap_help are built of.
+ *
+ * - mutex: pthread_mutex lock + unlock with a counter increment, the
+ *   total split between the threads. Time per lock.
+ * - create_join: pthread_create + pthread_join of an empty thread, the
+ *   total split between the creating threads. Time per pair.
+ * - atomic: a store into one value and a relaxed increment of the shared
+ *   counter until it reaches the total. The store is relaxed or seq_cst.
+ *   Time per 1000 increments.
+ * - cond: one thread calls signal or broadcast under the mutex, the
+ *   others wait. Time per call.
+ * - false_sharing: each thread increments its own number up to the total.
+ *   The numbers are close (in one cache line) or distant (64 bytes apart).
+ *   Time per 1000 increments.
+ *
+ *     gcc -O2 thread_bench.c -lpthread
+ *     ./a.out [-b bench,...] [-t threads,...] [-c cpus] [-m node]
+ *             [-s scale] [-r runs]
+ *
+ * -t is the thread counts to try, by default 1, 2, 3 and the powers of 2
+ * up to the CPU count. -c pins the threads to the given CPUs round-robin,
+ * like "0-3,8". -m places the shared data on the given NUMA node. -s
+ * multiplies the operation counts, which are the ones task_eng.txt
+ * proposes by default.
+ *
+ * With BENCH_FORMAT=json each result is one line of JSON, after a line
+ * describing the machine. The baselines of the known machines are kept
+ * in baselines/ like that:
+ *
+ *     BENCH_FORMAT=json ./a.out -s 0.1 > baselines/<machine>.jsonl
+ */
+
+enum {
+	THREAD_COUNT_MAX = 256,
+	CPU_COUNT_MAX = 1024,
+	CACHE_LINE_SIZE = 64,
+	MUTEX_LOCK_COUNT = 10000000,
+	CREATE_JOIN_COUNT = 100000,
+	ATOMIC_INCREMENT_COUNT = 100000000,
+	COND_SIGNAL_COUNT = 1000000,
+	FALSE_SHARING_INCREMENT_COUNT = 100000000,
+};
+
+struct options {
+	int thread_counts[THREAD_COUNT_MAX];
+	int thread_count_count;
+	/* Empty means the threads are not pinned. */
+	int cpus[CPU_COUNT_MAX];
+	int cpu_count;
+	/* NUMA node of the shared data, -1 for the default policy. */
+	int mem_node;
+	double scale;
+	/* Comma separated bench names, NULL for all. */
+	const char *filter;
+	int run_count;
+};
+
+static struct options opts;
+
+static bool is_started;
+
+struct worker {
+	void *ctx;
+	int index;
+};
+
+static bool
+is_json(void)
+{
+	const char *format = getenv("BENCH_FORMAT");
+	return format != NULL && strcmp(format, "json") == 0;
+}
+
+static uint64_t
+scaled(uint64_t count)
+{
+	uint64_t res = (uint64_t)(count * opts.scale);
+	return res > 0 ? res : 1;
+}
+
+/** Parse a list like "1,2,8-11". Returns the count, -1 on an error. */
+static int
+parse_list(const char *str, int *list, int size)
+{
+	int count = 0;
+	while (*str != 0) {
+		char *end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+		if (end == str || first < 0)
+			return -1;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first)
+				return -1;
+		}
+		for (long i = first; i <= last; ++i) {
+			if (count == size)
+				return -1;
+			list[count++] = (int)i;
+		}
+		if (*end == ',')
+			++end;
+		else if (*end != 0)
+			return -1;
+		str = end;
+	}
+	return count;
+}
+
+static bool
+is_selected(const char *name)
+{
+	if (opts.filter == NULL)
+		return true;
+	size_t len = strlen(name);
+	for (const char *pos = opts.filter; pos != NULL;) {
+		if (strncmp(pos, name, len) == 0 &&
+		    (pos[len] == ',' || pos[len] == 0))
+			return true;
+		pos = strchr(pos, ',');
+		if (pos != NULL)
+			++pos;
+	}
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Placement.
+
+static void
+pin_thread(int index)
+{
+	if (opts.cpu_count == 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(opts.cpus[index % opts.cpu_count], &set);
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		printf("pin error = %s\n", strerror(rc));
+		exit(-1);
+	}
+}
+
+/**
+ * Memory for the data the threads share, zeroed. It is touched only after
+ * the policy is set, so the pages are allocated on the chosen node.
+ */
+static void *
+shared_alloc(size_t size)
+{
+	void *res = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED) {
+		printf("mmap error = %s\n", strerror(errno));
+		exit(-1);
+	}
+	if (opts.mem_node >= 0) {
+		unsigned long mask = 1UL << opts.mem_node;
+		if (syscall(SYS_mbind, res, size, MPOL_BIND, &mask,
+			    sizeof(mask) * 8, 0) != 0) {
+			printf("mbind error = %s\n", strerror(errno));
+			exit(-1);
+		}
+	}
+	memset(res, 0, size);
+	return res;
+}
+
+static void
+shared_free(void *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+
+/** Pin the worker and wait until all of them are created. */
+static void
+worker_start(const struct worker *w)
+{
+	pin_thread(w->index);
+	while (!__atomic_load_n(&is_started, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+/**
+ * Start the threads, let them all go at once, and return the nanoseconds
+ * until all of them are done. The creation is not counted.
+ */
+static uint64_t
+team_run(int count, void *(*func)(void *), void *ctx)
+{
+	pthread_t tids[THREAD_COUNT_MAX + 1];
+	struct worker workers[THREAD_COUNT_MAX + 1];
+	__atomic_store_n(&is_started, false, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		workers[i].ctx = ctx;
+		workers[i].index = i;
+		int rc = pthread_create(&tids[i], NULL, func, &workers[i]);
+		if (rc != 0) {
+			printf("pthread_create error = %s\n", strerror(rc));
+			exit(-1);
+		}
+	}
+	uint64_t start = bench_clock_ns();
+	__atomic_store_n(&is_started, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < count; ++i)
+		pthread_join(tids[i], NULL);
+	return bench_clock_ns() - start;
+}
+
+static void
+report(const char *name, int count, const char *who, const char *unit,
+       double *samples)
+{
+	char full_name[128];
+	snprintf(full_name, sizeof(full_name), "%s, %d %s", name, count, who);
+	bench_report(full_name, unit, samples, opts.run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mutex.
+
+struct mutex_ctx {
+	pthread_mutex_t mutex;
+	uint64_t counter;
+	uint64_t lock_count;
+};
+
+static void *
+mutex_worker_f(void *arg)
+{
+	struct worker *w = arg;
+	struct mutex_ctx *ctx = w->ctx;
+	worker_start(w);
+	for (uint64_t i = 0; i < ctx->lock_count; ++i) {
+		pthread_mutex_lock(&ctx->mutex);
+		++ctx->counter;
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+static void
+bench_mutex(int thread_count, double *samples)
+{
+	for (int r = 0; r < opts.run_count; ++r) {
+		struct mutex_ctx *ctx = shared_alloc(sizeof(*ctx));
+		pthread_mutex_init(&ctx->mutex, NULL);
+		ctx->lock_count = scaled(MUTEX_LOCK_COUNT) / thread_count;
+		uint64_t total = ctx->lock_count * thread_count;
+		uint64_t duration = team_run(thread_count, mutex_worker_f, ctx);
+		samples[r] = (double)duration / total;
+		pthread_mutex_destroy(&ctx->mutex);
+		shared_free(ctx, sizeof(*ctx));
+	}
+	report("mutex", thread_count, "threads", "ns per lock", samples);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Create + join.
+
+struct create_join_ctx {
+	uint64_t pair_count;
+};
+
+static void *
+empty_f(void *arg)
+{
+	return arg;
+}
+
+static void *
+create_join_worker_f(void *arg)
+{
+	struct worker *w = arg;
+	struct create_join_ctx *ctx = w->ctx;
+	worker_start(w);
+	for (uint64_t i = 0; i < ctx->pair_count; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, empty_f, NULL) != 0)
+			abort();
+		pthread_join(tid, NULL);
+	}
+	return NULL;
+}
+
+static void
+bench_create_join(int thread_count, double *samples)
+{
+	struct create_join_ctx ctx;
+	ctx.pair_count = scaled(CREATE_JOIN_COUNT) / thread_count;
+	uint64_t total = ctx.pair_count * thread_count;
+	for (int r = 0; r < opts.run_count; ++r) {
+		uint64_t duration = team_run(thread_count, create_join_worker_f,
+					     &ctx);
+		samples[r] = (double)duration / total;
+	}
+	report("create_join", thread_count, "threads", "ns per pair", samples);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Atomics.
+
+struct atomic_ctx {
+	uint64_t counter;
+	/* The stored value is not in the counter's cache line. */
+	uint64_t value __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t target;
+	bool is_seq_cst;
+};
+
+static void *
+atomic_worker_f(void *arg)
+{
+	struct worker *w = arg;
+	struct atomic_ctx *ctx = w->ctx;
+	volatile uint64_t random_on_stack = (uint64_t)w->index;
+	worker_start(w);
+	/* The order must be a constant, so there are 2 loops. */
+	if (ctx->is_seq_cst) {
+		while (__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED) <
+		       ctx->target) {
+			__atomic_store_n(&ctx->value, random_on_stack,
+					 __ATOMIC_SEQ_CST);
+		}
+	} else {
+		while (__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED) <
+		       ctx->target) {
+			__atomic_store_n(&ctx->value, random_on_stack,
+					 __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static void
+bench_atomic(int thread_count, double *samples)
+{
+	for (int is_seq_cst = 0; is_seq_cst <= 1; ++is_seq_cst) {
+		for (int r = 0; r < opts.run_count; ++r) {
+			struct atomic_ctx *ctx = shared_alloc(sizeof(*ctx));
+			ctx->target = scaled(ATOMIC_INCREMENT_COUNT);
+			ctx->is_seq_cst = is_seq_cst;
+			uint64_t duration = team_run(thread_count,
+						     atomic_worker_f, ctx);
+			samples[r] = (double)duration / (ctx->target / 1000.0);
+			shared_free(ctx, sizeof(*ctx));
+		}
+		report(is_seq_cst ? "atomic seq_cst" : "atomic relaxed",
+		       thread_count, "threads", "ns per 1000", samples);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Condition variable.
+
+struct cond_ctx {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t signal_count;
+	bool is_broadcast;
+	bool is_stopped;
+};
+
+/** Worker 0 signals, the others wait. */
+static void *
+cond_worker_f(void *arg)
+{
+	struct worker *w = arg;
+	struct cond_ctx *ctx = w->ctx;
+	worker_start(w);
+	if (w->index != 0) {
+		pthread_mutex_lock(&ctx->mutex);
+		while (!ctx->is_stopped)
+			pthread_cond_wait(&ctx->cond, &ctx->mutex);
+		pthread_mutex_unlock(&ctx->mutex);
+		return NULL;
+	}
+	for (uint64_t i = 0; i < ctx->signal_count; ++i) {
+		pthread_mutex_lock(&ctx->mutex);
+		if (ctx->is_broadcast)
+			pthread_cond_broadcast(&ctx->cond);
+		else
+			pthread_cond_signal(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->is_stopped = true;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+/** The thread count is the waiters, the signaling one is extra. */
+static void
+bench_cond(int thread_count, double *samples)
+{
+	for (int is_broadcast = 0; is_broadcast <= 1; ++is_broadcast) {
+		for (int r = 0; r < opts.run_count; ++r) {
+			struct cond_ctx *ctx = shared_alloc(sizeof(*ctx));
+			pthread_mutex_init(&ctx->mutex, NULL);
+			pthread_cond_init(&ctx->cond, NULL);
+			ctx->signal_count = scaled(COND_SIGNAL_COUNT);
+			ctx->is_broadcast = is_broadcast;
+			uint64_t duration = team_run(thread_count + 1,
+						     cond_worker_f, ctx);
+			samples[r] = (double)duration / ctx->signal_count;
+			pthread_cond_destroy(&ctx->cond);
+			pthread_mutex_destroy(&ctx->mutex);
+			shared_free(ctx, sizeof(*ctx));
+		}
+		report(is_broadcast ? "cond broadcast" : "cond signal",
+		       thread_count, "waiters", "ns per call", samples);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// False sharing.
+
+struct false_sharing_ctx {
+	uint64_t *numbers;
+	int stride;
+	uint64_t target;
+};
+
+static void *
+false_sharing_worker_f(void *arg)
+{
+	struct worker *w = arg;
+	struct false_sharing_ctx *ctx = w->ctx;
+	volatile uint64_t *number = &ctx->numbers[w->index * ctx->stride];
+	worker_start(w);
+	while (*number < ctx->target)
+		++*number;
+	return NULL;
+}
+
+static void
+bench_false_sharing(int thread_count, double *samples)
+{
+	static const int strides[] = {1, CACHE_LINE_SIZE / sizeof(uint64_t)};
+	for (int i = 0; i < 2; ++i) {
+		struct false_sharing_ctx ctx;
+		ctx.stride = strides[i];
+		ctx.target = scaled(FALSE_SHARING_INCREMENT_COUNT);
+		size_t size = sizeof(uint64_t) * ctx.stride * thread_count;
+		for (int r = 0; r < opts.run_count; ++r) {
+			ctx.numbers = shared_alloc(size);
+			uint64_t duration = team_run(thread_count,
+						     false_sharing_worker_f,
+						     &ctx);
+			samples[r] = (double)duration / (ctx.target / 1000.0);
+			shared_free(ctx.numbers, size);
+		}
+		report(i == 0 ? "false_sharing close" : "false_sharing distant",
+		       thread_count, "threads", "ns per 1000", samples);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int
+numa_node_count(void)
+{
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir == NULL)
+		return 1;
+	int count = 0;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (strncmp(e->d_name, "node", 4) == 0 &&
+		    e->d_name[4] >= '0' && e->d_name[4] <= '9')
+			++count;
+	}
+	closedir(dir);
+	return count > 0 ? count : 1;
+}
+
+static void
+cpu_model(char *buf, size_t size)
+{
+	snprintf(buf, size, "unknown");
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	if (f == NULL)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *value = strchr(line, ':');
+		if (value == NULL || (strncmp(line, "model name", 10) != 0 &&
+				      strncmp(line, "CPU part", 8) != 0))
+			continue;
+		value += 2;
+		value[strcspn(value, "\n")] = 0;
+		snprintf(buf, size, "%s", value);
+		break;
+	}
+	fclose(f);
+}
+
+static void
+print_machine(int cpu_count)
+{
+	char model[128];
+	cpu_model(model, sizeof(model));
+	if (is_json()) {
+		printf("{\"machine\": ");
+		bench_print_json_string(model);
+		printf(", \"cpus\": %d, \"numa_nodes\": %d, \"pinned\": %s, "
+		       "\"mem_node\": %d, \"scale\": %.3lf}\n", cpu_count,
+		       numa_node_count(), opts.cpu_count > 0 ? "true" : "false",
+		       opts.mem_node, opts.scale);
+		return;
+	}
+	printf("%s, %d CPUs, %d NUMA nodes, %s, memory on %s, scale %.3lf\n",
+	       model, cpu_count, numa_node_count(),
+	       opts.cpu_count > 0 ? "pinned" : "not pinned",
+	       opts.mem_node >= 0 ? "the given node" : "any node", opts.scale);
+}
+
+static void
+usage(void)
+{
+	printf("Usage: ./a.out [-b mutex,create_join,atomic,cond,false_sharing] "
+	       "[-t threads,...] [-c cpus] [-m node] [-s scale] [-r runs]\n");
+	exit(-1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	opts.mem_node = -1;
+	opts.scale = 1;
+	opts.run_count = BENCH_RUN_COUNT;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:t:c:m:s:r:")) != -1) {
+		switch (opt) {
+		case 'b': opts.filter = optarg; break;
+		case 't':
+			opts.thread_count_count = parse_list(optarg,
+				opts.thread_counts, THREAD_COUNT_MAX);
+			if (opts.thread_count_count <= 0)
+				usage();
+			break;
+		case 'c':
+			opts.cpu_count = parse_list(optarg, opts.cpus,
+						    CPU_COUNT_MAX);
+			if (opts.cpu_count <= 0)
+				usage();
+			break;
+		case 'm': opts.mem_node = atoi(optarg); break;
+		case 's': opts.scale = atof(optarg); break;
+		case 'r': opts.run_count = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc || opts.mem_node >= 64 || opts.scale <= 0 ||
+	    opts.run_count < 1)
+		usage();
+	if (opts.thread_count_count == 0) {
+		int count = 0;
+		for (int i = 1; i <= 3; ++i)
+			opts.thread_counts[count++] = i;
+		for (int i = 4; i <= cpu_count && count < THREAD_COUNT_MAX; i *= 2)
+			opts.thread_counts[count++] = i;
+		opts.thread_count_count = count;
+	}
+	for (int i = 0; i < opts.thread_count_count; ++i) {
+		if (opts.thread_counts[i] < 1 ||
+		    opts.thread_counts[i] >= THREAD_COUNT_MAX)
+			usage();
+	}
+	print_machine(cpu_count);
+
+	static const struct {
+		const char *name;
+		void (*func)(int thread_count, double *samples);
+	} benches[] = {
+		{"mutex", bench_mutex},
+		{"create_join", bench_create_join},
+		{"atomic", bench_atomic},
+		{"cond", bench_cond},
+		{"false_sharing", bench_false_sharing},
+	};
+	double *samples = malloc(sizeof(*samples) * opts.run_count);
+	for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); ++b) {
+		if (!is_selected(benches[b].name))
+			continue;
+		for (int i = 0; i < opts.thread_count_count; ++i)
+			benches[b].func(opts.thread_counts[i], samples);
+		fflush(stdout);
+	}
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,355 @@
+#include "iocoro.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+// Echo server benchmark. The server runs on its IOMultiCore, the clients on another one
+// in the same process. Each client sends a message, waits for it to come back, and
+// repeats until the time is out. All the clients connect first, then the requests are
+// counted for the given duration. At the end of it the memory and the coroutine and task
+// counts are taken, when all the connections are alive and busy.
+//
+//     make bench && ./bench 10000 5
+//
+
+static constexpr int theServerThreadCount = 4;
+static constexpr int theClientThreadCount = 4;
+static constexpr size_t theMessageSize = 64;
+// Connects in flight at once, to not overflow the listen backlog.
+static constexpr uint32_t theConnectBatch = 256;
+// Loopback has about 28k ephemeral ports per source address. The clients are spread
+// over several of them.
+static constexpr uint32_t theClientsPerAddress = 20000;
+static constexpr uint64_t theWarmupUsec = 500'000;
+
+enum BenchPhase
+{
+	BENCH_PHASE_WARMUP,
+	BENCH_PHASE_MEASURE,
+	BENCH_PHASE_STOP,
+};
+
+static std::atomic_int theBenchPhase{BENCH_PHASE_WARMUP};
+static std::atomic_uint32_t theConnectedCount{0};
+static std::atomic_uint32_t theFinishedCount{0};
+static std::atomic_uint32_t theServerConnCount{0};
+static std::atomic_bool theIsAcceptFinished{false};
+
+// Latencies of all the clients, in microseconds.
+static std::mutex theLatencyMutex;
+static std::vector<uint32_t> theLatencies;
+
+static uint64_t
+getUsec();
+
+static void
+makeFdNonblock(
+	int fd);
+
+struct BenchMemory
+{
+	uint64_t myRssKb;
+	uint64_t myPeakRssKb;
+};
+
+static BenchMemory
+readMemory();
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static IOCoroutine
+coroServeConnection(
+	IOMultiCore &cores,
+	int sock)
+{
+	IOTask *task = co_await cores.asyncSubscribe(sock);
+	while (true)
+	{
+		IOBuffer buf = co_await task->asyncRecvPooled();
+		if (buf.size() <= 0)
+			break;
+		size_t sent = 0;
+		while (sent < (size_t)buf.size())
+		{
+			ssize_t rc = co_await task->asyncSend(buf.data() + sent, buf.size() - sent);
+			assert(rc > 0);
+			sent += rc;
+		}
+	}
+	task->close();
+	theServerConnCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static IOCoroutine
+coroAccept(
+	IOMultiCore &cores,
+	IOTask *task)
+{
+	while (true)
+	{
+		int sock = co_await task->asyncAccept(nullptr, nullptr);
+		// Could be cancel.
+		if (sock < 0)
+			break;
+		makeFdNonblock(sock);
+		theServerConnCount.fetch_add(1, std::memory_order_relaxed);
+		coroServeConnection(cores, sock);
+	}
+	theIsAcceptFinished.store(true, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static IOCoroutine
+coroClient(
+	IOMultiCore &cores,
+	uint16_t port,
+	uint32_t idx)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	assert(sock >= 0);
+	makeFdNonblock(sock);
+	// The port is chosen on connect then, only unique for the full address tuple.
+	int value = 1;
+	int rc = setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &value, sizeof(value));
+	assert(rc == 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + idx / theClientsPerAddress);
+	rc = bind(sock, (sockaddr *)&addr, sizeof(addr));
+	assert(rc == 0);
+	IOTask *task = co_await cores.asyncSubscribe(sock);
+
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rc = co_await task->asyncConnect((sockaddr *)&addr, sizeof(addr));
+	assert(rc == 0);
+	theConnectedCount.fetch_add(1, std::memory_order_relaxed);
+
+	char msg[theMessageSize];
+	memset(msg, 'x', sizeof(msg));
+	std::vector<uint32_t> latencies;
+	int phase;
+	while ((phase = theBenchPhase.load(std::memory_order_relaxed)) != BENCH_PHASE_STOP)
+	{
+		uint64_t t1 = getUsec();
+		size_t size = 0;
+		while (size < theMessageSize)
+		{
+			ssize_t rc = co_await task->asyncSend(msg + size, theMessageSize - size);
+			assert(rc > 0);
+			size += rc;
+		}
+		size = 0;
+		while (size < theMessageSize)
+		{
+			IOBuffer buf = co_await task->asyncRecvPooled();
+			assert(buf.size() > 0);
+			size += buf.size();
+		}
+		if (phase == BENCH_PHASE_MEASURE)
+			latencies.push_back(getUsec() - t1);
+	}
+	task->close();
+	{
+		std::unique_lock lock(theLatencyMutex);
+		theLatencies.insert(theLatencies.end(), latencies.begin(), latencies.end());
+	}
+	theFinishedCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint16_t
+startServer(
+	IOMultiCore &cores,
+	IOTask *&task)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	socklen_t len = sizeof(addr);
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	assert(sock >= 0);
+	int value = 1;
+	int rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+	assert(rc == 0);
+	rc = bind(sock, (sockaddr *)&addr, len);
+	assert(rc == 0);
+	rc = listen(sock, SOMAXCONN);
+	assert(rc == 0);
+	rc = getsockname(sock, (sockaddr *)&addr, &len);
+	assert(rc == 0);
+	makeFdNonblock(sock);
+	// The cores aren't started yet, so the coroutine can start here.
+	task = cores.subscribe(sock);
+	coroAccept(cores, task);
+	return ntohs(addr.sin_port);
+}
+
+static void
+waitFor(
+	const std::atomic_uint32_t &counter,
+	uint32_t target)
+{
+	while (counter.load(std::memory_order_relaxed) != target)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+static uint32_t
+percentile(
+	const std::vector<uint32_t> &sorted,
+	double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min<size_t>(sorted.size() * p, sorted.size() - 1)];
+}
+
+static int
+run(
+	uint32_t clientCount,
+	uint32_t durationSec)
+{
+	// Both ends of every connection are in this process.
+	rlimit lim;
+	int rc = getrlimit(RLIMIT_NOFILE, &lim);
+	assert(rc == 0);
+	rlim_t need = (rlim_t)clientCount * 2 + 64;
+	if (lim.rlim_cur < need)
+	{
+		lim.rlim_cur = std::min(lim.rlim_max, need);
+		setrlimit(RLIMIT_NOFILE, &lim);
+		if (lim.rlim_cur < need)
+		{
+			std::cerr << "need " << need << " fds, the limit is " << lim.rlim_cur
+				<< std::endl;
+			return -1;
+		}
+	}
+	std::cout << "bench: " << clientCount << " clients, " << theServerThreadCount
+		<< " server threads, " << theClientThreadCount << " client threads, "
+		<< theMessageSize << " byte messages, " << durationSec << " s" << std::endl;
+
+	IOMultiCore serverCores(theServerThreadCount);
+	IOTask *listener = nullptr;
+	uint16_t port = startServer(serverCores, listener);
+	serverCores.start();
+	IOMultiCore clientCores(theClientThreadCount);
+	clientCores.start();
+
+	uint64_t t1 = getUsec();
+	for (uint32_t i = 0; i < clientCount; ++i)
+	{
+		while (i - theConnectedCount.load(std::memory_order_relaxed) >= theConnectBatch)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		coroClient(clientCores, port, i);
+	}
+	waitFor(theConnectedCount, clientCount);
+	uint64_t t2 = getUsec();
+	std::cout << "connected in " << (t2 - t1) / 1000 << " ms" << std::endl;
+
+	std::this_thread::sleep_for(std::chrono::microseconds(theWarmupUsec));
+	theBenchPhase.store(BENCH_PHASE_MEASURE, std::memory_order_relaxed);
+	t1 = getUsec();
+	std::this_thread::sleep_for(std::chrono::seconds(durationSec));
+	// All the connections are busy now, it is the peak.
+	BenchMemory mem = readMemory();
+	int coroCount = IOCoroutinePromise::theCount.load(std::memory_order_relaxed);
+	int taskCount = IOTask::theCount.load(std::memory_order_relaxed);
+	theBenchPhase.store(BENCH_PHASE_STOP, std::memory_order_relaxed);
+	t2 = getUsec();
+	waitFor(theFinishedCount, clientCount);
+	waitFor(theServerConnCount, 0);
+
+	listener->close();
+	while (!theIsAcceptFinished.load(std::memory_order_acquire))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	clientCores.stop();
+	serverCores.stop();
+
+	std::vector<uint32_t> &lat = theLatencies;
+	std::sort(lat.begin(), lat.end());
+	double sec = (t2 - t1) / 1'000'000.0;
+	printf("requests/s: %.0lf\n", lat.size() / sec);
+	printf("latency us: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+		percentile(lat, 0.5), percentile(lat, 0.9), percentile(lat, 0.99),
+		percentile(lat, 0.999), lat.empty() ? 0 : lat.back());
+	// The clients are in the same process, their half is counted too.
+	printf("rss: %.1lf MB, peak %.1lf MB, %.2lf KB per connection\n",
+		mem.myRssKb / 1024.0, mem.myPeakRssKb / 1024.0,
+		(double)mem.myRssKb / clientCount);
+	printf("at peak: %d coroutines, %d tasks\n", coroCount, taskCount);
+	return 0;
+}
+
+int
+main(
+	int argc,
+	char **argv)
+{
+	uint32_t clientCount = argc > 1 ? atoi(argv[1]) : 1000;
+	uint32_t durationSec = argc > 2 ? atoi(argv[2]) : 5;
+	if (clientCount == 0 || durationSec == 0)
+	{
+		std::cout << "Usage: bench [clients] [seconds]" << std::endl;
+		return -1;
+	}
+	int rc = run(clientCount, durationSec);
+	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
+	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
+	return rc;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+getUsec()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
+}
+
+static void
+makeFdNonblock(
+	int fd)
+{
+	int rc = fcntl(fd, F_GETFL, 0);
+	assert(rc >= 0);
+	rc = fcntl(fd, F_SETFL, rc | O_NONBLOCK);
+	assert(rc == 0);
+}
+
+static BenchMemory
+readMemory()
+{
+	BenchMemory res = {0, 0};
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == nullptr)
+		return res;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		unsigned long long kb;
+		if (sscanf(line, "VmRSS: %llu", &kb) == 1)
+			res.myRssKb = kb;
+		else if (sscanf(line, "VmHWM: %llu", &kb) == 1)
+			res.myPeakRssKb = kb;
+	}
+	fclose(f);
+	return res;
+}
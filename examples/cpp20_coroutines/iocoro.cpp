@@ -2,225 +2,236 @@
 
 #include <cassert>
 #include <cstring>
-#include <sys/epoll.h>
-#include <sys/eventfd.h>
-
-static constexpr int theEpollBatchSize = 128;
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 std::atomic_int IOCoroutinePromise::theCount{0};
 std::atomic_int IOTask::theCount{0};
 
+// The parts not depending on the way the kernel is asked for IO. The backends are in
+// iocoro_epoll.cpp and iocoro_uring.cpp.
+
+// The frame sizes are rounded up to this step. Each step has its own free list.
+static constexpr size_t theFrameSizeStep = 64;
+static constexpr size_t theFrameBucketCount = 16;
+// The frames can be freed by another thread than the one which allocated them. Then one
+// thread's lists only grow. Keep them limited.
+static constexpr size_t theFrameBucketMaxCount = 1024;
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncOperation::AsyncOperation(IOTask *sub)
-	: myTask(sub)
+class IOFrameCache
+{
+public:
+	IOFrameCache() { memset(myBuckets, 0, sizeof(myBuckets)); }
+	~IOFrameCache();
+
+	void *
+	alloc(
+		size_t size);
+
+	void
+	free(
+		void *ptr,
+		size_t size);
+
+private:
+	struct Frame
+	{
+		Frame *myNext;
+	};
+
+	struct Bucket
+	{
+		Frame *myHead;
+		size_t myCount;
+	};
+
+	Bucket myBuckets[theFrameBucketCount];
+};
+
+static thread_local IOFrameCache theFrameCache;
+
+IOFrameCache::~IOFrameCache()
 {
+	for (Bucket &b : myBuckets)
+	{
+		while (b.myHead != nullptr)
+		{
+			Frame *f = b.myHead;
+			b.myHead = f->myNext;
+			::operator delete(f);
+		}
+	}
 }
 
-bool
-AsyncOperation::await_suspend(
-	std::coroutine_handle<> coro)
+void *
+IOFrameCache::alloc(
+	size_t size)
 {
-	assert(myTask->myAsyncOp == nullptr);
-	myCoro = coro;
-	myTask->myAsyncOp = this;
-	return true;
+	size_t idx = (size - 1) / theFrameSizeStep;
+	if (idx >= theFrameBucketCount)
+		return ::operator new(size);
+	Bucket &b = myBuckets[idx];
+	if (b.myHead == nullptr)
+		return ::operator new((idx + 1) * theFrameSizeStep);
+	Frame *f = b.myHead;
+	b.myHead = f->myNext;
+	--b.myCount;
+	return f;
+}
+
+void
+IOFrameCache::free(
+	void *ptr,
+	size_t size)
+{
+	size_t idx = (size - 1) / theFrameSizeStep;
+	if (idx >= theFrameBucketCount || myBuckets[idx].myCount == theFrameBucketMaxCount)
+	{
+		::operator delete(ptr);
+		return;
+	}
+	Bucket &b = myBuckets[idx];
+	Frame *f = (Frame *)ptr;
+	f->myNext = b.myHead;
+	b.myHead = f;
+	++b.myCount;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncRecv::AsyncRecv(
-	IOTask *sub,
-	void *data,
+void *
+IOCoroutinePromise::operator new(
 	size_t size)
-	: AsyncOperation(sub)
-	, myData(data)
-	, mySize(size)
-	, myRes(-1)
 {
-	execute();
+	return theFrameCache.alloc(size);
 }
 
 void
-AsyncRecv::execute()
+IOCoroutinePromise::operator delete(
+	void *ptr,
+	size_t size)
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-		return;
-	myRes = recv(myTask->myFd, myData, mySize, 0);
-	if (myRes >= 0)
-		return;
-	assert(errno == EWOULDBLOCK);
-	// The event is consumed, no more data to read. Wait for a new event.
-	myTask->myEventsReady &= ~IO_EVENT_READ;
+	theFrameCache.free(ptr, size);
 }
 
-bool
-AsyncRecv::onIOEvent()
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+ioClockUsec()
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
-	}
-	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
-		return false;
-	myCoro.resume();
-	return true;
+	timespec ts;
+	int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(rc == 0);
+	return (uint64_t)ts.tv_sec * 1'000'000 + ts.tv_nsec / 1000;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncSend::AsyncSend(
+AsyncOperation::AsyncOperation(
 	IOTask *sub,
-	const void *data,
-	size_t size)
-	: AsyncOperation(sub)
-	, myData(data)
-	, mySize(size)
+	int timeoutMs)
+	: myTask(sub)
+	, myTimeoutMs(timeoutMs)
 	, myRes(-1)
+	, myIsTimedOut(false)
 {
-	execute();
 }
 
 void
-AsyncSend::execute()
-{
-	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
-		return;
-	myRes = send(myTask->myFd, myData, mySize, 0);
-	if (myRes >= 0)
-		return;
-	assert(errno == EWOULDBLOCK);
-	// Can't write anymore. Need to wait for a new write-event.
-	myTask->myEventsReady &= ~IO_EVENT_WRITE;
-}
-
-bool
-AsyncSend::onIOEvent()
+AsyncOperation::resume()
 {
-	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
-	}
-	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
-		return false;
+	if (isArmed())
+		myTask->myCore.removeTimer(this);
 	myCoro.resume();
-	return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncAccept::AsyncAccept(
-	IOTask *sub,
-	sockaddr *addr,
-	socklen_t *size)
-	: AsyncOperation(sub)
-	, myAddr(addr)
-	, mySize(size)
-	, myRes(-1)
+IOBuffer::IOBuffer(
+	IOBuffer &&other)
+	: myCore(other.myCore)
+	, myData(other.myData)
+	, myId(other.myId)
+	, mySize(other.mySize)
+{
+	other.myCore = nullptr;
+	other.myData = nullptr;
+}
+
+IOBuffer&
+IOBuffer::operator=(
+	IOBuffer &&other)
 {
-	execute();
+	if (this == &other)
+		return *this;
+	release();
+	myCore = other.myCore;
+	myData = other.myData;
+	myId = other.myId;
+	mySize = other.mySize;
+	other.myCore = nullptr;
+	other.myData = nullptr;
+	return *this;
 }
 
 void
-AsyncAccept::execute()
+IOBuffer::release()
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	if (myCore == nullptr)
 		return;
-	myRes = accept(myTask->myFd, myAddr, mySize);
-	if (myRes >= 0)
-		return;
-	assert(errno == EWOULDBLOCK);
-	// Can't accept anymore. Need to wait for a new read-event.
-	myTask->myEventsReady &= ~IO_EVENT_READ;
+	myCore->releaseBuffer(myId);
+	myCore = nullptr;
+	myData = nullptr;
 }
 
-bool
-AsyncAccept::onIOEvent()
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOBuffer
+AsyncRecvPooled::await_resume()
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
-	}
-	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
-		return false;
-	myCoro.resume();
-	return true;
+	// Nothing to read in the buffer on an error or EOF.
+	if (myRes <= 0)
+		myBuffer.release();
+	myBuffer.mySize = myRes;
+	return std::move(myBuffer);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncConnect::AsyncConnect(
-	IOTask *sub,
-	const sockaddr *addr,
-	socklen_t size)
-	: AsyncOperation(sub)
-	, myIsDone(false)
-	, myRes(-1)
+AsyncSubscribe::AsyncSubscribe(
+	IOTask *sub)
+	: AsyncOperation(sub, -1)
 {
-	int rc = connect(myTask->myFd, addr, size);
-	if (rc == 0)
-	{
-		// Event async connect might succeed instantly.
-		myIsDone = true;
-		myRes = 0;
-		return;
-	}
-	// Connect is started. When the socket gets writable, it means the connect is done.
-	assert(errno == EINPROGRESS);
-	// Apparently, it is not writable yet.
-	myTask->myEventsReady &= ~IO_EVENT_WRITE;
 }
 
 bool
-AsyncConnect::onIOEvent()
+AsyncSubscribe::await_suspend(
+	std::coroutine_handle<> coro)
 {
-	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
-	}
-	myIsDone = true;
-	myRes = 0;
-	myCoro.resume();
+	assert(myTask->myAsyncOp == nullptr);
+	myCoro = coro;
+	myTask->myAsyncOp = this;
+	myTask->myState = IO_TASK_STATE_SUBSCRIBING;
+	// Only now, when the coroutine is fully stopped, the core can take the task.
+	myTask->myCore.pushTask(myTask);
 	return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+void
+AsyncSleep::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.addTimer(this, myMs);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 IOTask::IOTask(
 	IOCore &core,
 	int fd)
@@ -230,9 +241,17 @@ IOTask::IOTask(
 	, myEventsReady(0)
 	, myAsyncOp(nullptr)
 	, myCore(core)
+	, myNext(nullptr)
 {
 	LOG_DEBUG("IOTask create");
 	theCount.fetch_add(1, std::memory_order_relaxed);
+#ifdef IOCORO_URING
+	// io_uring fails the requests on a non-blocking fd with EAGAIN instead of waiting.
+	int rc = fcntl(fd, F_GETFL, 0);
+	assert(rc >= 0);
+	rc = fcntl(fd, F_SETFL, rc & ~O_NONBLOCK);
+	assert(rc == 0);
+#endif
 }
 
 IOTask::~IOTask()
@@ -254,31 +273,6 @@ IOTask::close()
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-IOCore::IOCore()
-	: myFd(epoll_create1(0))
-{
-	LOG_DEBUG("IOCore create");
-	myIsStopped = false;
-	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
-	// example, to let IOCore know, that there are new or deleting tasks to process.
-	myEventFd = eventfd(0, EFD_NONBLOCK);
-	myEventSub = subscribe(myEventFd);
-}
-
-IOCore::~IOCore()
-{
-	LOG_DEBUG("IOCore destroy");
-	unsubscribe(myEventSub);
-	myEventSub = nullptr;
-	myEventFd = -1;
-	processQueues();
-	assert(myTasks.empty());
-	assert(myQueue.empty());
-	assert(myFd >= 0);
-	int rc = close(myFd);
-	assert(rc == 0);
-}
-
 void
 IOCore::wakeup()
 {
@@ -291,15 +285,8 @@ IOTask *
 IOCore::subscribe(
 	int fd)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
 	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	pushTask(s);
 	return s;
 }
 
@@ -307,118 +294,206 @@ void
 IOCore::unsubscribe(
 	IOTask *s)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
+	assert(&s->myCore == this);
 	assert(s->myState == IO_TASK_STATE_WORKING);
 	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	pushTask(s);
 }
 
 void
-IOCore::roll()
+IOCore::pushTask(
+	IOTask *s)
 {
-	processQueues();
-	epoll_event evs[theEpollBatchSize];
-	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
-	if (rc < 0 && errno == EINTR)
-		return;
-	assert(rc >= 0);
-	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
-	for (int i = 0; i < rc; ++i)
+	assert(s->myNext == nullptr);
+	IOTask *head = myQueue.load(std::memory_order_relaxed);
+	do
 	{
-		epoll_event& ev = evs[i];
-		IOTask *s = (IOTask *)ev.data.ptr;
-		int mask = 0;
-		if ((ev.events & EPOLLIN) != 0)
-			mask |= IO_EVENT_READ;
-		if ((ev.events & EPOLLOUT) != 0)
-			mask |= IO_EVENT_WRITE;
-		assert((ev.events & ~(EPOLLIN | EPOLLOUT)) == 0);
-		assert(mask != 0);
-		const char *eventStr = "[empty]";
-		if ((mask & IO_EVENT_READ) && (mask & IO_EVENT_WRITE))
-		{
-			eventStr = "[read,write]";
-		}
-		else if (mask & IO_EVENT_READ)
-		{
-			eventStr = "[read]";
-		}
-		else if (mask & IO_EVENT_WRITE)
-		{
-			eventStr = "[write]";
-		}
-		LOG_THIS_DEBUG(IOCore, roll, "event " << i << ": " << eventStr);
-		s->myEventsReady |= mask;
-		AsyncOperation* op = s->myAsyncOp;
-		if (op != nullptr)
-		{
-			// Nullify in case the coroutine would try to start a new async operation.
-			s->myAsyncOp = nullptr;
-			// Restore it back in case the handling didn't work. For example, due to a
-			// spurious wakeup.
-			if (!op->onIOEvent())
-				s->myAsyncOp = op;
-		}
+		s->myNext = head;
+	} while (!myQueue.compare_exchange_weak(head, s, std::memory_order_release,
+		std::memory_order_relaxed));
+	// Only the first task in the queue wakes the core up. The ones after it find the
+	// wakeup already sent.
+	if (head == nullptr)
+		wakeup();
+}
+
+IOTask *
+IOCore::takeQueue()
+{
+	if (myQueue.load(std::memory_order_relaxed) == nullptr)
+		return nullptr;
+	IOTask *head = myQueue.exchange(nullptr, std::memory_order_acquire);
+	// The stack has the last pushed task first. Reverse it to handle the tasks in their
+	// order.
+	IOTask *res = nullptr;
+	while (head != nullptr)
+	{
+		IOTask *s = head;
+		head = s->myNext;
+		s->myNext = res;
+		res = s;
 	}
+	return res;
 }
 
 void
-IOCore::processQueues()
+IOCore::addTimer(
+	IOTimer *t,
+	uint32_t ms)
 {
-	if (mySize.load(std::memory_order_relaxed) == 0)
-		return;
-	std::unique_lock lock(myMutex);
-	if (myQueue.empty())
+	assert(t->myHeapIdx < 0);
+	t->myDeadline = ioClockUsec() + (uint64_t)ms * 1000;
+	t->myHeapIdx = myTimers.size();
+	myTimers.push_back(t);
+	timerSiftUp(t->myHeapIdx);
+}
+
+void
+IOCore::removeTimer(
+	IOTimer *t)
+{
+	int idx = t->myHeapIdx;
+	assert(idx >= 0 && myTimers[idx] == t);
+	t->myHeapIdx = -1;
+	IOTimer *last = myTimers.back();
+	myTimers.pop_back();
+	if (last == t)
 		return;
-	for (IOTask *s : myQueue)
+	// The last one takes the hole and goes whichever way restores the order.
+	myTimers[idx] = last;
+	last->myHeapIdx = idx;
+	timerSiftUp(idx);
+	timerSiftDown(last->myHeapIdx);
+}
+
+int
+IOCore::processTimers()
+{
+	if (myTimers.empty())
+		return -1;
+	uint64_t now = ioClockUsec();
+	bool isFired = false;
+	while (!myTimers.empty())
 	{
-		if (s->myState == IO_TASK_STATE_NEW)
-		{
-			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
-			s->myState = IO_TASK_STATE_WORKING;
-			// Assume that in a new socket all the events are there. The task will clear
-			// those which are not really available yet.
-			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
-			s->myIdx = myTasks.size();
-			epoll_event ev;
-			memset(&ev, 0, sizeof(ev));
-			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-			ev.data.ptr = (void *)s;
-			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
-			assert(rc == 0);
-			myTasks.push_back(s);
-		}
-		else if (s->myState == IO_TASK_STATE_DELETING)
-		{
-			assert(myTasks.size() > s->myIdx);
-			assert(myTasks[s->myIdx] == s);
-			assert(s->myFd >= 0);
-			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
-			// Cyclic deletion, for O(1).
-			myTasks.back()->myIdx = s->myIdx;
-			myTasks[s->myIdx] = myTasks.back();
-			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
-			assert(rc == 0);
-			if (s->myAsyncOp != nullptr)
-			{
-				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
-				s->myEventsReady = 0;
-				s->myAsyncOp->onIOEvent();
-				s->myAsyncOp = nullptr;
-			}
-			delete s;
-			myTasks.resize(myTasks.size() - 1);
-		}
-		else
+		IOTimer *t = myTimers.front();
+		if (t->myDeadline > now)
 		{
-			assert(false);
+			if (isFired)
+				break;
+			// Rounded up so as not to wake up before the deadline.
+			return (t->myDeadline - now + 999) / 1000;
 		}
+		removeTimer(t);
+		LOG_THIS_DEBUG(IOCore, processTimers, "fire " << t);
+		t->onTimeout();
+		isFired = true;
+	}
+	// The resumed coroutines might have changed something the caller waits for. Let it
+	// check that before sleeping again.
+	return isFired ? 0 : -1;
+}
+
+void
+IOCore::timerSiftUp(
+	int idx)
+{
+	IOTimer *t = myTimers[idx];
+	while (idx > 0)
+	{
+		int parent = (idx - 1) / 2;
+		IOTimer *p = myTimers[parent];
+		if (p->myDeadline <= t->myDeadline)
+			break;
+		myTimers[idx] = p;
+		p->myHeapIdx = idx;
+		idx = parent;
 	}
-	myQueue.clear();
-	mySize.store(myTasks.size(), std::memory_order_relaxed);
+	myTimers[idx] = t;
+	t->myHeapIdx = idx;
+}
+
+void
+IOCore::timerSiftDown(
+	int idx)
+{
+	IOTimer *t = myTimers[idx];
+	int size = myTimers.size();
+	while (true)
+	{
+		int child = idx * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+			myTimers[child + 1]->myDeadline < myTimers[child]->myDeadline)
+			++child;
+		IOTimer *c = myTimers[child];
+		if (t->myDeadline <= c->myDeadline)
+			break;
+		myTimers[idx] = c;
+		c->myHeapIdx = idx;
+		idx = child;
+	}
+	myTimers[idx] = t;
+	t->myHeapIdx = idx;
+}
+
+uint32_t
+IOCore::addBuffers(
+	uint32_t count)
+{
+	char *chunk = new char[count * theIOBufferSize];
+	myBufferChunks.push_back(chunk);
+	uint32_t id = myBuffers.size();
+	for (uint32_t i = 0; i < count; ++i)
+		myBuffers.push_back(chunk + i * theIOBufferSize);
+	return id;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOMultiCore::IOMultiCore(
+	uint32_t coreCount)
+{
+	assert(coreCount > 0);
+	myCores.reserve(coreCount);
+	for (uint32_t i = 0; i < coreCount; ++i)
+		myCores.emplace_back(std::make_unique<IOCore>());
+}
+
+IOMultiCore::~IOMultiCore()
+{
+	stop();
+}
+
+void
+IOMultiCore::start()
+{
+	assert(myThreads.empty());
+	myThreads.reserve(myCores.size());
+	for (std::unique_ptr<IOCore> &core : myCores)
+	{
+		myThreads.emplace_back([c = core.get()]() {
+			while (!c->isStopped())
+				c->roll();
+		});
+	}
+}
+
+void
+IOMultiCore::stop()
+{
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->stop();
+	for (std::thread &t : myThreads)
+		t.join();
+	myThreads.clear();
+}
+
+IOCore &
+IOMultiCore::coreForFd(
+	int fd)
+{
+	// The kernel gives out the lowest free fds, so they are dense and the remainder
+	// spreads them evenly.
+	return *myCores[(uint32_t)fd % myCores.size()];
 }
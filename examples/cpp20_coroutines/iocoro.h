@@ -3,10 +3,11 @@
 #include <atomic>
 #include <coroutine>
 #include <iostream>
-#include <mutex>
+#include <memory>
 #include <sstream>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <thread>
 #include <vector>
 
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
@@ -28,9 +29,21 @@
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+struct AsyncRecvPooled;
+class IOBuffer;
 class IOCore;
+class IOMultiCore;
 class IOTask;
 
+// The backend is chosen at build time. By default the operations wait for the fd events
+// from epoll. With IOCORO_URING they are submitted to io_uring.
+#ifdef IOCORO_URING
+struct IOUring;
+struct io_uring_sqe;
+#else
+struct epoll_event;
+#endif
+
 enum IOEventBit
 {
 	IO_EVENT_READ = 1,
@@ -40,6 +53,8 @@ enum IOEventBit
 enum IOTaskState
 {
 	IO_TASK_STATE_NEW,
+	// New, and a coroutine in AsyncSubscribe waits for it.
+	IO_TASK_STATE_SUBSCRIBING,
 	IO_TASK_STATE_WORKING,
 	IO_TASK_STATE_DELETING,
 };
@@ -105,16 +120,53 @@ struct IOCoroutinePromise
 	void
 	unhandled_exception() { abort(); }
 
+	// The frames are taken from a per-thread cache of freed ones, sorted by size. Then a
+	// coroutine per request doesn't go to malloc each time.
+	static void *
+	operator new(
+		size_t size);
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size);
+
 	// Keep track of the promise count to ensure there are no memory leaks.
 	static std::atomic_int theCount;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-struct AsyncOperation
+// An entry in the core's timer heap. Fires once, in the core's thread.
+struct IOTimer
+{
+	IOTimer() : myDeadline(0), myHeapIdx(-1) {}
+
+protected:
+	bool
+	isArmed() const { return myHeapIdx >= 0; }
+
+private:
+	virtual void
+	onTimeout() = 0;
+
+	// Microseconds of the monotonic clock.
+	uint64_t myDeadline;
+	// Position in the heap, -1 when not armed.
+	int myHeapIdx;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// With a timeout >= 0 the operation is aborted when it doesn't complete in time. Then it
+// returns -1 with errno ETIMEDOUT.
+struct AsyncOperation : public IOTimer
 {
 	AsyncOperation(
-		IOTask *sub);
+		IOTask *sub,
+		int timeoutMs);
 	AsyncOperation(
 		const AsyncOperation&) = delete;
 	AsyncOperation& operator=(
@@ -128,12 +180,42 @@ struct AsyncOperation
 		std::coroutine_handle<> coro);
 
 private:
+#ifdef IOCORO_URING
+	// Fill in the request to the kernel.
+	virtual void
+	prepare(
+		io_uring_sqe *sqe) = 0;
+
+	// The request is done, the result is the syscall's one or -errno. The flags are the
+	// completion's ones.
+	virtual void
+	onComplete(
+		int res,
+		uint32_t flags) = 0;
+#else
 	virtual bool
 	onIOEvent() = 0;
+#endif
+
+	void
+	onTimeout() final;
 
 protected:
+	// Continue the coroutine, the operation is done.
+	void
+	resume();
+
+#ifdef IOCORO_URING
+	// Put the request into the submission ring.
+	void
+	submit();
+#endif
+
 	IOTask *const myTask;
 	std::coroutine_handle<> myCoro;
+	const int myTimeoutMs;
+	ssize_t myRes;
+	bool myIsTimedOut;
 
 	friend IOCore;
 };
@@ -145,7 +227,8 @@ struct AsyncRecv final : public AsyncOperation
 	AsyncRecv(
 		IOTask *sub,
 		void *data,
-		size_t size);
+		size_t size,
+		int timeoutMs);
 	AsyncRecv(
 		const AsyncRecv&) = delete;
 	AsyncRecv& operator=(
@@ -160,15 +243,25 @@ struct AsyncRecv final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
+#endif
 
 	void *const myData;
 	const size_t mySize;
-	ssize_t myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -178,7 +271,8 @@ struct AsyncSend final : public AsyncOperation
 	AsyncSend(
 		IOTask *sub,
 		const void *data,
-		size_t size);
+		size_t size,
+		int timeoutMs);
 	AsyncSend(
 		const AsyncSend&) = delete;
 	AsyncSend& operator=(
@@ -191,15 +285,25 @@ struct AsyncSend final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
+#endif
 
 	const void *const myData;
 	const size_t mySize;
-	ssize_t myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -209,7 +313,8 @@ struct AsyncAccept final : public AsyncOperation
 	AsyncAccept(
 		IOTask *sub,
 		sockaddr *addr,
-		socklen_t *size);
+		socklen_t *size,
+		int timeoutMs);
 	AsyncAccept(
 		const AsyncAccept&) = delete;
 	AsyncAccept& operator=(
@@ -222,15 +327,25 @@ struct AsyncAccept final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
+#endif
 
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
-	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -240,7 +355,8 @@ struct AsyncConnect final : public AsyncOperation
 	AsyncConnect(
 		IOTask *sub,
 		const sockaddr *addr,
-		socklen_t size);
+		socklen_t size,
+		int timeoutMs);
 	AsyncConnect(
 		const AsyncConnect&) = delete;
 	AsyncConnect& operator=(
@@ -253,11 +369,173 @@ struct AsyncConnect final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
 	bool
 	onIOEvent() final;
+#endif
 
+	const sockaddr *const myAddr;
+	const socklen_t mySize;
 	bool myIsDone;
-	int myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Size of each buffer in the core's receive pool.
+static constexpr size_t theIOBufferSize = 4096;
+
+// A buffer borrowed from the core's pool by asyncRecvPooled(). Goes back to the pool on
+// destruction, which has to happen in the core's thread.
+class IOBuffer
+{
+public:
+	IOBuffer() : myCore(nullptr), myData(nullptr), myId(0), mySize(-1) {}
+	IOBuffer(
+		IOBuffer &&other);
+	IOBuffer& operator=(
+		IOBuffer &&other);
+	~IOBuffer() { release(); }
+
+	const char *
+	data() const { return myData; }
+
+	// Received byte count. 0 on EOF, -1 on an error with errno set. No buffer is held
+	// then.
+	ssize_t
+	size() const { return mySize; }
+
+	void
+	release();
+
+private:
+	IOCore *myCore;
+	char *myData;
+	uint32_t myId;
+	ssize_t mySize;
+
+	friend AsyncRecvPooled;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Receive into a buffer from the core's pool. The buffer is only taken when the data is
+// already there, so the idle connections don't hold any receive memory.
+struct AsyncRecvPooled final : public AsyncOperation
+{
+	AsyncRecvPooled(
+		IOTask *sub,
+		int timeoutMs);
+	AsyncRecvPooled(
+		const AsyncRecvPooled&) = delete;
+	AsyncRecvPooled& operator=(
+		const AsyncRecvPooled&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	IOBuffer
+	await_resume();
+
+private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+#endif
+
+	IOBuffer myBuffer;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Hands a new fd over to its core and resumes the coroutine in the core's thread, when
+// the fd is already in the core's epoll. Then the coroutine can be started in any thread,
+// and all its operations on the task will be done by the owner core.
+struct AsyncSubscribe final : public AsyncOperation
+{
+	AsyncSubscribe(
+		IOTask *sub);
+	AsyncSubscribe(
+		const AsyncSubscribe&) = delete;
+	AsyncSubscribe& operator=(
+		const AsyncSubscribe&) = delete;
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	IOTask *
+	await_resume() { return myTask; }
+
+private:
+#ifdef IOCORO_URING
+	void
+	prepare(
+		io_uring_sqe *sqe) final;
+
+	void
+	onComplete(
+		int res,
+		uint32_t flags) final;
+#else
+	bool
+	onIOEvent() final;
+#endif
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Resumes the coroutine in the core's thread after the given time.
+struct AsyncSleep final : public IOTimer
+{
+	AsyncSleep(
+		IOCore &core,
+		uint32_t ms) : myCore(core), myMs(ms) {}
+	AsyncSleep(
+		const AsyncSleep&) = delete;
+	AsyncSleep& operator=(
+		const AsyncSleep&) = delete;
+
+	bool
+	await_ready() const noexcept { return myMs == 0; }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() {}
+
+private:
+	void
+	onTimeout() final { myCoro.resume(); }
+
+	IOCore &myCore;
+	const uint32_t myMs;
+	std::coroutine_handle<> myCoro;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -281,16 +559,23 @@ public:
 	// Those all are arguments for co_await.
 	//
 	AsyncRecv
-	asyncRecv(void *data, size_t size) { return AsyncRecv(this, data, size); }
+	asyncRecv(void *data, size_t size, int timeoutMs = -1)
+	{ return AsyncRecv(this, data, size, timeoutMs); }
+
+	AsyncRecvPooled
+	asyncRecvPooled(int timeoutMs = -1) { return AsyncRecvPooled(this, timeoutMs); }
 
 	AsyncSend
-	asyncSend(const void *data, size_t size) { return AsyncSend(this, data, size); }
+	asyncSend(const void *data, size_t size, int timeoutMs = -1)
+	{ return AsyncSend(this, data, size, timeoutMs); }
 
 	AsyncAccept
-	asyncAccept(sockaddr *addr, socklen_t *size) { return AsyncAccept(this, addr, size); }
+	asyncAccept(sockaddr *addr, socklen_t *size, int timeoutMs = -1)
+	{ return AsyncAccept(this, addr, size, timeoutMs); }
 
 	AsyncConnect
-	asyncConnect(const sockaddr *addr, socklen_t size) { return AsyncConnect(this, addr, size); }
+	asyncConnect(const sockaddr *addr, socklen_t size, int timeoutMs = -1)
+	{ return AsyncConnect(this, addr, size, timeoutMs); }
 	//
 	//////////////////////////////////////////////
 
@@ -300,18 +585,22 @@ private:
 	IOTaskState myState;
 	const int myFd;
 	int myIdx;
-	// Mask of events which are ready for consumption.
+	// Mask of events which are ready for consumption. Only used with epoll.
 	int myEventsReady;
 	// Currently waiting async operation blocked by a co_await. Coroutine can't be blocked
 	// more than once at a time, which means the current operation can only be one.
 	AsyncOperation* myAsyncOp;
 	IOCore &myCore;
+	// Link in the core's incoming queue.
+	IOTask *myNext;
 
 	friend AsyncAccept;
 	friend AsyncConnect;
 	friend AsyncOperation;
 	friend AsyncRecv;
+	friend AsyncRecvPooled;
 	friend AsyncSend;
+	friend AsyncSubscribe;
 	friend IOCore;
 };
 
@@ -333,35 +622,172 @@ struct IOCore
 	bool
 	isStopped() const { return myIsStopped.load(std::memory_order_relaxed); }
 
-	// Create a new task for async operations on the given fd.
+	// Create a new task for async operations on the given fd. Can be called from any
+	// thread, but the operations on the task must be started in the core's thread.
 	IOTask *
 	subscribe(
 		int fd);
 
+	// Same, but the coroutine waiting for it is resumed in the core's thread.
+	AsyncSubscribe
+	asyncSubscribe(
+		int fd) { return AsyncSubscribe(new IOTask(*this, fd)); }
+
 	// Destroy the task asynchronously. The memory will be freed, the task can't be used
 	// anymore after unsubscription.
 	void
 	unsubscribe(
 		IOTask *s);
 
+	// Must be awaited in the core's thread.
+	AsyncSleep
+	asyncSleep(
+		uint32_t ms) { return AsyncSleep(*this, ms); }
+
 	// Get all pending events from the kernel and handle them. Can only be done in one
 	// thread at a time.
 	void
 	roll();
 
 private:
+	void
+	addTimer(
+		IOTimer *t,
+		uint32_t ms);
+
+	void
+	removeTimer(
+		IOTimer *t);
+
+	// Fire the expired timers. Returns how many milliseconds are left until the nearest
+	// deadline, -1 when there are no timers, 0 when some have fired.
+	int
+	processTimers();
+
+	void
+	timerSiftUp(
+		int idx);
+
+	void
+	timerSiftDown(
+		int idx);
+
+	// Allocate more pool buffers in one chunk. Returns the first new ID.
+	uint32_t
+	addBuffers(
+		uint32_t count);
+
+	void
+	releaseBuffer(
+		uint32_t id);
+
+#ifdef IOCORO_URING
+	// Give the buffers to the kernel for the receive requests to pick from. When linked,
+	// the next request only starts after they are given.
+	void
+	provideBuffers(
+		uint32_t id,
+		uint32_t count,
+		bool isLinked);
+#else
+	uint32_t
+	takeBuffer();
+#endif
+
+	void
+	pushTask(
+		IOTask *s);
+
+	// Take all the queued tasks, in the order they were pushed.
+	IOTask *
+	takeQueue();
+
 	void
 	processQueues();
 
+#ifdef IOCORO_URING
+	io_uring_sqe *
+	getSqe();
+
+	// Wait for the completions no longer than the timeout, if it is >= 0.
+	void
+	submitAndWait(
+		unsigned waitCount,
+		int timeoutMs);
+
+	void
+	processCompletions();
+#endif
+
 	int myEventFd;
+#ifdef IOCORO_URING
+	IOUring *myRing;
+#else
 	IOTask *myEventSub;
 	int myFd;
+	// Grows when epoll_wait() fills it up, so a busy core takes all its events in one
+	// syscall.
+	std::vector<epoll_event> myEvents;
+#endif
 	std::atomic_bool myIsStopped;
 
-	std::mutex myMutex;
-	// Tasks currently in work.
+	// Tasks currently in work. Only touched by the core's thread.
 	std::vector<IOTask *> myTasks;
-	// Incoming tasks. New and deleting ones.
-	std::vector<IOTask *> myQueue;
-	std::atomic_uint64_t mySize;
+	// Incoming tasks. New and deleting ones. A lock-free stack: any thread pushes with a
+	// CAS, the core takes all of it at once.
+	std::atomic<IOTask *> myQueue;
+	// Min-heap of the armed timers by deadline. Only touched by the core's thread.
+	std::vector<IOTimer *> myTimers;
+	// The receive pool, each buffer by its ID. Only touched by the core's thread.
+	std::vector<char *> myBuffers;
+	std::vector<char *> myBufferChunks;
+#ifndef IOCORO_URING
+	std::vector<uint32_t> myFreeBuffers;
+#endif
+	// Buffers held by the coroutines.
+	uint32_t myBorrowedBufferCount;
+
+	friend AsyncOperation;
+	friend AsyncRecvPooled;
+	friend IOBuffer;
+	friend AsyncSleep;
+	friend AsyncSubscribe;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Multiple IOCores, each rolled by its own thread. An fd always belongs to the same core,
+// chosen by the fd's hash. The cores don't share anything, the tasks going from one
+// thread to another core pass through the target core's queue and wake it up with its
+// eventfd.
+//
+class IOMultiCore
+{
+public:
+	IOMultiCore(
+		uint32_t coreCount);
+	~IOMultiCore();
+
+	// Start the threads. The tasks subscribed before will be served from then on.
+	void
+	start();
+
+	void
+	stop();
+
+	IOCore &
+	coreForFd(
+		int fd);
+
+	IOTask *
+	subscribe(
+		int fd) { return coreForFd(fd).subscribe(fd); }
+
+	AsyncSubscribe
+	asyncSubscribe(
+		int fd) { return coreForFd(fd).asyncSubscribe(fd); }
+
+private:
+	std::vector<std::unique_ptr<IOCore>> myCores;
+	std::vector<std::thread> myThreads;
 };
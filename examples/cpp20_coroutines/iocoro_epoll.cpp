@@ -0,0 +1,481 @@
+#include "iocoro.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// The operations try the syscall right away, and only when it would block they wait for
+// the fd's readiness reported by epoll.
+
+static constexpr int theEpollBatchSizeMin = 128;
+static constexpr int theEpollBatchSizeMax = 8192;
+// The receive pool grows by at least that many buffers at once.
+static constexpr uint32_t theBufferCountMin = 16;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncOperation::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	assert(myTask->myAsyncOp == nullptr);
+	myCoro = coro;
+	myTask->myAsyncOp = this;
+	if (myTimeoutMs >= 0)
+		myTask->myCore.addTimer(this, myTimeoutMs);
+	return true;
+}
+
+void
+AsyncOperation::onTimeout()
+{
+	// The fd stays in epoll, but nothing waits for its events anymore.
+	assert(myTask->myAsyncOp == this);
+	myTask->myAsyncOp = nullptr;
+	myIsTimedOut = true;
+	myRes = -1;
+	errno = ETIMEDOUT;
+	myCoro.resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecv::AsyncRecv(
+	IOTask *sub,
+	void *data,
+	size_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myData(data)
+	, mySize(size)
+{
+	execute();
+}
+
+void
+AsyncRecv::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	myRes = recv(myTask->myFd, myData, mySize, 0);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	// The event is consumed, no more data to read. Wait for a new event.
+	myTask->myEventsReady &= ~IO_EVENT_READ;
+}
+
+bool
+AsyncRecv::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			myRes = -1;
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSend::AsyncSend(
+	IOTask *sub,
+	const void *data,
+	size_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myData(data)
+	, mySize(size)
+{
+	execute();
+}
+
+void
+AsyncSend::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	myRes = send(myTask->myFd, myData, mySize, 0);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	// Can't write anymore. Need to wait for a new write-event.
+	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+}
+
+bool
+AsyncSend::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			myRes = -1;
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncAccept::AsyncAccept(
+	IOTask *sub,
+	sockaddr *addr,
+	socklen_t *size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myAddr(addr)
+	, mySize(size)
+{
+	execute();
+}
+
+void
+AsyncAccept::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	myRes = accept(myTask->myFd, myAddr, mySize);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	// Can't accept anymore. Need to wait for a new read-event.
+	myTask->myEventsReady &= ~IO_EVENT_READ;
+}
+
+bool
+AsyncAccept::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			myRes = -1;
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncConnect::AsyncConnect(
+	IOTask *sub,
+	const sockaddr *addr,
+	socklen_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myAddr(addr)
+	, mySize(size)
+	, myIsDone(false)
+{
+	int rc = connect(myTask->myFd, addr, size);
+	if (rc == 0)
+	{
+		// Event async connect might succeed instantly.
+		myIsDone = true;
+		myRes = 0;
+		return;
+	}
+	// Connect is started. When the socket gets writable, it means the connect is done.
+	assert(errno == EINPROGRESS);
+	// Apparently, it is not writable yet.
+	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+}
+
+bool
+AsyncConnect::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			myIsDone = true;
+			myRes = -1;
+			resume();
+			return true;
+		}
+		return false;
+	}
+	myIsDone = true;
+	myRes = 0;
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecvPooled::AsyncRecvPooled(
+	IOTask *sub,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+{
+	execute();
+}
+
+void
+AsyncRecvPooled::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	// Readable, so most likely the buffer is going to be used.
+	IOCore &core = myTask->myCore;
+	uint32_t id = core.takeBuffer();
+	char *data = core.myBuffers[id];
+	myRes = recv(myTask->myFd, data, theIOBufferSize, 0);
+	if (myRes > 0)
+	{
+		myBuffer.myCore = &core;
+		myBuffer.myData = data;
+		myBuffer.myId = id;
+		return;
+	}
+	core.releaseBuffer(id);
+	if (myRes == 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	// The event is consumed, no more data to read. Wait for a new event.
+	myTask->myEventsReady &= ~IO_EVENT_READ;
+}
+
+bool
+AsyncRecvPooled::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			myRes = -1;
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncSubscribe::onIOEvent()
+{
+	assert(myTask->myState == IO_TASK_STATE_WORKING);
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCore::IOCore()
+	: myFd(epoll_create1(0))
+	, myEvents(theEpollBatchSizeMin)
+	, myQueue(nullptr)
+	, myBorrowedBufferCount(0)
+{
+	LOG_DEBUG("IOCore create");
+	myIsStopped = false;
+	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
+	// example, to let IOCore know, that there are new or deleting tasks to process.
+	myEventFd = eventfd(0, EFD_NONBLOCK);
+	myEventSub = subscribe(myEventFd);
+}
+
+IOCore::~IOCore()
+{
+	LOG_DEBUG("IOCore destroy");
+	unsubscribe(myEventSub);
+	myEventSub = nullptr;
+	myEventFd = -1;
+	processQueues();
+	assert(myTasks.empty());
+	assert(myQueue.load(std::memory_order_relaxed) == nullptr);
+	assert(myTimers.empty());
+	assert(myBorrowedBufferCount == 0);
+	for (char *chunk : myBufferChunks)
+		delete[] chunk;
+	assert(myFd >= 0);
+	int rc = close(myFd);
+	assert(rc == 0);
+}
+
+void
+IOCore::roll()
+{
+	processQueues();
+	// Sleep until the nearest deadline at most.
+	int timeout = processTimers();
+	epoll_event *evs = myEvents.data();
+	int rc = epoll_wait(myFd, evs, myEvents.size(), timeout);
+	if (rc < 0 && errno == EINTR)
+		return;
+	assert(rc >= 0);
+	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
+	// Filled up - there might be more events left in the kernel. Take more next time.
+	// The array is resized after the loop, because evs points into it.
+	bool isFull = rc == (int)myEvents.size() && rc < theEpollBatchSizeMax;
+	for (int i = 0; i < rc; ++i)
+	{
+		epoll_event& ev = evs[i];
+		IOTask *s = (IOTask *)ev.data.ptr;
+		int mask = 0;
+		if ((ev.events & EPOLLIN) != 0)
+			mask |= IO_EVENT_READ;
+		if ((ev.events & EPOLLOUT) != 0)
+			mask |= IO_EVENT_WRITE;
+		assert((ev.events & ~(EPOLLIN | EPOLLOUT)) == 0);
+		assert(mask != 0);
+		const char *eventStr = "[empty]";
+		if ((mask & IO_EVENT_READ) && (mask & IO_EVENT_WRITE))
+		{
+			eventStr = "[read,write]";
+		}
+		else if (mask & IO_EVENT_READ)
+		{
+			eventStr = "[read]";
+		}
+		else if (mask & IO_EVENT_WRITE)
+		{
+			eventStr = "[write]";
+		}
+		LOG_THIS_DEBUG(IOCore, roll, "event " << i << ": " << eventStr);
+		s->myEventsReady |= mask;
+		AsyncOperation* op = s->myAsyncOp;
+		if (op != nullptr)
+		{
+			// Nullify in case the coroutine would try to start a new async operation.
+			s->myAsyncOp = nullptr;
+			// Restore it back in case the handling didn't work. For example, due to a
+			// spurious wakeup.
+			if (!op->onIOEvent())
+				s->myAsyncOp = op;
+		}
+	}
+	if (isFull)
+		myEvents.resize(myEvents.size() * 2);
+}
+
+uint32_t
+IOCore::takeBuffer()
+{
+	if (myFreeBuffers.empty())
+	{
+		// Double the pool.
+		uint32_t count = std::max<uint32_t>(myBuffers.size(), theBufferCountMin);
+		uint32_t id = addBuffers(count);
+		for (uint32_t i = count; i > 0; --i)
+			myFreeBuffers.push_back(id + i - 1);
+	}
+	uint32_t id = myFreeBuffers.back();
+	myFreeBuffers.pop_back();
+	++myBorrowedBufferCount;
+	return id;
+}
+
+void
+IOCore::releaseBuffer(
+	uint32_t id)
+{
+	assert(myBorrowedBufferCount > 0);
+	--myBorrowedBufferCount;
+	// The last freed one is taken first, while it is still in the cache.
+	myFreeBuffers.push_back(id);
+}
+
+void
+IOCore::processQueues()
+{
+	IOTask *next = takeQueue();
+	while (next != nullptr)
+	{
+		IOTask *s = next;
+		next = s->myNext;
+		s->myNext = nullptr;
+		if (s->myState == IO_TASK_STATE_NEW || s->myState == IO_TASK_STATE_SUBSCRIBING)
+		{
+			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
+			bool isSubscribing = s->myState == IO_TASK_STATE_SUBSCRIBING;
+			s->myState = IO_TASK_STATE_WORKING;
+			// Assume that in a new socket all the events are there. The task will clear
+			// those which are not really available yet.
+			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
+			s->myIdx = myTasks.size();
+			epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			ev.data.ptr = (void *)s;
+			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
+			assert(rc == 0);
+			myTasks.push_back(s);
+			// The coroutine from AsyncSubscribe continues in this thread.
+			if (isSubscribing)
+			{
+				AsyncOperation* op = s->myAsyncOp;
+				s->myAsyncOp = nullptr;
+				op->onIOEvent();
+			}
+		}
+		else if (s->myState == IO_TASK_STATE_DELETING)
+		{
+			assert(myTasks.size() > s->myIdx);
+			assert(myTasks[s->myIdx] == s);
+			assert(s->myFd >= 0);
+			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
+			// Cyclic deletion, for O(1).
+			myTasks.back()->myIdx = s->myIdx;
+			myTasks[s->myIdx] = myTasks.back();
+			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
+			assert(rc == 0);
+			if (s->myAsyncOp != nullptr)
+			{
+				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+				s->myEventsReady = 0;
+				s->myAsyncOp->onIOEvent();
+				s->myAsyncOp = nullptr;
+			}
+			delete s;
+			myTasks.resize(myTasks.size() - 1);
+		}
+		else
+		{
+			assert(false);
+		}
+	}
+}
@@ -0,0 +1,592 @@
+#include "iocoro.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Each operation is a request in the submission ring, and the coroutine is resumed by its
+// completion. Nothing is tried in advance, so a blocking operation costs no syscalls of
+// its own. The requests are only written to the ring, and roll() submits all of them at
+// once together with waiting for the next completions. That is, all the operations
+// started by the coroutines resumed in one roll() go to the kernel in one syscall.
+
+static constexpr unsigned theRingSize = 1024;
+// Special request IDs. The others are AsyncOperation pointers.
+static constexpr uint64_t theWakeupRequestId = 0;
+static constexpr uint64_t theCancelRequestId = 1;
+static constexpr uint64_t theProvideRequestId = 2;
+// The receive pool is one group of the provided buffers. Initially the kernel gets that
+// many, and more are added when they run out.
+static constexpr uint16_t theBufferGroupId = 0;
+static constexpr uint32_t theBufferCountMin = 64;
+// Buffer IDs are 16 bit.
+static constexpr uint32_t theBufferCountMax = 1 << 16;
+
+struct IOUring
+{
+	int myFd;
+	unsigned *mySqHead;
+	unsigned *mySqTail;
+	unsigned mySqMask;
+	unsigned mySqSize;
+	unsigned *mySqArray;
+	io_uring_sqe *mySqes;
+	unsigned *myCqHead;
+	unsigned *myCqTail;
+	unsigned myCqMask;
+	io_uring_cqe *myCqes;
+	// Tail of the filled requests. The kernel sees them only on submission.
+	unsigned mySqLocalTail;
+
+	void *mySqMap;
+	size_t mySqMapSize;
+	void *myCqMap;
+	size_t myCqMapSize;
+	size_t mySqesSize;
+
+	// Where the eventfd is read into.
+	uint64_t myEventValue;
+	// Deleted tasks waiting for their cancelled operation to complete.
+	uint32_t myCancelCount;
+	// The receive pool has grown during the current roll().
+	bool myIsBufferPoolGrown;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncOperation::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	assert(myTask->myAsyncOp == nullptr);
+	myCoro = coro;
+	myTask->myAsyncOp = this;
+	submit();
+	if (myTimeoutMs >= 0)
+		myTask->myCore.addTimer(this, myTimeoutMs);
+	return true;
+}
+
+void
+AsyncOperation::submit()
+{
+	io_uring_sqe *sqe = myTask->myCore.getSqe();
+	prepare(sqe);
+	sqe->user_data = (uint64_t)this;
+}
+
+void
+AsyncOperation::onTimeout()
+{
+	// The request is cancelled and completes with ECANCELED, reported as ETIMEDOUT. If it
+	// manages to complete before that, the result is kept.
+	myIsTimedOut = true;
+	io_uring_sqe *sqe = myTask->myCore.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)this;
+	sqe->user_data = theCancelRequestId;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecv::AsyncRecv(
+	IOTask *sub,
+	void *data,
+	size_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myData(data)
+	, mySize(size)
+{
+}
+
+void
+AsyncRecv::prepare(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+}
+
+void
+AsyncRecv::onComplete(
+	int res,
+	uint32_t)
+{
+	myRes = res < 0 ? -1 : res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSend::AsyncSend(
+	IOTask *sub,
+	const void *data,
+	size_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myData(data)
+	, mySize(size)
+{
+}
+
+void
+AsyncSend::prepare(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+}
+
+void
+AsyncSend::onComplete(
+	int res,
+	uint32_t)
+{
+	myRes = res < 0 ? -1 : res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncAccept::AsyncAccept(
+	IOTask *sub,
+	sockaddr *addr,
+	socklen_t *size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myAddr(addr)
+	, mySize(size)
+{
+}
+
+void
+AsyncAccept::prepare(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myAddr;
+	sqe->addr2 = (uint64_t)mySize;
+}
+
+void
+AsyncAccept::onComplete(
+	int res,
+	uint32_t)
+{
+	myRes = res < 0 ? -1 : res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncConnect::AsyncConnect(
+	IOTask *sub,
+	const sockaddr *addr,
+	socklen_t size,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+	, myAddr(addr)
+	, mySize(size)
+	, myIsDone(false)
+{
+}
+
+void
+AsyncConnect::prepare(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myAddr;
+	sqe->off = mySize;
+}
+
+void
+AsyncConnect::onComplete(
+	int res,
+	uint32_t)
+{
+	myIsDone = true;
+	myRes = res < 0 ? -1 : 0;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecvPooled::AsyncRecvPooled(
+	IOTask *sub,
+	int timeoutMs)
+	: AsyncOperation(sub, timeoutMs)
+{
+}
+
+void
+AsyncRecvPooled::prepare(
+	io_uring_sqe *sqe)
+{
+	// The kernel picks a buffer only when the data arrives.
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = myTask->myFd;
+	sqe->len = theIOBufferSize;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = theBufferGroupId;
+}
+
+void
+AsyncRecvPooled::onComplete(
+	int res,
+	uint32_t flags)
+{
+	IOCore &core = myTask->myCore;
+	if (res == -ENOBUFS)
+	{
+		// The kernel ran out of buffers. Double the pool, but only once per roll() - all
+		// the requests failed in the same batch retry with the new buffers. Then the pool
+		// settles at the peak count of receives completed at once.
+		IOUring &r = *core.myRing;
+		if (!r.myIsBufferPoolGrown)
+		{
+			uint32_t count = core.myBuffers.size();
+			core.provideBuffers(core.addBuffers(count), count, true);
+			r.myIsBufferPoolGrown = true;
+		}
+		myTask->myAsyncOp = this;
+		submit();
+		return;
+	}
+	if ((flags & IORING_CQE_F_BUFFER) != 0)
+	{
+		uint32_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+		++core.myBorrowedBufferCount;
+		myBuffer.myCore = &core;
+		myBuffer.myData = core.myBuffers[id];
+		myBuffer.myId = id;
+	}
+	myRes = res < 0 ? -1 : res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncSubscribe::prepare(
+	io_uring_sqe *)
+{
+	// Never goes to the kernel, the core completes it on its own.
+	assert(false);
+}
+
+void
+AsyncSubscribe::onComplete(
+	int,
+	uint32_t)
+{
+	assert(myTask->myState == IO_TASK_STATE_WORKING);
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCore::IOCore()
+	: myRing(new IOUring())
+	, myQueue(nullptr)
+	, myBorrowedBufferCount(0)
+{
+	LOG_DEBUG("IOCore create");
+	myIsStopped = false;
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, theRingSize, &params);
+	assert(fd >= 0);
+	IOUring &r = *myRing;
+	r.myFd = fd;
+	r.mySqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r.myCqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool isSingleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (isSingleMap)
+	{
+		r.mySqMapSize = std::max(r.mySqMapSize, r.myCqMapSize);
+		r.myCqMapSize = r.mySqMapSize;
+	}
+	r.mySqMap = mmap(nullptr, r.mySqMapSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	assert(r.mySqMap != MAP_FAILED);
+	if (isSingleMap)
+	{
+		r.myCqMap = r.mySqMap;
+	}
+	else
+	{
+		r.myCqMap = mmap(nullptr, r.myCqMapSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		assert(r.myCqMap != MAP_FAILED);
+	}
+	r.mySqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	r.mySqes = (io_uring_sqe *)mmap(nullptr, r.mySqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	assert(r.mySqes != MAP_FAILED);
+
+	char *sq = (char *)r.mySqMap;
+	r.mySqHead = (unsigned *)(sq + params.sq_off.head);
+	r.mySqTail = (unsigned *)(sq + params.sq_off.tail);
+	r.mySqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	r.mySqSize = params.sq_entries;
+	r.mySqArray = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)r.myCqMap;
+	r.myCqHead = (unsigned *)(cq + params.cq_off.head);
+	r.myCqTail = (unsigned *)(cq + params.cq_off.tail);
+	r.myCqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	r.myCqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	r.mySqLocalTail = *r.mySqTail;
+	r.myEventValue = 0;
+	r.myCancelCount = 0;
+	r.myIsBufferPoolGrown = false;
+
+	// The eventfd is always being read by a request. Its completion wakes the core up
+	// for handling non-kernel events, like new or deleting tasks.
+	myEventFd = eventfd(0, 0);
+	assert(myEventFd >= 0);
+	io_uring_sqe *sqe = getSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = myEventFd;
+	sqe->addr = (uint64_t)&r.myEventValue;
+	sqe->len = sizeof(r.myEventValue);
+	sqe->user_data = theWakeupRequestId;
+
+	provideBuffers(addBuffers(theBufferCountMin), theBufferCountMin, false);
+}
+
+IOCore::~IOCore()
+{
+	LOG_DEBUG("IOCore destroy");
+	processQueues();
+	while (myRing->myCancelCount != 0)
+	{
+		submitAndWait(1, -1);
+		processCompletions();
+	}
+	assert(myTasks.empty());
+	assert(myQueue.load(std::memory_order_relaxed) == nullptr);
+	assert(myTimers.empty());
+	assert(myBorrowedBufferCount == 0);
+	// The ring's closure cancels the eventfd read and takes the buffers back.
+	IOUring &r = *myRing;
+	munmap(r.mySqes, r.mySqesSize);
+	if (r.myCqMap != r.mySqMap)
+		munmap(r.myCqMap, r.myCqMapSize);
+	munmap(r.mySqMap, r.mySqMapSize);
+	int rc = close(r.myFd);
+	assert(rc == 0);
+	rc = close(myEventFd);
+	assert(rc == 0);
+	myEventFd = -1;
+	delete myRing;
+	for (char *chunk : myBufferChunks)
+		delete[] chunk;
+}
+
+void
+IOCore::roll()
+{
+	processQueues();
+	// The expired timers can make requests too, they go with the same submission.
+	int timeout = processTimers();
+	submitAndWait(1, timeout);
+	myRing->myIsBufferPoolGrown = false;
+	processCompletions();
+}
+
+io_uring_sqe *
+IOCore::getSqe()
+{
+	IOUring &r = *myRing;
+	unsigned head = __atomic_load_n(r.mySqHead, __ATOMIC_ACQUIRE);
+	if (r.mySqLocalTail - head == r.mySqSize)
+	{
+		// Full. Push the requests to the kernel to free the space.
+		submitAndWait(0, -1);
+		head = __atomic_load_n(r.mySqHead, __ATOMIC_ACQUIRE);
+		assert(r.mySqLocalTail - head < r.mySqSize);
+	}
+	unsigned idx = r.mySqLocalTail & r.mySqMask;
+	io_uring_sqe *sqe = &r.mySqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r.mySqArray[idx] = idx;
+	++r.mySqLocalTail;
+	return sqe;
+}
+
+void
+IOCore::submitAndWait(
+	unsigned waitCount,
+	int timeoutMs)
+{
+	IOUring &r = *myRing;
+	__atomic_store_n(r.mySqTail, r.mySqLocalTail, __ATOMIC_RELEASE);
+	// Without SQPOLL the kernel consumes the requests only inside this syscall.
+	unsigned toSubmit = r.mySqLocalTail - __atomic_load_n(r.mySqHead, __ATOMIC_ACQUIRE);
+	unsigned flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+	__kernel_timespec ts;
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (waitCount > 0 && timeoutMs >= 0)
+	{
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+		arg.ts = (uint64_t)&ts;
+	}
+	// The extended argument is just to pass the timeout. No signal mask is given.
+	flags |= IORING_ENTER_EXT_ARG;
+	int rc = syscall(__NR_io_uring_enter, r.myFd, toSubmit, waitCount, flags,
+		&arg, sizeof(arg));
+	// ETIME is the timeout expiration, the requests are submitted anyway.
+	if (rc < 0 && (errno == EINTR || errno == ETIME))
+		return;
+	assert(rc >= 0);
+	LOG_THIS_DEBUG(IOCore, submitAndWait, rc << " submitted");
+}
+
+void
+IOCore::processCompletions()
+{
+	IOUring &r = *myRing;
+	unsigned head = *r.myCqHead;
+	while (head != __atomic_load_n(r.myCqTail, __ATOMIC_ACQUIRE))
+	{
+		const io_uring_cqe &cqe = r.myCqes[head & r.myCqMask];
+		uint64_t id = cqe.user_data;
+		int res = cqe.res;
+		uint32_t flags = cqe.flags;
+		// Free the slot right away. The handlers below can make more requests.
+		__atomic_store_n(r.myCqHead, ++head, __ATOMIC_RELEASE);
+		if (id == theCancelRequestId)
+			continue;
+		if (id == theProvideRequestId)
+		{
+			assert(res >= 0);
+			continue;
+		}
+		if (id == theWakeupRequestId)
+		{
+			assert(res == sizeof(r.myEventValue));
+			io_uring_sqe *sqe = getSqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = myEventFd;
+			sqe->addr = (uint64_t)&r.myEventValue;
+			sqe->len = sizeof(r.myEventValue);
+			sqe->user_data = theWakeupRequestId;
+			continue;
+		}
+		AsyncOperation *op = (AsyncOperation *)id;
+		IOTask *s = op->myTask;
+		assert(s->myAsyncOp == op);
+		s->myAsyncOp = nullptr;
+		if (s->myState != IO_TASK_STATE_DELETING)
+		{
+			if (res == -ECANCELED && op->myIsTimedOut)
+				res = -ETIMEDOUT;
+			if (res < 0)
+				errno = -res;
+			op->onComplete(res, flags);
+			continue;
+		}
+		// Cancellation. Even if the operation managed to finish, the task is gone.
+		LOG_THIS_DEBUG(IOCore, processCompletions, "cancel " << s);
+		op->onComplete(-ECANCELED, flags);
+		delete s;
+		--r.myCancelCount;
+	}
+}
+
+void
+IOCore::releaseBuffer(
+	uint32_t id)
+{
+	assert(myBorrowedBufferCount > 0);
+	--myBorrowedBufferCount;
+	provideBuffers(id, 1, false);
+}
+
+void
+IOCore::provideBuffers(
+	uint32_t id,
+	uint32_t count,
+	bool isLinked)
+{
+	assert(id + count <= theBufferCountMax);
+	io_uring_sqe *sqe = getSqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	// The buffers are consecutive in memory, and so are their IDs.
+	sqe->fd = count;
+	sqe->addr = (uint64_t)myBuffers[id];
+	sqe->len = theIOBufferSize;
+	sqe->off = id;
+	sqe->buf_group = theBufferGroupId;
+	if (isLinked)
+		sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = theProvideRequestId;
+}
+
+void
+IOCore::processQueues()
+{
+	IOTask *next = takeQueue();
+	while (next != nullptr)
+	{
+		IOTask *s = next;
+		next = s->myNext;
+		s->myNext = nullptr;
+		if (s->myState == IO_TASK_STATE_NEW || s->myState == IO_TASK_STATE_SUBSCRIBING)
+		{
+			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
+			bool isSubscribing = s->myState == IO_TASK_STATE_SUBSCRIBING;
+			s->myState = IO_TASK_STATE_WORKING;
+			s->myIdx = myTasks.size();
+			myTasks.push_back(s);
+			// The coroutine from AsyncSubscribe continues in this thread.
+			if (isSubscribing)
+			{
+				AsyncOperation* op = s->myAsyncOp;
+				s->myAsyncOp = nullptr;
+				op->onComplete(0, 0);
+			}
+		}
+		else if (s->myState == IO_TASK_STATE_DELETING)
+		{
+			assert(myTasks.size() > s->myIdx);
+			assert(myTasks[s->myIdx] == s);
+			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
+			// Cyclic deletion, for O(1).
+			myTasks.back()->myIdx = s->myIdx;
+			myTasks[s->myIdx] = myTasks.back();
+			myTasks.resize(myTasks.size() - 1);
+			if (s->myAsyncOp == nullptr)
+			{
+				delete s;
+				continue;
+			}
+			// The kernel still uses the operation's memory. The task is deleted when the
+			// operation completes.
+			io_uring_sqe *sqe = getSqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t)s->myAsyncOp;
+			sqe->user_data = theCancelRequestId;
+			++myRing->myCancelCount;
+		}
+		else
+		{
+			assert(false);
+		}
+	}
+}
@@ -6,12 +6,17 @@
 #include <ctime>
 #include <fcntl.h>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
 #include <thread>
 #include <unistd.h>
 
 static constexpr uint64_t theRequestTargetCount = 50;
 static constexpr int theClientCount = 100;
+static constexpr int theServerThreadCount = 4;
+// The answers come right away. The timeout is only there to put every wait through the
+// timer heap.
+static constexpr int theRecvTimeoutMs = 10'000;
 
 static uint64_t
 getUsec();
@@ -24,6 +29,9 @@ static void
 makeFdNonblock(
 	int fd);
 
+static void
+checkTimers();
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 class Context
@@ -65,7 +73,7 @@ struct Client
 
 	void
 	wrapAndRun(
-		IOCore &core,
+		IOMultiCore &cores,
 		int sock);
 
 	static std::atomic_int theCount;
@@ -92,7 +100,7 @@ struct Server
 
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOMultiCore &cores);
 
 	void
 	stop();
@@ -102,6 +110,7 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	IOMultiCore *myCores;
 	const std::shared_ptr<Context> myContext;
 };
 
@@ -112,11 +121,11 @@ run()
 {
 	std::shared_ptr<Context> context = std::make_shared<Context>();
 
-	IOCore serverCore;
+	IOMultiCore serverCores(theServerThreadCount);
 	std::cout << "start server" << std::endl;
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
+	uint16_t port = server.bindAndListenAndRun(serverCores);
+	serverCores.start();
 
 	std::cout << "start clients" << std::endl;
 	IOCore clientCore;
@@ -135,13 +144,13 @@ run()
 	std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
+	serverCores.stop();
 	return 0;
 }
 
 int main()
 {
+	checkTimers();
 	int rc = run();
 	assert(Client::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
@@ -178,6 +187,44 @@ makeFdNonblock(
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+static IOCoroutine
+coroCheckTimers(
+	IOCore &core,
+	IOTask *task,
+	bool &isDone)
+{
+	uint64_t t1 = getUsec();
+	co_await core.asyncSleep(20);
+	uint64_t t2 = getUsec();
+	assert(t2 - t1 >= 20'000);
+	// Nothing is ever sent into the socket.
+	char c;
+	ssize_t rc = co_await task->asyncRecv(&c, 1, 20);
+	assert(rc == -1 && errno == ETIMEDOUT);
+	assert(getUsec() - t2 >= 20'000);
+	task->close();
+	isDone = true;
+}
+
+static void
+checkTimers()
+{
+	std::cout << "check timers" << std::endl;
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	IOCore core;
+	bool isDone = false;
+	IOTask *task = core.subscribe(fds[0]);
+	coroCheckTimers(core, task, isDone);
+	while (!isDone)
+		core.roll();
+	close(fds[1]);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 void
 Context::onClientFinish()
 {
@@ -268,14 +315,18 @@ Client::connectAndRun(
 
 void
 Client::wrapAndRun(
-	IOCore &core,
+	IOMultiCore &cores,
 	int sock)
 {
 	LOG_THIS_DEBUG(Client, wrap, myTask);
 	assert(myTask == nullptr);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
-	coroRun();
+	// The socket can belong to another core. Then the coroutine moves to its thread.
+	[](Client* self, IOMultiCore &cores, int sock) -> IOCoroutine {
+		self->myTask = co_await cores.asyncSubscribe(sock);
+		self->coroRun();
+		co_return;
+	}(this, cores, sock);
 }
 
 IOCoroutine
@@ -289,11 +340,19 @@ Client::coroRun()
 		ssize_t rc = co_await myTask->asyncSend(&data, 1);
 		LOG_THIS_DEBUG(Client, coroRun, "sent " << rc);
 		assert(rc == 1);
+		++mySendCount;
 		LOG_THIS_DEBUG(Client, coroRun, "receive");
-		rc = co_await myTask->asyncRecv(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
-		assert(rc == 1);
+		// Both sides send first, so the next byte might already have come along with the
+		// previous one.
+		while (myRecvCount < mySendCount)
+		{
+			IOBuffer buf = co_await myTask->asyncRecvPooled(theRecvTimeoutMs);
+			LOG_THIS_DEBUG(Client, coroRun, "received " << buf.size());
+			assert(buf.size() > 0);
+			myRecvCount += buf.size();
+		}
 	}
+	assert(myRecvCount == theRequestTargetCount);
 	LOG_THIS_DEBUG(Client, coroRun, "finish");
 	myContext->onClientFinish();
 	delete this;
@@ -305,6 +364,7 @@ Client::coroRun()
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myCores(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,7 +376,7 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOMultiCore &cores)
 {
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -334,7 +394,9 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	myCores = &cores;
+	// The cores aren't started yet, so the coroutine can start here.
+	myTask = cores.subscribe(sock);
 	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
 
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
@@ -366,7 +428,7 @@ Server::coroRun()
 		if (sock < 0)
 			break;
 		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		(new Client(myContext))->wrapAndRun(*myCores, sock);
 	}
 	myContext->onServerFinish();
 	co_return;
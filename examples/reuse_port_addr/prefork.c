@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include "prefork.h"
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct worker_slot {
+	int listen_fd;
+	pid_t pid;
+	/* The old worker being replaced, still finishing its clients. */
+	pid_t retiring_pid;
+};
+
+static volatile sig_atomic_t is_stopping = false;
+
+static void
+on_stop_signal(int signo)
+{
+	(void)signo;
+	is_stopping = true;
+}
+
+bool
+prefork_is_stopping(void)
+{
+	return is_stopping;
+}
+
+static int
+create_listen_socket(const struct sockaddr_in *addr, int backlog)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	int value = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) != 0 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0 ||
+	    bind(s, (const struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+	    listen(s, backlog) != 0) {
+		int err = errno;
+		close(s);
+		errno = err;
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * The socket index in the group is the order of bind(). The program
+ * picks the index = current CPU modulo the socket count.
+ */
+static int
+attach_cpu_steering(int listen_fd, int socket_count)
+{
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned)socket_count},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	return setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &prog, sizeof(prog));
+}
+
+static void
+pin_to_cpu(int worker_id)
+{
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count <= 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(worker_id % cpu_count, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		printf("worker %d: pin error: %s\n", worker_id, strerror(errno));
+}
+
+static pid_t
+spawn_worker(const struct prefork_cfg *cfg, struct worker_slot *slots,
+	     int worker_id, prefork_worker_f worker, void *arg,
+	     const sigset_t *old_mask)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	/* Only the own socket is needed. */
+	for (int i = 0; i < cfg->worker_count; ++i) {
+		if (i != worker_id)
+			close(slots[i].listen_fd);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop_signal;
+	/* No SA_RESTART, the blocking calls must see the stop. */
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigprocmask(SIG_SETMASK, old_mask, NULL);
+	if (cfg->pin_cpus)
+		pin_to_cpu(worker_id);
+	worker(slots[worker_id].listen_fd, worker_id, arg);
+	fflush(stdout);
+	_exit(0);
+}
+
+static int
+find_slot(const struct worker_slot *slots, int count, pid_t pid,
+	  bool *is_retiring)
+{
+	for (int i = 0; i < count; ++i) {
+		if (slots[i].pid == pid) {
+			*is_retiring = false;
+			return i;
+		}
+		if (slots[i].retiring_pid == pid) {
+			*is_retiring = true;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+stop_workers(struct worker_slot *slots, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (slots[i].pid > 0)
+			kill(slots[i].pid, SIGTERM);
+		if (slots[i].retiring_pid > 0)
+			kill(slots[i].retiring_pid, SIGTERM);
+	}
+	while (wait(NULL) > 0 || errno == EINTR) {
+	}
+	for (int i = 0; i < count; ++i)
+		close(slots[i].listen_fd);
+}
+
+int
+prefork_run(const struct prefork_cfg *cfg, const struct sockaddr_in *addr,
+	    prefork_worker_f worker, void *arg)
+{
+	int count = cfg->worker_count;
+	int err;
+	sigset_t mask, old_mask;
+	struct worker_slot *slots = calloc(count, sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+	for (int i = 0; i < count; ++i)
+		slots[i].listen_fd = -1;
+	for (int i = 0; i < count; ++i) {
+		slots[i].listen_fd = create_listen_socket(addr, cfg->backlog);
+		if (slots[i].listen_fd < 0)
+			goto error;
+	}
+	if (cfg->use_bpf && attach_cpu_steering(slots[0].listen_fd, count) != 0)
+		goto error;
+	/*
+	 * The signals are handled synchronously, in the loop below. They
+	 * are blocked before the first fork() so none is lost.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	for (int i = 0; i < count; ++i) {
+		slots[i].pid = spawn_worker(cfg, slots, i, worker, arg,
+					    &old_mask);
+		if (slots[i].pid < 0)
+			goto error_stop;
+	}
+	while (true) {
+		siginfo_t info;
+		int signo = sigwaitinfo(&mask, &info);
+		if (signo < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error_stop;
+		}
+		if (signo == SIGTERM || signo == SIGINT)
+			break;
+		if (signo == SIGHUP) {
+			/*
+			 * The new worker is started before the old one is
+			 * stopped, so the socket always has someone
+			 * accepting.
+			 */
+			for (int i = 0; i < count; ++i) {
+				pid_t pid = spawn_worker(cfg, slots, i, worker,
+							 arg, &old_mask);
+				if (pid < 0) {
+					printf("restart error: %s\n",
+					       strerror(errno));
+					continue;
+				}
+				if (slots[i].retiring_pid > 0)
+					kill(slots[i].retiring_pid, SIGTERM);
+				slots[i].retiring_pid = slots[i].pid;
+				slots[i].pid = pid;
+				kill(slots[i].retiring_pid, SIGTERM);
+			}
+			continue;
+		}
+		/* SIGCHLD. They are merged, so reap all the dead. */
+		pid_t pid;
+		int status;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			bool is_retiring;
+			int i = find_slot(slots, count, pid, &is_retiring);
+			if (i < 0)
+				continue;
+			if (is_retiring) {
+				slots[i].retiring_pid = 0;
+				continue;
+			}
+			printf("worker %d (pid %d) died, restart\n", i, (int)pid);
+			/* Don't spin if it dies right away each time. */
+			sleep(1);
+			slots[i].pid = spawn_worker(cfg, slots, i, worker, arg,
+						    &old_mask);
+			if (slots[i].pid < 0)
+				printf("restart error: %s\n", strerror(errno));
+		}
+	}
+	stop_workers(slots, count);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	free(slots);
+	return 0;
+
+error_stop:
+	err = errno;
+	stop_workers(slots, count);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	free(slots);
+	errno = err;
+	return -1;
+error:
+	err = errno;
+	for (int i = 0; i < count; ++i) {
+		if (slots[i].listen_fd >= 0)
+			close(slots[i].listen_fd);
+	}
+	free(slots);
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/*
+ * Prefork supervisor. Runs N worker processes serving one address. Each
+ * worker slot has its own listening socket with SO_REUSEPORT, and the
+ * kernel balances the new connections between them.
+ *
+ * The sockets are created and kept by the supervisor, the workers get
+ * them via fork(). So when a worker is restarted, its socket with the
+ * accept queue stays open, and the clients waiting in the queue are
+ * accepted by the next worker instead of getting a reset.
+ *
+ * Signals to the supervisor:
+ * - SIGHUP - graceful restart. Each worker is replaced by a new one:
+ *   the new one starts on the same socket first, then the old one gets
+ *   SIGTERM and finishes what it has;
+ * - SIGTERM, SIGINT - stop all the workers and exit.
+ *
+ * A worker which has died by itself is restarted.
+ */
+
+/**
+ * Worker body. Accepts the clients from the listening socket and serves
+ * them until prefork_is_stopping(). The socket is blocking, and any
+ * blocking call is interrupted by the stop request with EINTR.
+ */
+typedef void (*prefork_worker_f)(int listen_fd, int worker_id, void *arg);
+
+struct prefork_cfg {
+	int worker_count;
+	/* Pin worker I to CPU I modulo the CPU count. */
+	bool pin_cpus;
+	/*
+	 * Steer each connection to the socket of the worker on the CPU
+	 * which has got the packet, with a classic BPF program. Makes
+	 * sense with pinned workers and not more workers than CPUs.
+	 */
+	bool use_bpf;
+	/* Listen backlog of each socket. */
+	int backlog;
+};
+
+/**
+ * Run the workers until SIGTERM or SIGINT. Returns 0 when stopped by
+ * them, -1 on an error, see errno.
+ */
+int
+prefork_run(const struct prefork_cfg *cfg, const struct sockaddr_in *addr,
+	    prefork_worker_f worker, void *arg);
+
+/** In a worker process, whether it is asked to finish. */
+bool
+prefork_is_stopping(void);
@@ -0,0 +1,70 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "prefork.h"
+
+/*
+ * Echo server on the prefork supervisor. Each worker serves one client
+ * at a time, and says which worker it is in the first line.
+ *
+ *     ./prefork_server [<worker count> [bpf]]
+ *     kill -HUP <supervisor pid>  # graceful restart
+ */
+
+static void
+serve(int listen_fd, int worker_id, void *arg)
+{
+	(void)arg;
+	printf("worker %d (pid %d) started\n", worker_id, (int)getpid());
+	while (!prefork_is_stopping()) {
+		int c = accept(listen_fd, NULL, NULL);
+		if (c < 0) {
+			if (errno != EINTR)
+				printf("accept error: %s\n", strerror(errno));
+			continue;
+		}
+		char buf[128];
+		int len = snprintf(buf, sizeof(buf), "worker %d\n", worker_id);
+		send(c, buf, len, 0);
+		/* The current client is served to the end even when stopping. */
+		ssize_t rc;
+		while ((rc = recv(c, buf, sizeof(buf), 0)) > 0 ||
+		       (rc < 0 && errno == EINTR)) {
+			if (rc > 0)
+				send(c, buf, rc, 0);
+		}
+		close(c);
+	}
+	printf("worker %d (pid %d) stopped\n", worker_id, (int)getpid());
+}
+
+int
+main(int argc, char **argv)
+{
+	struct prefork_cfg cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.worker_count = argc > 1 ? atoi(argv[1]) : 4;
+	cfg.pin_cpus = true;
+	cfg.use_bpf = argc > 2 && strcmp(argv[2], "bpf") == 0;
+	cfg.backlog = 128;
+	if (cfg.worker_count <= 0) {
+		printf("bad worker count\n");
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	addr.sin_port = htons(3333);
+	printf("supervisor pid %d\n", (int)getpid());
+	if (prefork_run(&cfg, &addr, serve, NULL) != 0) {
+		printf("prefork error: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../utils/adaptive_lock.h"
+#include "../../utils/bench.h"
+
+/*
+ * The spin lock of 8_6_spinlock_acq_rel.c and the futex lock of
+ * 8_futex.c put together in utils/adaptive_lock.h, compared with
+ * pthread_mutex. The threads increment one counter under the lock, from
+ * 1 thread up to the given count:
+ *
+ *     ./a.out [<max threads>]
+ */
+
+enum {
+	LOCK_COUNT = 2000000,
+	THREAD_COUNT_MAX = 64,
+};
+
+struct lock_api {
+	const char *name;
+	void (*lock)(void *);
+	void (*unlock)(void *);
+};
+
+static void
+adaptive_lock_lock_f(void *lock)
+{
+	adaptive_lock_lock(lock);
+}
+
+static void
+adaptive_lock_unlock_f(void *lock)
+{
+	adaptive_lock_unlock(lock);
+}
+
+static void
+pthread_mutex_lock_f(void *lock)
+{
+	pthread_mutex_lock(lock);
+}
+
+static void
+pthread_mutex_unlock_f(void *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+static const struct lock_api apis[] = {
+	{"adaptive_lock", adaptive_lock_lock_f, adaptive_lock_unlock_f},
+	{"pthread_mutex", pthread_mutex_lock_f, pthread_mutex_unlock_f},
+};
+
+struct bench_ctx {
+	const struct lock_api *api;
+	void *lock;
+	int lock_count;
+	bool start;
+	uint64_t counter;
+};
+
+static void *
+thread_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->start, __ATOMIC_ACQUIRE))
+		sched_yield();
+	for (int i = 0; i < ctx->lock_count; ++i) {
+		ctx->api->lock(ctx->lock);
+		++ctx->counter;
+		ctx->api->unlock(ctx->lock);
+	}
+	return NULL;
+}
+
+static double
+lock_bench_run(const struct lock_api *api, void *lock, int thread_count)
+{
+	pthread_t tid[THREAD_COUNT_MAX];
+	struct bench_ctx ctx = {api, lock, LOCK_COUNT / thread_count, false, 0};
+	for (int i = 0; i < thread_count; ++i)
+		pthread_create(&tid[i], NULL, thread_f, &ctx);
+	uint64_t start = bench_clock_ns();
+	__atomic_store_n(&ctx.start, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(tid[i], NULL);
+	uint64_t total = (uint64_t)ctx.lock_count * thread_count;
+	assert(ctx.counter == total);
+	return (double)(bench_clock_ns() - start) / total;
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count_max = 4;
+	if (argc > 1)
+		thread_count_max = atoi(argv[1]);
+	if (thread_count_max < 1 || thread_count_max > THREAD_COUNT_MAX) {
+		printf("Bad thread count\n");
+		return -1;
+	}
+	struct adaptive_lock adaptive = ADAPTIVE_LOCK_INITIALIZER;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	void *locks[] = {&adaptive, &mutex};
+	for (int threads = 1; threads <= thread_count_max; threads *= 2) {
+		for (int i = 0; i < 2; ++i) {
+			double times[BENCH_RUN_COUNT];
+			for (int j = 0; j < BENCH_RUN_COUNT; ++j)
+				times[j] = lock_bench_run(&apis[i], locks[i], threads);
+			char name[64];
+			snprintf(name, sizeof(name), "%s, %d threads",
+				 apis[i].name, threads);
+			bench_report(name, "ns per lock", times,
+				     BENCH_RUN_COUNT);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Byte ring for one writer and one reader, which can be different
+ * processes. It lives in a MAP_SHARED mapping created before fork().
+ * Unlike 3_mem_sort.c, the waiting side doesn't spin with
+ * sched_yield() burning a core, but sleeps on a futex. The other side
+ * calls futex wake only when someone really sleeps, so while the data
+ * flows there are no syscalls at all.
+ *
+ * The positions are free-running 32-bit counters of the bytes ever
+ * written and read. They are the futex words at the same time: the
+ * reader sleeps on the write position while it doesn't change, and the
+ * writer on the read position.
+ */
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SHM_RING_CACHE_LINE 64
+
+struct shm_ring {
+	/* Changed by the writer. */
+	uint32_t write_pos;
+	uint32_t is_reader_waiting;
+	char pad1[SHM_RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+	/* Changed by the reader. */
+	uint32_t read_pos;
+	uint32_t is_writer_waiting;
+	char pad2[SHM_RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+	/* Power of 2. */
+	uint32_t capacity;
+	char data[];
+};
+
+/* Not private futexes, the waiters can be in the other processes. */
+static inline void
+shm_ring_futex_wait(uint32_t *futex, uint32_t val)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline void
+shm_ring_futex_wake(uint32_t *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Capacity is rounded up to a power of 2. NULL on error. */
+static inline struct shm_ring *
+shm_ring_new(uint32_t capacity)
+{
+	uint32_t cap = 1;
+	while (cap < capacity)
+		cap *= 2;
+	struct shm_ring *ring = mmap(NULL, sizeof(*ring) + cap,
+				     PROT_READ | PROT_WRITE,
+				     MAP_ANON | MAP_SHARED, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+	/* The anonymous memory is zeroed. */
+	ring->capacity = cap;
+	return ring;
+}
+
+static inline void
+shm_ring_delete(struct shm_ring *ring)
+{
+	munmap(ring, sizeof(*ring) + ring->capacity);
+}
+
+/*
+ * Sleep until the position is not @a seen anymore. The flag is set
+ * before the last check of the position done by the kernel, and the
+ * other side sets the position before checking the flag. With the full
+ * barriers in between, either the kernel sees the new position, or
+ * the other side sees the flag and wakes the sleeper up.
+ */
+static inline void
+shm_ring_wait(uint32_t *pos, uint32_t *is_waiting, uint32_t seen)
+{
+	__atomic_store_n(is_waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen)
+		shm_ring_futex_wait(pos, seen);
+	__atomic_store_n(is_waiting, 0, __ATOMIC_RELAXED);
+}
+
+static inline void
+shm_ring_publish(uint32_t *pos, uint32_t *is_waiting, uint32_t new_pos)
+{
+	__atomic_store_n(pos, new_pos, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(is_waiting, __ATOMIC_SEQ_CST))
+		shm_ring_futex_wake(pos);
+}
+
+/* Copy a part of the ring from or to the buffer, with the wrap. */
+static inline void
+shm_ring_copy(struct shm_ring *ring, uint32_t pos, char *buf, uint32_t size,
+	      bool is_write)
+{
+	uint32_t offset = pos & (ring->capacity - 1);
+	uint32_t first = ring->capacity - offset;
+	if (first > size)
+		first = size;
+	if (is_write) {
+		memcpy(ring->data + offset, buf, first);
+		memcpy(ring->data, buf + first, size - first);
+	} else {
+		memcpy(buf, ring->data + offset, first);
+		memcpy(buf + first, ring->data, size - first);
+	}
+}
+
+/* Write all the data. Waits while the ring is full. */
+static inline void
+shm_ring_write(struct shm_ring *ring, const void *src, size_t size)
+{
+	const char *pos = src;
+	uint32_t write_pos = ring->write_pos;
+	while (size > 0) {
+		uint32_t read_pos = __atomic_load_n(&ring->read_pos,
+						    __ATOMIC_ACQUIRE);
+		uint32_t free_size = ring->capacity - (write_pos - read_pos);
+		if (free_size == 0) {
+			shm_ring_wait(&ring->read_pos, &ring->is_writer_waiting,
+				      read_pos);
+			continue;
+		}
+		uint32_t to_copy = size < free_size ? size : free_size;
+		shm_ring_copy(ring, write_pos, (char *)pos, to_copy, true);
+		write_pos += to_copy;
+		pos += to_copy;
+		size -= to_copy;
+		shm_ring_publish(&ring->write_pos, &ring->is_reader_waiting,
+				 write_pos);
+	}
+}
+
+/* Read exactly this many bytes. Waits while the ring is empty. */
+static inline void
+shm_ring_read(struct shm_ring *ring, void *dst, size_t size)
+{
+	char *pos = dst;
+	uint32_t read_pos = ring->read_pos;
+	while (size > 0) {
+		uint32_t write_pos = __atomic_load_n(&ring->write_pos,
+						     __ATOMIC_ACQUIRE);
+		uint32_t used_size = write_pos - read_pos;
+		if (used_size == 0) {
+			shm_ring_wait(&ring->write_pos, &ring->is_reader_waiting,
+				      write_pos);
+			continue;
+		}
+		uint32_t to_copy = size < used_size ? size : used_size;
+		shm_ring_copy(ring, read_pos, pos, to_copy, false);
+		read_pos += to_copy;
+		pos += to_copy;
+		size -= to_copy;
+		shm_ring_publish(&ring->read_pos, &ring->is_writer_waiting,
+				 read_pos);
+	}
+}
@@ -0,0 +1,138 @@
+/*
+ * Semaphore and mutex on futexes. Unlike 10_sem_mutex.h, when there is
+ * no contention they cost one atomic operation and no syscalls. The
+ * kernel is called only to sleep when the semaphore is 0 or the mutex
+ * is taken, and to wake up the ones who really sleep.
+ *
+ * With is_shared they work for the processes having the object in a
+ * shared mapping, like the one from mmap(MAP_SHARED). Otherwise the
+ * cheaper private futexes are used, good only for the threads of one
+ * process.
+ */
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline void
+futex_sync_wait(uint32_t *futex, uint32_t val, int flags)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT | flags, val, NULL, NULL, 0);
+}
+
+static inline void
+futex_sync_wake(uint32_t *futex, int flags)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE | flags, 1, NULL, NULL, 0);
+}
+
+struct futex_sem {
+	uint32_t counter;
+	/* How many are about to sleep or sleep already. */
+	uint32_t waiter_count;
+	int futex_flags;
+};
+
+static inline void
+futex_sem_create(struct futex_sem *sem, uint32_t counter, bool is_shared)
+{
+	sem->counter = counter;
+	sem->waiter_count = 0;
+	sem->futex_flags = is_shared ? 0 : FUTEX_PRIVATE_FLAG;
+}
+
+static inline bool
+futex_sem_try_get(struct futex_sem *sem)
+{
+	uint32_t old = __atomic_load_n(&sem->counter, __ATOMIC_RELAXED);
+	while (old != 0) {
+		if (__atomic_compare_exchange_n(&sem->counter, &old, old - 1,
+						true, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+static inline void
+futex_sem_get(struct futex_sem *sem)
+{
+	if (futex_sem_try_get(sem))
+		return;
+	/*
+	 * The waiter is counted before the kernel checks that the
+	 * counter is still 0, and put() increments the counter before
+	 * looking at the waiters. So either the kernel sees the new
+	 * counter and doesn't sleep, or put() sees the waiter and wakes
+	 * it up.
+	 */
+	__atomic_add_fetch(&sem->waiter_count, 1, __ATOMIC_SEQ_CST);
+	while (!futex_sem_try_get(sem))
+		futex_sync_wait(&sem->counter, 0, sem->futex_flags);
+	__atomic_sub_fetch(&sem->waiter_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * Put() wakes one waiter only when the counter becomes not 0.
+	 * The further puts can happen before that one runs, so it passes
+	 * the wakeup on if something is left.
+	 */
+	if (__atomic_load_n(&sem->counter, __ATOMIC_SEQ_CST) != 0 &&
+	    __atomic_load_n(&sem->waiter_count, __ATOMIC_SEQ_CST) != 0)
+		futex_sync_wake(&sem->counter, sem->futex_flags);
+}
+
+static inline void
+futex_sem_put(struct futex_sem *sem)
+{
+	/*
+	 * The waiters sleep only while the counter is 0. When it is
+	 * bigger, someone is woken up already.
+	 */
+	if (__atomic_fetch_add(&sem->counter, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&sem->waiter_count, __ATOMIC_SEQ_CST) != 0)
+		futex_sync_wake(&sem->counter, sem->futex_flags);
+}
+
+/*
+ * The mutex from U. Drepper's "Futexes Are Tricky". The state is 0 when
+ * free, 1 when locked, and 2 when locked and someone might sleep on
+ * it. Unlock calls the kernel only in the last case.
+ */
+struct futex_mutex {
+	uint32_t state;
+	int futex_flags;
+};
+
+static inline void
+futex_mutex_create(struct futex_mutex *mutex, bool is_shared)
+{
+	mutex->state = 0;
+	mutex->futex_flags = is_shared ? 0 : FUTEX_PRIVATE_FLAG;
+}
+
+static inline void
+futex_mutex_lock(struct futex_mutex *mutex)
+{
+	uint32_t old = 0;
+	if (__atomic_compare_exchange_n(&mutex->state, &old, 1, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	/*
+	 * Sleeping, so mark the mutex as having waiters. Who takes it
+	 * after the sleep keeps the mark, because it can't know if there
+	 * are other sleepers.
+	 */
+	if (old != 2)
+		old = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+	while (old != 0) {
+		futex_sync_wait(&mutex->state, 2, mutex->futex_flags);
+		old = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static inline void
+futex_mutex_unlock(struct futex_mutex *mutex)
+{
+	if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2)
+		futex_sync_wake(&mutex->state, mutex->futex_flags);
+}
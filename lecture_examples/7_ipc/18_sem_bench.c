@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "10_sem_mutex.h"
+#include "18_futex_sem.h"
+
+/*
+ * Semaphore 10_sem_mutex.h against 18_futex_sem.h, done like the bonus
+ * task 6: one thread calls put() and N threads are waiting in get().
+ * The target metric is the time per one put(), until all the puts are
+ * consumed. Plus the same for the uncontended get() + put() in one
+ * thread, for the mutexes in N threads, and for the futex semaphore
+ * between 2 processes.
+ */
+
+enum {
+	RUN_COUNT = 5,
+	OP_COUNT = 1000000,
+	MAX_THREADS = 16,
+};
+
+enum sem_type {
+	SEM_PTHREAD,
+	SEM_FUTEX,
+};
+
+static const char *sem_type_name[] = {"pthread", "futex"};
+
+struct bench {
+	enum sem_type type;
+	struct semaphore pthread_sem;
+	struct futex_sem futex_sem;
+	pthread_mutex_t pthread_mutex;
+	struct futex_mutex futex_mutex;
+	int thread_count;
+	uint64_t counter;
+};
+
+static inline void
+bench_sem_get(struct bench *b)
+{
+	if (b->type == SEM_PTHREAD)
+		semaphore_get(&b->pthread_sem);
+	else
+		futex_sem_get(&b->futex_sem);
+}
+
+static inline void
+bench_sem_put(struct bench *b)
+{
+	if (b->type == SEM_PTHREAD)
+		semaphore_put(&b->pthread_sem);
+	else
+		futex_sem_put(&b->futex_sem);
+}
+
+static void
+bench_create(struct bench *b, enum sem_type type, int thread_count,
+	     bool is_shared)
+{
+	memset(b, 0, sizeof(*b));
+	b->type = type;
+	b->thread_count = thread_count;
+	pthread_mutex_init(&b->pthread_sem.mutex, NULL);
+	pthread_cond_init(&b->pthread_sem.cond, NULL);
+	pthread_mutex_init(&b->pthread_mutex, NULL);
+	futex_sem_create(&b->futex_sem, 0, is_shared);
+	futex_mutex_create(&b->futex_mutex, is_shared);
+}
+
+static void
+bench_destroy(struct bench *b)
+{
+	pthread_mutex_destroy(&b->pthread_sem.mutex);
+	pthread_cond_destroy(&b->pthread_sem.cond);
+	pthread_mutex_destroy(&b->pthread_mutex);
+}
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+print_times(const char *name, double *times)
+{
+	qsort(times, RUN_COUNT, sizeof(*times), double_cmp);
+	printf("%s\n", name);
+	printf("    min: %.2lf ns\n", times[0]);
+	printf("    med: %.2lf ns\n", times[RUN_COUNT / 2]);
+	printf("    max: %.2lf ns\n", times[RUN_COUNT - 1]);
+}
+
+static void *
+getter_f(void *arg)
+{
+	struct bench *b = arg;
+	for (int i = 0; i < OP_COUNT / b->thread_count; ++i)
+		bench_sem_get(b);
+	return NULL;
+}
+
+static void
+bench_signal(enum sem_type type, int thread_count)
+{
+	double times[RUN_COUNT];
+	struct bench b;
+	pthread_t tids[MAX_THREADS];
+	int put_count = OP_COUNT / thread_count * thread_count;
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		bench_create(&b, type, thread_count, false);
+		for (int i = 0; i < thread_count; ++i)
+			pthread_create(&tids[i], NULL, getter_f, &b);
+		uint64_t start = time_ns();
+		for (int i = 0; i < put_count; ++i)
+			bench_sem_put(&b);
+		for (int i = 0; i < thread_count; ++i)
+			pthread_join(tids[i], NULL);
+		times[run] = (double)(time_ns() - start) / put_count;
+		bench_destroy(&b);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "%s sem, put with %d get-threads",
+		 sem_type_name[type], thread_count);
+	print_times(name, times);
+}
+
+static void
+bench_uncontended(enum sem_type type)
+{
+	double times[RUN_COUNT];
+	struct bench b;
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		bench_create(&b, type, 1, false);
+		bench_sem_put(&b);
+		uint64_t start = time_ns();
+		for (int i = 0; i < OP_COUNT; ++i) {
+			bench_sem_get(&b);
+			bench_sem_put(&b);
+		}
+		times[run] = (double)(time_ns() - start) / OP_COUNT;
+		bench_destroy(&b);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "%s sem, get + put in 1 thread",
+		 sem_type_name[type]);
+	print_times(name, times);
+}
+
+static void *
+locker_f(void *arg)
+{
+	struct bench *b = arg;
+	for (int i = 0; i < OP_COUNT / b->thread_count; ++i) {
+		if (b->type == SEM_PTHREAD) {
+			pthread_mutex_lock(&b->pthread_mutex);
+			++b->counter;
+			pthread_mutex_unlock(&b->pthread_mutex);
+		} else {
+			futex_mutex_lock(&b->futex_mutex);
+			++b->counter;
+			futex_mutex_unlock(&b->futex_mutex);
+		}
+	}
+	return NULL;
+}
+
+static void
+bench_mutex(enum sem_type type, int thread_count)
+{
+	double times[RUN_COUNT];
+	struct bench b;
+	pthread_t tids[MAX_THREADS];
+	int lock_count = OP_COUNT / thread_count * thread_count;
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		bench_create(&b, type, thread_count, false);
+		uint64_t start = time_ns();
+		for (int i = 0; i < thread_count; ++i)
+			pthread_create(&tids[i], NULL, locker_f, &b);
+		for (int i = 0; i < thread_count; ++i)
+			pthread_join(tids[i], NULL);
+		times[run] = (double)(time_ns() - start) / lock_count;
+		if (b.counter != (uint64_t)lock_count) {
+			printf("Lost the updates: %llu\n",
+			       (unsigned long long)b.counter);
+			exit(-1);
+		}
+		bench_destroy(&b);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "%s mutex, lock + unlock in %d threads",
+		 sem_type_name[type], thread_count);
+	print_times(name, times);
+}
+
+static void
+bench_processes(void)
+{
+	double times[RUN_COUNT];
+	struct futex_sem *sem = mmap(NULL, sizeof(*sem),
+				     PROT_READ | PROT_WRITE,
+				     MAP_ANON | MAP_SHARED, -1, 0);
+	if (sem == MAP_FAILED) {
+		printf("mmap failed\n");
+		exit(-1);
+	}
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		futex_sem_create(sem, 0, true);
+		/* Otherwise the child would print the buffer again. */
+		fflush(stdout);
+		uint64_t start = time_ns();
+		if (fork() == 0) {
+			for (int i = 0; i < OP_COUNT; ++i)
+				futex_sem_get(sem);
+			_exit(0);
+		}
+		for (int i = 0; i < OP_COUNT; ++i)
+			futex_sem_put(sem);
+		wait(NULL);
+		times[run] = (double)(time_ns() - start) / OP_COUNT;
+	}
+	munmap(sem, sizeof(*sem));
+	print_times("futex sem, put with 1 get-process", times);
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_counts[] = {1, 3};
+	int thread_counts_size = sizeof(thread_counts) / sizeof(thread_counts[0]);
+	if (argc > 1) {
+		thread_counts[0] = atoi(argv[1]);
+		thread_counts_size = 1;
+		if (thread_counts[0] < 1 || thread_counts[0] > MAX_THREADS) {
+			printf("Thread count must be in [1, %d]\n", MAX_THREADS);
+			return -1;
+		}
+	}
+	for (int type = SEM_PTHREAD; type <= SEM_FUTEX; ++type)
+		bench_uncontended(type);
+	for (int i = 0; i < thread_counts_size; ++i) {
+		for (int type = SEM_PTHREAD; type <= SEM_FUTEX; ++type)
+			bench_signal(type, thread_counts[i]);
+	}
+	for (int i = 0; i < thread_counts_size; ++i) {
+		for (int type = SEM_PTHREAD; type <= SEM_FUTEX; ++type)
+			bench_mutex(type, thread_counts[i]);
+	}
+	bench_processes();
+	return 0;
+}
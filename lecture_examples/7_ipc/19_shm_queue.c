@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+
+#include "19_shm_queue.h"
+
+/*
+ * First shows how the queue survives a producer dying in the middle of
+ * a message. Then compares its throughput with msgsnd()/msgrcv() of
+ * 7_msgsend_server.c, for the given numbers of producer and consumer
+ * processes:
+ *
+ *     ./a.out [<producers> <consumers> [<msg size>]]
+ */
+
+enum {
+	RUN_COUNT = 5,
+	MSG_COUNT = 1000000,
+	QUEUE_CAPACITY = 1024,
+	MSG_SIZE_MAX = 4096,
+};
+
+static void
+show_recovery(void)
+{
+	int id = shm_queue_create(IPC_PRIVATE, 4, 64);
+	assert(id >= 0);
+	struct shm_queue *q = shm_queue_open(id);
+	printf("Child starts a message and dies\n");
+	fflush(stdout);
+	if (fork() == 0) {
+		struct shm_queue_slot *slot = shm_queue_push_begin(q);
+		memcpy(slot->data, "broken", 3);
+		_exit(1);
+	}
+	wait(NULL);
+	shm_queue_push(q, "hello", sizeof("hello"));
+	char buf[64];
+	shm_queue_pop(q, buf, sizeof(buf));
+	printf("Parent got '%s', lost %u messages\n", buf, q->lost_count);
+	shm_queue_close(q);
+	shm_queue_destroy(id);
+}
+
+struct msgbuf_max {
+	long mtype;
+	char mtext[MSG_SIZE_MAX];
+};
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The count is split between the processes, the first ones take more. */
+static int
+share(int total, int process_count, int i)
+{
+	return total / process_count + (i < total % process_count);
+}
+
+static double
+bench_shm_queue(int producers, int consumers, int msg_size)
+{
+	int id = shm_queue_create(IPC_PRIVATE, QUEUE_CAPACITY, msg_size);
+	assert(id >= 0);
+	struct shm_queue *q = shm_queue_open(id);
+	uint64_t start = time_ns();
+	for (int i = 0; i < producers; ++i) {
+		if (fork() == 0) {
+			char msg[MSG_SIZE_MAX] = {0};
+			for (int j = share(MSG_COUNT, producers, i); j > 0; --j)
+				shm_queue_push(q, msg, msg_size);
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < consumers; ++i) {
+		if (fork() == 0) {
+			char msg[MSG_SIZE_MAX];
+			for (int j = share(MSG_COUNT, consumers, i); j > 0; --j)
+				shm_queue_pop(q, msg, sizeof(msg));
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < producers + consumers; ++i)
+		wait(NULL);
+	double res = (time_ns() - start) / (double)MSG_COUNT;
+	assert(q->lost_count == 0);
+	shm_queue_close(q);
+	shm_queue_destroy(id);
+	return res;
+}
+
+static double
+bench_msg_queue(int producers, int consumers, int msg_size)
+{
+	int id = msgget(IPC_PRIVATE, IPC_CREAT | S_IRWXU);
+	assert(id >= 0);
+	uint64_t start = time_ns();
+	for (int i = 0; i < producers; ++i) {
+		if (fork() == 0) {
+			struct msgbuf_max msg = {1, {0}};
+			for (int j = share(MSG_COUNT, producers, i); j > 0; --j)
+				msgsnd(id, &msg, msg_size, 0);
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < consumers; ++i) {
+		if (fork() == 0) {
+			struct msgbuf_max msg;
+			for (int j = share(MSG_COUNT, consumers, i); j > 0; --j)
+				msgrcv(id, &msg, sizeof(msg.mtext), 0, 0);
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < producers + consumers; ++i)
+		wait(NULL);
+	double res = (time_ns() - start) / (double)MSG_COUNT;
+	msgctl(id, IPC_RMID, NULL);
+	return res;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench(const char *name, double (*func)(int, int, int), int producers,
+      int consumers, int msg_size)
+{
+	double times[RUN_COUNT];
+	/* Otherwise the children would print the buffer again. */
+	fflush(stdout);
+	for (int i = 0; i < RUN_COUNT; ++i)
+		times[i] = func(producers, consumers, msg_size);
+	qsort(times, RUN_COUNT, sizeof(times[0]), double_cmp);
+	printf("%s, %d producers, %d consumers, %d bytes\n", name, producers,
+	       consumers, msg_size);
+	printf("    min: %.2lf ns per message\n", times[0]);
+	printf("    med: %.2lf ns per message\n", times[RUN_COUNT / 2]);
+	printf("    max: %.2lf ns per message\n", times[RUN_COUNT - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	show_recovery();
+	int producers = 1;
+	int consumers = 1;
+	int msg_size = 64;
+	if (argc > 2) {
+		producers = atoi(argv[1]);
+		consumers = atoi(argv[2]);
+	}
+	if (argc > 3)
+		msg_size = atoi(argv[3]);
+	if (producers < 1 || consumers < 1 || msg_size < 1 ||
+	    msg_size > MSG_SIZE_MAX) {
+		printf("Bad arguments\n");
+		return -1;
+	}
+	bench("shm queue", bench_shm_queue, producers, consumers, msg_size);
+	bench("msg queue", bench_msg_queue, producers, consumers, msg_size);
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Message queue for any number of producer and consumer processes in a
+ * SysV shared memory segment. Like the one of msgsnd()/msgrcv(), but
+ * the messages don't go through the kernel.
+ *
+ * It is a ring of the fixed size slots without a global lock. Each slot
+ * has a state word: the sequence number telling whose turn it is (the
+ * producer of position P when it is P, the consumer when it is P + 1),
+ * and the pid of the process writing or reading the slot right now. A
+ * process claims a slot by a CAS of its state, so the pid is saved
+ * together with the claim. If the process dies with the slot claimed,
+ * the others see that the pid is not alive anymore and take the slot
+ * back. The message in it is lost then, and counted in lost_count.
+ * That is the same what 11_shm.c does with a robust mutex, but per
+ * slot.
+ *
+ * The pid liveness is checked with kill(pid, 0), so a dead child has to
+ * be wait()-ed first. A zombie is still alive for kill().
+ */
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_QUEUE_CACHE_LINE 64
+/* Owner of a ready slot left by a dead producer. */
+#define SHM_QUEUE_OWNER_BROKEN UINT32_MAX
+/* How often the blocked ones look for the dead slot owners. */
+#define SHM_QUEUE_CHECK_DEAD_MS 10
+
+struct shm_queue_slot {
+	/* Sequence in the high 32 bits, owner pid or 0 in the low. */
+	uint64_t state;
+	uint32_t size;
+	char data[];
+};
+
+struct shm_queue {
+	/* Power of 2. */
+	uint32_t capacity;
+	uint32_t msg_size_max;
+	uint32_t slot_size;
+	/* Messages dropped with their dead writers or readers. */
+	uint32_t lost_count;
+	char pad1[SHM_QUEUE_CACHE_LINE - 4 * sizeof(uint32_t)];
+	/*
+	 * Next position to push. Only a hint, the slot state is what
+	 * decides. Who claims a slot moves it, and the others help if
+	 * the claimer is slow or dead.
+	 */
+	uint32_t tail;
+	/* Changed when a message appears, for the consumers to sleep. */
+	uint32_t push_event;
+	/* Some consumers sleep or are going to. */
+	uint32_t is_pop_waiting;
+	char pad2[SHM_QUEUE_CACHE_LINE - 3 * sizeof(uint32_t)];
+	/* Next position to pop. */
+	uint32_t head;
+	/* Changed when a slot is freed, for the producers to sleep. */
+	uint32_t pop_event;
+	uint32_t is_push_waiting;
+	char pad3[SHM_QUEUE_CACHE_LINE - 3 * sizeof(uint32_t)];
+	char slots[];
+};
+
+static inline uint64_t
+shm_queue_state(uint32_t seq, uint32_t pid)
+{
+	return ((uint64_t)seq << 32) | pid;
+}
+
+static inline struct shm_queue_slot *
+shm_queue_slot(struct shm_queue *q, uint32_t pos)
+{
+	return (struct shm_queue_slot *)
+		(q->slots + (size_t)(pos & (q->capacity - 1)) * q->slot_size);
+}
+
+/*
+ * getpid() is a syscall, so it is cached. After fork() the child
+ * resets the cache.
+ */
+static pid_t shm_queue_pid_cache = 0;
+static pthread_once_t shm_queue_pid_once = PTHREAD_ONCE_INIT;
+
+static void
+shm_queue_pid_reset(void)
+{
+	shm_queue_pid_cache = getpid();
+}
+
+static void
+shm_queue_pid_init(void)
+{
+	pthread_atfork(NULL, NULL, shm_queue_pid_reset);
+	shm_queue_pid_reset();
+}
+
+static inline uint32_t
+shm_queue_pid(void)
+{
+	pthread_once(&shm_queue_pid_once, shm_queue_pid_init);
+	return shm_queue_pid_cache;
+}
+
+static inline bool
+shm_queue_is_dead(uint32_t pid)
+{
+	return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+static inline uint32_t
+shm_queue_slot_size(uint32_t msg_size_max)
+{
+	return (sizeof(struct shm_queue_slot) + msg_size_max + 7) & ~7;
+}
+
+/*
+ * Create a segment for the key and the queue in it. The capacity is
+ * rounded up to a power of 2. Returns the segment id, or -1.
+ */
+static inline int
+shm_queue_create(key_t key, uint32_t capacity, uint32_t msg_size_max)
+{
+	uint32_t cap = 1;
+	while (cap < capacity)
+		cap *= 2;
+	uint32_t slot_size = shm_queue_slot_size(msg_size_max);
+	int id = shmget(key, sizeof(struct shm_queue) + (size_t)cap * slot_size,
+			IPC_CREAT | IPC_EXCL | S_IRWXU);
+	if (id < 0)
+		return -1;
+	struct shm_queue *q = shmat(id, NULL, 0);
+	if (q == (void *)-1) {
+		shmctl(id, IPC_RMID, NULL);
+		return -1;
+	}
+	/* The new segment is zeroed. */
+	q->capacity = cap;
+	q->msg_size_max = msg_size_max;
+	q->slot_size = slot_size;
+	for (uint32_t i = 0; i < cap; ++i)
+		shm_queue_slot(q, i)->state = shm_queue_state(i, 0);
+	shmdt(q);
+	return id;
+}
+
+/* Attach the queue created with that id. NULL on error. */
+static inline struct shm_queue *
+shm_queue_open(int id)
+{
+	struct shm_queue *q = shmat(id, NULL, 0);
+	return q == (void *)-1 ? NULL : q;
+}
+
+static inline void
+shm_queue_close(struct shm_queue *q)
+{
+	shmdt(q);
+}
+
+static inline void
+shm_queue_destroy(int id)
+{
+	shmctl(id, IPC_RMID, NULL);
+}
+
+static inline void
+shm_queue_futex_wait(uint32_t *futex, uint32_t val)
+{
+	struct timespec timeout = {0, SHM_QUEUE_CHECK_DEAD_MS * 1000000};
+	syscall(SYS_futex, futex, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+/*
+ * Wake up all who sleep on the event. Only the first notifier after
+ * they went to sleep does the syscall. The waiters set the flag before
+ * their last check of the queue, and the notifiers look at it after
+ * changing the queue. So either the waiter sees the change, or the
+ * notifier sees the flag.
+ */
+static inline void
+shm_queue_notify(uint32_t *event, uint32_t *is_waiting)
+{
+	if (__atomic_load_n(is_waiting, __ATOMIC_SEQ_CST) == 0 ||
+	    __atomic_exchange_n(is_waiting, 0, __ATOMIC_SEQ_CST) == 0)
+		return;
+	__atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, event, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Claim a slot for writing. Returns NULL when the queue is full. The
+ * message is written into slot->data, and is visible for the
+ * consumers after shm_queue_push_commit().
+ */
+static inline struct shm_queue_slot *
+shm_queue_push_begin(struct shm_queue *q)
+{
+	uint32_t pid = shm_queue_pid();
+	while (true) {
+		uint32_t pos = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		struct shm_queue_slot *slot = shm_queue_slot(q, pos);
+		uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		uint32_t owner = (uint32_t)state;
+		int32_t diff = (int32_t)((uint32_t)(state >> 32) - pos);
+		if (diff == 0) {
+			if (owner == 0 &&
+			    __atomic_compare_exchange_n(&slot->state, &state,
+							shm_queue_state(pos, pid),
+							false, __ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED)) {
+				__atomic_compare_exchange_n(&q->tail, &pos,
+							    pos + 1, false,
+							    __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED);
+				return slot;
+			}
+			/* Another producer has it, help to move on. */
+			if (owner != 0)
+				__atomic_compare_exchange_n(&q->tail, &pos,
+							    pos + 1, false,
+							    __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED);
+			continue;
+		}
+		if (diff > 0) {
+			/*
+			 * The slot is taken already, but the tail is not
+			 * moved yet. Or it is moved and was read before that.
+			 */
+			__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+						    false, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED);
+			continue;
+		}
+		/*
+		 * The message of the previous lap is still here. If it is
+		 * being written, the consumers will deal with it.
+		 */
+		if (diff != 1 - (int32_t)q->capacity || owner == 0 ||
+		    owner == SHM_QUEUE_OWNER_BROKEN || !shm_queue_is_dead(owner))
+			return NULL;
+		/* Its reader is dead. Drop the message. */
+		if (__atomic_compare_exchange_n(&slot->state, &state,
+						shm_queue_state(pos, 0), false,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			__atomic_add_fetch(&q->lost_count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void
+shm_queue_push_commit(struct shm_queue *q, struct shm_queue_slot *slot,
+		      uint32_t size)
+{
+	slot->size = size;
+	uint32_t seq = (uint32_t)(slot->state >> 32);
+	__atomic_store_n(&slot->state, shm_queue_state(seq + 1, 0),
+			 __ATOMIC_SEQ_CST);
+	shm_queue_notify(&q->push_event, &q->is_pop_waiting);
+}
+
+/*
+ * Claim the oldest message for reading. Returns NULL when there are no
+ * messages ready. The message is slot->data of slot->size bytes, valid
+ * until shm_queue_pop_commit().
+ */
+static inline struct shm_queue_slot *
+shm_queue_pop_begin(struct shm_queue *q)
+{
+	uint32_t pid = shm_queue_pid();
+	while (true) {
+		uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		struct shm_queue_slot *slot = shm_queue_slot(q, pos);
+		uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		uint32_t owner = (uint32_t)state;
+		int32_t diff = (int32_t)((uint32_t)(state >> 32) - (pos + 1));
+		if (diff == 0) {
+			if (owner == 0 &&
+			    __atomic_compare_exchange_n(&slot->state, &state,
+							shm_queue_state(pos + 1, pid),
+							false, __ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED)) {
+				__atomic_compare_exchange_n(&q->head, &pos,
+							    pos + 1, false,
+							    __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED);
+				return slot;
+			}
+			if (owner == SHM_QUEUE_OWNER_BROKEN) {
+				/*
+				 * Left by a dead producer. Freed right away,
+				 * and only then the head can move on.
+				 */
+				uint64_t new_state =
+					shm_queue_state(pos + q->capacity, 0);
+				if (!__atomic_compare_exchange_n(&slot->state,
+								 &state, new_state,
+								 false,
+								 __ATOMIC_SEQ_CST,
+								 __ATOMIC_RELAXED))
+					continue;
+				__atomic_add_fetch(&q->lost_count, 1,
+						   __ATOMIC_RELAXED);
+				shm_queue_notify(&q->pop_event,
+						 &q->is_push_waiting);
+			}
+			/* Another consumer has it, help to move on. */
+			if (owner != 0)
+				__atomic_compare_exchange_n(&q->head, &pos,
+							    pos + 1, false,
+							    __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED);
+			continue;
+		}
+		if (diff > 0) {
+			__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+						    false, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED);
+			continue;
+		}
+		/* Empty, or the message is still being written. */
+		if (diff != -1 || owner == 0 || !shm_queue_is_dead(owner))
+			return NULL;
+		/* The producer is dead. Mark the slot as ready and broken. */
+		__atomic_compare_exchange_n(&slot->state, &state,
+					    shm_queue_state(pos + 1,
+							    SHM_QUEUE_OWNER_BROKEN),
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED);
+	}
+}
+
+static inline void
+shm_queue_pop_commit(struct shm_queue *q, struct shm_queue_slot *slot)
+{
+	uint32_t seq = (uint32_t)(slot->state >> 32);
+	__atomic_store_n(&slot->state,
+			 shm_queue_state(seq - 1 + q->capacity, 0),
+			 __ATOMIC_SEQ_CST);
+	shm_queue_notify(&q->pop_event, &q->is_push_waiting);
+}
+
+/*
+ * Copying versions. They wait while the queue is full or empty. Size
+ * must be not bigger than msg_size_max. Pop returns the message size,
+ * and copies not more than buf_size of it.
+ */
+static inline void
+shm_queue_push(struct shm_queue *q, const void *data, uint32_t size)
+{
+	struct shm_queue_slot *slot;
+	while ((slot = shm_queue_push_begin(q)) == NULL) {
+		uint32_t event = __atomic_load_n(&q->pop_event, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&q->is_push_waiting, 1, __ATOMIC_SEQ_CST);
+		if ((slot = shm_queue_push_begin(q)) != NULL)
+			break;
+		shm_queue_futex_wait(&q->pop_event, event);
+	}
+	memcpy(slot->data, data, size);
+	shm_queue_push_commit(q, slot, size);
+}
+
+static inline uint32_t
+shm_queue_pop(struct shm_queue *q, void *buf, uint32_t buf_size)
+{
+	struct shm_queue_slot *slot;
+	while ((slot = shm_queue_pop_begin(q)) == NULL) {
+		uint32_t event = __atomic_load_n(&q->push_event, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&q->is_pop_waiting, 1, __ATOMIC_SEQ_CST);
+		if ((slot = shm_queue_pop_begin(q)) != NULL)
+			break;
+		shm_queue_futex_wait(&q->push_event, event);
+	}
+	uint32_t size = slot->size;
+	memcpy(buf, slot->data, size < buf_size ? size : buf_size);
+	shm_queue_pop_commit(q, slot);
+	return size;
+}
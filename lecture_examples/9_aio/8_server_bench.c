@@ -0,0 +1,854 @@
+/*
+ * The echo server of the examples 4-7 with the event loop backend
+ * chosen at start: select, poll, epoll, kqueue or io_uring. And a load
+ * driver for it. For each backend and connection count it shows:
+ *
+ * - how fast the connections are accepted, each one until its first
+ *   echo is received;
+ * - echo round trip time percentiles, with a few requests in flight on
+ *   random connections, while the others are idle;
+ * - how much CPU the server process has spent.
+ *
+ *     ./a.out [<backend> or all [<max connection count>]]
+ *
+ * The server is a child process, so the driver and the server have own
+ * file descriptor limits. The counts above the limit are skipped. For
+ * more than ~28k connections the driver connects from the different
+ * local addresses 127.0.0.X, because each address has only so many
+ * ports.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_EPOLL 1
+#define HAVE_IO_URING 1
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__)
+#include <sys/event.h>
+#define HAVE_KQUEUE 1
+#endif
+
+enum {
+	/* How many ready fds a backend returns at once. */
+	EVENT_BATCH = 256,
+	/* Connects in progress at once, not to overflow the backlog. */
+	CONNECT_WINDOW = 256,
+	/* Echo requests in flight at once in the round trip phase. */
+	ECHO_WINDOW = 64,
+	ECHO_PHASE_MS = 1000,
+	ECHO_SAMPLES_MAX = 4 * 1000 * 1000,
+	/* Connections from one local address. */
+	CONNS_PER_ADDR = 20000,
+	/* Descriptors kept for the listener, the backend, stdio. */
+	FD_RESERVE = 16,
+};
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Event loop backend. The server has one loop, so the backends keep
+ * their state in the globals.
+ */
+struct backend {
+	const char *name;
+	/* The fds must be below it, or 0 if there is no such limit. */
+	int fd_limit;
+	int (*create)(int fd_count);
+	void (*destroy)(void);
+	int (*add)(int fd);
+	void (*del)(int fd);
+	/* Up to count fds ready for reading. -1 on error. */
+	int (*wait)(int *fds, int count);
+};
+
+////////////////////////////////////////////////////////////////////////
+// select
+
+static fd_set select_fds;
+static int select_max_fd;
+
+static int
+select_create(int fd_count)
+{
+	(void)fd_count;
+	FD_ZERO(&select_fds);
+	select_max_fd = -1;
+	return 0;
+}
+
+static void
+select_destroy(void)
+{
+}
+
+static int
+select_add(int fd)
+{
+	FD_SET(fd, &select_fds);
+	if (fd > select_max_fd)
+		select_max_fd = fd;
+	return 0;
+}
+
+static void
+select_del(int fd)
+{
+	FD_CLR(fd, &select_fds);
+	while (select_max_fd >= 0 && !FD_ISSET(select_max_fd, &select_fds))
+		--select_max_fd;
+}
+
+static int
+select_wait(int *fds, int count)
+{
+	fd_set ready = select_fds;
+	int rc = select(select_max_fd + 1, &ready, NULL, NULL, NULL);
+	if (rc < 0)
+		return -1;
+	int res = 0;
+	for (int fd = 0; fd <= select_max_fd && res < count; ++fd) {
+		if (FD_ISSET(fd, &ready))
+			fds[res++] = fd;
+	}
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////
+// poll
+
+static struct pollfd *poll_fds;
+static int poll_fd_count;
+/* Index of each fd in poll_fds. */
+static int *poll_fd_index;
+
+static int
+poll_create(int fd_count)
+{
+	poll_fds = malloc(fd_count * sizeof(poll_fds[0]));
+	poll_fd_index = malloc(fd_count * sizeof(poll_fd_index[0]));
+	poll_fd_count = 0;
+	return poll_fds == NULL || poll_fd_index == NULL ? -1 : 0;
+}
+
+static void
+poll_destroy(void)
+{
+	free(poll_fds);
+	free(poll_fd_index);
+}
+
+static int
+poll_add(int fd)
+{
+	poll_fds[poll_fd_count].fd = fd;
+	poll_fds[poll_fd_count].events = POLLIN;
+	poll_fds[poll_fd_count].revents = 0;
+	poll_fd_index[fd] = poll_fd_count++;
+	return 0;
+}
+
+static void
+poll_del(int fd)
+{
+	/* The last one takes the place of the removed one. */
+	int i = poll_fd_index[fd];
+	poll_fds[i] = poll_fds[--poll_fd_count];
+	poll_fd_index[poll_fds[i].fd] = i;
+}
+
+static int
+poll_wait(int *fds, int count)
+{
+	int rc = poll(poll_fds, poll_fd_count, -1);
+	if (rc < 0)
+		return -1;
+	int res = 0;
+	for (int i = 0; i < poll_fd_count && res < count && res < rc; ++i) {
+		if (poll_fds[i].revents != 0)
+			fds[res++] = poll_fds[i].fd;
+	}
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////
+// epoll
+
+#if HAVE_EPOLL
+
+static int epoll_fd;
+
+static int
+epoll_backend_create(int fd_count)
+{
+	(void)fd_count;
+	epoll_fd = epoll_create1(0);
+	return epoll_fd < 0 ? -1 : 0;
+}
+
+static void
+epoll_backend_destroy(void)
+{
+	close(epoll_fd);
+}
+
+static int
+epoll_backend_add(int fd)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void
+epoll_backend_del(int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+epoll_backend_wait(int *fds, int count)
+{
+	struct epoll_event evs[EVENT_BATCH];
+	if (count > EVENT_BATCH)
+		count = EVENT_BATCH;
+	int rc = epoll_wait(epoll_fd, evs, count, -1);
+	for (int i = 0; i < rc; ++i)
+		fds[i] = evs[i].data.fd;
+	return rc;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// kqueue
+
+#if HAVE_KQUEUE
+
+static int kqueue_fd;
+
+static int
+kqueue_backend_create(int fd_count)
+{
+	(void)fd_count;
+	kqueue_fd = kqueue();
+	return kqueue_fd < 0 ? -1 : 0;
+}
+
+static void
+kqueue_backend_destroy(void)
+{
+	close(kqueue_fd);
+}
+
+static int
+kqueue_backend_add(int fd)
+{
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	return kevent(kqueue_fd, &ev, 1, NULL, 0, NULL);
+}
+
+static void
+kqueue_backend_del(int fd)
+{
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(kqueue_fd, &ev, 1, NULL, 0, NULL);
+}
+
+static int
+kqueue_backend_wait(int *fds, int count)
+{
+	struct kevent evs[EVENT_BATCH];
+	if (count > EVENT_BATCH)
+		count = EVENT_BATCH;
+	int rc = kevent(kqueue_fd, NULL, 0, evs, count, NULL);
+	for (int i = 0; i < rc; ++i)
+		fds[i] = (int)evs[i].ident;
+	return rc;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// io_uring
+
+#if HAVE_IO_URING
+
+/*
+ * The readiness is taken from the one-shot poll requests, re-armed after
+ * each completion. The request data is the fd and its generation, which
+ * changes on removal. So a late completion of a removed fd is not
+ * confused with a new socket got the same fd number.
+ */
+static struct {
+	int fd;
+	void *mem;
+	size_t mem_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	/* Filled, but not given to the kernel yet. */
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	uint32_t *generations;
+} uring;
+
+#define URING_REMOVE_DATA UINT64_MAX
+
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, uring.fd, to_submit,
+			    min_complete, flags, NULL, 0);
+}
+
+static int
+uring_submit(unsigned min_complete)
+{
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (true) {
+		int rc = uring_enter(uring.to_submit, min_complete, flags);
+		if (rc >= 0) {
+			uring.to_submit -= rc;
+			return 0;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+	unsigned tail = *uring.sq_tail;
+	if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+	    uring.sq_entries && uring_submit(0) != 0)
+		return NULL;
+	unsigned index = tail & uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[index] = index;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++uring.to_submit;
+	return sqe;
+}
+
+static uint64_t
+uring_poll_data(int fd)
+{
+	return ((uint64_t)uring.generations[fd] << 32) | (uint32_t)fd;
+}
+
+static int
+uring_arm(int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = uring_poll_data(fd);
+	return 0;
+}
+
+static void
+uring_destroy(void)
+{
+	munmap(uring.sqes, uring.sqes_size);
+	munmap(uring.mem, uring.mem_size);
+	close(uring.fd);
+	free(uring.generations);
+}
+
+static int
+uring_create(int fd_count)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	/* All the connections can become ready at once. */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 65536;
+	uring.fd = (int)syscall(__NR_io_uring_setup, 4096, &params);
+	if (uring.fd < 0)
+		return -1;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+	    (params.features & IORING_FEAT_NODROP) == 0) {
+		close(uring.fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	uring.mem_size = sq_size > cq_size ? sq_size : cq_size;
+	uring.mem = mmap(NULL, uring.mem_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, uring.fd,
+			 IORING_OFF_SQ_RING);
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	uring.generations = calloc(fd_count, sizeof(uring.generations[0]));
+	if (uring.mem == MAP_FAILED || uring.sqes == MAP_FAILED ||
+	    uring.generations == NULL) {
+		printf("io_uring setup error\n");
+		exit(-1);
+	}
+	char *mem = uring.mem;
+	uring.sq_head = (unsigned *)(mem + params.sq_off.head);
+	uring.sq_tail = (unsigned *)(mem + params.sq_off.tail);
+	uring.sq_array = (unsigned *)(mem + params.sq_off.array);
+	uring.sq_mask = *(unsigned *)(mem + params.sq_off.ring_mask);
+	uring.sq_entries = params.sq_entries;
+	uring.to_submit = 0;
+	uring.cq_head = (unsigned *)(mem + params.cq_off.head);
+	uring.cq_tail = (unsigned *)(mem + params.cq_off.tail);
+	uring.cq_mask = *(unsigned *)(mem + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+	return 0;
+}
+
+static int
+uring_add(int fd)
+{
+	return uring_arm(fd);
+}
+
+static void
+uring_del(int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = uring_poll_data(fd);
+		sqe->user_data = URING_REMOVE_DATA;
+	}
+	++uring.generations[fd];
+	/* Before the fd is closed and its number is reused. */
+	uring_submit(0);
+}
+
+static int
+uring_wait(int *fds, int count)
+{
+	unsigned head = *uring.cq_head;
+	bool is_empty = head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	if (uring_submit(is_empty ? 1 : 0) != 0)
+		return -1;
+	int res = 0;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail && res < count; ++head) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		if (cqe->user_data == URING_REMOVE_DATA)
+			continue;
+		int fd = (int)(uint32_t)cqe->user_data;
+		if (cqe->user_data != uring_poll_data(fd))
+			continue;
+		fds[res++] = fd;
+		if (uring_arm(fd) != 0)
+			return -1;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	return res;
+}
+
+#endif
+
+static const struct backend backends[] = {
+	{"select", FD_SETSIZE, select_create, select_destroy, select_add,
+	 select_del, select_wait},
+	{"poll", 0, poll_create, poll_destroy, poll_add, poll_del, poll_wait},
+#if HAVE_EPOLL
+	{"epoll", 0, epoll_backend_create, epoll_backend_destroy,
+	 epoll_backend_add, epoll_backend_del, epoll_backend_wait},
+#endif
+#if HAVE_KQUEUE
+	{"kqueue", 0, kqueue_backend_create, kqueue_backend_destroy,
+	 kqueue_backend_add, kqueue_backend_del, kqueue_backend_wait},
+#endif
+#if HAVE_IO_URING
+	{"io_uring", 0, uring_create, uring_destroy, uring_add, uring_del,
+	 uring_wait},
+#endif
+};
+
+static const int backend_count = sizeof(backends) / sizeof(backends[0]);
+
+////////////////////////////////////////////////////////////////////////
+// Server
+
+static void
+server_run(const struct backend *b, int server, int fd_count)
+{
+	if (b->create(fd_count) != 0 || b->add(server) != 0) {
+		printf("%s error = %s\n", b->name, strerror(errno));
+		exit(-1);
+	}
+	int fds[EVENT_BATCH];
+	while (true) {
+		int count = b->wait(fds, EVENT_BATCH);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("%s error = %s\n", b->name, strerror(errno));
+			exit(-1);
+		}
+		for (int i = 0; i < count; ++i) {
+			int fd = fds[i];
+			if (fd == server) {
+				int peer;
+				while ((peer = accept4(server, NULL, NULL,
+						       SOCK_NONBLOCK)) >= 0) {
+					if ((b->fd_limit != 0 &&
+					     peer >= b->fd_limit) ||
+					    b->add(peer) != 0)
+						close(peer);
+				}
+				continue;
+			}
+			char buf[64];
+			ssize_t rc = recv(fd, buf, sizeof(buf), 0);
+			if (rc > 0) {
+				send(fd, buf, rc, 0);
+				continue;
+			}
+			if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			b->del(fd);
+			close(fd);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Load driver
+
+struct conn {
+	int fd;
+	bool is_busy;
+	uint64_t sent_ns;
+};
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+/*
+ * Connect to the server. On the loopback connect() doesn't wait for the
+ * server, only for the kernel, so it is done blocking.
+ */
+static int
+conn_open(const struct sockaddr_in *server_addr, int i)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i / CONNS_PER_ADDR);
+	int one = 1;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	/* The port is chosen at connect(), unique only for the address. */
+	setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+	    connect(fd, (struct sockaddr *)server_addr,
+		    sizeof(*server_addr)) != 0 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+conn_send(struct conn *c)
+{
+	uint64_t now = time_ns();
+	c->sent_ns = now;
+	c->is_busy = true;
+	if (send(c->fd, &now, sizeof(now), 0) != sizeof(now)) {
+		printf("send error = %s\n", strerror(errno));
+		exit(-1);
+	}
+}
+
+/* Returns true if the echo is received. */
+static bool
+conn_recv(struct conn *c)
+{
+	uint64_t buf;
+	ssize_t rc = recv(c->fd, &buf, sizeof(buf), 0);
+	if (rc == sizeof(buf)) {
+		c->is_busy = false;
+		return true;
+	}
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	printf("connection %d broken: %s\n", c->fd,
+	       rc == 0 ? "closed" : strerror(errno));
+	exit(-1);
+}
+
+static struct conn *
+conn_find_idle(struct conn *conns, int conn_count)
+{
+	while (true) {
+		struct conn *c = &conns[rand() % conn_count];
+		if (!c->is_busy)
+			return c;
+	}
+}
+
+struct bench_result {
+	double connects_per_sec;
+	double echoes_per_sec;
+	uint64_t rtt_p50;
+	uint64_t rtt_p99;
+	uint64_t rtt_p999;
+	double server_cpu;
+};
+
+/*
+ * The driver takes the most scalable backend there is, the same for all
+ * the tested ones. Otherwise with select or poll it would be slower
+ * than the server.
+ */
+static const struct backend *
+driver_backend(void)
+{
+	const char *names[] = {"epoll", "kqueue", "poll"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		for (int j = 0; j < backend_count; ++j) {
+			if (strcmp(backends[j].name, names[i]) == 0)
+				return &backends[j];
+		}
+	}
+	abort();
+}
+
+static void
+driver_wait(const struct backend *b, int *fds, int *count)
+{
+	while ((*count = b->wait(fds, EVENT_BATCH)) < 0) {
+		if (errno != EINTR) {
+			printf("%s error = %s\n", b->name, strerror(errno));
+			exit(-1);
+		}
+	}
+}
+
+static void
+driver_run(const struct sockaddr_in *server_addr, int conn_count,
+	   int fd_count, struct bench_result *res)
+{
+	const struct backend *b = driver_backend();
+	struct conn *conns = calloc(conn_count, sizeof(*conns));
+	struct conn **conn_by_fd = calloc(fd_count, sizeof(*conn_by_fd));
+	uint64_t *samples = malloc(ECHO_SAMPLES_MAX * sizeof(*samples));
+	if (b->create(fd_count) != 0) {
+		printf("%s error = %s\n", b->name, strerror(errno));
+		exit(-1);
+	}
+	int fds[EVENT_BATCH];
+	int count;
+	/*
+	 * Connect. Each connection sends its first request right away and
+	 * is counted when the echo is back. Not more than the window is
+	 * in progress, or the server backlog overflows and the SYNs get
+	 * retried after a second.
+	 */
+	uint64_t start = time_ns();
+	int opened = 0;
+	int connected = 0;
+	while (connected < conn_count) {
+		while (opened < conn_count &&
+		       opened - connected < CONNECT_WINDOW) {
+			struct conn *c = &conns[opened];
+			c->fd = conn_open(server_addr, opened);
+			if (c->fd < 0 || c->fd >= fd_count || b->add(c->fd) != 0) {
+				printf("connect error = %s\n", strerror(errno));
+				exit(-1);
+			}
+			conn_by_fd[c->fd] = c;
+			conn_send(c);
+			++opened;
+		}
+		driver_wait(b, fds, &count);
+		for (int i = 0; i < count; ++i) {
+			if (conn_recv(conn_by_fd[fds[i]]))
+				++connected;
+		}
+	}
+	res->connects_per_sec = conn_count / ((time_ns() - start) / 1e9);
+	/*
+	 * Echo. A few requests are in flight on random connections, the
+	 * others are idle.
+	 */
+	int window = ECHO_WINDOW < conn_count ? ECHO_WINDOW : conn_count;
+	for (int i = 0; i < window; ++i)
+		conn_send(conn_find_idle(conns, conn_count));
+	int sample_count = 0;
+	start = time_ns();
+	uint64_t deadline = start + (uint64_t)ECHO_PHASE_MS * 1000000;
+	while (time_ns() < deadline && sample_count < ECHO_SAMPLES_MAX) {
+		driver_wait(b, fds, &count);
+		for (int i = 0; i < count; ++i) {
+			struct conn *c = conn_by_fd[fds[i]];
+			if (!conn_recv(c))
+				continue;
+			if (sample_count < ECHO_SAMPLES_MAX)
+				samples[sample_count++] = time_ns() - c->sent_ns;
+			conn_send(conn_find_idle(conns, conn_count));
+		}
+	}
+	res->echoes_per_sec = sample_count / ((time_ns() - start) / 1e9);
+	qsort(samples, sample_count, sizeof(samples[0]), uint64_cmp);
+	res->rtt_p50 = samples[sample_count / 2];
+	res->rtt_p99 = samples[(int)(sample_count * 0.99)];
+	res->rtt_p999 = samples[(int)(sample_count * 0.999)];
+	b->destroy();
+	for (int i = 0; i < conn_count; ++i)
+		close(conns[i].fd);
+	free(samples);
+	free(conn_by_fd);
+	free(conns);
+}
+
+static int
+bench(const struct backend *b, int conn_count, struct bench_result *res)
+{
+	int server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (server == -1) {
+		printf("error = %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	socklen_t addr_len = sizeof(addr);
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(server, SOMAXCONN) != 0 ||
+	    getsockname(server, (struct sockaddr *)&addr, &addr_len) != 0) {
+		printf("error = %s\n", strerror(errno));
+		close(server);
+		return -1;
+	}
+	fflush(stdout);
+	uint64_t start = time_ns();
+	pid_t pid = fork();
+	if (pid == 0)
+		server_run(b, server, conn_count + FD_RESERVE);
+	close(server);
+	driver_run(&addr, conn_count, conn_count + FD_RESERVE, res);
+	double wall = (time_ns() - start) / 1e9;
+	kill(pid, SIGKILL);
+	struct rusage usage;
+	wait4(pid, NULL, 0, &usage);
+	double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	res->server_cpu = cpu / wall;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *backend_name = argc > 1 && strcmp(argv[1], "all") != 0 ?
+				   argv[1] : NULL;
+	int max_conn_count = argc > 2 ? atoi(argv[2]) : 50000;
+	const int conn_counts[] = {100, 1000, 10000, 50000};
+	/* The connections and the echo samples take many descriptors. */
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	int fd_max = limit.rlim_cur > INT32_MAX ? INT32_MAX : (int)limit.rlim_cur;
+
+	bool is_found = false;
+	for (int i = 0; i < backend_count; ++i) {
+		const struct backend *b = &backends[i];
+		if (backend_name != NULL && strcmp(backend_name, b->name) != 0)
+			continue;
+		is_found = true;
+		for (size_t j = 0; j < sizeof(conn_counts) / sizeof(conn_counts[0]);
+		     ++j) {
+			int count = conn_counts[j];
+			if (count > max_conn_count)
+				break;
+			printf("%s, %d connections\n", b->name, count);
+			if (count + FD_RESERVE > fd_max ||
+			    (b->fd_limit != 0 && count + FD_RESERVE > b->fd_limit)) {
+				printf("    skipped, over the fd limit\n");
+				continue;
+			}
+			struct bench_result res;
+			if (bench(b, count, &res) != 0)
+				return -1;
+			printf("    connect: %.0lf conn/s\n", res.connects_per_sec);
+			printf("    echo: %.0lf req/s\n", res.echoes_per_sec);
+			printf("    rtt p50: %.1lf us, p99: %.1lf us, "
+			       "p99.9: %.1lf us\n", res.rtt_p50 / 1000.0,
+			       res.rtt_p99 / 1000.0, res.rtt_p999 / 1000.0);
+			printf("    server cpu: %.0lf%%\n", res.server_cpu * 100);
+		}
+	}
+	if (!is_found) {
+		printf("Unknown backend, the known ones:");
+		for (int i = 0; i < backend_count; ++i)
+			printf(" %s", backends[i].name);
+		printf("\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Mutex which spins a bit before going to sleep. It is the spinlock of
+ * lecture_examples/6_threads/8_6_spinlock_acq_rel.c and the futex lock of 8_futex.c put
+ * together. Short critical sections under contention are passed between the threads
+ * without the syscalls, and the long ones don't burn the CPU.
+ *
+ * The lock word has 3 states: free, locked, and locked with possible sleepers. Only the
+ * last one makes the unlock call futex wake, so an uncontended lock-unlock is 2 atomics.
+ *
+ * How long to spin is learned per lock like glibc PTHREAD_MUTEX_ADAPTIVE_NP does: it is
+ * about twice the spins which were needed recently. On a single CPU there is no spinning
+ * at all, the owner can't run while the waiter spins.
+ *
+ *     struct adaptive_lock lock = ADAPTIVE_LOCK_INITIALIZER;
+ *     adaptive_lock_lock(&lock);
+ *     ...
+ *     adaptive_lock_unlock(&lock);
+ *
+ * In C++ the same is the adaptive_mutex class, usable with std::lock_guard. The lock is
+ * for the threads of one process. Where there are no futexes, the sleep is sched_yield().
+ */
+
+enum {
+	ADAPTIVE_LOCK_FREE = 0,
+	ADAPTIVE_LOCK_LOCKED = 1,
+	/** Locked, and someone might sleep on it. */
+	ADAPTIVE_LOCK_CONTENDED = 2,
+	/** Longest spin, in the pause instructions. */
+	ADAPTIVE_LOCK_SPIN_MAX = 100,
+};
+
+struct adaptive_lock {
+	uint32_t state;
+	/**
+	 * Average spins which were needed to get the lock. Updated without atomics, it is just
+	 * a hint.
+	 */
+	int32_t spin_avg;
+};
+
+#define ADAPTIVE_LOCK_INITIALIZER {ADAPTIVE_LOCK_FREE, 0}
+
+static inline void
+adaptive_lock_create(struct adaptive_lock *lock)
+{
+	lock->state = ADAPTIVE_LOCK_FREE;
+	lock->spin_avg = 0;
+}
+
+/** Tell the CPU it is a spin-wait loop. Saves power and the other hyper-thread. */
+static inline void
+adaptive_lock_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/** Spinning makes sense only when the owner can run at the same time. */
+static inline bool
+adaptive_lock_can_spin(void)
+{
+	static int cpu_count = 0;
+	int count = __atomic_load_n(&cpu_count, __ATOMIC_RELAXED);
+	if (count == 0) {
+		count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (count <= 0)
+			count = 1;
+		__atomic_store_n(&cpu_count, count, __ATOMIC_RELAXED);
+	}
+	return count > 1;
+}
+
+static inline void
+adaptive_lock_wait(struct adaptive_lock *lock)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, ADAPTIVE_LOCK_CONTENDED, NULL,
+		NULL, 0);
+#else
+	(void)lock;
+	sched_yield();
+#endif
+}
+
+static inline void
+adaptive_lock_wake(struct adaptive_lock *lock)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	(void)lock;
+#endif
+}
+
+static inline bool
+adaptive_lock_trylock(struct adaptive_lock *lock)
+{
+	uint32_t expected = ADAPTIVE_LOCK_FREE;
+	return __atomic_compare_exchange_n(&lock->state, &expected, ADAPTIVE_LOCK_LOCKED, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+adaptive_lock_lock(struct adaptive_lock *lock)
+{
+	if (adaptive_lock_trylock(lock))
+		return;
+	if (adaptive_lock_can_spin()) {
+		int spin_avg = __atomic_load_n(&lock->spin_avg, __ATOMIC_RELAXED);
+		int spin_max = spin_avg * 2 + 10;
+		if (spin_max > ADAPTIVE_LOCK_SPIN_MAX)
+			spin_max = ADAPTIVE_LOCK_SPIN_MAX;
+		int spin_count = 0;
+		bool is_locked = false;
+		while (spin_count < spin_max) {
+			++spin_count;
+			adaptive_lock_pause();
+			/*
+			 * Read-only until the lock looks free, so the spinners don't bounce the
+			 * cache line between each other.
+			 */
+			if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == ADAPTIVE_LOCK_FREE &&
+			    adaptive_lock_trylock(lock)) {
+				is_locked = true;
+				break;
+			}
+		}
+		__atomic_store_n(&lock->spin_avg, spin_avg + (spin_count - spin_avg) / 8,
+				 __ATOMIC_RELAXED);
+		if (is_locked)
+			return;
+	}
+	/*
+	 * Not knowing whether there are other sleepers, the lock is taken as contended. The
+	 * unlock then does one wake too many at worst.
+	 */
+	while (__atomic_exchange_n(&lock->state, ADAPTIVE_LOCK_CONTENDED, __ATOMIC_ACQUIRE) !=
+	       ADAPTIVE_LOCK_FREE)
+		adaptive_lock_wait(lock);
+}
+
+static inline void
+adaptive_lock_unlock(struct adaptive_lock *lock)
+{
+	if (__atomic_exchange_n(&lock->state, ADAPTIVE_LOCK_FREE, __ATOMIC_RELEASE) ==
+	    ADAPTIVE_LOCK_CONTENDED)
+		adaptive_lock_wake(lock);
+}
+
+#ifdef __cplusplus
+
+class adaptive_mutex
+{
+public:
+	adaptive_mutex() = default;
+	adaptive_mutex(const adaptive_mutex &) = delete;
+	adaptive_mutex &operator=(const adaptive_mutex &) = delete;
+
+	void lock() { adaptive_lock_lock(&m_lock); }
+	bool try_lock() { return adaptive_lock_trylock(&m_lock); }
+	void unlock() { adaptive_lock_unlock(&m_lock); }
+
+private:
+	struct adaptive_lock m_lock = ADAPTIVE_LOCK_INITIALIZER;
+};
+
+#endif
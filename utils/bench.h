@@ -0,0 +1,215 @@
+#pragma once
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Helpers for the micro-benchmarks. A bench calls the tested operation in a loop, and
+ * does that several times to see the noise. The result is min, median, p99 and max of the
+ * runs, printed like the bonus tasks propose:
+ *
+ *     <Scenario>
+ *         min: 12.10 ns
+ *         med: 12.40 ns
+ *         p99: 13.00 ns
+ *         max: 13.00 ns
+ *
+ * With the environment variable BENCH_FORMAT=json each result is printed as one line of
+ * JSON instead, to be collected by scripts and compared between runs and machines.
+ */
+
+enum {
+	/** Default number of the measured runs. */
+	BENCH_RUN_COUNT = 5,
+};
+
+struct bench_result {
+	const char *name;
+	/** What the samples are, like "ns" or "ops/s". */
+	const char *unit;
+	int run_count;
+	double min;
+	double med;
+	double p99;
+	double max;
+};
+
+/** Monotonic time in nanoseconds. */
+static inline uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * CPU time stamp counter. Much cheaper than the clock, so good for timing short
+ * operations one by one. Its ticks are not nanoseconds, convert them with
+ * bench_tsc_per_ns(). Falls back to the clock where there is no counter.
+ */
+static inline uint64_t
+bench_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t res;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(res));
+	return res;
+#else
+	return bench_clock_ns();
+#endif
+}
+
+/** Counter ticks per nanosecond. Measured against the clock at the first call. */
+static inline double
+bench_tsc_per_ns(void)
+{
+	static double res = 0;
+	if (res != 0)
+		return res;
+	uint64_t ns1 = bench_clock_ns();
+	uint64_t tsc1 = bench_tsc();
+	while (bench_clock_ns() - ns1 < 10 * 1000 * 1000) {
+	}
+	uint64_t ns2 = bench_clock_ns();
+	uint64_t tsc2 = bench_tsc();
+	res = (double)(tsc2 - tsc1) / (ns2 - ns1);
+	return res;
+}
+
+/**
+ * Make the compiler believe the value is used, so the code computing it is not thrown
+ * away.
+ */
+#define bench_do_not_optimize(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+/**
+ * Make the compiler believe all the memory is read and written here, so the stores
+ * before it are done and the loads after it are not cached in registers.
+ */
+static inline void
+bench_clobber(void)
+{
+	__asm__ volatile("" : : : "memory");
+}
+
+/**
+ * Bind the calling thread to the CPU, so it is not migrated in the middle of a run. Returns
+ * 0 on success, -1 on error. In C it needs _GNU_SOURCE defined before the includes.
+ */
+static inline int
+bench_pin_cpu(int cpu)
+{
+#if defined(CPU_SET)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#else
+	(void)cpu;
+	return -1;
+#endif
+}
+
+static inline int
+bench_double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+/** Sort the samples and take their stats. */
+static inline void
+bench_stats(const char *name, const char *unit, double *samples, int count,
+	    struct bench_result *res)
+{
+	qsort(samples, count, sizeof(*samples), bench_double_cmp);
+	res->name = name;
+	res->unit = unit;
+	res->run_count = count;
+	if (count == 0) {
+		res->min = res->med = res->p99 = res->max = 0;
+		return;
+	}
+	res->min = samples[0];
+	res->med = samples[count / 2];
+	int p99 = (int)(count * 0.99);
+	res->p99 = samples[p99 < count ? p99 : count - 1];
+	res->max = samples[count - 1];
+}
+
+static inline void
+bench_print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static inline void
+bench_print(const struct bench_result *res)
+{
+	const char *format = getenv("BENCH_FORMAT");
+	if (format != NULL && strcmp(format, "json") == 0) {
+		printf("{\"name\": ");
+		bench_print_json_string(res->name);
+		printf(", \"unit\": ");
+		bench_print_json_string(res->unit);
+		printf(", \"runs\": %d, \"min\": %.2lf, \"med\": %.2lf, "
+		       "\"p99\": %.2lf, \"max\": %.2lf}\n", res->run_count,
+		       res->min, res->med, res->p99, res->max);
+		return;
+	}
+	printf("%s\n", res->name);
+	printf("    min: %.2lf %s\n", res->min, res->unit);
+	printf("    med: %.2lf %s\n", res->med, res->unit);
+	printf("    p99: %.2lf %s\n", res->p99, res->unit);
+	printf("    max: %.2lf %s\n", res->max, res->unit);
+}
+
+/** Take the stats of the samples and print them. The samples get sorted. */
+static inline void
+bench_report(const char *name, const char *unit, double *samples, int count)
+{
+	struct bench_result res;
+	bench_stats(name, unit, samples, count, &res);
+	bench_print(&res);
+}
+
+/** Tested code. Does the operation the given number of times. */
+typedef void (*bench_f)(void *arg, uint64_t iter_count);
+
+/**
+ * One warmup run which is not counted, then the measured runs. The samples are the
+ * nanoseconds per one iteration.
+ */
+static inline void
+bench_run(const char *name, bench_f func, void *arg, uint64_t iter_count,
+	  int run_count, struct bench_result *res)
+{
+	double *samples = (double *)malloc(sizeof(*samples) * (run_count > 0 ? run_count : 1));
+	func(arg, iter_count);
+	for (int i = 0; i < run_count; ++i) {
+		uint64_t start = bench_clock_ns();
+		func(arg, iter_count);
+		uint64_t duration = bench_clock_ns() - start;
+		samples[i] = (double)duration / iter_count;
+	}
+	bench_stats(name, "ns", samples, run_count, res);
+	free(samples);
+}
@@ -0,0 +1,72 @@
+# The build types of the homeworks, included by each CMakeLists.txt. The
+# default build is for the tests: no optimization and the leak checks of
+# heap_help, with only the benchmarks at -O2. Release is for the production
+# builds and for measuring:
+#
+#     cmake -DCMAKE_BUILD_TYPE=Release ..
+#
+# Everything is -O3 with LTO, when the compiler can do it, and heap_help is
+# off unless ENABLE_LEAK_CHECKS is given. PGO can be added on top, trained on
+# the benchmark targets, see pgo.sh next to this file.
+#
+# Has to be included with NO_POLICY_SCOPE, before the targets and the
+# ENABLE_LEAK_CHECKS option. Sets LEAK_CHECKS_DEFAULT for the option, and
+# BENCH_COMPILE_OPTIONS for the benchmark targets.
+#
+# ENABLE_TRACE compiles in the event rings of trace.h, in any build type.
+
+if (POLICY CMP0069)
+    # LTO by CMAKE_INTERPROCEDURAL_OPTIMIZATION
+    cmake_policy(SET CMP0069 NEW)
+endif ()
+
+if (CMAKE_BUILD_TYPE STREQUAL "Release")
+    set(LEAK_CHECKS_DEFAULT OFF)
+    # The benchmarks are optimized like the rest
+    set(BENCH_COMPILE_OPTIONS)
+    set(CMAKE_CXX_FLAGS_RELEASE "-O3 -DNDEBUG")
+    if (NOT CMAKE_VERSION VERSION_LESS 3.9)
+        include(CheckIPOSupported)
+        check_ipo_supported(RESULT IPO_SUPPORTED OUTPUT IPO_ERROR LANGUAGES CXX)
+        if (IPO_SUPPORTED)
+            set(CMAKE_INTERPROCEDURAL_OPTIMIZATION ON)
+        else ()
+            message(STATUS "No LTO: ${IPO_ERROR}")
+        endif ()
+    endif ()
+else ()
+    set(LEAK_CHECKS_DEFAULT ON)
+    set(BENCH_COMPILE_OPTIONS -O2)
+endif ()
+
+# PGO=GENERATE builds the instrumented binaries, they write the profiles into
+# PGO_DIR when run. PGO=USE rebuilds the same build directory with them. GCC
+# finds the profiles by the object paths, so both steps need the same one.
+set(PGO "" CACHE STRING "Profile-guided optimization step: GENERATE, USE, or empty")
+set(PGO_DIR "${CMAKE_BINARY_DIR}/pgo" CACHE PATH "Directory of the PGO profiles")
+
+if (PGO STREQUAL "GENERATE")
+    add_compile_options(-fprofile-generate=${PGO_DIR})
+    set(CMAKE_EXE_LINKER_FLAGS "${CMAKE_EXE_LINKER_FLAGS} -fprofile-generate=${PGO_DIR}")
+elseif (PGO STREQUAL "USE")
+    # The code not run by the benchmarks has no profile, it is not an error
+    if (CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+        set(PGO_FLAGS -fprofile-use=${PGO_DIR}/default.profdata
+            -Wno-profile-instr-unprofiled -Wno-profile-instr-out-of-date)
+    else ()
+        set(PGO_FLAGS -fprofile-use=${PGO_DIR} -fprofile-correction -Wno-missing-profile)
+    endif ()
+    add_compile_options(${PGO_FLAGS})
+    string(REPLACE ";" " " PGO_LINK_FLAGS "${PGO_FLAGS}")
+    set(CMAKE_EXE_LINKER_FLAGS "${CMAKE_EXE_LINKER_FLAGS} ${PGO_LINK_FLAGS}")
+elseif (NOT PGO STREQUAL "")
+    message(FATAL_ERROR "Unknown PGO step ${PGO}, expected GENERATE or USE")
+endif ()
+
+option(ENABLE_TRACE
+        "Record the events of trace.h, dumped into TRACE_FILE at exit"
+        OFF)
+
+if (ENABLE_TRACE)
+    add_definitions(-DTRACE_ENABLED=1)
+endif ()
@@ -0,0 +1,476 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * A load generator for any of the chat servers in the repository, to
+ * compare them on the same load. It has no dependencies on them and
+ * speaks their protocols itself:
+ *
+ * - frames: the length-prefixed frames of 5/chat_server;
+ * - lines: the '\n'-separated lines of advanced/boost_chat.
+ *
+ * All the connections are driven by one epoll. The messages carry their
+ * send time, so each delivery gives the broadcast latency. When the server
+ * pid is given, its CPU time per delivered message and its memory are
+ * taken from /proc.
+ *
+ * Examples, 1000 clients at 2000 messages/s. The boost_chat server is the
+ * coroutine one (make CORO=1), and it stops on the end of its input:
+ *
+ *     5/build/server 8080 < /dev/null > /dev/null &
+ *     chat_bench -a 127.0.0.1:8080 -p frames -c 1000 -r 2000 -P $!
+ *
+ *     sleep inf | advanced/boost_chat/server 8081 4 > /dev/null &
+ *     chat_bench -a 127.0.0.1:8081 -p lines -c 1000 -r 2000 \
+ *         -P $(pgrep -n -f "server 8081")
+ */
+
+enum {
+	CB_EVENT_COUNT = 1024,
+	/* Pacing period of the senders. */
+	CB_TICK_MS = 1,
+	/* Send time in the message start, in nanoseconds. */
+	CB_STAMP_LEN = 20,
+	/* Connects in flight at once, to not overflow the listen backlog. */
+	CB_CONNECT_BATCH = 256,
+};
+
+enum cb_protocol {
+	CB_PROTOCOL_FRAMES,
+	CB_PROTOCOL_LINES,
+};
+
+struct cb_options {
+	const char *address = NULL;
+	enum cb_protocol protocol = CB_PROTOCOL_FRAMES;
+	int client_count = 1000;
+	/* Messages per second of all the clients together. */
+	int rate = 1000;
+	int message_size = 64;
+	int duration_sec = 5;
+	int server_pid = 0;
+};
+
+struct cb_conn {
+	int fd = -1;
+	bool is_connected = false;
+	/* Not complete message tail of the input. */
+	std::string in;
+	/* The lines protocol sends the author and the data separately. */
+	bool is_author_next = true;
+	std::string out;
+	size_t out_offset = 0;
+};
+
+struct cb_ctx {
+	enum cb_protocol protocol;
+	int epoll_fd = -1;
+	std::vector<cb_conn> conns;
+	int connected_count = 0;
+	std::string padding;
+	/* Latencies of all the deliveries, in nanoseconds. */
+	std::vector<uint64_t> latencies;
+	uint64_t sent_count = 0;
+	uint64_t delivered_count = 0;
+};
+
+/** CPU time and memory of the server process. */
+struct cb_proc_stat {
+	double cpu_sec = 0;
+	uint64_t rss_kb = 0;
+	uint64_t peak_rss_kb = 0;
+};
+
+static uint64_t
+cb_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+cb_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("%s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+cb_usage(void)
+{
+	printf("Usage: chat_bench -a host:port [-p frames|lines] [-c clients] "
+	       "[-r messages/s] [-s message size] [-d seconds] "
+	       "[-P server pid]\n");
+	exit(-1);
+}
+
+static bool
+cb_proc_stat_read(int pid, struct cb_proc_stat *stat)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	/* utime and stime are the 14th and the 15th fields. */
+	unsigned long utime = 0;
+	unsigned long stime = 0;
+	int rc = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+			"%*u %lu %lu", &utime, &stime);
+	fclose(f);
+	if (rc != 2)
+		return false;
+	stat->cpu_sec = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long kb;
+		if (sscanf(line, "VmRSS: %llu", &kb) == 1)
+			stat->rss_kb = kb;
+		else if (sscanf(line, "VmHWM: %llu", &kb) == 1)
+			stat->peak_rss_kb = kb;
+	}
+	fclose(f);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+cb_append_u32(std::string &out, uint32_t value)
+{
+	value = htonl(value);
+	out.append((const char *)&value, sizeof(value));
+}
+
+static void
+cb_enqueue(struct cb_ctx *ctx, struct cb_conn *conn, const char *author,
+	   const std::string &data)
+{
+	if (ctx->protocol == CB_PROTOCOL_FRAMES) {
+		size_t author_len = author != NULL ? strlen(author) : 0;
+		cb_append_u32(conn->out, author_len);
+		cb_append_u32(conn->out, data.size());
+		conn->out.append(author != NULL ? author : "", author_len);
+		conn->out.append(data);
+		return;
+	}
+	/* The name is sent once, in the handshake. */
+	if (author != NULL) {
+		conn->out.append(author);
+		conn->out.push_back('\n');
+	}
+	if (!data.empty()) {
+		conn->out.append(data);
+		conn->out.push_back('\n');
+	}
+}
+
+static void
+cb_on_message(struct cb_ctx *ctx, const char *data, size_t size, uint64_t now)
+{
+	/* Handshake answers, pings and feeds have no send time. */
+	if (size < CB_STAMP_LEN || data[0] < '0' || data[0] > '9')
+		return;
+	uint64_t sent_ns = strtoull(std::string(data, CB_STAMP_LEN).c_str(),
+				    NULL, 10);
+	ctx->latencies.push_back(now - sent_ns);
+	++ctx->delivered_count;
+}
+
+/** Handles the complete messages in the input, returns the used size. */
+static size_t
+cb_parse(struct cb_ctx *ctx, struct cb_conn *conn, const char *pos,
+	 size_t size, uint64_t now)
+{
+	size_t used = 0;
+	if (ctx->protocol == CB_PROTOCOL_FRAMES) {
+		while (size - used >= 8) {
+			uint32_t author_len;
+			uint32_t data_len;
+			memcpy(&author_len, pos + used, 4);
+			memcpy(&data_len, pos + used + 4, 4);
+			author_len = ntohl(author_len);
+			data_len = ntohl(data_len);
+			size_t total = 8 + (size_t)author_len + data_len;
+			if (size - used < total)
+				break;
+			cb_on_message(ctx, pos + used + 8 + author_len, data_len,
+				      now);
+			used += total;
+		}
+		return used;
+	}
+	const char *end;
+	while ((end = (const char *)memchr(pos + used, '\n', size - used)) !=
+	       NULL) {
+		size_t len = end - (pos + used);
+		if (!conn->is_author_next)
+			cb_on_message(ctx, pos + used, len, now);
+		conn->is_author_next = !conn->is_author_next;
+		used += len + 1;
+	}
+	return used;
+}
+
+static bool
+cb_conn_flush(struct cb_conn *conn)
+{
+	while (conn->out_offset < conn->out.size()) {
+		ssize_t rc = send(conn->fd, conn->out.data() + conn->out_offset,
+				  conn->out.size() - conn->out_offset,
+				  MSG_NOSIGNAL);
+		if (rc > 0) {
+			conn->out_offset += rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+	conn->out.clear();
+	conn->out_offset = 0;
+	return true;
+}
+
+static void
+cb_conn_read(struct cb_ctx *ctx, struct cb_conn *conn)
+{
+	char buf[16 * 1024];
+	while (true) {
+		ssize_t rc = recv(conn->fd, buf, sizeof(buf), 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		cb_check(rc > 0, "recv");
+		uint64_t now = cb_now_ns();
+		if (conn->in.empty()) {
+			size_t used = cb_parse(ctx, conn, buf, rc, now);
+			conn->in.assign(buf + used, rc - used);
+			continue;
+		}
+		conn->in.append(buf, rc);
+		size_t used = cb_parse(ctx, conn, conn->in.data(),
+				       conn->in.size(), now);
+		conn->in.erase(0, used);
+	}
+}
+
+static void
+cb_process(struct cb_ctx *ctx, int timeout_ms)
+{
+	struct epoll_event events[CB_EVENT_COUNT];
+	int count = epoll_wait(ctx->epoll_fd, events, CB_EVENT_COUNT,
+			       timeout_ms);
+	cb_check(count >= 0 || errno == EINTR, "epoll_wait");
+	for (int i = 0; i < count; ++i) {
+		struct cb_conn *conn = (struct cb_conn *)events[i].data.ptr;
+		cb_check((events[i].events & (EPOLLERR | EPOLLHUP)) == 0,
+			 "connection");
+		if (!conn->is_connected && (events[i].events & EPOLLOUT)) {
+			conn->is_connected = true;
+			++ctx->connected_count;
+		}
+		if (events[i].events & EPOLLIN)
+			cb_conn_read(ctx, conn);
+		if (events[i].events & EPOLLOUT)
+			cb_check(cb_conn_flush(conn), "send");
+	}
+}
+
+static void
+cb_connect(struct cb_ctx *ctx, const struct addrinfo *addr)
+{
+	char name[32];
+	for (size_t i = 0; i < ctx->conns.size(); ++i) {
+		while ((int)i - ctx->connected_count >= CB_CONNECT_BATCH)
+			cb_process(ctx, CB_TICK_MS);
+		struct cb_conn *conn = &ctx->conns[i];
+		conn->fd = socket(addr->ai_family, addr->ai_socktype |
+				  SOCK_NONBLOCK, addr->ai_protocol);
+		cb_check(conn->fd >= 0, "socket");
+		int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			   sizeof(one));
+		int rc = connect(conn->fd, addr->ai_addr, addr->ai_addrlen);
+		cb_check(rc == 0 || errno == EINPROGRESS, "connect");
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = conn;
+		cb_check(epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, conn->fd,
+				   &ev) == 0, "epoll_ctl");
+		snprintf(name, sizeof(name), "bench_%zu", i);
+		cb_enqueue(ctx, conn, name, std::string());
+	}
+	while (ctx->connected_count < (int)ctx->conns.size())
+		cb_process(ctx, CB_TICK_MS);
+}
+
+/** The senders take turns, each message is sent by the next one. */
+static void
+cb_send(struct cb_ctx *ctx, uint64_t count)
+{
+	char stamp[32];
+	for (uint64_t i = 0; i < count; ++i) {
+		struct cb_conn *conn =
+			&ctx->conns[ctx->sent_count % ctx->conns.size()];
+		snprintf(stamp, sizeof(stamp), "%020llu",
+			 (unsigned long long)cb_now_ns());
+		memcpy(&ctx->padding[0], stamp, CB_STAMP_LEN);
+		cb_enqueue(ctx, conn, NULL, ctx->padding);
+		cb_check(cb_conn_flush(conn), "send");
+		++ctx->sent_count;
+	}
+}
+
+static void
+cb_report(struct cb_ctx *ctx, uint64_t duration_ns,
+	  const struct cb_options *opts, const struct cb_proc_stat *start,
+	  const struct cb_proc_stat *end)
+{
+	std::vector<uint64_t> &l = ctx->latencies;
+	std::sort(l.begin(), l.end());
+	double sec = duration_ns / 1e9;
+	printf("sent: %llu messages, %.0lf/s\n",
+	       (unsigned long long)ctx->sent_count, ctx->sent_count / sec);
+	printf("delivered: %llu messages, %.0lf/s\n",
+	       (unsigned long long)ctx->delivered_count,
+	       ctx->delivered_count / sec);
+	if (!l.empty()) {
+		const double percentiles[] = {50, 99, 99.9};
+		printf("latency:");
+		for (double p : percentiles) {
+			size_t i = std::min(l.size() - 1,
+					    (size_t)(l.size() * p / 100));
+			printf(" p%g %.1lf us,", p, l[i] / 1e3);
+		}
+		printf(" max %.1lf us\n", l.back() / 1e3);
+	}
+	if (opts->server_pid == 0)
+		return;
+	double cpu = end->cpu_sec - start->cpu_sec;
+	printf("server cpu: %.2lf s, %.0lf%% of a core", cpu, cpu / sec * 100);
+	if (ctx->delivered_count > 0)
+		printf(", %.2lf us per delivered message",
+		       cpu * 1e6 / ctx->delivered_count);
+	printf("\n");
+	printf("server rss: %.1lf MB, peak %.1lf MB, %.1lf KB per connection\n",
+	       end->rss_kb / 1024.0, end->peak_rss_kb / 1024.0,
+	       (double)end->rss_kb / opts->client_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct cb_options opts;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:c:r:s:d:P:")) != -1) {
+		switch (opt) {
+		case 'a': opts.address = optarg; break;
+		case 'p':
+			if (strcmp(optarg, "frames") == 0)
+				opts.protocol = CB_PROTOCOL_FRAMES;
+			else if (strcmp(optarg, "lines") == 0)
+				opts.protocol = CB_PROTOCOL_LINES;
+			else
+				cb_usage();
+			break;
+		case 'c': opts.client_count = atoi(optarg); break;
+		case 'r': opts.rate = atoi(optarg); break;
+		case 's': opts.message_size = atoi(optarg); break;
+		case 'd': opts.duration_sec = atoi(optarg); break;
+		case 'P': opts.server_pid = atoi(optarg); break;
+		default: cb_usage();
+		}
+	}
+	if (opts.address == NULL || opts.client_count < 2 || opts.rate < 1 ||
+	    opts.message_size < CB_STAMP_LEN || opts.duration_sec < 1)
+		cb_usage();
+
+	/* 10k connections don't fit into the usual default limit. */
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 &&
+	    lim.rlim_cur < (rlim_t)opts.client_count + 64) {
+		lim.rlim_cur = std::min<rlim_t>(lim.rlim_max,
+						opts.client_count + 64);
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+	const char *colon = strrchr(opts.address, ':');
+	if (colon == NULL)
+		cb_usage();
+	std::string host(opts.address, colon - opts.address);
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addr = NULL;
+	cb_check(getaddrinfo(host.c_str(), colon + 1, &hints, &addr) == 0,
+		 "getaddrinfo");
+
+	struct cb_ctx ctx;
+	ctx.protocol = opts.protocol;
+	ctx.epoll_fd = epoll_create1(0);
+	cb_check(ctx.epoll_fd >= 0, "epoll_create1");
+	ctx.conns.resize(opts.client_count);
+	ctx.padding.assign(opts.message_size, 'x');
+	cb_connect(&ctx, addr);
+	freeaddrinfo(addr);
+	printf("%d clients, %d messages/s of %d bytes, %d s, %s protocol\n",
+	       opts.client_count, opts.rate, opts.message_size,
+	       opts.duration_sec,
+	       opts.protocol == CB_PROTOCOL_FRAMES ? "frames" : "lines");
+
+	struct cb_proc_stat stat_start;
+	struct cb_proc_stat stat_end;
+	if (opts.server_pid != 0) {
+		cb_check(cb_proc_stat_read(opts.server_pid, &stat_start),
+			 "server stat");
+	}
+	/* Paced by the clock, a slow tick sends more the next time. */
+	uint64_t start = cb_now_ns();
+	uint64_t end = start + (uint64_t)opts.duration_sec * 1000000000;
+	uint64_t now;
+	while ((now = cb_now_ns()) < end) {
+		uint64_t due = (now - start) * opts.rate / 1000000000;
+		cb_send(&ctx, due - ctx.sent_count);
+		cb_process(&ctx, CB_TICK_MS);
+	}
+	/* The messages in flight are waited for a bit. */
+	uint64_t expected = ctx.sent_count * (opts.client_count - 1);
+	uint64_t drain_end = cb_now_ns() + 1000000000;
+	while (ctx.delivered_count < expected && cb_now_ns() < drain_end)
+		cb_process(&ctx, CB_TICK_MS);
+	if (opts.server_pid != 0) {
+		cb_check(cb_proc_stat_read(opts.server_pid, &stat_end),
+			 "server stat");
+	}
+	cb_report(&ctx, end - start, &opts, &stat_start, &stat_end);
+
+	for (struct cb_conn &conn : ctx.conns)
+		close(conn.fd);
+	close(ctx.epoll_fd);
+	return 0;
+}
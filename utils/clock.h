@@ -0,0 +1,212 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/**
+ * Clocks for the hot paths, where even the vDSO clock_gettime() is
+ * noticeable. Costs on a Xeon VM, see bonus/clock_bench.c:
+ *
+ * - clock_monotonic_ns(): CLOCK_MONOTONIC, ~26 ns;
+ * - clock_coarse_ns(): CLOCK_MONOTONIC_COARSE, ~5 ns, but it moves only
+ *   once per kernel tick, 1-10 ms;
+ * - clock_fast_ns(): the CPU time stamp counter turned into nanoseconds of
+ *   CLOCK_MONOTONIC, ~20 ns, precise. Most of it is rdtsc itself, which
+ *   is cheaper on bare metal;
+ * - clock_cache_ns(): the time an event loop has saved in the beginning of
+ *   its iteration, free.
+ *
+ * The fast clock is calibrated against CLOCK_MONOTONIC at its first call,
+ * which spins for CLOCK_FAST_CALIBRATION_NS. It is meant for durations and
+ * the deadlines of the own process. Its drift from CLOCK_MONOTONIC is
+ * about 10 microseconds per second, so don't mix them in one comparison.
+ * Where the counter is not stable, like on an old x86 CPU without the
+ * invariant TSC, it is CLOCK_MONOTONIC itself.
+ */
+
+enum {
+	CLOCK_FAST_CALIBRATION_NS = 2 * 1000 * 1000,
+};
+
+enum clock_fast_state {
+	CLOCK_FAST_NEW,
+	CLOCK_FAST_CALIBRATING,
+	CLOCK_FAST_READY,
+	/* No usable counter, the clock is CLOCK_MONOTONIC. */
+	CLOCK_FAST_NO_TICKS,
+};
+
+struct clock_fast {
+	int state;
+	uint64_t base_ticks;
+	uint64_t base_ns;
+	double ns_per_tick;
+};
+
+/**
+ * One calibration for the whole program. Each file including the header
+ * defines it, and the linker merges the weak definitions into one.
+ */
+__attribute__((weak)) struct clock_fast clock_fast_global;
+
+static inline uint64_t
+clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+clock_coarse_ns(void)
+{
+	struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** CPU counter ticks. Not nanoseconds, and not stable everywhere. */
+static inline uint64_t
+clock_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t res;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(res));
+	return res;
+#else
+	return clock_monotonic_ns();
+#endif
+}
+
+/** Whether the counter runs at a constant rate, synchronized on all CPUs. */
+static inline bool
+clock_ticks_are_stable(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+	    eax < 0x80000007)
+		return false;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	/* Invariant TSC. */
+	return (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+	/* The generic timer has a fixed frequency by the architecture. */
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * A pair of the counter and the clock taken at the same time. The counter
+ * is read around the clock, and the pair is the closest of a few tries.
+ */
+static inline void
+clock_fast_sample(uint64_t *ticks, uint64_t *ns)
+{
+	uint64_t best_gap = UINT64_MAX;
+	for (int i = 0; i < 5; ++i) {
+		uint64_t t1 = clock_ticks();
+		uint64_t clock = clock_monotonic_ns();
+		uint64_t t2 = clock_ticks();
+		if (t2 - t1 < best_gap) {
+			best_gap = t2 - t1;
+			*ticks = t1 + (t2 - t1) / 2;
+			*ns = clock;
+		}
+	}
+}
+
+/** First calls. The ones made during the calibration use the usual clock. */
+static inline uint64_t
+clock_fast_ns_slow(void)
+{
+	struct clock_fast *f = &clock_fast_global;
+	int state = CLOCK_FAST_NEW;
+	if (!__atomic_compare_exchange_n(&f->state, &state,
+					 CLOCK_FAST_CALIBRATING, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return clock_monotonic_ns();
+	if (!clock_ticks_are_stable()) {
+		__atomic_store_n(&f->state, CLOCK_FAST_NO_TICKS, __ATOMIC_RELEASE);
+		return clock_monotonic_ns();
+	}
+	uint64_t ticks1 = 0, ns1 = 0, ticks2 = 0, ns2 = 0;
+	clock_fast_sample(&ticks1, &ns1);
+	do {
+		clock_fast_sample(&ticks2, &ns2);
+	} while (ns2 - ns1 < CLOCK_FAST_CALIBRATION_NS);
+	if (ticks2 <= ticks1) {
+		__atomic_store_n(&f->state, CLOCK_FAST_NO_TICKS, __ATOMIC_RELEASE);
+		return ns2;
+	}
+	f->base_ticks = ticks2;
+	f->base_ns = ns2;
+	f->ns_per_tick = (double)(ns2 - ns1) / (ticks2 - ticks1);
+	__atomic_store_n(&f->state, CLOCK_FAST_READY, __ATOMIC_RELEASE);
+	return ns2;
+}
+
+/** Nanoseconds of CLOCK_MONOTONIC, from the CPU counter. */
+static inline uint64_t
+clock_fast_ns(void)
+{
+	struct clock_fast *f = &clock_fast_global;
+	int state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+	if (state == CLOCK_FAST_READY) {
+		/* Before the base if another CPU's counter is a bit behind. */
+		int64_t ticks = (int64_t)(clock_ticks() - f->base_ticks);
+		return f->base_ns + (int64_t)(ticks * f->ns_per_tick);
+	}
+	if (state == CLOCK_FAST_NO_TICKS)
+		return clock_monotonic_ns();
+	return clock_fast_ns_slow();
+}
+
+/**
+ * Time of an event loop iteration. The loop updates it once in the
+ * beginning of each iteration, and everything the iteration does reads it
+ * for free. Good for the timeouts and the stats, where a few milliseconds
+ * spent inside the iteration don't matter.
+ *
+ *     struct clock_cache clock;
+ *     while (true) {
+ *         epoll_wait(...);
+ *         clock_cache_update(&clock);
+ *         ... clock_cache_ns(&clock) ...
+ *     }
+ */
+struct clock_cache {
+	uint64_t now_ns;
+};
+
+static inline void
+clock_cache_update(struct clock_cache *cache)
+{
+	cache->now_ns = clock_fast_ns();
+}
+
+static inline uint64_t
+clock_cache_ns(const struct clock_cache *cache)
+{
+	return cache->now_ns;
+}
+
+static inline uint64_t
+clock_cache_ms(const struct clock_cache *cache)
+{
+	return cache->now_ns / 1000000;
+}
@@ -1,21 +1,37 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <cxxabi.h>
 #include <dlfcn.h>
 #include <execinfo.h>
-#include <map>
+#include <malloc.h>
 #include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <stdio.h>
 
 #include <mutex>
 
+#include "../adaptive_lock.h"
+#include "heap_help.h"
+
 namespace
 {
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// The allocations are spread over the shards by their address, each shard with its
+	// own lock. Must be a power of 2.
+	SHARD_COUNT = 64,
+	CACHE_LINE_SIZE = 64,
+	TABLE_CAPACITY_MIN = 1024,
+	THREAD_STATS_BATCH_SIZE = 64,
 };
 
 enum report_mode {
@@ -29,6 +45,9 @@ enum report_mode {
 
 enum backtrace_mode {
 	BACKTRACE_ON,
+	// Walk the frame pointers. Much faster than the unwinder, but needs the code built
+	// with -fno-omit-frame-pointer.
+	BACKTRACE_FP,
 	BACKTRACE_OFF,
 };
 
@@ -104,35 +123,280 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 	return rc;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
+// Peak resident set size of the process in kilobytes, or 0 if unknown.
+static uint64_t
+peak_rss_kb(void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == nullptr)
+		return 0;
+	uint64_t res = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != nullptr) {
+		unsigned long long kb;
+		if (sscanf(line, "VmHWM: %llu", &kb) == 1) {
+			res = kb;
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
 
-template<class T>
-struct hh_allocator
+static bool
+trace_less(const allocation *a, const allocation *b)
 {
-	using value_type = T;
+	if (a->trace_size != b->trace_size)
+		return a->trace_size < b->trace_size;
+	return memcmp(a->trace, b->trace, a->trace_size * sizeof(a->trace[0])) < 0;
+}
 
-	T *
-	allocate(size_t n)
-	{
-		T *res = (T *)std::malloc(n * sizeof(T));
-		heaph_assert(res != nullptr);
-		return res;
+static bool
+trace_equal(const allocation *a, const allocation *b)
+{
+	return a->trace_size == b->trace_size &&
+	       memcmp(a->trace, b->trace, a->trace_size * sizeof(a->trace[0])) == 0;
+}
+
+// Stack of the current thread, to check the frame pointers against.
+struct stack_bounds {
+	uintptr_t lo;
+	uintptr_t hi;
+};
+
+static thread_local stack_bounds thread_stack_bounds;
+
+static const stack_bounds &
+get_stack_bounds(void)
+{
+	stack_bounds &b = thread_stack_bounds;
+	if (b.hi != 0)
+		return b;
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return b;
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+		b.lo = (uintptr_t)addr;
+		b.hi = b.lo + size;
 	}
+	pthread_attr_destroy(&attr);
+	return b;
+}
+
+// Each frame starts with the caller's frame pointer followed by the return address.
+// The chain is trusted only while it goes up the stack. A function built without the
+// frame pointers leaves some random value in its place, and the walk stops there.
+static __attribute__((noinline)) int
+fp_backtrace(void **addrs, int count)
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+	const stack_bounds &b = get_stack_bounds();
+	uintptr_t fp = (uintptr_t)__builtin_frame_address(0);
+	int res = 0;
+	while (res < count) {
+		if (fp < b.lo || fp + 2 * sizeof(void *) > b.hi ||
+		    fp % sizeof(void *) != 0)
+			break;
+		void **frame = (void **)fp;
+		if (frame[1] == nullptr)
+			break;
+		addrs[res++] = frame[1];
+		uintptr_t next = (uintptr_t)frame[0];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return res;
+#else
+	return backtrace(addrs, count);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void *
+hh_mmap(size_t size)
+{
+	void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	heaph_assert(res != MAP_FAILED);
+	return res;
+}
+
+static uint64_t
+ptr_hash(const void *ptr)
+{
+	// The low bits are zeros due to the alignment. Mix all the bits into each other, so
+	// any of them can be taken as the hash.
+	uint64_t h = (uint64_t)ptr;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Open addressing hash table of the allocations by their address, with linear probing.
+// The low bits of the hash choose the shard, the next ones the slot. The slots are
+// mmap()-ed to not recurse into the traced allocator.
+struct allocation_table {
+	allocation **slots = nullptr;
+	size_t capacity = 0;
+	size_t size = 0;
+
+	// The slot with this allocation, or the empty one where it would be.
+	size_t
+	find(const void *ptr, uint64_t hash) const;
 
 	void
-	deallocate(T *p, std::size_t)
-	{
-		std::free(p);
+	insert(allocation *a, uint64_t hash);
+
+	void
+	erase(size_t idx);
+
+	void
+	grow();
+
+	size_t
+	home(uint64_t hash) const { return (hash / SHARD_COUNT) & (capacity - 1); }
+};
+
+size_t
+allocation_table::find(const void *ptr, uint64_t hash) const
+{
+	size_t mask = capacity - 1;
+	size_t i = home(hash);
+	while (slots[i] != nullptr && slots[i]->mem != ptr)
+		i = (i + 1) & mask;
+	return i;
+}
+
+void
+allocation_table::insert(allocation *a, uint64_t hash)
+{
+	// Half empty at least, to keep the probe sequences short.
+	if ((size + 1) * 2 > capacity)
+		grow();
+	size_t i = find(a->mem, hash);
+	heaph_assert(slots[i] == nullptr);
+	slots[i] = a;
+	++size;
+}
+
+void
+allocation_table::erase(size_t idx)
+{
+	// No tombstones. The following entries of the same probe sequence are shifted back
+	// into the hole, so the lookups always stop at the first empty slot.
+	size_t mask = capacity - 1;
+	size_t hole = idx;
+	size_t i = idx;
+	while (true) {
+		i = (i + 1) & mask;
+		allocation *a = slots[i];
+		if (a == nullptr)
+			break;
+		// Can move only if the hole is not before the entry's home slot.
+		size_t dist = (i - home(ptr_hash(a->mem))) & mask;
+		if (dist < ((i - hole) & mask))
+			continue;
+		slots[hole] = a;
+		hole = i;
+	}
+	slots[hole] = nullptr;
+	--size;
+}
+
+void
+allocation_table::grow()
+{
+	allocation **old_slots = slots;
+	size_t old_capacity = capacity;
+	capacity = capacity == 0 ? (size_t)TABLE_CAPACITY_MIN : capacity * 2;
+	slots = (allocation **)hh_mmap(capacity * sizeof(*slots));
+	for (size_t i = 0; i < old_capacity; ++i) {
+		allocation *a = old_slots[i];
+		if (a != nullptr)
+			slots[find(a->mem, ptr_hash(a->mem))] = a;
 	}
+	if (old_slots != nullptr)
+		munmap(old_slots, old_capacity * sizeof(*slots));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A part of the traced allocations. Aligned to not share the cache lines with the other
+// shards' locks. The lock is held for a few table operations, so a contender rather spins
+// than sleeps.
+struct alignas(CACHE_LINE_SIZE) allocation_shard {
+	adaptive_mutex mutex;
+	allocation_table allocations;
+	// Unused allocation objects. For re-use.
+	allocation *pool = nullptr;
+	// Freshly created allocation objects. Taken from here when the pool is empty.
+	allocation_batch *batch = nullptr;
+};
+
+// Counters of one thread. Updated only by the owner thread, read by anyone. When the
+// thread exits, they are moved into the common counters of the exited threads.
+struct alignas(CACHE_LINE_SIZE) thread_stats {
+	std::atomic<uint64_t> alloc_count;
+	std::atomic<uint64_t> free_count;
+	std::atomic<uint64_t> alloc_size;
+	std::atomic<uint64_t> size_class_alloc_count[HEAPH_SIZE_CLASS_COUNT];
+	std::atomic<uint64_t> size_class_free_count[HEAPH_SIZE_CLASS_COUNT];
+	int tid;
+	bool is_used;
+	// All the objects, used or not.
+	thread_stats *next;
+	// The unused objects. For re-use.
+	thread_stats *next_free;
 };
 
-using allocation_node = std::map<void *, allocation *>::value_type;
-using allocation_map = std::map<
-	void *,
-	allocation *,
-	std::less<>,
-	hh_allocator<allocation_node>
->;
+struct thread_stats_batch {
+	thread_stats stats[THREAD_STATS_BATCH_SIZE];
+	int used;
+};
+
+// Releases the thread's counters when the thread exits.
+struct thread_stats_owner {
+	~thread_stats_owner();
+};
+
+static thread_local thread_stats *thread_stats_ptr;
+static thread_local bool thread_is_exited;
+static thread_local thread_stats_owner thread_owner;
+
+static int
+size_class_of(size_t size)
+{
+	if (size <= HEAPH_SIZE_CLASS_MIN)
+		return 0;
+	int res = 64 - __builtin_clzll(size - 1) - 4;
+	return res < HEAPH_SIZE_CLASS_COUNT ? res : HEAPH_SIZE_CLASS_COUNT - 1;
+}
+
+static uint64_t
+monotonic_usec(void)
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+// State of the sampling in one thread.
+struct sample_state {
+	// Bytes to allocate before the next sampled allocation. 0 means not initialized.
+	int64_t bytes_left;
+	uint64_t rand;
+};
+
+static thread_local sample_state thread_sample_state;
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -148,14 +412,60 @@ public:
 	void
 	untrace(void *ptr);
 
+	uint64_t
+	get_alloc_count();
+
+	uint64_t
+	get_total_alloc_count();
+
+	int
+	dump_profile(const char *path);
+
+	void
+	get_stats(heaph_stats *stats);
+
+	void
+	release_thread_stats();
+
 private:
-	std::mutex m_mutex;
-	allocation_map m_allocations;
-	// Unused allocation objects. For re-use.
-	allocation *m_alloc_pool;
-	// Freshly created allocation objects. Taken from here when the pool is empty.
-	allocation_batch *m_alloc_batch;
-	uint64_t m_alloc_count;
+	allocation_shard &
+	shard_of(uint64_t hash) { return m_shards[hash & (SHARD_COUNT - 1)]; }
+
+	bool
+	should_sample(size_t size);
+
+	int64_t
+	next_sample_interval(sample_state &state);
+
+	// Estimated count of the allocations of this size one sampled allocation stands for.
+	double
+	sample_weight(size_t size);
+
+	// Counters of the current thread. Created on the first use.
+	thread_stats &
+	get_thread_stats();
+
+	void
+	count_alloc(void *ptr, size_t size);
+
+	void
+	count_free(void *ptr);
+
+	allocation_shard m_shards[SHARD_COUNT];
+	// The counters are exact even when only some allocations are traced.
+	std::atomic<uint64_t> m_alloc_count;
+	std::atomic<uint64_t> m_free_count;
+	// Mean bytes between the sampled allocations. 0 means all are traced.
+	uint64_t m_sample_interval;
+
+	adaptive_mutex m_thread_mutex;
+	thread_stats *m_threads;
+	thread_stats *m_thread_pool;
+	thread_stats_batch *m_thread_batch;
+	// Counters of all the exited threads together. And of the threads which still
+	// allocate after their counters were released, at exit.
+	thread_stats m_exited_threads;
+	uint64_t m_start_usec;
 
 	report_mode m_report_mode;
 	content_mode m_content_mode;
@@ -163,9 +473,14 @@ private:
 };
 
 heap_help::heap_help()
-	: m_alloc_pool(nullptr)
-	, m_alloc_batch(nullptr)
-	, m_alloc_count(0)
+	: m_alloc_count(0)
+	, m_free_count(0)
+	, m_sample_interval(0)
+	, m_threads(nullptr)
+	, m_thread_pool(nullptr)
+	, m_thread_batch(nullptr)
+	, m_exited_threads()
+	, m_start_usec(monotonic_usec())
 	, m_report_mode(REPORT_MODE_LEAKS)
 	, m_content_mode(CONTENT_MODE_ORIGINAL)
 	, m_backtrace_mode(BACKTRACE_ON)
@@ -192,125 +507,452 @@ heap_help::heap_help()
 	if (bt_mode != nullptr) {
 		if (strcmp(bt_mode, "on") == 0)
 			m_backtrace_mode = BACKTRACE_ON;
+		else if (strcmp(bt_mode, "fp") == 0)
+			m_backtrace_mode = BACKTRACE_FP;
 		else if (strcmp(bt_mode, "off") == 0)
 			m_backtrace_mode = BACKTRACE_OFF;
 	}
+
+	const char *sample = getenv("HHSAMPLE");
+	if (sample != nullptr)
+		m_sample_interval = strtoull(sample, nullptr, 10);
 }
 
 heap_help::~heap_help()
 {
 	if (m_report_mode == REPORT_MODE_QUIET)
 		return;
-	m_mutex.lock();
-	if (m_allocations.empty())
+	for (allocation_shard &sh : m_shards)
+		sh.mutex.lock();
+	uint64_t alloc_count = m_alloc_count.load(std::memory_order_relaxed);
+	uint64_t leak_count = 0;
+	for (allocation_shard &sh : m_shards)
+		leak_count += sh.allocations.size;
+	if (leak_count == 0)
 	{
-		uint64_t count = m_alloc_count;
-		m_mutex.unlock();
+		for (allocation_shard &sh : m_shards)
+			sh.mutex.unlock();
 
 		if (m_report_mode == REPORT_MODE_VERBOSE) {
 			printf("\n");
 			printf("HH: found no leaks\n");
 			printf("HH: total allocation count - %llu\n",
-			       (long long)count);
+			       (long long)alloc_count);
+			printf("HH: peak RSS - %llu KB\n",
+			       (long long)peak_rss_kb());
 		}
 		return;
 	}
 	const int report_limit = 10;
 	uint64_t report_count = 0;
 	uint64_t leak_size = 0;
+	double leak_size_estimate = 0;
 	symbol syms[MAX_BACKTRACE_LEN];
 	// People often do not write '\n' in the end of their program. That makes it
 	// harder to read HH output unless the latter prepends itself with a line wrap.
 	const char *prefix = "\n";
 	char *demangled_name = nullptr;
 	size_t demangled_size = 0;
-	for (const auto& [ptr, a] : m_allocations) {
-		leak_size += a->size;
-		if (report_count >= report_limit)
-			continue;
-		bool has_trace = trace_resolve(a->trace, a->trace_size, syms) == 0;
-		printf("%s", prefix);
-		prefix = "";
-		printf("#### Leak %llu (%zu bytes) ####\n",
-			(long long)++report_count, a->size);
-		if (!has_trace) {
-			printf("Couldn't get the trace\n");
-			continue;
-		}
-		for (int i = 0; i < a->trace_size; ++i) {
-			int status = 0;
-			const char *original_name = syms[i].name;
-			const char *name = abi::__cxa_demangle(
-				original_name, demangled_name, &demangled_size, &status);
-			if (name == nullptr)
-				name = original_name;
-			printf("%d - %s\n", i, name);
+	for (allocation_shard &sh : m_shards) {
+		for (size_t i = 0; i < sh.allocations.capacity; ++i) {
+			const allocation *a = sh.allocations.slots[i];
+			if (a == nullptr)
+				continue;
+			leak_size += a->size;
+			leak_size_estimate += sample_weight(a->size) * a->size;
+			if (report_count >= report_limit)
+				continue;
+			bool has_trace = trace_resolve(a->trace, a->trace_size, syms) == 0;
+			printf("%s", prefix);
+			prefix = "";
+			printf("#### Leak %llu (%zu bytes) ####\n",
+				(long long)++report_count, a->size);
+			if (!has_trace) {
+				printf("Couldn't get the trace\n");
+				continue;
+			}
+			for (int i = 0; i < a->trace_size; ++i) {
+				int status = 0;
+				const char *original_name = syms[i].name;
+				const char *name = abi::__cxa_demangle(
+					original_name, demangled_name, &demangled_size, &status);
+				if (name == nullptr)
+					name = original_name;
+				printf("%d - %s\n", i, name);
+			}
 		}
 	}
 	std::free(demangled_name);
 	printf("%s", prefix), prefix = "";
-	printf("HH: found %lld leaks (%llu bytes)\n", (long long)m_allocations.size(),
-		(long long)leak_size);
-	if (report_count < m_allocations.size()) {
+	if (m_sample_interval == 0) {
+		printf("HH: found %lld leaks (%llu bytes)\n", (long long)leak_count,
+			(long long)leak_size);
+	} else {
+		printf("HH: found %lld sampled leaks (%llu bytes), ~%.0lf bytes "
+			"leaked in total\n", (long long)leak_count, (long long)leak_size,
+			leak_size_estimate);
+	}
+	if (report_count < leak_count) {
 		printf("HH: only first %llu reports are shown\n",
 			(long long)report_count);
 	}
-	printf("HH: total allocation count - %llu\n", (long long)m_alloc_count);
-	m_mutex.unlock();
+	printf("HH: total allocation count - %llu\n", (long long)alloc_count);
+	printf("HH: peak RSS - %llu KB\n", (long long)peak_rss_kb());
+	for (allocation_shard &sh : m_shards)
+		sh.mutex.unlock();
+	// _exit() doesn't flush, and stdout is not line-buffered when redirected.
+	fflush(stdout);
 	_exit(-1);
 }
 
+bool
+heap_help::should_sample(size_t size)
+{
+	if (m_sample_interval == 0)
+		return true;
+	sample_state &state = thread_sample_state;
+	if (state.bytes_left == 0) {
+		state.rand = (uint64_t)&state | 1;
+		state.bytes_left = next_sample_interval(state);
+	}
+	state.bytes_left -= size;
+	if (state.bytes_left > 0)
+		return false;
+	state.bytes_left = next_sample_interval(state);
+	return true;
+}
+
+int64_t
+heap_help::next_sample_interval(sample_state &state)
+{
+	// Exponentially distributed intervals make the sampled points a Poisson process
+	// over the allocated bytes. Then each byte has the same chance to be sampled, and
+	// no allocation pattern can always slip between the samples.
+	state.rand ^= state.rand << 13;
+	state.rand ^= state.rand >> 7;
+	state.rand ^= state.rand << 17;
+	double u = ((state.rand >> 11) + 1) * (1.0 / (1ull << 53));
+	int64_t res = -log(u) * m_sample_interval;
+	return res > 0 ? res : 1;
+}
+
+double
+heap_help::sample_weight(size_t size)
+{
+	if (m_sample_interval == 0 || size == 0)
+		return 1;
+	// The chance for an allocation of this size to be sampled is 1 - e^(-size / T).
+	return 1 / (1 - exp(-(double)size / m_sample_interval));
+}
+
+thread_stats &
+heap_help::get_thread_stats()
+{
+	if (thread_stats_ptr != nullptr)
+		return *thread_stats_ptr;
+	if (thread_is_exited)
+		return m_exited_threads;
+	// Touch the owner so its destructor runs at the thread exit.
+	(void)&thread_owner;
+	std::lock_guard<adaptive_mutex> lock(m_thread_mutex);
+	thread_stats *st = m_thread_pool;
+	if (st != nullptr) {
+		m_thread_pool = st->next_free;
+	} else {
+		if (m_thread_batch == nullptr ||
+		    m_thread_batch->used == THREAD_STATS_BATCH_SIZE) {
+			m_thread_batch = (thread_stats_batch *)hh_mmap(
+				sizeof(*m_thread_batch));
+			m_thread_batch->used = 0;
+		}
+		st = &m_thread_batch->stats[m_thread_batch->used++];
+		st->next = m_threads;
+		m_threads = st;
+	}
+	st->tid = syscall(SYS_gettid);
+	st->is_used = true;
+	thread_stats_ptr = st;
+	return *st;
+}
+
+void
+heap_help::release_thread_stats()
+{
+	thread_stats *st = thread_stats_ptr;
+	thread_stats_ptr = nullptr;
+	thread_is_exited = true;
+	if (st == nullptr)
+		return;
+	std::lock_guard<adaptive_mutex> lock(m_thread_mutex);
+	thread_stats &ex = m_exited_threads;
+	ex.alloc_count.fetch_add(st->alloc_count.exchange(0));
+	ex.free_count.fetch_add(st->free_count.exchange(0));
+	ex.alloc_size.fetch_add(st->alloc_size.exchange(0));
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		ex.size_class_alloc_count[i].fetch_add(
+			st->size_class_alloc_count[i].exchange(0));
+		ex.size_class_free_count[i].fetch_add(
+			st->size_class_free_count[i].exchange(0));
+	}
+	st->is_used = false;
+	st->next_free = m_thread_pool;
+	m_thread_pool = st;
+}
+
+void
+heap_help::count_alloc(void *ptr, size_t size)
+{
+	m_alloc_count.fetch_add(1, std::memory_order_relaxed);
+	thread_stats &st = get_thread_stats();
+	st.alloc_count.fetch_add(1, std::memory_order_relaxed);
+	st.alloc_size.fetch_add(size, std::memory_order_relaxed);
+	// The usable size is known at free too, unlike the requested one.
+	int cls = size_class_of(malloc_usable_size(ptr));
+	st.size_class_alloc_count[cls].fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+heap_help::count_free(void *ptr)
+{
+	m_free_count.fetch_add(1, std::memory_order_relaxed);
+	thread_stats &st = get_thread_stats();
+	st.free_count.fetch_add(1, std::memory_order_relaxed);
+	int cls = size_class_of(malloc_usable_size(ptr));
+	st.size_class_free_count[cls].fetch_add(1, std::memory_order_relaxed);
+}
+
 void
 heap_help::trace(void *ptr, size_t size)
 {
-	m_mutex.lock();
-	allocation *a = m_alloc_pool;
+	count_alloc(ptr, size);
+	if (!should_sample(size))
+		return;
+	uint64_t hash = ptr_hash(ptr);
+	allocation_shard &sh = shard_of(hash);
+	sh.mutex.lock();
+	allocation *a = sh.pool;
 	if (a != nullptr) {
-		m_alloc_pool = a->next;
+		sh.pool = a->next;
 	} else {
-		if (m_alloc_batch == nullptr ||
-		    m_alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			m_alloc_batch =
-				(allocation_batch *)std::malloc(sizeof(*m_alloc_batch));
-			heaph_assert(m_alloc_batch != nullptr);
-			m_alloc_batch->used = 0;
+		if (sh.batch == nullptr || sh.batch->used == ALLOCATION_BATCH_SIZE) {
+			sh.batch = (allocation_batch *)hh_mmap(sizeof(*sh.batch));
+			sh.batch->used = 0;
 		} else {
-			heaph_assert(m_alloc_batch->used < ALLOCATION_BATCH_SIZE);
+			heaph_assert(sh.batch->used < ALLOCATION_BATCH_SIZE);
 		}
-		a = &m_alloc_batch->allocs[m_alloc_batch->used++];
+		a = &sh.batch->allocs[sh.batch->used++];
 	}
 	a->mem = ptr;
 	a->size = size;
-	heaph_assert(m_allocations.emplace(ptr, a).second);
-	++m_alloc_count;
-	m_mutex.unlock();
+	a->trace_size = 0;
+	sh.allocations.insert(a, hash);
+	sh.mutex.unlock();
 
 	if (m_backtrace_mode == BACKTRACE_ON)
 		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
+	else if (m_backtrace_mode == BACKTRACE_FP)
+		a->trace_size = fp_backtrace(a->trace, MAX_BACKTRACE_LEN);
 	heaph_assert(a->trace_size >= 0);
 }
 
 void
 heap_help::untrace(void *ptr)
 {
-	m_mutex.lock();
-	auto it = m_allocations.find(ptr);
-	if (it == m_allocations.end())
+	// Deleting a null pointer is legal and does nothing.
+	if (ptr == nullptr)
+		return;
+	count_free(ptr);
+	uint64_t hash = ptr_hash(ptr);
+	allocation_shard &sh = shard_of(hash);
+	sh.mutex.lock();
+	allocation_table &t = sh.allocations;
+	size_t idx = t.capacity == 0 ? 0 : t.find(ptr, hash);
+	if (t.capacity == 0 || t.slots[idx] == nullptr)
 	{
-		m_mutex.unlock();
+		sh.mutex.unlock();
+		// Not sampled. Double frees can't be caught then.
+		if (m_sample_interval != 0)
+			return;
 		heaph_assert(! "Freeing unknown or already freed memory");
 		return;
 	}
-	allocation *a = it->second;
-	a->next = m_alloc_pool;
-	m_alloc_pool = a;
-	m_allocations.erase(it);
-	m_mutex.unlock();
+	allocation *a = t.slots[idx];
+	a->next = sh.pool;
+	sh.pool = a;
+	t.erase(idx);
+	sh.mutex.unlock();
+}
+
+uint64_t
+heap_help::get_alloc_count()
+{
+	// Frees first. Otherwise an allocation and its free done in between could make the
+	// result negative.
+	uint64_t free_count = m_free_count.load(std::memory_order_relaxed);
+	return m_alloc_count.load(std::memory_order_relaxed) - free_count;
+}
+
+uint64_t
+heap_help::get_total_alloc_count()
+{
+	return m_alloc_count.load(std::memory_order_relaxed);
+}
+
+int
+heap_help::dump_profile(const char *path)
+{
+	// Opened before taking the locks, the file stream allocates.
+	FILE *f = fopen(path, "w");
+	if (f == nullptr)
+		return -1;
+	for (allocation_shard &sh : m_shards)
+		sh.mutex.lock();
+	size_t count = 0;
+	for (allocation_shard &sh : m_shards)
+		count += sh.allocations.size;
+	// The live allocations are sorted by their traces, so the equal ones are grouped.
+	size_t list_size = (count + 1) * sizeof(allocation *);
+	allocation **list = (allocation **)hh_mmap(list_size);
+	size_t pos = 0;
+	uint64_t total_size = 0;
+	for (allocation_shard &sh : m_shards) {
+		for (size_t i = 0; i < sh.allocations.capacity; ++i) {
+			allocation *a = sh.allocations.slots[i];
+			if (a == nullptr)
+				continue;
+			list[pos++] = a;
+			total_size += a->size;
+		}
+	}
+	std::sort(list, list + count, trace_less);
+
+	// The legacy heap profile format of gperftools. pprof reads it and resolves the
+	// addresses using the mappings in the end. With the sampling the values are
+	// scaled up by pprof itself, knowing the interval.
+	if (m_sample_interval == 0)
+		fprintf(f, "heap profile: %llu: %llu [%llu: %llu] @ heapprofile\n",
+			(long long)count, (long long)total_size,
+			(long long)count, (long long)total_size);
+	else
+		fprintf(f, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n",
+			(long long)count, (long long)total_size,
+			(long long)count, (long long)total_size,
+			(long long)m_sample_interval);
+	for (size_t begin = 0, end; begin < count; begin = end) {
+		uint64_t site_size = 0;
+		for (end = begin; end < count && trace_equal(list[begin], list[end]); ++end)
+			site_size += list[end]->size;
+		// The freed allocations are not kept, so the totals are the same as the
+		// live ones.
+		fprintf(f, "%llu: %llu [%llu: %llu] @", (long long)(end - begin),
+			(long long)site_size, (long long)(end - begin),
+			(long long)site_size);
+		const allocation *a = list[begin];
+		for (int i = 0; i < a->trace_size; ++i)
+			fprintf(f, " %p", a->trace[i]);
+		fprintf(f, "\n");
+	}
+	for (allocation_shard &sh : m_shards)
+		sh.mutex.unlock();
+	munmap(list, list_size);
+
+	fprintf(f, "\nMAPPED_LIBRARIES:\n");
+	FILE *maps = fopen("/proc/self/maps", "r");
+	if (maps != nullptr) {
+		char buf[4096];
+		size_t size;
+		while ((size = fread(buf, 1, sizeof(buf), maps)) > 0)
+			fwrite(buf, 1, size, f);
+		fclose(maps);
+	}
+	bool ok = ferror(f) == 0;
+	if (fclose(f) != 0 || !ok)
+		return -1;
+	return 0;
+}
+
+void
+heap_help::get_stats(heaph_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	uint64_t free_count = m_free_count.load(std::memory_order_relaxed);
+	stats->alloc_count = m_alloc_count.load(std::memory_order_relaxed);
+	stats->free_count = free_count;
+	stats->uptime_usec = monotonic_usec() - m_start_usec;
+
+	std::lock_guard<adaptive_mutex> lock(m_thread_mutex);
+	heaph_thread_stats &other = stats->other_threads;
+	other.alloc_count = m_exited_threads.alloc_count.load();
+	other.free_count = m_exited_threads.free_count.load();
+	other.alloc_size = m_exited_threads.alloc_size.load();
+	stats->alloc_size = other.alloc_size;
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		stats->size_class_alloc_count[i] =
+			m_exited_threads.size_class_alloc_count[i].load();
+		stats->size_class_free_count[i] =
+			m_exited_threads.size_class_free_count[i].load();
+	}
+	for (thread_stats *st = m_threads; st != nullptr; st = st->next) {
+		if (!st->is_used)
+			continue;
+		heaph_thread_stats t;
+		t.tid = st->tid;
+		t.alloc_count = st->alloc_count.load(std::memory_order_relaxed);
+		t.free_count = st->free_count.load(std::memory_order_relaxed);
+		t.alloc_size = st->alloc_size.load(std::memory_order_relaxed);
+		stats->alloc_size += t.alloc_size;
+		for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+			stats->size_class_alloc_count[i] += st->size_class_alloc_count[i].load(
+				std::memory_order_relaxed);
+			stats->size_class_free_count[i] += st->size_class_free_count[i].load(
+				std::memory_order_relaxed);
+		}
+		if (stats->thread_count < HEAPH_STATS_THREAD_MAX) {
+			stats->threads[stats->thread_count++] = t;
+			continue;
+		}
+		other.alloc_count += t.alloc_count;
+		other.free_count += t.free_count;
+		other.alloc_size += t.alloc_size;
+	}
+	if (stats->uptime_usec != 0) {
+		stats->alloc_size_per_sec =
+			stats->alloc_size * 1000000.0 / stats->uptime_usec;
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 static heap_help glob_hh;
+
+thread_stats_owner::~thread_stats_owner()
+{
+	glob_hh.release_thread_stats();
+}
+}
+
+uint64_t
+heaph_get_alloc_count(void)
+{
+	return glob_hh.get_alloc_count();
+}
+
+uint64_t
+heaph_get_total_alloc_count(void)
+{
+	return glob_hh.get_total_alloc_count();
+}
+
+int
+heaph_dump_profile(const char *path)
+{
+	return glob_hh.dump_profile(path);
+}
+
+void
+heaph_get_stats(struct heaph_stats *stats)
+{
+	glob_hh.get_stats(stats);
 }
 
 void *
@@ -2,5 +2,64 @@
 
 #include <stdint.h>
 
+/** Number of the allocations not freed yet. */
 uint64_t
 heaph_get_alloc_count(void);
+
+/** Number of all the allocations done since the start, freed or not. */
+uint64_t
+heaph_get_total_alloc_count(void);
+
+/**
+ * Write the live allocations grouped by their stack traces into the file, in the heap
+ * profile format of gperftools. View it with `pprof --text ./my_app <path>`, or make a
+ * flame graph with `pprof --collapsed`. Returns 0 on success, -1 on error.
+ */
+int
+heaph_dump_profile(const char *path);
+
+enum {
+	/**
+	 * The allocations are counted by size classes, powers of 2 of their usable size.
+	 * The first class is up to 16 bytes, the next one up to 32, and so on. The last
+	 * one has all the bigger sizes too.
+	 */
+	HEAPH_SIZE_CLASS_MIN = 16,
+	HEAPH_SIZE_CLASS_COUNT = 16,
+	HEAPH_STATS_THREAD_MAX = 64,
+};
+
+struct heaph_thread_stats {
+	/** Kernel thread ID. */
+	int tid;
+	uint64_t alloc_count;
+	/** Frees done by this thread, of the memory allocated by any thread. */
+	uint64_t free_count;
+	/** Sum of the requested sizes. */
+	uint64_t alloc_size;
+};
+
+struct heaph_stats {
+	uint64_t alloc_count;
+	uint64_t free_count;
+	uint64_t alloc_size;
+	/** Time since the start of the process. */
+	uint64_t uptime_usec;
+	/** Average since the start. Diff two stats for the rate of a certain period. */
+	double alloc_size_per_sec;
+	uint64_t size_class_alloc_count[HEAPH_SIZE_CLASS_COUNT];
+	uint64_t size_class_free_count[HEAPH_SIZE_CLASS_COUNT];
+	/** The alive threads which allocated or freed anything. */
+	int thread_count;
+	struct heaph_thread_stats threads[HEAPH_STATS_THREAD_MAX];
+	/** The exited threads together, and the ones not fitting into the array. */
+	struct heaph_thread_stats other_threads;
+};
+
+/**
+ * Counters of all the allocations and frees, traced or not. They are exact also with
+ * the sampling. The total counts can be a bit ahead of the per-class ones when the
+ * other threads allocate at the same time.
+ */
+void
+heaph_get_stats(struct heaph_stats *stats);
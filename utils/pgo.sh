@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Release build of a homework optimized by the profiles of its benchmarks.
+# Run from the homework directory, each benchmark is a target with its
+# arguments:
+#
+#     ../utils/pgo.sh build_pgo bench_userfs
+#     ../utils/pgo.sh build_pgo "bench_chat -d 3"
+#
+# The first build is instrumented, the benchmarks run in it and leave the
+# profiles, then the same directory is rebuilt with them. Clang's raw profiles
+# are merged with llvm-profdata, GCC reads its own as they are. See
+# build_type.cmake.
+
+set -e
+
+if [ $# -lt 2 ]; then
+	echo "Usage: pgo.sh <build dir> <benchmark> [<benchmark> ...]"
+	exit 1
+fi
+build=$1
+shift
+pgo_dir=$(realpath -m "$build")/pgo
+
+cmake -S . -B "$build" -DCMAKE_BUILD_TYPE=Release -DPGO=GENERATE \
+	-DPGO_DIR="$pgo_dir"
+cmake --build "$build" -j"$(nproc)" --clean-first
+rm -rf "$pgo_dir"
+for bench in "$@"; do
+	echo "Training on $bench"
+	# The arguments are split on purpose
+	$build/$bench > /dev/null
+done
+if ls "$pgo_dir"/*.profraw > /dev/null 2>&1; then
+	llvm-profdata merge -o "$pgo_dir/default.profdata" "$pgo_dir"/*.profraw
+fi
+
+cmake -S . -B "$build" -DPGO=USE
+cmake --build "$build" -j"$(nproc)" --clean-first
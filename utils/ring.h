@@ -0,0 +1,314 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/**
+ * Bounded ring queues for passing values between threads. The capacity is a power of 2.
+ * None of them locks or allocates after the creation. A push into a full ring and a pop
+ * from an empty one return at once with nothing done.
+ *
+ *     ring<task *, RING_MPMC> queue(1024);
+ *     queue.push(t);
+ *     task *t2;
+ *     if (queue.pop(t2))
+ *         ...
+ *
+ * The batch versions push_n() and pop_n() copy in or move out up to the given count of
+ * values with one update of the shared position, and return how many were done.
+ */
+
+enum
+{
+	RING_CACHE_LINE_SIZE = 64,
+};
+
+enum ring_mode
+{
+	// One producer thread, one consumer thread.
+	RING_SPSC,
+	// Any producers, one consumer thread.
+	RING_MPSC,
+	// Any producers, any consumers.
+	RING_MPMC,
+};
+
+template<typename T, ring_mode Mode>
+class ring;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Each end is owned by one thread. It keeps a copy of the other end's position and reads
+ * the shared one only when the copy says the ring is full or empty.
+ */
+template<typename T>
+class ring<T, RING_SPSC>
+{
+public:
+	explicit ring(
+		std::size_t capacity)
+		: m_mask(capacity - 1)
+		, m_cells(new T[capacity])
+	{
+		assert(capacity != 0 && (capacity & m_mask) == 0);
+	}
+
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	std::size_t
+	capacity() const { return m_mask + 1; }
+
+	// Exact only when called by one of the ends.
+	std::size_t
+	size() const
+	{
+		std::size_t head = m_head.load(std::memory_order_acquire);
+		return m_tail.load(std::memory_order_acquire) - head;
+	}
+
+	// Whether a push or a pop would do something now. For waiting on the other end.
+	bool
+	can_push() const
+	{
+		std::size_t head = m_head.load(std::memory_order_acquire);
+		return m_tail.load(std::memory_order_acquire) - head < capacity();
+	}
+
+	bool
+	can_pop() const
+	{
+		std::size_t head = m_head.load(std::memory_order_acquire);
+		return m_tail.load(std::memory_order_acquire) != head;
+	}
+
+	bool
+	push(const T &value) { return push_n(&value, 1) == 1; }
+
+	std::size_t
+	push_n(
+		const T *values,
+		std::size_t count)
+	{
+		std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		std::size_t free_count = capacity() - (tail - m_head_cache);
+		if (free_count < count)
+		{
+			m_head_cache = m_head.load(std::memory_order_acquire);
+			free_count = capacity() - (tail - m_head_cache);
+		}
+		if (count > free_count)
+			count = free_count;
+		for (std::size_t i = 0; i < count; ++i)
+			m_cells[(tail + i) & m_mask] = values[i];
+		m_tail.store(tail + count, std::memory_order_release);
+		return count;
+	}
+
+	bool
+	pop(T &value) { return pop_n(&value, 1) == 1; }
+
+	std::size_t
+	pop_n(
+		T *values,
+		std::size_t count)
+	{
+		std::size_t head = m_head.load(std::memory_order_relaxed);
+		std::size_t used_count = m_tail_cache - head;
+		if (used_count < count)
+		{
+			m_tail_cache = m_tail.load(std::memory_order_acquire);
+			used_count = m_tail_cache - head;
+		}
+		if (count > used_count)
+			count = used_count;
+		for (std::size_t i = 0; i < count; ++i)
+			values[i] = std::move(m_cells[(head + i) & m_mask]);
+		m_head.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+private:
+	const std::size_t m_mask;
+	const std::unique_ptr<T[]> m_cells;
+	// The ends are changed by different threads, keep them on different cache lines.
+	alignas(RING_CACHE_LINE_SIZE) std::atomic<std::size_t> m_tail{0};
+	std::size_t m_head_cache = 0;
+	alignas(RING_CACHE_LINE_SIZE) std::atomic<std::size_t> m_head{0};
+	std::size_t m_tail_cache = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * D. Vyukov's ring. Each cell has a sequence number telling whose turn it is: the
+ * producer of the position when it equals the position, the consumer when it is one
+ * more. The producers claim the positions with a CAS. So do the consumers, unless there
+ * is just one.
+ */
+template<typename T, ring_mode Mode>
+class ring
+{
+	static_assert(Mode == RING_MPSC || Mode == RING_MPMC);
+
+public:
+	explicit ring(
+		std::size_t capacity)
+		: m_mask(capacity - 1)
+		, m_cells(new cell[capacity])
+	{
+		assert(capacity != 0 && (capacity & m_mask) == 0);
+		for (std::size_t i = 0; i < capacity; ++i)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	std::size_t
+	capacity() const { return m_mask + 1; }
+
+	// Approximate when the others push or pop at the same time.
+	std::size_t
+	size() const
+	{
+		std::size_t head = m_head.load(std::memory_order_acquire);
+		std::size_t tail = m_tail.load(std::memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	// Whether a push or a pop would do something now. For waiting on the other end.
+	bool
+	can_push() const
+	{
+		std::size_t pos = m_tail.load(std::memory_order_relaxed);
+		return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) == pos;
+	}
+
+	bool
+	can_pop() const
+	{
+		std::size_t pos = m_head.load(std::memory_order_relaxed);
+		return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) ==
+			pos + 1;
+	}
+
+	bool
+	push(const T &value) { return push_n(&value, 1) == 1; }
+
+	std::size_t
+	push_n(
+		const T *values,
+		std::size_t count)
+	{
+		std::size_t pos = m_tail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			std::intptr_t diff = 0;
+			std::size_t n = ready_count(pos, count, 0, diff);
+			if (n == 0)
+			{
+				// Full, or the first cell is not consumed yet.
+				if (diff < 0)
+					return 0;
+				pos = m_tail.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (!m_tail.compare_exchange_weak(pos, pos + n,
+				std::memory_order_relaxed))
+				continue;
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				cell &c = m_cells[(pos + i) & m_mask];
+				c.value = values[i];
+				c.sequence.store(pos + i + 1, std::memory_order_release);
+			}
+			return n;
+		}
+	}
+
+	bool
+	pop(T &value) { return pop_n(&value, 1) == 1; }
+
+	// Stops at a value still being pushed, even if the later ones are ready.
+	std::size_t
+	pop_n(
+		T *values,
+		std::size_t count)
+	{
+		std::size_t pos = m_head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			std::intptr_t diff = 0;
+			std::size_t n = ready_count(pos, count, 1, diff);
+			if (n == 0)
+			{
+				if (Mode == RING_MPSC || diff < 0)
+					return 0;
+				pos = m_head.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (Mode == RING_MPSC)
+				m_head.store(pos + n, std::memory_order_relaxed);
+			else if (!m_head.compare_exchange_weak(pos, pos + n,
+				std::memory_order_relaxed))
+				continue;
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				cell &c = m_cells[(pos + i) & m_mask];
+				values[i] = std::move(c.value);
+				c.sequence.store(pos + i + m_mask + 1, std::memory_order_release);
+			}
+			return n;
+		}
+	}
+
+private:
+	struct cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	// How many cells in a row starting at the position have their sequence equal to the
+	// position plus the shift, up to the count. The difference of the first cell not
+	// matching is saved.
+	std::size_t
+	ready_count(
+		std::size_t pos,
+		std::size_t count,
+		std::size_t shift,
+		std::intptr_t &diff) const
+	{
+		std::size_t n = 0;
+		for (; n < count; ++n)
+		{
+			std::size_t seq = m_cells[(pos + n) & m_mask].sequence.load(
+				std::memory_order_acquire);
+			diff = (std::intptr_t)seq - (std::intptr_t)(pos + n + shift);
+			if (diff != 0)
+				break;
+		}
+		return n;
+	}
+
+	// Read by all, apart from the ends.
+	const std::size_t m_mask;
+	const std::unique_ptr<cell[]> m_cells;
+	alignas(RING_CACHE_LINE_SIZE) std::atomic<std::size_t> m_tail{0};
+	alignas(RING_CACHE_LINE_SIZE) std::atomic<std::size_t> m_head{0};
+};
+
+template<typename T>
+using spsc_ring = ring<T, RING_SPSC>;
+
+template<typename T>
+using mpsc_ring = ring<T, RING_MPSC>;
+
+template<typename T>
+using mpmc_ring = ring<T, RING_MPMC>;
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+
+#include "rlist.h"
+
+/**
+ * Typed view of an rlist with the entries of type T linked via the member Link. It
+ * doesn't own the head, so it can wrap any existing list:
+ *
+ *     for (file *f : intrusive_list<file, &file::in_file_list>(&file_list))
+ *
+ * The iteration prefetches the link after the next one, so a scan over the entries
+ * spread in memory waits for one cache miss at a time less often. In debug builds it
+ * also checks that the current entry is still linked when moving to the next one.
+ */
+template<typename T, rlist T::*Link>
+class intrusive_list
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = T *;
+		using difference_type = std::ptrdiff_t;
+		using pointer = T **;
+		using reference = T *;
+
+		iterator() = default;
+
+		explicit iterator(
+			rlist *node)
+			: m_node(node)
+		{
+			__builtin_prefetch(node->next);
+		}
+
+		T *
+		operator*() const { return intrusive_list::entry(m_node); }
+
+		iterator &
+		operator++()
+		{
+			// Removing the current entry would leave it linked to itself.
+			assert(m_node->next != m_node && m_node->next->prev == m_node);
+			m_node = m_node->next;
+			__builtin_prefetch(m_node->next);
+			return *this;
+		}
+
+		iterator
+		operator++(int)
+		{
+			iterator res = *this;
+			++*this;
+			return res;
+		}
+
+		bool
+		operator==(const iterator &other) const { return m_node == other.m_node; }
+
+		bool
+		operator!=(const iterator &other) const { return m_node != other.m_node; }
+
+	private:
+		rlist *m_node = nullptr;
+	};
+
+	// The entries are not a part of the head, so they can be changed even via a const
+	// head.
+	explicit intrusive_list(
+		const rlist *head)
+		: m_head(const_cast<rlist *>(head))
+	{
+	}
+
+	static T *
+	entry(rlist *link)
+	{
+		return reinterpret_cast<T *>(reinterpret_cast<char *>(link) - link_offset());
+	}
+
+	static rlist *
+	link(T *item) { return &(item->*Link); }
+
+	iterator
+	begin() const { return iterator(m_head->next); }
+
+	iterator
+	end() const { return iterator(m_head); }
+
+	bool
+	empty() const { return rlist_empty(m_head); }
+
+	/** @pre The list is not empty. */
+	T *
+	front() const { return entry(m_head->next); }
+
+	/** @pre The list is not empty. */
+	T *
+	back() const { return entry(m_head->prev); }
+
+	void
+	push_front(T *item) { rlist_add(m_head, link(item)); }
+
+	void
+	push_back(T *item) { rlist_add_tail(m_head, link(item)); }
+
+	/** @pre The list is not empty. */
+	T *
+	pop_front() { return entry(rlist_shift(m_head)); }
+
+	static void
+	remove(T *item) { rlist_del(link(item)); }
+
+	/**
+	 * Move up to @a count first entries of @a from to the tail of this list, keeping
+	 * their order. The cut point is found by a walk, the move itself is O(1).
+	 * Returns how many were moved.
+	 */
+	std::size_t
+	splice_n(
+		intrusive_list &from,
+		std::size_t count)
+	{
+		rlist *src = from.m_head;
+		rlist *last = src;
+		std::size_t res = 0;
+		while (res < count && last->next != src)
+		{
+			last = last->next;
+			__builtin_prefetch(last->next);
+			++res;
+		}
+		if (res == 0)
+			return 0;
+		rlist *first = src->next;
+		src->next = last->next;
+		last->next->prev = src;
+
+		first->prev = m_head->prev;
+		m_head->prev->next = first;
+		last->next = m_head;
+		m_head->prev = last;
+		return res;
+	}
+
+private:
+	static std::size_t
+	link_offset()
+	{
+		// Same as offsetof(), which doesn't take a member pointer.
+		alignas(T) static char probe[sizeof(T)];
+		T *item = reinterpret_cast<T *>(probe);
+		return reinterpret_cast<char *>(&(item->*Link)) - probe;
+	}
+
+	rlist *m_head;
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+/**
+ * One timeline of libcoro, corobus, thread_pool and chat, for the tail
+ * latencies which no single subsystem's stats explain. Each thread writes
+ * timestamped events into its own ring, without locks or atomics besides
+ * one release store, and the rings are dumped together in the Chrome trace
+ * format, which chrome://tracing and ui.perfetto.dev both open:
+ *
+ *     TRACE_BEGIN("task", task);
+ *     ...
+ *     TRACE_END("task");
+ *     TRACE_INSTANT("epoll wakeup", count);
+ *
+ * The argument is a number or a pointer. The names must be string
+ * literals, only the pointers are stored. The macros are nothing unless
+ * TRACE_ENABLED is 1, the ENABLE_TRACE option of build_type.cmake. Then the
+ * program dumps the trace at exit into the file of the TRACE_FILE
+ * environment variable, if it is set, and can call trace_dump_file() any
+ * time before.
+ *
+ * A ring keeps the last TRACE_RING_SIZE events of its thread. It is
+ * mmap()ed, so only the pages which were written take memory, and heap_help
+ * doesn't see it. The rings outlive their threads, for the dump. A dump
+ * while the threads run skips the events being overwritten during it.
+ */
+
+#if TRACE_ENABLED
+
+#include "clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum {
+	/** Events kept per thread, a power of 2. */
+	TRACE_RING_SIZE = 64 * 1024,
+	TRACE_THREAD_NAME_SIZE = 16,
+};
+
+/** The phases of the Chrome trace format. */
+enum trace_phase {
+	TRACE_PHASE_BEGIN = 'B',
+	TRACE_PHASE_END = 'E',
+	TRACE_PHASE_INSTANT = 'i',
+};
+
+struct trace_event {
+	uint64_t ns;
+	const char *name;
+	uint64_t arg;
+	int phase;
+};
+
+struct trace_ring {
+	/** All the rings, newest first. */
+	struct trace_ring *next;
+	int tid;
+	char thread_name[TRACE_THREAD_NAME_SIZE];
+	/** Events ever written. Only the owner thread changes it. */
+	uint64_t count;
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+struct trace_global {
+	struct trace_ring *rings;
+	int is_exit_dump_set;
+};
+
+/**
+ * Same as the fast clock, one for the whole program, the weak definitions
+ * of all the files are merged into one.
+ */
+__attribute__((weak)) struct trace_global trace_global;
+__attribute__((weak)) __thread struct trace_ring *trace_thread_ring;
+
+static inline int
+trace_dump(FILE *out)
+{
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	const char *sep = "";
+	int pid = getpid();
+	struct trace_ring *ring =
+		__atomic_load_n(&trace_global.rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next) {
+		fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			sep, pid, ring->tid, ring->thread_name);
+		sep = ",\n";
+		uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+		uint64_t i = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+		for (; i < count; ++i) {
+			struct trace_event e = ring->events[i % TRACE_RING_SIZE];
+			/*
+			 * The owner might have lapped the reader. The slot
+			 * of the event being written is not valid either.
+			 */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			uint64_t now = __atomic_load_n(&ring->count,
+						       __ATOMIC_RELAXED);
+			if (now >= i + TRACE_RING_SIZE)
+				continue;
+			fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%.3f,\"pid\":%d,\"tid\":%d", sep,
+				e.name, e.phase, e.ns / 1000.0, pid, ring->tid);
+			if (e.phase == TRACE_PHASE_INSTANT)
+				fprintf(out, ",\"s\":\"t\"");
+			if (e.phase != TRACE_PHASE_END)
+				fprintf(out, ",\"args\":{\"arg\":%llu}",
+					(unsigned long long)e.arg);
+			fprintf(out, "}");
+		}
+	}
+	fprintf(out, "\n]}\n");
+	return ferror(out) ? -1 : 0;
+}
+
+static inline int
+trace_dump_file(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+	int rc = trace_dump(out);
+	if (fclose(out) != 0)
+		rc = -1;
+	return rc;
+}
+
+static inline void
+trace_dump_at_exit(void)
+{
+	const char *path = getenv("TRACE_FILE");
+	if (path != NULL && trace_dump_file(path) != 0)
+		fprintf(stderr, "Couldn't dump the trace into %s\n", path);
+}
+
+/** The first event of a thread. NULL if there is no memory. */
+static inline struct trace_ring *
+trace_ring_new(void)
+{
+	void *mem = mmap(NULL, sizeof(struct trace_ring),
+			 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			 -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	struct trace_ring *ring = (struct trace_ring *)mem;
+	ring->tid = (int)syscall(SYS_gettid);
+	if (prctl(PR_GET_NAME, ring->thread_name, 0, 0, 0) != 0)
+		strcpy(ring->thread_name, "thread");
+	ring->thread_name[TRACE_THREAD_NAME_SIZE - 1] = 0;
+	ring->next = __atomic_load_n(&trace_global.rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_global.rings, &ring->next,
+					    ring, true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED));
+	if (__atomic_exchange_n(&trace_global.is_exit_dump_set, 1,
+				__ATOMIC_RELAXED) == 0)
+		atexit(trace_dump_at_exit);
+	trace_thread_ring = ring;
+	return ring;
+}
+
+static inline void
+trace_event(int phase, const char *name, uint64_t arg)
+{
+	struct trace_ring *ring = trace_thread_ring;
+	if (ring == NULL && (ring = trace_ring_new()) == NULL)
+		return;
+	uint64_t count = ring->count;
+	struct trace_event *e = &ring->events[count % TRACE_RING_SIZE];
+	e->ns = clock_fast_ns();
+	e->name = name;
+	e->arg = arg;
+	e->phase = phase;
+	__atomic_store_n(&ring->count, count + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_BEGIN(name, arg) \
+	trace_event(TRACE_PHASE_BEGIN, name, (uint64_t)(arg))
+#define TRACE_END(name) trace_event(TRACE_PHASE_END, name, 0)
+#define TRACE_INSTANT(name, arg) \
+	trace_event(TRACE_PHASE_INSTANT, name, (uint64_t)(arg))
+
+#else /* !TRACE_ENABLED */
+
+#define TRACE_BEGIN(name, arg) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_INSTANT(name, arg) do {} while (0)
+
+#endif /* !TRACE_ENABLED */
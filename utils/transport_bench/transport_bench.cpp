@@ -0,0 +1,551 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "bench.h"
+
+/**
+ * Socket throughput of the bonus task 2 (bonus/task_eng.txt), with the
+ * ways to send the data which avoid a copy or a syscall per pack:
+ *
+ * - send: plain send() of each pack;
+ * - zerocopy: send() with MSG_ZEROCOPY, the pages are pinned instead of
+ *   copied, and the completions are read from the socket error queue.
+ *   TCP only, and on loopback the kernel copies anyway, see the note it
+ *   prints;
+ * - splice: each pack goes from a file in the page cache into a pipe and
+ *   from the pipe into the socket with splice();
+ * - vmsplice: same, but the pack gets into the pipe from the user memory
+ *   with vmsplice();
+ * - mmsg: sendmmsg() and recvmmsg() of many packs at once.
+ *
+ * The receiver is a child process, it recv()s the packs in all the modes
+ * except mmsg. Both sockets are non-blocking and wait in poll(). The
+ * results are MB per second and CPU time of each side per GB sent:
+ *
+ *     transport_bench [-T unix|tcp] [-m mode] [-p pack size] [-t total MB]
+ *         [-r runs]
+ *
+ * Without -T, -m or -p all of them are tried. The packs are 512 B, 1 KB,
+ * 16 KB and 48 KB then, like the task proposes.
+ */
+
+enum {
+	TB_MMSG_BATCH = 16,
+	/* Zero-copy sends between reading their completions. */
+	TB_ZEROCOPY_REAP_PERIOD = 32,
+	TB_PIPE_SIZE = 1024 * 1024,
+};
+
+enum tb_transport {
+	TB_TRANSPORT_UNIX,
+	TB_TRANSPORT_TCP,
+	TB_TRANSPORT_COUNT,
+};
+
+enum tb_mode {
+	TB_MODE_SEND,
+	TB_MODE_ZEROCOPY,
+	TB_MODE_SPLICE,
+	TB_MODE_VMSPLICE,
+	TB_MODE_MMSG,
+	TB_MODE_COUNT,
+};
+
+static const char *const tb_transport_names[] = {"unix", "tcp"};
+static const char *const tb_mode_names[] = {
+	"send", "zerocopy", "splice", "vmsplice", "mmsg",
+};
+static const int tb_default_packs[] = {512, 1024, 16 * 1024, 48 * 1024};
+
+struct tb_options {
+	int transport = -1;
+	int mode = -1;
+	int pack = 0;
+	uint64_t total = 256 * 1024 * 1024;
+	int run_count = BENCH_RUN_COUNT;
+};
+
+struct tb_sender {
+	int fd = -1;
+	enum tb_mode mode;
+	int pack;
+	char *buf = NULL;
+	/* The pipe and the file for the splice modes. */
+	int pipe_fds[2] = {-1, -1};
+	int file_fd = -1;
+	/* Bytes in the pipe not spliced into the socket yet. */
+	size_t pipe_len = 0;
+	uint64_t zerocopy_sent = 0;
+	uint64_t zerocopy_done = 0;
+	uint64_t zerocopy_copied = 0;
+	struct mmsghdr msgs[TB_MMSG_BATCH];
+	struct iovec iovs[TB_MMSG_BATCH];
+};
+
+struct tb_sample {
+	double mb_per_sec;
+	double sender_ms_per_gb;
+	double receiver_ms_per_gb;
+};
+
+static void
+tb_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("%s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+tb_usage(void)
+{
+	printf("Usage: transport_bench [-T unix|tcp] "
+	       "[-m send|zerocopy|splice|vmsplice|mmsg] [-p pack size] "
+	       "[-t total MB] [-r runs]\n");
+	exit(-1);
+}
+
+static int
+tb_find_name(const char *const *names, int count, const char *name)
+{
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	tb_usage();
+	return -1;
+}
+
+static double
+tb_timeval_ms(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void
+tb_wait(int fd, short events)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, -1) < 0)
+		tb_check(errno == EINTR, "poll");
+}
+
+/**
+ * A connected pair made the way the task asks: listen, connect, accept.
+ * Both ends are non-blocking.
+ */
+static void
+tb_socket_pair(enum tb_transport transport, int *client_fd, int *server_fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	int family = transport == TB_TRANSPORT_UNIX ? AF_UNIX : AF_INET;
+	int listen_fd = socket(family, SOCK_STREAM, 0);
+	tb_check(listen_fd >= 0, "socket");
+	if (transport == TB_TRANSPORT_UNIX) {
+		/* Abstract name, nothing to delete afterwards. */
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		int len = snprintf(un->sun_path + 1, sizeof(un->sun_path) - 1,
+				   "transport_bench.%d", (int)getpid());
+		addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(*in);
+	}
+	tb_check(bind(listen_fd, (struct sockaddr *)&addr, addr_len) == 0,
+		 "bind");
+	tb_check(listen(listen_fd, 1) == 0, "listen");
+	/* The port is chosen by the kernel. */
+	tb_check(getsockname(listen_fd, (struct sockaddr *)&addr,
+			     &addr_len) == 0, "getsockname");
+	*client_fd = socket(family, SOCK_STREAM, 0);
+	tb_check(*client_fd >= 0, "socket");
+	tb_check(connect(*client_fd, (struct sockaddr *)&addr, addr_len) == 0,
+		 "connect");
+	*server_fd = accept(listen_fd, NULL, NULL);
+	tb_check(*server_fd >= 0, "accept");
+	close(listen_fd);
+	tb_check(fcntl(*client_fd, F_SETFL, O_NONBLOCK) == 0, "fcntl");
+	tb_check(fcntl(*server_fd, F_SETFL, O_NONBLOCK) == 0, "fcntl");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** Read the zero-copy completions. The kernel merges them into ranges. */
+static void
+tb_zerocopy_reap(struct tb_sender *s)
+{
+	char control[128];
+	while (true) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0)
+			return;
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+		     c = CMSG_NXTHDR(&msg, c)) {
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(c), sizeof(err));
+			if (err.ee_errno != 0 ||
+			    err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			uint64_t count = (uint32_t)(err.ee_data - err.ee_info) + 1;
+			s->zerocopy_done += count;
+			if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0)
+				s->zerocopy_copied += count;
+		}
+	}
+}
+
+static bool
+tb_sender_create(struct tb_sender *s, int fd, enum tb_mode mode, int pack)
+{
+	s->fd = fd;
+	s->mode = mode;
+	s->pack = pack;
+	s->buf = (char *)malloc(pack);
+	tb_check(s->buf != NULL, "malloc");
+	memset(s->buf, 'x', pack);
+	if (mode == TB_MODE_ZEROCOPY) {
+		int value = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &value,
+			       sizeof(value)) != 0)
+			return false;
+	}
+	if (mode == TB_MODE_SPLICE || mode == TB_MODE_VMSPLICE) {
+		tb_check(pipe(s->pipe_fds) == 0, "pipe");
+		/* Not fatal, the default 64 KB fit any pack up to that. */
+		fcntl(s->pipe_fds[1], F_SETPIPE_SZ, TB_PIPE_SIZE);
+	}
+	if (mode == TB_MODE_SPLICE) {
+		s->file_fd = memfd_create("transport_bench", 0);
+		tb_check(s->file_fd >= 0, "memfd_create");
+		tb_check(write(s->file_fd, s->buf, pack) == pack, "write");
+	}
+	return true;
+}
+
+static void
+tb_sender_destroy(struct tb_sender *s)
+{
+	if (s->pipe_fds[0] >= 0) {
+		close(s->pipe_fds[0]);
+		close(s->pipe_fds[1]);
+	}
+	if (s->file_fd >= 0)
+		close(s->file_fd);
+	free(s->buf);
+}
+
+/**
+ * Send the next pack or its rest, at most the given size. Returns the sent
+ * size, or -1 with errno like send().
+ */
+static ssize_t
+tb_sender_step(struct tb_sender *s, uint64_t left)
+{
+	size_t size = left < (uint64_t)s->pack ? left : s->pack;
+	switch (s->mode) {
+	case TB_MODE_SEND:
+		return send(s->fd, s->buf, size, MSG_NOSIGNAL);
+	case TB_MODE_ZEROCOPY: {
+		ssize_t rc = send(s->fd, s->buf, size,
+				  MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (rc > 0 && ++s->zerocopy_sent % TB_ZEROCOPY_REAP_PERIOD == 0)
+			tb_zerocopy_reap(s);
+		return rc;
+	}
+	case TB_MODE_SPLICE:
+	case TB_MODE_VMSPLICE: {
+		if (s->pipe_len == 0) {
+			ssize_t rc;
+			if (s->mode == TB_MODE_SPLICE) {
+				loff_t offset = 0;
+				rc = splice(s->file_fd, &offset, s->pipe_fds[1],
+					    NULL, size, SPLICE_F_MOVE);
+			} else {
+				/*
+				 * The pipe refers to the buffer pages, which
+				 * is fine while they are not changed.
+				 */
+				struct iovec iov = {s->buf, size};
+				rc = vmsplice(s->pipe_fds[1], &iov, 1, 0);
+			}
+			tb_check(rc > 0, "fill pipe");
+			s->pipe_len = rc;
+		}
+		ssize_t rc = splice(s->pipe_fds[0], NULL, s->fd, NULL,
+				    s->pipe_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (rc > 0)
+			s->pipe_len -= rc;
+		return rc;
+	}
+	case TB_MODE_MMSG: {
+		int count = 0;
+		for (uint64_t batch = 0; count < TB_MMSG_BATCH && batch < left;
+		     ++count) {
+			size_t msg_size = left - batch < (uint64_t)s->pack ?
+					  left - batch : s->pack;
+			s->iovs[count].iov_base = s->buf;
+			s->iovs[count].iov_len = msg_size;
+			memset(&s->msgs[count], 0, sizeof(s->msgs[count]));
+			s->msgs[count].msg_hdr.msg_iov = &s->iovs[count];
+			s->msgs[count].msg_hdr.msg_iovlen = 1;
+			batch += msg_size;
+		}
+		int rc = sendmmsg(s->fd, s->msgs, count, MSG_NOSIGNAL);
+		if (rc < 0)
+			return -1;
+		ssize_t sent = 0;
+		for (int i = 0; i < rc; ++i)
+			sent += s->msgs[i].msg_len;
+		return sent;
+	}
+	default:
+		abort();
+	}
+}
+
+static void
+tb_send_all(struct tb_sender *s, uint64_t total)
+{
+	uint64_t sent = 0;
+	while (sent < total) {
+		ssize_t rc = tb_sender_step(s, total - sent);
+		if (rc > 0) {
+			sent += rc;
+			continue;
+		}
+		tb_check(rc < 0, "send");
+		if (errno == EINTR)
+			continue;
+		if (errno == ENOBUFS && s->mode == TB_MODE_ZEROCOPY) {
+			/* Too many pinned pages, wait for the completions. */
+			tb_wait(s->fd, 0);
+			tb_zerocopy_reap(s);
+			continue;
+		}
+		tb_check(errno == EAGAIN || errno == EWOULDBLOCK, "send");
+		tb_wait(s->fd, POLLOUT);
+		/* The completions wake the poll too, and must be read then. */
+		if (s->mode == TB_MODE_ZEROCOPY)
+			tb_zerocopy_reap(s);
+	}
+	if (s->mode == TB_MODE_ZEROCOPY) {
+		tb_zerocopy_reap(s);
+		while (s->zerocopy_done < s->zerocopy_sent) {
+			tb_wait(s->fd, 0);
+			tb_zerocopy_reap(s);
+		}
+	}
+}
+
+static void
+tb_receive_all(int fd, enum tb_mode mode, int pack, uint64_t total)
+{
+	std::vector<char> buf((size_t)pack * TB_MMSG_BATCH);
+	struct mmsghdr msgs[TB_MMSG_BATCH];
+	struct iovec iovs[TB_MMSG_BATCH];
+	for (int i = 0; i < TB_MMSG_BATCH; ++i) {
+		iovs[i].iov_base = buf.data() + (size_t)i * pack;
+		iovs[i].iov_len = pack;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	uint64_t received = 0;
+	while (received < total) {
+		ssize_t size;
+		if (mode == TB_MODE_MMSG) {
+			int rc = recvmmsg(fd, msgs, TB_MMSG_BATCH, MSG_WAITFORONE,
+					  NULL);
+			size = rc;
+			if (rc > 0) {
+				size = 0;
+				for (int i = 0; i < rc; ++i)
+					size += msgs[i].msg_len;
+			}
+		} else {
+			size = recv(fd, buf.data(), pack, 0);
+		}
+		if (size > 0) {
+			received += size;
+			continue;
+		}
+		tb_check(size < 0, "recv, unexpected EOF");
+		if (errno == EINTR)
+			continue;
+		tb_check(errno == EAGAIN || errno == EWOULDBLOCK, "recv");
+		tb_wait(fd, POLLIN);
+	}
+}
+
+/**
+ * One transfer of the total size. Returns false if the mode is not
+ * supported by the transport.
+ */
+static bool
+tb_run(const struct tb_options *opts, enum tb_transport transport,
+       enum tb_mode mode, int pack, struct tb_sample *sample,
+       double *copied_share)
+{
+	int client_fd;
+	int server_fd;
+	tb_socket_pair(transport, &client_fd, &server_fd);
+	struct tb_sender sender;
+	if (!tb_sender_create(&sender, client_fd, mode, pack)) {
+		tb_sender_destroy(&sender);
+		close(client_fd);
+		close(server_fd);
+		return false;
+	}
+	/* Otherwise the child would print the buffer again. */
+	fflush(stdout);
+	pid_t pid = fork();
+	tb_check(pid >= 0, "fork");
+	if (pid == 0) {
+		close(client_fd);
+		tb_receive_all(server_fd, mode, pack, opts->total);
+		_exit(0);
+	}
+	close(server_fd);
+
+	struct rusage usage_start;
+	getrusage(RUSAGE_SELF, &usage_start);
+	uint64_t start = bench_clock_ns();
+	tb_send_all(&sender, opts->total);
+	int status;
+	struct rusage receiver_usage;
+	tb_check(wait4(pid, &status, 0, &receiver_usage) == pid, "wait4");
+	uint64_t duration = bench_clock_ns() - start;
+	struct rusage usage_end;
+	getrusage(RUSAGE_SELF, &usage_end);
+	tb_check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "receiver");
+
+	double gb = (double)opts->total / (1024 * 1024 * 1024);
+	double sender_ms = tb_timeval_ms(&usage_end.ru_utime) -
+			   tb_timeval_ms(&usage_start.ru_utime) +
+			   tb_timeval_ms(&usage_end.ru_stime) -
+			   tb_timeval_ms(&usage_start.ru_stime);
+	double receiver_ms = tb_timeval_ms(&receiver_usage.ru_utime) +
+			     tb_timeval_ms(&receiver_usage.ru_stime);
+	sample->mb_per_sec = (double)opts->total / (1024 * 1024) /
+			     (duration / 1000000000.0);
+	sample->sender_ms_per_gb = sender_ms / gb;
+	sample->receiver_ms_per_gb = receiver_ms / gb;
+	*copied_share = sender.zerocopy_sent == 0 ? 0 :
+			(double)sender.zerocopy_copied / sender.zerocopy_sent;
+	tb_sender_destroy(&sender);
+	close(client_fd);
+	return true;
+}
+
+static void
+tb_bench(const struct tb_options *opts, enum tb_transport transport,
+	 enum tb_mode mode, int pack)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "%s, %d B packs, %s",
+		 tb_transport_names[transport], pack, tb_mode_names[mode]);
+	std::vector<double> speeds;
+	std::vector<double> sender_cpu;
+	std::vector<double> receiver_cpu;
+	double copied_share = 0;
+	for (int i = 0; i < opts->run_count; ++i) {
+		struct tb_sample sample;
+		if (!tb_run(opts, transport, mode, pack, &sample,
+			    &copied_share)) {
+			printf("%s: not supported: %s\n", name, strerror(errno));
+			return;
+		}
+		speeds.push_back(sample.mb_per_sec);
+		sender_cpu.push_back(sample.sender_ms_per_gb);
+		receiver_cpu.push_back(sample.receiver_ms_per_gb);
+	}
+	bench_report(name, "MB/s", speeds.data(), (int)speeds.size());
+	char cpu_name[160];
+	snprintf(cpu_name, sizeof(cpu_name), "%s, sender CPU", name);
+	bench_report(cpu_name, "ms per GB", sender_cpu.data(),
+		     (int)sender_cpu.size());
+	snprintf(cpu_name, sizeof(cpu_name), "%s, receiver CPU", name);
+	bench_report(cpu_name, "ms per GB", receiver_cpu.data(),
+		     (int)receiver_cpu.size());
+	const char *format = getenv("BENCH_FORMAT");
+	if (mode == TB_MODE_ZEROCOPY &&
+	    (format == NULL || strcmp(format, "json") != 0)) {
+		printf("    note: %.0lf%% of the zero-copy sends were copied by "
+		       "the kernel\n", copied_share * 100);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct tb_options opts;
+	int opt;
+	while ((opt = getopt(argc, argv, "T:m:p:t:r:")) != -1) {
+		switch (opt) {
+		case 'T':
+			opts.transport = tb_find_name(tb_transport_names,
+						      TB_TRANSPORT_COUNT, optarg);
+			break;
+		case 'm':
+			opts.mode = tb_find_name(tb_mode_names, TB_MODE_COUNT,
+						 optarg);
+			break;
+		case 'p': opts.pack = atoi(optarg); break;
+		case 't': opts.total = strtoull(optarg, NULL, 10) << 20; break;
+		case 'r': opts.run_count = atoi(optarg); break;
+		default: tb_usage();
+		}
+	}
+	if (optind != argc || opts.pack < 0 || opts.total == 0 ||
+	    opts.run_count < 1)
+		tb_usage();
+
+	std::vector<int> packs;
+	if (opts.pack != 0)
+		packs.push_back(opts.pack);
+	else
+		packs.assign(tb_default_packs, tb_default_packs +
+			     sizeof(tb_default_packs) / sizeof(tb_default_packs[0]));
+	printf("%llu MB in each run\n", (unsigned long long)(opts.total >> 20));
+	for (int t = 0; t < TB_TRANSPORT_COUNT; ++t) {
+		if (opts.transport >= 0 && opts.transport != t)
+			continue;
+		for (int pack : packs) {
+			for (int m = 0; m < TB_MODE_COUNT; ++m) {
+				if (opts.mode >= 0 && opts.mode != m)
+					continue;
+				tb_bench(&opts, (enum tb_transport)t,
+					 (enum tb_mode)m, pack);
+			}
+		}
+	}
+	return 0;
+}